@@ -20,6 +20,7 @@
 #include <sys/socket.h>
 #include <stdbool.h>
 #include "istgt.h"
+#include "istgt_affinity.h"
 #include "zrepl_prot.h"
 #include "istgt_integration.h"
 #include "replication.h"
@@ -33,6 +34,12 @@
 #define	WRITE_PARTIAL	1
 #define	WRITE_COMPLETED	2
 
+/* epoll data of a data connection, the low bits are its dconn index */
+#define	DCONN_EPOLL_TAG		(1ULL << 32)
+
+/* ISTGT_DCONN_LBA sends each 128K of the volume over the same connection */
+#define	DCONN_STRIPE_SHIFT	17
+
 /* default timeout is set to REPLICA_DEFAULT_TIMEOUT seconds */
 int replica_timeout = REPLICA_DEFAULT_TIMEOUT;
 
@@ -59,6 +66,11 @@ int replica_timeout = REPLICA_DEFAULT_TIMEOUT;
 	}								\
 }
 
+#define CHECK_BLOCKAGE_IN_READYQS(r) {					\
+	for (d = 0; d < (r)->ndconns; d++)				\
+		CHECK_BLOCKAGE_IN_Q(&(r)->dconn[d].readyq, next);	\
+}
+
 #define SEND_ERROR_RESPONSES(head, r, _cond, _cnt, _time_diff, _r, _w)	\
 {									\
 	_cnt = 0;							\
@@ -73,6 +85,7 @@ int replica_timeout = REPLICA_DEFAULT_TIMEOUT;
 	while (rcmd != NULL) {						\
 		next_rcmd = TAILQ_NEXT(rcmd, next);			\
 		TAILQ_REMOVE(head, rcmd, next);				\
+		istgt_twheel_cancel(&r->io_wheel, &rcmd->deadline);	\
 		idx = rcmd->idx;					\
 		rcomm_cmd = rcmd->rcommq_ptr;				\
 		_cond = rcomm_cmd->cond_var;				\
@@ -106,50 +119,74 @@ int replica_timeout = REPLICA_DEFAULT_TIMEOUT;
 			    RECEIVED_ERR;				\
 		}							\
 		free(rcmd->iov_data);					\
+		RCMD_IOV_FREE(rcmd);					\
 		free(rcmd);						\
 		rcmd = next_rcmd;					\
 		_cnt++;							\
 	}								\
 }
 
-#define	CHECK_REPLICA_TIMEOUT(_head, _diff, _ret, _exit_label, etimeout)\
-	do {								\
-		struct timespec nw;					\
-		rcmd_t *pending_cmd;					\
-		int ms;							\
-		pending_cmd = TAILQ_FIRST(_head);			\
-		if (pending_cmd != NULL) {				\
-			clock_gettime(CLOCK_MONOTONIC_RAW, &nw);		\
-			timesdiff(CLOCK_MONOTONIC_RAW,			\
-			    pending_cmd->start_time, nw, _diff);	\
-			if (_diff.tv_sec >= replica_timeout) {		\
-				REPLICA_ERRLOG("timeout happened for "	\
-				    "replica(%lu).. delay(%lu sec)\n", 	\
-				    r->zvol_guid, _diff.tv_sec); 	\
-				_ret = -1;				\
-				goto _exit_label;			\
-			} else {					\
-				ms = _diff.tv_sec * 1000;		\
-				ms += _diff.tv_nsec / 1000000;		\
-				if (ms >				\
-				    (wait_count * polling_timeout)) {	\
-					REPLICA_NOTICELOG("replica(%lu)"\
-					    " hasn't responded in last "\
-					    "%d seconds for opcode: %d"	\
-					    " with seq: %lu\n",		\
-					    r->zvol_guid, ms / 1000,	\
-					    pending_cmd->opcode,	\
-					    pending_cmd->io_seq);	\
-				}					\
-				if (ms > (wait_count * polling_timeout))\
-					wait_count =			\
-					    (ms / polling_timeout) + 1;	\
-				ms = (replica_timeout * 1000) - ms;	\
-				if (ms < etimeout)			\
-					etimeout = ms;			\
-			}						\
-		}							\
-	} while (0)
+/*
+ * Deadline of an IO owned by replica_thread.  It fires every quarter of
+ * replica_timeout, for the "hasn't responded" notice, until the IO has
+ * waited replica_timeout in total; then the replica is disconnected.
+ * The notice is logged once per quarter for the replica, for the oldest
+ * IO since deadlines expire in submit order.
+ */
+static void
+rcmd_deadline_expired(void *owner, ISTGT_TIMER *t)
+{
+	replica_t *r = owner;
+	rcmd_t *cmd = t->arg;
+	struct timespec now, diff;
+	uint64_t quarter, now_ms, ms;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	timesdiff(CLOCK_MONOTONIC_RAW, cmd->start_time, now, diff);
+	ms = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+	if (diff.tv_sec >= replica_timeout) {
+		if (!r->io_timed_out)
+			REPLICA_ERRLOG("timeout happened for replica(%lu).. "
+			    "delay(%lu sec) opcode(%d) seq(%lu)\n",
+			    r->zvol_guid, diff.tv_sec, cmd->opcode,
+			    cmd->io_seq);
+		r->io_timed_out = 1;
+		return;
+	}
+
+	quarter = (replica_timeout * 1000) / 4;
+	now_ms = istgt_twheel_now_ms();
+	if (now_ms >= r->io_notice_ms + quarter) {
+		REPLICA_NOTICELOG("replica(%lu) hasn't responded in last %lu "
+		    "seconds for opcode: %d with seq: %lu\n", r->zvol_guid,
+		    ms / 1000, cmd->opcode, cmd->io_seq);
+		r->io_notice_ms = now_ms;
+	}
+	ms = (replica_timeout * 1000) - ms;
+	if (ms > quarter)
+		ms = quarter;
+	istgt_twheel_arm(&r->io_wheel, t, now_ms + ms, rcmd_deadline_expired,
+	    cmd);
+}
+
+/*
+ * add an unblocked command to the readyq of one of replica's data
+ * connections
+ */
+static void
+move_to_dconn_ready_q(replica_t *r, rcmd_t *cmd)
+{
+	uint32_t d = 0;
+
+	if (r->ndconns > 1) {
+		if (r->spec->replica_dconn_policy == ISTGT_DCONN_RR)
+			d = r->dconn_next++ % r->ndconns;
+		else
+			d = (cmd->offset >> DCONN_STRIPE_SHIFT) % r->ndconns;
+	}
+	TAILQ_INSERT_TAIL(&r->dconn[d].readyq, cmd, next);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &cmd->ready_time);
+}
 
 /*
  * check replica's blocked command queue.
@@ -161,20 +198,19 @@ unblock_cmds(replica_t *r)
 	bool cmd_blocked = false;
 	rcmd_t *pending_rcmd, *cmd, *next_cmd;
 	bool unblocked = false;
+	int d;
 
 	for (cmd = TAILQ_FIRST(&r->blockedq); cmd; cmd = next_cmd) {
 		next_cmd = TAILQ_NEXT(cmd, next);
 		cmd_blocked = false;
-		CHECK_BLOCKAGE_IN_Q(&r->readyq, next);
+		CHECK_BLOCKAGE_IN_READYQS(r);
 		if (cmd_blocked == true)
 			break;
 		CHECK_BLOCKAGE_IN_Q(&r->waitq, next);
 		if (cmd_blocked == true)
 			break;
 		TAILQ_REMOVE(&r->blockedq, cmd, next);
-		TAILQ_INSERT_TAIL(&r->readyq, cmd, next);
-
-		clock_gettime(CLOCK_MONOTONIC_RAW, &cmd->ready_time);
+		move_to_dconn_ready_q(r, cmd);
 		unblocked = true;
 	}
 	return unblocked;
@@ -188,20 +224,22 @@ move_to_blocked_or_ready_q(replica_t *r, rcmd_t *cmd)
 {
 	bool cmd_blocked = false;
 	rcmd_t *pending_rcmd;
+	int d;
 
 	clock_gettime(CLOCK_MONOTONIC_RAW, &cmd->start_time);
+	istgt_twheel_arm(&r->io_wheel, &cmd->deadline,
+	    istgt_twheel_now_ms() + (replica_timeout * 1000) / 4,
+	    rcmd_deadline_expired, cmd);
 	if (!TAILQ_EMPTY(&r->blockedq)) {
 		TAILQ_INSERT_TAIL(&r->blockedq, cmd, next);
 		goto done;
 	}
-	CHECK_BLOCKAGE_IN_Q(&r->readyq, next);
+	CHECK_BLOCKAGE_IN_READYQS(r);
 	CHECK_BLOCKAGE_IN_Q(&r->waitq, next);
 	if (cmd_blocked == true)
 		TAILQ_INSERT_TAIL(&r->blockedq, cmd, next);
-	else {
-		TAILQ_INSERT_TAIL(&r->readyq, cmd, next);
-		clock_gettime(CLOCK_MONOTONIC_RAW, &cmd->ready_time);
-	}
+	else
+		move_to_dconn_ready_q(r, cmd);
 done:
 	return;
 }
@@ -246,8 +284,8 @@ respond_with_error_for_all_outstanding_ios(replica_t *r)
 	int idx;
 	rcommon_cmd_t *rcomm_cmd;
 	pthread_cond_t *cond_var;
-	int wait_cnt, ready_cnt, blocked_cnt;
-	struct timespec wait_diff, ready_diff, blocked_diff;
+	int wait_cnt, ready_cnt, blocked_cnt, cnt, d;
+	struct timespec wait_diff, ready_diff, blocked_diff, diff;
 	uint64_t read_cnt = 0, write_cnt = 0;
 
 	ASSERT(r->data_eventfd == -1);
@@ -259,8 +297,15 @@ respond_with_error_for_all_outstanding_ios(replica_t *r)
 
 	SEND_ERROR_RESPONSES((&(r->waitq)), r, cond_var, wait_cnt, wait_diff,
 	    read_cnt, write_cnt);
-	SEND_ERROR_RESPONSES((&(r->readyq)), r, cond_var, ready_cnt,
-	    ready_diff, read_cnt, write_cnt);
+	ready_cnt = 0;
+	memset(&ready_diff, 0, sizeof (ready_diff));
+	for (d = 0; d < r->ndconns; d++) {
+		SEND_ERROR_RESPONSES((&(r->dconn[d].readyq)), r, cond_var,
+		    cnt, diff, read_cnt, write_cnt);
+		ready_cnt += cnt;
+		if (diff.tv_sec > ready_diff.tv_sec)
+			ready_diff = diff;
+	}
 	SEND_ERROR_RESPONSES((&(r->blockedq)), r, cond_var, blocked_cnt,
 	    blocked_diff, read_cnt, write_cnt);
 
@@ -280,9 +325,10 @@ respond_with_error_for_all_outstanding_ios(replica_t *r)
 static int
 handle_data_conn_error(replica_t *r)
 {
-	int fd, data_eventfd, mgmt_eventfd2, epollfd;
+	int d, data_eventfd, mgmt_eventfd2, epollfd;
 	spec_t *spec;
 	replica_t *r1 = NULL;
+	replica_dconn_t *dc;
 	int found_in_list = 0;
 
 	if (r->iofd == -1) {
@@ -347,26 +393,23 @@ handle_data_conn_error(replica_t *r)
 	MTX_UNLOCK(&spec->rq_mtx);
 
 	MTX_LOCK(&r->r_mtx);
-	(void) epoll_ctl(r->epollfd, EPOLL_CTL_DEL, r->iofd, NULL);
-
-	fd = r->iofd;
+	for (d = 0; d < r->ndconns; d++) {
+		dc = &r->dconn[d];
+		(void) epoll_ctl(r->epollfd, EPOLL_CTL_DEL, dc->fd, NULL);
+		shutdown(dc->fd, SHUT_RDWR);
+		close(dc->fd);
+		dc->fd = -1;
+		if (dc->ongoing_io_buf) {
+			free(dc->ongoing_io_buf);
+			dc->ongoing_io_buf = NULL;
+		}
+	}
 	r->iofd = -1;
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
 
 	data_eventfd = r->data_eventfd;
 	r->data_eventfd = -1;
 	close_fd(epollfd, data_eventfd);
 
-	if (r->io_resp_hdr) {
-		free(r->io_resp_hdr);
-		r->io_resp_hdr = NULL;
-	}
-	if (r->ongoing_io_buf) {
-		free(r->ongoing_io_buf);
-		r->ongoing_io_buf = NULL;
-	}
-
 	MTX_UNLOCK(&r->r_mtx);
 
 	respond_with_error_for_all_outstanding_ios(r);
@@ -416,11 +459,11 @@ find_replica_cmd(replica_t *r, uint64_t ioseq)
  * read response read on replica's data connection
  */
 static int
-read_cmd(replica_t *r)
+read_cmd(replica_t *r, replica_dconn_t *dc)
 {
-	int fd = r->iofd;
-	int state = r->io_state;
-	zvol_io_hdr_t *resp_hdr = r->io_resp_hdr;
+	int fd = dc->fd;
+	int state = dc->io_state;
+	zvol_io_hdr_t *resp_hdr = &dc->io_resp_hdr;
 	uint8_t *resp_data = NULL;
 	uint64_t reqlen;
 	ssize_t count;
@@ -428,13 +471,13 @@ read_cmd(replica_t *r)
 
 	switch(state) {
 		case READ_IO_RESP_HDR:
-			ASSERT(r->io_read < sizeof(zvol_io_hdr_t));
-			reqlen = sizeof (zvol_io_hdr_t) - (r->io_read);
+			ASSERT(dc->io_read < sizeof(zvol_io_hdr_t));
+			reqlen = sizeof (zvol_io_hdr_t) - (dc->io_read);
 			count = perform_read_write_on_fd(fd,
-			    ((uint8_t *)resp_hdr) + (r->io_read), reqlen, state);
+			    ((uint8_t *)resp_hdr) + (dc->io_read), reqlen, state);
 			if (count == -1)
 				return -1;
-			r->io_read += count;
+			dc->io_read += count;
 			if (count != (ssize_t)reqlen)
 				return READ_PARTIAL;
 
@@ -449,30 +492,30 @@ read_cmd(replica_t *r)
 			if (cmd == NULL)
 				return -1;
 
-			r->ongoing_io = cmd;
+			dc->ongoing_io = cmd;
 
-			r->io_state = READ_IO_RESP_DATA;
-			r->io_read = 0;
+			dc->io_state = READ_IO_RESP_DATA;
+			dc->io_read = 0;
 			if ((resp_hdr->len == 0) ||
 			    (resp_hdr->opcode == ZVOL_OPCODE_WRITE)) {
-				r->ongoing_io_len = 0;
-				r->ongoing_io_buf = NULL;
+				dc->ongoing_io_len = 0;
+				dc->ongoing_io_buf = NULL;
 			}
 			else {
-				r->ongoing_io_len = resp_hdr->len;
-				r->ongoing_io_buf = malloc(resp_hdr->len);
+				dc->ongoing_io_len = resp_hdr->len;
+				dc->ongoing_io_buf = malloc(resp_hdr->len);
 			}
 			/* Fall through */
 		case READ_IO_RESP_DATA:
-			reqlen = r->ongoing_io_len - (r->io_read);
-			resp_data = r->ongoing_io_buf;
+			reqlen = dc->ongoing_io_len - (dc->io_read);
+			resp_data = dc->ongoing_io_buf;
 			if (reqlen != 0) {
 				count = perform_read_write_on_fd(fd,
-				    ((uint8_t *)(resp_data)) + (r->io_read), reqlen, state);
+				    ((uint8_t *)(resp_data)) + (dc->io_read), reqlen, state);
 
 				if (count == -1)
 					return -1;
-				r->io_read += count;
+				dc->io_read += count;
 				if (count != (ssize_t)reqlen)
 					return READ_PARTIAL;
 			}
@@ -491,11 +534,18 @@ static int
 write_cmd(int fd, rcmd_t *cmd)
 {
 	ssize_t rc;
-	int err, i;
+	int err, i, first, cnt;
 
 	ASSERT(cmd->iovcnt > 0);
+	first = 0;
 start:
-	rc = writev(fd, cmd->iov, cmd->iovcnt);
+	/* a large burst can take more segments than one writev() accepts */
+	while (first < cmd->iovcnt && cmd->iov[first].iov_len == 0)
+		first++;
+	cnt = cmd->iovcnt - first;
+	if (cnt > ISTGT_IOV_MAX)
+		cnt = ISTGT_IOV_MAX;
+	rc = writev(fd, cmd->iov + first, cnt);
 	err = errno;
 	if (rc < 0) {
 		if (err == EINTR)
@@ -507,7 +557,7 @@ start:
 		return WRITE_PARTIAL;
 	}
 
-	for (i = 0; i < cmd->iovcnt; i++) {
+	for (i = first; i < cmd->iovcnt; i++) {
 		if (cmd->iov[i].iov_len != 0 && cmd->iov[i].iov_len > (size_t)rc) {
 			cmd->iov[i].iov_base = (void *)(((uint8_t *)cmd->iov[i].iov_base) + rc);
 			cmd->iov[i].iov_len -= rc;
@@ -555,18 +605,19 @@ do_drainfd(int data_eventfd)
 }
 
 static int
-handle_epoll_out_event(replica_t *r)
+handle_dconn_out_event(replica_t *r, replica_dconn_t *dc)
 {
 	rcmd_t *cmd;
 	int ret;
 
-	while ((cmd = TAILQ_FIRST(&r->readyq)) != NULL) {
-		ret = write_cmd(r->iofd, cmd);
+	while ((cmd = TAILQ_FIRST(&dc->readyq)) != NULL) {
+		ret = write_cmd(dc->fd, cmd);
 		if (ret < 0)
 			return -1;
 		if (ret == WRITE_COMPLETED) {
-			TAILQ_REMOVE(&r->readyq, cmd, next);
+			TAILQ_REMOVE(&dc->readyq, cmd, next);
 			TAILQ_INSERT_TAIL(&r->waitq, cmd, next);
+			dc->cmds_sent++;
 			continue;
 		}
 		else {
@@ -577,11 +628,22 @@ handle_epoll_out_event(replica_t *r)
 	return 0;
 }
 
+static int
+handle_epoll_out_event(replica_t *r)
+{
+	int d;
+
+	for (d = 0; d < r->ndconns; d++)
+		if (handle_dconn_out_event(r, &r->dconn[d]) == -1)
+			return -1;
+	return 0;
+}
+
 #define	ADD_TIMESPEC(var, s, d)	\
 	(var) += (uint64_t)(d.tv_sec - s.tv_sec) * (uint64_t)SEC_IN_NS + d.tv_nsec - s.tv_nsec;
 
 static int
-handle_epoll_in_event(replica_t *r)
+handle_epoll_in_event(replica_t *r, replica_dconn_t *dc)
 {
 	int ret, idx;
 	rcommon_cmd_t *rcomm_cmd;
@@ -591,31 +653,32 @@ handle_epoll_in_event(replica_t *r)
 	struct timespec now;
 
 start:
-	ret = read_cmd(r);
+	ret = read_cmd(r, dc);
 	if (ret < 0)
 		return -1;
 
 	if (ret == READ_COMPLETED) {
-		rcomm_cmd = r->ongoing_io->rcommq_ptr;
-		idx = r->ongoing_io->idx;
-		TAILQ_REMOVE(&r->waitq, r->ongoing_io, next);
+		rcomm_cmd = dc->ongoing_io->rcommq_ptr;
+		idx = dc->ongoing_io->idx;
+		TAILQ_REMOVE(&r->waitq, dc->ongoing_io, next);
+		istgt_twheel_cancel(&r->io_wheel, &dc->ongoing_io->deadline);
 		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
 
-		if (r->ongoing_io->opcode == ZVOL_OPCODE_READ) {
+		if (dc->ongoing_io->opcode == ZVOL_OPCODE_READ) {
 			ADD_TIMESPEC((r->totalread_reqtime),
-			    (r->ongoing_io->start_time), (r->ongoing_io->ready_time));
+			    (dc->ongoing_io->start_time), (dc->ongoing_io->ready_time));
 			ADD_TIMESPEC((r->totalread_resptime),
-			    (r->ongoing_io->start_time), now);
-		} else if (r->ongoing_io->opcode == ZVOL_OPCODE_WRITE) {
+			    (dc->ongoing_io->start_time), now);
+		} else if (dc->ongoing_io->opcode == ZVOL_OPCODE_WRITE) {
 			ADD_TIMESPEC((r->totalwrite_reqtime),
-			    (r->ongoing_io->start_time), (r->ongoing_io->ready_time));
+			    (dc->ongoing_io->start_time), (dc->ongoing_io->ready_time));
 			ADD_TIMESPEC((r->totalwrite_resptime),
-			    (r->ongoing_io->start_time), now);
+			    (dc->ongoing_io->start_time), now);
 		}
 		cond_var = rcomm_cmd->cond_var;
 
-		rcomm_cmd->resp_list[idx].io_resp_hdr = *(r->io_resp_hdr);
-		rcomm_cmd->resp_list[idx].data_ptr = r->ongoing_io_buf;
+		rcomm_cmd->resp_list[idx].io_resp_hdr = dc->io_resp_hdr;
+		rcomm_cmd->resp_list[idx].data_ptr = dc->ongoing_io_buf;
 
 		DECREMENT_INFLIGHT_REPLICA_IO_CNT(r, rcomm_cmd->opcode);
 
@@ -632,12 +695,13 @@ start:
 		} else
 			rcomm_cmd->resp_list[idx].status |= RECEIVED_OK;
 
-		free(r->ongoing_io->iov_data);
-		free(r->ongoing_io);
-		r->ongoing_io = NULL;
-		r->io_read = 0;
-		r->ongoing_io_buf = NULL;
-		r->io_state = READ_IO_RESP_HDR;
+		free(dc->ongoing_io->iov_data);
+		RCMD_IOV_FREE(dc->ongoing_io);
+		free(dc->ongoing_io);
+		dc->ongoing_io = NULL;
+		dc->io_read = 0;
+		dc->ongoing_io_buf = NULL;
+		dc->io_state = READ_IO_RESP_HDR;
 
 		task_completed = true;
 		goto start;
@@ -677,26 +741,60 @@ handle_mgmt_eventfd(void *arg)
 	return 0;
 }
 
+static int
+epoll_add_dconns(replica_t *r, int epollfd)
+{
+	struct epoll_event ev;
+	int d;
+
+	if (r->iofd == -1)
+		return -1;
+	for (d = 0; d < r->ndconns; d++) {
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR | EPOLLET |
+		    EPOLLRDHUP;
+		ev.data.u64 = DCONN_EPOLL_TAG | d;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, r->dconn[d].fd, &ev) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Tells the mgmt shard, in replica_hs_step, that we are up or have given
+ * up.  hs_eventfd is closed by the shard once kicked, and on giving up
+ * this is our last use of r.
+ */
+static void
+replica_thread_started(replica_t *r)
+{
+	uint64_t num = 1;
+
+	if (write(r->hs_eventfd, &num, sizeof (num)) != sizeof (num))
+		REPLICA_ERRLOG("failed to kick handshake of replica(%s:%d) "
+		    "err(%d)\n", r->ip, r->port, errno);
+}
+
 void *
 replica_thread(void *arg)
 {
 	int r_data_eventfd = -1, r_mgmt_eventfd = -1, r_epollfd = -1;
 	struct epoll_event ev, events[MAXEVENTS];
 	int i, nfds, fd, ret = 0;
-	void *ptr;
-	struct timespec diff_time, last_time, now;
+	replica_dconn_t *dc;
+	uint64_t d;
 	replica_t *r = (replica_t *)arg;
-	int polling_timeout = (replica_timeout / 4) * 1000;
-	int epoll_timeout = polling_timeout;
-	int wait_count = 1;
+	int polling_timeout, epoll_timeout;
 	pthread_t self = pthread_self();
 
 	snprintf(tinfo, sizeof tinfo, "r#%d.%lu", (int)(((uint64_t *)self)[0]), r->zvol_guid);
+	/* next to the luworkers of the volume */
+	istgt_affinity_apply(ISTGT_AFF_REPLICA, r->spec->numa_node);
 
 	r_data_eventfd = eventfd(0, EFD_NONBLOCK);
 	if (r_data_eventfd < 0) {
 		REPLICA_ERRLOG("error for replica(%s:%d) data_eventfd:%d\n",
 		    r->ip, r->port, r_data_eventfd);
+		replica_thread_started(r);
 		return NULL;
 	}
 
@@ -708,7 +806,7 @@ replica_thread(void *arg)
 	}
 
 	ev.events = EPOLLIN;
-	ev.data.fd = r_data_eventfd;
+	ev.data.u64 = r_data_eventfd;
 	if (epoll_ctl(r_epollfd, EPOLL_CTL_ADD, r_data_eventfd, &ev) == -1) {
 		REPLICA_ERRLOG("epoll error for replica(%s:%d) err(%d)\n",
 		    r->ip, r->port, errno);
@@ -722,21 +820,16 @@ replica_thread(void *arg)
 		goto initialize_error;
 	}
 
-	ev.data.fd = r_mgmt_eventfd;
+	ev.data.u64 = r_mgmt_eventfd;
 	if (epoll_ctl(r_epollfd, EPOLL_CTL_ADD, r_mgmt_eventfd, &ev) == -1) {
 		REPLICA_ERRLOG("epoll error for replica(%s:%d) err(%d)\n",
 		    r->ip, r->port, errno);
 		goto initialize_error;
 	}
 
-	ev.events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR | EPOLLET |
-	    EPOLLRDHUP;
-	ev.data.ptr = NULL;
-
 	MTX_LOCK(&r->r_mtx);
 
-	if ((r->iofd == -1) ||
-	    (epoll_ctl(r_epollfd, EPOLL_CTL_ADD, r->iofd, &ev) == -1)) {
+	if (epoll_add_dconns(r, r_epollfd) == -1) {
 		MTX_UNLOCK(&r->r_mtx);
 		REPLICA_ERRLOG("epoll error for replica(%s:%d) err(%d)\n",
 		    r->ip, r->port, errno);
@@ -761,19 +854,30 @@ initialize_error:
 			close(r_data_eventfd);
 			r->data_eventfd = -1;
 		}
+		replica_thread_started(r);
 		return NULL;
 	}
 
 	r->data_eventfd = r_data_eventfd;
 	r->epollfd = r_epollfd;
 	r->mgmt_eventfd2 = r_mgmt_eventfd;
+	/* update_replica_entry goes on from it */
+	replica_thread_started(r);
 
 	MTX_UNLOCK(&r->r_mtx);
 
 	prctl(PR_SET_NAME, "replica", 0, 0, 0);
-	clock_gettime(CLOCK_MONOTONIC_RAW, &last_time);
 
 	while (1) {
+		/*
+		 * Sleep until the next IO deadline on io_wheel, or at most
+		 * a quarter of replica_timeout when nothing is outstanding.
+		 */
+		polling_timeout = (replica_timeout / 4) * 1000;
+		epoll_timeout = istgt_twheel_timeout(&r->io_wheel,
+		    istgt_twheel_now_ms());
+		if (epoll_timeout < 0 || epoll_timeout > polling_timeout)
+			epoll_timeout = polling_timeout;
 		nfds = epoll_wait(r_epollfd, events, MAXEVENTS, epoll_timeout);
 		if (nfds == -1) {
 			if (errno == EINTR)
@@ -792,7 +896,8 @@ initialize_error:
 
 		for (i = 0; i < nfds; i++) {
 			fd = events[i].data.fd;
-			if ((fd == r_data_eventfd) || (fd == r_mgmt_eventfd)) {
+			if (!(events[i].data.u64 & DCONN_EPOLL_TAG) &&
+			    ((fd == r_data_eventfd) || (fd == r_mgmt_eventfd))) {
 				ret = do_drainfd(fd);
 				if (ret == -1)
 					goto exit;
@@ -806,70 +911,41 @@ initialize_error:
 			}
 
 			ret = -1;
-			ptr = events[i].data.ptr;
-			if (ptr != NULL) {
-				REPLICA_ERRLOG("event.data.ptr != NULL.. This "
-				    "should not happen.. r(%lu)!\n", r->zvol_guid);
+			d = events[i].data.u64 & ~DCONN_EPOLL_TAG;
+			if (!(events[i].data.u64 & DCONN_EPOLL_TAG) ||
+			    d >= (uint64_t)r->ndconns) {
+				REPLICA_ERRLOG("event.data(%lx) is not a data "
+				    "connection.. This should not happen.. "
+				    "r(%lu)!\n", events[i].data.u64, r->zvol_guid);
 				goto exit;
 			}
+			dc = &r->dconn[d];
 
 			if (events[i].events & (EPOLLERR | EPOLLRDHUP | EPOLLHUP)) {
 				REPLICA_ERRLOG("Received event(%d) on fd(%d) "
 				    "for replica(%lu)\n", events[i].events,
-				    events[i].data.fd, r->zvol_guid);
+				    dc->fd, r->zvol_guid);
 				goto exit;
 			}
 
 			ret = 0;
 			if (events[i].events & EPOLLIN)
-				ret = handle_epoll_in_event(arg);
+				ret = handle_epoll_in_event(r, dc);
 
 			if (ret == -1)
 				goto exit;
 
 			if (events[i].events & EPOLLOUT)
-				ret = handle_epoll_out_event(arg);
+				ret = handle_dconn_out_event(r, dc);
 
 			if (ret == -1)
 				goto exit;
 		}
 
-		/*
-		 * Here, we are checking if replica are taking much time to
-		 * responde than expected time.
-		 * Expected time is set to replica_timeout in ms.
-		 *
-		 * We will check time difference for first IOs from all replica
-		 * queues (waitq, readyq and blocked queue) at an interval of
-		 * `x` ms.
-		 * `x` is set to minimum of (replica_timeout/4) or lowest
-		 * time_diff of IOs from all replica queue.
-		 */
-		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-		timesdiff(CLOCK_MONOTONIC_RAW, last_time, now, diff_time);
-		polling_timeout = (replica_timeout / 4) * 1000;
-		if (epoll_timeout > polling_timeout)
-			epoll_timeout = polling_timeout;
-
-		if (((diff_time.tv_sec * 1000) +
-		    (diff_time.tv_nsec / 1000000)) > epoll_timeout) {
-			epoll_timeout = polling_timeout;
-			CHECK_REPLICA_TIMEOUT(&r->readyq, diff_time, ret, exit,
-			    epoll_timeout);
-			CHECK_REPLICA_TIMEOUT(&r->waitq, diff_time, ret, exit,
-			    epoll_timeout);
-			CHECK_REPLICA_TIMEOUT(&r->blockedq, diff_time, ret,
-			    exit, epoll_timeout);
-
-			/*
-			 * In CHECK_REPLICA_TIMEOUT macro, we are logging
-			 * replica details and time_diff since how long replica
-			 * is not responding at an interval of
-			 * (replica_timeout/4) ms.
-			 */
-			if (epoll_timeout < replica_timeout)
-				wait_count = 1;
-			clock_gettime(CLOCK_MONOTONIC_RAW, &last_time);
+		istgt_twheel_advance(&r->io_wheel, istgt_twheel_now_ms());
+		if (r->io_timed_out) {
+			ret = -1;
+			goto exit;
 		}
 	}
 exit:
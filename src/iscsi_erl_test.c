@@ -0,0 +1,428 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Logs in to a target at ErrorRecoveryLevel 2 with header and data
+ * digests over loopback and recovers from the faults it injects:
+ * a command whose immediate data fails its digest is retried after a
+ * later one went through, a DATA-OUT that fails its digest is sent
+ * again on the recovery R2T, a status and the DATA-IN of a READ are
+ * asked for again by SNACK, and a READ whose connection was dropped
+ * before its data was read is reassigned to a new connection of the
+ * same session by TASK REASSIGN, while a WRITE still waiting for its
+ * DATA-OUT then is refused.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "iscsi_test_util.h"
+
+#define	SNACK_DATA	0
+#define	SNACK_STATUS	1
+#define	TASK_REASSIGN	8
+
+#define	BLOCK_LEN	4096
+#define	IO_BLOCKS	8
+#define	IO_LEN		(IO_BLOCKS * BLOCK_LEN)
+/* a write of IO_LEN takes two R2Ts, one outstanding at a time */
+#define	BURST_LEN	16384
+
+static uint8_t io_buf[IO_LEN];
+
+/*
+ * Leading login with tsih 0, else a connection cid joining the session.
+ * The digests are on from the full feature phase.
+ */
+static int
+erl_login(iscsi_test_conn_t *c, const char *target, uint16_t cid)
+{
+	/* ISID: random qualifier type */
+	static const uint8_t isid[6] = { 0x80, 0x5e, 0x12, 0x34, 0, 0x01 };
+	char keys[1024];
+	int leading = (c->tsih == 0);
+	int len;
+
+	if (leading)
+		len = snprintf(keys, sizeof (keys),
+		    "InitiatorName=iqn.2019-01.io.openebs:erl%c"
+		    "TargetName=%s%c"
+		    "SessionType=Normal%c"
+		    "HeaderDigest=CRC32C%c"
+		    "DataDigest=CRC32C%c"
+		    "ErrorRecoveryLevel=2%c"
+		    "DefaultTime2Wait=2%c"
+		    "DefaultTime2Retain=20%c"
+		    "InitialR2T=Yes%c"
+		    "ImmediateData=Yes%c"
+		    "MaxRecvDataSegmentLength=65536%c"
+		    "FirstBurstLength=%d%c"
+		    "MaxBurstLength=%d%c"
+		    "MaxOutstandingR2T=1%c",
+		    0, target, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, BURST_LEN, 0, BURST_LEN,
+		    0, 0);
+	else
+		len = snprintf(keys, sizeof (keys),
+		    "InitiatorName=iqn.2019-01.io.openebs:erl%c"
+		    "TargetName=%s%c"
+		    "HeaderDigest=CRC32C%c"
+		    "DataDigest=CRC32C%c"
+		    "MaxRecvDataSegmentLength=65536%c",
+		    0, target, 0, 0, 0, 0);
+
+	c->cid = cid;
+	if (conn_login(c, isid, keys, len) != 0)
+		return (-1);
+	if (leading && !has_key(c, "ErrorRecoveryLevel=2")) {
+		fprintf(stderr, "ErrorRecoveryLevel 2 not taken\n");
+		return (-1);
+	}
+	c->digests = 1;
+	return (0);
+}
+
+/* a command of blocks at lba, with imm of its data in the PDU */
+static int
+scsi_send(iscsi_test_conn_t *c, uint32_t itt, uint32_t cmdsn, uint8_t op,
+    uint32_t lba, int blocks, size_t imm, int corrupt)
+{
+	uint8_t bhs[BHS_LEN];
+	uint32_t len = (op == 0x00) ? 0 : blocks * BLOCK_LEN;
+
+	memset(bhs, 0, sizeof (bhs));
+	bhs[0] = OP_SCSI_CMD;
+	bhs[1] = 0x80 | 0x01;	/* F, simple */
+	if (op == 0x2a)
+		bhs[1] |= 0x20;
+	else if (op == 0x28)
+		bhs[1] |= 0x40;
+	put32(&bhs[16], itt);
+	put32(&bhs[20], len);
+	put32(&bhs[24], cmdsn);
+	put32(&bhs[28], c->expstatsn);
+	bhs[32] = op;
+	if (op != 0x00) {
+		put32(&bhs[34], lba);
+		bhs[39] = blocks >> 8;
+		bhs[40] = blocks & 0xff;
+	}
+	return (send_pdu_digest(c, bhs, io_buf, imm, corrupt));
+}
+
+/*
+ * Answers R2Ts until the status of the WRITE itt, the DATA-OUT at
+ * bad_off of the first burst fails its digest once.
+ */
+static int
+erl_write_finish(iscsi_test_conn_t *c, uint32_t itt, uint32_t bad_off,
+    int *rejects, int *r2ts)
+{
+	uint8_t bhs[BHS_LEN];
+
+	for (;;) {
+		if (recv_reply(c, bhs) != 0)
+			return (-1);
+		if ((bhs[0] & 0x3f) == OP_SCSI_RSP)
+			return (scsi_status(c, bhs, itt));
+		if ((bhs[0] & 0x3f) == OP_REJECT) {
+			if (bhs[2] != 0x02)
+				return (-1);
+			c->expstatsn = get32(&bhs[24]) + 1;
+			(*rejects)++;
+			continue;
+		}
+		if ((bhs[0] & 0x3f) != OP_R2T || get32(&bhs[16]) != itt)
+			return (-1);
+		(*r2ts)++;
+		if (data_out_send(c, bhs, io_buf, IO_LEN,
+		    *r2ts == 1 ? bad_off : NO_BAD_OFF) != 0)
+			return (-1);
+	}
+}
+
+static int
+snack_send(iscsi_test_conn_t *c, int type, uint32_t itt, uint32_t beg_run,
+    uint32_t run_length)
+{
+	uint8_t bhs[BHS_LEN];
+
+	memset(bhs, 0, sizeof (bhs));
+	bhs[0] = OP_SNACK;
+	bhs[1] = 0x80 | type;
+	put32(&bhs[16], itt);
+	put32(&bhs[20], 0xffffffffU);
+	put32(&bhs[28], c->expstatsn);
+	put32(&bhs[40], beg_run);
+	put32(&bhs[44], run_length);
+	return (send_pdu(c, bhs, NULL, 0));
+}
+
+/*
+ * Immediate data failing its digest is rejected and the command dropped;
+ * a TEST UNIT READY goes past it before it is retried with its CmdSN.
+ */
+static int
+test_command_retry(iscsi_test_conn_t *c)
+{
+	uint8_t bhs[BHS_LEN];
+	uint32_t itt = c->itt++;
+	uint32_t cmdsn = c->cmdsn++;
+	uint32_t tur = c->itt++;
+
+	memset(io_buf, 0x11, sizeof (io_buf));
+	if (scsi_send(c, itt, cmdsn, 0x2a, 0, 2, 2 * BLOCK_LEN, 1) != 0 ||
+	    recv_reply(c, bhs) != 0)
+		return (-1);
+	if ((bhs[0] & 0x3f) != OP_REJECT || bhs[2] != 0x02) {
+		fprintf(stderr, "no reject for the data digest (0x%02x %d)\n",
+		    bhs[0], bhs[2]);
+		return (-1);
+	}
+	c->expstatsn = get32(&bhs[24]) + 1;
+
+	if (scsi_send(c, tur, c->cmdsn++, 0x00, 0, 0, 0, 0) != 0 ||
+	    recv_reply(c, bhs) != 0 || (bhs[0] & 0x3f) != OP_SCSI_RSP ||
+	    get32(&bhs[16]) != tur)
+		return (-1);
+	c->expstatsn = get32(&bhs[24]) + 1;
+
+	if (scsi_send(c, itt, cmdsn, 0x2a, 0, 2, 2 * BLOCK_LEN, 0) != 0 ||
+	    recv_reply(c, bhs) != 0 || scsi_status(c, bhs, itt) != 0) {
+		fprintf(stderr, "retried WRITE failed\n");
+		return (-1);
+	}
+	itt = c->itt++;
+	if (scsi_send(c, itt, c->cmdsn++, 0x28, 0, 2, 0, 0) != 0 ||
+	    read_finish(c, itt, 2 * BLOCK_LEN, 0x11, 0, NULL) != 0)
+		return (-1);
+	printf("command retried after a data digest error\n");
+	return (0);
+}
+
+/* a DATA-OUT failing its digest is asked for again by a recovery R2T */
+static int
+test_recovery_r2t(iscsi_test_conn_t *c)
+{
+	uint32_t itt = c->itt++;
+	int rejects = 0, r2ts = 0;
+
+	memset(io_buf, 0x22, sizeof (io_buf));
+	if (scsi_send(c, itt, c->cmdsn++, 0x2a, IO_BLOCKS, IO_BLOCKS, 0, 0) != 0 ||
+	    erl_write_finish(c, itt, DATAOUT_LEN, &rejects, &r2ts) != 0) {
+		fprintf(stderr, "WRITE with a bad DATA-OUT failed\n");
+		return (-1);
+	}
+	/* two R2Ts for the WRITE, one more to recover */
+	if (rejects != 1 || r2ts != IO_LEN / BURST_LEN + 1) {
+		fprintf(stderr, "%d rejects, %d R2Ts\n", rejects, r2ts);
+		return (-1);
+	}
+	itt = c->itt++;
+	if (scsi_send(c, itt, c->cmdsn++, 0x28, IO_BLOCKS, IO_BLOCKS, 0, 0) != 0 ||
+	    read_finish(c, itt, IO_LEN, 0x22, 0, NULL) != 0)
+		return (-1);
+	printf("DATA-OUT recovered by R2T\n");
+	return (0);
+}
+
+/* the status and then the data of a READ are sent again on SNACK */
+static int
+test_snack(iscsi_test_conn_t *c)
+{
+	uint8_t bhs[BHS_LEN];
+	uint32_t itt = c->itt++;
+	uint32_t statsn, again;
+
+	if (scsi_send(c, itt, c->cmdsn++, 0x28, IO_BLOCKS, IO_BLOCKS, 0, 0) != 0 ||
+	    read_finish(c, itt, IO_LEN, 0x22, 0, &statsn) != 0)
+		return (-1);
+	/* as if the status was lost, it is not acknowledged */
+	c->expstatsn = statsn;
+
+	if (snack_send(c, SNACK_STATUS, 0xffffffffU, statsn, 1) != 0 ||
+	    recv_reply(c, bhs) != 0)
+		return (-1);
+	again = get32(&bhs[24]);
+	if (((bhs[0] & 0x3f) != OP_SCSI_RSP &&
+	    ((bhs[0] & 0x3f) != OP_DATAIN || (bhs[1] & 0x01) == 0)) ||
+	    get32(&bhs[16]) != itt || again != statsn) {
+		fprintf(stderr, "status SNACK: 0x%02x ITT %x StatSN %u/%u\n",
+		    bhs[0], get32(&bhs[16]), again, statsn);
+		return (-1);
+	}
+
+	if (snack_send(c, SNACK_DATA, itt, 0, 0) != 0 ||
+	    read_finish(c, itt, IO_LEN, 0x22, 1, NULL) != 0) {
+		fprintf(stderr, "data SNACK failed\n");
+		return (-1);
+	}
+	c->expstatsn = statsn + 1;
+	printf("status and data sent again on SNACK\n");
+	return (0);
+}
+
+/* TASK REASSIGN of itt, the response goes to bhs */
+static int
+task_reassign(iscsi_test_conn_t *c, uint32_t itt, uint32_t cmdsn, uint8_t *bhs)
+{
+	uint32_t tmf = c->itt++;
+
+	memset(bhs, 0, BHS_LEN);
+	bhs[0] = OP_IMMEDIATE | OP_TASK;
+	bhs[1] = 0x80 | TASK_REASSIGN;
+	put32(&bhs[16], tmf);
+	put32(&bhs[20], itt);
+	put32(&bhs[24], c->cmdsn);
+	put32(&bhs[28], c->expstatsn);
+	put32(&bhs[32], cmdsn);
+	put32(&bhs[36], 0);	/* ExpDataSN, nothing was read */
+	if (send_pdu(c, bhs, NULL, 0) != 0 || recv_reply(c, bhs) != 0)
+		return (-1);
+	if ((bhs[0] & 0x3f) != OP_TASK_RSP || get32(&bhs[16]) != tmf) {
+		fprintf(stderr, "TASK REASSIGN: 0x%02x\n", bhs[0]);
+		return (-1);
+	}
+	c->expstatsn = get32(&bhs[24]) + 1;
+	return (0);
+}
+
+/*
+ * The connection of a READ drops before its data is read, and of a
+ * WRITE before its DATA-OUT is sent; a new one joins the session and
+ * has the READ reassigned to it.  The WRITE was still running, its
+ * reassignment is rejected.
+ */
+static int
+test_reassign(iscsi_test_conn_t *c, const char *host, const char *port,
+    const char *target, int wait)
+{
+	uint8_t bhs[BHS_LEN];
+	uint32_t witt = c->itt++;
+	uint32_t wcmdsn = c->cmdsn++;
+	uint32_t itt = c->itt++;
+	uint32_t cmdsn = c->cmdsn++;
+
+	if (scsi_send(c, witt, wcmdsn, 0x2a, IO_BLOCKS, IO_BLOCKS, 0, 0) != 0 ||
+	    recv_reply(c, bhs) != 0)
+		return (-1);
+	if ((bhs[0] & 0x3f) != OP_R2T || get32(&bhs[16]) != witt) {
+		fprintf(stderr, "WRITE: 0x%02x, no R2T\n", bhs[0]);
+		return (-1);
+	}
+	if (scsi_send(c, itt, cmdsn, 0x28, 0, 2, 0, 0) != 0)
+		return (-1);
+	sleep(1);
+	close(c->sock);
+	c->sock = -1;
+	/* the target keeps the session with no connection */
+	sleep(wait);
+
+	if (conn_connect(c, host, port) != 0) {
+		fprintf(stderr, "reconnect failed: %s\n", strerror(errno));
+		return (-1);
+	}
+	if (erl_login(c, target, 2) != 0)
+		return (-1);
+
+	if (task_reassign(c, witt, wcmdsn, bhs) != 0)
+		return (-1);
+	if (bhs[2] != 255) {
+		fprintf(stderr, "running WRITE reassigned: response %d\n",
+		    bhs[2]);
+		return (-1);
+	}
+	printf("running WRITE not reassigned\n");
+
+	if (task_reassign(c, itt, cmdsn, bhs) != 0)
+		return (-1);
+	if (bhs[2] != 0) {
+		fprintf(stderr, "TASK REASSIGN of the READ: response %d\n",
+		    bhs[2]);
+		return (-1);
+	}
+	if (read_finish(c, itt, 2 * BLOCK_LEN, 0x11, 0, NULL) != 0) {
+		fprintf(stderr, "reassigned READ failed\n");
+		return (-1);
+	}
+	printf("READ reassigned to a new connection\n");
+	return (0);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -t target [-h host] [-p port]"
+	    " [-w seconds without a connection]\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	const char *port = "3260";
+	const char *target = NULL;
+	iscsi_test_conn_t conn;
+	int wait = 7;
+	int ch, ret = 1;
+
+	while ((ch = getopt(argc, argv, "h:p:t:w:")) != -1) {
+		switch (ch) {
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 't': target = optarg; break;
+		case 'w': wait = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return (1);
+		}
+	}
+	if (target == NULL) {
+		usage(argv[0]);
+		return (1);
+	}
+
+	memset(&conn, 0, sizeof (conn));
+	conn.itt = 1;
+	if (conn_connect(&conn, host, port) != 0) {
+		fprintf(stderr, "connect failed: %s\n", strerror(errno));
+		return (1);
+	}
+	if (erl_login(&conn, target, 1) != 0)
+		goto out;
+	printf("logged in at ErrorRecoveryLevel 2, tsih %u\n", conn.tsih);
+
+	if (test_command_retry(&conn) != 0 ||
+	    test_recovery_r2t(&conn) != 0 ||
+	    test_snack(&conn) != 0 ||
+	    test_reassign(&conn, host, port, target, wait) != 0)
+		goto out;
+
+	if (conn_logout(&conn) != 0) {
+		fprintf(stderr, "logout failed\n");
+		goto out;
+	}
+	printf("logged out\n");
+	ret = 0;
+out:
+	if (conn.sock >= 0)
+		close(conn.sock);
+	return (ret);
+}
@@ -0,0 +1,475 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Opens one iSCSI session with several connections (MC/S) to a target
+ * over loopback.  A READ sent on the second connection ahead of its
+ * CmdSN is held back until the WRITE before it came in on the first one
+ * and returns what that wrote, each status on the connection its command
+ * went out on.  An ORDERED command stays behind a WRITE still waiting
+ * for its DATA-OUT, and everything stays behind an ORDERED one.  Then a
+ * thread per connection writes and reads back its own blocks, all of
+ * them taking CmdSNs from the one session-wide counter, first on one
+ * connection and then on all of them.  A logout closing the session has
+ * the target close the other connections too.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "iscsi_test_util.h"
+
+#define	MAX_CONNS	16
+
+#define	ATTR_SIMPLE	0x01
+#define	ATTR_ORDERED	0x02
+
+#define	BLOCK_LEN	4096
+/* blocks of a connection, the WRITEs go round in them */
+#define	CONN_BLOCKS	1024
+
+typedef struct mcs_conn {
+	iscsi_test_conn_t conn;
+	uint8_t io[BLOCK_LEN];
+	/* the IO thread */
+	pthread_t thread;
+	int ops;
+	int failed;
+} mcs_conn_t;
+
+/* the CmdSN window is the session's, shared by all connections */
+static pthread_mutex_t sn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sn_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t cmdsn;
+static uint32_t maxcmdsn;
+static uint64_t isid_seq;
+
+static int
+sn_gt(uint32_t a, uint32_t b)
+{
+	return ((int32_t)(a - b) > 0);
+}
+
+/* the session's window moves with every status, on any connection */
+static void
+window_update(mcs_conn_t *c)
+{
+	pthread_mutex_lock(&sn_mutex);
+	if (sn_gt(c->conn.maxcmdsn, maxcmdsn)) {
+		maxcmdsn = c->conn.maxcmdsn;
+		pthread_cond_broadcast(&sn_cond);
+	}
+	pthread_mutex_unlock(&sn_mutex);
+}
+
+/* the next CmdSN of the session, once the window has room for it */
+static uint32_t
+window_take(void)
+{
+	uint32_t sn;
+
+	pthread_mutex_lock(&sn_mutex);
+	while (sn_gt(cmdsn, maxcmdsn))
+		pthread_cond_wait(&sn_cond, &sn_mutex);
+	sn = cmdsn++;
+	pthread_mutex_unlock(&sn_mutex);
+	return (sn);
+}
+
+/*
+ * The leading login asks for nconns connections and sets *tsih, the
+ * others join that session.
+ */
+static int
+mcs_login(mcs_conn_t *c, const char *target, int nconns, uint16_t *tsih)
+{
+	/* ISID: random qualifier type, the same for all connections */
+	uint8_t isid[6] = { 0x80, 0x4d, isid_seq >> 8, isid_seq, 0, 0x02 };
+	char keys[1024];
+	char want[32];
+	int len;
+
+	if (*tsih == 0)
+		len = snprintf(keys, sizeof (keys),
+		    "InitiatorName=iqn.2019-01.io.openebs:mcs%c"
+		    "TargetName=%s%c"
+		    "SessionType=Normal%c"
+		    "HeaderDigest=None%c"
+		    "DataDigest=None%c"
+		    "MaxConnections=%d%c"
+		    "InitialR2T=Yes%c"
+		    "ImmediateData=Yes%c"
+		    "MaxRecvDataSegmentLength=65536%c"
+		    "FirstBurstLength=65536%c"
+		    "MaxBurstLength=262144%c",
+		    0, target, 0, 0, 0, 0, nconns, 0, 0, 0, 0, 0, 0);
+	else
+		len = snprintf(keys, sizeof (keys),
+		    "InitiatorName=iqn.2019-01.io.openebs:mcs%c"
+		    "TargetName=%s%c"
+		    "HeaderDigest=None%c"
+		    "DataDigest=None%c"
+		    "MaxRecvDataSegmentLength=65536%c",
+		    0, target, 0, 0, 0, 0);
+
+	c->conn.tsih = *tsih;
+	c->conn.cmdsn = cmdsn;
+	if (conn_login(&c->conn, isid, keys, len) != 0)
+		return (-1);
+	if (*tsih == 0) {
+		snprintf(want, sizeof (want), "MaxConnections=%d", nconns);
+		if (!has_key(&c->conn, want)) {
+			fprintf(stderr, "target does not take %s\n", want);
+			return (-1);
+		}
+		*tsih = c->conn.tsih;
+		cmdsn = c->conn.cmdsn;
+		maxcmdsn = c->conn.maxcmdsn;
+	}
+	return (0);
+}
+
+/* one block, a WRITE with imm bytes of it as immediate data */
+static int
+scsi_cmd(mcs_conn_t *c, uint32_t itt, uint32_t sn, int write, uint32_t lba,
+    int attr, size_t imm)
+{
+	uint8_t bhs[BHS_LEN];
+
+	memset(bhs, 0, sizeof (bhs));
+	bhs[0] = OP_SCSI_CMD;
+	bhs[1] = 0x80 | (write ? 0x20 : 0x40) | attr;	/* F, W/R, attr */
+	put32(&bhs[16], itt);
+	put32(&bhs[20], BLOCK_LEN);
+	put32(&bhs[24], sn);
+	put32(&bhs[28], c->conn.expstatsn);
+	bhs[32] = write ? 0x2a : 0x28;
+	put32(&bhs[34], lba);
+	bhs[40] = 1;
+	return (send_pdu(&c->conn, bhs, c->io, write ? imm : 0));
+}
+
+/* a WRITE of one block carries all of it as immediate data */
+static int
+scsi_send(mcs_conn_t *c, uint32_t itt, uint32_t sn, int write, uint32_t lba)
+{
+	return (scsi_cmd(c, itt, sn, write, lba, ATTR_SIMPLE, BLOCK_LEN));
+}
+
+/* the R2T for all of the WRITE itt, into r2t */
+static int
+r2t_wait(mcs_conn_t *c, uint32_t itt, uint8_t *r2t)
+{
+	if (recv_reply(&c->conn, r2t) != 0) {
+		fprintf(stderr, "cid %d: no R2T for ITT %x\n", c->conn.cid,
+		    itt);
+		return (-1);
+	}
+	if ((r2t[0] & 0x3f) != OP_R2T || get32(&r2t[16]) != itt ||
+	    get32(&r2t[40]) != 0 || get32(&r2t[44]) != BLOCK_LEN) {
+		fprintf(stderr, "cid %d: PDU 0x%02x ITT %x offset %u length %u,"
+		    " expected an R2T for ITT %x\n", c->conn.cid, r2t[0],
+		    get32(&r2t[16]), get32(&r2t[40]), get32(&r2t[44]), itt);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+mcs_write_finish(mcs_conn_t *c, uint32_t itt)
+{
+	if (write_finish(&c->conn, itt, c->io, BLOCK_LEN) != 0)
+		return (-1);
+	window_update(c);
+	return (0);
+}
+
+/* the block of itt has to be pattern */
+static int
+mcs_read_finish(mcs_conn_t *c, uint32_t itt, uint8_t pattern)
+{
+	if (read_finish(&c->conn, itt, BLOCK_LEN, pattern, 0, NULL) != 0)
+		return (-1);
+	window_update(c);
+	return (0);
+}
+
+/* nothing may come in on c for ms */
+static int
+quiet(mcs_conn_t *c, int ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = c->conn.sock;
+	pfd.events = POLLIN;
+	return (poll(&pfd, 1, ms) == 0 ? 0 : -1);
+}
+
+/*
+ * The READ goes out with CmdSN n+1 on the second connection before the
+ * WRITE of the same block with n on the first.  The READ has to wait
+ * for the WRITE and see its data.
+ */
+static int
+test_order(mcs_conn_t *conns)
+{
+	mcs_conn_t *a = &conns[0], *b = &conns[1];
+	uint32_t w_itt = a->conn.itt++, r_itt = b->conn.itt++;
+	uint32_t sn;
+
+	sn = window_take();
+	(void) window_take();
+	if (scsi_send(b, r_itt, sn + 1, 0, 0) != 0)
+		return (-1);
+	if (quiet(b, 500) != 0) {
+		fprintf(stderr, "READ ahead of its CmdSN was not held back\n");
+		return (-1);
+	}
+	memset(a->io, 0x5a, BLOCK_LEN);
+	if (scsi_send(a, w_itt, sn, 1, 0) != 0 ||
+	    mcs_write_finish(a, w_itt) != 0)
+		return (-1);
+	if (mcs_read_finish(b, r_itt, 0x5a) != 0)
+		return (-1);
+	printf("READ ahead of its CmdSN ran after the WRITE before it\n");
+	return (0);
+}
+
+/*
+ * A WRITE still gathering its DATA-OUT on the first connection, and a
+ * command of the same LUN after it on the second.  An ORDERED command
+ * may not pass the WRITE, nor may anything pass an ORDERED WRITE; a
+ * SIMPLE one after a SIMPLE WRITE may.  The held command has to see the
+ * data the WRITE brought in.
+ */
+static int
+ordered_case(mcs_conn_t *conns, int w_attr, int r_attr, uint32_t lba,
+    uint8_t pattern)
+{
+	mcs_conn_t *a = &conns[0], *b = &conns[1];
+	uint8_t r2t[BHS_LEN];
+	uint32_t w_itt = a->conn.itt++, r_itt = b->conn.itt++, s_itt;
+	uint32_t sn;
+
+	sn = window_take();
+	if (scsi_cmd(a, w_itt, sn, 1, lba, w_attr, 0) != 0 ||
+	    r2t_wait(a, w_itt, r2t) != 0)
+		return (-1);
+
+	/* another block, it may pass when nothing before it is ORDERED */
+	if (w_attr == ATTR_SIMPLE) {
+		s_itt = b->conn.itt++;
+		if (scsi_cmd(b, s_itt, window_take(), 0, 0, ATTR_SIMPLE, 0)
+		    != 0 || mcs_read_finish(b, s_itt, 0x5a) != 0) {
+			fprintf(stderr, "SIMPLE READ held behind a SIMPLE "
+			    "WRITE\n");
+			return (-1);
+		}
+	}
+
+	if (scsi_cmd(b, r_itt, window_take(), 0, lba, r_attr, 0) != 0)
+		return (-1);
+	if (quiet(b, 500) != 0) {
+		fprintf(stderr, "%s READ passed the %s WRITE gathering its "
+		    "data\n", r_attr == ATTR_ORDERED ? "ORDERED" : "SIMPLE",
+		    w_attr == ATTR_ORDERED ? "ORDERED" : "SIMPLE");
+		return (-1);
+	}
+	memset(a->io, pattern, BLOCK_LEN);
+	if (data_out_send(&a->conn, r2t, a->io, BLOCK_LEN, NO_BAD_OFF) != 0 ||
+	    mcs_write_finish(a, w_itt) != 0)
+		return (-1);
+	if (mcs_read_finish(b, r_itt, pattern) != 0)
+		return (-1);
+	return (0);
+}
+
+static int
+test_ordered(mcs_conn_t *conns)
+{
+	if (ordered_case(conns, ATTR_SIMPLE, ATTR_ORDERED, 1, 0x3c) != 0 ||
+	    ordered_case(conns, ATTR_ORDERED, ATTR_SIMPLE, 2, 0xc3) != 0)
+		return (-1);
+	printf("commands behind a WRITE gathering its data kept their order\n");
+	return (0);
+}
+
+static void *
+conn_io(void *arg)
+{
+	mcs_conn_t *c = arg;
+	uint32_t itt, lba;
+	uint8_t pattern;
+	int i;
+
+	lba = (uint32_t)c->conn.cid * CONN_BLOCKS;
+	for (i = 0; i < c->ops; i++) {
+		pattern = (uint8_t)(c->conn.cid * 31 + i) | 1;
+		memset(c->io, pattern, BLOCK_LEN);
+		itt = c->conn.itt++;
+		if (scsi_send(c, itt, window_take(), 1,
+		    lba + i % CONN_BLOCKS) != 0 ||
+		    mcs_write_finish(c, itt) != 0)
+			goto failed;
+		itt = c->conn.itt++;
+		if (scsi_send(c, itt, window_take(), 0,
+		    lba + i % CONN_BLOCKS) != 0 ||
+		    mcs_read_finish(c, itt, pattern) != 0)
+			goto failed;
+	}
+	return (NULL);
+failed:
+	c->failed = 1;
+	return (NULL);
+}
+
+/* ops WRITEs and READs on each of the first n connections at once */
+static int
+run_io(mcs_conn_t *conns, int n, int ops)
+{
+	struct timeval start, end;
+	double secs;
+	int i, failed = 0;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < n; i++) {
+		conns[i].ops = ops;
+		conns[i].failed = 0;
+		if (pthread_create(&conns[i].thread, NULL, conn_io,
+		    &conns[i]) != 0)
+			return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(conns[i].thread, NULL);
+		failed |= conns[i].failed;
+	}
+	if (failed)
+		return (-1);
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%d connection(s): %d IOs of %d bytes in %.3f s (%.0f IOPS)\n",
+	    n, 2 * n * ops, BLOCK_LEN, secs,
+	    secs > 0 ? 2 * n * ops / secs : 0);
+	return (0);
+}
+
+/* logout of the session on the first, the others are closed by the target */
+static int
+test_logout(mcs_conn_t *conns, int nconns)
+{
+	char buf[BHS_LEN];
+	ssize_t rc;
+	int i;
+
+	conns[0].conn.cmdsn = cmdsn;
+	if (conn_logout(&conns[0].conn) != 0) {
+		fprintf(stderr, "logout failed\n");
+		return (-1);
+	}
+	for (i = 1; i < nconns; i++) {
+		/* NOP-Ins may still come before the close */
+		do {
+			rc = recv(conns[i].conn.sock, buf, sizeof (buf), 0);
+		} while (rc > 0 || (rc < 0 && errno == EINTR));
+		if (rc < 0) {
+			fprintf(stderr, "cid %d: not closed after the logout"
+			    " (%s)\n", conns[i].conn.cid, strerror(errno));
+			return (-1);
+		}
+	}
+	printf("logout of the session closed all %d connections\n", nconns);
+	return (0);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -t target [-h host] [-p port]"
+	    " [-c connections] [-n IO rounds per connection]\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	const char *port = "3260";
+	const char *target = NULL;
+	mcs_conn_t *conns;
+	uint16_t tsih = 0;
+	int nconns = 4, ops = 500;
+	int i, ch, ret = 1;
+
+	while ((ch = getopt(argc, argv, "h:p:t:c:n:")) != -1) {
+		switch (ch) {
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 't': target = optarg; break;
+		case 'c': nconns = atoi(optarg); break;
+		case 'n': ops = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return (1);
+		}
+	}
+	if (target == NULL || nconns < 2 || nconns > MAX_CONNS || ops <= 0) {
+		usage(argv[0]);
+		return (1);
+	}
+
+	conns = calloc(nconns, sizeof (*conns));
+	if (conns == NULL)
+		return (1);
+	for (i = 0; i < nconns; i++)
+		conns[i].conn.sock = -1;
+	isid_seq = getpid();
+
+	for (i = 0; i < nconns; i++) {
+		conns[i].conn.cid = i;
+		conns[i].conn.itt = (uint32_t)i << 24;
+		if (conn_connect(&conns[i].conn, host, port) != 0) {
+			fprintf(stderr, "cid %d: connect failed: %s\n", i,
+			    strerror(errno));
+			goto out;
+		}
+		if (mcs_login(&conns[i], target, nconns, &tsih) != 0)
+			goto out;
+	}
+	printf("%d connections logged in to session tsih %u\n", nconns, tsih);
+
+	if (test_order(conns) != 0 ||
+	    test_ordered(conns) != 0 ||
+	    run_io(conns, 1, ops) != 0 ||
+	    run_io(conns, nconns, ops) != 0 ||
+	    test_logout(conns, nconns) != 0)
+		goto out;
+	ret = 0;
+out:
+	for (i = 0; i < nconns; i++) {
+		if (conns[i].conn.sock >= 0)
+			close(conns[i].conn.sock);
+	}
+	free(conns);
+	return (ret);
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Opens many iSCSI sessions to one target over loopback, pings all of
+ * them with NOP-Out at once and logs them out again.  -w adds rounds of
+ * a WRITE, collected by R2T, and a READ back on every session, -q keeps
+ * that many WRITEs of a session outstanding at once.  With -P the thread
+ * count of the target is checked while all the sessions are up, which
+ * is how the connection reactors are told apart from a thread pair per
+ * connection.  A target takes at most 255 sessions (MAX_LU_TSIH).
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "iscsi_test_util.h"
+
+#define	IO_BLOCKS	8
+#define	IO_LEN		(IO_BLOCKS * 4096)
+/* a write takes IO_BURSTS R2Ts, all of them asked for at once */
+#define	BURST_LEN	8192
+#define	IO_BURSTS	(IO_LEN / BURST_LEN)
+
+static uint8_t io_buf[IO_LEN];
+
+/* session idx, its index keeps the ISID and the initiator name unique */
+static int
+sess_login(iscsi_test_conn_t *s, int idx, const char *target)
+{
+	/* ISID: random qualifier type */
+	uint8_t isid[6] = { 0x80, 0x5c, idx >> 16, idx >> 8, idx, 0x01 };
+	char keys[1024];
+	int len;
+
+	len = snprintf(keys, sizeof (keys),
+	    "InitiatorName=iqn.2019-01.io.openebs:scale-%d%c"
+	    "TargetName=%s%c"
+	    "SessionType=Normal%c"
+	    "HeaderDigest=None%c"
+	    "DataDigest=None%c"
+	    "MaxRecvDataSegmentLength=65536%c"
+	    "FirstBurstLength=%d%c"
+	    "MaxBurstLength=%d%c"
+	    "MaxOutstandingR2T=%d%c",
+	    idx, 0, target, 0, 0, 0, 0, 0, BURST_LEN, 0, BURST_LEN, 0,
+	    IO_BURSTS, 0);
+	return (conn_login(s, isid, keys, len));
+}
+
+static int
+sess_nop_send(iscsi_test_conn_t *s)
+{
+	uint8_t bhs[BHS_LEN];
+
+	memset(bhs, 0, sizeof (bhs));
+	bhs[0] = OP_IMMEDIATE | OP_NOPOUT;
+	bhs[1] = 0x80;
+	put32(&bhs[16], s->itt);
+	put32(&bhs[20], 0xffffffffU);
+	put32(&bhs[24], s->cmdsn);
+	put32(&bhs[28], s->expstatsn);
+	return (send_pdu(s, bhs, NULL, 0));
+}
+
+static int
+sess_nop_recv(iscsi_test_conn_t *s)
+{
+	uint8_t bhs[BHS_LEN];
+
+	if (recv_reply(s, bhs) != 0)
+		return (-1);
+	if ((bhs[0] & 0x3f) != OP_NOPIN || get32(&bhs[16]) != s->itt)
+		return (-1);
+	s->expstatsn = get32(&bhs[24]) + 1;
+	s->itt++;
+	return (0);
+}
+
+static int
+sess_scsi_send(iscsi_test_conn_t *s, int write, uint32_t lba)
+{
+	uint8_t bhs[BHS_LEN];
+
+	memset(bhs, 0, sizeof (bhs));
+	bhs[0] = OP_SCSI_CMD;
+	bhs[1] = 0x80 | (write ? 0x20 : 0x40) | 0x01;	/* F, W/R, simple */
+	put32(&bhs[16], s->itt);
+	put32(&bhs[20], IO_LEN);
+	put32(&bhs[24], s->cmdsn++);
+	put32(&bhs[28], s->expstatsn);
+	bhs[32] = write ? 0x2a : 0x28;	/* WRITE(10), READ(10) */
+	put32(&bhs[34], lba);
+	bhs[39] = IO_BLOCKS >> 8;
+	bhs[40] = IO_BLOCKS & 0xff;
+	return (send_pdu(s, bhs, NULL, 0));
+}
+
+/* the WRITEs of lba on, ITTs s->itt to s->itt + depth - 1 */
+static int
+sess_write_send(iscsi_test_conn_t *s, int depth, uint32_t lba)
+{
+	uint32_t itt = s->itt;
+	int k;
+
+	for (k = 0; k < depth; k++) {
+		s->itt = itt + k;
+		if (sess_scsi_send(s, 1, lba + k * IO_BLOCKS) != 0)
+			return (-1);
+	}
+	s->itt = itt;
+	return (0);
+}
+
+/* answers the R2Ts of the WRITEs, in any order, with data of the pattern */
+static int
+sess_write_finish(iscsi_test_conn_t *s, int depth, uint8_t pattern)
+{
+	uint8_t bhs[BHS_LEN];
+	uint32_t itt;
+	int done = 0;
+
+	memset(io_buf, pattern, sizeof (io_buf));
+	while (done < depth) {
+		if (recv_reply(s, bhs) != 0)
+			return (-1);
+		itt = get32(&bhs[16]);
+		if (itt - s->itt >= (uint32_t)depth)
+			return (-1);
+		if ((bhs[0] & 0x3f) == OP_SCSI_RSP) {
+			if (scsi_status(s, bhs, itt) != 0)
+				return (-1);
+			done++;
+			continue;
+		}
+		if ((bhs[0] & 0x3f) != OP_R2T ||
+		    data_out_send(s, bhs, io_buf, IO_LEN, NO_BAD_OFF) != 0)
+			return (-1);
+	}
+	s->itt += depth;
+	return (0);
+}
+
+static int
+sess_read_finish(iscsi_test_conn_t *s, uint8_t pattern)
+{
+	if (read_finish(s, s->itt, IO_LEN, pattern, 0, NULL) != 0)
+		return (-1);
+	s->itt++;
+	return (0);
+}
+
+static int
+target_threads(int pid)
+{
+	char path[64], line[128];
+	FILE *fp;
+	int n = -1;
+
+	snprintf(path, sizeof (path), "/proc/%d/status", pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (sscanf(line, "Threads: %d", &n) == 1)
+			break;
+	}
+	fclose(fp);
+	return (n);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -t target [-h host] [-p port] [-n sessions]"
+	    " [-r rounds] [-w io rounds [-q depth]] [-P pid [-T max threads]]\n",
+	    prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	const char *port = "3260";
+	const char *target = NULL;
+	iscsi_test_conn_t *sess;
+	struct timeval start, end;
+	int nsess = 250, rounds = 10, io_rounds = 0, pid = 0, max_threads = 0;
+	int depth = 1;
+	int threads_before = 0, threads;
+	int i, k, r, ch, ret = 1;
+	double secs;
+
+	while ((ch = getopt(argc, argv, "h:p:t:n:r:w:q:P:T:")) != -1) {
+		switch (ch) {
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 't': target = optarg; break;
+		case 'n': nsess = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		case 'w': io_rounds = atoi(optarg); break;
+		case 'q': depth = atoi(optarg); break;
+		case 'P': pid = atoi(optarg); break;
+		case 'T': max_threads = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return (1);
+		}
+	}
+	if (target == NULL || nsess <= 0 || depth <= 0) {
+		usage(argv[0]);
+		return (1);
+	}
+
+	sess = calloc(nsess, sizeof (*sess));
+	if (sess == NULL)
+		return (1);
+	for (i = 0; i < nsess; i++)
+		sess[i].sock = -1;
+	if (pid > 0)
+		threads_before = target_threads(pid);
+
+	for (i = 0; i < nsess; i++) {
+		sess[i].cid = i;
+		sess[i].itt = 1;
+		if (conn_connect(&sess[i], host, port) != 0) {
+			fprintf(stderr, "session %d: connect failed: %s\n", i,
+			    strerror(errno));
+			goto out;
+		}
+		if (sess_login(&sess[i], i, target) != 0)
+			goto out;
+	}
+	printf("%d sessions logged in\n", nsess);
+
+	if (pid > 0) {
+		threads = target_threads(pid);
+		printf("target threads: %d before, %d with %d sessions\n",
+		    threads_before, threads, nsess);
+		if (max_threads > 0 && threads > max_threads) {
+			fprintf(stderr, "target runs %d threads, limit %d\n",
+			    threads, max_threads);
+			goto out;
+		}
+	}
+
+	/* every session has a ping outstanding before any is collected */
+	gettimeofday(&start, NULL);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nsess; i++) {
+			if (sess_nop_send(&sess[i]) != 0) {
+				fprintf(stderr, "session %d: NOP-Out failed\n", i);
+				goto out;
+			}
+		}
+		for (i = 0; i < nsess; i++) {
+			if (sess_nop_recv(&sess[i]) != 0) {
+				fprintf(stderr, "session %d: no NOP-In\n", i);
+				goto out;
+			}
+		}
+	}
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%d pings in %.3f s (%.0f/s)\n", nsess * rounds, secs,
+	    secs > 0 ? nsess * rounds / secs : 0);
+
+	/*
+	 * Each session has its own blocks.  The writes of all sessions are
+	 * out before the first gets its data, in the order opposite to the
+	 * one they were sent in; the target gathers DATA-OUT without holding
+	 * up the other sessions, or this client stalls.
+	 */
+	gettimeofday(&start, NULL);
+	for (r = 0; r < io_rounds; r++) {
+		for (i = 0; i < nsess; i++) {
+			if (sess_write_send(&sess[i], depth,
+			    i * depth * IO_BLOCKS) != 0)
+				goto io_failed;
+		}
+		for (i = nsess - 1; i >= 0; i--) {
+			if (sess_write_finish(&sess[i], depth,
+			    (uint8_t)(i + r)) != 0)
+				goto io_failed;
+		}
+		for (i = 0; i < nsess; i++) {
+			for (k = 0; k < depth; k++) {
+				if (sess_scsi_send(&sess[i], 0,
+				    (i * depth + k) * IO_BLOCKS) != 0 ||
+				    sess_read_finish(&sess[i], (uint8_t)(i + r)) != 0)
+					goto io_failed;
+			}
+		}
+	}
+	if (io_rounds > 0) {
+		gettimeofday(&end, NULL);
+		secs = (end.tv_sec - start.tv_sec) +
+		    (end.tv_usec - start.tv_usec) / 1e6;
+		printf("%d writes and reads of %d bytes in %.3f s\n",
+		    nsess * io_rounds * depth, IO_LEN, secs);
+	}
+
+	for (i = 0; i < nsess; i++) {
+		if (conn_logout(&sess[i]) != 0) {
+			fprintf(stderr, "session %d: logout failed\n", i);
+			goto out;
+		}
+		close(sess[i].sock);
+		sess[i].sock = -1;
+	}
+	printf("%d sessions logged out\n", nsess);
+	ret = 0;
+	goto out;
+io_failed:
+	fprintf(stderr, "session %d: IO failed in round %d\n", i, r);
+out:
+	for (i = 0; i < nsess; i++) {
+		if (sess[i].sock >= 0)
+			close(sess[i].sock);
+	}
+	free(sess);
+	return (ret);
+}
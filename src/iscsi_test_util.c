@@ -0,0 +1,489 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "iscsi_test_util.h"
+
+void
+put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+uint32_t
+get32(const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3]);
+}
+
+/*
+ * CRC32C of len more bytes, from 0xffffffff and inverted at the end.
+ * The digests go on the wire least significant byte first.
+ */
+static uint32_t
+crc32c_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+	int k;
+
+	while (len-- > 0) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0x82f63b78U & -(crc & 1));
+	}
+	return (crc);
+}
+
+static uint32_t
+crc32c(const uint8_t *p, size_t len)
+{
+	return (crc32c_update(0xffffffffU, p, len) ^ 0xffffffffU);
+}
+
+static void
+put_digest(uint8_t *p, uint32_t crc)
+{
+	p[0] = crc;
+	p[1] = crc >> 8;
+	p[2] = crc >> 16;
+	p[3] = crc >> 24;
+}
+
+static uint32_t
+get_digest(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+int
+xfer(int sock, void *buf, size_t len, int out)
+{
+	uint8_t *p = buf;
+	ssize_t rc;
+
+	while (len > 0) {
+		if (out)
+			rc = send(sock, p, len, MSG_NOSIGNAL);
+		else
+			rc = recv(sock, p, len, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return (-1);
+		p += rc;
+		len -= rc;
+	}
+	return (0);
+}
+
+/* all of iov, in as few segments as the socket takes */
+static int
+xferv(int sock, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t rc;
+
+	memset(&msg, 0, sizeof (msg));
+	while (iovcnt > 0) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return (-1);
+		while (iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return (0);
+}
+
+int
+send_pdu(iscsi_test_conn_t *c, uint8_t *bhs, const uint8_t *data, size_t len)
+{
+	return (send_pdu_digest(c, bhs, data, len, 0));
+}
+
+/* with bad_digest the data digest is off by one bit */
+int
+send_pdu_digest(iscsi_test_conn_t *c, uint8_t *bhs, const uint8_t *data,
+    size_t len, int bad_digest)
+{
+	uint8_t hdigest[DIGEST_LEN], tail[3 + DIGEST_LEN];
+	struct iovec iov[4];
+	uint32_t crc;
+	size_t padlen = (4 - (len & 3)) & 3;
+	int n = 0;
+
+	bhs[5] = len >> 16;
+	bhs[6] = len >> 8;
+	bhs[7] = len;
+	iov[n].iov_base = bhs;
+	iov[n++].iov_len = BHS_LEN;
+	if (c->digests) {
+		put_digest(hdigest, crc32c(bhs, BHS_LEN));
+		iov[n].iov_base = hdigest;
+		iov[n++].iov_len = DIGEST_LEN;
+	}
+	if (len == 0)
+		return (xferv(c->sock, iov, n));
+
+	iov[n].iov_base = (void *)(uintptr_t)data;
+	iov[n++].iov_len = len;
+	memset(tail, 0, padlen);
+	if (c->digests) {
+		/* the pad is covered too */
+		crc = crc32c_update(0xffffffffU, data, len);
+		crc = crc32c_update(crc, tail, padlen) ^ 0xffffffffU;
+		put_digest(tail + padlen, bad_digest ? crc ^ 1 : crc);
+	}
+	iov[n].iov_base = tail;
+	iov[n++].iov_len = padlen + (c->digests ? DIGEST_LEN : 0);
+	if (iov[n - 1].iov_len == 0)
+		n--;
+	return (xferv(c->sock, iov, n));
+}
+
+/* reads one PDU into bhs and c->data, the digests have to match */
+int
+recv_pdu(iscsi_test_conn_t *c, uint8_t *bhs)
+{
+	uint8_t digest[DIGEST_LEN];
+	size_t len;
+
+	if (xfer(c->sock, bhs, BHS_LEN, 0) != 0)
+		return (-1);
+	if (c->digests) {
+		if (xfer(c->sock, digest, DIGEST_LEN, 0) != 0)
+			return (-1);
+		if (get_digest(digest) != crc32c(bhs, BHS_LEN)) {
+			fprintf(stderr, "cid %d: header digest mismatch\n",
+			    c->cid);
+			return (-1);
+		}
+	}
+	c->data_len = ((size_t)bhs[5] << 16) | ((size_t)bhs[6] << 8) | bhs[7];
+	len = (size_t)bhs[4] * 4 + c->data_len;
+	len = (len + 3) & ~(size_t)3;
+	if (len > MAX_DATA)
+		return (-1);
+	if (len != 0 && xfer(c->sock, c->data, len, 0) != 0)
+		return (-1);
+	if (c->digests && c->data_len != 0) {
+		if (xfer(c->sock, digest, DIGEST_LEN, 0) != 0)
+			return (-1);
+		if (get_digest(digest) != crc32c(c->data, len)) {
+			fprintf(stderr, "cid %d: data digest mismatch\n",
+			    c->cid);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* next PDU that isn't a NOP-In of the target's own */
+int
+recv_reply(iscsi_test_conn_t *c, uint8_t *bhs)
+{
+	do {
+		if (recv_pdu(c, bhs) != 0)
+			return (-1);
+	} while ((bhs[0] & 0x3f) == OP_NOPIN && get32(&bhs[16]) == 0xffffffffU);
+	return (0);
+}
+
+/* the text keys in c->data have key=value */
+int
+has_key(iscsi_test_conn_t *c, const char *pair)
+{
+	size_t off = 0;
+
+	while (off < c->data_len) {
+		if (strncmp((const char *)c->data + off, pair,
+		    c->data_len - off) == 0)
+			return (1);
+		off += strnlen((const char *)c->data + off,
+		    c->data_len - off) + 1;
+	}
+	return (0);
+}
+
+int
+conn_connect(iscsi_test_conn_t *c, const char *host, const char *port)
+{
+	struct addrinfo hints, *res;
+	struct timeval tv;
+	int one = 1;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return (-1);
+	c->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (c->sock < 0) {
+		freeaddrinfo(res);
+		return (-1);
+	}
+	tv.tv_sec = 30;
+	tv.tv_usec = 0;
+	setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+	if (connect(c->sock, res->ai_addr, res->ai_addrlen) != 0) {
+		close(c->sock);
+		c->sock = -1;
+		freeaddrinfo(res);
+		return (-1);
+	}
+	freeaddrinfo(res);
+	c->digests = 0;
+	return (0);
+}
+
+/*
+ * One login request with keys, the security stage is skipped and the
+ * response has to go straight to the full feature phase.  With tsih 0
+ * it leads a new session, else connection c->cid joins that one.  The
+ * keys of the response are left in c->data.
+ */
+int
+conn_login(iscsi_test_conn_t *c, const uint8_t *isid, const char *keys,
+    size_t len)
+{
+	uint8_t bhs[BHS_LEN];
+
+	memset(bhs, 0, sizeof (bhs));
+	bhs[0] = OP_IMMEDIATE | OP_LOGIN;
+	bhs[1] = 0x80 | (1 << 2) | 3;	/* T, CSG=1, NSG=3 */
+	memcpy(&bhs[8], isid, 6);
+	bhs[14] = c->tsih >> 8;
+	bhs[15] = c->tsih;
+	put32(&bhs[16], c->itt++);
+	bhs[20] = c->cid >> 8;
+	bhs[21] = c->cid;
+	put32(&bhs[24], c->cmdsn);
+	put32(&bhs[28], c->expstatsn);
+	if (send_pdu(c, bhs, (const uint8_t *)keys, len) != 0 ||
+	    recv_pdu(c, bhs) != 0) {
+		fprintf(stderr, "cid %d: no login response\n", c->cid);
+		return (-1);
+	}
+	if ((bhs[0] & 0x3f) != OP_LOGIN_RSP || bhs[36] != 0) {
+		fprintf(stderr, "cid %d: login rejected (0x%02x %d/%d)\n",
+		    c->cid, bhs[0], bhs[36], bhs[37]);
+		return (-1);
+	}
+	if ((bhs[1] & 0x83) != 0x83) {
+		fprintf(stderr, "cid %d: no full feature phase\n", c->cid);
+		return (-1);
+	}
+	c->tsih = ((uint16_t)bhs[14] << 8) | bhs[15];
+	c->expstatsn = get32(&bhs[24]) + 1;
+	c->cmdsn = get32(&bhs[28]);
+	c->maxcmdsn = get32(&bhs[32]);
+	return (0);
+}
+
+/* logout closing the session */
+int
+conn_logout(iscsi_test_conn_t *c)
+{
+	uint8_t bhs[BHS_LEN];
+
+	memset(bhs, 0, sizeof (bhs));
+	bhs[0] = OP_IMMEDIATE | OP_LOGOUT;
+	bhs[1] = 0x80;
+	put32(&bhs[16], c->itt++);
+	bhs[20] = c->cid >> 8;
+	bhs[21] = c->cid;
+	put32(&bhs[24], c->cmdsn);
+	put32(&bhs[28], c->expstatsn);
+	if (send_pdu(c, bhs, NULL, 0) != 0 || recv_reply(c, bhs) != 0)
+		return (-1);
+	if ((bhs[0] & 0x3f) != OP_LOGOUT_RSP || bhs[2] != 0) {
+		fprintf(stderr, "cid %d: logout response 0x%02x %d\n", c->cid,
+		    bhs[0], bhs[2]);
+		return (-1);
+	}
+	return (0);
+}
+
+/* the good status of itt, with the next StatSN of the connection */
+int
+scsi_status(iscsi_test_conn_t *c, const uint8_t *bhs, uint32_t itt)
+{
+	if (get32(&bhs[16]) != itt) {
+		fprintf(stderr, "cid %d: status of ITT %x, expected %x\n",
+		    c->cid, get32(&bhs[16]), itt);
+		return (-1);
+	}
+	if (bhs[2] != 0 || bhs[3] != 0) {
+		fprintf(stderr, "cid %d: ITT %x status %d/%d\n", c->cid, itt,
+		    bhs[2], bhs[3]);
+		return (-1);
+	}
+	if (get32(&bhs[24]) != c->expstatsn) {
+		fprintf(stderr, "cid %d: StatSN %u, expected %u\n", c->cid,
+		    get32(&bhs[24]), c->expstatsn);
+		return (-1);
+	}
+	c->expstatsn++;
+	c->maxcmdsn = get32(&bhs[32]);
+	return (0);
+}
+
+/*
+ * Answers the R2T r2t with DATA-OUTs from data, of len bytes in all.
+ * The one at bad_off fails its data digest.
+ */
+int
+data_out_send(iscsi_test_conn_t *c, const uint8_t *r2t, const uint8_t *data,
+    uint32_t len, uint32_t bad_off)
+{
+	uint8_t bhs[BHS_LEN];
+	uint32_t itt, ttt, off, left, n, datasn;
+
+	itt = get32(&r2t[16]);
+	ttt = get32(&r2t[20]);
+	off = get32(&r2t[40]);
+	left = get32(&r2t[44]);
+	if (off > len || left > len - off) {
+		fprintf(stderr, "cid %d: R2T of ITT %x for %u at %u, past %u\n",
+		    c->cid, itt, left, off, len);
+		return (-1);
+	}
+	for (datasn = 0; left > 0; datasn++) {
+		n = (left > DATAOUT_LEN) ? DATAOUT_LEN : left;
+		memset(bhs, 0, sizeof (bhs));
+		bhs[0] = OP_DATAOUT;
+		bhs[1] = (n == left) ? 0x80 : 0;
+		put32(&bhs[16], itt);
+		put32(&bhs[20], ttt);
+		put32(&bhs[28], c->expstatsn);
+		put32(&bhs[36], datasn);
+		put32(&bhs[40], off);
+		if (send_pdu_digest(c, bhs, data + off, n, off == bad_off) != 0)
+			return (-1);
+		off += n;
+		left -= n;
+	}
+	return (0);
+}
+
+/* answers the R2Ts of the WRITE itt from data until its status */
+int
+write_finish(iscsi_test_conn_t *c, uint32_t itt, const uint8_t *data,
+    uint32_t len)
+{
+	uint8_t bhs[BHS_LEN];
+
+	for (;;) {
+		if (recv_reply(c, bhs) != 0) {
+			fprintf(stderr, "cid %d: no status for ITT %x\n",
+			    c->cid, itt);
+			return (-1);
+		}
+		if ((bhs[0] & 0x3f) == OP_SCSI_RSP)
+			return (scsi_status(c, bhs, itt));
+		if ((bhs[0] & 0x3f) != OP_R2T || get32(&bhs[16]) != itt) {
+			fprintf(stderr, "cid %d: PDU 0x%02x of ITT %x, expected"
+			    " an R2T or status of %x\n", c->cid, bhs[0],
+			    get32(&bhs[16]), itt);
+			return (-1);
+		}
+		if (data_out_send(c, bhs, data, len, NO_BAD_OFF) != 0)
+			return (-1);
+	}
+}
+
+/*
+ * DATA-IN of the READ itt until its status, or with no_status until
+ * len bytes are in as when they are sent again on SNACK.  The data has
+ * to be pattern.  The StatSN goes to statsn.
+ */
+int
+read_finish(iscsi_test_conn_t *c, uint32_t itt, uint32_t len,
+    uint8_t pattern, int no_status, uint32_t *statsn)
+{
+	uint8_t bhs[BHS_LEN];
+	uint32_t off, got = 0;
+	size_t i;
+
+	for (;;) {
+		if (no_status && got >= len)
+			return (0);
+		if (recv_reply(c, bhs) != 0) {
+			fprintf(stderr, "cid %d: no data for ITT %x\n", c->cid,
+			    itt);
+			return (-1);
+		}
+		if ((bhs[0] & 0x3f) == OP_SCSI_RSP)
+			break;
+		if ((bhs[0] & 0x3f) != OP_DATAIN || get32(&bhs[16]) != itt) {
+			fprintf(stderr, "cid %d: ITT %x: unexpected PDU "
+			    "0x%02x\n", c->cid, itt, bhs[0]);
+			return (-1);
+		}
+		off = get32(&bhs[40]);
+		if (off > len || c->data_len > len - off) {
+			fprintf(stderr, "cid %d: ITT %x: DATA-IN at %u past "
+			    "%u\n", c->cid, itt, off, len);
+			return (-1);
+		}
+		for (i = 0; i < c->data_len; i++) {
+			if (c->data[i] != pattern) {
+				fprintf(stderr, "cid %d: ITT %x: data %02x at "
+				    "%zu, wrote %02x\n", c->cid, itt,
+				    c->data[i], off + i, pattern);
+				return (-1);
+			}
+		}
+		got += c->data_len;
+		/* status came with the data */
+		if (bhs[1] & 0x01)
+			break;
+	}
+	if (got != len) {
+		fprintf(stderr, "cid %d: ITT %x: %u of %u bytes\n", c->cid, itt,
+		    got, len);
+		return (-1);
+	}
+	if (statsn != NULL)
+		*statsn = get32(&bhs[24]);
+	return (scsi_status(c, bhs, itt));
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef	ISCSI_TEST_UTIL_H
+#define	ISCSI_TEST_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The mini initiator the iSCSI test programs drive a target with.  A
+ * connection sends and takes PDUs whole, blocking, and leaves the
+ * scenario to the program: it picks the ITTs and CmdSNs and builds the
+ * BHS of each request.
+ */
+
+#define	BHS_LEN		48
+#define	DIGEST_LEN	4
+#define	MAX_DATA	(64 * 1024)
+/* data segment of a DATA-OUT */
+#define	DATAOUT_LEN	4096
+
+#define	OP_NOPOUT	0x00
+#define	OP_SCSI_CMD	0x01
+#define	OP_TASK		0x02
+#define	OP_LOGIN	0x03
+#define	OP_DATAOUT	0x05
+#define	OP_LOGOUT	0x06
+#define	OP_SNACK	0x10
+#define	OP_NOPIN	0x20
+#define	OP_SCSI_RSP	0x21
+#define	OP_TASK_RSP	0x22
+#define	OP_LOGIN_RSP	0x23
+#define	OP_DATAIN	0x25
+#define	OP_LOGOUT_RSP	0x26
+#define	OP_R2T		0x31
+#define	OP_REJECT	0x3f
+#define	OP_IMMEDIATE	0x40
+
+/* data_out_send with no DATA-OUT failing its digest */
+#define	NO_BAD_OFF	0xffffffffU
+
+typedef struct iscsi_test_conn {
+	int sock;
+	/* CRC32C header and data digests, from the login on */
+	int digests;
+	uint16_t cid;
+	uint16_t tsih;
+	uint32_t itt;
+	uint32_t cmdsn;
+	uint32_t maxcmdsn;
+	uint32_t expstatsn;
+	/* data segment of the last PDU in */
+	uint8_t data[MAX_DATA];
+	size_t data_len;
+} iscsi_test_conn_t;
+
+void put32(uint8_t *p, uint32_t v);
+uint32_t get32(const uint8_t *p);
+
+int xfer(int sock, void *buf, size_t len, int out);
+int send_pdu(iscsi_test_conn_t *c, uint8_t *bhs, const uint8_t *data,
+    size_t len);
+int send_pdu_digest(iscsi_test_conn_t *c, uint8_t *bhs, const uint8_t *data,
+    size_t len, int bad_digest);
+int recv_pdu(iscsi_test_conn_t *c, uint8_t *bhs);
+int recv_reply(iscsi_test_conn_t *c, uint8_t *bhs);
+int has_key(iscsi_test_conn_t *c, const char *pair);
+
+int conn_connect(iscsi_test_conn_t *c, const char *host, const char *port);
+int conn_login(iscsi_test_conn_t *c, const uint8_t *isid, const char *keys,
+    size_t len);
+int conn_logout(iscsi_test_conn_t *c);
+
+int scsi_status(iscsi_test_conn_t *c, const uint8_t *bhs, uint32_t itt);
+int data_out_send(iscsi_test_conn_t *c, const uint8_t *r2t,
+    const uint8_t *data, uint32_t len, uint32_t bad_off);
+int write_finish(iscsi_test_conn_t *c, uint32_t itt, const uint8_t *data,
+    uint32_t len);
+int read_finish(iscsi_test_conn_t *c, uint32_t itt, uint32_t len,
+    uint8_t pattern, int no_status, uint32_t *statsn);
+
+#endif /* ISCSI_TEST_UTIL_H */
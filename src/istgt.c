@@ -86,6 +86,7 @@
 #include "istgt_sock.h"
 #include "istgt_misc.h"
 #include "istgt_crc32c.h"
+#include "istgt_affinity.h"
 #include "istgt_iscsi.h"
 #include "istgt_lu.h"
 #include "istgt_proto.h"
@@ -1286,6 +1287,7 @@ istgt_init(ISTGT_Ptr istgt)
 	int nopininterval;
 	int maxr2t;
 	int OperationalMode;
+	int colocate, numabind;
 	int rc;
 	int i;
 
@@ -1401,6 +1403,49 @@ istgt_init(ISTGT_Ptr istgt)
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "Luworkers %d\n",
 	    g_num_luworkers);
 
+	/* thread placement, environment overrides the config */
+	if (istgt_affinity_init() != 0)
+		return (-1);
+	for (i = 0; i < ISTGT_AFF_NCLASSES; i++) {
+		val = getenv(istgt_aff_class_key[i]);
+		if (val == NULL)
+			val = istgt_get_val(sp, istgt_aff_class_key[i]);
+		if (istgt_affinity_set_class(i, val) != 0)
+			return (-1);
+	}
+	val = getenv("AffinityColocate");
+	if (val == NULL)
+		val = istgt_get_val(sp, "AffinityColocate");
+	colocate = (val != NULL && strcasecmp(val, "Yes") == 0);
+	val = getenv("NumaBind");
+	if (val == NULL)
+		val = istgt_get_val(sp, "NumaBind");
+	numabind = (val != NULL && strcasecmp(val, "Yes") == 0);
+	istgt_affinity_set_policy(colocate, numabind);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "AffinityColocate %s NumaBind %s\n",
+	    colocate ? "Yes" : "No", numabind ? "Yes" : "No");
+
+	/* connections on a pool of reactors, 0 keeps a thread pair each */
+	val = getenv("ConnReactors");
+	if (val == NULL)
+		val = istgt_get_val(sp, "ConnReactors");
+	if (val == NULL || strcasecmp(val, "No") == 0) {
+		istgt->conn_reactors = 0;
+	} else if (strcasecmp(val, "Auto") == 0) {
+		istgt->conn_reactors = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	} else {
+		istgt->conn_reactors = (int)strtol(val, NULL, 10);
+	}
+	if (istgt->conn_reactors < 0)
+		istgt->conn_reactors = 0;
+	if (istgt->conn_reactors > ISTGT_REACTOR_MAX)
+		istgt->conn_reactors = ISTGT_REACTOR_MAX;
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "ConnReactors %d\n",
+	    istgt->conn_reactors);
+
+	if (istgt_metrics_init(istgt, sp) != 0)
+		return (-1);
+
 	/* limited to 16bits - RFC3720(12.2) */
 	if (MaxSessions > 0xffff) {
 		ISTGT_ERRLOG("over 65535 sessions are not supported\n");
@@ -1590,19 +1635,9 @@ istgt_init(ISTGT_Ptr istgt)
 	} else if (ErrorRecoveryLevel == 0) {
 		ErrorRecoveryLevel = 0;
 	} else if (ErrorRecoveryLevel == 1) {
-#if 0
 		ErrorRecoveryLevel = 1;
-#else
-		ISTGT_ERRLOG("not supported value %d\n", ErrorRecoveryLevel);
-		return (-1);
-#endif
 	} else if (ErrorRecoveryLevel == 2) {
-#if 0
 		ErrorRecoveryLevel = 2;
-#else
-		ISTGT_ERRLOG("not supported value %d\n", ErrorRecoveryLevel);
-		return (-1);
-#endif
 	} else {
 		ISTGT_ERRLOG("not supported value %d\n", ErrorRecoveryLevel);
 		return (-1);
@@ -2807,100 +2842,72 @@ void *timerfn(void
 	ISTGT_QUEUE backupconns;
 	istgt_queue_init(&backupconns);
 	CONN *conn;
+	time_t last_reap = 0;
 #ifdef	REPLICATION
 	spec_t *spec;
-	ISTGT_LU_TASK_Ptr lu_task;
-	ISTGT_LU_CMD_Ptr lu_cmd;
-	int ms;
-	struct timespec now, diff, last_check;
-	clock_gettime(clockid, &last_check);
+	uint64_t now_ms;
+	int ms, wait_ms;
 #endif
 
 	while (1) {
-		while ((conn = (CONN *)(istgt_queue_dequeue(&closedconns))) !=
-		    NULL) {
-			if (((time(NULL) - conn->closetime) > 300) &&
-			    (conn->inflight == 0))
-				istgt_free_conn(conn);
-			else
-				istgt_queue_enqueue(&backupconns, conn);
-		}
-		while ((conn = (CONN *)(istgt_queue_dequeue(&backupconns))) !=
-		    NULL)
-			istgt_queue_enqueue(&closedconns, conn);
-
+		if (time(NULL) - last_reap >= 10) {
+			while ((conn = (CONN *)
+			    (istgt_queue_dequeue(&closedconns))) != NULL) {
+				if (((time(NULL) - conn->closetime) > 300) &&
+				    (conn->inflight == 0))
+					istgt_free_conn(conn);
+				else
+					istgt_queue_enqueue(&backupconns, conn);
+			}
+			while ((conn = (CONN *)
+			    (istgt_queue_dequeue(&backupconns))) != NULL)
+				istgt_queue_enqueue(&closedconns, conn);
+			istgt_iscsi_expire_sess();
 #ifdef	REPLICATION
-		const char *s_replica_timeout = getenv("replicaTimeout");
-		int rep_timeout = 0;
-		if (s_replica_timeout != NULL)
-			rep_timeout = (int)strtol(s_replica_timeout,
-			    NULL, 10);
-		if ((rep_timeout > 30) && (rep_timeout != replica_timeout)) {
-			ISTGT_NOTICELOG("changing replica timeout "
-			    "from %d to %d", replica_timeout,
-			    rep_timeout);
-			replica_timeout = rep_timeout;
+			const char *s_replica_timeout = getenv("replicaTimeout");
+			int rep_timeout = 0;
+			if (s_replica_timeout != NULL)
+				rep_timeout = (int)strtol(s_replica_timeout,
+				    NULL, 10);
+			if ((rep_timeout > 30) &&
+			    (rep_timeout != replica_timeout)) {
+				ISTGT_NOTICELOG("changing replica timeout "
+				    "from %d to %d", replica_timeout,
+				    rep_timeout);
+				replica_timeout = rep_timeout;
+			}
+#endif
+			last_reap = time(NULL);
 		}
-		int check_interval = (replica_timeout / 4) * 1000;
-
-
-		clock_gettime(clockid, &now);
-		timesdiff(clockid, last_check, now, diff);
-		ms = diff.tv_sec * 1000;
-		ms += diff.tv_nsec / 1000000;
 
+#ifdef	REPLICATION
 		/*
-		 * Here, we are checking if IOs are taking much time to
-		 * complete than expected time at an interval of
-		 * (replica_timeout /4). Expected time is set
-		 * to (replica_timeout / 4) in ms.
-		 *
-		 * complete_queue holds the IOs scheduled for the target.
-		 * we will calculate the time difference of first IO from
-		 * complete_queue as first IO is the oldest one in the queue.
-		 * If the time difference is more than (replica_timeout / 4)
-		 * then we will log the IO's details.
+		 * Tasks arm a deadline on their volume's task_wheel when
+		 * they enter the complete_queue and cancel it on leaving,
+		 * so stale IOs are reported, and failed past
+		 * io_max_wait_time, right when they become due.  Sleep
+		 * until the nearest deadline of all volumes, at most a
+		 * second; a deadline armed meanwhile is a quarter of
+		 * replica_timeout away, so it is not missed.
 		 */
-
-		if (ms > check_interval) {
-			MTX_LOCK(&specq_mtx);
-			TAILQ_FOREACH(spec, &spec_q, spec_next) {
-				MTX_LOCK(&spec->complete_queue_mutex);
-				lu_task = (ISTGT_LU_TASK_Ptr)
-				    istgt_queue_first(&spec->complete_queue);
-				if (lu_task) {
-					lu_cmd = &lu_task->lu_cmd;
-					clock_gettime(clockid, &now);
-					timesdiff(clockid,
-					    lu_cmd->times[0], now, diff);
-					ms = diff.tv_sec * 1000;
-					ms += diff.tv_nsec / 1000000;
-					if (ms > check_interval) {
-						ISTGT_NOTICELOG("LU:%lu "
-						    "CSN:0x%x TT:%x "
-						    "OP:%2.2x:%x:%s(%lu+%u) "
-						    "not responded since "
-						    "%d seconds\n",
-						    lu_cmd->lun,
-						    lu_cmd->CmdSN,
-						    lu_cmd->task_tag,
-						    lu_cmd->cdb0,
-						    lu_cmd->status,
-						    lu_cmd->info,
-						    lu_cmd->lba,
-						    lu_cmd->lblen,
-						    ms / 1000);
-					}
-				}
-
-				MTX_UNLOCK(&spec->complete_queue_mutex);
-			}
-			MTX_UNLOCK(&specq_mtx);
-			clock_gettime(clockid, &last_check);
+		wait_ms = 1000;
+		now_ms = istgt_twheel_now_ms();
+		MTX_LOCK(&specq_mtx);
+		TAILQ_FOREACH(spec, &spec_q, spec_next) {
+			MTX_LOCK(&spec->complete_queue_mutex);
+			istgt_twheel_advance(&spec->task_wheel, now_ms);
+			ms = istgt_twheel_timeout(&spec->task_wheel, now_ms);
+			MTX_UNLOCK(&spec->complete_queue_mutex);
+			if (ms >= 0 && ms < wait_ms)
+				wait_ms = ms;
 		}
-#endif
-
+		MTX_UNLOCK(&specq_mtx);
+		if (wait_ms < ISTGT_TWHEEL_TICK_MS)
+			wait_ms = ISTGT_TWHEEL_TICK_MS;
+		usleep(wait_ms * 1000);
+#else
 		sleep(10);
+#endif
 	}
 	return ((void *)NULL);
 }
@@ -3206,6 +3213,11 @@ initialize_error:
 		ISTGT_ERRLOG("istgt_iscsi_init() failed\n");
 		goto initialize_error;
 	}
+	rc = istgt_metrics_start(istgt);
+	if (rc < 0) {
+		ISTGT_ERRLOG("istgt_metrics_start() failed\n");
+		goto initialize_error;
+	}
 
 	/* override by command line */
 	if (pidfile != NULL) {
@@ -3374,6 +3386,7 @@ initialize_error:
 		ISTGT_ERRLOG("istgt_acceptor() failed:%d\n", rc);
 		istgt_close_all_portals(istgt);
 		istgt_close_uctl_portal(istgt);
+		istgt_metrics_shutdown();
 		istgt_iscsi_shutdown(istgt);
 		istgt_lu_shutdown(istgt);
 		istgt_shutdown(istgt);
@@ -3417,6 +3430,7 @@ initialize_error:
 	/* cleanup */
 	istgt_close_all_portals(istgt);
 	istgt_close_uctl_portal(istgt);
+	istgt_metrics_shutdown();
 	istgt_iscsi_shutdown(istgt);
 	istgt_lu_shutdown(istgt);
 	istgt_shutdown(istgt);
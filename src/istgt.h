@@ -66,6 +66,8 @@
 #include <pthread.h>
 #include <signal.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include "istgt_log.h"
 #include "istgt_conf.h"
 
@@ -203,6 +205,108 @@
 
 #define	MTX_LOCKED(MTX)	((MTX)->__data.__owner == syscall(SYS_gettid))
 
+/*
+ * Data segments of a command, kept as iobuf/iobufindx/iobufsize/iobufcap
+ * and iobuf_inl in the owning struct.  iobuf points at the inline array
+ * until more than ISTGT_SGL_INLINE segments are gathered and at a heap
+ * array, doubled as needed, after that; a burst is thus not limited by
+ * the number of Data-Out PDUs it takes.
+ */
+#define	ISTGT_SGL_INLINE	40
+#ifdef IOV_MAX
+#define	ISTGT_IOV_MAX		IOV_MAX
+#else
+#define	ISTGT_IOV_MAX		1024
+#endif
+
+#define	ISTGT_SGL_INIT(o)						\
+	do {								\
+		(o)->iobuf = (o)->iobuf_inl;				\
+		(o)->iobufcap = ISTGT_SGL_INLINE;			\
+		(o)->iobufindx = -1;					\
+		(o)->iobufsize = 0;					\
+	} while (0)
+/* room for n segments, -1 if out of memory */
+#define	ISTGT_SGL_RESERVE(o, n)						\
+	istgt_iov_reserve(&(o)->iobuf, &(o)->iobufcap, (o)->iobuf_inl, (n))
+/* append one segment, -1 (and nothing appended) if out of memory */
+#define	ISTGT_SGL_APPEND(o, base, len)					\
+	((ISTGT_SGL_RESERVE((o), (o)->iobufindx + 2) < 0) ? -1 :	\
+	((o)->iobuf[++(o)->iobufindx].iov_base = (base),		\
+	(o)->iobuf[(o)->iobufindx].iov_len = (len),			\
+	(o)->iobufsize += (len), 0))
+/* forget the segments, the buffers they point at are not freed */
+#define	ISTGT_SGL_RELEASE(o)						\
+	do {								\
+		if ((o)->iobuf != (o)->iobuf_inl)			\
+			xfree((o)->iobuf);				\
+		ISTGT_SGL_INIT(o);					\
+	} while (0)
+/* hand the segments of s over to d, s is left empty */
+#define	ISTGT_SGL_MOVE(d, s)						\
+	do {								\
+		ISTGT_SGL_RELEASE(d);					\
+		if ((s)->iobuf != (s)->iobuf_inl) {			\
+			(d)->iobuf = (s)->iobuf;			\
+			(d)->iobufcap = (s)->iobufcap;			\
+		} else if ((s)->iobufindx >= 0) {			\
+			memcpy((d)->iobuf_inl, (s)->iobuf_inl,		\
+			    sizeof (struct iovec) * ((s)->iobufindx + 1)); \
+		}							\
+		(d)->iobufindx = (s)->iobufindx;			\
+		(d)->iobufsize = (s)->iobufsize;			\
+		ISTGT_SGL_INIT(s);					\
+	} while (0)
+
+int istgt_iov_reserve(struct iovec **iovp, int *capp, struct iovec *inl,
+    int need);
+
+/*
+ * Case-insensitive index of names (target names, volume names).  Names are
+ * copied, the same name may be added for several values; locking is up to
+ * the owner.
+ */
+typedef struct istgt_nidx_ent_t {
+	struct istgt_nidx_ent_t *next;
+	uint32_t hash;
+	char *name;
+	void *val;
+} ISTGT_NIDX_ENT;
+
+typedef struct istgt_nidx_t {
+	uint32_t mask;
+	int count;
+	ISTGT_NIDX_ENT **bucket;
+} ISTGT_NIDX;
+
+int istgt_nidx_init(ISTGT_NIDX *idx, int size);
+void istgt_nidx_fini(ISTGT_NIDX *idx);
+int istgt_nidx_add(ISTGT_NIDX *idx, const char *name, void *val);
+int istgt_nidx_del(ISTGT_NIDX *idx, const char *name, void *val);
+void *istgt_nidx_find(ISTGT_NIDX *idx, const char *name);
+
+/*
+ * Hash chains over the slots of a fixed table owned by the caller, for
+ * tables small enough to be re-indexed whole after they change (PR
+ * registrations).  Nothing is allocated and a chain keeps table order;
+ * the caller still compares the slot, a hash only narrows the walk.
+ */
+#define	ISTGT_SIDX_BUCKETS	64
+#define	ISTGT_SIDX_SLOTS	256
+
+typedef struct istgt_sidx_t {
+	int16_t head[ISTGT_SIDX_BUCKETS];
+	int16_t tail[ISTGT_SIDX_BUCKETS];
+	int16_t next[ISTGT_SIDX_SLOTS];
+	uint32_t hash[ISTGT_SIDX_SLOTS];
+} ISTGT_SIDX;
+
+uint32_t istgt_sidx_hash(const char *name);
+void istgt_sidx_reset(ISTGT_SIDX *x);
+void istgt_sidx_add(ISTGT_SIDX *x, int slot, uint32_t hash);
+int istgt_sidx_first(ISTGT_SIDX *x, uint32_t hash);
+int istgt_sidx_next(ISTGT_SIDX *x, int slot);
+
 typedef struct istgt_portal_t {
 	char *label;
 	char *host;
@@ -290,10 +394,15 @@ typedef struct istgt_t {
 	INITIATOR_GROUP initiator_group[MAX_INITIATOR_GROUP];
 	int nlogical_unit;
 	struct istgt_lu_t *logical_unit[MAX_LOGICAL_UNIT];
+	/* logical_unit[] by target name and by volume name */
+	pthread_mutex_t lu_idx_mutex;
+	ISTGT_NIDX lu_name_idx;
+	ISTGT_NIDX lu_volname_idx;
 
 	int timeout;
 	int nopininterval;
 	int maxr2t;
+	int conn_reactors;
 	int no_discovery_auth;
 	int req_discovery_auth;
 	int req_discovery_auth_mutual;
@@ -0,0 +1,402 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_affinity.h"
+
+/* from linux/mempolicy.h, libnuma is not required */
+#define	AFF_MPOL_DEFAULT	0
+#define	AFF_MPOL_PREFERRED	1
+
+#define	AFF_NODE_CPULIST	"/sys/devices/system/node/node%d/cpulist"
+
+const char *istgt_aff_class_key[ISTGT_AFF_NCLASSES] = {
+	"AffinityConnWorker",
+	"AffinityConnSender",
+	"AffinityLUScheduler",
+	"AffinityLUWorker",
+	"AffinityMaintenance",
+	"AffinityReplica",
+};
+
+const char *istgt_aff_class_name[ISTGT_AFF_NCLASSES] = {
+	"worker",
+	"sender",
+	"luscheduler",
+	"luworker",
+	"maintenance",
+	"replica",
+};
+
+typedef struct aff_thr {
+	ISTGT_AFFINITY_ENT ent;
+	TAILQ_ENTRY(aff_thr) next;
+} aff_thr_t;
+
+static cpu_set_t aff_all;
+static cpu_set_t aff_class[ISTGT_AFF_NCLASSES];
+static int aff_class_set[ISTGT_AFF_NCLASSES];
+static cpu_set_t aff_node[ISTGT_AFF_MAX_NODES];
+static int aff_node_ids[ISTGT_AFF_MAX_NODES];
+static int aff_nnodes = 0;
+static int aff_colocate = 0;
+static int aff_numabind = 0;
+static int aff_inited = 0;
+
+static TAILQ_HEAD(, aff_thr) aff_threads =
+    TAILQ_HEAD_INITIALIZER(aff_threads);
+static pthread_mutex_t aff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t aff_key;
+static pthread_once_t aff_key_once = PTHREAD_ONCE_INIT;
+static __thread aff_thr_t *aff_me = NULL;
+
+/* "0-3,8,10-11" */
+static int
+aff_parse_cpulist(const char *s, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi, c;
+
+	CPU_ZERO(set);
+	while (*s != '\0' && *s != '\n') {
+		lo = strtol(s, &end, 10);
+		if (end == s || lo < 0 || lo >= CPU_SETSIZE)
+			return (-1);
+		hi = lo;
+		s = end;
+		if (*s == '-') {
+			s++;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo || hi >= CPU_SETSIZE)
+				return (-1);
+			s = end;
+		}
+		for (c = lo; c <= hi; c++)
+			CPU_SET(c, set);
+		if (*s == ',')
+			s++;
+		else if (*s != '\0' && *s != '\n')
+			return (-1);
+	}
+	return (CPU_COUNT(set) == 0 ? -1 : 0);
+}
+
+static int
+aff_format_cpulist(const cpu_set_t *set, char *buf, int len)
+{
+	int c, lo, n = 0;
+
+	buf[0] = '\0';
+	for (c = 0; c < CPU_SETSIZE && n < len; c++) {
+		if (!CPU_ISSET(c, set))
+			continue;
+		lo = c;
+		while (c + 1 < CPU_SETSIZE && CPU_ISSET(c + 1, set))
+			c++;
+		if (lo == c)
+			n += snprintf(buf + n, len - n, "%s%d",
+			    n ? "," : "", lo);
+		else
+			n += snprintf(buf + n, len - n, "%s%d-%d",
+			    n ? "," : "", lo, c);
+	}
+	return (n);
+}
+
+static int
+aff_node_index(int node)
+{
+	int i;
+
+	for (i = 0; i < aff_nnodes; i++)
+		if (aff_node_ids[i] == node)
+			return (i);
+	return (-1);
+}
+
+static void
+aff_thr_destructor(void *arg)
+{
+	aff_thr_t *t = arg;
+
+	MTX_LOCK(&aff_mutex);
+	TAILQ_REMOVE(&aff_threads, t, next);
+	MTX_UNLOCK(&aff_mutex);
+	xfree(t);
+}
+
+static void
+aff_key_init(void)
+{
+	(void) pthread_key_create(&aff_key, aff_thr_destructor);
+}
+
+int
+istgt_affinity_init(void)
+{
+	char path[64], line[1024];
+	cpu_set_t set;
+	FILE *fp;
+	int n;
+
+	if (aff_inited)
+		return (0);
+	(void) pthread_once(&aff_key_once, aff_key_init);
+
+	if (sched_getaffinity(0, sizeof (aff_all), &aff_all) != 0) {
+		ISTGT_ERRLOG("sched_getaffinity() failed errno:%d\n", errno);
+		return (-1);
+	}
+
+	/* only the CPUs of each node we are allowed to run on */
+	aff_nnodes = 0;
+	for (n = 0; n < ISTGT_AFF_MAX_NODES; n++) {
+		snprintf(path, sizeof (path), AFF_NODE_CPULIST, n);
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		if (fgets(line, sizeof (line), fp) != NULL &&
+		    aff_parse_cpulist(line, &set) == 0) {
+			CPU_AND(&set, &set, &aff_all);
+			if (CPU_COUNT(&set) != 0) {
+				aff_node[aff_nnodes] = set;
+				aff_node_ids[aff_nnodes] = n;
+				aff_nnodes++;
+			}
+		}
+		fclose(fp);
+	}
+	ISTGT_NOTICELOG("affinity: %d cpus over %d numa nodes\n",
+	    CPU_COUNT(&aff_all), aff_nnodes);
+	aff_inited = 1;
+	return (0);
+}
+
+int
+istgt_affinity_set_class(istgt_aff_class_t cls, const char *cpulist)
+{
+	cpu_set_t set;
+
+	if (cpulist == NULL || strcasecmp(cpulist, "All") == 0) {
+		aff_class_set[cls] = 0;
+		return (0);
+	}
+	if (aff_parse_cpulist(cpulist, &set) != 0) {
+		ISTGT_ERRLOG("%s: invalid cpu list %s\n",
+		    istgt_aff_class_key[cls], cpulist);
+		return (-1);
+	}
+	CPU_AND(&set, &set, &aff_all);
+	if (CPU_COUNT(&set) == 0) {
+		ISTGT_ERRLOG("%s: none of cpus %s is usable\n",
+		    istgt_aff_class_key[cls], cpulist);
+		return (-1);
+	}
+	aff_class[cls] = set;
+	aff_class_set[cls] = 1;
+	return (0);
+}
+
+void
+istgt_affinity_set_policy(int colocate, int numabind)
+{
+	aff_colocate = colocate;
+	aff_numabind = numabind;
+}
+
+void
+istgt_affinity_get_policy(int *colocate, int *numabind)
+{
+	*colocate = aff_colocate;
+	*numabind = aff_numabind;
+}
+
+/*
+ * Node of an LU: the NumaNode of its section if any, otherwise with
+ * colocation the LUs are spread over the nodes having CPUs that their
+ * luworkers and replica threads may use.
+ */
+int
+istgt_affinity_lu_node(int lu_num, const char *cfg)
+{
+	int cand[ISTGT_AFF_MAX_NODES];
+	cpu_set_t want, tmp;
+	int i, n, ncand = 0;
+
+	if (cfg != NULL) {
+		n = (int) strtol(cfg, NULL, 10);
+		if (aff_node_index(n) >= 0)
+			return (n);
+		ISTGT_ERRLOG("LU%d: numa node %s is not usable\n", lu_num, cfg);
+	}
+	if (!aff_colocate || aff_nnodes == 0)
+		return (-1);
+
+	CPU_ZERO(&want);
+	if (aff_class_set[ISTGT_AFF_LU_WORKER])
+		CPU_OR(&want, &want, &aff_class[ISTGT_AFF_LU_WORKER]);
+	if (aff_class_set[ISTGT_AFF_REPLICA])
+		CPU_OR(&want, &want, &aff_class[ISTGT_AFF_REPLICA]);
+	if (CPU_COUNT(&want) == 0)
+		want = aff_all;
+
+	for (i = 0; i < aff_nnodes; i++) {
+		CPU_AND(&tmp, &want, &aff_node[i]);
+		if (CPU_COUNT(&tmp) != 0)
+			cand[ncand++] = aff_node_ids[i];
+	}
+	if (ncand == 0)
+		return (-1);
+	return (cand[lu_num % ncand]);
+}
+
+/*
+ * Called by a thread on itself.  The class CPU list is narrowed down to
+ * the node of the LU the thread works for; if they don't overlap the
+ * node wins, as colocation is what was asked for.
+ */
+int
+istgt_affinity_apply(istgt_aff_class_t cls, int node)
+{
+	cpu_set_t set, tmp;
+	aff_thr_t *t;
+	int idx, rc = 0;
+
+	if (!aff_inited)
+		return (0);
+
+	set = aff_class_set[cls] ? aff_class[cls] : aff_all;
+	idx = aff_node_index(node);
+	if (idx < 0) {
+		node = -1;
+	} else {
+		CPU_AND(&tmp, &set, &aff_node[idx]);
+		set = CPU_COUNT(&tmp) != 0 ? tmp : aff_node[idx];
+	}
+
+	if (aff_class_set[cls] || node >= 0) {
+		rc = pthread_setaffinity_np(pthread_self(), sizeof (set), &set);
+		if (rc != 0) {
+			ISTGT_ERRLOG("%s: pthread_setaffinity_np() failed rc:%d\n",
+			    istgt_aff_class_name[cls], rc);
+			set = aff_all;
+		}
+	}
+	if (node >= 0)
+		istgt_affinity_mem_bind(node);
+
+	t = aff_me;
+	if (t == NULL) {
+		t = xmalloc(sizeof (*t));
+		memset(t, 0, sizeof (*t));
+		MTX_LOCK(&aff_mutex);
+		TAILQ_INSERT_TAIL(&aff_threads, t, next);
+		MTX_UNLOCK(&aff_mutex);
+		(void) pthread_setspecific(aff_key, t);
+		aff_me = t;
+	}
+	MTX_LOCK(&aff_mutex);
+	strlcpy(t->ent.name, tinfo, sizeof (t->ent.name));
+	t->ent.cls = cls;
+	t->ent.node = node;
+	aff_format_cpulist(&set, t->ent.cpus, sizeof (t->ent.cpus));
+	MTX_UNLOCK(&aff_mutex);
+	return (rc);
+}
+
+/*
+ * Make the calling thread prefer memory of the node for the pages it
+ * touches from now on.  Pages already faulted in stay where they are.
+ */
+void
+istgt_affinity_mem_bind(int node)
+{
+	unsigned long mask;
+
+	if (!aff_numabind || aff_node_index(node) < 0)
+		return;
+	mask = 1UL << node;
+	if (syscall(SYS_set_mempolicy, AFF_MPOL_PREFERRED, &mask,
+	    (unsigned long)ISTGT_AFF_MAX_NODES + 1) != 0)
+		ISTGT_ERRLOG("set_mempolicy(%d) failed errno:%d\n", node,
+		    errno);
+}
+
+void
+istgt_affinity_mem_unbind(void)
+{
+	if (!aff_numabind)
+		return;
+	(void) syscall(SYS_set_mempolicy, AFF_MPOL_DEFAULT, NULL, 0UL);
+}
+
+int
+istgt_affinity_class_cpus(istgt_aff_class_t cls, char *buf, int len)
+{
+	if (!aff_class_set[cls]) {
+		strlcpy(buf, "all", len);
+		return (0);
+	}
+	return (aff_format_cpulist(&aff_class[cls], buf, len));
+}
+
+/* node is an index here, 0 .. istgt_affinity_nnodes() - 1 */
+int
+istgt_affinity_node_cpus(int node, char *buf, int len)
+{
+	if (node < 0 || node >= aff_nnodes)
+		return (-1);
+	aff_format_cpulist(&aff_node[node], buf, len);
+	return (aff_node_ids[node]);
+}
+
+int
+istgt_affinity_nnodes(void)
+{
+	return (aff_nnodes);
+}
+
+int
+istgt_affinity_snapshot(ISTGT_AFFINITY_ENT *ent, int max)
+{
+	aff_thr_t *t;
+	int n = 0;
+
+	MTX_LOCK(&aff_mutex);
+	TAILQ_FOREACH(t, &aff_threads, next) {
+		if (n >= max)
+			break;
+		ent[n++] = t->ent;
+	}
+	MTX_UNLOCK(&aff_mutex);
+	return (n);
+}
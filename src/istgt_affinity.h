@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef	ISTGT_AFFINITY_H
+#define	ISTGT_AFFINITY_H
+
+/*
+ * CPU and NUMA placement of the data path threads.
+ *
+ * Every thread class can be given a CPU list.  With colocation enabled
+ * each LU is assigned a NUMA node, and the luscheduler, luworkers,
+ * maintenance thread and replica threads of that LU run on the CPUs of
+ * that node only; with NUMA binding they also prefer memory of that
+ * node for what they allocate.  Threads record the placement they got,
+ * which is what istgtcontrol reports.
+ */
+
+typedef enum istgt_aff_class {
+	ISTGT_AFF_CONN_WORKER = 0,
+	ISTGT_AFF_CONN_SENDER,
+	ISTGT_AFF_LU_SCHEDULER,
+	ISTGT_AFF_LU_WORKER,
+	ISTGT_AFF_LU_MAINT,
+	ISTGT_AFF_REPLICA,
+	ISTGT_AFF_NCLASSES
+} istgt_aff_class_t;
+
+#define	ISTGT_AFF_MAX_NODES	64
+#define	ISTGT_AFF_CPULIST_LEN	128
+
+typedef struct istgt_affinity_ent {
+	char name[50];		/* tinfo of the thread */
+	int cls;
+	int node;		/* -1 if not bound to a node */
+	char cpus[ISTGT_AFF_CPULIST_LEN];
+} ISTGT_AFFINITY_ENT;
+
+/* config keys of the thread classes, indexed by istgt_aff_class_t */
+extern const char *istgt_aff_class_key[ISTGT_AFF_NCLASSES];
+extern const char *istgt_aff_class_name[ISTGT_AFF_NCLASSES];
+
+int istgt_affinity_init(void);
+int istgt_affinity_set_class(istgt_aff_class_t cls, const char *cpulist);
+void istgt_affinity_set_policy(int colocate, int numabind);
+int istgt_affinity_lu_node(int lu_num, const char *cfg);
+int istgt_affinity_apply(istgt_aff_class_t cls, int node);
+void istgt_affinity_mem_bind(int node);
+void istgt_affinity_mem_unbind(void);
+int istgt_affinity_class_cpus(istgt_aff_class_t cls, char *buf, int len);
+int istgt_affinity_node_cpus(int node, char *buf, int len);
+int istgt_affinity_nnodes(void);
+void istgt_affinity_get_policy(int *colocate, int *numabind);
+int istgt_affinity_snapshot(ISTGT_AFFINITY_ENT *ent, int max);
+
+#endif /* ISTGT_AFFINITY_H */
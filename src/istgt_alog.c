@@ -0,0 +1,413 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "istgt_alog.h"
+#include "istgt_log.h"
+
+/*
+ * Messages are formatted by the caller: deferring the formatting would
+ * mean keeping %s arguments alive until the logger thread gets to them.
+ * A record is this header followed by the message, rounded up to a
+ * multiple of the header size so that one always fits before the end of
+ * the ring; a record that doesn't is preceded by an ALOG_PAD one.
+ */
+typedef struct alog_rec {
+	struct timespec ts;
+	int sink;
+	int prio;
+	uint32_t suppressed;
+	uint32_t len;		/* of the whole record */
+	char msg[];
+} alog_rec_t;
+
+#define	ALOG_PAD	(-1)
+#define	ALOG_REC_LEN(msglen)						\
+	((sizeof (alog_rec_t) + (msglen) + sizeof (alog_rec_t) - 1)	\
+	    / sizeof (alog_rec_t) * sizeof (alog_rec_t))
+
+typedef struct alog_ring {
+	struct alog_ring *next;
+	uint32_t head;		/* written by the owner thread only */
+	uint32_t tail;		/* written by the logger thread only */
+	int dead;		/* owner thread exited */
+	uint64_t buf[ISTGT_ALOG_RING_SIZE / sizeof (uint64_t)];
+} alog_ring_t;
+
+#define	ALOG_REC(ring, off)						\
+	((alog_rec_t *)((char *)(ring)->buf +				\
+	    ((off) & (ISTGT_ALOG_RING_SIZE - 1))))
+
+/* where the logger reports its own drop counters */
+#ifdef	REPLICATION
+#define	ALOG_OWN_SINK	ISTGT_ALOG_STDERR
+#else
+#define	ALOG_OWN_SINK	ISTGT_ALOG_SYSLOG
+#endif
+
+int g_log_ratelimit = ISTGT_ALOG_DEFAULT_RATELIMIT;
+uint64_t g_log_dropped = 0;
+uint64_t g_log_ratelimited = 0;
+
+static alog_ring_t *alog_rings = NULL;
+static __thread alog_ring_t *alog_my_ring = NULL;
+static pthread_key_t alog_key;
+static pthread_once_t alog_key_once = PTHREAD_ONCE_INIT;
+static pthread_t alog_thread;
+static int alog_running = 0;
+static int alog_efd = -1;
+static int alog_sleeping = 0;	/* logger waits on alog_efd */
+
+static void
+alog_emit(int sink, int prio, struct timespec *ts, uint32_t suppressed,
+    const char *msg)
+{
+	struct tm tm;
+	char tbuf[32];
+	int len;
+
+	if (sink == ISTGT_ALOG_STDERR) {
+		/* most messages come with their newline */
+		len = (int)strlen(msg);
+		if (len > 0 && msg[len - 1] == '\n')
+			len--;
+		localtime_r(&ts->tv_sec, &tm);
+		strftime(tbuf, sizeof (tbuf), "%Y-%m-%d/%H:%M:%S", &tm);
+		if (suppressed != 0)
+			fprintf(stderr, "%s.%03u suppressed %u messages from "
+			    "the call site below\n", tbuf,
+			    (unsigned int)(ts->tv_nsec / 1000000), suppressed);
+		fprintf(stderr, "%s.%03u %.*s\n", tbuf,
+		    (unsigned int)(ts->tv_nsec / 1000000), len, msg);
+	} else {
+		if (suppressed != 0)
+			syslog(prio, "suppressed %u messages from the call "
+			    "site below", suppressed);
+		syslog(prio, "%s", msg);
+	}
+}
+
+static void
+alog_ring_destructor(void *arg)
+{
+	alog_ring_t *ring = arg;
+
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+alog_key_init(void)
+{
+	(void) pthread_key_create(&alog_key, alog_ring_destructor);
+}
+
+static alog_ring_t *
+alog_get_ring(void)
+{
+	alog_ring_t *ring = alog_my_ring;
+
+	if (ring != NULL)
+		return (ring);
+
+	ring = calloc(1, sizeof (*ring));
+	if (ring == NULL)
+		return (NULL);
+	(void) pthread_setspecific(alog_key, ring);
+
+	/* lock-free push, the logger thread is the only one unlinking */
+	ring->next = __atomic_load_n(&alog_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&alog_rings, &ring->next, ring,
+	    1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	alog_my_ring = ring;
+	return (ring);
+}
+
+/*
+ * Returns 1 if the call site exceeded its budget for this second.
+ * The number of records suppressed in the previous second is handed
+ * back in *suppressed so that it can be reported with this record.
+ */
+static int
+alog_ratelimit(istgt_log_site_t *site, uint32_t *suppressed)
+{
+	struct timespec now;
+	uint64_t w;
+
+	*suppressed = 0;
+	if (site == NULL || g_log_ratelimit <= 0)
+		return (0);
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	w = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+	if (w != (uint64_t)now.tv_sec &&
+	    __atomic_compare_exchange_n(&site->window, &w,
+	    (uint64_t)now.tv_sec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		*suppressed = __atomic_exchange_n(&site->suppressed, 0,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) >
+	    (uint32_t)g_log_ratelimit) {
+		__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&g_log_ratelimited, 1, __ATOMIC_RELAXED);
+		return (1);
+	}
+	return (0);
+}
+
+void
+istgt_alog(istgt_log_site_t *site, int sink, int prio, const char *format,
+    ...)
+{
+	static const char cut[] = "...\n";
+	alog_ring_t *ring;
+	alog_rec_t *rec;
+	struct timespec ts;
+	uint32_t head, tail, suppressed, len, room;
+	char buf[ISTGT_ALOG_MSGLEN];
+	va_list ap;
+	int n;
+
+	if (alog_ratelimit(site, &suppressed))
+		return;
+
+	va_start(ap, format);
+	n = vsnprintf(buf, sizeof (buf), format, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t)n >= sizeof (buf)) {
+		memcpy(buf + sizeof (buf) - sizeof (cut), cut, sizeof (cut));
+		n = sizeof (buf) - 1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	if (!__atomic_load_n(&alog_running, __ATOMIC_ACQUIRE) ||
+	    (ring = alog_get_ring()) == NULL) {
+		alog_emit(sink, prio, &ts, suppressed, buf);
+		return;
+	}
+
+	len = ALOG_REC_LEN(n + 1);
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	room = ISTGT_ALOG_RING_SIZE - (head & (ISTGT_ALOG_RING_SIZE - 1));
+	if (room < len &&
+	    head - tail + room + len <= ISTGT_ALOG_RING_SIZE) {
+		rec = ALOG_REC(ring, head);
+		rec->sink = ALOG_PAD;
+		rec->len = room;
+		head += room;
+	}
+	if (head - tail + len > ISTGT_ALOG_RING_SIZE) {
+		__atomic_add_fetch(&g_log_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = ALOG_REC(ring, head);
+	rec->ts = ts;
+	rec->sink = sink;
+	rec->prio = prio;
+	rec->suppressed = suppressed;
+	rec->len = len;
+	memcpy(rec->msg, buf, n + 1);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in alog_worker() before it drains again */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&alog_sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&alog_sleeping, 0, __ATOMIC_RELAXED))
+		(void) eventfd_write(alog_efd, 1);
+}
+
+static int
+alog_drain_ring(alog_ring_t *ring)
+{
+	alog_rec_t *rec;
+	uint32_t head, tail;
+	int count = 0;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		rec = ALOG_REC(ring, tail);
+		if (rec->sink != ALOG_PAD) {
+			alog_emit(rec->sink, rec->prio, &rec->ts,
+			    rec->suppressed, rec->msg);
+			count++;
+		}
+		tail += rec->len;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	return (count);
+}
+
+static void
+alog_unlink_ring(alog_ring_t *prev, alog_ring_t *ring)
+{
+	alog_ring_t *expected = ring;
+
+	if (prev != NULL) {
+		prev->next = ring->next;
+		return;
+	}
+
+	/* ring was the head, but a new ring may have been pushed since */
+	if (__atomic_compare_exchange_n(&alog_rings, &expected, ring->next,
+	    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	for (prev = expected; prev->next != ring; prev = prev->next)
+		;
+	prev->next = ring->next;
+}
+
+static int
+alog_drain_all(void)
+{
+	alog_ring_t *ring, *prev = NULL, *next;
+	int count = 0, dead;
+
+	ring = __atomic_load_n(&alog_rings, __ATOMIC_ACQUIRE);
+	while (ring != NULL) {
+		dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		count += alog_drain_ring(ring);
+		next = ring->next;
+		if (dead) {
+			/* owner is gone, nothing can be queued anymore */
+			alog_unlink_ring(prev, ring);
+			free(ring);
+		} else {
+			prev = ring;
+		}
+		ring = next;
+	}
+	return (count);
+}
+
+static void *
+alog_worker(void *arg __attribute__((__unused__)))
+{
+	struct timespec now, last;
+	uint64_t dropped, ratelimited, last_dropped = 0, last_ratelimited = 0;
+	struct timespec ts;
+	struct pollfd pfd;
+	eventfd_t val;
+	char msg[128];
+	int count;
+
+	snprintf(tinfo, sizeof (tinfo), "logger");
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
+
+	while (1) {
+		count = alog_drain_all();
+
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		if (now.tv_sec - last.tv_sec >= 10) {
+			last = now;
+			dropped = __atomic_load_n(&g_log_dropped,
+			    __ATOMIC_RELAXED);
+			ratelimited = __atomic_load_n(&g_log_ratelimited,
+			    __ATOMIC_RELAXED);
+			if (dropped != last_dropped ||
+			    ratelimited != last_ratelimited) {
+				snprintf(msg, sizeof (msg), "logger: %lu "
+				    "records dropped, %lu rate limited so far",
+				    dropped, ratelimited);
+				clock_gettime(CLOCK_REALTIME, &ts);
+				alog_emit(ALOG_OWN_SINK, LOG_WARNING, &ts, 0,
+				    msg);
+				last_dropped = dropped;
+				last_ratelimited = ratelimited;
+			}
+		}
+
+		if (count != 0)
+			continue;
+		if (!__atomic_load_n(&alog_running, __ATOMIC_ACQUIRE))
+			break;
+
+		/* idle, wait for a producer to find us sleeping */
+		__atomic_store_n(&alog_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (alog_drain_all() == 0 &&
+		    __atomic_load_n(&alog_running, __ATOMIC_ACQUIRE)) {
+			pfd.fd = alog_efd;
+			pfd.events = POLLIN;
+			/* wake up anyway for the drop counters above */
+			if (poll(&pfd, 1, 10 * 1000) > 0)
+				(void) eventfd_read(alog_efd, &val);
+		}
+		__atomic_store_n(&alog_sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return (NULL);
+}
+
+int
+istgt_alog_start(void)
+{
+	const char *val;
+	int rc;
+
+	if (alog_running)
+		return (0);
+
+	val = getenv("ISTGT_LOG_RATELIMIT");
+	if (val != NULL)
+		g_log_ratelimit = (int)strtol(val, NULL, 10);
+
+	(void) pthread_once(&alog_key_once, alog_key_init);
+	/* kept open after istgt_alog_stop(), a late producer may poke it */
+	if (alog_efd < 0)
+		alog_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (alog_efd < 0)
+		return (-1);
+	__atomic_store_n(&alog_running, 1, __ATOMIC_RELEASE);
+	rc = pthread_create(&alog_thread, NULL, &alog_worker, NULL);
+	if (rc != 0) {
+		__atomic_store_n(&alog_running, 0, __ATOMIC_RELEASE);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+istgt_alog_stop(void)
+{
+	if (!alog_running)
+		return;
+
+	__atomic_store_n(&alog_running, 0, __ATOMIC_RELEASE);
+	(void) eventfd_write(alog_efd, 1);
+	(void) pthread_join(alog_thread, NULL);
+	/* pick up records queued while the logger was exiting */
+	(void) alog_drain_all();
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef	ISTGT_ALOG_H
+#define	ISTGT_ALOG_H
+
+#include <stdint.h>
+
+/*
+ * Asynchronous logging.
+ *
+ * Log macros format the message into a per-thread single producer/single
+ * consumer byte ring and return; a logger thread, woken through an eventfd
+ * when it went idle, drains the rings and does the actual syslog()/stderr
+ * write.  Records take only the bytes of their message, those longer than
+ * ISTGT_ALOG_MSGLEN are cut and end in "...".  Records that don't fit in
+ * the ring are dropped and counted.  Every call site carries an
+ * istgt_log_site_t so that a site firing in a loop gets rate limited
+ * to g_log_ratelimit records per second.
+ *
+ * Until istgt_alog_start() is called (and after istgt_alog_stop()),
+ * records are written synchronously from the caller's thread.
+ */
+
+/* where a record goes */
+#define	ISTGT_ALOG_SYSLOG	0	/* syslog(prio, ...) */
+#define	ISTGT_ALOG_STDERR	1	/* timestamped line on stderr */
+
+#define	ISTGT_ALOG_MSGLEN	1024
+#define	ISTGT_ALOG_RING_SIZE	(16 * 1024)	/* bytes, power of 2 */
+#define	ISTGT_ALOG_DEFAULT_RATELIMIT	200
+
+typedef struct istgt_log_site {
+	uint64_t window;	/* second the counters belong to */
+	uint32_t count;
+	uint32_t suppressed;
+} istgt_log_site_t;
+
+extern int g_log_ratelimit;
+extern uint64_t g_log_dropped;
+extern uint64_t g_log_ratelimited;
+
+void istgt_alog(istgt_log_site_t *site, int sink, int prio,
+    const char *format, ...) __attribute__((__format__(__printf__, 4, 5)));
+int istgt_alog_start(void);
+void istgt_alog_stop(void);
+
+#endif /* ISTGT_ALOG_H */
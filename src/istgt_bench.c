@@ -0,0 +1,1388 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * istgt_bench: load generator for the LU/replication IO path.
+ *
+ * Volumes are registered with the replication module exactly as istgt does
+ * it, and every volume is backed by in-process in-memory mock replicas that
+ * talk the replica protocol over loopback.  Worker threads then issue
+ * READ_16/WRITE_16 commands through replicate() with a fixed queue depth
+ * per volume, and the tool reports IOPS, MB/s and latency percentiles as
+ * JSON on stdout.  Logs go to stderr.  With -F a share of the commands are
+ * SYNCHRONIZE_CACHE_16 sent the way the LU sends them, and every flush
+ * checks that the worker's last acked write was flushed on a quorum of
+ * the mock replicas.
+ *
+ * The IO path of each volume runs in a forked child so that volumes don't
+ * share the replication module's locks, and the parent aggregates the
+ * results.  With -M all volumes are instead registered in one process and
+ * only the management plane is exercised: the tool reports how long every
+ * volume takes to turn healthy and how evenly the periodic replica polls
+ * are spread over time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "config.h"
+#include "istgt_misc.h"
+#include "istgt_proto.h"
+#include "istgt_scsi.h"
+#include "replication.h"
+#include "istgt_integration.h"
+#include "replication_misc.h"
+#include "assert.h"
+
+__thread char tinfo[50] = {0};
+int g_trace_flag = 0;
+
+extern int replica_poll_time;
+extern int replica_timeout;
+extern int replica_mgmt_shards;
+extern cstor_conn_ops_t cstor_ops;
+
+#define	BENCH_CTRL_PORT		6060
+#define	BENCH_REPLICA_PORT	6161
+#define	BENCH_SECTOR_SIZE	512
+#define	BENCH_MAX_VOLUMES	254
+#define	BENCH_NAME_LEN		256
+/* time a mock replica spends on a SYNC, roughly a ZIL commit */
+#define	BENCH_SYNC_USEC		500
+
+/*
+ * Latency histogram: values below 2^BENCH_HIST_SUB_BITS usec are kept
+ * exactly, larger values land in one of 2^BENCH_HIST_SUB_BITS linear
+ * sub-buckets per power of two, which bounds the error to ~6%.
+ */
+#define	BENCH_HIST_SUB_BITS	4
+#define	BENCH_HIST_SUB		(1 << BENCH_HIST_SUB_BITS)
+#define	BENCH_HIST_BUCKETS	((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+typedef struct bench_hist_s {
+	uint64_t bucket[BENCH_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_usec;
+	uint64_t max_usec;
+} bench_hist_t;
+
+typedef struct bench_replica_s {
+	char volname[MAX_NAME_LEN];
+	char replica_id[REPLICA_ID_LEN];
+	char ctrl_ip[MAX_IP_LEN];
+	uint16_t port;
+	uint64_t volsize;
+
+	/* in-memory backing store and per-sector io_num metadata */
+	uint8_t *store;
+	uint64_t *md;
+	/* flush_gen + 1 at the time each sector was written */
+	uint64_t *wgen;
+	volatile uint64_t flush_gen;
+
+	int sfd;
+	int mgmtfd;
+	int iofd;
+
+	zrepl_status_ack_t status;
+	int status_enquiry;
+
+	pthread_t mgmt_thread;
+	pthread_t io_thread;
+} bench_replica_t;
+
+typedef struct bench_worker_s {
+	spec_t *spec;
+	bench_replica_t *replicas;
+	int workerid;
+	unsigned int seed;
+	uint64_t next_offset;
+	uint64_t region_start;
+	uint64_t region_end;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t flushes;
+	uint64_t unflushed;
+	uint64_t bytes;
+	uint64_t errors;
+	bench_hist_t hist;
+	pthread_t thread;
+} bench_worker_t;
+
+typedef struct bench_result_s {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t flushes;
+	uint64_t unflushed;
+	uint64_t syncs_sent;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t elapsed_usec;
+	bench_hist_t hist;
+} bench_result_t;
+
+static uint64_t blocksize = 4096;
+static uint64_t volsize = 64 * 1024 * 1024;
+static int queue_depth = 8;
+static int read_pct = 50;
+static int flush_pct = 0;
+static bool group_sync = true;
+static bool random_io = false;
+static int num_volumes = 1;
+static int run_time = 10;
+static int r_factor = 3;
+static int c_factor = 2;
+static int lookup_luns = 0;
+static int pr_registrants = 0;
+static bool mgmt_plane = false;
+
+/* STATS requests seen by the mock replicas, per second, in -M */
+static uint64_t *stats_polls = NULL;
+static int stats_poll_secs = 0;
+static uint64_t stats_poll_start;
+
+static volatile int bench_stop = 0;
+static pthread_mutexattr_t mutex_attr;
+
+static int
+bench_read(int fd, void *buf, uint64_t nbytes)
+{
+	ssize_t count;
+	uint8_t *p = buf;
+
+	while (nbytes) {
+		count = read(fd, p, nbytes);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return (-1);
+		p += count;
+		nbytes -= count;
+	}
+	return (0);
+}
+
+static int
+bench_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t count;
+
+	while (iovcnt > 0) {
+		count = writev(fd, iov, iovcnt);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return (-1);
+		while (iovcnt > 0 && (size_t)count >= iov->iov_len) {
+			count -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + count;
+			iov->iov_len -= count;
+		}
+	}
+	return (0);
+}
+
+static int
+bench_write_full(int fd, void *buf, uint64_t nbytes)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = nbytes;
+	return (bench_writev(fd, &iov, 1));
+}
+
+static uint64_t
+bench_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+bench_count_stats_poll(void)
+{
+	uint64_t *polls = stats_polls;
+	uint64_t sec;
+
+	if (polls == NULL)
+		return;
+	sec = (bench_now_usec() - stats_poll_start) / 1000000;
+	if (sec < (uint64_t)stats_poll_secs)
+		__sync_fetch_and_add(&polls[sec], 1);
+}
+
+/*
+ * Replies to management opcodes the same way replication_test does,
+ * minus the error injection.
+ */
+static int
+bench_replica_mgmt_reply(bench_replica_t *r, zvol_io_hdr_t *hdr, void *data)
+{
+	zvol_io_hdr_t resp;
+	mgmt_ack_t ack;
+	zvol_op_stat_t stats;
+	struct iovec iov[2];
+	int iovcnt = 1;
+
+	memcpy(&resp, hdr, sizeof (resp));
+	resp.version = REPLICA_VERSION;
+	resp.status = ZVOL_OP_STATUS_OK;
+	resp.len = 0;
+
+	switch (hdr->opcode) {
+		case ZVOL_OPCODE_HANDSHAKE:
+		case ZVOL_OPCODE_PREPARE_FOR_REBUILD:
+			memset(&ack, 0, sizeof (ack));
+			strncpy(ack.ip, "127.0.0.1", sizeof (ack.ip));
+			strncpy(ack.volname, r->volname, sizeof (ack.volname));
+			strncpy(ack.replica_id, r->replica_id,
+			    sizeof (ack.replica_id));
+			ack.port = r->port;
+			ack.pool_guid = r->port;
+			ack.zvol_guid = r->port;
+			ack.checkpointed_io_seq = 1000;
+			ack.quorum = 1;
+			resp.len = sizeof (ack);
+			iov[1].iov_base = &ack;
+			iov[1].iov_len = sizeof (ack);
+			iovcnt = 2;
+			break;
+
+		case ZVOL_OPCODE_REPLICA_STATUS:
+			if (r->status_enquiry >= 2 &&
+			    r->status.state != ZVOL_STATUS_HEALTHY) {
+				r->status.state = ZVOL_STATUS_HEALTHY;
+				r->status.rebuild_status = ZVOL_REBUILDING_DONE;
+				r->status_enquiry = 0;
+			}
+			if (r->status.rebuild_status == ZVOL_REBUILDING_SNAP)
+				r->status_enquiry++;
+			resp.len = sizeof (r->status);
+			iov[1].iov_base = &r->status;
+			iov[1].iov_len = sizeof (r->status);
+			iovcnt = 2;
+			break;
+
+		case ZVOL_OPCODE_START_REBUILD:
+			r->status.rebuild_status = ZVOL_REBUILDING_SNAP;
+			break;
+
+		case ZVOL_OPCODE_STATS:
+			bench_count_stats_poll();
+			memset(&stats, 0, sizeof (stats));
+			strcpy(stats.label, "used");
+			stats.value = r->volsize;
+			resp.len = sizeof (stats);
+			iov[1].iov_base = &stats;
+			iov[1].iov_len = sizeof (stats);
+			iovcnt = 2;
+			break;
+
+		default:
+			break;
+	}
+
+	(void) data;
+	iov[0].iov_base = &resp;
+	iov[0].iov_len = sizeof (resp);
+	return (bench_writev(r->mgmtfd, iov, iovcnt));
+}
+
+static void *
+bench_replica_mgmt(void *arg)
+{
+	bench_replica_t *r = arg;
+	zvol_io_hdr_t hdr;
+	void *data;
+
+	snprintf(tinfo, sizeof (tinfo), "bmgmt%d", r->port);
+	prctl(PR_SET_NAME, tinfo, 0, 0, 0);
+
+	while ((r->mgmtfd = cstor_ops.conn_connect(r->ctrl_ip,
+	    BENCH_CTRL_PORT)) < 0)
+		usleep(100000);
+
+	while (1) {
+		if (bench_read(r->mgmtfd, &hdr, sizeof (hdr)) != 0)
+			break;
+		data = NULL;
+		if (hdr.len != 0) {
+			data = xmalloc(hdr.len);
+			if (bench_read(r->mgmtfd, data, hdr.len) != 0) {
+				xfree(data);
+				break;
+			}
+		}
+		if (bench_replica_mgmt_reply(r, &hdr, data) != 0) {
+			xfree(data);
+			break;
+		}
+		xfree(data);
+	}
+	REPLICA_ERRLOG("mgmt connection of replica(%d) closed\n", r->port);
+	return (NULL);
+}
+
+/*
+ * Builds READ response payload. When the target asks for metadata, the
+ * payload is split in runs of sectors carrying the same io_num.
+ */
+static uint8_t *
+bench_replica_build_read(bench_replica_t *r, zvol_io_hdr_t *hdr,
+    uint64_t *payload_len)
+{
+	struct zvol_io_rw_hdr *rw_hdr;
+	uint64_t start = hdr->offset, end = hdr->offset + hdr->len;
+	uint64_t off, run_start, count = 1;
+	bool md = (hdr->flags & ZVOL_OP_FLAG_READ_METADATA) ? true : false;
+	uint8_t *buf, *p;
+
+	if (md) {
+		for (off = start + BENCH_SECTOR_SIZE; off < end;
+		    off += BENCH_SECTOR_SIZE) {
+			if (r->md[off / BENCH_SECTOR_SIZE] !=
+			    r->md[(off - BENCH_SECTOR_SIZE) / BENCH_SECTOR_SIZE])
+				count++;
+		}
+	}
+
+	*payload_len = hdr->len + count * sizeof (*rw_hdr);
+	p = buf = xmalloc(*payload_len);
+	if (!md) {
+		rw_hdr = (struct zvol_io_rw_hdr *)p;
+		rw_hdr->io_num = 0;
+		rw_hdr->len = hdr->len;
+		memcpy(p + sizeof (*rw_hdr), r->store + start, hdr->len);
+		return (buf);
+	}
+
+	run_start = start;
+	for (off = start + BENCH_SECTOR_SIZE; off <= end;
+	    off += BENCH_SECTOR_SIZE) {
+		if (off < end && r->md[off / BENCH_SECTOR_SIZE] ==
+		    r->md[run_start / BENCH_SECTOR_SIZE])
+			continue;
+		rw_hdr = (struct zvol_io_rw_hdr *)p;
+		rw_hdr->io_num = r->md[run_start / BENCH_SECTOR_SIZE];
+		rw_hdr->len = off - run_start;
+		p += sizeof (*rw_hdr);
+		memcpy(p, r->store + run_start, rw_hdr->len);
+		p += rw_hdr->len;
+		run_start = off;
+	}
+	return (buf);
+}
+
+static void *
+bench_replica_io(void *arg)
+{
+	bench_replica_t *r = arg;
+	zvol_io_hdr_t hdr;
+	zvol_op_open_data_t *open_data;
+	struct zvol_io_rw_hdr *rw_hdr;
+	struct sockaddr saddr;
+	socklen_t slen = sizeof (saddr);
+	struct iovec iov[2];
+	uint8_t *data, *resp;
+	uint64_t resp_len, off;
+	int iovcnt;
+
+	snprintf(tinfo, sizeof (tinfo), "bio%d", r->port);
+	prctl(PR_SET_NAME, tinfo, 0, 0, 0);
+
+	r->iofd = accept(r->sfd, &saddr, &slen);
+	if (r->iofd < 0) {
+		REPLICA_ERRLOG("accept failed for replica(%d) err(%d)\n",
+		    r->port, errno);
+		return (NULL);
+	}
+
+	while (1) {
+		if (bench_read(r->iofd, &hdr, sizeof (hdr)) != 0)
+			break;
+
+		data = resp = NULL;
+		if ((hdr.opcode == ZVOL_OPCODE_WRITE ||
+		    hdr.opcode == ZVOL_OPCODE_HANDSHAKE ||
+		    hdr.opcode == ZVOL_OPCODE_OPEN) && hdr.len != 0) {
+			data = xmalloc(hdr.len);
+			if (bench_read(r->iofd, data, hdr.len) != 0) {
+				xfree(data);
+				break;
+			}
+		}
+
+		hdr.status = ZVOL_OP_STATUS_OK;
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof (hdr);
+		iovcnt = 1;
+
+		switch (hdr.opcode) {
+			case ZVOL_OPCODE_OPEN:
+				open_data = (zvol_op_open_data_t *)data;
+				if (open_data->replication_factor == 1) {
+					r->status.state = ZVOL_STATUS_HEALTHY;
+					r->status.rebuild_status =
+					    ZVOL_REBUILDING_DONE;
+				}
+				hdr.len = 0;
+				break;
+
+			case ZVOL_OPCODE_WRITE:
+				rw_hdr = (struct zvol_io_rw_hdr *)data;
+				if (hdr.offset + rw_hdr->len > r->volsize) {
+					hdr.status = ZVOL_OP_STATUS_FAILED;
+					break;
+				}
+				memcpy(r->store + hdr.offset,
+				    data + sizeof (*rw_hdr), rw_hdr->len);
+				for (off = hdr.offset;
+				    off < hdr.offset + rw_hdr->len;
+				    off += BENCH_SECTOR_SIZE) {
+					r->md[off / BENCH_SECTOR_SIZE] =
+					    rw_hdr->io_num;
+					r->wgen[off / BENCH_SECTOR_SIZE] =
+					    r->flush_gen + 1;
+				}
+				break;
+
+			case ZVOL_OPCODE_SYNC:
+				usleep(BENCH_SYNC_USEC);
+				r->flush_gen++;
+				hdr.len = 0;
+				break;
+
+			case ZVOL_OPCODE_READ:
+				if (hdr.offset + hdr.len > r->volsize) {
+					hdr.status = ZVOL_OP_STATUS_FAILED;
+					hdr.len = 0;
+					break;
+				}
+				resp = bench_replica_build_read(r, &hdr,
+				    &resp_len);
+				hdr.len = resp_len;
+				iov[1].iov_base = resp;
+				iov[1].iov_len = resp_len;
+				iovcnt = 2;
+				break;
+
+			default:
+				hdr.len = 0;
+				break;
+		}
+
+		if (bench_writev(r->iofd, iov, iovcnt) != 0) {
+			xfree(data);
+			xfree(resp);
+			break;
+		}
+		xfree(data);
+		xfree(resp);
+	}
+	REPLICA_ERRLOG("data connection of replica(%d) closed\n", r->port);
+	return (NULL);
+}
+
+static int
+bench_replica_start(bench_replica_t *r, const char *volname,
+    const char *ctrl_ip, int port)
+{
+	memset(r, 0, sizeof (*r));
+	strncpy(r->volname, volname, sizeof (r->volname) - 1);
+	strncpy(r->ctrl_ip, ctrl_ip, sizeof (r->ctrl_ip) - 1);
+	snprintf(r->replica_id, sizeof (r->replica_id), "%d", port);
+	r->port = port;
+	r->volsize = volsize;
+	r->status.state = ZVOL_STATUS_DEGRADED;
+	r->status.rebuild_status = ZVOL_REBUILDING_INIT;
+
+	r->store = calloc(1, volsize);
+	r->md = calloc(volsize / BENCH_SECTOR_SIZE, sizeof (uint64_t));
+	r->wgen = calloc(volsize / BENCH_SECTOR_SIZE, sizeof (uint64_t));
+	if (r->store == NULL || r->md == NULL || r->wgen == NULL) {
+		REPLICA_ERRLOG("failed to allocate %lu bytes for replica(%d)\n",
+		    volsize, port);
+		return (-1);
+	}
+
+	r->sfd = cstor_ops.conn_listen("127.0.0.1", port, 32, 0);
+	if (r->sfd < 0) {
+		REPLICA_ERRLOG("conn_listen failed for replica(%d) err(%d)\n",
+		    port, errno);
+		return (-1);
+	}
+
+	pthread_create(&r->io_thread, NULL, &bench_replica_io, r);
+	pthread_create(&r->mgmt_thread, NULL, &bench_replica_mgmt, r);
+	return (0);
+}
+
+static spec_t *
+bench_volume_create(int volid)
+{
+	spec_t *spec;
+	ISTGT_LU_Ptr lu;
+	char volname[MAX_NAME_LEN];
+	int k;
+
+	spec = xmalloc(sizeof (*spec));
+	lu = xmalloc(sizeof (*lu));
+	memset(spec, 0, sizeof (*spec));
+	memset(lu, 0, sizeof (*lu));
+
+	snprintf(volname, sizeof (volname), "benchvol%d", volid);
+	spec->volname = xstrdup(volname);
+	spec->blocklen = BENCH_SECTOR_SIZE;
+	spec->blockcnt = volsize / BENCH_SECTOR_SIZE;
+
+	for (k = 0; k < ISTGT_MAX_NUM_LUWORKERS; k++) {
+		if (pthread_cond_init(&spec->luworker_rcond[k], NULL) != 0 ||
+		    pthread_mutex_init(&spec->luworker_rmutex[k],
+		    &mutex_attr) != 0) {
+			REPLICA_ERRLOG("luworker %d init failed errno:%d\n",
+			    k, errno);
+			return (NULL);
+		}
+	}
+
+	lu->desired_replication_factor = r_factor;
+	TAILQ_INIT(&lu->trusty_replicas);
+	spec->lu = lu;
+
+	if (initialize_volume(spec, r_factor, c_factor, r_factor) != 0)
+		return (NULL);
+	return (spec);
+}
+
+static int
+bench_hist_index(uint64_t usec)
+{
+	int msb;
+
+	if (usec < BENCH_HIST_SUB)
+		return ((int)usec);
+	msb = 63 - __builtin_clzll(usec);
+	return ((msb - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+	    (int)((usec >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1)));
+}
+
+static uint64_t
+bench_hist_value(int idx)
+{
+	int msb;
+
+	if (idx < BENCH_HIST_SUB)
+		return ((uint64_t)idx);
+	msb = idx / BENCH_HIST_SUB + BENCH_HIST_SUB_BITS - 1;
+	return (((uint64_t)(BENCH_HIST_SUB + idx % BENCH_HIST_SUB)) <<
+	    (msb - BENCH_HIST_SUB_BITS));
+}
+
+static void
+bench_hist_add(bench_hist_t *h, uint64_t usec)
+{
+	h->bucket[bench_hist_index(usec)]++;
+	h->count++;
+	h->sum_usec += usec;
+	if (usec > h->max_usec)
+		h->max_usec = usec;
+}
+
+static void
+bench_hist_merge(bench_hist_t *dst, bench_hist_t *src)
+{
+	int i;
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	dst->sum_usec += src->sum_usec;
+	if (src->max_usec > dst->max_usec)
+		dst->max_usec = src->max_usec;
+}
+
+static uint64_t
+bench_hist_percentile(bench_hist_t *h, uint64_t permille)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	if (h->count == 0)
+		return (0);
+	target = (h->count * permille + 999) / 1000;
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= target)
+			return (bench_hist_value(i));
+	}
+	return (h->max_usec);
+}
+
+/*
+ * A write acked before a flush was sent has to be on stable storage of at
+ * least consistency factor replicas once the flush is acked.
+ */
+static bool
+bench_unflushed(bench_replica_t *replicas, uint64_t offset)
+{
+	uint64_t sector = offset / BENCH_SECTOR_SIZE;
+	int i, flushed = 0;
+
+	for (i = 0; i < r_factor; i++)
+		if (replicas[i].wgen[sector] <= replicas[i].flush_gen)
+			flushed++;
+	return (flushed < c_factor);
+}
+
+static void *
+bench_worker(void *arg)
+{
+	bench_worker_t *w = arg;
+	spec_t *spec = w->spec;
+	ISTGT_LU_CMD lu_cmd;
+	uint64_t offset, start, nblocks, last_write = 0;
+	uint8_t *pattern, *wbuf;
+	bool is_read, is_flush, written = false;
+	int64_t rc;
+	uint64_t i;
+
+	snprintf(tinfo, sizeof (tinfo), "bench%d", w->workerid);
+	prctl(PR_SET_NAME, tinfo, 0, 0, 0);
+
+	pattern = xmalloc(blocksize);
+	for (i = 0; i < blocksize; i++)
+		pattern[i] = rand_r(&w->seed) & 0xff;
+
+	memset(&lu_cmd, 0, sizeof (lu_cmd));
+	ISTGT_SGL_INIT(&lu_cmd);
+	nblocks = (w->region_end - w->region_start) / blocksize;
+
+	while (!bench_stop) {
+		if (random_io)
+			offset = w->region_start +
+			    (rand_r(&w->seed) % nblocks) * blocksize;
+		else {
+			offset = w->next_offset;
+			w->next_offset += blocksize;
+			if (w->next_offset >= w->region_end)
+				w->next_offset = w->region_start;
+		}
+		is_flush = ((int)(rand_r(&w->seed) % 100) < flush_pct);
+		is_read = ((int)(rand_r(&w->seed) % 100) < read_pct);
+
+		lu_cmd.luworkerindx = w->workerid;
+		lu_cmd.iobufindx = 0;
+		lu_cmd.iobufsize = blocksize;
+		lu_cmd.data = NULL;
+		if (is_flush) {
+			lu_cmd.cdb0 = SBC_SYNCHRONIZE_CACHE_16;
+			lu_cmd.iobufsize = 0;
+			start = bench_now_usec();
+			rc = group_sync ?
+			    replicate_sync(spec, &lu_cmd, offset, blocksize) :
+			    replicate(spec, &lu_cmd, offset, blocksize);
+			bench_hist_add(&w->hist, bench_now_usec() - start);
+			if (rc < 0) {
+				w->errors++;
+				continue;
+			}
+			w->flushes++;
+			if (written && bench_unflushed(w->replicas, last_write))
+				w->unflushed++;
+			continue;
+		} else if (is_read) {
+			lu_cmd.cdb0 = SBC_READ_16;
+		} else {
+			/* replication module owns and frees write buffers */
+			wbuf = xmalloc(blocksize);
+			memcpy(wbuf, pattern, blocksize);
+			lu_cmd.cdb0 = SBC_WRITE_16;
+			lu_cmd.iobuf[0].iov_base = wbuf;
+			lu_cmd.iobuf[0].iov_len = blocksize;
+		}
+
+		start = bench_now_usec();
+		rc = replicate(spec, &lu_cmd, offset, blocksize);
+		bench_hist_add(&w->hist, bench_now_usec() - start);
+
+		if (rc != (int64_t)blocksize)
+			w->errors++;
+		else if (is_read)
+			w->reads++;
+		else {
+			w->writes++;
+			last_write = offset;
+			written = true;
+		}
+		if (rc == (int64_t)blocksize)
+			w->bytes += blocksize;
+
+		if (lu_cmd.data != NULL) {
+			xfree(lu_cmd.data);
+			lu_cmd.data = NULL;
+		}
+	}
+
+	xfree(pattern);
+	return (NULL);
+}
+
+static void
+usage(void)
+{
+	printf("istgt_bench [options]\n");
+	printf("options:\n");
+	printf(" -b block size in bytes (default 4096)\n");
+	printf(" -q queue depth per volume (default 8, max %d)\n",
+	    ISTGT_MAX_NUM_LUWORKERS);
+	printf(" -r read percentage 0-100 (default 50)\n");
+	printf(" -F flush percentage 0-100 (default 0)\n");
+	printf(" -G send every flush on its own instead of group commit\n");
+	printf(" -R random offsets (default sequential)\n");
+	printf(" -n number of volumes (default 1, max %d)\n",
+	    BENCH_MAX_VOLUMES);
+	printf(" -s volume size in MB (default 64)\n");
+	printf(" -f replication factor (default 3)\n");
+	printf(" -c consistency factor (default 2)\n");
+	printf(" -t run time in seconds (default 10)\n");
+	printf(" -L only measure target/volume name lookups over this many "
+	    "LUs\n");
+	printf(" -P only measure PR permission checks with this many "
+	    "registrants (max %d)\n", ISTGT_SIDX_SLOTS);
+	printf(" -M only measure the management plane, all volumes in one "
+	    "process\n");
+	exit(1);
+}
+
+static void
+process_options(int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:q:r:F:GRn:s:f:c:t:L:P:Mh")) != -1) {
+		switch (ch) {
+			case 'b':
+				blocksize = strtoull(optarg, NULL, 10);
+				break;
+			case 'q':
+				queue_depth = atoi(optarg);
+				break;
+			case 'r':
+				read_pct = atoi(optarg);
+				break;
+			case 'F':
+				flush_pct = atoi(optarg);
+				break;
+			case 'G':
+				group_sync = false;
+				break;
+			case 'R':
+				random_io = true;
+				break;
+			case 'n':
+				num_volumes = atoi(optarg);
+				break;
+			case 's':
+				volsize = strtoull(optarg, NULL, 10) *
+				    1024 * 1024;
+				break;
+			case 'f':
+				r_factor = atoi(optarg);
+				break;
+			case 'c':
+				c_factor = atoi(optarg);
+				break;
+			case 't':
+				run_time = atoi(optarg);
+				break;
+			case 'L':
+				lookup_luns = atoi(optarg);
+				if (lookup_luns <= 0)
+					usage();
+				break;
+			case 'P':
+				pr_registrants = atoi(optarg);
+				if (pr_registrants <= 0 ||
+				    pr_registrants > ISTGT_SIDX_SLOTS)
+					usage();
+				break;
+			case 'M':
+				mgmt_plane = true;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (blocksize == 0 || (blocksize % BENCH_SECTOR_SIZE) != 0 ||
+	    queue_depth <= 0 || queue_depth > ISTGT_MAX_NUM_LUWORKERS ||
+	    read_pct < 0 || read_pct > 100 || flush_pct < 0 ||
+	    flush_pct > 100 || num_volumes <= 0 ||
+	    num_volumes > BENCH_MAX_VOLUMES ||
+	    r_factor <= 0 || r_factor > MAXREPLICA || c_factor <= 0 ||
+	    c_factor > r_factor || run_time <= 0 ||
+	    volsize < blocksize * queue_depth)
+		usage();
+}
+
+/*
+ * Runs the workload against a single volume, with the management listener
+ * on its own loopback address (127.0.0.<volid>).  The child reports
+ * readiness on res_fd, waits for the go byte on go_fd so that all volumes
+ * start together, and finally writes its bench_result_t to res_fd.
+ */
+static void
+bench_run_volume(int volid, int res_fd, int go_fd)
+{
+	spec_t *spec;
+	bench_replica_t *replicas;
+	bench_worker_t *workers;
+	bench_result_t res;
+	pthread_t mgmt_thread;
+	char ctrl_ip[MAX_IP_LEN];
+	uint64_t region, start;
+	int i, k, wait_sec;
+	char c = 0;
+
+	snprintf(ctrl_ip, sizeof (ctrl_ip), "127.0.0.%d", volid);
+	setenv("externalIP", ctrl_ip, 1);
+
+	if (initialize_replication() != 0)
+		_exit(1);
+
+	spec = bench_volume_create(volid);
+	if (spec == NULL) {
+		REPLICA_ERRLOG("failed to create volume %d\n", volid);
+		_exit(1);
+	}
+
+	pthread_create(&mgmt_thread, NULL, &init_replication, NULL);
+
+	replicas = xmalloc(sizeof (*replicas) * r_factor);
+	for (i = 0; i < r_factor; i++) {
+		k = (volid - 1) * r_factor + i;
+		if (bench_replica_start(&replicas[i], spec->volname, ctrl_ip,
+		    BENCH_REPLICA_PORT + k) != 0)
+			_exit(1);
+	}
+
+	/* Wait for every replica to finish rebuild and turn healthy */
+	for (wait_sec = 0; !spec->ready || spec->healthy_rcount < r_factor;
+	    wait_sec++) {
+		if (wait_sec > 60 + 10 * r_factor) {
+			REPLICA_ERRLOG("volume %s didn't become healthy\n",
+			    spec->volname);
+			_exit(1);
+		}
+		sleep(1);
+	}
+
+	if (write(res_fd, &c, 1) != 1 || read(go_fd, &c, 1) != 1)
+		_exit(1);
+
+	workers = xmalloc(sizeof (*workers) * queue_depth);
+	memset(workers, 0, sizeof (*workers) * queue_depth);
+	region = (volsize / queue_depth) / blocksize * blocksize;
+	for (i = 0; i < queue_depth; i++) {
+		workers[i].spec = spec;
+		workers[i].replicas = replicas;
+		workers[i].workerid = i;
+		workers[i].seed = (unsigned int)(bench_now_usec() + volid * 997 + i);
+		workers[i].region_start = i * region;
+		workers[i].region_end = workers[i].region_start + region;
+		workers[i].next_offset = workers[i].region_start;
+	}
+
+	start = bench_now_usec();
+	for (i = 0; i < queue_depth; i++)
+		pthread_create(&workers[i].thread, NULL, &bench_worker,
+		    &workers[i]);
+	sleep(run_time);
+	bench_stop = 1;
+	for (i = 0; i < queue_depth; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	memset(&res, 0, sizeof (res));
+	res.elapsed_usec = bench_now_usec() - start;
+	for (i = 0; i < queue_depth; i++) {
+		res.reads += workers[i].reads;
+		res.writes += workers[i].writes;
+		res.flushes += workers[i].flushes;
+		res.unflushed += workers[i].unflushed;
+		res.bytes += workers[i].bytes;
+		res.errors += workers[i].errors;
+		bench_hist_merge(&res.hist, &workers[i].hist);
+	}
+	res.syncs_sent = group_sync ? spec->gs_syncs : res.flushes;
+
+	if (bench_write_full(res_fd, &res, sizeof (res)) != 0)
+		_exit(1);
+
+	/* replication threads don't support teardown, just leave */
+	_exit(0);
+}
+
+/*
+ * Lookup rate of the name indexes against the linear strcasecmp scan they
+ * replaced, at the LU count given with -L.  Login resolves a target name,
+ * replica registration a volume name; both are looked up with random case
+ * as initiators don't agree on it.
+ */
+#define	BENCH_LOOKUP_ROUNDS	(1 << 20)
+#define	BENCH_LOOKUP_SCAN_ROUNDS	(1 << 14)
+
+static double
+bench_lookup_rate(char **names, int n, ISTGT_NIDX *idx, char **probe,
+    int nprobe)
+{
+	uint64_t start, elapsed;
+	volatile uintptr_t sink = 0;
+	int rounds, i, k;
+
+	/* the scan is slow enough that fewer rounds give a stable rate */
+	rounds = (idx != NULL) ? BENCH_LOOKUP_ROUNDS : BENCH_LOOKUP_SCAN_ROUNDS;
+	start = bench_now_usec();
+	for (i = 0; i < rounds; i++) {
+		if (idx != NULL) {
+			if (istgt_nidx_find(idx, probe[i % nprobe]) != NULL)
+				sink++;
+			continue;
+		}
+		for (k = 0; k < n; k++) {
+			if (strcasecmp(names[k], probe[i % nprobe]) == 0) {
+				sink += k;
+				break;
+			}
+		}
+	}
+	elapsed = bench_now_usec() - start;
+	(void) sink;
+	return (rounds / (elapsed ? elapsed / 1000000.0 : 1e-6));
+}
+
+static int
+bench_lookup(int n)
+{
+	ISTGT_NIDX tidx, vidx;
+	char **tnames, **vnames, **tprobe, **vprobe;
+	unsigned int seed = (unsigned int)bench_now_usec();
+	double lin_t, idx_t, lin_v, idx_v;
+	int nprobe = 4096, i, j;
+
+	if (istgt_nidx_init(&tidx, n) != 0 || istgt_nidx_init(&vidx, n) != 0)
+		return (1);
+	tnames = xmalloc(sizeof (char *) * n);
+	vnames = xmalloc(sizeof (char *) * n);
+	tprobe = xmalloc(sizeof (char *) * nprobe);
+	vprobe = xmalloc(sizeof (char *) * nprobe);
+	for (i = 0; i < n; i++) {
+		tnames[i] = xmalloc(BENCH_NAME_LEN);
+		vnames[i] = xmalloc(BENCH_NAME_LEN);
+		snprintf(tnames[i], BENCH_NAME_LEN,
+		    "iqn.2016-09.com.openebs.cstor:pvc-%08x-vol%d", i * 2654435761U,
+		    i);
+		snprintf(vnames[i], BENCH_NAME_LEN, "pvc-%08x-vol%d",
+		    i * 2654435761U, i);
+		istgt_nidx_add(&tidx, tnames[i], tnames[i]);
+		istgt_nidx_add(&vidx, vnames[i], vnames[i]);
+	}
+	for (i = 0; i < nprobe; i++) {
+		j = rand_r(&seed) % n;
+		tprobe[i] = xstrdup(tnames[j]);
+		vprobe[i] = xstrdup(vnames[j]);
+		for (j = 0; tprobe[i][j] != '\0'; j++)
+			if (rand_r(&seed) & 1)
+				tprobe[i][j] = toupper((int)tprobe[i][j]);
+	}
+
+	lin_t = bench_lookup_rate(tnames, n, NULL, tprobe, nprobe);
+	idx_t = bench_lookup_rate(tnames, n, &tidx, tprobe, nprobe);
+	lin_v = bench_lookup_rate(vnames, n, NULL, vprobe, nprobe);
+	idx_v = bench_lookup_rate(vnames, n, &vidx, vprobe, nprobe);
+
+	printf("{\n");
+	printf("  \"config\": {\"luns\": %d},\n", n);
+	printf("  \"target_lookups_per_sec\": {\"linear\": %.0f, "
+	    "\"indexed\": %.0f},\n", lin_t, idx_t);
+	printf("  \"volume_lookups_per_sec\": {\"linear\": %.0f, "
+	    "\"indexed\": %.0f}\n", lin_v, idx_v);
+	printf("}\n");
+
+	for (i = 0; i < nprobe; i++) {
+		xfree(tprobe[i]);
+		xfree(vprobe[i]);
+	}
+	for (i = 0; i < n; i++) {
+		xfree(tnames[i]);
+		xfree(vnames[i]);
+	}
+	xfree(tprobe);
+	xfree(vprobe);
+	xfree(tnames);
+	xfree(vnames);
+	istgt_nidx_fini(&tidx);
+	istgt_nidx_fini(&vidx);
+	return (0);
+}
+
+/*
+ * Cost of the per-IO persistent reservation check with n registrants:
+ * the linear scan of the registration table with string compares it used
+ * to be, the hashed lookup a verdict is now computed with, and the cached
+ * verdict every IO after that sees.  Every registrant issues IO.
+ */
+#define	BENCH_PR_ROUNDS		(1 << 22)
+#define	BENCH_PR_SCAN_ROUNDS	(1 << 16)
+
+typedef struct bench_pr_key {
+	uint64_t key;
+	char *iport;
+	char *tport;
+} bench_pr_key_t;
+
+static double
+bench_pr_rate(bench_pr_key_t *keys, int n, ISTGT_SIDX *idx,
+    uint64_t *verdict, uint32_t epoch, int *probe, int nprobe)
+{
+	uint64_t start, elapsed;
+	volatile uintptr_t sink = 0;
+	const char *ip, *tp;
+	int rounds, i, k;
+
+	if (verdict != NULL)
+		rounds = BENCH_PR_ROUNDS;
+	else if (idx != NULL)
+		rounds = BENCH_PR_ROUNDS >> 2;
+	else
+		rounds = BENCH_PR_SCAN_ROUNDS;
+	start = bench_now_usec();
+	for (i = 0; i < rounds; i++) {
+		k = probe[i % nprobe];
+		if (verdict != NULL) {
+			if ((uint32_t)(verdict[k] >> 32) == epoch &&
+			    ((uint32_t)verdict[k] & 0x4) != 0)
+				sink++;
+			continue;
+		}
+		ip = keys[k].iport;
+		tp = keys[k].tport;
+		if (idx != NULL) {
+			for (k = istgt_sidx_first(idx, istgt_sidx_hash(ip));
+			    k >= 0; k = istgt_sidx_next(idx, k)) {
+				if (strcmp(keys[k].iport, ip) == 0 &&
+				    strcmp(keys[k].tport, tp) == 0) {
+					sink += k;
+					break;
+				}
+			}
+			continue;
+		}
+		for (k = 0; k < n; k++) {
+			if (keys[k].key != 0 &&
+			    strcmp(keys[k].iport, ip) == 0 &&
+			    strcmp(keys[k].tport, tp) == 0) {
+				sink += k;
+				break;
+			}
+		}
+	}
+	elapsed = bench_now_usec() - start;
+	(void) sink;
+	return (rounds / (elapsed ? elapsed / 1000000.0 : 1e-6));
+}
+
+static int
+bench_pr_check(int n)
+{
+	ISTGT_SIDX idx;
+	bench_pr_key_t *keys;
+	uint64_t *verdict;
+	unsigned int seed = (unsigned int)bench_now_usec();
+	uint32_t epoch = 1;
+	double lin, hashed, cached;
+	int nprobe = 4096, *probe, i;
+
+	keys = xmalloc(sizeof (*keys) * n);
+	verdict = xmalloc(sizeof (*verdict) * n);
+	probe = xmalloc(sizeof (*probe) * nprobe);
+	istgt_sidx_reset(&idx);
+	for (i = 0; i < n; i++) {
+		keys[i].key = 0x1000 + i;
+		keys[i].iport = xmalloc(BENCH_NAME_LEN);
+		keys[i].tport = xmalloc(BENCH_NAME_LEN);
+		snprintf(keys[i].iport, BENCH_NAME_LEN,
+		    "iqn.1993-08.org.debian:01:node%d,i,0x00023d%06x", i, i);
+		snprintf(keys[i].tport, BENCH_NAME_LEN,
+		    "iqn.2016-09.com.openebs.cstor:vol1,t,0x0001");
+		istgt_sidx_add(&idx, i, istgt_sidx_hash(keys[i].iport));
+		/* holder or registrant of a *_REGISTRANTS reservation */
+		verdict[i] = ((uint64_t)epoch << 32) | 0x4;
+	}
+	for (i = 0; i < nprobe; i++)
+		probe[i] = rand_r(&seed) % n;
+
+	lin = bench_pr_rate(keys, n, NULL, NULL, epoch, probe, nprobe);
+	hashed = bench_pr_rate(keys, n, &idx, NULL, epoch, probe, nprobe);
+	cached = bench_pr_rate(keys, n, NULL, verdict, epoch, probe, nprobe);
+
+	printf("{\n");
+	printf("  \"config\": {\"registrants\": %d},\n", n);
+	printf("  \"pr_checks_per_sec\": {\"linear\": %.0f, "
+	    "\"hashed\": %.0f, \"cached\": %.0f}\n", lin, hashed, cached);
+	printf("}\n");
+
+	for (i = 0; i < n; i++) {
+		xfree(keys[i].iport);
+		xfree(keys[i].tport);
+	}
+	xfree(keys);
+	xfree(verdict);
+	xfree(probe);
+	return (0);
+}
+
+/*
+ * Management plane only: every volume is registered in this process and
+ * shares one management listener, so all replica connections land on the
+ * replication module's management shards.  Once every volume is healthy
+ * the STATS requests of the periodic poll reaching the mock replicas are
+ * counted per second for run_time seconds; polls that all fire on the
+ * same tick show up as a peak far above the mean.
+ */
+static int
+bench_mgmt_plane(void)
+{
+	spec_t **specs;
+	bench_replica_t *replicas;
+	pthread_t mgmt_thread;
+	uint64_t start, healthy_usec, total = 0, peak = 0, *polls;
+	int i, k, healthy, wait_sec;
+
+	setenv("externalIP", "127.0.0.1", 1);
+	if (initialize_replication() != 0)
+		return (1);
+
+	specs = xmalloc(sizeof (*specs) * num_volumes);
+	for (i = 0; i < num_volumes; i++) {
+		specs[i] = bench_volume_create(i + 1);
+		if (specs[i] == NULL) {
+			REPLICA_ERRLOG("failed to create volume %d\n", i + 1);
+			return (1);
+		}
+	}
+
+	pthread_create(&mgmt_thread, NULL, &init_replication, NULL);
+
+	start = bench_now_usec();
+	replicas = xmalloc(sizeof (*replicas) * num_volumes * r_factor);
+	for (i = 0; i < num_volumes; i++) {
+		for (k = 0; k < r_factor; k++) {
+			if (bench_replica_start(&replicas[i * r_factor + k],
+			    specs[i]->volname, "127.0.0.1",
+			    BENCH_REPLICA_PORT + i * r_factor + k) != 0)
+				return (1);
+		}
+	}
+
+	for (wait_sec = 0; ; wait_sec++) {
+		for (healthy = 0, i = 0; i < num_volumes; i++) {
+			if (specs[i]->ready &&
+			    specs[i]->healthy_rcount >= r_factor)
+				healthy++;
+		}
+		if (healthy == num_volumes)
+			break;
+		if (wait_sec > 60 + 10 * r_factor * replica_poll_time) {
+			REPLICA_ERRLOG("only %d of %d volumes became healthy\n",
+			    healthy, num_volumes);
+			return (1);
+		}
+		sleep(1);
+	}
+	healthy_usec = bench_now_usec() - start;
+
+	polls = xmalloc(sizeof (*polls) * run_time);
+	memset(polls, 0, sizeof (*polls) * run_time);
+	stats_poll_secs = run_time;
+	stats_poll_start = bench_now_usec();
+	__sync_synchronize();
+	stats_polls = polls;
+	sleep(run_time + 1);
+
+	for (i = 0; i < run_time; i++) {
+		total += polls[i];
+		if (polls[i] > peak)
+			peak = polls[i];
+	}
+
+	printf("{\n");
+	printf("  \"config\": {\"volumes\": %d, \"replication_factor\": %d, "
+	    "\"mgmt_threads\": %d, \"poll_time_sec\": %d, "
+	    "\"run_time_sec\": %d},\n", num_volumes, r_factor,
+	    replica_mgmt_shards, replica_poll_time, run_time);
+	printf("  \"healthy_msec\": %lu,\n", healthy_usec / 1000);
+	printf("  \"stats_polls\": %lu,\n", total);
+	printf("  \"stats_polls_per_sec\": {\"avg\": %.1f, \"max\": %lu}\n",
+	    (double)total / run_time, peak);
+	printf("}\n");
+	fflush(stdout);
+
+	/* replication threads don't support teardown, just leave */
+	_exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_result_t total, res;
+	pid_t *pids;
+	int (*res_fds)[2], (*go_fds)[2];
+	uint64_t elapsed = 0;
+	double secs;
+	int i, status, rc = 0;
+	char c = 0;
+
+	process_options(argc, argv);
+	if (lookup_luns > 0)
+		return (bench_lookup(lookup_luns));
+	if (pr_registrants > 0)
+		return (bench_pr_check(pr_registrants));
+
+	signal(SIGPIPE, SIG_IGN);
+
+	replica_poll_time = 1;
+	replica_timeout = 10;
+
+	pthread_mutexattr_init(&mutex_attr);
+#ifdef HAVE_PTHREAD_MUTEX_ADAPTIVE_NP
+	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#else
+	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK);
+#endif
+
+	if (mgmt_plane) {
+		replica_poll_time = 5;
+		return (bench_mgmt_plane());
+	}
+
+	pids = xmalloc(sizeof (*pids) * num_volumes);
+	res_fds = xmalloc(sizeof (*res_fds) * num_volumes);
+	go_fds = xmalloc(sizeof (*go_fds) * num_volumes);
+
+	fflush(stdout);
+	for (i = 0; i < num_volumes; i++) {
+		if (pipe(res_fds[i]) != 0 || pipe(go_fds[i]) != 0) {
+			REPLICA_ERRLOG("pipe failed err(%d)\n", errno);
+			return (1);
+		}
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			REPLICA_ERRLOG("fork failed err(%d)\n", errno);
+			return (1);
+		}
+		if (pids[i] == 0) {
+			close(res_fds[i][0]);
+			close(go_fds[i][1]);
+			bench_run_volume(i + 1, res_fds[i][1], go_fds[i][0]);
+		}
+		close(res_fds[i][1]);
+		close(go_fds[i][0]);
+	}
+
+	for (i = 0; i < num_volumes; i++) {
+		if (read(res_fds[i][0], &c, 1) != 1) {
+			REPLICA_ERRLOG("volume %d failed to come up\n", i + 1);
+			rc = 1;
+		}
+	}
+	for (i = 0; i < num_volumes; i++) {
+		if (rc == 0 && write(go_fds[i][1], &c, 1) != 1)
+			rc = 1;
+		close(go_fds[i][1]);
+	}
+
+	memset(&total, 0, sizeof (total));
+	for (i = 0; i < num_volumes; i++) {
+		if (rc == 0 &&
+		    bench_read(res_fds[i][0], &res, sizeof (res)) == 0) {
+			total.reads += res.reads;
+			total.writes += res.writes;
+			total.flushes += res.flushes;
+			total.unflushed += res.unflushed;
+			total.syncs_sent += res.syncs_sent;
+			total.bytes += res.bytes;
+			total.errors += res.errors;
+			if (res.elapsed_usec > elapsed)
+				elapsed = res.elapsed_usec;
+			bench_hist_merge(&total.hist, &res.hist);
+		} else
+			rc = 1;
+		close(res_fds[i][0]);
+	}
+	for (i = 0; i < num_volumes; i++) {
+		if (rc != 0)
+			kill(pids[i], SIGKILL);
+		waitpid(pids[i], &status, 0);
+	}
+	if (rc != 0)
+		return (rc);
+
+	secs = elapsed / 1000000.0;
+	printf("{\n");
+	printf("  \"config\": {\"block_size\": %lu, \"queue_depth\": %d, "
+	    "\"read_pct\": %d, \"flush_pct\": %d, \"group_sync\": %s, "
+	    "\"pattern\": \"%s\", \"volumes\": %d, "
+	    "\"replication_factor\": %d, \"consistency_factor\": %d, "
+	    "\"volume_size\": %lu, \"run_time_sec\": %.3f},\n",
+	    blocksize, queue_depth, read_pct, flush_pct,
+	    group_sync ? "true" : "false",
+	    random_io ? "random" : "sequential", num_volumes, r_factor,
+	    c_factor, volsize, secs);
+	printf("  \"reads\": %lu,\n  \"writes\": %lu,\n  \"errors\": %lu,\n",
+	    total.reads, total.writes, total.errors);
+	printf("  \"flushes\": %lu,\n  \"syncs_sent\": %lu,\n"
+	    "  \"unflushed\": %lu,\n",
+	    total.flushes, total.syncs_sent, total.unflushed);
+	printf("  \"iops\": %.1f,\n",
+	    (total.reads + total.writes + total.flushes) / secs);
+	printf("  \"mbps\": %.2f,\n", total.bytes / secs / (1024.0 * 1024.0));
+	printf("  \"latency_usec\": {\"avg\": %.1f, \"p50\": %lu, "
+	    "\"p99\": %lu, \"p999\": %lu, \"max\": %lu}\n",
+	    total.hist.count ?
+	    (double)total.hist.sum_usec / total.hist.count : 0.0,
+	    bench_hist_percentile(&total.hist, 500),
+	    bench_hist_percentile(&total.hist, 990),
+	    bench_hist_percentile(&total.hist, 999), total.hist.max_usec);
+	printf("}\n");
+
+	return ((total.errors || total.unflushed) ? 2 : 0);
+}
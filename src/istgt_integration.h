@@ -45,6 +45,32 @@ typedef enum {
 typedef struct mgmt_ack mgmt_ack_data_t;
 typedef enum zvol_status replica_state_t;
 
+/*
+ * A data connection to a replica.  A replica has ndconns of them, all
+ * serviced by its replica_thread; dconn[0] is replica->iofd.  IOs are
+ * spread over the connections once they are unblocked, so overlapping
+ * IOs are still never outstanding at the same time.
+ */
+typedef struct replica_dconn_s {
+	int fd;
+	/* list of IOs (non-blocking IOs) ready to sent on this connection */
+	TAILQ_HEAD(, rcmd_s) readyq;
+	/* header recieved on this connection */
+	zvol_io_hdr_t io_resp_hdr;
+	/* state of response being read */
+	int io_state;
+	/* amount of IO data read in current IO state */
+	uint32_t io_read;
+	/* payload for current IO response */
+	void *ongoing_io_buf;
+	/* payload size for current IO response */
+	uint64_t ongoing_io_len;
+	/* IO for which we are receiving response */
+	rcmd_t *ongoing_io;
+	/* IOs sent on this connection */
+	uint64_t cmds_sent;
+} replica_dconn_t;
+
 typedef struct replica_s {
 	TAILQ_ENTRY(replica_s) r_next;
 	/* For Replicas which are connected with the quorum value as 0 */
@@ -52,8 +78,6 @@ typedef struct replica_s {
 	TAILQ_ENTRY(replica_s) r_waitnext;
 	/* list of IOs queued from spec to replica */
 	rte_smempool_t cmdq;
-	/* list of IOs (non-blocking IOs) ready to sent to replica */
-	TAILQ_HEAD(, rcmd_s) readyq;
 	/* list of IOs waiting for the response from replica */
 	TAILQ_HEAD(, rcmd_s) waitq;
 	/* list of blocked IOs */
@@ -78,13 +102,12 @@ typedef struct replica_s {
 	/* extra byte for printing and strlen functions */
 	char replica_id[REPLICA_ID_LEN + 1]; //UID to identify replica
 
-	/* payload for current IO response for a replica */
-	void *ongoing_io_buf;
+	/* data connections, negotiated during handshake */
+	int ndconns;
+	replica_dconn_t dconn[MAX_LU_REPLICA_DCONNS];
+	/* next connection for round robin */
+	uint32_t dconn_next;
 
-	/* payload size for IO response for a replica */
-	uint64_t ongoing_io_len;
-	/* IO for which we are receiving response from replica */
-	rcmd_t *ongoing_io;
 	/* data ptr for epoll */
 	void *m_event1;
 	/* eventfd to notify for a command in replica's mgmt cmd queue */
@@ -93,6 +116,26 @@ typedef struct replica_s {
 	void *m_event2;
 	/* to inform mgmt interface for an error in data interface */
 	int mgmt_eventfd2;
+
+	/*
+	 * Handshake after the ack, run by the mgmt shard from epoll events
+	 * on hs_eventfd and on the data connection being opened (hs_fd).
+	 * hs_eventfd is kicked to start, by replica_thread once it is up,
+	 * and when hs_deadline_ms passes.  See replica_hs_step.
+	 */
+	int hs_state;
+	int hs_fd;
+	int hs_eventfd;
+	/* data ptrs for epoll of hs_fd and hs_eventfd */
+	void *m_event3;
+	void *m_event4;
+	/* response to OPEN on hs_fd, hs_read bytes of it so far */
+	zvol_io_hdr_t hs_hdr;
+	int hs_read;
+	uint64_t hs_deadline_ms;
+	/* mgmt connection failed while replica_thread was starting */
+	int hs_conn_error;
+	bool hs_needs_update;
 	/* to inform data interface for an error in mgmt interface */
 	int disconnect_conn;
 	/* To track tear down of replica's interfaces(mgmt and data) */
@@ -104,6 +147,26 @@ typedef struct replica_s {
 	/* Epoll descriptor for mgmt interface */
 	int epfd;
 
+	/*
+	 * replica pushes its status and stats, see STATUS_SUBSCRIBE; it is
+	 * still polled, but only once push_poll_due_ms has passed
+	 */
+	int push_enabled;
+	uint64_t push_poll_due_ms;
+	/*
+	 * read progress on the mgmt connection, kept here rather than in the
+	 * mgmt command as notifications come in between responses
+	 */
+	int mgmt_read_state;
+	int mgmt_read_bytes;
+
+	/* deadlines of IOs owned by replica_thread */
+	ISTGT_TWHEEL io_wheel;
+	/* an IO has gone past replica_timeout */
+	int io_timed_out;
+	/* last "hasn't responded" notice, in wheel time */
+	uint64_t io_notice_ms;
+
 	int dont_free;
 
 	struct timespec create_time;
@@ -126,12 +189,6 @@ typedef struct replica_s {
 	uint64_t replica_inflight_read_io_cnt;
 	uint64_t replica_inflight_sync_io_cnt;
 
-	/* header recieved on data connection */
-	zvol_io_hdr_t *io_resp_hdr;
-	/* state of command on data connection */
-	int io_state;
-	/* amount of IO data read in current IO state for data connection */
-	uint32_t io_read;
 	/* header recieved on management connection */
 	zvol_io_hdr_t *mgmt_io_resp_hdr;
 	/* data recieved on management connection */
@@ -149,6 +206,8 @@ typedef struct replica_s {
 typedef struct cstor_conn_ops {
 	cstor_listen conn_listen;
 	cstor_connect conn_connect;
+	/* returns with connect in progress */
+	cstor_connect conn_connect_nb;
 } cstor_conn_ops_t;
 
 void *cleanup_deadlist(void *);
@@ -157,7 +216,7 @@ int handle_write_resp(spec_t *, replica_t *);
 int handle_read_resp(spec_t *, replica_t *);
 int update_replica_list(int, spec_t *, int);
 replica_t *create_replica_entry(spec_t *, int, int);
-int update_replica_entry(spec_t *, replica_t *, int);
+int update_replica_entry(spec_t *, replica_t *);
 int handle_read_data_event(replica_t *);
 int handle_write_data_event(replica_t *replica);
 void update_volstate(spec_t *);
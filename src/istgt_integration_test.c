@@ -29,6 +29,7 @@
 #include "config.h"
 #include "istgt_misc.h"
 #include "istgt_proto.h"
+#include "istgt_scsi.h"
 #include "replication.h"
 #include "istgt_integration.h"
 #include "replication_misc.h"
@@ -1432,6 +1433,128 @@ exit:
 	return (NULL);
 }
 
+typedef struct scaleup_stall_s {
+	spec_t *spec;
+	volatile bool stop;
+	uint64_t writes;
+	uint64_t max_stall_ns;
+} scaleup_stall_t;
+
+/*
+ * Keeps writing to the volume and records the longest time a single write
+ * spent in replicate() while a replica gets added to the volume.
+ */
+static void *
+scaleup_stall_writer(void *arg)
+{
+	scaleup_stall_t *stall = (scaleup_stall_t *)arg;
+	spec_t *spec = stall->spec;
+	ISTGT_LU_CMD_Ptr lu_cmd;
+	struct timespec start, end;
+	uint64_t offset, ns;
+	int len = 8 * spec->blocklen;
+	char *buf;
+	int rc;
+
+	snprintf(tinfo, 50, "stallwrite");
+	prctl(PR_SET_NAME, tinfo, 0, 0, 0);
+
+	lu_cmd = (ISTGT_LU_CMD_Ptr)malloc(sizeof (ISTGT_LU_CMD));
+	buf = xmalloc(len);
+	memset(buf, 0xa5, len);
+
+	while (!stall->stop) {
+		memset(lu_cmd, 0, sizeof (ISTGT_LU_CMD));
+		ISTGT_SGL_INIT(lu_cmd);
+		lu_cmd->luworkerindx = 0;
+		lu_cmd->cdb0 = SBC_WRITE_16;
+		lu_cmd->iobufindx = 0;
+		lu_cmd->iobuf[0].iov_base = buf;
+		lu_cmd->iobuf[0].iov_len = len;
+		lu_cmd->iobufsize = len;
+		offset = (random() % (spec->blockcnt - 16)) * spec->blocklen;
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+		rc = replicate(spec, lu_cmd, offset, len);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+		if (rc != len) {
+			REPLICA_ERRLOG("write failed during scaleup rc(%d)\n",
+			    rc);
+			usleep(1000);
+			continue;
+		}
+
+		ns = (end.tv_sec - start.tv_sec) * SEC_IN_NS +
+		    end.tv_nsec - start.tv_nsec;
+		if (ns > stall->max_stall_ns)
+			stall->max_stall_ns = ns;
+		stall->writes++;
+	}
+
+	free(buf);
+	free(lu_cmd);
+	return (NULL);
+}
+
+/*
+ * Adds a new replica to the volume while a writer keeps issuing IOs and
+ * verifies that writes keep flowing across the replication factor change.
+ * Returns 0 on success.
+ */
+static int
+scaleup_stall_test(spec_t *spec)
+{
+	scaleup_stall_t stall;
+	pthread_t writer_thread;
+	rargs_t *rargs;
+	int rf, wait_time = 300;
+	/* scaleup must not hold writes for more than a second */
+	uint64_t max_allowed_stall_ns = SEC_IN_NS;
+
+	rf = spec->replication_factor;
+	if (rf >= spec->desired_replication_factor ||
+	    new_replica_count >= MAXREPLICA) {
+		REPLICA_LOG("skipping scaleup stall test rf(%d)\n", rf);
+		return (0);
+	}
+
+	memset(&stall, 0, sizeof (stall));
+	stall.spec = spec;
+	pthread_create(&writer_thread, NULL, &scaleup_stall_writer, &stall);
+
+	rargs = &(all_rargs[new_replica_count]);
+	rargs->zvol_guid = 6167;
+	snprintf(rargs->replica_id, REPLICA_ID_LEN, "%d", 6167);
+	all_rthrds[new_replica_count] = reregister_replica(spec->volname,
+	    rargs, 6167);
+	new_replica_count += 1;
+
+	while (spec->replication_factor == rf && wait_time > 0) {
+		sleep(1);
+		wait_time--;
+	}
+
+	/* keep writing for a while under the new replication factor */
+	sleep(5);
+	stall.stop = true;
+	pthread_join(writer_thread, NULL);
+
+	REPLICA_LOG("scaleup from rf(%d) to rf(%d): %lu writes, max write "
+	    "latency %lu us\n", rf, spec->replication_factor, stall.writes,
+	    stall.max_stall_ns / 1000);
+
+	if (spec->replication_factor == rf) {
+		REPLICA_ERRLOG("replica was not added within 300 seconds\n");
+		return (-1);
+	}
+	if (stall.writes == 0 || stall.max_stall_ns > max_allowed_stall_ns) {
+		REPLICA_ERRLOG("writes stalled for %lu us during scaleup\n",
+		    stall.max_stall_ns / 1000);
+		return (-1);
+	}
+	return (0);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1552,6 +1675,12 @@ main(int argc, char **argv)
 	test_args->data_read_write_test_done = true;
 	pthread_cond_wait(&test_args->test_state_cv, &test_args->test_mtx);
 	MTX_UNLOCK(&test_args->test_mtx);
+
+	if (scaleup_stall_test(spec) != 0) {
+		REPLICA_ERRLOG("scaleup stall test failed\n");
+		return (1);
+	}
+
 	REPLICA_LOG("Killing all replicas\n");
 	kill_all_replicas();
 
@@ -76,6 +76,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #endif
 
@@ -96,6 +97,7 @@
 #include "istgt_proto.h"
 #include "istgt_scsi.h"
 #include "istgt_queue.h"
+#include "istgt_affinity.h"
 
 #include <netinet/in.h>
 
@@ -120,7 +122,6 @@
 			&& ((uint32_t)(S1) - (uint32_t)(S2) < SN32_CMPMAX))))
 
 #define	POLLWAIT 5000
-#define	MAX_MCSREVWAIT (10 * 1000)
 #define	ISCMDQ 8
 #define	ISCSI_SOCKET "/dev/eventctl"
 
@@ -160,6 +161,11 @@ static pthread_mutex_t g_last_tsih_mutex;
 
 static int istgt_add_transfer_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
 static void istgt_clear_transfer_task(CONN_Ptr conn, uint32_t CmdSN);
+static int istgt_iscsi_unpark_transfer_task(CONN_Ptr conn);
+static ISTGT_R2T_TASK_Ptr istgt_iscsi_new_transfer_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
+static void istgt_free_transfer_task(ISTGT_R2T_TASK_Ptr r2t_task);
+static int istgt_iscsi_order_wait(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
+static int istgt_iscsi_order_abort(SESS_Ptr sess, uint32_t task_tag);
 static void istgt_clear_all_transfer_task(CONN_Ptr conn);
 static int istgt_iscsi_send_r2t(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int offset, int len, uint32_t transfer_tag, uint32_t *R2TSN);
 static int istgt_append_sess(CONN_Ptr conn, uint64_t isid, uint16_t tsih, uint16_t cid);
@@ -167,6 +173,14 @@ static void istgt_remove_conn(CONN_Ptr conn);
 static int istgt_iscsi_drop_all_conns(CONN_Ptr conn);
 static int istgt_iscsi_drop_old_conns(CONN_Ptr conn);
 static void ioctl_call(CONN_Ptr, enum iscsi_log);
+static int istgt_iscsi_task_exit(CONN_Ptr conn);
+static int istgt_iscsi_execute_pending(CONN_Ptr conn);
+static void istgt_iscsi_retain_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu);
+static int istgt_iscsi_digest_error(CONN_Ptr conn, ISCSI_PDU_Ptr pdu);
+static void istgt_iscsi_cmdsn_next(SESS_Ptr sess);
+static int istgt_iscsi_execute_waiting(CONN_Ptr conn);
+
+static SESS_Ptr g_failed_sess;
 
 // _verb_stat SCSIstat_0min[SCSI_ARYSZ]
 // _verb_stat SCSIstat_1min[SCSI_ARYSZ]
@@ -220,62 +234,23 @@ istgt_make_digest_word(uint8_t *buf, size_t len, uint32_t crc32c)
 
 
 extern clockid_t clockid;
+
+/*
+ * Sets up the PDU from its BHS: allocates AHS and data segment and fills
+ * iovec (AHS+HD+DATA+DD) with what remains to be read.  Returns the
+ * number of bytes after the BHS.
+ */
 static int
-istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+istgt_iscsi_pdu_prepare(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, struct iovec *iovec)
 {
-	struct iovec iovec[4]; /* AHS+HD+DATA+DD */
-	uint32_t crc32c;
-	int nbytes;
 	int total_ahs_len;
 	int data_len;
 	int adata_len = 0;
 	int segment_len;
 	int total;
-	int rc;
-	int i;
-	struct timespec  now;
 	int opcode;
-	pdu->ahs = NULL;
-	pdu->total_ahs_len = 0;
-	pdu->data = NULL;
-	pdu->data_segment_len = 0;
-	pdu->opcode = -1;
-	total = 0;
-
-	/* BHS (require for all PDU) */
-	// ISTGT_TRACELOG(ISTGT_TRACE_NET, "BHS read %d\n",
-	//   ISCSI_BHS_LEN);
-	errno = 0;
-	clock_gettime(clockid, &pdu->start0);
-	rc = recv(conn->sock, &pdu->bhs, ISCSI_BHS_LEN, MSG_WAITALL);
-	if (rc < 0) {
-		clock_gettime(clockid, &now);
-		if (errno == ECONNRESET) {
-			ISTGT_WARNLOG("Connection reset by peer (%s,time=%lu)\n",
-				conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start0.tv_sec));
-			conn->state = CONN_STATE_EXITING;
-		} else if (errno == ETIMEDOUT) {
-			ISTGT_WARNLOG("Operation timed out (%s,time=%lu)\n",
-				conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start0.tv_sec));
-			conn->state = CONN_STATE_EXITING;
-		} else {
-			ISTGT_ERRLOG("iscsi_read() failed (errno=%d,%s,time=%lu)\n",
-				errno, conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start0.tv_sec));
-		}
-		return (-1);
-	}
-	if (rc == 0) {
-		ISTGT_TRACELOG(ISTGT_TRACE_NET, "recv() EOF (%s)\n",
-			conn->initiator_name);
-		conn->state = CONN_STATE_EXITING;
-		return (-1);
-	}
-	if (rc != ISCSI_BHS_LEN) {
-		ISTGT_ERRLOG("invalid BHS length (%d,%s)\n", rc, conn->initiator_name);
-		return (-1);
-	}
-	total += ISCSI_BHS_LEN;
 
+	total = 0;
 	opcode = BGET8W(&pdu->bhs.opcode, 5, 6);
 	pdu->opcode = (uint8_t)opcode;
 	ISCSIstat_rest[ iscsi_ops_indx_table[pdu->opcode] ].opcode = opcode;
@@ -339,44 +314,40 @@ istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		iovec[3].iov_len = 0;
 	}
 
-	/* read all bytes to iovec */
-	nbytes = total - ISCSI_BHS_LEN;
-	if (nbytes > 0) {
-		ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU read %d (data:%ld ahs:%lu)\n", nbytes, pdu->data_segment_len, pdu->total_ahs_len);
+	if (total > 0) {
+		ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU read %d (data:%ld ahs:%lu)\n", total, pdu->data_segment_len, pdu->total_ahs_len);
 	}
-	clock_gettime(clockid, &pdu->start);
-	errno = 0;
-	while (nbytes > 0) {
-		rc = readv(conn->sock, &iovec[0], 4);
-		if (rc < 0) {
-			clock_gettime(clockid, &now); // time(NULL);
-			ISTGT_ERRLOG("readv() failed (%d,errno=%d,%s,time=%lu)\n",
-				rc, errno, conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start.tv_sec));
-			return (-1);
-		}
-		if (rc == 0) {
-			ISTGT_TRACELOG(ISTGT_TRACE_NET, "readv() EOF (%s)\n",
-				conn->initiator_name);
-			conn->state = CONN_STATE_EXITING;
-			return (-1);
-		}
-		nbytes -= rc;
-		if (nbytes == 0)
+	return (total);
+}
+
+/* skips rc bytes of iovec, i.e. what readv/writev just moved */
+static void
+istgt_iscsi_iov_advance(struct iovec *iovec, int iovcnt, size_t rc)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iovec[i].iov_len != 0 && iovec[i].iov_len > rc) {
+			iovec[i].iov_base
+				= (void *) (((char *)iovec[i].iov_base) + rc);
+			iovec[i].iov_len -= rc;
 			break;
-		/* adjust iovec length */
-		for (i = 0; i < 4; i++) {
-			if (iovec[i].iov_len != 0 && iovec[i].iov_len > (size_t)rc) {
-				iovec[i].iov_base
-					= (void *) (((char *)iovec[i].iov_base) + rc);
-				iovec[i].iov_len -= rc;
-				break;
-			} else {
-				rc -= iovec[i].iov_len;
-				iovec[i].iov_len = 0;
-			}
+		} else {
+			rc -= iovec[i].iov_len;
+			iovec[i].iov_len = 0;
 		}
 	}
+}
+
+static int
+istgt_iscsi_pdu_verify(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	uint32_t crc32c;
+	int total_ahs_len = pdu->total_ahs_len;
+	int data_len = pdu->data_segment_len;
+	int rc;
 
+	pdu->data_digest_error = 0;
 	/* check digest */
 	if (conn->header_digest) {
 		if (total_ahs_len == 0) {
@@ -403,17 +374,202 @@ istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	if (conn->data_digest && data_len != 0) {
 		crc32c = istgt_crc32c(pdu->data, ISCSI_ALIGN(data_len));
 		rc = MATCH_DIGEST_WORD(pdu->data_digest, crc32c);
-		if (rc == 0) {
+		if (rc == 0 && conn->error_recovery && conn->full_feature) {
+			/* the header holds, istgt_iscsi_execute() rejects it */
+			ISTGT_WARNLOG("data digest error (%s)\n", conn->initiator_name);
+			pdu->data_digest_error = 1;
+		} else if (rc == 0) {
 			ISTGT_ERRLOG("data digest error (%s)\n", conn->initiator_name);
 			return (-1);
 		}
 	}
+	return (0);
+}
+
+static int
+istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	struct iovec iovec[4]; /* AHS+HD+DATA+DD */
+	int nbytes;
+	int total;
+	int rc;
+	struct timespec  now;
+
+	/* a reactor connection gathers DATA-OUT in op_data, never here */
+	if (conn->reactor != NULL) {
+		ISTGT_ERRLOG("c#%d blocking read on a reactor connection\n",
+			conn->id);
+		return (-1);
+	}
+
+	pdu->ahs = NULL;
+	pdu->total_ahs_len = 0;
+	pdu->data = NULL;
+	pdu->data_segment_len = 0;
+	pdu->opcode = -1;
+	total = 0;
+
+	/* BHS (require for all PDU) */
+	// ISTGT_TRACELOG(ISTGT_TRACE_NET, "BHS read %d\n",
+	//   ISCSI_BHS_LEN);
+	errno = 0;
+	clock_gettime(clockid, &pdu->start0);
+	rc = recv(conn->sock, &pdu->bhs, ISCSI_BHS_LEN, MSG_WAITALL);
+	if (rc < 0) {
+		clock_gettime(clockid, &now);
+		if (errno == ECONNRESET) {
+			ISTGT_WARNLOG("Connection reset by peer (%s,time=%lu)\n",
+				conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start0.tv_sec));
+			conn->state = CONN_STATE_EXITING;
+		} else if (errno == ETIMEDOUT) {
+			ISTGT_WARNLOG("Operation timed out (%s,time=%lu)\n",
+				conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start0.tv_sec));
+			conn->state = CONN_STATE_EXITING;
+		} else {
+			ISTGT_ERRLOG("iscsi_read() failed (errno=%d,%s,time=%lu)\n",
+				errno, conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start0.tv_sec));
+		}
+		return (-1);
+	}
+	if (rc == 0) {
+		ISTGT_TRACELOG(ISTGT_TRACE_NET, "recv() EOF (%s)\n",
+			conn->initiator_name);
+		conn->state = CONN_STATE_EXITING;
+		return (-1);
+	}
+	if (rc != ISCSI_BHS_LEN) {
+		ISTGT_ERRLOG("invalid BHS length (%d,%s)\n", rc, conn->initiator_name);
+		return (-1);
+	}
+	total += ISCSI_BHS_LEN;
+
+	nbytes = istgt_iscsi_pdu_prepare(conn, pdu, iovec);
+	if (nbytes < 0)
+		return (-1);
+	total += nbytes;
+
+	/* read all bytes to iovec */
+	clock_gettime(clockid, &pdu->start);
+	errno = 0;
+	while (nbytes > 0) {
+		rc = readv(conn->sock, &iovec[0], 4);
+		if (rc < 0) {
+			clock_gettime(clockid, &now); // time(NULL);
+			ISTGT_ERRLOG("readv() failed (%d,errno=%d,%s,time=%lu)\n",
+				rc, errno, conn->initiator_name, (unsigned long)(now.tv_sec - pdu->start.tv_sec));
+			return (-1);
+		}
+		if (rc == 0) {
+			ISTGT_TRACELOG(ISTGT_TRACE_NET, "readv() EOF (%s)\n",
+				conn->initiator_name);
+			conn->state = CONN_STATE_EXITING;
+			return (-1);
+		}
+		nbytes -= rc;
+		if (nbytes == 0)
+			break;
+		/* adjust iovec length */
+		istgt_iscsi_iov_advance(iovec, 4, rc);
+	}
+
+	if (istgt_iscsi_pdu_verify(conn, pdu) < 0)
+		return (-1);
 
+	conn->rx_pdus++;
+	conn->rx_bytes += total;
 	return (total);
 }
 
+/*
+ * Reactor side of the PDU reader: takes whatever the socket has and keeps
+ * the progress in conn, returning 1 once the PDU is complete, 0 if more
+ * bytes are needed and -1 if the connection is to be dropped.
+ */
+static int
+istgt_iscsi_read_pdu_nb(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	ssize_t rc;
+	int nbytes;
+
+	if (conn->rx_state == ISTGT_RX_IDLE) {
+		pdu->ahs = NULL;
+		pdu->total_ahs_len = 0;
+		pdu->data = NULL;
+		pdu->data_segment_len = 0;
+		pdu->opcode = -1;
+		clock_gettime(clockid, &pdu->start0);
+		conn->rx_off = 0;
+		conn->rx_state = ISTGT_RX_BHS;
+	}
+	if (conn->rx_state == ISTGT_RX_BHS) {
+		rc = recv(conn->sock, (uint8_t *)&pdu->bhs + conn->rx_off,
+		    ISCSI_BHS_LEN - conn->rx_off, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR) {
+				/* nothing of the next PDU yet */
+				if (conn->rx_off == 0)
+					conn->rx_state = ISTGT_RX_IDLE;
+				return (0);
+			}
+			ISTGT_WARNLOG("recv() failed (errno=%d,%s)\n", errno,
+			    conn->initiator_name);
+			goto error_return;
+		}
+		if (rc == 0) {
+			ISTGT_TRACELOG(ISTGT_TRACE_NET, "recv() EOF (%s)\n",
+				conn->initiator_name);
+			goto error_return;
+		}
+		if (conn->rx_off == 0)
+			conn->rx_start = time(NULL);
+		conn->rx_off += rc;
+		if (conn->rx_off < ISCSI_BHS_LEN)
+			return (0);
+
+		nbytes = istgt_iscsi_pdu_prepare(conn, pdu, conn->rx_iov);
+		if (nbytes < 0)
+			goto error_return;
+		conn->rx_left = nbytes;
+		conn->rx_total = ISCSI_BHS_LEN + nbytes;
+		conn->rx_state = ISTGT_RX_REST;
+		clock_gettime(clockid, &pdu->start);
+	}
+	while (conn->rx_left > 0) {
+		rc = readv(conn->sock, conn->rx_iov, 4);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				return (0);
+			ISTGT_ERRLOG("readv() failed (errno=%d,%s)\n", errno,
+			    conn->initiator_name);
+			goto error_return;
+		}
+		if (rc == 0) {
+			ISTGT_TRACELOG(ISTGT_TRACE_NET, "readv() EOF (%s)\n",
+				conn->initiator_name);
+			goto error_return;
+		}
+		conn->rx_left -= rc;
+		istgt_iscsi_iov_advance(conn->rx_iov, 4, rc);
+	}
+
+	conn->rx_state = ISTGT_RX_IDLE;
+	if (istgt_iscsi_pdu_verify(conn, pdu) < 0)
+		return (-1);
+	conn->rx_pdus++;
+	conn->rx_bytes += conn->rx_total;
+	return (1);
+
+error_return:
+	conn->rx_state = ISTGT_RX_IDLE;
+	conn->state = CONN_STATE_EXITING;
+	return (-1);
+}
+
 static int istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, ISTGT_LU_CMD_Ptr lu_cmd);
 static int istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int I_bit);
+static int istgt_iscsi_reactor_queue(CONN_Ptr conn, struct iovec *iovec, int iovcnt, int total);
 
 uint8_t istgt_get_sleep_val(ISTGT_LU_DISK *spec);
 
@@ -477,10 +633,20 @@ static int istgt_update_pdu(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 				conn->sess->ExpCmdSN++;
 				conn->sess->MaxCmdSN_local++;
 			}
+			istgt_iscsi_cmdsn_next(conn->sess);
 		}
 		DSET32(&rsp[28], conn->sess->ExpCmdSN);
 		DSET32(&rsp[32], conn->sess->MaxCmdSN);
 		SESS_MTX_UNLOCK(conn);
+	} else if (opcode == ISCSI_OP_SCSI_RSP
+		|| opcode == ISCSI_OP_SCSI_DATAIN) {
+		/* the status of a task reassigned to this connection */
+		SESS_MTX_LOCK(conn);
+		DSET32(&rsp[24], conn->StatSN);
+		conn->StatSN++;
+		DSET32(&rsp[28], conn->sess->ExpCmdSN);
+		DSET32(&rsp[32], conn->sess->MaxCmdSN);
+		SESS_MTX_UNLOCK(conn);
 	}
 	return (0);
 }
@@ -507,7 +673,6 @@ istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int
 	uint8_t *cp;
 	int total_ahs_len;
 	int data_len;
-	int alloc_len;
 	int total;
 
 	cp = (uint8_t *) &pdu->bhs;
@@ -520,14 +685,10 @@ istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int
 		DGET8(&cp[0]), DGET32(&cp[32]), DGET32(&cp[28]), DGET32(&cp[32]));
 #endif
 	/* allocate for queued PDU */
-	alloc_len = ISCSI_ALIGN(sizeof (*lu_task));
-	alloc_len += ISCSI_ALIGN(sizeof (*lu_task->lu_cmd.pdu));
-	// alloc_len += ISCSI_ALIGN(4 * total_ahs_len);
-	// alloc_len += ISCSI_ALIGN(data_len);
-	lu_task = xmalloc(alloc_len);
-	memset(lu_task, 0, alloc_len);
+	lu_task = istgt_lu_task_get(conn, 1);
 	lu_task->lu_cmd.pdu = (ISCSI_PDU_Ptr) ((uintptr_t)lu_task
 		+ ISCSI_ALIGN(sizeof (*lu_task)));
+	ISTGT_SGL_INIT(&lu_task->lu_cmd);
 	// lu_task->lu_cmd.pdu->ahs = (ISCSI_AHS *) ((uintptr_t)lu_task->lu_cmd.pdu
 	//	+ ISCSI_ALIGN(sizeof (*lu_task->lu_cmd.pdu)));
 	// lu_task->lu_cmd.pdu->data = (uint8_t *) ((uintptr_t)lu_task->lu_cmd.pdu->ahs
@@ -593,8 +754,7 @@ istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int
 		return (-1);
 	}
 	/* notify to thread */
-	if (conn->sender_waiting == 1)
-		rc = pthread_cond_broadcast(&conn->result_queue_cond);
+	rc = istgt_iscsi_result_notify(conn);
 	MTX_UNLOCK(&conn->result_queue_mutex);
 	if (rc != 0) {
 		ISTGT_ERRLOG("cond_broadcast() failed\n");
@@ -620,7 +780,6 @@ istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, ISTGT_LU_CMD_Pt
 	int data_len;
 	int total;
 	int rc;
-	int i;
 
 	cp = (uint8_t *) &pdu->bhs;
 	total_ahs_len = DGET8(&cp[4]);
@@ -636,6 +795,10 @@ istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, ISTGT_LU_CMD_Pt
 	ISCSIstat_rest[ iscsi_ops_indx_table[(uint8_t)opcode] ].opcode = (uint8_t)opcode;
 	++ISCSIstat_rest[ iscsi_ops_indx_table[(uint8_t)opcode] ].pdu_sent;
 
+	/* kept before the write, a failed connection may have it reassigned */
+	if (conn->error_recovery != 0)
+		istgt_iscsi_retain_pdu(conn, pdu);
+
 	/* BHS */
 	iovec[0].iov_base = &pdu->bhs;
 	iovec[0].iov_len = ISCSI_BHS_LEN;
@@ -689,6 +852,15 @@ istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, ISTGT_LU_CMD_Pt
 		iovec[4].iov_len = 0;
 	}
 
+	/* the reactor writes as the socket allows */
+	if (conn->reactor != NULL) {
+		if (istgt_iscsi_reactor_queue(conn, iovec, 5, total) < 0)
+			return (-1);
+		__sync_fetch_and_add(&conn->tx_pdus, 1);
+		__sync_fetch_and_add(&conn->tx_bytes, total);
+		return (total);
+	}
+
 	/* write all bytes from iovec */
 	nbytes = total;
 	ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU write %d[%lu, %lu/%lu]\n", nbytes, iovec[1].iov_len, iovec[3].iov_len, iovec[4].iov_len);
@@ -706,19 +878,11 @@ istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, ISTGT_LU_CMD_Pt
 		if (nbytes == 0)
 			break;
 		/* adjust iovec length */
-		for (i = 0; i < 5; i++) {
-			if (iovec[i].iov_len != 0 && iovec[i].iov_len > (size_t)rc) {
-				iovec[i].iov_base
-					= (void *) (((uintptr_t)iovec[i].iov_base) + rc);
-				iovec[i].iov_len -= rc;
-				break;
-			} else {
-				rc -= iovec[i].iov_len;
-				iovec[i].iov_len = 0;
-			}
-		}
+		istgt_iscsi_iov_advance(iovec, 5, rc);
 	}
 
+	__sync_fetch_and_add(&conn->tx_pdus, 1);
+	__sync_fetch_and_add(&conn->tx_bytes, total);
 	return (total);
 }
 
@@ -733,34 +897,566 @@ istgt_iscsi_copy_pdu(ISCSI_PDU_Ptr dst_pdu, ISCSI_PDU_Ptr src_pdu)
 	dst_pdu->total_ahs_len = src_pdu->total_ahs_len;
 	dst_pdu->data_segment_len = src_pdu->data_segment_len;
 	dst_pdu->opcode = src_pdu->opcode;
+	dst_pdu->data_digest_error = src_pdu->data_digest_error;
 	dst_pdu->start = src_pdu->start;
 	src_pdu->ahs = NULL;
 	src_pdu->data = NULL;
 	src_pdu->data_segment_len = 0;
 }
 
-typedef struct iscsi_param_table_t
+/* a connection stops keeping PDUs past this, answered tasks go first */
+#define	ISTGT_RETAIN_MAX	(16 * 1024 * 1024)
+
+#define	ISTGT_RETAIN_HASHIDX(tag)	((tag) % ISTGT_RETAIN_HASH)
+
+static int
+istgt_sn_in_run(uint32_t sn, uint32_t beg_run, uint32_t run_length)
 {
-	const char *key;
-	const char *val;
-	const char *list;
-	int type;
-} ISCSI_PARAM_TABLE;
+	if (SN32_LT(sn, beg_run))
+		return (0);
+	/* RunLength 0 is everything from BegRun on */
+	return (run_length == 0 || SN32_LT(sn, beg_run + run_length));
+}
 
-static ISCSI_PARAM_TABLE conn_param_table[] =
+/* what is kept of rt apart from its own struct */
+static void
+istgt_iscsi_retained_clear(ISTGT_RETAINED_TASK *rt)
 {
-	{ "HeaderDigest", "None", "CRC32C,None", ISPT_LIST },
-	{ "DataDigest", "None", "CRC32C,None", ISPT_LIST },
-	{ "MaxRecvDataSegmentLength", "8192", "512,16777215", ISPT_NUMERICAL },
-	{ "OFMarker", "No", "Yes,No", ISPT_BOOLEAN_AND },
-	{ "IFMarker", "No", "Yes,No", ISPT_BOOLEAN_AND },
-	{ "OFMarkInt", "1", "1,65535", ISPT_NUMERICAL },
-	{ "IFMarkInt", "1", "1,65535", ISPT_NUMERICAL },
-	{ "AuthMethod", "None", "CHAP,None", ISPT_LIST },
-	{ "CHAP_A", "5", "5", ISPT_LIST },
-	{ "CHAP_N", "", "", ISPT_DECLARATIVE },
-	{ "CHAP_R", "", "", ISPT_DECLARATIVE },
-	{ "CHAP_I", "", "", ISPT_DECLARATIVE },
+	if (rt->pdus != NULL)
+		xfree(rt->pdus);
+	if (rt->buf != NULL)
+		xfree(rt->buf);
+	if (rt->rsp_data != NULL)
+		xfree(rt->rsp_data);
+	rt->pdus = NULL;
+	rt->npdus = rt->maxpdus = 0;
+	rt->buf = NULL;
+	rt->buf_off = 0;
+	rt->buf_len = 0;
+	rt->rsp_data = NULL;
+	rt->rsp_len = 0;
+	rt->bytes = sizeof (*rt);
+}
+
+static void
+istgt_iscsi_retained_free(ISTGT_RETAINED_TASK *rt)
+{
+	istgt_iscsi_retained_clear(rt);
+	xfree(rt);
+}
+
+static void
+istgt_iscsi_retained_free_all(ISTGT_RETAINED_TASK *list)
+{
+	ISTGT_RETAINED_TASK *rt;
+
+	while ((rt = list) != NULL) {
+		list = rt->next;
+		istgt_iscsi_retained_free(rt);
+	}
+}
+
+/* retain_mutex is held */
+static ISTGT_RETAINED_TASK *
+istgt_iscsi_retain_find(CONN_Ptr conn, uint32_t task_tag)
+{
+	ISTGT_RETAINED_TASK *rt;
+
+	rt = conn->retain_hash[ISTGT_RETAIN_HASHIDX(task_tag)];
+	while (rt != NULL && rt->task_tag != task_tag)
+		rt = rt->hnext;
+	return (rt);
+}
+
+/* retain_mutex is held, rt goes to the hash only */
+static void
+istgt_iscsi_retain_add(CONN_Ptr conn, ISTGT_RETAINED_TASK *rt)
+{
+	ISTGT_RETAINED_TASK **bucket;
+
+	bucket = &conn->retain_hash[ISTGT_RETAIN_HASHIDX(rt->task_tag)];
+	rt->hnext = *bucket;
+	*bucket = rt;
+	rt->next = rt->prev = NULL;
+	conn->retained_tasks++;
+	conn->retained_bytes += rt->bytes;
+}
+
+/* retain_mutex is held, rt is in StatSN order from here on */
+static void
+istgt_iscsi_retain_queue(CONN_Ptr conn, ISTGT_RETAINED_TASK *rt)
+{
+	ISTGT_RETAINED_TASK *after;
+
+	/* statuses are kept about as they are numbered, look from the end */
+	after = conn->retained_tail;
+	while (after != NULL && SN32_GT(after->StatSN, rt->StatSN))
+		after = after->prev;
+	rt->prev = after;
+	if (after != NULL) {
+		rt->next = after->next;
+		after->next = rt;
+	} else {
+		rt->next = conn->retained;
+		conn->retained = rt;
+	}
+	if (rt->next != NULL)
+		rt->next->prev = rt;
+	else
+		conn->retained_tail = rt;
+}
+
+static void
+istgt_iscsi_retain_dequeue(CONN_Ptr conn, ISTGT_RETAINED_TASK *rt)
+{
+	if (rt->prev != NULL)
+		rt->prev->next = rt->next;
+	else
+		conn->retained = rt->next;
+	if (rt->next != NULL)
+		rt->next->prev = rt->prev;
+	else
+		conn->retained_tail = rt->prev;
+	rt->next = rt->prev = NULL;
+}
+
+/* retain_mutex is held, rt leaves the connection */
+static void
+istgt_iscsi_retain_remove(CONN_Ptr conn, ISTGT_RETAINED_TASK *rt)
+{
+	ISTGT_RETAINED_TASK **tp;
+
+	tp = &conn->retain_hash[ISTGT_RETAIN_HASHIDX(rt->task_tag)];
+	while (*tp != NULL && *tp != rt)
+		tp = &(*tp)->hnext;
+	if (*tp != NULL)
+		*tp = rt->hnext;
+	rt->hnext = NULL;
+	if (rt->has_status)
+		istgt_iscsi_retain_dequeue(conn, rt);
+	conn->retained_tasks--;
+	conn->retained_bytes -= rt->bytes;
+}
+
+/* retain_mutex is held, the oldest answered tasks but keep go */
+static void
+istgt_iscsi_retain_trim(CONN_Ptr conn, size_t need, ISTGT_RETAINED_TASK *keep)
+{
+	ISTGT_RETAINED_TASK *rt, *next;
+
+	for (rt = conn->retained; rt != NULL
+	    && conn->retained_bytes + need > ISTGT_RETAIN_MAX; rt = next) {
+		next = rt->next;
+		if (rt == keep)
+			continue;
+		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+		    "c#%d dropping retained ITT=%x StatSN=%u\n",
+		    conn->id, rt->task_tag, rt->StatSN);
+		istgt_iscsi_retain_remove(conn, rt);
+		istgt_iscsi_retained_free(rt);
+	}
+}
+
+/* retain_mutex is held, answered tasks other than keep may make room */
+static int
+istgt_iscsi_retain_fits(CONN_Ptr conn, size_t need, ISTGT_RETAINED_TASK *keep)
+{
+	if (conn->retained_bytes + need > ISTGT_RETAIN_MAX)
+		istgt_iscsi_retain_trim(conn, need, keep);
+	return (conn->retained_bytes + need <= ISTGT_RETAIN_MAX);
+}
+
+static ISTGT_RETAINED_TASK *
+istgt_iscsi_retain_new(CONN_Ptr conn, uint32_t task_tag)
+{
+	ISTGT_RETAINED_TASK *rt;
+
+	rt = xmalloc(sizeof (*rt));
+	memset(rt, 0, sizeof (*rt));
+	rt->task_tag = task_tag;
+	rt->status_pdu = -1;
+	rt->bytes = sizeof (*rt);
+	istgt_iscsi_retain_add(conn, rt);
+	return (rt);
+}
+
+/*
+ * ErrorRecoveryLevel 2: a command is known from its arrival, so that a
+ * TASK REASSIGN of it after its connection failed finds it running.
+ */
+static void
+istgt_iscsi_retain_task(CONN_Ptr conn, uint32_t task_tag)
+{
+	ISTGT_RETAINED_TASK *rt;
+
+	MTX_LOCK(&conn->retain_mutex);
+	rt = istgt_iscsi_retain_find(conn, task_tag);
+	if (rt != NULL) {
+		/* the ITT of an aborted task, used again */
+		istgt_iscsi_retain_remove(conn, rt);
+		istgt_iscsi_retained_free(rt);
+	}
+	(void) istgt_iscsi_retain_new(conn, task_tag);
+	MTX_UNLOCK(&conn->retain_mutex);
+}
+
+/* retain_mutex is held, a status that came with StatSN */
+static void
+istgt_iscsi_retain_status(CONN_Ptr conn, ISTGT_RETAINED_TASK *rt, uint32_t StatSN, int status_pdu)
+{
+	rt->status_pdu = status_pdu;
+	if (rt->has_status) {
+		if (rt->StatSN == StatSN)
+			return;
+		/* sent again, a reassigned status has a new StatSN */
+		istgt_iscsi_retain_dequeue(conn, rt);
+	}
+	rt->has_status = 1;
+	rt->StatSN = StatSN;
+	istgt_iscsi_retain_queue(conn, rt);
+}
+
+/* retain_mutex is held, room in pdus for index sn */
+static int
+istgt_iscsi_retain_grow(CONN_Ptr conn, ISTGT_RETAINED_TASK *rt, uint32_t sn)
+{
+	ISCSI_BHS *pdus;
+	size_t need;
+	int n;
+
+	if (sn < (uint32_t) rt->maxpdus)
+		return (0);
+	if (sn >= ISTGT_RETAIN_MAX / ISCSI_BHS_LEN)
+		return (-1);
+	for (n = rt->maxpdus ? rt->maxpdus : 8; (uint32_t) n <= sn; n *= 2)
+		;
+	need = (n - rt->maxpdus) * sizeof (ISCSI_BHS);
+	if (!istgt_iscsi_retain_fits(conn, need, rt))
+		return (-1);
+	pdus = xmalloc(n * sizeof (ISCSI_BHS));
+	memset(pdus, 0, n * sizeof (ISCSI_BHS));
+	if (rt->npdus != 0)
+		memcpy(pdus, rt->pdus, rt->npdus * sizeof (ISCSI_BHS));
+	if (rt->pdus != NULL)
+		xfree(rt->pdus);
+	rt->pdus = pdus;
+	rt->maxpdus = n;
+	rt->bytes += need;
+	conn->retained_bytes += need;
+	return (0);
+}
+
+/*
+ * Called for every PDU sent, keeps the BHS of a DATA-IN, R2T or SCSI
+ * Response by the ITT of its task.  The payload of a DATA-IN is not
+ * copied here, istgt_iscsi_retain_data() takes the whole read over.
+ */
+static void
+istgt_iscsi_retain_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	ISTGT_RETAINED_TASK *rt;
+	uint8_t *cp;
+	uint32_t task_tag;
+	uint32_t sn;
+	size_t data_len;
+	int opcode;
+
+	cp = (uint8_t *) &pdu->bhs;
+	opcode = BGET8W(&cp[0], 5, 6);
+	if (opcode != ISCSI_OP_SCSI_DATAIN && opcode != ISCSI_OP_R2T
+	    && opcode != ISCSI_OP_SCSI_RSP)
+		return;
+	task_tag = DGET32(&cp[16]);
+
+	MTX_LOCK(&conn->retain_mutex);
+	rt = istgt_iscsi_retain_find(conn, task_tag);
+	if (rt == NULL)
+		rt = istgt_iscsi_retain_new(conn, task_tag);
+	if (opcode == ISCSI_OP_SCSI_RSP) {
+		/* sense data, a few bytes; the same again when resent */
+		data_len = DGET24(&cp[5]);
+		if (data_len != 0 && rt->rsp_data == NULL) {
+			rt->rsp_data = xmalloc(data_len);
+			memcpy(rt->rsp_data, pdu->data, data_len);
+			rt->rsp_len = data_len;
+			rt->bytes += data_len;
+			conn->retained_bytes += data_len;
+		}
+		memcpy(&rt->rsp, &pdu->bhs, ISCSI_BHS_LEN);
+		istgt_iscsi_retain_status(conn, rt, DGET32(&cp[24]), -1);
+		MTX_UNLOCK(&conn->retain_mutex);
+		return;
+	}
+
+	sn = DGET32(&cp[36]);
+	if (opcode == ISCSI_OP_SCSI_DATAIN)
+		rt->datain = 1;
+	if (istgt_iscsi_retain_grow(conn, rt, sn) != 0) {
+		rt->partial = 1;
+		/* acknowledged all the same, with nothing to send again */
+		if (opcode == ISCSI_OP_SCSI_DATAIN && BGET8(&cp[1], 0))
+			istgt_iscsi_retain_status(conn, rt, DGET32(&cp[24]),
+			    -1);
+		MTX_UNLOCK(&conn->retain_mutex);
+		return;
+	}
+	memcpy(&rt->pdus[sn], &pdu->bhs, ISCSI_BHS_LEN);
+	if (sn >= (uint32_t) rt->npdus)
+		rt->npdus = sn + 1;
+	if (opcode == ISCSI_OP_SCSI_DATAIN && BGET8(&cp[1], 0))
+		istgt_iscsi_retain_status(conn, rt, DGET32(&cp[24]), sn);
+	MTX_UNLOCK(&conn->retain_mutex);
+}
+
+/*
+ * The read data of lu_cmd went out in DATA-IN, the retained task takes
+ * the buffer over in place of a copy.  Past ISTGT_RETAIN_MAX only the
+ * DATA-IN that carried the status is kept, copied.
+ */
+static void
+istgt_iscsi_retain_data(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, size_t len)
+{
+	ISTGT_RETAINED_TASK *rt;
+	uint8_t *cp;
+	uint32_t off;
+	size_t seg;
+
+	if (lu_cmd->data == NULL || len == 0)
+		return;
+	MTX_LOCK(&conn->retain_mutex);
+	rt = istgt_iscsi_retain_find(conn, lu_cmd->task_tag);
+	if (rt == NULL || rt->buf != NULL) {
+		MTX_UNLOCK(&conn->retain_mutex);
+		return;
+	}
+	if (rt->partial == 0 && istgt_iscsi_retain_fits(conn, len, rt)) {
+		rt->buf = lu_cmd->data;
+		rt->buf_off = 0;
+		rt->buf_len = len;
+		lu_cmd->data = NULL;
+	} else if (rt->has_status && rt->status_pdu >= 0) {
+		rt->partial = 1;
+		cp = (uint8_t *) &rt->pdus[rt->status_pdu];
+		off = DGET32(&cp[40]);
+		seg = DGET24(&cp[5]);
+		if (off + seg <= len) {
+			rt->buf = xmalloc(seg);
+			memcpy(rt->buf, lu_cmd->data + off, seg);
+			rt->buf_off = off;
+			rt->buf_len = seg;
+		}
+	} else {
+		rt->partial = 1;
+	}
+	rt->bytes += rt->buf_len;
+	conn->retained_bytes += rt->buf_len;
+	MTX_UNLOCK(&conn->retain_mutex);
+}
+
+/* the initiator has the status of everything before ExpStatSN */
+static void
+istgt_iscsi_retain_ack(CONN_Ptr conn, uint32_t ExpStatSN)
+{
+	ISTGT_RETAINED_TASK *rt;
+
+	if (ExpStatSN == conn->retain_ack)
+		return;
+	conn->retain_ack = ExpStatSN;
+
+	MTX_LOCK(&conn->retain_mutex);
+	while ((rt = conn->retained) != NULL
+	    && SN32_LT(rt->StatSN, ExpStatSN)) {
+		istgt_iscsi_retain_remove(conn, rt);
+		istgt_iscsi_retained_free(rt);
+	}
+	MTX_UNLOCK(&conn->retain_mutex);
+}
+
+/* everything rt sent can be sent again */
+static int
+istgt_iscsi_retained_whole(ISTGT_RETAINED_TASK *rt)
+{
+	return (rt->partial == 0 && (rt->datain == 0 || rt->buf != NULL));
+}
+
+/* retain_mutex is held, a copy of bhs with its payload, if that was kept */
+static ISTGT_RETAINED_PDU *
+istgt_iscsi_retained_dup(ISTGT_RETAINED_TASK *rt, ISCSI_BHS *bhs, uint32_t sn)
+{
+	ISTGT_RETAINED_PDU *dup;
+	const uint8_t *data = NULL;
+	uint8_t *cp;
+	size_t data_len;
+	uint32_t off;
+
+	cp = (uint8_t *) bhs;
+	if (cp[0] == 0)
+		return (NULL);
+	data_len = DGET24(&cp[5]);
+	if (data_len == 0) {
+		;
+	} else if (BGET8W(&cp[0], 5, 6) == ISCSI_OP_SCSI_RSP) {
+		if (rt->rsp_len != data_len)
+			return (NULL);
+		data = rt->rsp_data;
+	} else {
+		/* DATA-IN, from the read data if it was kept */
+		off = DGET32(&cp[40]);
+		if (rt->buf == NULL || off < rt->buf_off
+		    || off - rt->buf_off + data_len > rt->buf_len)
+			return (NULL);
+		data = rt->buf + (off - rt->buf_off);
+	}
+	dup = xmalloc(sizeof (*dup) + data_len);
+	dup->next = NULL;
+	dup->sn = sn;
+	dup->data_len = data_len;
+	memcpy(&dup->bhs, bhs, ISCSI_BHS_LEN);
+	if (data_len != 0)
+		memcpy(dup->data, data, data_len);
+	return (dup);
+}
+
+/*
+ * Copies of what task rt sent: with data, its DATA-IN and R2T of a
+ * DataSN/R2TSN in the run; with status, the PDU carrying its status.
+ */
+static ISTGT_RETAINED_PDU *
+istgt_iscsi_retained_pick(ISTGT_RETAINED_TASK *rt, int data, uint32_t beg_run, uint32_t run_length, int status)
+{
+	ISTGT_RETAINED_PDU *dup, *head, *tail;
+	uint32_t sn, end;
+	int status_sent = 0;
+
+	head = tail = NULL;
+	if (data && beg_run < (uint32_t) rt->npdus) {
+		end = rt->npdus;
+		if (run_length != 0 && run_length < end - beg_run)
+			end = beg_run + run_length;
+		for (sn = beg_run; sn < end; sn++) {
+			if (rt->pdus[sn].opcode == 0)
+				continue;
+			dup = istgt_iscsi_retained_dup(rt, &rt->pdus[sn], sn);
+			if (dup == NULL)
+				continue;
+			if ((int) sn == rt->status_pdu)
+				status_sent = 1;
+			if (tail != NULL)
+				tail->next = dup;
+			else
+				head = dup;
+			tail = dup;
+		}
+	}
+	if (status && rt->has_status && status_sent == 0) {
+		if (rt->status_pdu >= 0)
+			dup = istgt_iscsi_retained_dup(rt,
+			    &rt->pdus[rt->status_pdu], rt->status_pdu);
+		else
+			dup = istgt_iscsi_retained_dup(rt, &rt->rsp, 0);
+		if (dup != NULL) {
+			if (tail != NULL)
+				tail->next = dup;
+			else
+				head = dup;
+		}
+	}
+	return (head);
+}
+
+/*
+ * Sends the copies in list again and frees them.  With upd the status
+ * takes the next StatSN of this connection, else it keeps its own.
+ */
+static int
+istgt_iscsi_resend(CONN_Ptr conn, ISTGT_RETAINED_PDU *list, int upd)
+{
+	ISTGT_RETAINED_PDU *rp;
+	ISCSI_PDU pdu;
+	uint8_t *cp;
+	int opcode;
+	int rc = 0;
+
+	while ((rp = list) != NULL) {
+		list = rp->next;
+		if (rc < 0) {
+			xfree(rp);
+			continue;
+		}
+		memset(&pdu, 0, sizeof (pdu));
+		memcpy(&pdu.bhs, &rp->bhs, ISCSI_BHS_LEN);
+		if (rp->data_len != 0) {
+			pdu.data = xmalloc(ISCSI_ALIGN(rp->data_len));
+			memset(pdu.data + rp->data_len, 0,
+			    ISCSI_ALIGN(rp->data_len) - rp->data_len);
+			memcpy(pdu.data, rp->data, rp->data_len);
+			pdu.data_segment_len = rp->data_len;
+		}
+		cp = (uint8_t *) &pdu.bhs;
+		opcode = BGET8W(&cp[0], 5, 6);
+		SESS_MTX_LOCK(conn);
+		DSET32(&cp[28], conn->sess->ExpCmdSN);
+		DSET32(&cp[32], conn->sess->MaxCmdSN);
+		SESS_MTX_UNLOCK(conn);
+		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+		    "c#%d resend OP=0x%x ITT=%x SN=%u\n",
+		    conn->id, opcode, DGET32(&cp[16]), rp->sn);
+		if (upd && (opcode == ISCSI_OP_SCSI_RSP
+		    || (opcode == ISCSI_OP_SCSI_DATAIN && BGET8(&cp[1], 0))))
+			rc = istgt_iscsi_write_pdu_upd(conn, &pdu, 1);
+		else
+			rc = istgt_iscsi_write_pdu(conn, &pdu);
+		if (rc < 0)
+			ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
+		xfree(rp);
+	}
+	return (rc < 0 ? -1 : 0);
+}
+
+/* a retried command whose status went missing gets it again */
+static int
+istgt_iscsi_resend_task(CONN_Ptr conn, uint32_t task_tag)
+{
+	ISTGT_RETAINED_TASK *rt;
+	ISTGT_RETAINED_PDU *list;
+
+	list = NULL;
+	MTX_LOCK(&conn->retain_mutex);
+	rt = istgt_iscsi_retain_find(conn, task_tag);
+	if (rt != NULL && rt->has_status && istgt_iscsi_retained_whole(rt))
+		list = istgt_iscsi_retained_pick(rt, 1, 0, 0, 1);
+	MTX_UNLOCK(&conn->retain_mutex);
+	if (list == NULL) {
+		/* still running, or never seen */
+		ISTGT_WARNLOG("c#%d retried ITT=%x has no status to resend\n",
+		    conn->id, task_tag);
+		return (0);
+	}
+	return (istgt_iscsi_resend(conn, list, 0));
+}
+
+typedef struct iscsi_param_table_t
+{
+	const char *key;
+	const char *val;
+	const char *list;
+	int type;
+} ISCSI_PARAM_TABLE;
+
+static ISCSI_PARAM_TABLE conn_param_table[] =
+{
+	{ "HeaderDigest", "None", "CRC32C,None", ISPT_LIST },
+	{ "DataDigest", "None", "CRC32C,None", ISPT_LIST },
+	{ "MaxRecvDataSegmentLength", "8192", "512,16777215", ISPT_NUMERICAL },
+	{ "OFMarker", "No", "Yes,No", ISPT_BOOLEAN_AND },
+	{ "IFMarker", "No", "Yes,No", ISPT_BOOLEAN_AND },
+	{ "OFMarkInt", "1", "1,65535", ISPT_NUMERICAL },
+	{ "IFMarkInt", "1", "1,65535", ISPT_NUMERICAL },
+	{ "AuthMethod", "None", "CHAP,None", ISPT_LIST },
+	{ "CHAP_A", "5", "5", ISPT_LIST },
+	{ "CHAP_N", "", "", ISPT_DECLARATIVE },
+	{ "CHAP_R", "", "", ISPT_DECLARATIVE },
+	{ "CHAP_I", "", "", ISPT_DECLARATIVE },
 	{ "CHAP_C", "", "", ISPT_DECLARATIVE },
 	{ NULL, NULL, NULL, ISPT_INVALID },
 };
@@ -1714,6 +2410,20 @@ istgt_iscsi_copy_param2var(CONN_Ptr conn)
 		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "set ImmediateData=0\n");
 		conn->sess->immediate_data = 0;
 	}
+	val = ISCSI_GETVAL(conn->sess->params, "DefaultTime2Wait");
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "copy DefaultTime2Wait=%s\n", val);
+	conn->sess->DefaultTime2Wait = (int) strtol(val, NULL, 10);
+	val = ISCSI_GETVAL(conn->sess->params, "DefaultTime2Retain");
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "copy DefaultTime2Retain=%s\n", val);
+	conn->sess->DefaultTime2Retain = (int) strtol(val, NULL, 10);
+	val = ISCSI_GETVAL(conn->sess->params, "ErrorRecoveryLevel");
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "copy ErrorRecoveryLevel=%s\n", val);
+	conn->sess->ErrorRecoveryLevel = (int) strtol(val, NULL, 10);
+	/* a discovery session has nothing to recover */
+	if (ISCSI_EQVAL(conn->sess->params, "SessionType", "Normal"))
+		conn->error_recovery = conn->sess->ErrorRecoveryLevel;
+	else
+		conn->error_recovery = 0;
 	SESS_MTX_UNLOCK(conn);
 }
 
@@ -2127,6 +2837,9 @@ istgt_iscsi_op_login(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			conn->queue_depth = lu->queue_depth;
 		}
 		conn->max_pending = (conn->queue_depth + 1) * 2;
+		if (conn->task_pool == NULL)
+			conn->task_pool = istgt_lu_task_pool_create(
+			    (conn->queue_depth + 1) * 2);
 #if 0
 		/* override config setting */
 		MTX_LOCK(&conn->r2t_mutex);
@@ -2332,7 +3045,8 @@ istgt_iscsi_op_login(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		case 3:
 			/* FullFeaturePhase */
 			conn->login_phase = ISCSI_LOGIN_PHASE_FULLFEATURE;
-			rc = istgt_lu_add_nexus(conn->sess->lu, conn->initiator_port);
+			/* the nexus keeps the name, it lives as long as the session */
+			rc = istgt_lu_add_nexus(conn->sess->lu, conn->sess->initiator_port);
 			if (rc == -1) {
 				/* Ignore the error, Since during discovery there is no nexus formed */
 				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "Failed to Add  the Nexus\n");
@@ -2494,8 +3208,6 @@ response:
 		if (rc < 0) {
 			ISTGT_ERRLOG("iscsi_check_values() failed\n");
 			istgt_iscsi_param_free(params);
-			if (data != NULL)
-				xfree(data);
 			return (-1);
 		}
 	}
@@ -2699,6 +3411,7 @@ istgt_iscsi_op_text(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		conn->sess->ExpCmdSN++;
 		conn->sess->MaxCmdSN++;
 		conn->sess->MaxCmdSN_local++;
+		istgt_iscsi_cmdsn_next(conn->sess);
 	}
 	DSET32(&rsp[28], conn->sess->ExpCmdSN);
 	DSET32(&rsp[32], conn->sess->MaxCmdSN);
@@ -2727,6 +3440,33 @@ istgt_iscsi_op_text(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	return (0);
 }
 
+/*
+ * A logout closing the session closes its other connections as well, a
+ * connection can also be closed by a logout on another one with its CID.
+ */
+static void
+istgt_iscsi_logout_conns(CONN_Ptr conn, int reason, uint16_t cid)
+{
+	SESS_Ptr sess = conn->sess;
+	CONN_Ptr xconn;
+	int i;
+
+	MTX_LOCK(&sess->mutex);
+	for (i = 0; i < sess->connections; i++) {
+		xconn = sess->conns[i];
+		if (xconn == conn || xconn->state != CONN_STATE_RUNNING)
+			continue;
+		if (reason != 0 && xconn->cid != cid)
+			continue;
+		ISTGT_NOTICELOG("c#%d CID=%u closed by logout on CID=%u\n",
+			xconn->id, xconn->cid, conn->cid);
+		if (reason != 2 || xconn->error_recovery < 2)
+			xconn->no_recovery = 1;
+		(void) istgt_iscsi_task_exit(xconn);
+	}
+	MTX_UNLOCK(&sess->mutex);
+}
+
 static int
 istgt_iscsi_op_logout(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 {
@@ -2738,6 +3478,7 @@ istgt_iscsi_op_logout(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	uint16_t cid;
 	uint32_t CmdSN;
 	uint32_t ExpStatSN;
+	int I_bit;
 	int reason;
 	int response;
 	int data_len;
@@ -2745,6 +3486,7 @@ istgt_iscsi_op_logout(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 
 	data_len = 0;
 	cp = (uint8_t *) &pdu->bhs;
+	I_bit = BGET8(&cp[0], 6);
 	reason = BGET8W(&cp[1], 6, 7);
 
 	task_tag = DGET32(&cp[16]);
@@ -2814,6 +3556,12 @@ istgt_iscsi_op_logout(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			conn->sess->ExpCmdSN++;
 			conn->sess->MaxCmdSN++;
 			conn->sess->MaxCmdSN_local++;
+		} else if (I_bit == 0 && CmdSN == conn->sess->ExpCmdSN) {
+			/* MC/S, the session goes on with the others */
+			conn->sess->ExpCmdSN++;
+			conn->sess->MaxCmdSN++;
+			conn->sess->MaxCmdSN_local++;
+			istgt_iscsi_cmdsn_next(conn->sess);
 		}
 		DSET32(&rsp[28], conn->sess->ExpCmdSN);
 		DSET32(&rsp[32], conn->sess->MaxCmdSN);
@@ -2825,14 +3573,24 @@ istgt_iscsi_op_logout(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		DSET32(&rsp[32], CmdSN);
 	}
 
-	DSET16(&rsp[40], 0); // Time2Wait
-	DSET16(&rsp[42], 0); // Time2Retain
+	/* remove the connection for recovery, its tasks may be reassigned */
+	if (reason == 2 && conn->error_recovery >= 2) {
+		DSET16(&rsp[40], conn->sess->DefaultTime2Wait); // Time2Wait
+		DSET16(&rsp[42], conn->sess->DefaultTime2Retain); // Time2Retain
+	} else {
+		DSET16(&rsp[40], 0); // Time2Wait
+		DSET16(&rsp[42], 0); // Time2Retain
+		if (reason == 0 || cid == conn->cid)
+			conn->no_recovery = 1;
+	}
 
 	rc = istgt_iscsi_write_pdu(conn, &rsp_pdu);
 	if (rc < 0) {
 		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
 		return (-1);
 	}
+	if (conn->sess != NULL && (reason == 0 || cid != conn->cid))
+		istgt_iscsi_logout_conns(conn, reason, cid);
 
 	SESS_MTX_LOCK(conn);
 	if (ISCSI_EQVAL(conn->sess->params, "SessionType", "Normal")) {
@@ -3026,6 +3784,9 @@ istgt_iscsi_transfer_in_internal(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			return (-1);
 		}
 	}
+	/* kept for SNACK instead of a copy of each DATA-IN */
+	if (conn->error_recovery != 0)
+		istgt_iscsi_retain_data(conn, lu_cmd, transfer_len);
 
 	if (sent_status) {
 		return (1);
@@ -3391,42 +4152,342 @@ timediff(ISTGT_LU_CMD_Ptr p, char  ch, uint16_t line)
 	}
 }
 
+/*
+ * Queue a SCSI command to its LU.  0 when queued, the LU task answers it
+ * then; 1 when the status is to be sent from here.
+ */
 static int
-istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+istgt_iscsi_queue_scsi(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, const char **que)
+{
+	int rc;
+
+	rc = istgt_lu_disk_queue(conn, lu_cmd);
+	if (rc < 0) {
+		ISTGT_ERRLOG("LU%d: lu_disk_queue() failed\n", lu_cmd->lu->num);
+		return (-1);
+	}
+	switch (rc) {
+		case ISTGT_LU_TASK_RESULT_QUEUE_OK:
+			return (0);
+		case ISTGT_LU_TASK_RESULT_QUEUE_FULL:
+			*que =  "QueueFull ";
+			ISTGT_WARNLOG("Queue Full\n");
+			break;
+		case ISTGT_LU_TASK_RESULT_IMMEDIATE:
+			*que =  "Immediate ";
+			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "Immediate\n");
+			break;
+		default:
+			ISTGT_ERRLOG("lu_disk_queue unknown rc=%d\n", rc);
+			return (-1);
+	}
+	return (1);
+}
+
+/* status of a command that did not get to an LU task */
+static int
+istgt_iscsi_scsi_status(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, const char *que)
 {
-	int istgt_state, lunum;
-	ISTGT_LU_Ptr lu;
-	ISTGT_LU_CMD lu_cmd;
 	ISCSI_PDU rsp_pdu;
 	uint8_t *rsp;
 	uint8_t *cp;
-	// uint8_t *data;
-	uint8_t *cdb;
-	uint64_t lun;
-	uint32_t task_tag;
-	uint32_t transfer_len;
-	uint32_t CmdSN;
 	uint32_t ExpStatSN;
+	uint32_t StatSN, ExpCmdSN, MaxCmdSN;
 	size_t bidi_residual_len;
 	size_t residual_len;
 	size_t data_len;
-	int I_bit, F_bit, R_bit, W_bit, Attr_bit;
 	int o_bit, u_bit, O_bit, U_bit;
 	int rc;
-	uint32_t c_StatSN, s_ExpCmdSN, s_MaxCmdSN;
-	uint32_t QCmdSN;
-	int s_conns;
-	int operation_mode = 0;
-	const char *msg = "", *que = "";
-	if (!conn->full_feature) {
-		ISTGT_ERRLOG("before Full Feature\n");
-		return (-1);
-	}
+	const char *msg = "";
 
-	data_len = 0;
+	cp = (uint8_t *) &lu_cmd->pdu->bhs;
+	ExpStatSN = DGET32(&cp[28]);
 
-	cp = (uint8_t *) &pdu->bhs;
-	I_bit = BGET8(&cp[0], 6);
+	/* transfer data from logical unit */
+	/* (direction is view of initiator side) */
+	if (lu_cmd->R_bit
+		&& (lu_cmd->status == ISTGT_SCSI_STATUS_GOOD
+			|| lu_cmd->sense_data_len != 0)) {
+		rc = istgt_iscsi_transfer_in(conn, lu_cmd);
+		if (rc < 0) {
+			ISTGT_ERRLOG("iscsi_transfer_in() failed\n");
+			return (-1);
+		}
+		if (rc > 0) {
+			/* sent status by last DATAIN PDU */
+			return (0);
+		}
+	}
+
+	o_bit = u_bit = O_bit = U_bit = 0;
+	bidi_residual_len = residual_len = 0;
+	data_len = lu_cmd->data_len;
+	if (lu_cmd->transfer_len != 0
+		&& lu_cmd->status == ISTGT_SCSI_STATUS_GOOD) {
+		if (data_len < lu_cmd->transfer_len) {
+			/* underflow */
+			msg = "Underflow";
+			residual_len = lu_cmd->transfer_len - data_len;
+			U_bit = 1;
+		} else if (data_len > lu_cmd->transfer_len) {
+			/* overflow */
+			msg = "Overflow";
+			residual_len = data_len - lu_cmd->transfer_len;
+			O_bit = 1;
+		} else {
+			msg = "Transfer";
+		}
+	}
+
+	/* response PDU */
+	rsp = (uint8_t *) &rsp_pdu.bhs;
+	// memset(rsp, 0, ISCSI_BHS_LEN);
+	uint64_t *tptr = (uint64_t *)rsp;
+	*tptr = 0; *(tptr+1) = 0; *(tptr+2) = 0;
+	*(tptr+3) = 0; *(tptr+4) = 0; *(tptr+5) = 0;
+
+	rsp[0] = ISCSI_OP_SCSI_RSP;
+	BDADD8(&rsp[1], 1, 7);
+	BDADD8(&rsp[1], o_bit, 4);
+	BDADD8(&rsp[1], u_bit, 3);
+	BDADD8(&rsp[1], O_bit, 2);
+	BDADD8(&rsp[1], U_bit, 1);
+	rsp[2] = 0x00; // Command Completed at Target
+	// rsp[2] = 0x01; // Target Failure
+	rsp[3] = lu_cmd->status;
+	rsp[4] = 0; // TotalAHSLength
+	rsp_pdu.data = lu_cmd->sense_data;
+	DSET24(&rsp[5], lu_cmd->sense_data_len); // DataSegmentLength
+	rsp_pdu.data_segment_len = lu_cmd->sense_data_len;
+	lu_cmd->sense_data = NULL; lu_cmd->sense_data_len = 0;
+	DSET32(&rsp[16], lu_cmd->task_tag);
+	DSET32(&rsp[20], 0); // SNACK Tag
+
+	SESS_MTX_LOCK(conn);
+	StatSN = conn->StatSN;
+	DSET32(&rsp[24], conn->StatSN);
+	conn->StatSN++;
+	if (lu_cmd->I_bit == 0) {
+		if (likely((lu_cmd->lu->limit_q_size == 0) || ((int)(conn->sess->MaxCmdSN - conn->sess->ExpCmdSN) < lu_cmd->lu->limit_q_size))) {
+			conn->sess->MaxCmdSN++;
+			conn->sess->MaxCmdSN_local++;
+			if (unlikely((conn->sess->MaxCmdSN != conn->sess->MaxCmdSN_local) && (lu_cmd->lu->limit_q_size == 0))) {
+				ISTGT_LOG("conn->sess->MaxCmdSN != conn->sess->MaxCmdSN_local in op_scsi\n");
+				conn->sess->MaxCmdSN = conn->sess->MaxCmdSN_local;
+			}
+		} else
+			conn->sess->MaxCmdSN_local++;
+	}
+	ExpCmdSN = conn->sess->ExpCmdSN;
+	MaxCmdSN = conn->sess->MaxCmdSN;
+	DSET32(&rsp[28], ExpCmdSN);
+	DSET32(&rsp[32], MaxCmdSN);
+	SESS_MTX_UNLOCK(conn);
+
+	DSET32(&rsp[36], 0); // ExpDataSN
+	DSET32(&rsp[40], bidi_residual_len);
+	DSET32(&rsp[44], residual_len);
+
+	rc = istgt_iscsi_write_pdu(conn, &rsp_pdu);
+	if (rc < 0) {
+		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
+	} else {
+		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+		    "op_scsi_done: status:%d %s, CmdSN=%u, ExpStatSN=%u, StatSN=%u, ExpCmdSN=%u, MaxCmdSN=%u"
+		    "I=%d, F=%d, R=%d, W=%d, Attr=%d, ITT=%x, TL=%u (%s %lu)\n",
+		    lu_cmd->status, que, lu_cmd->CmdSN, ExpStatSN, StatSN, ExpCmdSN, MaxCmdSN,
+		    lu_cmd->I_bit, lu_cmd->F_bit, lu_cmd->R_bit, lu_cmd->W_bit, lu_cmd->Attr_bit,
+		    lu_cmd->task_tag, lu_cmd->transfer_len, msg, data_len);
+	}
+	if (lu_cmd->sense_data != NULL) {
+		xfree(lu_cmd->sense_data);
+		lu_cmd->sense_data = NULL;
+	}
+	if (lu_cmd->data != NULL) {
+		xfree(lu_cmd->data);
+		lu_cmd->data = NULL;
+	}
+	return (rc < 0 ? -1 : 0);
+}
+
+
+/* a command discarded on a data digest error, its CmdSN is let in again */
+static int
+istgt_iscsi_cmdsn_hole(CONN_Ptr conn, uint32_t CmdSN)
+{
+	SESS_MTX_LOCK(conn);
+	if (conn->sess->ncmdsn_holes >= ISTGT_CMDSN_HOLES) {
+		SESS_MTX_UNLOCK(conn);
+		ISTGT_ERRLOG("c#%d too many commands to retry, CmdSN=%u\n",
+			conn->id, CmdSN);
+		return (-1);
+	}
+	conn->sess->cmdsn_holes[conn->sess->ncmdsn_holes++] = CmdSN;
+	SESS_MTX_UNLOCK(conn);
+	return (0);
+}
+
+/* session mutex is held, 1 if CmdSN was waiting to be retried */
+static int
+istgt_iscsi_cmdsn_plug(SESS_Ptr sess, uint32_t CmdSN)
+{
+	int i;
+
+	for (i = 0; i < sess->ncmdsn_holes; i++) {
+		if (sess->cmdsn_holes[i] == CmdSN) {
+			sess->ncmdsn_holes--;
+			sess->cmdsn_holes[i] = sess->cmdsn_holes[sess->ncmdsn_holes];
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * MC/S: a command ahead of ExpCmdSN waits in the session for the ones
+ * before it to come in on the other connections, so that the LU gets
+ * them in CmdSN order and no connection stops reading meanwhile.
+ * Returns 1 if pdu was taken to wait, 0 if it is for now.
+ */
+static int
+istgt_iscsi_cmdsn_wait(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, uint32_t CmdSN,
+    uint32_t *ExpCmdSN, uint32_t *MaxCmdSN)
+{
+	SESS_Ptr sess = conn->sess;
+	ISTGT_CMDSN_WAIT *w, **wp;
+
+	MTX_LOCK(&sess->mutex);
+	*ExpCmdSN = sess->ExpCmdSN;
+	*MaxCmdSN = sess->MaxCmdSN;
+	/* with one connection a command before it was lost */
+	if ((sess->connections < 2 && sess->cmdsn_wait == NULL)
+	    || !SN32_GT(CmdSN, sess->ExpCmdSN)
+	    || SN32_GT(CmdSN, sess->MaxCmdSN)) {
+		MTX_UNLOCK(&sess->mutex);
+		return (0);
+	}
+	for (wp = &sess->cmdsn_wait; *wp != NULL; wp = &(*wp)->next) {
+		if ((*wp)->CmdSN == CmdSN) {
+			MTX_UNLOCK(&sess->mutex);
+			ISTGT_ERRLOG("c#%d CmdSN(%u) is waiting already\n",
+				conn->id, CmdSN);
+			return (-1);
+		}
+		if (SN32_GT((*wp)->CmdSN, CmdSN))
+			break;
+	}
+	w = xmalloc(sizeof (*w));
+	w->conn = conn;
+	w->CmdSN = CmdSN;
+	w->task_tag = DGET32(&((uint8_t *) &pdu->bhs)[16]);
+	w->aborted = 0;
+	istgt_iscsi_copy_pdu(&w->pdu, pdu);
+	w->next = *wp;
+	*wp = w;
+	MTX_UNLOCK(&sess->mutex);
+	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "c#%d CmdSN(%u) waits, ExpCmdSN=%u\n",
+		conn->id, CmdSN, *ExpCmdSN);
+	return (1);
+}
+
+static void
+istgt_iscsi_cmdsn_wait_free(ISTGT_CMDSN_WAIT *w)
+{
+	if (w->pdu.ahs != NULL)
+		xfree(w->pdu.ahs);
+	if (w->pdu.data != NULL)
+		xfree(w->pdu.data);
+	xfree(w);
+}
+
+/*
+ * Session mutex is held, after ExpCmdSN moved on.  The connection of the
+ * command now due is woken to run it, an aborted one only takes its
+ * CmdSN.
+ */
+static void
+istgt_iscsi_cmdsn_next(SESS_Ptr sess)
+{
+	ISTGT_CMDSN_WAIT *w;
+
+	while ((w = sess->cmdsn_wait) != NULL && w->CmdSN == sess->ExpCmdSN) {
+		if (w->aborted == 0) {
+			(void) istgt_iscsi_task_notify(w->conn);
+			return;
+		}
+		sess->cmdsn_wait = w->next;
+		sess->ExpCmdSN++;
+		sess->MaxCmdSN++;
+		sess->MaxCmdSN_local++;
+		istgt_iscsi_cmdsn_wait_free(w);
+	}
+}
+
+/*
+ * Session mutex is held.  The waiting commands before CmdSN are aborted,
+ * only task_tag of them unless it is 0xffffffff.  Returns how many.
+ */
+static int
+istgt_iscsi_cmdsn_wait_abort(SESS_Ptr sess, uint32_t CmdSN, uint32_t task_tag)
+{
+	ISTGT_CMDSN_WAIT *w;
+	int n = 0;
+
+	for (w = sess->cmdsn_wait; w != NULL; w = w->next) {
+		if (w->aborted || !SN32_LT(w->CmdSN, CmdSN))
+			continue;
+		if (task_tag != 0xffffffffU && w->task_tag != task_tag)
+			continue;
+		w->aborted = 1;
+		n++;
+	}
+	istgt_iscsi_cmdsn_next(sess);
+	return (n);
+}
+
+/* session mutex is held, conn is gone before running what it had waiting */
+static void
+istgt_iscsi_cmdsn_wait_drop(CONN_Ptr conn)
+{
+	ISTGT_CMDSN_WAIT *w;
+
+	for (w = conn->sess->cmdsn_wait; w != NULL; w = w->next) {
+		if (w->conn == conn) {
+			w->aborted = 1;
+			w->conn = NULL;
+		}
+	}
+	istgt_iscsi_cmdsn_next(conn->sess);
+}
+
+static int
+istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	int istgt_state, lunum;
+	ISTGT_LU_Ptr lu;
+	ISTGT_LU_CMD lu_cmd;
+	uint8_t *cp;
+	// uint8_t *data;
+	uint8_t *cdb;
+	uint64_t lun;
+	uint32_t task_tag;
+	uint32_t transfer_len;
+	uint32_t CmdSN;
+	uint32_t ExpStatSN;
+	int I_bit, F_bit, R_bit, W_bit, Attr_bit;
+	int rc;
+	uint32_t c_StatSN, s_ExpCmdSN, s_MaxCmdSN;
+	uint32_t QCmdSN;
+	int operation_mode = 0;
+	int retry = 0;
+	const char *que = "";
+	if (!conn->full_feature) {
+		ISTGT_ERRLOG("before Full Feature\n");
+		return (-1);
+	}
+
+	cp = (uint8_t *) &pdu->bhs;
+	I_bit = BGET8(&cp[0], 6);
 	F_bit = BGET8(&cp[1], 7);
 	R_bit = BGET8(&cp[1], 6);
 	W_bit = BGET8(&cp[1], 5);
@@ -3448,7 +4509,6 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	c_StatSN  = conn->StatSN;
 	s_ExpCmdSN = conn->sess->ExpCmdSN;
 	s_MaxCmdSN = conn->sess->MaxCmdSN;
-	s_conns = conn->sess->connections;
 	if (conn->sess->lu && conn->sess->lu->istgt)
 		operation_mode = conn->sess->lu->istgt->OperationalMode;
 	lu = conn->sess->lu;
@@ -3477,8 +4537,7 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	timediff(&lu_cmd, 'b', __LINE__);
 	lu_cmd.lunum = lunum;
 
-	lu_cmd.iobufindx = -1;
-	lu_cmd.iobufsize = 0;
+	ISTGT_SGL_INIT(&lu_cmd);
 	lu_cmd.data = NULL; // data;
 	lu_cmd.data_len = 0;
 	lu_cmd.alloc_len = 0; // alloc_len;
@@ -3503,69 +4562,24 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		Attr_bit);
 
 	if (I_bit == 0) {
-		/* XXX MCS reverse order? */
-		if (SN32_GT(CmdSN, s_ExpCmdSN)) {
-			if (s_conns > 1) {
-				struct timespec abstime;
-				time_t start, now;
-
-				start = now = time(NULL);
-				memset(&abstime, 0, sizeof (abstime));
-				abstime.tv_sec = now + (MAX_MCSREVWAIT / 1000);
-				abstime.tv_nsec = (MAX_MCSREVWAIT % 1000) * 1000000;
-
-				rc = 0;
-				SESS_MTX_LOCK(conn);
-				while (SN32_GT(CmdSN, conn->sess->ExpCmdSN)) {
-					conn->sess->req_mcs_cond++;
-					rc = pthread_cond_timedwait(&conn->sess->mcs_cond,
-						&conn->sess->mutex,
-						&abstime);
-					if (rc == ETIMEDOUT) {
-						if (SN32_GT(CmdSN, conn->sess->ExpCmdSN)) {
-							rc = -1;
-							/* timeout */
-							break;
-						}
-						/* OK cond */
-						rc = 0;
-						break;
-					}
-					if (rc != 0) {
-						break;
-					}
-				}
-				c_StatSN = conn->StatSN;
-				s_ExpCmdSN = conn->sess->ExpCmdSN;
-				s_MaxCmdSN = conn->sess->MaxCmdSN;
-				s_conns = conn->sess->connections;
-				if (conn->sess->lu && conn->sess->lu->istgt)
-					operation_mode = conn->sess->lu->istgt->OperationalMode;
-				if (I_bit == 0) {
-					if (SN32_GT(CmdSN, s_ExpCmdSN))
-						conn->sess->ExpCmdSN = CmdSN;
-				} else if (CmdSN == s_ExpCmdSN) {
-					if (SN32_GT(ExpStatSN, c_StatSN))
-						conn->StatSN = ExpStatSN;
-				}
-				SESS_MTX_UNLOCK(conn);
-				if (rc < 0) {
-					now = time(NULL);
-					ISTGT_ERRLOG("MCS: CmdSN(%u) error ExpCmdSN=%u "
-						"(time=%f)\n",
-						CmdSN, s_ExpCmdSN,
-						difftime(now, start));
-					return (-1);
-				}
-#if 0
-				ISTGT_WARNLOG("MCS: reverse CmdSN=%u(retry=%d, yields=%d)\n",
-					CmdSN, retry, try_yields);
-#endif
-			}
-		}
+		rc = istgt_iscsi_cmdsn_wait(conn, pdu, CmdSN, &s_ExpCmdSN,
+		    &s_MaxCmdSN);
+		if (rc != 0)
+			return (rc < 0 ? -1 : 0);
 	}
 
-	if (I_bit == 0) {
+	if (I_bit == 0 && conn->error_recovery != 0
+	    && SN32_LT(CmdSN, s_ExpCmdSN)) {
+		/* discarded on a digest error, or its status went missing */
+		SESS_MTX_LOCK(conn);
+		retry = istgt_iscsi_cmdsn_plug(conn->sess, CmdSN);
+		SESS_MTX_UNLOCK(conn);
+		if (retry == 0) {
+			ISTGT_WARNLOG("CmdSN(%u) < ExpCmdSN(%u) ITT=%x retried\n",
+				CmdSN, s_ExpCmdSN, task_tag);
+			return (istgt_iscsi_resend_task(conn, task_tag));
+		}
+	} else if (I_bit == 0) {
 		if (SN32_LT(CmdSN, s_ExpCmdSN)
 			|| SN32_GT(CmdSN, s_MaxCmdSN)) {
 			ISTGT_ERRLOG("CmdSN(%u) ignore (ExpCmdSN=%u, MaxCmdSN=%u)\n",
@@ -3608,19 +4622,14 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 
 	lu_cmd.pdu = pdu;
 	lu_cmd.lu = conn->sess->lu;
-	if (I_bit == 0) {
+	if (I_bit == 0 && retry == 0) {
+		if (conn->sess->ncmdsn_holes != 0)
+			(void) istgt_iscsi_cmdsn_plug(conn->sess, CmdSN);
 		conn->sess->ExpCmdSN++;
-		if (conn->sess->req_mcs_cond > 0) {
-			conn->sess->req_mcs_cond--;
-			rc = pthread_cond_broadcast(&conn->sess->mcs_cond);
-			if (rc != 0) {
-				SESS_MTX_UNLOCK(conn);
-				ISTGT_ERRLOG("cond_broadcast() failed\n");
-				return (-1);
-			}
-		}
 	}
 	SESS_MTX_UNLOCK(conn);
+	if (conn->error_recovery >= 2)
+		istgt_iscsi_retain_task(conn, task_tag);
 
 	if (R_bit != 0 && W_bit != 0) {
 		ISTGT_ERRLOG("Bidirectional CDB is not supported\n");
@@ -3653,186 +4662,77 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		rc = 0;
 	} else {
 
-		/* need R2T? */
-		if (!operation_mode && (W_bit && F_bit) && (conn->max_r2t > 0)) {
+		/*
+		 * need R2T?  the data is gathered here, the LU gets it all;
+		 * always so in reactor mode, which must not block for it
+		 */
+		if (!operation_mode && W_bit
+			&& (conn->max_r2t > 0 || conn->reactor != NULL)) {
 			if (lu_cmd.pdu->data_segment_len < transfer_len) {
 				rc = istgt_add_transfer_task(conn, &lu_cmd);
 				if (rc < 0) {
 					ISTGT_ERRLOG("add_transfer_task() failed\n");
 					return (-1);
 				}
+				if (rc > 0)
+					return (0);
 			}
 		}
 
+		/* not past a write before it that still gathers DATA-OUT */
+		if (istgt_iscsi_order_wait(conn, &lu_cmd))
+			return (0);
+
 		/* execute SCSI command */
-		rc = istgt_lu_disk_queue(conn, &lu_cmd);
-		if (rc < 0) {
-			ISTGT_ERRLOG("LU%d: lu_disk_queue() failed\n", lu->num);
-			return (-1);
-		}
-		switch (rc) {
-			case ISTGT_LU_TASK_RESULT_QUEUE_OK:
-				return (0);
-			case ISTGT_LU_TASK_RESULT_QUEUE_FULL:
-				que =  "QueueFull ";
-				ISTGT_WARNLOG("Queue Full\n");
-				break;
-			case ISTGT_LU_TASK_RESULT_IMMEDIATE:
-				que =  "Immediate ";
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "Immediate\n");
-				break;
-			default:
-				ISTGT_ERRLOG("lu_disk_queue unknown rc=%d\n", rc);
-				return (-1);
-		}
+		rc = istgt_iscsi_queue_scsi(conn, &lu_cmd, &que);
+		if (rc <= 0)
+			return (rc);
 	}
 
+	return (istgt_iscsi_scsi_status(conn, &lu_cmd, que));
+}
+
+static int
+istgt_iscsi_task_response(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	ISTGT_LU_CMD_Ptr lu_cmd;
+	ISCSI_PDU rsp_pdu = { 0 };
+	uint8_t *rsp;
+	uint32_t task_tag;
+	uint32_t transfer_len;
+	uint32_t CmdSN;
+	size_t residual_len;
+	size_t data_len;
+	int I_bit;
+	int o_bit, u_bit, O_bit, U_bit;
+	int bidi_residual_len;
+	int rc;
+	uint64_t *tptr;
+	const  char *msg = NULL;
+	lu_cmd = &lu_task->lu_cmd;
+	ISTGT_SCSI_STATUS lstat = lu_cmd->status;
+	transfer_len = lu_cmd->transfer_len;
+	task_tag = lu_cmd->task_tag;
+	I_bit = lu_cmd->I_bit;
+	CmdSN = lu_cmd->CmdSN;
+
+	uint8_t sidx = istgt_cmd_table[lu_cmd->cdb0].statidx;
+
+	++SCSIstat_rest[sidx].req_finish;
+
+
+	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "SCSI response CSN=%x/%x tt:%x tl:%x\n", CmdSN, lu_cmd->status, task_tag, transfer_len);
+
 	/* transfer data from logical unit */
 	/* (direction is view of initiator side) */
-	if (lu_cmd.R_bit
-		&& (lu_cmd.status == ISTGT_SCSI_STATUS_GOOD
-			|| lu_cmd.sense_data_len != 0)) {
-		rc = istgt_iscsi_transfer_in(conn, &lu_cmd);
-		if (rc < 0) {
-			ISTGT_ERRLOG("iscsi_transfer_in() failed\n");
-			return (-1);
-		}
-		if (rc > 0) {
-			/* sent status by last DATAIN PDU */
-			return (0);
-		}
-	}
-
-	o_bit = u_bit = O_bit = U_bit = 0;
-	bidi_residual_len = residual_len = 0;
-	data_len = lu_cmd.data_len;
-	if (transfer_len != 0
-		&& lu_cmd.status == ISTGT_SCSI_STATUS_GOOD) {
-		if (data_len < transfer_len) {
-			/* underflow */
-			msg = "Underflow";
-			residual_len = transfer_len - data_len;
-			U_bit = 1;
-		} else if (data_len > transfer_len) {
-			/* overflow */
-			msg = "Overflow";
-			residual_len = data_len - transfer_len;
-			O_bit = 1;
-		} else {
-			msg = "Transfer";
-		}
-	}
-
-	/* response PDU */
-	rsp = (uint8_t *) &rsp_pdu.bhs;
-	// memset(rsp, 0, ISCSI_BHS_LEN);
-	uint64_t *tptr = (uint64_t *)rsp;
-	*tptr = 0; *(tptr+1) = 0; *(tptr+2) = 0;
-	*(tptr+3) = 0; *(tptr+4) = 0; *(tptr+5) = 0;
-
-	rsp[0] = ISCSI_OP_SCSI_RSP;
-	BDADD8(&rsp[1], 1, 7);
-	BDADD8(&rsp[1], o_bit, 4);
-	BDADD8(&rsp[1], u_bit, 3);
-	BDADD8(&rsp[1], O_bit, 2);
-	BDADD8(&rsp[1], U_bit, 1);
-	rsp[2] = 0x00; // Command Completed at Target
-	// rsp[2] = 0x01; // Target Failure
-	rsp[3] = lu_cmd.status;
-	rsp[4] = 0; // TotalAHSLength
-	rsp_pdu.data = lu_cmd.sense_data;
-	DSET24(&rsp[5], lu_cmd.sense_data_len); // DataSegmentLength
-	rsp_pdu.data_segment_len = lu_cmd.sense_data_len;
-	lu_cmd.sense_data = NULL; lu_cmd.sense_data_len = 0;
-	DSET32(&rsp[16], task_tag);
-	DSET32(&rsp[20], 0); // SNACK Tag
-
-	SESS_MTX_LOCK(conn);
-	DSET32(&rsp[24], conn->StatSN);
-	conn->StatSN++;
-	if (I_bit == 0) {
-		if (likely((lu_cmd.lu->limit_q_size == 0) || ((int)(conn->sess->MaxCmdSN - conn->sess->ExpCmdSN) < lu_cmd.lu->limit_q_size))) {
-			conn->sess->MaxCmdSN++;
-			conn->sess->MaxCmdSN_local++;
-			if (unlikely((conn->sess->MaxCmdSN != conn->sess->MaxCmdSN_local) && (lu_cmd.lu->limit_q_size == 0))) {
-				ISTGT_LOG("conn->sess->MaxCmdSN != conn->sess->MaxCmdSN_local in op_scsi\n");
-				conn->sess->MaxCmdSN = conn->sess->MaxCmdSN_local;
-			}
-		} else
-			conn->sess->MaxCmdSN_local++;
-	}
-	DSET32(&rsp[28], conn->sess->ExpCmdSN);
-	DSET32(&rsp[32], conn->sess->MaxCmdSN);
-	SESS_MTX_UNLOCK(conn);
-
-	DSET32(&rsp[36], 0); // ExpDataSN
-	DSET32(&rsp[40], bidi_residual_len);
-	DSET32(&rsp[44], residual_len);
-
-	rc = istgt_iscsi_write_pdu(conn, &rsp_pdu);
-	if (rc < 0) {
-		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
-		if (lu_cmd.sense_data != NULL)
-			xfree(lu_cmd.sense_data);
-		if (lu_cmd.data != NULL)
-			xfree(lu_cmd.data);
-		return (-1);
-	}
-
-	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
-		"op_scsi_done: status:%d %s, CmdSN=%u, ExpStatSN=%u, StatSN=%u, ExpCmdSN=%u, MaxCmdSN=%u"
-		"I=%d, F=%d, R=%d, W=%d, Attr=%d, ITT=%x, TL=%u (%s %lu)\n",
-		lu_cmd.status, que, CmdSN, ExpStatSN, c_StatSN, s_ExpCmdSN, s_MaxCmdSN,
-		I_bit, F_bit, R_bit, W_bit, Attr_bit,
-		task_tag, transfer_len, msg, data_len);
-	if (lu_cmd.sense_data != NULL)
-		xfree(lu_cmd.sense_data);
-	if (lu_cmd.data != NULL)
-		xfree(lu_cmd.data);
-	return (0);
-}
-
-static int
-istgt_iscsi_task_response(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
-{
-	ISTGT_LU_CMD_Ptr lu_cmd;
-	ISCSI_PDU rsp_pdu = { 0 };
-	uint8_t *rsp;
-	uint32_t task_tag;
-	uint32_t transfer_len;
-	uint32_t CmdSN;
-	size_t residual_len;
-	size_t data_len;
-	int I_bit;
-	int o_bit, u_bit, O_bit, U_bit;
-	int bidi_residual_len;
-	int rc;
-	uint64_t *tptr;
-	const  char *msg = NULL;
-	lu_cmd = &lu_task->lu_cmd;
-	ISTGT_SCSI_STATUS lstat = lu_cmd->status;
-	transfer_len = lu_cmd->transfer_len;
-	task_tag = lu_cmd->task_tag;
-	I_bit = lu_cmd->I_bit;
-	CmdSN = lu_cmd->CmdSN;
-
-	uint8_t sidx = istgt_cmd_table[lu_cmd->cdb0].statidx;
-
-	++SCSIstat_rest[sidx].req_finish;
-
-
-	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "SCSI response CSN=%x/%x tt:%x tl:%x\n", CmdSN, lu_cmd->status, task_tag, transfer_len);
-
-	/* transfer data from logical unit */
-	/* (direction is view of initiator side) */
-	if (lu_cmd->R_bit
-		&& (lu_cmd->status == ISTGT_SCSI_STATUS_GOOD
-		|| lu_cmd->sense_data_len != 0)) {
-		if (lu_task->lock) {
-			rc = istgt_iscsi_transfer_in_internal(conn, lu_cmd);
-		} else {
-			rc = istgt_iscsi_transfer_in(conn, lu_cmd);
-		}
+	if (lu_cmd->R_bit
+		&& (lu_cmd->status == ISTGT_SCSI_STATUS_GOOD
+		|| lu_cmd->sense_data_len != 0)) {
+		if (lu_task->lock) {
+			rc = istgt_iscsi_transfer_in_internal(conn, lu_cmd);
+		} else {
+			rc = istgt_iscsi_transfer_in(conn, lu_cmd);
+		}
 		if (rc < 0) {
 			ISTGT_ERRLOG("iscsi_transfer_in() failed\n");
 			return (-1);
@@ -3925,6 +4825,86 @@ istgt_iscsi_task_response(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
 	return (0);
 }
 
+/* how long TASK REASSIGN waits for a failing connection to hand its tasks over */
+#define	ISTGT_REASSIGN_WAIT	5
+
+/*
+ * TASK REASSIGN: a task of a failed connection of the session moves to
+ * this one.  Only tasks that had ended move, what they sent from
+ * ExpDataSN on comes back in list and their status takes a StatSN of
+ * this connection.  One still running when its connection failed, or
+ * not kept whole, is refused with 255 (function rejected): it was
+ * cleared with the connection, and may have been executed in part.
+ */
+static int
+istgt_iscsi_reassign(CONN_Ptr conn, uint32_t ref_task_tag, uint32_t ExpDataSN, ISTGT_RETAINED_PDU **list)
+{
+	SESS_Ptr sess = conn->sess;
+	ISTGT_RETAINED_TASK *rt, *prev;
+	CONN_Ptr xconn;
+	struct timespec abstime;
+	int failing;
+	int i, rc;
+
+	*list = NULL;
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec += ISTGT_REASSIGN_WAIT;
+
+	rc = 0;
+	MTX_LOCK(&sess->mutex);
+	for (;;) {
+		prev = NULL;
+		for (rt = sess->orphans; rt != NULL; rt = rt->next) {
+			if (rt->task_tag == ref_task_tag)
+				break;
+			prev = rt;
+		}
+		failing = 0;
+		for (i = 0; i < sess->connections; i++) {
+			xconn = sess->conns[i];
+			if (xconn == conn || xconn->state == CONN_STATE_RUNNING)
+				continue;
+			MTX_LOCK(&xconn->retain_mutex);
+			if (xconn->retained_tasks != 0)
+				failing = 1;
+			MTX_UNLOCK(&xconn->retain_mutex);
+		}
+		if (rt != NULL || failing == 0 || rc == ETIMEDOUT)
+			break;
+		rc = pthread_cond_timedwait(&sess->mcs_cond, &sess->mutex,
+		    &abstime);
+		if (rc != 0 && rc != ETIMEDOUT)
+			break;
+	}
+	if (rt == NULL) {
+		MTX_UNLOCK(&sess->mutex);
+		/* 3 is still allegiant to the failing connection */
+		return (failing ? 3 : 1);
+	}
+	if (prev != NULL)
+		prev->next = rt->next;
+	else
+		sess->orphans = rt->next;
+	rt->next = NULL;
+	MTX_UNLOCK(&sess->mutex);
+
+	if (rt->has_status == 0 || !istgt_iscsi_retained_whole(rt)) {
+		ISTGT_WARNLOG("c#%d ITT=%x %s, not reassigned\n",
+		    conn->id, ref_task_tag, rt->has_status
+		    ? "was not kept whole" : "was still running");
+		istgt_iscsi_retained_free(rt);
+		return (255);
+	}
+	MTX_LOCK(&conn->retain_mutex);
+	*list = istgt_iscsi_retained_pick(rt, 1, ExpDataSN, 0, 1);
+	/* in StatSN order again once resent with one of this connection */
+	rt->has_status = 0;
+	rt->orphaned = 0;
+	istgt_iscsi_retain_add(conn, rt);
+	MTX_UNLOCK(&conn->retain_mutex);
+	return (0);
+}
+
 static int
 istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 {
@@ -3942,6 +4922,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	int response;
 	int rc;
 	int cleared = 0;
+	int waiting = 0;
 	uint32_t cStatSN, nStatSN = 0, sExpCmdSN, nExpCmdSN = 0, sMaxCmdSN;
 	const char *msg = "";
 	const char *fname = "";
@@ -3949,6 +4930,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		ISTGT_LU_DISK *spec;
 	int cmdqcount = 0;
 	int blockedqcount = 0;
+	ISTGT_RETAINED_PDU *resend = NULL;
 
 	if (!conn->full_feature) {
 		ISTGT_ERRLOG("before Full Feature\n");
@@ -3977,9 +4959,15 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	sExpCmdSN = conn->sess->ExpCmdSN;
 	sMaxCmdSN = conn->sess->MaxCmdSN;
 	if (CmdSN != conn->sess->ExpCmdSN) {
-		msg = "dropped?";
-		conn->sess->ExpCmdSN = CmdSN;
-		nExpCmdSN  = CmdSN;
+		if (conn->sess->connections > 1
+		    || conn->sess->cmdsn_wait != NULL) {
+			/* MC/S, the commands before it may be on the others */
+			msg = "MC/S";
+		} else {
+			msg = "dropped?";
+			conn->sess->ExpCmdSN = CmdSN;
+			nExpCmdSN  = CmdSN;
+		}
 	}
 	if (SN32_GT(ExpStatSN, conn->StatSN)) {
 		msg = "StatSN-advanced!";
@@ -4014,6 +5002,8 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_LOCK(conn);
 		cleared = istgt_lu_clear_task_ITLQ(conn, conn->sess->lu, lun,
 			ref_CmdSN);
+		waiting = istgt_iscsi_cmdsn_wait_abort(conn->sess, CmdSN,
+			ref_task_tag);
 		if (cleared <= 0) {
 			ISTGT_ERRLOG("%s failed rc:%d\n", fname, cleared);
 		} else {
@@ -4025,9 +5015,12 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_UNLOCK(conn);
 		if (conn->sess->lu != NULL)
 			MTX_UNLOCK(&conn->sess->lu->mutex);
-		if (cleared == 0 && send_abrt_resp == 1)
+		waiting += istgt_iscsi_order_abort(conn->sess, ref_task_tag);
+		if (cleared == 0 && waiting == 0 && send_abrt_resp == 1)
 			response = 1;
 		istgt_clear_transfer_task(conn, ref_CmdSN);
+		if (istgt_iscsi_unpark_transfer_task(conn) < 0)
+			return (-1);
 		break;
 	case ISCSI_TASK_FUNC_ABORT_TASK_SET:
 		fname = "ABORT_TASK_SET";
@@ -4035,6 +5028,8 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			MTX_LOCK(&conn->sess->lu->mutex);
 		SESS_MTX_LOCK(conn);
 		cleared = istgt_lu_clear_task_ITL(conn, conn->sess->lu, lun);
+		(void) istgt_iscsi_cmdsn_wait_abort(conn->sess, CmdSN,
+			0xffffffffU);
 		if (cleared <= 0) {
 			ISTGT_ERRLOG("%s failed rc:%d\n", fname, cleared);
 		} else {
@@ -4046,6 +5041,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_UNLOCK(conn);
 		if (conn->sess->lu != NULL)
 			MTX_UNLOCK(&conn->sess->lu->mutex);
+		(void) istgt_iscsi_order_abort(conn->sess, 0xffffffffU);
 		if (cleared == 0 && send_abrt_resp == 1)
 			response = 1;
 		istgt_clear_all_transfer_task(conn);
@@ -4059,6 +5055,8 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			MTX_LOCK(&conn->sess->lu->mutex);
 		SESS_MTX_LOCK(conn);
 		cleared = istgt_lu_clear_task_ITL(conn, conn->sess->lu, lun);
+		(void) istgt_iscsi_cmdsn_wait_abort(conn->sess, CmdSN,
+			0xffffffffU);
 		if (cleared <= 0) {
 			ISTGT_ERRLOG("%s failed rc:%d\n", fname, cleared);
 		} else {
@@ -4070,6 +5068,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_UNLOCK(conn);
 		if (conn->sess->lu != NULL)
 			MTX_UNLOCK(&conn->sess->lu->mutex);
+		(void) istgt_iscsi_order_abort(conn->sess, 0xffffffffU);
 		if (cleared == 0 && send_abrt_resp == 1)
 			response = 1;
 		istgt_clear_all_transfer_task(conn);
@@ -4083,6 +5082,8 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			MTX_LOCK(&conn->sess->lu->mutex);
 		SESS_MTX_LOCK(conn);
 		cleared = istgt_lu_reset(conn->sess->lu, lun, ISTGT_UA_LUN_RESET);
+		(void) istgt_iscsi_cmdsn_wait_abort(conn->sess, CmdSN,
+			0xffffffffU);
 		if (cleared <= 0) {
 			ISTGT_ERRLOG("%s failed rc:%d\n", fname, cleared);
 		} else {
@@ -4094,6 +5095,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_UNLOCK(conn);
 		if (conn->sess->lu != NULL)
 			MTX_UNLOCK(&conn->sess->lu->mutex);
+		(void) istgt_iscsi_order_abort(conn->sess, 0xffffffffU);
 		// conn->state = CONN_STATE_EXITING;
 		break;
 	case ISCSI_TASK_FUNC_TARGET_WARM_RESET:
@@ -4105,6 +5107,8 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			MTX_LOCK(&conn->sess->lu->mutex);
 		SESS_MTX_LOCK(conn);
 		cleared = istgt_lu_reset(conn->sess->lu, lun, ISTGT_UA_TARG_RESET);
+		(void) istgt_iscsi_cmdsn_wait_abort(conn->sess, CmdSN,
+			0xffffffffU);
 		if (cleared <= 0) {
 			ISTGT_ERRLOG("%s failed rc:%d\n", fname, cleared);
 		} else {
@@ -4116,6 +5120,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_UNLOCK(conn);
 		if (conn->sess->lu != NULL)
 			MTX_UNLOCK(&conn->sess->lu->mutex);
+		(void) istgt_iscsi_order_abort(conn->sess, 0xffffffffU);
 		// conn->state = CONN_STATE_EXITING;
 		break;
 	case ISCSI_TASK_FUNC_TARGET_COLD_RESET:
@@ -4128,6 +5133,8 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			MTX_LOCK(&conn->sess->lu->mutex);
 		SESS_MTX_LOCK(conn);
 		cleared = istgt_lu_reset(conn->sess->lu, lun, ISTGT_UA_TARG_RESET);
+		(void) istgt_iscsi_cmdsn_wait_abort(conn->sess, CmdSN,
+			0xffffffffU);
 		if (cleared <= 0) {
 			ISTGT_ERRLOG("%s failed rc:%d\n", fname, cleared);
 		} else {
@@ -4139,10 +5146,17 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_UNLOCK(conn);
 		if (conn->sess->lu != NULL)
 			MTX_UNLOCK(&conn->sess->lu->mutex);
+		(void) istgt_iscsi_order_abort(conn->sess, 0xffffffffU);
 		// conn->state = CONN_STATE_EXITING;
 		break;
 	case ISCSI_TASK_FUNC_TASK_REASSIGN:
 		fname = "TASK_REASSIGN";
+		if (conn->error_recovery < 2) {
+			response = 4; // Task allegiance reassignment not supported.
+			break;
+		}
+		response = istgt_iscsi_reassign(conn, ref_task_tag,
+		    DGET32(&cp[36]), &resend);
 		break;
 	default:
 		fname = "unsupported function";
@@ -4171,6 +5185,12 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		ISTGT_ERRLOG("iscsi_write_pdu() failed in iscsi_op_task\n");
 		return (-1);
 	}
+	if (resend != NULL) {
+		/* the reassigned task carries on after the response */
+		rc = istgt_iscsi_resend(conn, resend, 1);
+		if (rc < 0)
+			return (-1);
+	}
 	ISTGT_LOG("scsitask:%d:%s %s done. CSN=0x%x, ExpStatSN=0x%x, StatSN=0x%x/0x%x, ExpCmdSN=0x%x/0x%x, MaxCmdSN=0x%x (%s) "
 		"I=%d, ITT=0x%x, ref TT=0x%x, LUN=0x%16.16lx\n",
 		function, fname, initport, CmdSN, ExpStatSN, cStatSN, nStatSN, sExpCmdSN, nExpCmdSN,
@@ -4309,23 +5329,207 @@ istgt_iscsi_op_nopout(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 }
 
 
+/*
+ * SAM task attributes across writes gathering DATA-OUT.  Such a write is
+ * not in the LU yet, so the LU can't keep an ORDERED command behind it,
+ * or the commands after an ORDERED write behind that.  Each one is in
+ * sess->order_q from the command PDU on until it is queued to the LU;
+ * commands after it that may not pass it wait there too, held, and go to
+ * the LU from their own connection once nothing before them is in the
+ * way.  order_mutex is taken last, under no other lock of the session.
+ */
+
+/* order_mutex is held; may a command go to the LU before the entries ahead of stop */
+static int
+istgt_iscsi_order_blocked(SESS_Ptr sess, ISTGT_R2T_TASK_Ptr stop,
+    uint64_t lun, int Attr_bit)
+{
+	ISTGT_R2T_TASK_Ptr t;
+
+	if (Attr_bit == ISTGT_TAG_HEAD_OF_QUEUE)
+		return (0);
+	for (t = sess->order_q; t != NULL && t != stop; t = t->order_next) {
+		if (t->lun != lun)
+			continue;
+		if (Attr_bit == ISTGT_TAG_ORDERED
+		    || t->lu_cmd.Attr_bit == ISTGT_TAG_ORDERED)
+			return (1);
+	}
+	return (0);
+}
+
+/* order_mutex is held, an entry left: wake the connections it held up */
+static void
+istgt_iscsi_order_next(SESS_Ptr sess)
+{
+	ISTGT_R2T_TASK_Ptr t;
+
+	for (t = sess->order_q; t != NULL; t = t->order_next) {
+		if (t->held && !istgt_iscsi_order_blocked(sess, t, t->lun,
+		    t->lu_cmd.Attr_bit))
+			(void) istgt_iscsi_task_notify(t->conn);
+	}
+}
+
+static void
+istgt_iscsi_order_add(SESS_Ptr sess, ISTGT_R2T_TASK_Ptr r2t_task)
+{
+	ISTGT_R2T_TASK_Ptr *tp;
+
+	for (tp = &sess->order_q; *tp != NULL; tp = &(*tp)->order_next)
+		;
+	r2t_task->order_next = NULL;
+	r2t_task->in_order_q = 1;
+	*tp = r2t_task;
+}
+
+static void
+istgt_iscsi_order_remove(ISTGT_R2T_TASK_Ptr r2t_task)
+{
+	SESS_Ptr sess = r2t_task->conn->sess;
+	ISTGT_R2T_TASK_Ptr *tp;
+
+	MTX_LOCK(&sess->order_mutex);
+	for (tp = &sess->order_q; *tp != NULL; tp = &(*tp)->order_next) {
+		if (*tp == r2t_task) {
+			*tp = r2t_task->order_next;
+			break;
+		}
+	}
+	r2t_task->in_order_q = 0;
+	istgt_iscsi_order_next(sess);
+	MTX_UNLOCK(&sess->order_mutex);
+}
+
+/*
+ * A command goes to the LU, or waits in order_q when something before it
+ * may not be passed.  Returns 1 if it was taken to wait.
+ */
+static int
+istgt_iscsi_order_wait(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	SESS_Ptr sess = conn->sess;
+	ISTGT_R2T_TASK_Ptr r2t_task;
+
+	MTX_LOCK(&sess->order_mutex);
+	if (sess->order_q == NULL || !istgt_iscsi_order_blocked(sess, NULL,
+	    lu_cmd->lun, lu_cmd->Attr_bit)) {
+		MTX_UNLOCK(&sess->order_mutex);
+		return (0);
+	}
+	r2t_task = istgt_iscsi_new_transfer_task(conn, lu_cmd);
+	r2t_task->held = 1;
+	istgt_iscsi_order_add(sess, r2t_task);
+	MTX_UNLOCK(&sess->order_mutex);
+	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+		"c#%d CmdSN=0x%x ITT=%x Attr%d held\n",
+		conn->id, lu_cmd->CmdSN, lu_cmd->task_tag, lu_cmd->Attr_bit);
+	return (1);
+}
+
+/* a write has all its data, returns 1 if it is held for the ones ahead */
+static int
+istgt_iscsi_order_hold(ISTGT_R2T_TASK_Ptr r2t_task)
+{
+	SESS_Ptr sess = r2t_task->conn->sess;
+
+	MTX_LOCK(&sess->order_mutex);
+	if (istgt_iscsi_order_blocked(sess, r2t_task, r2t_task->lun,
+	    r2t_task->lu_cmd.Attr_bit))
+		r2t_task->held = 1;
+	MTX_UNLOCK(&sess->order_mutex);
+	return (r2t_task->held);
+}
+
+/*
+ * Aborts the held commands of the session, only task_tag of them unless
+ * it is 0xffffffff.  Returns how many.
+ */
+static int
+istgt_iscsi_order_abort(SESS_Ptr sess, uint32_t task_tag)
+{
+	ISTGT_R2T_TASK_Ptr *tp, t, list = NULL;
+	int n = 0;
+
+	MTX_LOCK(&sess->order_mutex);
+	for (tp = &sess->order_q; (t = *tp) != NULL; ) {
+		if (t->held && (task_tag == 0xffffffffU
+		    || t->task_tag == task_tag)) {
+			*tp = t->order_next;
+			t->in_order_q = 0;
+			t->order_next = list;
+			list = t;
+			n++;
+			continue;
+		}
+		tp = &t->order_next;
+	}
+	if (n != 0)
+		istgt_iscsi_order_next(sess);
+	MTX_UNLOCK(&sess->order_mutex);
+	while ((t = list) != NULL) {
+		list = t->order_next;
+		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+			"CmdSN=0x%x ITT=%x aborted while held\n",
+			t->CmdSN, t->task_tag);
+		istgt_free_transfer_task(t);
+	}
+	return (n);
+}
+
+/* conn is gone, so are the commands it had held */
+static void
+istgt_iscsi_order_drop(CONN_Ptr conn)
+{
+	SESS_Ptr sess = conn->sess;
+	ISTGT_R2T_TASK_Ptr *tp, t, list = NULL;
+
+	MTX_LOCK(&sess->order_mutex);
+	for (tp = &sess->order_q; (t = *tp) != NULL; ) {
+		if (t->conn == conn && t->held) {
+			*tp = t->order_next;
+			t->in_order_q = 0;
+			t->order_next = list;
+			list = t;
+			continue;
+		}
+		tp = &t->order_next;
+	}
+	istgt_iscsi_order_next(sess);
+	MTX_UNLOCK(&sess->order_mutex);
+	while ((t = list) != NULL) {
+		list = t->order_next;
+		istgt_free_transfer_task(t);
+	}
+}
+
 static void
 istgt_free_transfer_task(ISTGT_R2T_TASK_Ptr r2t_task)
 {
 	int ind = 0;
 	if (r2t_task == NULL)
 		return;
+	if (r2t_task->in_order_q)
+		istgt_iscsi_order_remove(r2t_task);
 	if (r2t_task->iobufindx != -1) {
 		while ((ind = r2t_task->iobufindx--) > -1) {
 			xfree(r2t_task->iobuf[ind].iov_base);
 		}
 	}
-	r2t_task->iobufsize = 0;
+	ISTGT_SGL_RELEASE(r2t_task);
+	if (r2t_task->pdu.ahs != NULL)
+		xfree(r2t_task->pdu.ahs);
+	if (r2t_task->pdu.data != NULL)
+		xfree(r2t_task->pdu.data);
+	if (r2t_task->lu_cmd.data != NULL)
+		xfree(r2t_task->lu_cmd.data);
+	if (r2t_task->lu_cmd.sense_data != NULL)
+		xfree(r2t_task->lu_cmd.sense_data);
 	xfree(r2t_task);
 }
 
 static ISTGT_R2T_TASK_Ptr
-istgt_get_transfer_task(CONN_Ptr conn, uint32_t transfer_tag)
+istgt_get_transfer_task(CONN_Ptr conn, uint32_t task_tag)
 {
 	ISTGT_R2T_TASK_Ptr r2t_task;
 	int i;
@@ -4339,14 +5543,14 @@ istgt_get_transfer_task(CONN_Ptr conn, uint32_t transfer_tag)
 		r2t_task = conn->r2t_tasks[i];
 #if 0
 		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-			"CmdSN=%d, TransferTag=%x/%x\n",
-			r2t_task->CmdSN, r2t_task->transfer_tag, transfer_tag);
+			"CmdSN=%d, TaskTag=%x/%x\n",
+			r2t_task->CmdSN, r2t_task->task_tag, task_tag);
 #endif
-		if (r2t_task->transfer_tag == transfer_tag) {
+		if (r2t_task->task_tag == task_tag) {
 			MTX_UNLOCK(&conn->r2t_mutex);
 			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-				"Match index=%d, CmdSN=%d, TransferTag=%x\n",
-				i, r2t_task->CmdSN, r2t_task->transfer_tag);
+				"Match index=%d, CmdSN=%d, TaskTag=%x\n",
+				i, r2t_task->CmdSN, r2t_task->task_tag);
 			return (r2t_task);
 		}
 	}
@@ -4354,93 +5558,232 @@ istgt_get_transfer_task(CONN_Ptr conn, uint32_t transfer_tag)
 	return (NULL);
 }
 
+/* ask for more data, up to MaxOutstandingR2T bursts at a time */
 static int
-istgt_add_transfer_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+istgt_iscsi_kick_r2t(CONN_Ptr conn, ISTGT_R2T_TASK_Ptr r2t_task)
 {
-	ISTGT_R2T_TASK_Ptr r2t_task;
-	uint32_t transfer_len;
-	uint32_t transfer_tag;
-	size_t first_burst_len;
-	size_t max_burst_len;
-	size_t data_len;
-	size_t offset = 0;
-	int len;
-	int idx;
+	ISTGT_R2T_BURST *burst;
+	uint32_t len;
+	int max_burst;
 	int rc;
 
-	MTX_LOCK(&conn->r2t_mutex);
-	if (conn->pending_r2t >= conn->max_r2t) {
-		// no slot available, skip now...
-		// ISTGT_WARNLOG("No R2T space available (%d/%d)\n",
-		//	conn->pending_r2t, conn->max_r2t);
-		MTX_UNLOCK(&conn->r2t_mutex);
+	if (r2t_task->parked)
 		return (0);
-	}
-	MTX_UNLOCK(&conn->r2t_mutex);
-
-	transfer_len = lu_cmd->transfer_len;
-	transfer_tag = lu_cmd->task_tag;
-	data_len = lu_cmd->pdu->data_segment_len;
-	first_burst_len = conn->FirstBurstLength;
-	max_burst_len = conn->MaxBurstLength;
-	offset += data_len;
-	if (offset >= first_burst_len) {
-		len = DMIN32(max_burst_len, (transfer_len - offset));
-
-		r2t_task = xmalloc(sizeof (*r2t_task));
-		r2t_task->conn = conn;
-		r2t_task->lu = lu_cmd->lu;
-		r2t_task->lun = lu_cmd->lun;
-		r2t_task->CmdSN = lu_cmd->CmdSN;
-		r2t_task->task_tag = lu_cmd->task_tag;
-		r2t_task->transfer_len = transfer_len;
-		r2t_task->transfer_tag = transfer_tag;
-
-		// r2t_task->iobuf = xmalloc(r2t_task->iobufsize);
-		// memcpy(r2t_task->iobuf, lu_cmd->pdu->data, data_len);
-		r2t_task->iobufindx = 0;
-		r2t_task->iobufsize = data_len;
-		r2t_task->iobuf[0].iov_base = lu_cmd->pdu->data;
-		r2t_task->iobuf[0].iov_len = data_len;
-		lu_cmd->pdu->data = NULL;
-		lu_cmd->pdu->data_segment_len = 0;
-
-		r2t_task->offset = offset;
-		r2t_task->R2TSN = 0;
-		r2t_task->DataSN = 0;
-		r2t_task->F_bit = lu_cmd->F_bit;
-
-		MTX_LOCK(&conn->r2t_mutex);
-		idx = conn->pending_r2t++;
-		conn->r2t_tasks[idx] = r2t_task;
-		MTX_UNLOCK(&conn->r2t_mutex);
+	max_burst = conn->MaxOutstandingR2T;
+	if (max_burst > ISTGT_R2T_BURSTS)
+		max_burst = ISTGT_R2T_BURSTS;
+	if (max_burst < 1)
+		max_burst = 1;
+	while (r2t_task->nburst < max_burst
+		&& r2t_task->r2t_offset < r2t_task->transfer_len) {
+		len = DMIN32((uint32_t) conn->MaxBurstLength,
+			(r2t_task->transfer_len - r2t_task->r2t_offset));
+		burst = &r2t_task->burst[(r2t_task->hburst + r2t_task->nburst)
+			% ISTGT_R2T_BURSTS];
+		/* 0xffffffff is the tag of unsolicited data */
+		if (++conn->r2t_ttt == 0xffffffffU)
+			conn->r2t_ttt = 0;
+		burst->transfer_tag = conn->r2t_ttt;
+		burst->end = r2t_task->r2t_offset + len;
 
 		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-			"Send R2T(Offset=%d, Tag=%x)\n",
-			r2t_task->offset, r2t_task->transfer_tag);
-		rc = istgt_iscsi_send_r2t(conn, lu_cmd,
-			r2t_task->offset, len, r2t_task->transfer_tag,
+			"Send R2T(Offset=%u, Len=%u, Tag=%x) ITT=%x\n",
+			r2t_task->r2t_offset, len, burst->transfer_tag,
+			r2t_task->task_tag);
+		rc = istgt_iscsi_send_r2t(conn, &r2t_task->lu_cmd,
+			r2t_task->r2t_offset, len, burst->transfer_tag,
 			&r2t_task->R2TSN);
-		timediff(lu_cmd, 'R', __LINE__);
+		timediff(&r2t_task->lu_cmd, 'R', __LINE__);
 		if (rc < 0) {
-			ISTGT_ERRLOG("iscsi_send_r2t() failed\n");
+			ISTGT_ERRLOG("c#%d iscsi_send_r2t() failed\n", conn->id);
 			return (-1);
 		}
+		r2t_task->r2t_offset += len;
+		r2t_task->nburst++;
 	}
 	return (0);
 }
 
-static void
-istgt_del_transfer_task(CONN_Ptr conn, ISTGT_R2T_TASK_Ptr r2t_task)
+/* MaxR2T 0 has the LU ask for the data, a reactor gathers one at a time */
+#define	ISTGT_R2T_SLOTS(conn) ((conn)->max_r2t > 0 ? (conn)->max_r2t : 1)
+
+/* writes asking for their data by R2T, the rest is parked; r2t_mutex held */
+static int
+istgt_iscsi_active_r2t(CONN_Ptr conn, ISTGT_R2T_TASK_Ptr *first_parked)
 {
-	int found = 0;
-	int i, removed = -1;
+	int active = 0;
+	int i;
 
-	if (r2t_task == NULL)
-		return;
+	*first_parked = NULL;
+	for (i = 0; i < conn->pending_r2t; i++) {
+		if (!conn->r2t_tasks[i]->parked)
+			active++;
+		else if (*first_parked == NULL)
+			*first_parked = conn->r2t_tasks[i];
+	}
+	return (active);
+}
 
-	MTX_LOCK(&conn->r2t_mutex);
-	if (conn->pending_r2t == 0) {
+/*
+ * A slot freed up, the oldest parked writes get their R2Ts.  Parked ones
+ * are behind all active ones in r2t_tasks, so they go in arrival order.
+ */
+static int
+istgt_iscsi_unpark_transfer_task(CONN_Ptr conn)
+{
+	ISTGT_R2T_TASK_Ptr r2t_task;
+	int active;
+
+	while (1) {
+		MTX_LOCK(&conn->r2t_mutex);
+		active = istgt_iscsi_active_r2t(conn, &r2t_task);
+		if (r2t_task == NULL || active >= ISTGT_R2T_SLOTS(conn)) {
+			MTX_UNLOCK(&conn->r2t_mutex);
+			return (0);
+		}
+		r2t_task->parked = 0;
+		r2t_task->start = time(NULL);
+		MTX_UNLOCK(&conn->r2t_mutex);
+		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+			"c#%d unparked CmdSN=0x%x ITT=%x\n",
+			conn->id, r2t_task->CmdSN, r2t_task->task_tag);
+		if (istgt_iscsi_kick_r2t(conn, r2t_task) < 0)
+			return (-1);
+	}
+}
+
+/* the command outlives the PDU it came in, the data goes with it */
+static ISTGT_R2T_TASK_Ptr
+istgt_iscsi_new_transfer_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	ISTGT_R2T_TASK_Ptr r2t_task;
+
+	r2t_task = xmalloc(sizeof (*r2t_task));
+	r2t_task->conn = conn;
+	r2t_task->lu = lu_cmd->lu;
+	r2t_task->lun = lu_cmd->lun;
+	r2t_task->CmdSN = lu_cmd->CmdSN;
+	r2t_task->task_tag = lu_cmd->task_tag;
+	r2t_task->transfer_len = lu_cmd->transfer_len;
+	r2t_task->transfer_tag = 0xffffffffU;
+
+	ISTGT_SGL_INIT(r2t_task);
+	r2t_task->offset = 0;
+	r2t_task->R2TSN = 0;
+	r2t_task->DataSN = 0;
+	r2t_task->F_bit = lu_cmd->F_bit;
+	r2t_task->unsol_end = 0;
+	r2t_task->r2t_offset = 0;
+	r2t_task->hburst = 0;
+	r2t_task->nburst = 0;
+	r2t_task->recover = 0;
+	r2t_task->recover_offset = 0;
+	r2t_task->parked = 0;
+	r2t_task->in_order_q = 0;
+	r2t_task->held = 0;
+	r2t_task->order_next = NULL;
+	r2t_task->start = time(NULL);
+
+	istgt_iscsi_copy_pdu(&r2t_task->pdu, lu_cmd->pdu);
+	r2t_task->lu_cmd = *lu_cmd;
+	r2t_task->lu_cmd.pdu = &r2t_task->pdu;
+	r2t_task->lu_cmd.cdb = (uint8_t *) &r2t_task->pdu.bhs + 32;
+	ISTGT_SGL_INIT(&r2t_task->lu_cmd);
+	return (r2t_task);
+}
+
+/*
+ * Take over a write whose data is not all in the command PDU.  Returns 1
+ * when the data is gathered here, 0 with no slot left; the LU asks for
+ * the data itself then.  A reactor thread can't wait for the data in the
+ * LU, with no slot left the write is parked here instead: unsolicited
+ * DATA-OUT is still taken, the R2Ts wait for a slot.
+ */
+static int
+istgt_add_transfer_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	ISTGT_R2T_TASK_Ptr r2t_task;
+	ISTGT_R2T_TASK_Ptr *r2t_tasks;
+	ISTGT_R2T_TASK_Ptr first_parked;
+	ISCSI_PDU_Ptr pdu = lu_cmd->pdu;
+	size_t first_burst_len;
+	size_t data_len;
+	int idx;
+
+	MTX_LOCK(&conn->r2t_mutex);
+	if (conn->pending_r2t >= conn->max_r2t && conn->reactor == NULL) {
+		// no slot available, skip now...
+		// ISTGT_WARNLOG("No R2T space available (%d/%d)\n",
+		//	conn->pending_r2t, conn->max_r2t);
+		MTX_UNLOCK(&conn->r2t_mutex);
+		return (0);
+	}
+	MTX_UNLOCK(&conn->r2t_mutex);
+
+	data_len = pdu->data_segment_len;
+	first_burst_len = conn->FirstBurstLength;
+	if (data_len > first_burst_len) {
+		ISTGT_ERRLOG("c#%d data_len(%zd) > first_burst_len(%zd)\n",
+			conn->id, data_len, first_burst_len);
+		return (-1);
+	}
+
+	r2t_task = istgt_iscsi_new_transfer_task(conn, lu_cmd);
+	if (data_len != 0) {
+		(void) ISTGT_SGL_APPEND(r2t_task, r2t_task->pdu.data, data_len);
+		r2t_task->pdu.data = NULL;
+		r2t_task->pdu.data_segment_len = 0;
+	}
+	r2t_task->offset = data_len;
+	/* unsolicited DATA-OUT follows a command PDU without F bit */
+	if (lu_cmd->F_bit)
+		r2t_task->unsol_end = data_len;
+	else
+		r2t_task->unsol_end = DMIN32(first_burst_len,
+			lu_cmd->transfer_len);
+	r2t_task->r2t_offset = r2t_task->unsol_end;
+
+	/* later commands may have to wait for it, see istgt_iscsi_order_wait() */
+	MTX_LOCK(&conn->sess->order_mutex);
+	istgt_iscsi_order_add(conn->sess, r2t_task);
+	MTX_UNLOCK(&conn->sess->order_mutex);
+
+	MTX_LOCK(&conn->r2t_mutex);
+	if (conn->pending_r2t >= conn->r2t_slots) {
+		r2t_tasks = xmalloc(sizeof (*r2t_tasks)
+			* (conn->r2t_slots * 2 + 2));
+		memset(r2t_tasks, 0, sizeof (*r2t_tasks)
+			* (conn->r2t_slots * 2 + 2));
+		memcpy(r2t_tasks, conn->r2t_tasks, sizeof (*r2t_tasks)
+			* conn->pending_r2t);
+		xfree(conn->r2t_tasks);
+		conn->r2t_tasks = r2t_tasks;
+		conn->r2t_slots = conn->r2t_slots * 2 + 1;
+	}
+	if (istgt_iscsi_active_r2t(conn, &first_parked)
+		>= ISTGT_R2T_SLOTS(conn))
+		r2t_task->parked = 1;
+	idx = conn->pending_r2t++;
+	conn->r2t_tasks[idx] = r2t_task;
+	MTX_UNLOCK(&conn->r2t_mutex);
+
+	/* dropped with the connection on failure */
+	if (istgt_iscsi_kick_r2t(conn, r2t_task) < 0)
+		return (-1);
+	return (1);
+}
+
+static void
+istgt_del_transfer_task(CONN_Ptr conn, ISTGT_R2T_TASK_Ptr r2t_task)
+{
+	int found = 0;
+	int i, removed = -1;
+
+	if (r2t_task == NULL)
+		return;
+
+	MTX_LOCK(&conn->r2t_mutex);
+	if (conn->pending_r2t == 0) {
 		MTX_UNLOCK(&conn->r2t_mutex);
 		return;
 	}
@@ -4516,12 +5859,128 @@ istgt_clear_all_transfer_task(CONN_Ptr conn)
 	MTX_UNLOCK(&conn->r2t_mutex);
 }
 
+/* a command of order_q goes to the LU, and leaves order_q after that */
+static int
+istgt_iscsi_order_exec(CONN_Ptr conn, ISTGT_R2T_TASK_Ptr r2t_task)
+{
+	ISTGT_LU_CMD_Ptr lu_cmd = &r2t_task->lu_cmd;
+	const char *que = "";
+	int rc;
+
+	ISTGT_SGL_MOVE(lu_cmd, r2t_task);
+	rc = istgt_iscsi_queue_scsi(conn, lu_cmd, &que);
+	if (rc > 0)
+		rc = istgt_iscsi_scsi_status(conn, lu_cmd, que);
+	/* the segments if no LU task took them */
+	ISTGT_SGL_MOVE(r2t_task, lu_cmd);
+	istgt_free_transfer_task(r2t_task);
+	return (rc);
+}
+
+/* runs the held commands of conn that nothing holds up anymore */
+static int
+istgt_iscsi_execute_held(CONN_Ptr conn)
+{
+	SESS_Ptr sess = conn->sess;
+	ISTGT_R2T_TASK_Ptr t;
+
+	if (sess == NULL)
+		return (0);
+	for (;;) {
+		if (conn->state != CONN_STATE_RUNNING)
+			return (0);
+		MTX_LOCK(&sess->order_mutex);
+		for (t = sess->order_q; t != NULL; t = t->order_next) {
+			if (t->held && t->conn == conn
+			    && !istgt_iscsi_order_blocked(sess, t, t->lun,
+			    t->lu_cmd.Attr_bit))
+				break;
+		}
+		if (t != NULL)
+			t->held = 0;
+		MTX_UNLOCK(&sess->order_mutex);
+		if (t == NULL)
+			return (0);
+		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+			"c#%d CmdSN=0x%x ITT=%x released\n",
+			conn->id, t->CmdSN, t->task_tag);
+		if (istgt_iscsi_order_exec(conn, t) < 0)
+			return (-1);
+	}
+}
+
+/* all DATA-OUT is in, the write goes to the LU unless it is held */
+static int
+istgt_iscsi_exec_transfer_task(CONN_Ptr conn, ISTGT_R2T_TASK_Ptr r2t_task)
+{
+	istgt_del_transfer_task(conn, r2t_task);
+	if (!istgt_iscsi_order_hold(r2t_task)) {
+		if (istgt_iscsi_order_exec(conn, r2t_task) < 0)
+			return (-1);
+		if (istgt_iscsi_execute_held(conn) < 0)
+			return (-1);
+	}
+	return (istgt_iscsi_unpark_transfer_task(conn));
+}
+
+/*
+ * DATA-OUT of r2t_task is thrown away from recover_offset on until every
+ * sequence outstanding has ended, the rest is then asked for by R2T.
+ */
+static int
+istgt_iscsi_data_discard(CONN_Ptr conn, ISTGT_R2T_TASK_Ptr r2t_task, int F_bit)
+{
+	if (F_bit == 0 || --r2t_task->recover > 0)
+		return (0);
+	ISTGT_WARNLOG("c#%d recovery R2T for ITT=%x from %u\n",
+		conn->id, r2t_task->task_tag, r2t_task->recover_offset);
+	if (r2t_task->unsol_end > r2t_task->recover_offset)
+		r2t_task->unsol_end = r2t_task->recover_offset;
+	r2t_task->r2t_offset = r2t_task->recover_offset;
+	r2t_task->hburst = 0;
+	r2t_task->nburst = 0;
+	r2t_task->DataSN = 0;
+	return (istgt_iscsi_kick_r2t(conn, r2t_task));
+}
+
+/* a DATA-OUT failed its data digest */
+static int
+istgt_iscsi_data_recover(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	ISTGT_R2T_TASK_Ptr r2t_task;
+	uint8_t *cp;
+	uint32_t buffer_offset;
+
+	cp = (uint8_t *) &pdu->bhs;
+	r2t_task = istgt_get_transfer_task(conn, DGET32(&cp[16]));
+	if (r2t_task == NULL) {
+		/* rejected already, as op_data does */
+		return (0);
+	}
+	if (r2t_task->recover == 0) {
+		buffer_offset = DGET32(&cp[40]);
+		if (buffer_offset != (uint32_t) r2t_task->offset) {
+			ISTGT_ERRLOG("offset(%u) error\n", buffer_offset);
+			return (-1);
+		}
+		r2t_task->recover = r2t_task->nburst;
+		if ((uint32_t) r2t_task->offset < r2t_task->unsol_end)
+			r2t_task->recover++;
+		if (r2t_task->recover == 0) {
+			ISTGT_ERRLOG("c#%d no R2T outstanding for task_tag=%x\n",
+				conn->id, r2t_task->task_tag);
+			return (-1);
+		}
+		r2t_task->recover_offset = r2t_task->offset;
+	}
+	return (istgt_iscsi_data_discard(conn, r2t_task, BGET8(&cp[1], 7)));
+}
+
 static int
 istgt_iscsi_op_data(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 {
 	ISTGT_R2T_TASK_Ptr r2t_task;
 	uint8_t *cp;
-	uint32_t current_task_tag;
 	uint32_t current_transfer_tag;
 	uint32_t ExpStatSN;
 	uint32_t task_tag;
@@ -4529,28 +5988,14 @@ istgt_iscsi_op_data(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	uint32_t ExpDataSN;
 	uint32_t DataSN;
 	uint32_t buffer_offset;
+	uint32_t end;
 	size_t data_len;
-	size_t offset;
 	int F_bit;
 	int rc;
-	int iondx;
 	if (!conn->full_feature) {
 		ISTGT_ERRLOG("before Full Feature\n");
 		return (-1);
 	}
-	MTX_LOCK(&conn->r2t_mutex);
-	if (conn->pending_r2t == 0) {
-		ISTGT_ERRLOG("No R2T task\n");
-		MTX_UNLOCK(&conn->r2t_mutex);
-	reject_return:
-		rc = istgt_iscsi_reject(conn, pdu, 0x09);
-		if (rc < 0) {
-			ISTGT_ERRLOG("iscsi_reject() failed\n");
-			return (-1);
-		}
-		return (0);
-	}
-	MTX_UNLOCK(&conn->r2t_mutex);
 
 	cp = (uint8_t *) &pdu->bhs;
 	F_bit = BGET8(&cp[1], 7);
@@ -4562,58 +6007,116 @@ istgt_iscsi_op_data(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	DataSN = DGET32(&cp[36]);
 	buffer_offset = DGET32(&cp[40]);
 
-	r2t_task = istgt_get_transfer_task(conn, transfer_tag);
+	r2t_task = istgt_get_transfer_task(conn, task_tag);
 	if (r2t_task == NULL) {
-		ISTGT_ERRLOG("Not found R2T task for transfer_tag=%x (pending_r2t:%d)\n",
-			transfer_tag, conn->pending_r2t);
-		goto reject_return;
+		ISTGT_ERRLOG("Not found R2T task for task_tag=%x transfer_tag=%x (pending_r2t:%d)\n",
+			task_tag, transfer_tag, conn->pending_r2t);
+		rc = istgt_iscsi_reject(conn, pdu, 0x09);
+		if (rc < 0) {
+			ISTGT_ERRLOG("iscsi_reject() failed\n");
+			return (-1);
+		}
+		return (0);
+	}
+	if (r2t_task->recover != 0)
+		return (istgt_iscsi_data_discard(conn, r2t_task, F_bit));
+
+	/* the data is in order, it is for the oldest burst */
+	if ((uint32_t) r2t_task->offset < r2t_task->unsol_end) {
+		current_transfer_tag = 0xffffffffU;
+		end = r2t_task->unsol_end;
+	} else if (r2t_task->nburst > 0) {
+		current_transfer_tag =
+			r2t_task->burst[r2t_task->hburst].transfer_tag;
+		end = r2t_task->burst[r2t_task->hburst].end;
+	} else {
+		ISTGT_ERRLOG("c#%d no R2T outstanding for task_tag=%x\n",
+			conn->id, task_tag);
+		return (-1);
 	}
-
-	current_task_tag = r2t_task->task_tag;
-	current_transfer_tag = r2t_task->transfer_tag;
-	offset = r2t_task->offset;
 	ExpDataSN = r2t_task->DataSN;
 
 	if (DataSN != ExpDataSN) {
 		ISTGT_ERRLOG("DataSN(%x) error\n", DataSN);
 		return (-1);
 	}
-	if (task_tag != current_task_tag) {
-		ISTGT_ERRLOG("task_tag(%x/%x) error\n",
-			task_tag, current_task_tag);
-		return (-1);
-	}
 	if (transfer_tag != current_transfer_tag) {
 		ISTGT_ERRLOG("transfer_tag(%x/%x) error\n",
 			transfer_tag, current_transfer_tag);
 		return (-1);
 	}
-	if (buffer_offset != offset) {
+	if (buffer_offset != (uint32_t) r2t_task->offset) {
 		ISTGT_ERRLOG("offset(%u) error\n", buffer_offset);
 		return (-1);
 	}
-	// if (buffer_offset + data_len > alloc_len) {
-	// 	ISTGT_ERRLOG("offset error\n");
-	// 	return (-1);
-	// }
+	if (buffer_offset + data_len > end) {
+		ISTGT_ERRLOG("offset(%u)+%zd past the burst(%u)\n",
+			buffer_offset, data_len, end);
+		return (-1);
+	}
 
 	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
 		"copy pdu.data %lu to r2ttask.iobuf at %u; pending r2t=%d, StatSN=%x, ExpStatSN=%x, DataSN=%x\n",
 		data_len, buffer_offset, conn->pending_r2t, conn->StatSN, ExpStatSN, DataSN);
 
-	iondx = ++r2t_task->iobufindx;
-	r2t_task->iobufsize += data_len;
-	offset += data_len;  // we do check buffer_offest == offset
-	r2t_task->iobuf[iondx].iov_base = pdu->data;
-	r2t_task->iobuf[iondx].iov_len = data_len;
-	// memcpy(data + buffer_offset, pdu->data, data_len);
+	if (ISTGT_SGL_APPEND(r2t_task, pdu->data, data_len) < 0) {
+		ISTGT_ERRLOG("no memory for %d segments of r2ttask\n",
+		    r2t_task->iobufindx + 2);
+		return (-1);
+	}
 	pdu->data = NULL;
 	ExpDataSN++;
 
-	r2t_task->offset = offset;
+	r2t_task->offset += data_len;
 	r2t_task->DataSN = ExpDataSN;
 	r2t_task->F_bit = F_bit;
-	return (0);
+
+	if ((uint32_t) r2t_task->offset == end) {
+		if (F_bit == 0) {
+			ISTGT_ERRLOG("c#%d F_bit not set on the last PDU\n", conn->id);
+			return (-1);
+		}
+		/* DataSN starts over with each R2T */
+		r2t_task->DataSN = 0;
+		if (current_transfer_tag != 0xffffffffU) {
+			r2t_task->hburst = (r2t_task->hburst + 1) % ISTGT_R2T_BURSTS;
+			r2t_task->nburst--;
+		}
+	} else if (F_bit != 0) {
+		ISTGT_ERRLOG("c#%d burst ended at %d of %u\n",
+			conn->id, r2t_task->offset, end);
+		return (-1);
+	}
+
+	if ((uint32_t) r2t_task->offset == r2t_task->transfer_len)
+		return (istgt_iscsi_exec_transfer_task(conn, r2t_task));
+	return (istgt_iscsi_kick_r2t(conn, r2t_task));
+}
+
+/* writes the initiator stopped sending the data of */
+static int
+istgt_iscsi_transfer_stalled(CONN_Ptr conn, time_t now)
+{
+	ISTGT_R2T_TASK_Ptr r2t_task;
+	int stalled = 0;
+	int i;
+
+	MTX_LOCK(&conn->r2t_mutex);
+	for (i = 0; i < conn->pending_r2t; i++) {
+		r2t_task = conn->r2t_tasks[i];
+		/* waiting on the writes ahead, not on the initiator */
+		if (r2t_task->parked)
+			continue;
+		if (now - r2t_task->start > conn->timeout) {
+			ISTGT_ERRLOG("c#%d DATA-OUT timed out CmdSN=0x%x ITT=%x (%d/%u)\n",
+				conn->id, r2t_task->CmdSN, r2t_task->task_tag,
+				r2t_task->offset, r2t_task->transfer_len);
+			stalled = 1;
+			break;
+		}
+	}
+	MTX_UNLOCK(&conn->r2t_mutex);
+	return (stalled);
 }
 
 uint8_t istgt_get_sleep_val(ISTGT_LU_DISK *spec) {
@@ -4678,7 +6181,6 @@ istgt_iscsi_transfer_out(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, size_t transfer
 	// uint8_t *data = lu_cmd->iobuf;
 	// size_t alloc_len = lu_cmd->iobufsize;
 	ISTGT_QUEUE_Ptr r_ptr = NULL;
-	ISTGT_R2T_TASK_Ptr r2t_task;
 	ISCSI_PDU data_pdu;
 	uint8_t *cp;
 	uint32_t current_task_tag;
@@ -4701,7 +6203,7 @@ istgt_iscsi_transfer_out(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, size_t transfer
 	int len;
 	int r2t_flag;
 	int r2t_sent;
-	int rc, i;
+	int rc;
 	uint64_t *tptr;
 	const char *msg;
 	current_task_tag = lu_cmd->task_tag;
@@ -4730,66 +6232,6 @@ start:
 		return (0);
 	}
 
-	r2t_task = istgt_get_transfer_task(conn, current_transfer_tag);
-	if (r2t_task != NULL) {
-		current_task_tag = r2t_task->task_tag;
-		current_transfer_tag = r2t_task->transfer_tag;
-		offset = r2t_task->offset;
-		R2TSN = r2t_task->R2TSN;
-		ExpDataSN = r2t_task->DataSN;
-		F_bit = r2t_task->F_bit;
-		r2t_flag = 1;
-
-		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
-			"c#%d Using R2T(%x)trtag:%x offset=%zd, DataSN=%x. Transfer=%zd, First=%zd, Max=%zd, Segment=%zd\n",
-			conn->id, R2TSN, current_transfer_tag, offset, ExpDataSN,
-			transfer_len, data_len, max_burst_len, segment_len);
-
-		data_len = 0;
-
-		// memcpy(data, r2t_task->iobuf, offset);
-		lu_cmd->iobufsize = r2t_task->iobufsize;
-		lu_cmd->iobufindx = r2t_task->iobufindx;
-		for (i = 0; i <= r2t_task->iobufindx; ++i) {
-			lu_cmd->iobuf[i].iov_base = r2t_task->iobuf[i].iov_base;
-			lu_cmd->iobuf[i].iov_len = r2t_task->iobuf[i].iov_len;
-			r2t_task->iobuf[i].iov_base = NULL;
-			r2t_task->iobuf[i].iov_len = 0;
-		}
-		r2t_task->iobufsize = 0;
-		r2t_task->iobufindx = -1;
-		istgt_del_transfer_task(conn, r2t_task);
-		istgt_free_transfer_task(r2t_task);
-
-		rc = istgt_queue_count(&conn->pending_pdus);
-		if (rc > 0) {
-			if (g_trace_flag) {
-				ISTGT_WARNLOG("pending_pdus > 0\n");
-			}
-		}
-		if (offset < transfer_len) {
-			if (offset >= (first_burst_len + max_burst_len)) {
-				/* need more data */
-				r2t_flag = 0;
-			}
-			len = DMIN32(max_burst_len,
-				(transfer_len - offset));
-			// memset(&data_pdu.bhs, 0, ISCSI_BHS_LEN);
-			tptr = (uint64_t *)&(data_pdu.bhs);
-			*tptr = 0; *(tptr+1) = 0; *(tptr+2) = 0;
-			*(tptr+3) = 0; *(tptr+4) = 0; *(tptr+5) = 0;
-			data_pdu.ahs = NULL;
-			data_pdu.data = NULL;
-			goto r2t_retry;
-		} else if (offset == transfer_len) {
-			if (F_bit == 0) {
-				ISTGT_ERRLOG("c#%d F_bit not set on the last PDU\n", conn->id);
-				return (-1);
-			}
-		}
-		return (0);
-	}
-
 	if (data_len != 0) {
 		if (data_len > first_burst_len) {
 			ISTGT_ERRLOG("c#%d data_len > first_burst_len,  Transfer=%zd, First=%zd, Max=%zd, Segment=%zd\n",
@@ -4797,10 +6239,12 @@ start:
 			return (-1);
 		}
 		if (lu_cmd->pdu->data) {
-			i = ++lu_cmd->iobufindx;
-			lu_cmd->iobufsize += data_len;
-			lu_cmd->iobuf[i].iov_base = lu_cmd->pdu->data;
-			lu_cmd->iobuf[i].iov_len = data_len;
+			if (ISTGT_SGL_APPEND(lu_cmd, lu_cmd->pdu->data,
+			    data_len) < 0) {
+				ISTGT_ERRLOG("c#%d no memory for segments\n",
+				    conn->id);
+				return (-1);
+			}
 			// memcpy(data + offset, lu_cmd->pdu->data, data_len);
 			lu_cmd->pdu->data = NULL;
 		} else {
@@ -4884,7 +6328,10 @@ start:
 				if (msg) {
 					ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
 						"c#%d DATAOUT but %s [tsk:%x tran:%x]", conn->id, msg, task_tag,  transfer_tag);
-					rc = istgt_iscsi_op_data(conn, &data_pdu);
+					if (data_pdu.data_digest_error)
+						rc = istgt_iscsi_digest_error(conn, &data_pdu);
+					else
+						rc = istgt_iscsi_op_data(conn, &data_pdu);
 					if (rc < 0) {
 						ISTGT_ERRLOG("c#%d iscsi_op_data() failed\n", conn->id);
 						goto error_return;
@@ -4930,6 +6377,12 @@ start:
 				data_pdu.opcode = 0;
 				continue;
 			}
+			if (data_pdu.data_digest_error) {
+				/* no recovery R2T for a write the LU gathers */
+				ISTGT_ERRLOG("c#%d data digest error on DATA-OUT ITT=%x\n",
+					conn->id, task_tag);
+				goto error_return;
+			}
 
 			ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
 				"c#%d read_from_net cmdSN=0x%x StatSN=%x, ExpStatSN=%x, DataSN=%x, Offset=%u, Data=%zd\n",
@@ -4958,10 +6411,12 @@ start:
 			// }
 
 			timediff(lu_cmd, '@', __LINE__);
-			i = ++lu_cmd->iobufindx;
-			lu_cmd->iobufsize += data_len;
-			lu_cmd->iobuf[i].iov_base = data_pdu.data;
-			lu_cmd->iobuf[i].iov_len = data_len;
+			if (ISTGT_SGL_APPEND(lu_cmd, data_pdu.data,
+			    data_len) < 0) {
+				ISTGT_ERRLOG("c#%d no memory for %d segments\n",
+				    conn->id, lu_cmd->iobufindx + 2);
+				goto error_return;
+			}
 			data_pdu.data = NULL; data_pdu.data_segment_len = 0;
 			// memcpy(data + buffer_offset, data_pdu.data, data_len);
 			offset += data_len;
@@ -5150,9 +6605,114 @@ istgt_iscsi_send_async(CONN_Ptr conn)
 	return (0);
 }
 
+/* SNACK, from ErrorRecoveryLevel 1 on */
+static int
+istgt_iscsi_op_snack(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	ISTGT_RETAINED_TASK *rt;
+	ISTGT_RETAINED_PDU *list, *tail, *rp;
+	uint8_t *cp;
+	uint32_t task_tag;
+	uint32_t beg_run;
+	uint32_t run_length;
+	int type;
+	int rc;
+
+	if (!conn->full_feature) {
+		ISTGT_ERRLOG("before Full Feature\n");
+		return (-1);
+	}
+
+	cp = (uint8_t *) &pdu->bhs;
+	type = BGET8W(&cp[1], 3, 4);
+	task_tag = DGET32(&cp[16]);
+	beg_run = DGET32(&cp[40]);
+	run_length = DGET32(&cp[44]);
+
+	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+		"c#%d SNACK type=%d ITT=%x BegRun=%u RunLength=%u\n",
+		conn->id, type, task_tag, beg_run, run_length);
+	if (type == 2) {
+		/* DataACK, no DATA-IN here asks for one */
+		return (0);
+	}
+
+	list = tail = NULL;
+	MTX_LOCK(&conn->retain_mutex);
+	if (type == 1) {
+		/* Status, by StatSN, the run ends the walk */
+		for (rt = conn->retained; rt != NULL; rt = rt->next) {
+			if (SN32_LT(rt->StatSN, beg_run))
+				continue;
+			if (!istgt_sn_in_run(rt->StatSN, beg_run, run_length))
+				break;
+			rp = istgt_iscsi_retained_pick(rt, 0, 0, 0, 1);
+			if (rp == NULL)
+				continue;
+			if (tail != NULL)
+				tail->next = rp;
+			else
+				list = rp;
+			for (tail = rp; tail->next != NULL; tail = tail->next)
+				;
+		}
+	} else if (type == 0 || type == 3) {
+		/* Data/R2T by DataSN or R2TSN, R-Data all of it again */
+		rt = istgt_iscsi_retain_find(conn, task_tag);
+		if (rt != NULL && type == 0)
+			list = istgt_iscsi_retained_pick(rt, 1, beg_run,
+			    run_length, 0);
+		else if (rt != NULL && istgt_iscsi_retained_whole(rt))
+			list = istgt_iscsi_retained_pick(rt, 1, 0, 0, 1);
+	}
+	MTX_UNLOCK(&conn->retain_mutex);
+
+	if (list == NULL) {
+		ISTGT_WARNLOG("c#%d SNACK type=%d ITT=%x %u+%u not kept\n",
+			conn->id, type, task_tag, beg_run, run_length);
+		rc = istgt_iscsi_reject(conn, pdu, 0x09);
+		if (rc < 0) {
+			ISTGT_ERRLOG("iscsi_reject() failed\n");
+			return (-1);
+		}
+		return (0);
+	}
+	return (istgt_iscsi_resend(conn, list, 0));
+}
+
+/*
+ * The data of pdu failed its digest, its header is good.  The PDU is
+ * rejected and dropped: a command is retried by the initiator with the
+ * same CmdSN, DATA-OUT is asked for again by a recovery R2T.
+ */
+static int
+istgt_iscsi_digest_error(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	uint8_t *cp;
+	int rc;
+
+	rc = istgt_iscsi_reject(conn, pdu, 0x02);
+	if (rc < 0) {
+		ISTGT_ERRLOG("iscsi_reject() failed\n");
+		return (-1);
+	}
+	cp = (uint8_t *) &pdu->bhs;
+	switch (BGET8W(&cp[0], 5, 6)) {
+	case ISCSI_OP_SCSI:
+		if (BGET8(&cp[0], 6) == 0)
+			return (istgt_iscsi_cmdsn_hole(conn, DGET32(&cp[24])));
+		return (0);
+	case ISCSI_OP_SCSI_DATAOUT:
+		return (istgt_iscsi_data_recover(conn, pdu));
+	default:
+		return (0);
+	}
+}
+
 static int
 istgt_iscsi_execute(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 {
+	uint8_t *cp;
 	uint8_t opcode;
 	int rc, ret = 0;
 	const char *op = "--";
@@ -5168,10 +6728,23 @@ istgt_iscsi_execute(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		pdu->opcode = bhsopcode;
 		opcode = bhsopcode;
 	}
-	switch (opcode) {
-	case ISCSI_OP_NOPOUT:
-		op = "nopout";
-		rc = istgt_iscsi_op_nopout(conn, pdu);
+	if (conn->error_recovery != 0 && conn->full_feature) {
+		/* ExpStatSN lets go of what was kept for SNACK */
+		cp = (uint8_t *) &pdu->bhs;
+		istgt_iscsi_retain_ack(conn, DGET32(&cp[28]));
+		if (pdu->data_digest_error) {
+			rc = istgt_iscsi_digest_error(conn, pdu);
+			if (rc < 0) {
+				op = "digest";
+				goto error_out;
+			}
+			return (0);
+		}
+	}
+	switch (opcode) {
+	case ISCSI_OP_NOPOUT:
+		op = "nopout";
+		rc = istgt_iscsi_op_nopout(conn, pdu);
 		if (rc < 0)
 			goto error_out;
 		break;
@@ -5179,6 +6752,12 @@ istgt_iscsi_execute(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	case ISCSI_OP_SCSI:
 		op = "scsi";
 		rc = istgt_iscsi_op_scsi(conn, pdu);
+		/* MC/S, the next command is let go once this one is with the LU */
+		if (conn->sess != NULL) {
+			SESS_MTX_LOCK(conn);
+			istgt_iscsi_cmdsn_next(conn->sess);
+			SESS_MTX_UNLOCK(conn);
+		}
 		if (rc < 0)
 			goto error_out;
 		break;
@@ -5221,6 +6800,13 @@ istgt_iscsi_execute(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 
 	case ISCSI_OP_SNACK:
 		op = "snack";
+		if (conn->error_recovery != 0) {
+			rc = istgt_iscsi_op_snack(conn, pdu);
+			if (rc < 0)
+				goto error_out;
+			break;
+		}
+		/* FALLTHROUGH */
 	default:
 		ISTGT_ERRLOG("unsupported opcode=%x:%s, isid=%"PRIx64", tsih=%u, cid=%u\n",
 				opcode, op, conn->isid, conn->tsih, conn->cid);
@@ -5251,6 +6837,7 @@ wait_all_task(CONN_Ptr conn)
 	int epfd;
 	struct epoll_event event, events;
 	struct timespec ep_timeout;
+	eventfd_t val;
 
 	int msec = 30;
 	int rc;
@@ -5265,9 +6852,9 @@ wait_all_task(CONN_Ptr conn)
 		ISTGT_ERRLOG("epoll_create1() failed\n");
 		return;
 	}
-	event.data.fd = conn->task_pipe[0];
+	event.data.fd = conn->task_efd;
 	event.events = EPOLLIN;
-	rc = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->task_pipe[0], &event);
+	rc = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->task_efd, &event);
 	if (rc == -1) {
 		ISTGT_ERRLOG("epoll_ctl() failed\n");
 		close(epfd);
@@ -5279,84 +6866,75 @@ wait_all_task(CONN_Ptr conn)
 		"waiting task start (%d) (left %d tasks)\n",
 		conn->id, conn->running_tasks);
 	while (1) {
-		ep_timeout.tv_sec = msec;
-		ep_timeout.tv_nsec = 0;
-
-		rc = epoll_wait(epfd, &events, 1, ep_timeout.tv_sec*1000);
-		// rc = kevent(kq, NULL, 0, &kev, 1, &kev_timeout);
-		if (rc == -1 && errno == EINTR) {
-			continue;
-		}
-		if (rc == -1) {
-			ISTGT_ERRLOG("epoll_wait() failed\n");
-			break;
-		}
-		if (rc == 0) {
-			ISTGT_ERRLOG("waiting task timeout (left %d tasks)\n",
-				conn->running_tasks);
-			break;
-		}
-
-		if (events.data.fd == conn->task_pipe[0]) {
-			// if (kev.flags & (EV_EOF|EV_ERROR)) {
-			// 	break;
-			// }
-			char tmp[1];
+		/* a wakeup stands for everything queued before it was read */
+		MTX_LOCK(&conn->task_queue_mutex);
+		lu_task = istgt_queue_dequeue(&conn->task_queue);
+		MTX_UNLOCK(&conn->task_queue_mutex);
+		if (lu_task == NULL) {
+			ep_timeout.tv_sec = msec;
+			ep_timeout.tv_nsec = 0;
 
-			rc = read(conn->task_pipe[0], tmp, 1);
-			if (rc < 0 || rc == 0 || rc != 1) {
-				ISTGT_ERRLOG("read() failed\n");
+			rc = epoll_wait(epfd, &events, 1, ep_timeout.tv_sec*1000);
+			// rc = kevent(kq, NULL, 0, &kev, 1, &kev_timeout);
+			if (rc == -1 && errno == EINTR) {
+				continue;
+			}
+			if (rc == -1) {
+				ISTGT_ERRLOG("epoll_wait() failed\n");
 				break;
 			}
+			if (rc == 0) {
+				ISTGT_ERRLOG("waiting task timeout (left %d tasks)\n",
+					conn->running_tasks);
+				break;
+			}
+			if (eventfd_read(conn->task_efd, &val) != 0 &&
+			    errno != EAGAIN) {
+				ISTGT_ERRLOG("eventfd_read() failed\n");
+				break;
+			}
+			continue;
+		}
 
-			MTX_LOCK(&conn->task_queue_mutex);
-			lu_task = istgt_queue_dequeue(&conn->task_queue);
-			MTX_UNLOCK(&conn->task_queue_mutex);
-			if (lu_task != NULL) {
-				if (lu_task->lu_cmd.W_bit) {
-					/* write */
-					if (lu_task->req_transfer_out != 0) {
-						/* error transfer */
-						lu_task->error = 1;
-						lu_task->abort = 1;
-						rc = pthread_cond_broadcast(&lu_task->trans_cond);
-						if (rc != 0) {
-							ISTGT_ERRLOG("cond_broadcast() failed\n");
-							/* ignore error */
-						}
-					} else {
-						if (lu_task->req_execute) {
-							conn->running_tasks--;
-							if (conn->running_tasks == 0) {
-								ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-									"task cleanup finished\n");
-								break;
-							}
-						}
-						/* ignore response */
-#if 0
-						rc = istgt_lu_destroy_task(lu_task);
-						if (rc < 0) {
-							ISTGT_ERRLOG("lu_destroy_task() failed\n");
-							/* ignore error */
-						}
-#endif
+		if (lu_task->lu_cmd.W_bit) {
+			/* write */
+			if (lu_task->req_transfer_out != 0) {
+				/* error transfer */
+				lu_task->error = 1;
+				lu_task->abort = 1;
+				rc = pthread_cond_broadcast(&lu_task->trans_cond);
+				if (rc != 0) {
+					ISTGT_ERRLOG("cond_broadcast() failed\n");
+					/* ignore error */
+				}
+			} else {
+				if (lu_task->req_execute) {
+					conn->running_tasks--;
+					if (conn->running_tasks == 0) {
+						ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+							"task cleanup finished\n");
+						break;
 					}
-				} else {
-					/* read or no data */
-					/* ignore response */
+				}
+				/* ignore response */
 #if 0
-					rc = istgt_lu_destroy_task(lu_task);
-					if (rc < 0) {
-						ISTGT_ERRLOG("lu_destroy_task() failed\n");
-						/* ignore error */
-					}
-#endif
+				rc = istgt_lu_destroy_task(lu_task);
+				if (rc < 0) {
+					ISTGT_ERRLOG("lu_destroy_task() failed\n");
+					/* ignore error */
 				}
-			} else {
-				ISTGT_ERRLOG("lu_task is NULL\n");
-				break;
+#endif
+			}
+		} else {
+			/* read or no data */
+			/* ignore response */
+#if 0
+			rc = istgt_lu_destroy_task(lu_task);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_destroy_task() failed\n");
+				/* ignore error */
 			}
+#endif
 		}
 	}
 
@@ -5734,6 +7312,106 @@ update_cummulative_rw_time(ISTGT_LU_TASK_Ptr lu_task)
 }
 #endif
 
+/*
+ * Sends one task taken off the result queue: the response of a command
+ * or a queued PDU.  Returns -1 if the connection can't continue.
+ */
+static int
+istgt_iscsi_send_result(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	ISCSI_PDU_Ptr pdu;
+	int rc;
+
+	lu_task->lu_cmd.flags |= ISTGT_RESULT_Q_DEQUEUED;
+	if (lu_task->lu_cmd.aborted == 1) {
+		ISTGT_LOG("Aborted from result queue\n");
+		rc = istgt_lu_destroy_task(lu_task);
+		if (rc < 0)
+			ISTGT_ERRLOG("lu_destroy_task failed\n");
+		return (0);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+		"CSN:%x sender type:%d 0x%x.%lu+%u",
+		lu_task->lu_cmd.CmdSN, lu_task->type,
+		lu_task->lu_cmd.cdb0, lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen);
+	lu_task->lock = 1;
+	timediff(&lu_task->lu_cmd, 'r', __LINE__);
+	if (lu_task->type == ISTGT_LU_TASK_RESPONSE) {
+#ifdef REPLICATION
+		if (lu_task->execute == 1 ||
+		    (lu_task->lu_cmd.flags & ISTGT_COMPLETED_EXEC))
+			update_cummulative_rw_time(lu_task);
+#endif
+
+		/* send DATA-IN, SCSI status */
+		rc = istgt_iscsi_task_response(conn, lu_task);
+		if (rc < 0) {
+			lu_task->error = 1;
+			ISTGT_ERRLOG(
+				"iscsi_task_response() CSN=%x failed"
+				" on %s(%s)\n", lu_task->lu_cmd.CmdSN,
+				conn->target_port, conn->initiator_port);
+			return (-1);
+		}
+		timediff(&lu_task->lu_cmd, 's', __LINE__);
+		prof_log(&lu_task->lu_cmd, "resp");
+		if (lu_task->complete_queue_ptr != NULL)
+			ISTGT_ERRLOG("complete_queue_ptr not NULL\n");
+		rc = istgt_lu_destroy_task(lu_task);
+		if (rc < 0)
+			ISTGT_ERRLOG("lu_destroy_task() failed\n");
+	} else if (lu_task->type == ISTGT_LU_TASK_REQPDU ||
+	    lu_task->type == ISTGT_LU_TASK_REQUPDPDU) {
+		if (lu_task->type == ISTGT_LU_TASK_REQUPDPDU) {
+			rc = istgt_update_pdu(lu_task->conn, &lu_task->lu_cmd);
+			if (rc < 0) {
+				lu_task->error = 1;
+				ISTGT_ERRLOG(
+					"update_pdu() failed on %s(%s)\n",
+					lu_task->conn->target_port,
+					lu_task->conn->initiator_port);
+				return (-1);
+			}
+		}
+		pdu = lu_task->lu_cmd.pdu;
+		/* send PDU */
+		rc = istgt_iscsi_write_pdu_internal(lu_task->conn,
+			lu_task->lu_cmd.pdu, &(lu_task->lu_cmd));
+		if (rc < 0) {
+			lu_task->error = 1;
+			ISTGT_ERRLOG(
+				"iscsi_write_pdu() failed on %s(%s)\n",
+				lu_task->conn->target_port,
+				lu_task->conn->initiator_port);
+			return (-1);
+		}
+		/* free allocated memory by caller */
+		timediff(&lu_task->lu_cmd, 'S', __LINE__);
+		prof_log(&lu_task->lu_cmd,
+				(lu_task->type == ISTGT_LU_TASK_REQUPDPDU) ?  "requ" : "req ");
+		if (pdu->data != NULL) {
+			xfree(pdu->data);
+			pdu->data = NULL;
+		}
+		if (pdu->ahs != NULL) {
+			xfree(pdu->ahs);
+			pdu->ahs = NULL;
+		}
+		if (lu_task->lu_cmd.data != NULL) {
+			xfree(lu_task->lu_cmd.data);
+			lu_task->lu_cmd.data = NULL;
+		}
+		if (lu_task->lu_cmd.sense_data != NULL) {
+			xfree(lu_task->lu_cmd.sense_data);
+			lu_task->lu_cmd.sense_data = NULL;
+		}
+		istgt_lu_task_put(lu_task);
+	} else {
+		ISTGT_ERRLOG("Unknown task type %x\n", lu_task->type);
+	}
+	return (0);
+}
+
 static void *
 sender(void *arg)
 {
@@ -5742,12 +7420,12 @@ sender(void *arg)
 	struct timespec abstime;
 	time_t now;
 	int rc;
-	ISCSI_PDU_Ptr pdu = NULL;
 	pthread_t slf = pthread_self();
 	snprintf(tinfo, sizeof (tinfo), "s#%d.%ld.%d", conn->id, (uint64_t)(((uint64_t *)slf)[0]), ntohs(conn->iport));
 #ifdef HAVE_PTHREAD_SET_NAME_NP
 	pthread_set_name_np(slf, tinfo);
 #endif
+	istgt_affinity_apply(ISTGT_AFF_CONN_SENDER, -1);
 
 //	pthread_cleanup_push(snd_cleanup, (void *)conn);
 	memset(&abstime, 0, sizeof (abstime));
@@ -5793,133 +7471,848 @@ sender(void *arg)
 		/* send all responses */
 //		MTX_LOCK(&conn->wpdu_mutex);
 		do {
-			lu_task->lu_cmd.flags |= ISTGT_RESULT_Q_DEQUEUED;
-			if (lu_task->lu_cmd.aborted == 1) {
-				ISTGT_LOG("Aborted from result queue\n");
-				rc = istgt_lu_destroy_task(lu_task);
-				if (rc < 0)
-					ISTGT_ERRLOG("lu_destroy_task failed\n");
+			rc = istgt_iscsi_send_result(conn, lu_task);
+			if (rc < 0) {
+				(void) istgt_iscsi_task_exit(conn);
 				break;
 			}
-			ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
-				"CSN:%x sender type:%d 0x%x.%lu+%u",
-				lu_task->lu_cmd.CmdSN, lu_task->type,
-				lu_task->lu_cmd.cdb0, lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen);
-			lu_task->lock = 1;
-			timediff(&lu_task->lu_cmd, 'r', __LINE__);
-			if (lu_task->type == ISTGT_LU_TASK_RESPONSE) {
-#ifdef REPLICATION
-				if (lu_task->execute == 1 ||
-				    (lu_task->lu_cmd.flags & ISTGT_COMPLETED_EXEC))
-					update_cummulative_rw_time(lu_task);
-#endif
+			// conn is running?
+			if (conn->state != CONN_STATE_RUNNING) {
+				// ISTGT_WARNLOG("exit thread\n");
+				break;
+			}
+			MTX_LOCK(&conn->result_queue_mutex);
+			lu_task = istgt_queue_dequeue(&conn->result_queue);
+			MTX_UNLOCK(&conn->result_queue_mutex);
+		} while (lu_task != NULL);
+//		MTX_UNLOCK(&conn->wpdu_mutex);
+	}
+	// MTX_UNLOCK(&conn->sender_mutex);
+//	pthread_cleanup_pop(0);
+	ISTGT_NOTICELOG("sender loop ended (%d:%d:%d)\n", conn->id, conn->epfd, ntohs(conn->iport));
+	return (NULL);
+}
+
+
+/*
+ * task_efd wakes the worker (the reactor in reactor mode) for the task
+ * queue, an exit request and the results of a reactor connection.  It
+ * carries no message, the consumer looks at task_queue, task_exit,
+ * result_kick and the commands of the session waiting for their CmdSN,
+ * so a producer only needs to notify when it makes one of them
+ * non-empty, and a wakeup stands for all of it.
+ */
+int
+istgt_iscsi_task_notify(CONN_Ptr conn)
+{
+	if (eventfd_write(conn->task_efd, 1) != 0) {
+		ISTGT_ERRLOG("eventfd_write() failed errno:%d (con:%d)\n",
+			errno, conn->id);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+istgt_iscsi_task_exit(CONN_Ptr conn)
+{
+	conn->task_exit = 1;
+	return (istgt_iscsi_task_notify(conn));
+}
+
+/*
+ * Runs the next task of the task queue (DATA-IN/OUT), returns 1 if there
+ * was one.
+ */
+static int
+istgt_iscsi_exec_task(CONN_Ptr conn)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	int rc;
+
+	MTX_LOCK(&conn->task_queue_mutex);
+	lu_task = istgt_queue_dequeue(&conn->task_queue);
+	MTX_UNLOCK(&conn->task_queue_mutex);
+	if (lu_task == NULL)
+		return (0);
+	if (conn->exec_lu_task != NULL) {
+		ISTGT_ERRLOG("task is overlapped (CSN=%x, %x)\n",
+			conn->exec_lu_task->lu_cmd.CmdSN,
+			lu_task->lu_cmd.CmdSN);
+		return (-1);
+	}
+	conn->exec_lu_task = lu_task;
+	if (lu_task->lu_cmd.W_bit) {
+		/* write */
+		if (lu_task->req_transfer_out == 0) {
+			if (lu_task->req_execute) {
+				if (conn->running_tasks > 0) {
+					conn->running_tasks--;
+				} else {
+					ISTGT_ERRLOG("running no task\n");
+				}
+			}
+			rc = istgt_iscsi_task_response(conn, lu_task);
+			if (rc < 0) {
+				lu_task->error = 1;
+				ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
+					conn->target_port,
+					conn->initiator_port);
+				return (-1);
+			}
+			conn->exec_lu_task = NULL;
+		} else {
+			rc = istgt_iscsi_transfer_out(conn, &(lu_task->lu_cmd),
+					lu_task->lu_cmd.transfer_len);
+			if (rc < 0) {
+				lu_task->error = 1;
+				ISTGT_ERRLOG("iscsi_task_transfer_out() failed on %s(%s)\n",
+					conn->target_port,
+					conn->initiator_port);
+				return (-1);
+			}
+
+			MTX_LOCK(&lu_task->trans_mutex);
+			lu_task->req_transfer_out = 0;
+
+			/* need response after execution */
+			lu_task->req_execute = 1;
+
+			rc = pthread_cond_broadcast(&lu_task->trans_cond);
+			MTX_UNLOCK(&lu_task->trans_mutex);
+			if (rc != 0) {
+				ISTGT_ERRLOG("cond_broadcast() failed\n");
+				return (-1);
+			}
+			conn->exec_lu_task = NULL;
+		}
+	} else {
+		/* read or no data */
+		rc = istgt_iscsi_task_response(conn, lu_task);
+		if (rc < 0) {
+			lu_task->error = 1;
+			ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
+				conn->target_port,
+				conn->initiator_port);
+			return (-1);
+		}
+		conn->exec_lu_task = NULL;
+	}
+	return (1);
+}
+
+/* runs the task queue empty, a reactor stops at a half read PDU */
+static int
+istgt_iscsi_drain_tasks(CONN_Ptr conn)
+{
+	int rc;
+
+	conn->tasks_deferred = 0;
+	do {
+		/* DATA-OUT would read in the middle of the PDU */
+		if (conn->reactor != NULL && conn->rx_state != ISTGT_RX_IDLE) {
+			conn->tasks_deferred = 1;
+			return (0);
+		}
+		rc = istgt_iscsi_exec_task(conn);
+		if (rc < 0)
+			return (-1);
+		/* XXX PDUs in DATA-OUT? */
+		if (istgt_iscsi_execute_pending(conn) < 0)
+			return (-1);
+		if (istgt_iscsi_execute_waiting(conn) < 0)
+			return (-1);
+		if (istgt_iscsi_execute_held(conn) < 0)
+			return (-1);
+	} while (rc > 0);
+	return (0);
+}
+
+/* executes conn->pdu and then the PDUs put aside during DATA-OUT */
+static int
+istgt_iscsi_execute_all(CONN_Ptr conn)
+{
+	ISCSI_PDU_Ptr pdu;
+	int rc;
+
+	do {
+		if (conn->state != CONN_STATE_RUNNING) {
+			return (-1);
+		}
+
+		rc = istgt_iscsi_execute(conn, &conn->pdu);
+		if (rc < 0) {
+			ISTGT_ERRLOG("iscsi_execute() failed on %s(%s)\n",
+				conn->target_port, conn->initiator_port);
+			return (-1);
+		} else if (rc == 1) { // means successful logout ISCSI_OP_LOGOUT
+			ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "logout received\n");
+		}
+
+		if (conn->pdu.ahs != NULL) {
+			xfree(conn->pdu.ahs);
+			conn->pdu.ahs = NULL;
+		}
+		if (conn->pdu.data != NULL) {
+			xfree(conn->pdu.data);
+			conn->pdu.data = NULL;
+		}
+
+		/* execute pending PDUs */
+		pdu = istgt_queue_dequeue(&conn->pending_pdus);
+		if (pdu != NULL) {
+			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				"execute pending PDU\n");
+			istgt_iscsi_copy_pdu(&conn->pdu, pdu);
+			xfree(pdu);
+		}
+	} while (pdu != NULL);
+	return (0);
+}
+
+/* PDUs in DATA-OUT of a task */
+static int
+istgt_iscsi_execute_pending(CONN_Ptr conn)
+{
+	ISCSI_PDU_Ptr pdu;
+
+	pdu = istgt_queue_dequeue(&conn->pending_pdus);
+	if (pdu == NULL)
+		return (0);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "pending in task\n");
+	istgt_iscsi_copy_pdu(&conn->pdu, pdu);
+	xfree(pdu);
+	return (istgt_iscsi_execute_all(conn));
+}
+
+/* MC/S, the commands of conn that waited for their CmdSN and are due */
+static int
+istgt_iscsi_execute_waiting(CONN_Ptr conn)
+{
+	SESS_Ptr sess = conn->sess;
+	ISTGT_CMDSN_WAIT *w;
+
+	if (sess == NULL)
+		return (0);
+	for (;;) {
+		/* a connection going away leaves them to the session */
+		if (conn->state != CONN_STATE_RUNNING)
+			return (0);
+		MTX_LOCK(&sess->mutex);
+		w = sess->cmdsn_wait;
+		if (w == NULL || w->conn != conn || w->CmdSN != sess->ExpCmdSN) {
+			MTX_UNLOCK(&sess->mutex);
+			return (0);
+		}
+		sess->cmdsn_wait = w->next;
+		MTX_UNLOCK(&sess->mutex);
+		istgt_iscsi_copy_pdu(&conn->pdu, &w->pdu);
+		xfree(w);
+		if (istgt_iscsi_execute_all(conn) < 0)
+			return (-1);
+	}
+}
+
+/* everything conn kept, linked by next */
+static ISTGT_RETAINED_TASK *
+istgt_iscsi_retain_take(CONN_Ptr conn)
+{
+	ISTGT_RETAINED_TASK *list, *rt;
+	int i;
+
+	list = NULL;
+	MTX_LOCK(&conn->retain_mutex);
+	for (i = 0; i < ISTGT_RETAIN_HASH; i++) {
+		while ((rt = conn->retain_hash[i]) != NULL) {
+			conn->retain_hash[i] = rt->hnext;
+			rt->hnext = rt->prev = NULL;
+			rt->next = list;
+			list = rt;
+		}
+	}
+	conn->retained = conn->retained_tail = NULL;
+	conn->retained_tasks = 0;
+	conn->retained_bytes = 0;
+	MTX_UNLOCK(&conn->retain_mutex);
+	return (list);
+}
+
+/*
+ * What a failed connection kept goes to its session for TASK REASSIGN
+ * from ErrorRecoveryLevel 2 on, tasks nobody came back for within
+ * DefaultTime2Wait + DefaultTime2Retain are let go.
+ */
+static void
+istgt_iscsi_retain_orphan(CONN_Ptr conn)
+{
+	SESS_Ptr sess = conn->sess;
+	ISTGT_RETAINED_TASK *list, *rt, *prev, *next;
+	time_t now;
+
+	list = istgt_iscsi_retain_take(conn);
+	if (sess == NULL || conn->error_recovery < 2 || conn->no_recovery) {
+		istgt_iscsi_retained_free_all(list);
+		return;
+	}
+
+	now = time(NULL);
+	MTX_LOCK(&sess->mutex);
+	prev = NULL;
+	for (rt = sess->orphans; rt != NULL; rt = next) {
+		next = rt->next;
+		if (now - rt->orphaned
+		    > sess->DefaultTime2Wait + sess->DefaultTime2Retain) {
+			if (prev != NULL)
+				prev->next = next;
+			else
+				sess->orphans = next;
+			istgt_iscsi_retained_free(rt);
+		} else {
+			prev = rt;
+		}
+	}
+	for (rt = list; rt != NULL; rt = next) {
+		next = rt->next;
+		rt->next = NULL;
+		/* a task that never ended is only known, to be refused */
+		if (rt->has_status == 0)
+			istgt_iscsi_retained_clear(rt);
+		rt->orphaned = now;
+		if (prev != NULL)
+			prev->next = rt;
+		else
+			sess->orphans = rt;
+		prev = rt;
+	}
+	(void) pthread_cond_broadcast(&sess->mcs_cond);
+	MTX_UNLOCK(&sess->mutex);
+}
+
+/*
+ * Tears down an ended connection: waits for its tasks, stops the sender
+ * if there is one and releases conn.
+ */
+static void
+istgt_iscsi_conn_cleanup(CONN_Ptr conn)
+{
+	ISTGT_LU_Ptr lu;
+	int lost;
+	int rc;
+
+	conn->state = CONN_STATE_EXITING;
+	if (conn->sess != NULL) {
+		lu = conn->sess->lu;
+		if (lu != NULL)
+			MTX_LOCK(&lu->mutex);
+		SESS_MTX_LOCK(conn);
+		rc = 0;
+		if (lu != NULL && lu->queue_depth != 0) {
+			lost = conn->pending_r2t;
+			rc = istgt_lu_clear_task_IT(conn, lu);
+			istgt_clear_all_transfer_task(conn);
+			/* the session goes on, the window keeps its size */
+			if (rc >= 0 && conn->error_recovery >= 2
+			    && conn->no_recovery == 0) {
+				lost += rc;
+				conn->sess->MaxCmdSN += lost;
+				conn->sess->MaxCmdSN_local += lost;
+			}
+		}
+		istgt_iscsi_cmdsn_wait_drop(conn);
+		SESS_MTX_UNLOCK(conn);
+		istgt_iscsi_order_drop(conn);
+		if (lu != NULL)
+			MTX_UNLOCK(&lu->mutex);
+		if (rc < 0) {
+			ISTGT_ERRLOG("lu_clear_task_IT() failed\n");
+		}
+	}
+	if (conn->pdu.ahs != NULL) {
+		xfree(conn->pdu.ahs);
+		conn->pdu.ahs = NULL;
+	}
+	if (conn->pdu.data != NULL) {
+		xfree(conn->pdu.data);
+		conn->pdu.data = NULL;
+	}
+	wait_all_task(conn);
+
+
+	if (conn->reactor == NULL) {
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "stop sender thread (%d)\n", conn->id);
+		/* stop sender thread */
+		MTX_LOCK(&conn->result_queue_mutex);
+		rc = pthread_cond_broadcast(&conn->result_queue_cond);
+		MTX_UNLOCK(&conn->result_queue_mutex);
+		if (rc != 0) {
+			ISTGT_ERRLOG("cond_broadcast() failed\n");
+			/* ignore errors */
+		}
+		rc = pthread_join(conn->sender_thread, NULL);
+		if (rc != 0) {
+			ISTGT_ERRLOG("pthread_join() failed\n");
+			/* ignore errors */
+		}
+	}
+
+	close(conn->sock);
+	if (conn->epfd >= 0)
+		close(conn->epfd);
+	conn->epfd = -1;
+	/* nothing more is sent, what was kept may go to another connection */
+	istgt_iscsi_retain_orphan(conn);
+	ISTGT_NOTICELOG("worker %d/%d/%d end (%s/%s)", conn->id, conn->epfd, ntohs(conn->iport), conn->thr, conn->sthr);
+
+	/* cleanup conn & sess */
+	while (conn->inflight != 0)
+		sleep(1);
+	sleep(5);
+	MTX_LOCK(&g_conns_mutex);
+	g_conns[conn->id] = NULL;
+	istgt_remove_conn(conn);
+	MTX_UNLOCK(&g_conns_mutex);
+}
+
+/*
+ * Reactor mode: the socket and task_efd of a connection are served by
+ * one of the shared reactor threads instead of a worker/sender pair.
+ * The reactor reads PDUs as the bytes arrive and never waits on a full
+ * socket, responses it can't write yet are kept in conn->sendq.
+ */
+
+/* stop taking results while this much is waiting for the socket */
+#define	ISTGT_SENDQ_MAX		(8 * 1024 * 1024)
+/* PDUs read in one wakeup before the other connections get a turn */
+#define	ISTGT_REACTOR_PDU_BUDGET	32
+#define	ISTGT_SENDQ_IOV		64
+
+int
+istgt_iscsi_result_notify(CONN_Ptr conn)
+{
+	int rc = 0;
+
+	/* result_queue_mutex is held */
+	if (conn->reactor == NULL) {
+		if (conn->sender_waiting == 1)
+			rc = pthread_cond_signal(&conn->result_queue_cond);
+		return (rc);
+	}
+	/* the reactor sends the results when its handler is done */
+	if (istgt_reactor_self() == conn->reactor)
+		return (0);
+	/* one wakeup at a time, cleared when the reactor picks it up */
+	if (conn->result_kick || conn->state != CONN_STATE_RUNNING)
+		return (0);
+	rc = istgt_iscsi_task_notify(conn);
+	if (rc < 0)
+		return (-1);
+	conn->result_kick = 1;
+	return (0);
+}
+
+static int
+istgt_iscsi_reactor_queue(CONN_Ptr conn, struct iovec *iovec, int iovcnt, int total)
+{
+	ISTGT_SEND_CHUNK *chunk;
+	size_t left = total;
+	size_t off;
+	ssize_t rc;
+	int i;
+
+	/* nothing queued, the socket may take it right away */
+	if (conn->sendq_head == NULL) {
+		rc = writev(conn->sock, iovec, iovcnt);
+		if (rc < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR) {
+				ISTGT_ERRLOG("writev() failed (errno=%d,%s)\n",
+					errno, conn->initiator_name);
+				return (-1);
+			}
+			rc = 0;
+		}
+		if ((size_t)rc == left)
+			return (0);
+		left -= rc;
+		istgt_iscsi_iov_advance(iovec, iovcnt, rc);
+	}
+
+	/* the PDU buffers belong to the caller, keep a copy */
+	chunk = xmalloc(sizeof (*chunk) + left);
+	chunk->next = NULL;
+	chunk->len = left;
+	chunk->off = 0;
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		if (iovec[i].iov_len == 0)
+			continue;
+		memcpy(chunk->buf + off, iovec[i].iov_base, iovec[i].iov_len);
+		off += iovec[i].iov_len;
+	}
+	if (conn->sendq_tail != NULL)
+		conn->sendq_tail->next = chunk;
+	else
+		conn->sendq_head = chunk;
+	conn->sendq_tail = chunk;
+	if (conn->sendq_bytes == 0)
+		conn->sendq_stall = time(NULL);
+	conn->sendq_bytes += left;
+	(void) istgt_reactor_mod(&conn->sock_ev, EPOLLIN | EPOLLOUT);
+	return (0);
+}
+
+static int
+istgt_iscsi_reactor_flush(CONN_Ptr conn)
+{
+	struct iovec iov[ISTGT_SENDQ_IOV];
+	ISTGT_SEND_CHUNK *chunk;
+	size_t avail;
+	ssize_t rc;
+	int n;
+
+	while (conn->sendq_head != NULL) {
+		n = 0;
+		for (chunk = conn->sendq_head; chunk != NULL && n < ISTGT_SENDQ_IOV;
+		    chunk = chunk->next, n++) {
+			iov[n].iov_base = chunk->buf + chunk->off;
+			iov[n].iov_len = chunk->len - chunk->off;
+		}
+		rc = writev(conn->sock, iov, n);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				return (0);
+			ISTGT_ERRLOG("writev() failed (errno=%d,%s)\n", errno,
+				conn->initiator_name);
+			return (-1);
+		}
+		conn->sendq_bytes -= rc;
+		conn->sendq_stall = time(NULL);
+		while (rc > 0) {
+			chunk = conn->sendq_head;
+			avail = chunk->len - chunk->off;
+			if ((size_t)rc < avail) {
+				chunk->off += rc;
+				break;
+			}
+			rc -= avail;
+			conn->sendq_head = chunk->next;
+			xfree(chunk);
+		}
+		if (conn->sendq_head == NULL)
+			conn->sendq_tail = NULL;
+	}
+	(void) istgt_reactor_mod(&conn->sock_ev, EPOLLIN);
+	return (0);
+}
+
+/*
+ * Sends what is on the result queue.  Returns 1 if it stopped because
+ * of the backlog in sendq, 0 when the queue is empty.
+ */
+static int
+istgt_iscsi_reactor_results(CONN_Ptr conn)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	int rc;
+
+	while (conn->state == CONN_STATE_RUNNING) {
+		if (conn->sendq_bytes >= ISTGT_SENDQ_MAX)
+			return (1);
+		MTX_LOCK(&conn->result_queue_mutex);
+		lu_task = istgt_queue_dequeue(&conn->result_queue);
+		if (lu_task == NULL) {
+			MTX_UNLOCK(&conn->result_queue_mutex);
+			break;
+		}
+		if (lu_task->lu_cmd.aborted == 1 || lu_task->lu_cmd.release_aborted == 1) {
+			ISTGT_LOG("Aborted from result queue\n");
+			MTX_UNLOCK(&conn->result_queue_mutex);
+			rc = istgt_lu_destroy_task(lu_task);
+			if (rc < 0)
+				ISTGT_ERRLOG("lu_destroy_task failed\n");
+			continue;
+		}
+		lu_task->lu_cmd.flags |= ISTGT_RESULT_Q_DEQUEUED;
+		MTX_UNLOCK(&conn->result_queue_mutex);
+		rc = istgt_iscsi_send_result(conn, lu_task);
+		if (rc < 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+istgt_iscsi_reactor_pump(CONN_Ptr conn)
+{
+	int rc;
+
+	do {
+		rc = istgt_iscsi_reactor_results(conn);
+		if (rc < 0)
+			return (-1);
+		if (istgt_iscsi_reactor_flush(conn) < 0)
+			return (-1);
+	} while (rc == 1 && conn->sendq_head == NULL);
+	return (0);
+}
+
+static void *
+istgt_iscsi_reactor_reaper(void *arg)
+{
+	CONN_Ptr conn = (CONN_Ptr) arg;
+
+	snprintf(tinfo, sizeof (tinfo), "x#%d.%d", conn->id, ntohs(conn->iport));
+	istgt_iscsi_conn_cleanup(conn);
+	return (NULL);
+}
+
+/* both events are off the reactor, nothing of it refers to conn anymore */
+static void
+istgt_iscsi_reactor_gone(ISTGT_REACTOR_EV *ev)
+{
+	CONN_Ptr conn = (CONN_Ptr) ev->arg;
+	ISTGT_SEND_CHUNK *chunk;
+	pthread_t thread;
+	int rc;
+
+	while ((chunk = conn->sendq_head) != NULL) {
+		conn->sendq_head = chunk->next;
+		xfree(chunk);
+	}
+	conn->sendq_tail = NULL;
+	conn->sendq_bytes = 0;
+
+	/* waiting for the tasks takes a while, not on the reactor */
+	rc = pthread_create(&thread, &conn->istgt->attr,
+		&istgt_iscsi_reactor_reaper, (void *)conn);
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_create() failed\n");
+		istgt_iscsi_conn_cleanup(conn);
+		return;
+	}
+	rc = pthread_detach(thread);
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_detach() failed\n");
+	}
+}
+
+static void
+istgt_iscsi_reactor_close(CONN_Ptr conn)
+{
+	if (conn->reactor_closing)
+		return;
+	conn->reactor_closing = 1;
+	conn->state = CONN_STATE_EXITING;
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "loop ended (%d)\n", conn->id);
+
+	/* wait_all_task() finds the deferred tasks on the queue */
+	conn->tasks_deferred = 0;
+
+	if (conn->task_ev.reactor == NULL) {
+		istgt_reactor_del(&conn->sock_ev, istgt_iscsi_reactor_gone);
+		return;
+	}
+	istgt_reactor_del(&conn->sock_ev, NULL);
+	istgt_reactor_del(&conn->task_ev, istgt_iscsi_reactor_gone);
+}
+
+/* tasks that came in while a PDU was half read */
+static int
+istgt_iscsi_reactor_deferred(CONN_Ptr conn)
+{
+	if (conn->tasks_deferred && conn->rx_state == ISTGT_RX_IDLE)
+		return (istgt_iscsi_drain_tasks(conn));
+	return (0);
+}
+
+static void
+istgt_iscsi_reactor_sock(ISTGT_REACTOR_EV *ev, uint32_t events)
+{
+	CONN_Ptr conn = (CONN_Ptr) ev->arg;
+	int budget = ISTGT_REACTOR_PDU_BUDGET;
+	int rc;
+
+	if (events & EPOLLOUT) {
+		if (istgt_iscsi_reactor_flush(conn) < 0)
+			goto close_conn;
+	}
+	/* considered the half-close case i.e., (EPOLLRDHUP | EPOLLIN) */
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		ISTGT_ERRLOG("close conn events %d\n", events);
+		goto close_conn;
+	}
+	if (events & EPOLLIN) {
+		conn->last_activity = time(NULL);
+		while (budget-- > 0) {
+			rc = istgt_iscsi_read_pdu_nb(conn, &conn->pdu);
+			if (rc < 0) {
+				if (conn->state == CONN_STATE_RUNNING)
+					ISTGT_ERRLOG("iscsi_read_pdu() failed conn-state:%d\n",
+						conn->state);
+				goto close_conn;
+			}
+			if (rc == 0)
+				break;
+			if (istgt_iscsi_execute_all(conn) < 0)
+				goto close_conn;
+			if (istgt_iscsi_reactor_deferred(conn) < 0)
+				goto close_conn;
+		}
+	}
+	if (istgt_iscsi_reactor_pump(conn) < 0)
+		goto close_conn;
+	return;
+
+close_conn:
+	istgt_iscsi_reactor_close(conn);
+}
+
+static void
+istgt_iscsi_reactor_task(ISTGT_REACTOR_EV *ev, uint32_t events)
+{
+	CONN_Ptr conn = (CONN_Ptr) ev->arg;
+	eventfd_t val;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		ISTGT_LOG("close eventfd %d\n", errno);
+		goto close_conn;
+	}
+	if (eventfd_read(conn->task_efd, &val) != 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		ISTGT_ERRLOG("eventfd_read() failed errno:%d (con:%d)\n",
+			errno, conn->id);
+		goto close_conn;
+	}
+	/* the pump below picks up the results queued so far */
+	MTX_LOCK(&conn->result_queue_mutex);
+	conn->result_kick = 0;
+	MTX_UNLOCK(&conn->result_queue_mutex);
+	if (conn->task_exit) {
+		ISTGT_NOTICELOG("exit request (%d)\n", conn->id);
+		goto close_conn;
+	}
+	if (istgt_iscsi_drain_tasks(conn) < 0)
+		goto close_conn;
+	if (istgt_iscsi_reactor_pump(conn) < 0)
+		goto close_conn;
+	return;
+
+close_conn:
+	istgt_iscsi_reactor_close(conn);
+}
+
+static void
+istgt_iscsi_reactor_tick(ISTGT_REACTOR_EV *ev)
+{
+	CONN_Ptr conn = (CONN_Ptr) ev->arg;
+	ISTGT_LU_Ptr lu;
+	time_t now;
+
+	/* check exit request */
+	if (conn->sess != NULL) {
+		SESS_MTX_LOCK(conn);
+		lu = conn->sess->lu;
+		SESS_MTX_UNLOCK(conn);
+	} else {
+		lu = NULL;
+	}
+	if (lu != NULL) {
+		if (istgt_lu_get_state(lu) != ISTGT_STATE_RUNNING)
+			conn->state = CONN_STATE_EXITING;
+	} else {
+		if (istgt_get_state(conn->istgt) != ISTGT_STATE_RUNNING)
+			conn->state = CONN_STATE_EXITING;
+	}
+	if (conn->state != CONN_STATE_RUNNING)
+		goto close_conn;
 
-				/* send DATA-IN, SCSI status */
-				rc = istgt_iscsi_task_response(conn, lu_task);
-				if (rc < 0) {
-					lu_task->error = 1;
-					ISTGT_ERRLOG(
-						"iscsi_task_response() CSN=%x failed"
-						" on %s(%s)\n", lu_task->lu_cmd.CmdSN,
-						conn->target_port, conn->initiator_port);
-					rc = write(conn->task_pipe[1], "E", 1);
-					if (rc < 0 || rc != 1) {
-						ISTGT_ERRLOG("write() failed\n");
-					}
-					break;
-				}
-				timediff(&lu_task->lu_cmd, 's', __LINE__);
-				prof_log(&lu_task->lu_cmd, "resp");
-				if (lu_task->complete_queue_ptr != NULL)
-					ISTGT_ERRLOG("complete_queue_ptr not NULL\n");
-				rc = istgt_lu_destroy_task(lu_task);
-				if (rc < 0) {
-					ISTGT_ERRLOG("lu_destroy_task() failed\n");
-					break;
-				}
-			} else if (lu_task->type == ISTGT_LU_TASK_REQPDU) {
-			reqpdu:
-				pdu = lu_task->lu_cmd.pdu;
-				/* send PDU */
-				rc = istgt_iscsi_write_pdu_internal(lu_task->conn,
-					lu_task->lu_cmd.pdu, &(lu_task->lu_cmd));
-				if (rc < 0) {
-					lu_task->error = 1;
-					ISTGT_ERRLOG(
-						"iscsi_write_pdu() failed on %s(%s)\n",
-						lu_task->conn->target_port,
-						lu_task->conn->initiator_port);
-					rc = write(conn->task_pipe[1], "E", 1);
-					if (rc < 0 || rc != 1) {
-						ISTGT_ERRLOG("write() failed\n");
-					}
-					break;
-				}
-				/* free allocated memory by caller */
-				timediff(&lu_task->lu_cmd, 'S', __LINE__);
-				prof_log(&lu_task->lu_cmd,
-						(lu_task->type == ISTGT_LU_TASK_REQUPDPDU) ?  "requ" : "req ");
-				if (pdu->data != NULL) {
-					xfree(pdu->data);
-					pdu->data = NULL;
-				}
-				if (pdu->ahs != NULL) {
-					xfree(pdu->ahs);
-					pdu->ahs = NULL;
-				}
-				if (lu_task->lu_cmd.data != NULL) {
-					xfree(lu_task->lu_cmd.data);
-					lu_task->lu_cmd.data = NULL;
-				}
-				if (lu_task->lu_cmd.sense_data != NULL) {
-					xfree(lu_task->lu_cmd.sense_data);
-					lu_task->lu_cmd.sense_data = NULL;
-				}
-				xfree(lu_task);
-			} else if (lu_task->type == ISTGT_LU_TASK_REQUPDPDU) {
-				rc = istgt_update_pdu(lu_task->conn, &lu_task->lu_cmd);
-				if (rc < 0) {
-					lu_task->error = 1;
-					ISTGT_ERRLOG(
-						"update_pdu() failed on %s(%s)\n",
-						lu_task->conn->target_port,
-						lu_task->conn->initiator_port);
-					rc = write(conn->task_pipe[1], "E", 1);
-					if (rc < 0 || rc != 1) {
-						ISTGT_ERRLOG("write() failed\n");
-					}
-					break;
-				}
-				goto reqpdu;
-			} else {
-				ISTGT_ERRLOG("Unknown task type %x\n", lu_task->type);
-				rc = -1;
-			}
-			// conn is running?
-			if (conn->state != CONN_STATE_RUNNING) {
-				// ISTGT_WARNLOG("exit thread\n");
-				break;
-			}
-			MTX_LOCK(&conn->result_queue_mutex);
-			lu_task = istgt_queue_dequeue(&conn->result_queue);
-			MTX_UNLOCK(&conn->result_queue_mutex);
-		} while (lu_task != NULL);
-//		MTX_UNLOCK(&conn->wpdu_mutex);
+	now = time(NULL);
+	if (conn->timeout > 0) {
+		if (conn->pending_r2t != 0 &&
+		    istgt_iscsi_transfer_stalled(conn, now))
+			goto close_conn;
+		if (conn->rx_state != ISTGT_RX_IDLE &&
+		    now - conn->rx_start > conn->timeout) {
+			ISTGT_ERRLOG("c#%d PDU read timed out (%s)\n",
+				conn->id, conn->initiator_name);
+			goto close_conn;
+		}
+		if (conn->sendq_head != NULL &&
+		    now - conn->sendq_stall > conn->timeout) {
+			ISTGT_ERRLOG("c#%d write timed out (%s)\n",
+				conn->id, conn->initiator_name);
+			goto close_conn;
+		}
 	}
-	// MTX_UNLOCK(&conn->sender_mutex);
-//	pthread_cleanup_pop(0);
-	ISTGT_NOTICELOG("sender loop ended (%d:%d:%d)\n", conn->id, conn->epfd, ntohs(conn->iport));
-	return (NULL);
+
+	/* idle timeout, send diagnosis packet */
+	if (conn->nopininterval != 0 &&
+	    (now - conn->last_activity) * 1000 >= conn->nopininterval) {
+		conn->last_activity = now;
+		if (istgt_iscsi_send_nopin(conn) < 0) {
+			ISTGT_ERRLOG("iscsi_send_nopin() failed\n");
+			goto close_conn;
+		}
+		if (istgt_iscsi_reactor_pump(conn) < 0)
+			goto close_conn;
+	}
+	return;
+
+close_conn:
+	istgt_iscsi_reactor_close(conn);
 }
 
+static int
+istgt_iscsi_reactor_attach(CONN_Ptr conn)
+{
+	ISTGT_REACTOR *r;
+	int flags;
+	int rc;
+
+	r = istgt_reactor_pick();
+	if (r == NULL)
+		return (-1);
+	flags = fcntl(conn->sock, F_GETFL, 0);
+	if (flags == -1 || fcntl(conn->sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		ISTGT_ERRLOG("fcntl() failed\n");
+		return (-1);
+	}
+
+	conn->pdu.ahs = NULL;
+	conn->pdu.data = NULL;
+	conn->state = CONN_STATE_RUNNING;
+	conn->exec_lu_task = NULL;
+	conn->wsock = conn->sock;
+	conn->epfd = -1;
+	conn->rx_state = ISTGT_RX_IDLE;
+	conn->last_activity = time(NULL);
+	snprintf(conn->thr, sizeof (conn->thr), "r#%d.%d.%d", r->id, conn->id, ntohs(conn->iport));
+	snprintf(conn->sthr, sizeof (conn->sthr), "%s", conn->thr);
+	conn->reactor = r;
+	ISTGT_NOTICELOG("con:%d/r%d [%x:%d->%s:%s,%d]",
+		conn->id, r->id, conn->iaddr, ntohs(conn->iport),
+		conn->portal.host, conn->portal.port, conn->portal.tag);
+
+	rc = istgt_reactor_add(r, &conn->sock_ev, conn->sock, EPOLLIN,
+		istgt_iscsi_reactor_sock, istgt_iscsi_reactor_tick, conn);
+	if (rc < 0) {
+		conn->reactor = NULL;
+		return (-1);
+	}
+	/* with the socket attached, the tick takes care of a failure here */
+	rc = istgt_reactor_add(r, &conn->task_ev, conn->task_efd, EPOLLIN,
+		istgt_iscsi_reactor_task, NULL, conn);
+	if (rc < 0)
+		conn->state = CONN_STATE_EXITING;
+	return (0);
+}
 
 static void *
 worker(void *arg)
 {
 	CONN_Ptr conn = (CONN_Ptr) arg;
-	ISTGT_LU_TASK_Ptr lu_task;
 	ISTGT_LU_Ptr lu;
-	ISCSI_PDU_Ptr pdu;
 	sigset_t signew, sigold;
 	int epfd;
 	struct epoll_event events;
@@ -5936,6 +8329,8 @@ worker(void *arg)
 #ifdef HAVE_PTHREAD_SET_NAME_NP
 	pthread_set_name_np(slf, tinfo);
 #endif
+	/* the LU isn't known before login, only the class list applies */
+	istgt_affinity_apply(ISTGT_AFF_CONN_WORKER, -1);
 	epfd = epoll_create1(0);
 	if (epfd == -1) {
 		ISTGT_ERRLOG("epoll_create1() failed\n");
@@ -5961,9 +8356,9 @@ worker(void *arg)
 		close(epfd);
 		return (NULL);
 	}
-	events.data.fd = conn->task_pipe[0];
+	events.data.fd = conn->task_efd;
 	events.events = EPOLLIN;
-	rc = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->task_pipe[0], &events);
+	rc = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->task_efd, &events);
 	if (rc == -1) {
 		ISTGT_ERRLOG("epoll_ctl() failed\n");
 		close(epfd);
@@ -6041,7 +8436,6 @@ worker(void *arg)
 	conn->pdu.data = NULL;
 	conn->state = CONN_STATE_RUNNING;
 	conn->exec_lu_task = NULL;
-	lu_task = NULL;
 
 //	pthread_cleanup_push(worker_cleanup, conn);
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
@@ -6105,6 +8499,9 @@ worker(void *arg)
 			break;
 		}
 		if (rc == 0) {
+			if (conn->timeout > 0 && conn->pending_r2t != 0 &&
+			    istgt_iscsi_transfer_stalled(conn, time(NULL)))
+				break;
 			/* idle timeout, send diagnosis packet */
 			if (conn->nopininterval != 0) {
 				rc = istgt_iscsi_send_nopin(conn);
@@ -6153,144 +8550,37 @@ worker(void *arg)
 				ISTGT_ERRLOG("iscsi_read_pdu() failed %d conn-state:%d\n", rc, conn->state);
 				break;
 			}
-		execute_pdu:
-			if (conn->state != CONN_STATE_RUNNING) {
-				break;
-			}
-
-			rc = istgt_iscsi_execute(conn, &conn->pdu);
+			rc = istgt_iscsi_execute_all(conn);
 			if (rc < 0) {
-				ISTGT_ERRLOG("iscsi_execute() failed on %s(%s)\n",
-					conn->target_port, conn->initiator_port);
 				break;
-			} else if (rc == 1) { // means successful logout ISCSI_OP_LOGOUT
-				ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "logout received\n");
-			}
-
-			if (conn->pdu.ahs != NULL) {
-				xfree(conn->pdu.ahs);
-				conn->pdu.ahs = NULL;
-			}
-			if (conn->pdu.data != NULL) {
-				xfree(conn->pdu.data);
-				conn->pdu.data = NULL;
 			}
-
-			/* execute pending PDUs */
-			pdu = istgt_queue_dequeue(&conn->pending_pdus);
-			if (pdu != NULL) {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-					"execute pending PDU\n");
-				istgt_iscsi_copy_pdu(&conn->pdu, pdu);
-				xfree(pdu);
-				goto execute_pdu;
-			}
-
 		}
 
 		/* execute on task queue */
-		if (events.data.fd == conn->task_pipe[0]) {
+		if (events.data.fd == conn->task_efd) {
 			if ((events.events & EPOLLERR) ||
 					(events.events & EPOLLHUP) ||
 					(!(events.events & EPOLLIN))) {
-				ISTGT_LOG("close pipe %d\n", errno);
+				ISTGT_LOG("close eventfd %d\n", errno);
 				break;
 			}
-			char tmp[1];
+			eventfd_t val;
 
-
-			rc = read(conn->task_pipe[0], tmp, 1);
-			if (rc < 0 || rc == 0 || rc != 1) {
-				ISTGT_ERRLOG("read() failed rc:%d (con:%d)\n", rc, conn->id);
+			rc = eventfd_read(conn->task_efd, &val);
+			if (rc != 0 && errno != EAGAIN) {
+				ISTGT_ERRLOG("eventfd_read() failed errno:%d (con:%d)\n",
+					errno, conn->id);
 				break;
 			}
-			if (tmp[0] == 'E') {
+			if (conn->task_exit) {
 				ISTGT_NOTICELOG("exit request (%d)\n", conn->id);
 				break;
 			}
 
-			/* DATA-IN/OUT */
-			MTX_LOCK(&conn->task_queue_mutex);
-			rc = istgt_queue_count(&conn->task_queue);
-			lu_task = istgt_queue_dequeue(&conn->task_queue);
-			MTX_UNLOCK(&conn->task_queue_mutex);
-			if (lu_task != NULL) {
-				if (conn->exec_lu_task != NULL) {
-					ISTGT_ERRLOG("task is overlapped (CSN=%x, %x)\n",
-						conn->exec_lu_task->lu_cmd.CmdSN,
-						lu_task->lu_cmd.CmdSN);
-					break;
-				}
-				conn->exec_lu_task = lu_task;
-				if (lu_task->lu_cmd.W_bit) {
-					/* write */
-					if (lu_task->req_transfer_out == 0) {
-						if (lu_task->req_execute) {
-							if (conn->running_tasks > 0) {
-								conn->running_tasks--;
-							} else {
-								ISTGT_ERRLOG("running no task\n");
-							}
-						}
-						rc = istgt_iscsi_task_response(conn, lu_task);
-						if (rc < 0) {
-							lu_task->error = 1;
-							ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
-								conn->target_port,
-								conn->initiator_port);
-							break;
-						}
-						lu_task = NULL;
-						conn->exec_lu_task = NULL;
-					} else {
-						rc = istgt_iscsi_transfer_out(conn, &(lu_task->lu_cmd),
-								lu_task->lu_cmd.transfer_len);
-						if (rc < 0) {
-							lu_task->error = 1;
-							ISTGT_ERRLOG("iscsi_task_transfer_out() failed on %s(%s)\n",
-								conn->target_port,
-								conn->initiator_port);
-							break;
-						}
-
-						MTX_LOCK(&lu_task->trans_mutex);
-						lu_task->req_transfer_out = 0;
-
-						/* need response after execution */
-						lu_task->req_execute = 1;
-
-						rc = pthread_cond_broadcast(&lu_task->trans_cond);
-						MTX_UNLOCK(&lu_task->trans_mutex);
-						if (rc != 0) {
-							ISTGT_ERRLOG("cond_broadcast() failed\n");
-							break;
-						}
-						lu_task = NULL;
-						conn->exec_lu_task = NULL;
-					}
-				} else {
-					/* read or no data */
-					rc = istgt_iscsi_task_response(conn, lu_task);
-					if (rc < 0) {
-						lu_task->error = 1;
-						ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
-							conn->target_port,
-							conn->initiator_port);
-						break;
-					}
-					lu_task = NULL;
-					conn->exec_lu_task = NULL;
-				}
-			}
-			/* XXX PDUs in DATA-OUT? */
-			pdu = istgt_queue_dequeue(&conn->pending_pdus);
-			if (pdu != NULL) {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-					"pending in task\n");
-				istgt_iscsi_copy_pdu(&conn->pdu, pdu);
-				xfree(pdu);
-				events.data.fd = -1;
-				goto execute_pdu;
+			/* DATA-IN/OUT, all of it queued since the last wakeup */
+			rc = istgt_iscsi_drain_tasks(conn);
+			if (rc < 0) {
+				break;
 			}
 		}
 	}
@@ -6299,65 +8589,7 @@ worker(void *arg)
 	cleanup_exit:
 ;
 //	pthread_cleanup_pop(0);
-	conn->state = CONN_STATE_EXITING;
-	if (conn->sess != NULL) {
-		lu = conn->sess->lu;
-		if (lu != NULL)
-			MTX_LOCK(&lu->mutex);
-		SESS_MTX_LOCK(conn);
-		rc = 0;
-		if (lu != NULL && lu->queue_depth != 0) {
-			rc = istgt_lu_clear_task_IT(conn, lu);
-			istgt_clear_all_transfer_task(conn);
-		}
-		SESS_MTX_UNLOCK(conn);
-		if (lu != NULL)
-			MTX_UNLOCK(&lu->mutex);
-		if (rc < 0) {
-			ISTGT_ERRLOG("lu_clear_task_IT() failed\n");
-		}
-	}
-	if (conn->pdu.ahs != NULL) {
-		xfree(conn->pdu.ahs);
-		conn->pdu.ahs = NULL;
-	}
-	if (conn->pdu.data != NULL) {
-		xfree(conn->pdu.data);
-		conn->pdu.data = NULL;
-	}
-	wait_all_task(conn);
-
-
-	if (1) {
-		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "stop sender thread (%d)\n", conn->id);
-		/* stop sender thread */
-		MTX_LOCK(&conn->result_queue_mutex);
-		rc = pthread_cond_broadcast(&conn->result_queue_cond);
-		MTX_UNLOCK(&conn->result_queue_mutex);
-		if (rc != 0) {
-			ISTGT_ERRLOG("cond_broadcast() failed\n");
-			/* ignore errors */
-		}
-		rc = pthread_join(conn->sender_thread, NULL);
-		if (rc != 0) {
-			ISTGT_ERRLOG("pthread_join() failed\n");
-			/* ignore errors */
-		}
-	}
-
-	close(conn->sock);
-	close(epfd);
-	conn->epfd = -1;
-	ISTGT_NOTICELOG("worker %d/%d/%d end (%s/%s)", conn->id, conn->epfd, ntohs(conn->iport), conn->thr, conn->sthr);
-
-	/* cleanup conn & sess */
-	while (conn->inflight != 0)
-		sleep(1);
-	sleep(5);
-	MTX_LOCK(&g_conns_mutex);
-	g_conns[conn->id] = NULL;
-	istgt_remove_conn(conn);
-	MTX_UNLOCK(&g_conns_mutex);
+	istgt_iscsi_conn_cleanup(conn);
 	return (NULL);
 }
 int
@@ -6423,13 +8655,13 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 	conn->inflight = 0;
 	conn->sender_waiting = 0;
 	istgt_queue_init(&conn->pending_pdus);
+	conn->r2t_slots = conn->max_r2t;
 	conn->r2t_tasks = xmalloc((sizeof (conn->r2t_tasks))
-		* (conn->max_r2t + 1));
-	for (i = 0; i < (conn->max_r2t + 1); i++) {
+		* (conn->r2t_slots + 1));
+	for (i = 0; i < (conn->r2t_slots + 1); i++) {
 		conn->r2t_tasks[i] = NULL;
 	}
-	conn->task_pipe[0] = -1;
-	conn->task_pipe[1] = -1;
+	conn->task_efd = -1;
 	conn->max_task_queue = MAX_LU_QUEUE_DEPTH;
 	istgt_queue_init(&conn->task_queue);
 	istgt_queue_init(&conn->result_queue);
@@ -6506,11 +8738,9 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 		goto error_return;
 	}
 
-	rc = pipe(conn->task_pipe);
-	if (rc != 0) {
-		ISTGT_ERRLOG("pipe() failed\n");
-		conn->task_pipe[0] = -1;
-		conn->task_pipe[1] = -1;
+	conn->task_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (conn->task_efd == -1) {
+		ISTGT_ERRLOG("eventfd() failed\n");
 		goto error_return;
 	}
 	rc = pthread_mutex_init(&conn->diskioflag_mutex, &istgt->mutex_attr);
@@ -6548,6 +8778,11 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 		ISTGT_ERRLOG("mutex_init() failed\n");
 		goto error_return;
 	}
+	rc = pthread_mutex_init(&conn->retain_mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("mutex_init() failed\n");
+		goto error_return;
+	}
 	rc = pthread_mutex_init(&conn->sender_mutex, NULL);
 	if (rc != 0) {
 		ISTGT_ERRLOG("mutex_init() failed\n");
@@ -6608,10 +8843,8 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 	if (rc < 0) {
 		ISTGT_ERRLOG("no free conn slot available\n");
 	error_return:
-		if (conn->task_pipe[0] != -1)
-			close(conn->task_pipe[0]);
-		if (conn->task_pipe[1] != -1)
-			close(conn->task_pipe[1]);
+		if (conn->task_efd != -1)
+			close(conn->task_efd);
 		istgt_iscsi_param_free(conn->params);
 		istgt_queue_destroy(&conn->pending_pdus);
 		istgt_queue_destroy(&conn->task_queue);
@@ -6625,6 +8858,19 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 		return (-1);
 	}
 
+	/* served by a reactor, no threads of its own */
+	if (istgt_reactor_count() > 0) {
+		rc = istgt_iscsi_reactor_attach(conn);
+		if (rc < 0) {
+			ISTGT_ERRLOG("reactor attach failed\n");
+			MTX_LOCK(&g_conns_mutex);
+			g_conns[conn->id] = NULL;
+			MTX_UNLOCK(&g_conns_mutex);
+			goto error_return;
+		}
+		return (0);
+	}
+
 	/* create new thread */
 	rc = pthread_create(&conn->thread, &istgt->attr, &worker, (void *)conn);
 	if (rc != 0) {
@@ -6672,10 +8918,10 @@ istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu)
 	if (sess->MaxOutstandingR2T < 1) {
 		sess->MaxOutstandingR2T = 1;
 	}
-	/* limit up to MaxOutstandingR2T */
-	if (sess->MaxOutstandingR2T < conn->max_r2t) {
-		conn->max_r2t = sess->MaxOutstandingR2T;
-	}
+	/*
+	 * MaxOutstandingR2T is per task, max_r2t is how many writes of the
+	 * connection may gather their data at once
+	 */
 #endif
 	if (lu != NULL) {
 		sess->DefaultTime2Wait = lu->DefaultTime2Wait;
@@ -6711,7 +8957,8 @@ istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu)
 	sess->target_name = xstrdup(conn->target_name);
 	sess->tag = conn->portal.tag;
 
-	sess->max_conns = sess->MaxConnections;
+	/* failed connections linger while their replacements log in */
+	sess->max_conns = 2 * sess->MaxConnections;
 	sess->conns = xmalloc(sizeof (*sess->conns) * sess->max_conns);
 	memset(sess->conns, 0, sizeof (*sess->conns) * sess->max_conns);
 	sess->connections = 0;
@@ -6719,7 +8966,7 @@ istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu)
 	sess->conns[sess->connections] = conn;
 	sess->connections++;
 
-	sess->req_mcs_cond = 0;
+	sess->cmdsn_wait = NULL;
 	sess->params = NULL;
 	sess->lu = NULL;
 	sess->isid = 0;
@@ -6745,6 +8992,12 @@ istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu)
 		ISTGT_ERRLOG("cond_init() failed\n");
 		goto error_return;
 	}
+	sess->order_q = NULL;
+	rc = pthread_mutex_init(&sess->order_mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("mutex_init() failed\n");
+		goto error_return;
+	}
 
 	/* set default params */
 	rc = istgt_iscsi_sess_params_init(&sess->params);
@@ -6858,10 +9111,21 @@ istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu)
 	return (0);
 }
 
+static int
+istgt_sess_match(CONN_Ptr conn, SESS_Ptr sess, uint64_t isid, uint16_t tsih)
+{
+	return (conn->portal.tag == sess->tag
+		&& strcasecmp(conn->initiator_port, sess->initiator_port) == 0
+		&& strcasecmp(conn->target_name, sess->target_name) == 0
+		&& (isid == sess->isid && tsih == sess->tsih));
+}
+
 static int
 istgt_append_sess(CONN_Ptr conn, uint64_t isid, uint16_t tsih, uint16_t cid)
 {
-	SESS_Ptr sess;
+	SESS_Ptr sess, prev;
+	CONN_Ptr xconn;
+	int running;
 	int rc;
 	int i;
 
@@ -6877,16 +9141,32 @@ istgt_append_sess(CONN_Ptr conn, uint64_t isid, uint16_t tsih, uint16_t cid)
 			continue;
 		sess = g_conns[i]->sess;
 		MTX_LOCK(&sess->mutex);
-		if (conn->portal.tag == sess->tag
-			&& strcasecmp(conn->initiator_port, sess->initiator_port) == 0
-			&& strcasecmp(conn->target_name, sess->target_name) == 0
-			&& (isid == sess->isid && tsih == sess->tsih)) {
+		if (istgt_sess_match(conn, sess, isid, tsih)) {
 			/* match tag and initiator port and target */
 			rc = 0;
 			break;
 		}
 		MTX_UNLOCK(&sess->mutex);
 	}
+	if (rc < 0) {
+		/* every connection failed, the session waits for one */
+		prev = NULL;
+		for (sess = g_failed_sess; sess != NULL; sess = sess->next_failed) {
+			if (istgt_sess_match(conn, sess, isid, tsih))
+				break;
+			prev = sess;
+		}
+		if (sess != NULL) {
+			if (prev != NULL)
+				prev->next_failed = sess->next_failed;
+			else
+				g_failed_sess = sess->next_failed;
+			sess->next_failed = NULL;
+			sess->retain_until = 0;
+			MTX_LOCK(&sess->mutex);
+			rc = 0;
+		}
+	}
 	if (rc < 0) {
 		/* no match */
 		MTX_UNLOCK(&g_conns_mutex);
@@ -6895,8 +9175,20 @@ istgt_append_sess(CONN_Ptr conn, uint64_t isid, uint16_t tsih, uint16_t cid)
 		return (-1);
 	}
 	/* sess is LOCK by loop */
+	running = 0;
+	for (i = 0; i < sess->connections; i++) {
+		xconn = sess->conns[i];
+		if (xconn->cid == cid && xconn->state == CONN_STATE_RUNNING) {
+			/* connection reinstatement, the old one goes */
+			ISTGT_WARNLOG("reinstating cid=%d of tsih=%d\n", cid, tsih);
+			xconn->no_recovery = (sess->ErrorRecoveryLevel < 2);
+			xconn->state = CONN_STATE_EXITING;
+		}
+		if (xconn->state == CONN_STATE_RUNNING)
+			running++;
+	}
 	if (sess->connections >= sess->max_conns
-		|| sess->connections >= sess->MaxConnections) {
+		|| running >= sess->MaxConnections) {
 		/* no slot for connection */
 		MTX_UNLOCK(&sess->mutex);
 		MTX_UNLOCK(&g_conns_mutex);
@@ -6918,10 +9210,19 @@ istgt_append_sess(CONN_Ptr conn, uint64_t isid, uint16_t tsih, uint16_t cid)
 static void
 istgt_free_sess(SESS_Ptr sess)
 {
+	ISTGT_CMDSN_WAIT *w;
+
 	if (sess == NULL)
 		return;
 	(void) pthread_mutex_destroy(&sess->mutex);
 	(void) pthread_cond_destroy(&sess->mcs_cond);
+	(void) pthread_mutex_destroy(&sess->order_mutex);
+	istgt_iscsi_retained_free_all(sess->orphans);
+	while (sess->cmdsn_wait != NULL) {
+		w = sess->cmdsn_wait;
+		sess->cmdsn_wait = w->next;
+		istgt_iscsi_cmdsn_wait_free(w);
+	}
 	istgt_iscsi_param_free(sess->params);
 	xfree(sess->initiator_port);
 	xfree(sess->target_name);
@@ -6934,12 +9235,9 @@ istgt_close_conn(CONN_Ptr conn)
 {
 	if (conn == NULL)
 		return;
-	if (conn->task_pipe[0] != -1)
-		close(conn->task_pipe[0]);
-	if (conn->task_pipe[1] != -1)
-		close(conn->task_pipe[1]);
-	conn->task_pipe[0] = -1;
-	conn->task_pipe[1] = -1;
+	if (conn->task_efd != -1)
+		close(conn->task_efd);
+	conn->task_efd = -1;
 	conn->closetime = time(NULL);
 }
 
@@ -6961,12 +9259,15 @@ istgt_free_conn(CONN_Ptr conn)
 	(void) pthread_mutex_destroy(&conn->wpdu_mutex);
 	(void) pthread_cond_destroy(&conn->wpdu_cond);
 	(void) pthread_mutex_destroy(&conn->r2t_mutex);
+	istgt_iscsi_retained_free_all(istgt_iscsi_retain_take(conn));
+	(void) pthread_mutex_destroy(&conn->retain_mutex);
 	(void) pthread_mutex_destroy(&conn->sender_mutex);
 	(void) pthread_cond_destroy(&conn->sender_cond);
 	istgt_iscsi_param_free(conn->params);
 	istgt_queue_destroy(&conn->pending_pdus);
 	istgt_queue_destroy(&conn->task_queue);
 	istgt_queue_destroy(&conn->result_queue);
+	istgt_lu_task_pool_release(conn->task_pool);
 	xfree(conn->r2t_tasks);
 	xfree(conn->portal.label);
 	xfree(conn->portal.host);
@@ -6983,17 +9284,110 @@ istgt_free_conn(CONN_Ptr conn)
 
 ISTGT_QUEUE closedconns;
 
+/* g_conns_mutex is held, the last connection of sess is gone */
+static void
+istgt_iscsi_end_sess(SESS_Ptr sess)
+{
+	ISTGT_LU_DISK *spec;
+	int rc;
+	int i;
+
+	if (sess->lu != NULL) {
+		spec = (ISTGT_LU_DISK *)sess->lu->lun[0].spec;
+		MTX_LOCK(&spec->pr_rsv_mutex);
+		if (spec->spc2_reserved == 1 && clear_resv == 1) {
+			if (strcmp(sess->initiator_port, spec->rsv_port) == 0) {
+				/* release reservation by key */
+				ISTGT_LOG("Clearing spc2 Reservations");
+				xfree(spec->rsv_port);
+				spec->rsv_port = NULL;
+				spec->rsv_key = 0;
+				spec->spc2_reserved = 0;
+				spec->rsv_scope = 0;
+				spec->rsv_type = 0;
+				/* remove registrations */
+				for (i = 0; i < spec->npr_keys; i++) {
+					if (spec->pr_keys[i].registered_initiator_port == sess->initiator_port) {
+						istgt_lu_disk_free_pr_key(&spec->pr_keys[i]);
+						memset(&spec->pr_keys[i], 0, sizeof (spec->pr_keys[i]));
+					}
+				}
+				istgt_lu_disk_pr_changed(spec);
+			}
+		}
+		MTX_UNLOCK(&spec->pr_rsv_mutex);
+	}
+	/* cleanup last connection */
+	istgt_lu_free_tsih(sess->lu, sess->tsih, sess->initiator_port);
+	rc = istgt_lu_remove_nexus(sess->lu, sess->initiator_port);
+	if (rc < 0) {
+		/* Ignore Error */
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "Failed to remove the Nexus\n");
+	}
+
+	istgt_free_sess(sess);
+}
+
+/* sessions kept for ErrorRecoveryLevel 2 nobody came back to in time */
+void
+istgt_iscsi_expire_sess(void)
+{
+	SESS_Ptr sess, prev, next;
+	time_t now;
+
+	now = time(NULL);
+	MTX_LOCK(&g_conns_mutex);
+	prev = NULL;
+	for (sess = g_failed_sess; sess != NULL; sess = next) {
+		next = sess->next_failed;
+		if (now < sess->retain_until) {
+			prev = sess;
+			continue;
+		}
+		if (prev != NULL)
+			prev->next_failed = next;
+		else
+			g_failed_sess = next;
+		ISTGT_NOTICELOG("session tsih:%d of %s not reinstated, ended",
+		    sess->tsih, sess->initiator_port);
+		istgt_iscsi_end_sess(sess);
+	}
+	MTX_UNLOCK(&g_conns_mutex);
+}
+
+/* g_conns_mutex is held, a new session of conn's initiator replaces them */
+static void
+istgt_iscsi_drop_failed_sess(CONN_Ptr conn)
+{
+	SESS_Ptr sess, prev, next;
+
+	prev = NULL;
+	for (sess = g_failed_sess; sess != NULL; sess = next) {
+		next = sess->next_failed;
+		if (strcasecmp(conn->initiator_port, sess->initiator_port) != 0
+		    || strcasecmp(conn->target_name, sess->target_name) != 0) {
+			prev = sess;
+			continue;
+		}
+		if (prev != NULL)
+			prev->next_failed = next;
+		else
+			g_failed_sess = next;
+		ISTGT_NOTICELOG("session tsih:%d of %s ended by a new one",
+		    sess->tsih, sess->initiator_port);
+		istgt_iscsi_end_sess(sess);
+	}
+}
+
 static void
 istgt_remove_conn(CONN_Ptr conn)
 {
 	SESS_Ptr sess;
 	int clear = 0;
-	ISTGT_LU_DISK *spec = NULL;
 	int idx;
 	int i, j;
 	int delayedFree = 0;
 	int sessConns = 0, ioPending = 0;
-	int rc = 0;
 	int lu_num;
 	uint16_t tsih;
 
@@ -7003,7 +9397,6 @@ istgt_remove_conn(CONN_Ptr conn)
 			conn->sess->lu->conns--;
 			MTX_UNLOCK(&conn->sess->lu->mutex);
 			clear = 1;
-			spec = (ISTGT_LU_DISK *)conn->sess->lu->lun[0].spec;
 		}
 	}
 
@@ -7044,38 +9437,19 @@ istgt_remove_conn(CONN_Ptr conn)
 	tsih = sess->tsih;
 
 	if (sessConns == 0) {
-		if (clear == 1) {
-			MTX_LOCK(&spec->pr_rsv_mutex);
-			if (spec->spc2_reserved == 1 && clear_resv == 1) {
-				if (strcmp(conn->initiator_port, spec->rsv_port) == 0) {
-					/* release reservation by key */
-					ISTGT_LOG("Clearing spc2 Reservations");
-					xfree(spec->rsv_port);
-					spec->rsv_port = NULL;
-					spec->rsv_key = 0;
-					spec->spc2_reserved = 0;
-					spec->rsv_scope = 0;
-					spec->rsv_type = 0;
-					/* remove registrations */
-					for (i = 0; i < spec->npr_keys; i++) {
-						if (spec->pr_keys[i].registered_initiator_port == conn->initiator_port) {
-							istgt_lu_disk_free_pr_key(&spec->pr_keys[i]);
-							memset(&spec->pr_keys[i], 0, sizeof (spec->pr_keys[i]));
-						}
-					}
-				}
-			}
-			MTX_UNLOCK(&spec->pr_rsv_mutex);
-		}
-		/* cleanup last connection */
-		istgt_lu_free_tsih(sess->lu, sess->tsih, conn->initiator_port);
-		rc = istgt_lu_remove_nexus(sess->lu, conn->initiator_port);
-		if (rc < 0) {
-			/* Ignore Error */
-			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "Failed to remove the Nexus\n");
+		if (clear == 1 && conn->error_recovery >= 2
+		    && conn->no_recovery == 0) {
+			/* the initiator may come back to reassign its tasks */
+			sess->retain_until = time(NULL) + sess->DefaultTime2Wait
+			    + sess->DefaultTime2Retain;
+			sess->next_failed = g_failed_sess;
+			g_failed_sess = sess;
+			ISTGT_NOTICELOG("session tsih:%d of %s kept for %d seconds",
+			    sess->tsih, sess->initiator_port,
+			    sess->DefaultTime2Wait + sess->DefaultTime2Retain);
+		} else {
+			istgt_iscsi_end_sess(sess);
 		}
-
-		istgt_free_sess(sess);
 	}
 	MTX_LOCK(&conn->diskioflag_mutex);
 	ioPending = conn->diskIoPending;
@@ -7135,6 +9509,7 @@ istgt_iscsi_drop_all_conns(CONN_Ptr conn)
 					xconn->initiator_addr,
 					xconn->cid);
 			}
+			xconn->no_recovery = 1;
 			xconn->state = CONN_STATE_EXITING;
 			num++;
 		}
@@ -7169,6 +9544,11 @@ istgt_iscsi_drop_all_conns(CONN_Ptr conn)
 						xconn->initiator_addr,
 						xconn->cid);
 				}
+				if (xconn->reactor != NULL) {
+					/* closed by its next tick */
+					xconn->state = CONN_STATE_EXITING;
+					continue;
+				}
 				rc = pthread_cancel(xconn->thread);
 				if (rc != 0) {
 					ISTGT_ERRLOG("pthread_cancel() failed rc=%d\n", rc);
@@ -7216,11 +9596,14 @@ istgt_iscsi_drop_old_conns(CONN_Ptr conn)
 					xconn->initiator_addr,
 					xconn->cid);
 			}
+			xconn->no_recovery = 1;
 			xconn->state = CONN_STATE_EXITING;
 			num++;
 		}
 	}
 
+	istgt_iscsi_drop_failed_sess(conn);
+
 	if (num != 0) {
 		istgt_yield();
 		sleep(1);
@@ -7250,6 +9633,11 @@ istgt_iscsi_drop_old_conns(CONN_Ptr conn)
 						xconn->initiator_addr,
 						xconn->cid);
 				}
+				if (xconn->reactor != NULL) {
+					/* closed by its next tick */
+					xconn->state = CONN_STATE_EXITING;
+					continue;
+				}
 				rc = pthread_cancel(xconn->thread);
 				if (rc != 0) {
 					ISTGT_ERRLOG("pthread_cancel() failed rc=%d\n", rc);
@@ -7375,22 +9763,16 @@ int
 istgt_stop_conns(void)
 {
 	CONN_Ptr conn;
-	char tmp[1];
-	int rc;
 	int i;
 
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "istgt_stop_conns\n");
-	tmp[0] = 'E';
 	MTX_LOCK(&g_conns_mutex);
 	for (i = 0; i <= g_max_connidx; i++) {
 		conn = g_conns[i];
 		if (conn == NULL)
 			continue;
-		rc = write(conn->task_pipe[1], tmp, 1);
-		if (rc < 0 || rc != 1) {
-			ISTGT_ERRLOG("write() failed\n");
-			/* ignore error */
-		}
+		/* ignore error */
+		(void) istgt_iscsi_task_exit(conn);
 	}
 	MTX_UNLOCK(&g_conns_mutex);
 	return (0);
@@ -7466,6 +9848,12 @@ istgt_iscsi_init(ISTGT_Ptr istgt)
 	bzero(g_conns, allocsize);
 	g_last_tsih = 0;
 
+	rc = istgt_reactor_start(istgt->conn_reactors, &istgt->attr);
+	if (rc < 0) {
+		ISTGT_ERRLOG("reactor_start() failed\n");
+		return (-1);
+	}
+
 	return (0);
 }
 
@@ -7513,6 +9901,8 @@ istgt_iscsi_shutdown(ISTGT_Ptr istgt __attribute__((__unused__)))
 		}
 	}
 
+	istgt_reactor_stop();
+
 	rc = pthread_mutex_destroy(&g_last_tsih_mutex);
 	if (rc != 0) {
 		ISTGT_ERRLOG("mutex_destroy() failed\n");
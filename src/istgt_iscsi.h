@@ -50,6 +50,7 @@
 #include "istgt_iscsi_param.h"
 #include "istgt_lu.h"
 #include "istgt_queue.h"
+#include "istgt_reactor.h"
 #include <sys/uio.h>
 /* Basic header segment length */
 #define	ISCSI_BHS_LEN	48
@@ -172,7 +173,9 @@ typedef struct iscsi_pdu_t {
 	size_t data_segment_len;
 	uint8_t opcode;
 	uint8_t scsi_op;
-	uint16_t dummy;
+	/* set by istgt_iscsi_pdu_verify() from ErrorRecoveryLevel 1 on */
+	uint8_t data_digest_error;
+	uint8_t dummy;
 	struct timespec start0;
 	struct timespec start;
 } ISCSI_PDU;
@@ -185,6 +188,21 @@ typedef enum {
 	CONN_STATE_SHUTDOWN	=	3,
 } CONN_STATE;
 
+/* PDU reader state of a reactor connection */
+typedef enum {
+	ISTGT_RX_IDLE	=	0,
+	ISTGT_RX_BHS	=	1,
+	ISTGT_RX_REST	=	2,
+} ISTGT_RX_STATE;
+
+/* serialized PDUs a reactor connection couldn't write yet */
+typedef struct istgt_send_chunk_t {
+	struct istgt_send_chunk_t *next;
+	size_t len;
+	size_t off;
+	uint8_t buf[];
+} ISTGT_SEND_CHUNK;
+
 typedef enum {
 	ISCSI_LOGIN_PHASE_NONE	=	0,
 	ISCSI_LOGIN_PHASE_START	=	1,
@@ -217,6 +235,25 @@ typedef struct istgt_chap_auth_t {
 	uint8_t chap_mchallenge[ISTGT_CHAP_CHALLENGE_LEN];
 } ISTGT_CHAP_AUTH;
 
+/* PR check verdicts cached per connection, power of 2 */
+#define	ISTGT_PR_VERDICTS	8
+
+/* R2Ts one task may have outstanding, MaxOutstandingR2T is capped to it */
+#define	ISTGT_R2T_BURSTS	8
+
+typedef struct istgt_r2t_burst_t {
+	uint32_t transfer_tag;
+	/* end of the burst, as an offset into the transfer */
+	uint32_t end;
+} ISTGT_R2T_BURST;
+
+/*
+ * A write gathering its DATA-OUT on the connection.  The command is kept
+ * here, with its PDU, and goes to the LU only once transfer_len bytes are
+ * in; the LU then never waits on the initiator.  Data before unsol_end is
+ * immediate or unsolicited, the rest comes in bursts asked for by R2T, of
+ * which up to nburst are outstanding.
+ */
 typedef struct istgt_r2t_task_t {
 	struct istgt_conn_t *conn;
 	ISTGT_LU_Ptr lu;
@@ -228,15 +265,103 @@ typedef struct istgt_r2t_task_t {
 
 	uint64_t iobufsize;
 	int iobufindx;
-	struct iovec iobuf[40];
+	int iobufcap;
+	struct iovec *iobuf;	/* iobuf_inl or heap, see ISTGT_SGL_INIT */
+	struct iovec iobuf_inl[ISTGT_SGL_INLINE];
 	//int iobufoff[20]; int iobufsize[20]; uint8_t *iobuf[20];
 	uint32_t R2TSN;
 	uint32_t DataSN;
 	int F_bit;
 	int offset;
+
+	uint32_t unsol_end;
+	/* requested so far, by R2T or as unsolicited data */
+	uint32_t r2t_offset;
+	int hburst;
+	int nburst;
+	ISTGT_R2T_BURST burst[ISTGT_R2T_BURSTS];
+	/* sequences to see end before asking again from recover_offset */
+	int recover;
+	uint32_t recover_offset;
+	/* no R2T until one of the max_r2t slots is free, reactor mode only */
+	int parked;
+	/* in sess->order_q; held: may not go to the LU yet, all data is in */
+	int in_order_q;
+	int held;
+	struct istgt_r2t_task_t *order_next;
+	time_t start;
+	ISCSI_PDU pdu;
+	ISTGT_LU_CMD lu_cmd;
 } ISTGT_R2T_TASK;
 typedef ISTGT_R2T_TASK *ISTGT_R2T_TASK_Ptr;
 
+/*
+ * From ErrorRecoveryLevel 1 on, the DATA-IN, R2T and SCSI Response PDUs
+ * of a task are kept until the initiator acknowledges its status, to be
+ * sent again on SNACK.  Only their BHSs are copied, by DataSN/R2TSN; the
+ * DATA-IN payload is the read data the task hands over once sent.  At
+ * level 2 the tasks of a failed connection go to the session, where
+ * TASK REASSIGN picks them up on another one.
+ */
+typedef struct istgt_retained_task_t {
+	/* by StatSN once it has its status, on the session when orphaned */
+	struct istgt_retained_task_t *next;
+	struct istgt_retained_task_t *prev;
+	/* same ITT hash bucket of the connection */
+	struct istgt_retained_task_t *hnext;
+	uint32_t task_tag;
+	int has_status;
+	uint32_t StatSN;
+	/* the DATA-IN that carried the status, -1 for the SCSI Response */
+	int status_pdu;
+	int datain;
+	/* some DATA-IN did not fit, only the status can be sent again */
+	int partial;
+	size_t bytes;
+	time_t orphaned;
+	/* DATA-IN and R2T, indexed by DataSN/R2TSN, opcode 0 for none */
+	ISCSI_BHS *pdus;
+	int npdus;
+	int maxpdus;
+	/* the read data from buf_off on */
+	uint8_t *buf;
+	uint32_t buf_off;
+	size_t buf_len;
+	ISCSI_BHS rsp;
+	uint8_t *rsp_data;
+	size_t rsp_len;
+} ISTGT_RETAINED_TASK;
+
+/* a copy of what a retained task sent, to be sent again */
+typedef struct istgt_retained_pdu_t {
+	struct istgt_retained_pdu_t *next;
+	/* DataSN or R2TSN, 0 for the SCSI Response */
+	uint32_t sn;
+	size_t data_len;
+	ISCSI_BHS bhs;
+	uint8_t data[];
+} ISTGT_RETAINED_PDU;
+
+#define	ISTGT_RETAIN_HASH	64
+
+/* commands discarded on a data digest error a session waits to be retried */
+#define	ISTGT_CMDSN_HOLES	8
+
+/*
+ * MC/S: a command that came ahead of its CmdSN on one connection waits
+ * in its session, sorted by CmdSN, until the commands before it came in
+ * on the others.  It is then run by the connection it came on.
+ */
+typedef struct istgt_cmdsn_wait_t {
+	struct istgt_cmdsn_wait_t *next;
+	struct istgt_conn_t *conn;
+	uint32_t CmdSN;
+	uint32_t task_tag;
+	/* aborted or its connection is gone, only the CmdSN is taken */
+	int aborted;
+	ISCSI_PDU pdu;
+} ISTGT_CMDSN_WAIT;
+
 typedef struct istgt_conn_t {
 	int id;
 
@@ -269,9 +394,14 @@ typedef struct istgt_conn_t {
 	int max_r2t;
 	int pending_r2t;
 	pthread_mutex_t r2t_mutex;
+	/* r2t_slots entries plus a NULL, parked writes may grow it */
+	int r2t_slots;
 	ISTGT_R2T_TASK_Ptr *r2t_tasks;
+	uint32_t r2t_ttt;
 
-	int task_pipe[2];
+	/* wakeups only, see istgt_iscsi_task_notify() */
+	int task_efd;
+	int task_exit;
 	int max_task_queue;
 	pthread_mutex_t task_queue_mutex;
 	ISTGT_QUEUE task_queue;
@@ -297,6 +427,8 @@ typedef struct istgt_conn_t {
 	char target_name[MAX_TARGET_NAME];
 	char initiator_port[MAX_INITIATOR_NAME];
 	char target_port[MAX_TARGET_NAME];
+	/* PR check verdicts by LUN, pr_epoch << 32 | allowed PR_ALLOW bits */
+	uint64_t pr_verdict[ISTGT_PR_VERDICTS];
 	uint8_t inn_len;
 	uint8_t inp_len;
 	uint8_t tn_len;
@@ -304,7 +436,10 @@ typedef struct istgt_conn_t {
 	/* for fast access */
 	int header_digest;
 	int data_digest;
+	int error_recovery;
 	int full_feature;
+	/* the session ends with this connection, nothing kept to reassign */
+	int no_recovery;
 
 	ISCSI_PARAM *params;
 	ISCSI_LOGIN_PHASE login_phase;
@@ -338,6 +473,44 @@ typedef struct istgt_conn_t {
 	time_t closetime;
 	int inflight;
 	int sender_waiting;
+
+	/* reactor mode, see istgt_iscsi_reactor_attach(); NULL with threads */
+	ISTGT_REACTOR *reactor;
+	ISTGT_REACTOR_EV sock_ev;
+	ISTGT_REACTOR_EV task_ev;
+	ISTGT_RX_STATE rx_state;
+	int rx_off;
+	int rx_left;
+	int rx_total;
+	struct iovec rx_iov[4];
+	time_t rx_start;
+	time_t last_activity;
+	int tasks_deferred;
+	int result_kick;
+	int reactor_closing;
+	ISTGT_SEND_CHUNK *sendq_head;
+	ISTGT_SEND_CHUNK *sendq_tail;
+	size_t sendq_bytes;
+	time_t sendq_stall;
+
+	/* task slots sized from the CmdSN window */
+	ISTGT_LU_TASK_POOL *task_pool;
+
+	/* ErrorRecoveryLevel >= 1, see istgt_iscsi_retain_pdu() */
+	pthread_mutex_t retain_mutex;
+	ISTGT_RETAINED_TASK *retain_hash[ISTGT_RETAIN_HASH];
+	int retained_tasks;
+	/* the tasks with their status, oldest StatSN first */
+	ISTGT_RETAINED_TASK *retained;
+	ISTGT_RETAINED_TASK *retained_tail;
+	size_t retained_bytes;
+	uint32_t retain_ack;
+
+	/* read without locks by istgt_metrics.c */
+	uint64_t rx_pdus;
+	uint64_t rx_bytes;
+	uint64_t tx_pdus;
+	uint64_t tx_bytes;
 } CONN;
 typedef CONN *CONN_Ptr;
 
@@ -348,7 +521,6 @@ typedef struct istgt_sess_t {
 
 	pthread_mutex_t mutex;
 	pthread_cond_t mcs_cond;
-	int req_mcs_cond;
 
 	char *initiator_port;
 	char *target_name;
@@ -378,6 +550,26 @@ typedef struct istgt_sess_t {
 	uint32_t ExpCmdSN;
 	uint32_t MaxCmdSN;
 	uint32_t MaxCmdSN_local;
+
+	int ncmdsn_holes;
+	uint32_t cmdsn_holes[ISTGT_CMDSN_HOLES];
+	/* MC/S, commands ahead of ExpCmdSN */
+	ISTGT_CMDSN_WAIT *cmdsn_wait;
+	/*
+	 * Writes gathering DATA-OUT, and the commands after them that may
+	 * not pass them, in CmdSN order; see istgt_iscsi_order_blocked()
+	 */
+	pthread_mutex_t order_mutex;
+	ISTGT_R2T_TASK_Ptr order_q;
+
+	/*
+	 * ErrorRecoveryLevel 2: tasks of failed connections, to reassign;
+	 * those without their status were still running and are refused
+	 */
+	ISTGT_RETAINED_TASK *orphans;
+	/* no connection left, kept until then for the initiator to return */
+	time_t retain_until;
+	struct istgt_sess_t *next_failed;
 } SESS;
 typedef SESS *SESS_Ptr;
 
@@ -385,5 +577,6 @@ int istgt_iscsi_send_async(CONN_Ptr conn);
 void istgt_free_conn(CONN_Ptr conn);
 void istgt_close_conn(CONN_Ptr conn);
 void istgt_lu_disk_free_pr_key(ISTGT_LU_PR_KEY *prkey);
+void istgt_lu_disk_pr_changed(ISTGT_LU_DISK *spec);
 
 #endif /* ISTGT_ISCSI_H */
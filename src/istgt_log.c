@@ -241,11 +241,15 @@ istgt_open_log(void)
 	} else {
 		openlog("istgt", LOG_PID, ISTGT_LOG_FACILITY);
 	}
+	if (istgt_alog_start() != 0)
+		fprintf(stderr, "failed to start logger thread, "
+		    "logging synchronously\n");
 }
 
 void
 istgt_close_log(void)
 {
+	istgt_alog_stop();
 	closelog();
 }
 
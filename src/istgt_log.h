@@ -47,6 +47,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <syslog.h>
+#include "istgt_alog.h"
 
 #if !defined(__GNUC__)
 #undef __attribute__
@@ -85,30 +86,31 @@ extern __thread char tinfo[50];
 
 #define	ISTGT_TRACELOG(FLAG, fmt, ...)					\
 	do {								\
+		static istgt_log_site_t _site;				\
 		if (g_trace_flag & FLAG)				\
-			fprintf(stderr, "%-18.18s:%4d: %-20.20s: " fmt,	\
-				__func__, __LINE__, tinfo, ##__VA_ARGS__); \
+			istgt_alog(&_site, ISTGT_ALOG_STDERR, LOG_DEBUG,\
+			    "%-18.18s:%4d: %-20.20s: " fmt,		\
+			    __func__, __LINE__, tinfo, ##__VA_ARGS__);	\
 	} while (0)
 /* REPLICATION */
 #else
-#define	ISTGT_LOG(fmt, ...) syslog(LOG_NOTICE, 	 \
-	"%-18.18s:%4d: %-20.20s: " \
-	fmt, __func__, __LINE__, tinfo, ##__VA_ARGS__)
-#define	ISTGT_NOTICELOG(fmt, ...) syslog(LOG_NOTICE, \
-	"%-18.18s:%4d: %-20.20s: " \
-	fmt, __func__, __LINE__, tinfo, ##__VA_ARGS__)
-#define	ISTGT_ERRLOG(fmt, ...) syslog(LOG_ERR,  	 \
-	"%-18.18s:%4d: %-20.20s: " \
-	fmt, __func__, __LINE__, tinfo, ##__VA_ARGS__)
-#define	ISTGT_WARNLOG(fmt, ...) syslog(LOG_ERR, 	 \
-	"%-18.18s:%4d: %-20.20s: " \
-	fmt, __func__, __LINE__, tinfo, ##__VA_ARGS__)
-
-#define	ISTGT_TRACELOG(FLAG, fmt, ...)  \
+#define	ISTGT_SYSLOG(prio, fmt, ...)					\
 	do {								\
-		if (g_trace_flag & FLAG)		\
-			syslog(LOG_NOTICE, "%-18.18s:%4d: %-20.20s: " \
-			fmt, __func__, __LINE__, tinfo, ##__VA_ARGS__); \
+		static istgt_log_site_t _site;				\
+		istgt_alog(&_site, ISTGT_ALOG_SYSLOG, prio,		\
+		    "%-18.18s:%4d: %-20.20s: " fmt,			\
+		    __func__, __LINE__, tinfo, ##__VA_ARGS__);		\
+	} while (0)
+
+#define	ISTGT_LOG(fmt, ...)	ISTGT_SYSLOG(LOG_NOTICE, fmt, ##__VA_ARGS__)
+#define	ISTGT_NOTICELOG(fmt, ...) ISTGT_SYSLOG(LOG_NOTICE, fmt, ##__VA_ARGS__)
+#define	ISTGT_ERRLOG(fmt, ...)	ISTGT_SYSLOG(LOG_ERR, fmt, ##__VA_ARGS__)
+#define	ISTGT_WARNLOG(fmt, ...)	ISTGT_SYSLOG(LOG_ERR, fmt, ##__VA_ARGS__)
+
+#define	ISTGT_TRACELOG(FLAG, fmt, ...)					\
+	do {								\
+		if (g_trace_flag & FLAG)				\
+			ISTGT_SYSLOG(LOG_NOTICE, fmt, ##__VA_ARGS__);	\
 	} while (0)
 #endif
 
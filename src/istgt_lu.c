@@ -89,6 +89,7 @@
 #include "istgt_lu.h"
 #include "istgt_proto.h"
 #include "istgt_scsi.h"
+#include "istgt_affinity.h"
 
 #define	MAX_MASKBUF 128
 
@@ -433,6 +434,7 @@ istgt_lu_sendtargets(CONN_Ptr conn, const char *iiqn, const char *iaddr, const c
 	int rc;
 	int pg_tag;
 	int i, j, k, l;
+	int lo, hi;
 
 	if (conn == NULL)
 		return (0);
@@ -453,8 +455,10 @@ istgt_lu_sendtargets(CONN_Ptr conn, const char *iiqn, const char *iaddr, const c
 		return (total);
 	}
 
+	istgt_lu_slot_range(istgt,
+	    (strcasecmp(tiqn, "ALL") == 0) ? NULL : tiqn, &lo, &hi);
 	MTX_LOCK(&istgt->mutex);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+	for (i = lo; i < hi; i++) {
 		lu = istgt->logical_unit[i];
 		if (lu == NULL)
 			continue;
@@ -557,22 +561,67 @@ istgt_lu_sendtargets(CONN_Ptr conn, const char *iiqn, const char *iaddr, const c
 	return (total);
 }
 
+/*
+ * All changes of logical_unit[] go through here so that the name indexes
+ * used by the lookups below stay in step with it.
+ */
+static void
+istgt_lu_set_slot(ISTGT_Ptr istgt, int num, ISTGT_LU_Ptr lu)
+{
+	ISTGT_LU_Ptr old;
+
+	MTX_LOCK(&istgt->lu_idx_mutex);
+	old = istgt->logical_unit[num];
+	if (old != NULL) {
+		(void) istgt_nidx_del(&istgt->lu_name_idx, old->name, old);
+		(void) istgt_nidx_del(&istgt->lu_volname_idx, old->volname,
+		    old);
+	}
+	istgt->logical_unit[num] = lu;
+	if (lu != NULL) {
+		if (istgt_nidx_add(&istgt->lu_name_idx, lu->name, lu) < 0 ||
+		    istgt_nidx_add(&istgt->lu_volname_idx, lu->volname,
+		    lu) < 0)
+			ISTGT_ERRLOG("LU%d: failed to index %s\n", num,
+			    lu->name);
+	}
+	MTX_UNLOCK(&istgt->lu_idx_mutex);
+}
+
+/*
+ * Slots that may hold target_name: just its own if it exists, all of them
+ * for NULL.
+ */
+void
+istgt_lu_slot_range(ISTGT_Ptr istgt, const char *target_name, int *lo,
+    int *hi)
+{
+	ISTGT_LU_Ptr lu;
+
+	if (target_name == NULL) {
+		*lo = 0;
+		*hi = MAX_LOGICAL_UNIT;
+		return;
+	}
+	MTX_LOCK(&istgt->lu_idx_mutex);
+	lu = istgt_nidx_find(&istgt->lu_name_idx, target_name);
+	*lo = (lu != NULL) ? lu->num : 0;
+	*hi = (lu != NULL) ? lu->num + 1 : 0;
+	MTX_UNLOCK(&istgt->lu_idx_mutex);
+}
+
 ISTGT_LU_Ptr
 istgt_lu_find_target_by_volname(ISTGT_Ptr istgt, const char *volname)
 {
 	ISTGT_LU_Ptr lu;
-	int i;
 
 	if (istgt == NULL || volname == NULL)
 		return (NULL);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
-		lu = istgt->logical_unit[i];
-		if (lu == NULL)
-			continue;
-		if (strcasecmp(volname, lu->volname) == 0) {
-			return (lu);
-		}
-	}
+	MTX_LOCK(&istgt->lu_idx_mutex);
+	lu = istgt_nidx_find(&istgt->lu_volname_idx, volname);
+	MTX_UNLOCK(&istgt->lu_idx_mutex);
+	if (lu != NULL)
+		return (lu);
 	ISTGT_WARNLOG("can't find target %s\n",
 	    volname);
 	return (NULL);
@@ -582,18 +631,14 @@ ISTGT_LU_Ptr
 istgt_lu_find_target(ISTGT_Ptr istgt, const char *target_name)
 {
 	ISTGT_LU_Ptr lu;
-	int i;
 
 	if (istgt == NULL || target_name == NULL)
 		return (NULL);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
-		lu = istgt->logical_unit[i];
-		if (lu == NULL)
-			continue;
-		if (strcasecmp(target_name, lu->name) == 0) {
-			return (lu);
-		}
-	}
+	MTX_LOCK(&istgt->lu_idx_mutex);
+	lu = istgt_nidx_find(&istgt->lu_name_idx, target_name);
+	MTX_UNLOCK(&istgt->lu_idx_mutex);
+	if (lu != NULL)
+		return (lu);
 	ISTGT_WARNLOG("can't find target %s\n",
 	    target_name);
 	return (NULL);
@@ -1354,21 +1399,9 @@ istgt_lu_set_local_settings(ISTGT_Ptr istgt, CF_SECTION *sp, ISTGT_LU_Ptr lu)
 		} else if (lu->ErrorRecoveryLevel == 0) {
 			lu->ErrorRecoveryLevel = 0;
 		} else if (lu->ErrorRecoveryLevel == 1) {
-#if 0
 			lu->ErrorRecoveryLevel = 1;
-#else
-			ISTGT_ERRLOG("not supported value %d\n",
-			    lu->ErrorRecoveryLevel);
-			return (-1);
-#endif
 		} else if (lu->ErrorRecoveryLevel == 2) {
-#if 0
 			lu->ErrorRecoveryLevel = 2;
-#else
-			ISTGT_ERRLOG("not supported value %d\n",
-			    lu->ErrorRecoveryLevel);
-			return (-1);
-#endif
 		} else {
 			ISTGT_ERRLOG("not supported value %d\n",
 			    lu->ErrorRecoveryLevel);
@@ -1412,6 +1445,143 @@ static void set_queue_depth(CF_SECTION *sp, ISTGT_LU_Ptr lu)
 	}
 }
 
+static void set_write_coalesce(CF_SECTION *sp, ISTGT_LU_Ptr lu)
+{
+	const char* val = getenv("WriteCoalesceWindow");
+	if (val)
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "setting write coalesce window from env to %s\n", val);
+	else
+		val = istgt_get_val(sp, "WriteCoalesceWindow");
+
+	/* usec, 0 disables coalescing */
+	lu->wc_window_us = 0;
+	if (val != NULL)
+		lu->wc_window_us = (int) strtol(val, NULL, 10);
+	if (lu->wc_window_us < 0 || lu->wc_window_us > MAX_LU_WC_WINDOW_US) {
+		ISTGT_ERRLOG("LU%d: write coalesce window %d is not in range, resetting to %d\n", lu->num, lu->wc_window_us, 0);
+		lu->wc_window_us = 0;
+	}
+
+	val = getenv("WriteCoalesceMax");
+	if (val)
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "setting write coalesce max from env to %s\n", val);
+	else
+		val = istgt_get_val(sp, "WriteCoalesceMax");
+
+	lu->wc_max_bytes = DEFAULT_LU_WC_MAX_BYTES;
+	if (val != NULL)
+		lu->wc_max_bytes = (int) strtol(val, NULL, 10) * 1024;
+	if (lu->wc_max_bytes <= 0 || lu->wc_max_bytes > MAX_LU_WC_MAX_BYTES) {
+		ISTGT_ERRLOG("LU%d: write coalesce max %d is not in range, resetting to %d\n", lu->num, lu->wc_max_bytes, DEFAULT_LU_WC_MAX_BYTES);
+		lu->wc_max_bytes = DEFAULT_LU_WC_MAX_BYTES;
+	}
+}
+
+static void set_read_cache(CF_SECTION *sp, ISTGT_LU_Ptr lu)
+{
+	const char* val = getenv("ReadCacheSize");
+	if (val)
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "setting read cache size from env to %s\n", val);
+	else
+		val = istgt_get_val(sp, "ReadCacheSize");
+
+	/* MB, 0 disables the cache */
+	lu->rcache_mb = 0;
+	if (val != NULL)
+		lu->rcache_mb = (int) strtol(val, NULL, 10);
+	if (lu->rcache_mb < 0 || lu->rcache_mb > MAX_LU_RCACHE_MB) {
+		ISTGT_ERRLOG("LU%d: read cache size %d is not in range, resetting to %d\n", lu->num, lu->rcache_mb, 0);
+		lu->rcache_mb = 0;
+	}
+}
+
+static const char *get_env_or_val(CF_SECTION *sp, const char *key)
+{
+	const char* val = getenv(key);
+	if (val)
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "setting %s from env to %s\n", key, val);
+	else
+		val = istgt_get_val(sp, key);
+	return val;
+}
+
+static void set_qos(CF_SECTION *sp, ISTGT_LU_Ptr lu)
+{
+	const char* val;
+	int burst_ms;
+
+	/* IOPS and KB/s, 0 means unlimited */
+	memset(&lu->qos_lu, 0, sizeof lu->qos_lu);
+	memset(&lu->qos_initiator, 0, sizeof lu->qos_initiator);
+	if ((val = get_env_or_val(sp, "QoSIOPS")) != NULL)
+		lu->qos_lu.iops = strtoull(val, NULL, 10);
+	if ((val = get_env_or_val(sp, "QoSBandwidth")) != NULL)
+		lu->qos_lu.bps = strtoull(val, NULL, 10) * 1024;
+	if ((val = get_env_or_val(sp, "QoSInitiatorIOPS")) != NULL)
+		lu->qos_initiator.iops = strtoull(val, NULL, 10);
+	if ((val = get_env_or_val(sp, "QoSInitiatorBandwidth")) != NULL)
+		lu->qos_initiator.bps = strtoull(val, NULL, 10) * 1024;
+
+	burst_ms = DEFAULT_LU_QOS_BURST_MS;
+	if ((val = get_env_or_val(sp, "QoSBurst")) != NULL)
+		burst_ms = (int) strtol(val, NULL, 10);
+	if (burst_ms <= 0 || burst_ms > MAX_LU_QOS_BURST_MS) {
+		ISTGT_ERRLOG("LU%d: QoS burst %d is not in range, resetting to %d\n", lu->num, burst_ms, DEFAULT_LU_QOS_BURST_MS);
+		burst_ms = DEFAULT_LU_QOS_BURST_MS;
+	}
+	lu->qos_lu.burst_ms = burst_ms;
+	lu->qos_initiator.burst_ms = burst_ms;
+}
+
+static void set_numa_node(CF_SECTION *sp, ISTGT_LU_Ptr lu)
+{
+	lu->numa_node = istgt_affinity_lu_node(lu->num,
+	    get_env_or_val(sp, "NumaNode"));
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: numa node %d\n", lu->num,
+	    lu->numa_node);
+}
+
+#ifdef REPLICATION
+static void set_replica_dconns(CF_SECTION *sp, ISTGT_LU_Ptr lu)
+{
+	const char* val;
+
+	/* replicas that don't take more connections stay at one */
+	lu->replica_dconns = 1;
+	if ((val = get_env_or_val(sp, "ReplicaDataConns")) != NULL)
+		lu->replica_dconns = (int) strtol(val, NULL, 10);
+	if (lu->replica_dconns < 1 || lu->replica_dconns > MAX_LU_REPLICA_DCONNS) {
+		ISTGT_ERRLOG("LU%d: replica data connections %d is not in range, resetting to %d\n", lu->num, lu->replica_dconns, 1);
+		lu->replica_dconns = 1;
+	}
+
+	lu->replica_dconn_policy = ISTGT_DCONN_LBA;
+	val = get_env_or_val(sp, "ReplicaDataConnPolicy");
+	if (val == NULL || strcasecmp(val, "LBA") == 0) {
+		lu->replica_dconn_policy = ISTGT_DCONN_LBA;
+	} else if (strcasecmp(val, "RoundRobin") == 0) {
+		lu->replica_dconn_policy = ISTGT_DCONN_RR;
+	} else {
+		ISTGT_ERRLOG("LU%d: unknown replica data connection policy %s, using LBA\n", lu->num, val);
+	}
+
+	lu->replica_status_push = 0;
+	val = get_env_or_val(sp, "ReplicaStatusPush");
+	if (val != NULL && strcasecmp(val, "Yes") == 0)
+		lu->replica_status_push = 1;
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: replica status push %s\n",
+	    lu->num, lu->replica_status_push ? "Yes" : "No");
+
+	/* only for replicas that know PR_UPDATE and PR_READ */
+	lu->replica_pr_persist = 0;
+	val = get_env_or_val(sp, "ReplicaPersistPR");
+	if (val != NULL && strcasecmp(val, "Yes") == 0)
+		lu->replica_pr_persist = 1;
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: replica PR persist %s\n",
+	    lu->num, lu->replica_pr_persist ? "Yes" : "No");
+}
+#endif
+
 static void set_luworkers(CF_SECTION *sp, ISTGT_LU_Ptr lu)
 {
 	const char* val = getenv("Luworkers");
@@ -1946,6 +2116,13 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 		lu->blocklen, lu->recordsize, lu->queue_depth);
 
 	set_luworkers(sp, lu);
+	set_write_coalesce(sp, lu);
+	set_read_cache(sp, lu);
+	set_qos(sp, lu);
+	set_numa_node(sp, lu);
+#ifdef REPLICATION
+	set_replica_dconns(sp, lu);
+#endif
 
 	lu->maxlun = 0;
 	for (i = 0; i < MAX_LU_LUN; i++) {
@@ -1960,6 +2137,8 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 		lu->lun[i].xcopy = 0;
 		lu->lun[i].wsame = 0;
 		lu->lun[i].dpofua = 0;
+		lu->lun[i].uring = 0;
+		lu->lun[i].directio = 0;
 		lu->lun[i].serial = NULL;
 		lu->lun[i].spec = NULL;
 		lu->lun[i].opt_tlen = 1;
@@ -2194,6 +2373,24 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
 						    lu->num, i, val);
 					}
+				} else if (strcasecmp(key, "IOEngine") == 0) {
+					if (strcasecmp(val, "uring") == 0) {
+						lu->lun[i].uring = 1;
+					} else if (strcasecmp(val, "sync") == 0) {
+						lu->lun[i].uring = 0;
+					} else {
+						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
+						    lu->num, i, val);
+					}
+				} else if (strcasecmp(key, "DirectIO") == 0) {
+					if (strcasecmp(val, "Enable") == 0) {
+						lu->lun[i].directio = 1;
+					} else if (strcasecmp(val, "Disable") == 0) {
+						lu->lun[i].directio = 0;
+					} else {
+						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
+						    lu->num, i, val);
+					}
 				} else if (strcasecmp(key, "Unmap") == 0) {
 					if (strcasecmp(val, "Enable") == 0) {
 						lu->lun[i].unmap = 1;
@@ -2327,7 +2524,7 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 
 	MTX_LOCK(&istgt->mutex);
 	istgt->nlogical_unit++;
-	istgt->logical_unit[lu->num] = lu;
+	istgt_lu_set_slot(istgt, lu->num, lu);
 	MTX_UNLOCK(&istgt->mutex);
 	return (0);
 
@@ -2765,6 +2962,29 @@ istgt_lu_update_unit(ISTGT_LU_Ptr lu, CF_SECTION *sp)
 						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
 						    lu->num, i, val);
 					}
+				} else if (strcasecmp(key, "IOEngine") == 0) {
+					/* takes effect when the storage is reopened */
+					if (strcasecmp(val, "uring") == 0) {
+						lu->lun[i].uring = 1;
+						spec->uring = 1;
+					} else if (strcasecmp(val, "sync") == 0) {
+						lu->lun[i].uring = 0;
+						spec->uring = 0;
+					} else {
+						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
+						    lu->num, i, val);
+					}
+				} else if (strcasecmp(key, "DirectIO") == 0) {
+					if (strcasecmp(val, "Enable") == 0) {
+						lu->lun[i].directio = 1;
+						spec->directio = 1;
+					} else if (strcasecmp(val, "Disable") == 0) {
+						lu->lun[i].directio = 0;
+						spec->directio = 0;
+					} else {
+						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
+						    lu->num, i, val);
+					}
 				} else if (strcasecmp(key, "Unmap") == 0) {
 					if (strcasecmp(val, "Enable") == 0) {
 						if (!spec->unmap)
@@ -2979,7 +3199,7 @@ istgt_lu_del_unit(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 
 	// MTX_LOCK(&istgt->mutex);
 	istgt->nlogical_unit--;
-	istgt->logical_unit[lu->num] = NULL;
+	istgt_lu_set_slot(istgt, lu->num, NULL);
 	// MTX_UNLOCK(&istgt->mutex);
 
 	xfree(lu->name);
@@ -3107,6 +3327,17 @@ istgt_lu_init(ISTGT_Ptr istgt)
 		return (-1);
 	}
 
+	rc = pthread_mutex_init(&istgt->lu_idx_mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("mutex_init() failed\n");
+		return (-1);
+	}
+	if (istgt_nidx_init(&istgt->lu_name_idx, MAX_LOGICAL_UNIT) < 0 ||
+	    istgt_nidx_init(&istgt->lu_volname_idx, MAX_LOGICAL_UNIT) < 0) {
+		ISTGT_ERRLOG("nidx_init() failed\n");
+		return (-1);
+	}
+
 	sp = istgt->config->section;
 	while (sp != NULL) {
 		if (sp->type == ST_LOGICAL_UNIT) {
@@ -3209,8 +3440,8 @@ retry:
 				/* ignore error */
 			}
 			ISTGT_NOTICELOG("delete LU%d: Name=%s\n", lu->num, lu->name);
+			istgt_lu_set_slot(istgt, i, NULL);
 			xfree(lu);
-			istgt->logical_unit[i] = NULL;
 		}
 	}
 	MTX_UNLOCK(&istgt->mutex);
@@ -3366,7 +3597,7 @@ istgt_lu_reload_update(ISTGT_Ptr istgt)
 						MTX_UNLOCK(&spec->complete_queue_mutex);
 						goto skip_lu;
 					} else {
-						istgt->logical_unit[sp->num] = NULL;
+						istgt_lu_set_slot(istgt, sp->num, NULL);
 						MTX_UNLOCK(&lu->mutex);
 						MTX_UNLOCK(&istgt->mutex);
 
@@ -3375,7 +3606,7 @@ istgt_lu_reload_update(ISTGT_Ptr istgt)
 						if (rc < 0) {
 							ISTGT_ERRLOG("lu_add_unit() failed\n");
 							MTX_LOCK(&istgt->mutex);
-							istgt->logical_unit[sp->num] = lu;
+							istgt_lu_set_slot(istgt, sp->num, lu);
 							MTX_UNLOCK(&istgt->mutex);
 							goto skip_lu;
 						} else {
@@ -3394,7 +3625,7 @@ istgt_lu_reload_update(ISTGT_Ptr istgt)
 								/* ignore error */
 							}
 							xfree(lu_old);
-							istgt->logical_unit[sp->num] = lu;
+							istgt_lu_set_slot(istgt, sp->num, lu);
 							MTX_UNLOCK(&istgt->mutex);
 						}
 						MTX_LOCK(&istgt->mutex);
@@ -3447,8 +3678,8 @@ istgt_lu_reload_update(ISTGT_Ptr istgt)
 			/* ignore error */
 		}
 		ISTGT_NOTICELOG("delete LU%d: Name=%s\n", lu->num, lu->name);
+		istgt_lu_set_slot(istgt, sp->num, NULL);
 		xfree(lu);
-		istgt->logical_unit[sp->num] = NULL;
 		MTX_UNLOCK(&istgt->mutex);
 
 	skip_lu:
@@ -3644,11 +3875,13 @@ istgt_lu_shutdown(ISTGT_Ptr istgt)
 			ISTGT_ERRLOG("LU%d: lu_shutdown_unit() failed\n", lu->num);
 			/* ignore error */
 		}
+		istgt_lu_set_slot(istgt, i, NULL);
 		xfree(lu);
-		istgt->logical_unit[i] = NULL;
 	}
 	MTX_UNLOCK(&istgt->mutex);
 
+	istgt_nidx_fini(&istgt->lu_name_idx);
+	istgt_nidx_fini(&istgt->lu_volname_idx);
 	return (0);
 }
 
@@ -3775,6 +4008,113 @@ istgt_lu_reset_all(ISTGT_Ptr istgt, istgt_ua_type ua_type)
 	return ((ret < 0) ? ret : cleared);
 }
 
+/*
+ * Tasks of a connection come from a pool sized from its CmdSN window: each
+ * command holds a task on the LU and one for its response queued to the
+ * sender, and both are the same ISTGT_LU_TASK with its PDU behind it.
+ * Slots are taken by the receiving side and given back by the sender and
+ * the LU workers, under the pool's mutex.  When the pool runs dry tasks
+ * are xmalloc()ed as before.  The pool goes away once the connection has
+ * released it and the last task is back.
+ */
+#define	ISTGT_LU_TASK_SLOT_LEN						\
+	(ISCSI_ALIGN(sizeof (ISTGT_LU_TASK)) + ISCSI_ALIGN(sizeof (ISCSI_PDU)))
+
+ISTGT_LU_TASK_POOL *
+istgt_lu_task_pool_create(int nslots)
+{
+	ISTGT_LU_TASK_POOL *pool;
+	int i;
+
+	pool = xmalloc(sizeof (*pool));
+	memset(pool, 0, sizeof (*pool));
+	pool->slot_len = ISTGT_LU_TASK_SLOT_LEN;
+	pool->slab = xmalloc(pool->slot_len * nslots);
+	pool->free = xmalloc(sizeof (*pool->free) * nslots);
+	for (i = 0; i < nslots; i++)
+		pool->free[i] = pool->slab + pool->slot_len * (nslots - 1 - i);
+	pool->nslots = pool->nfree = nslots;
+	pool->refs = 1;
+	if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+		ISTGT_ERRLOG("mutex_init() failed\n");
+		xfree(pool->free);
+		xfree(pool->slab);
+		xfree(pool);
+		return (NULL);
+	}
+	return (pool);
+}
+
+static void
+istgt_lu_task_pool_unref(ISTGT_LU_TASK_POOL *pool)
+{
+	int refs;
+
+	MTX_LOCK(&pool->mutex);
+	refs = --pool->refs;
+	MTX_UNLOCK(&pool->mutex);
+	if (refs != 0)
+		return;
+	(void) pthread_mutex_destroy(&pool->mutex);
+	xfree(pool->free);
+	xfree(pool->slab);
+	xfree(pool);
+}
+
+void
+istgt_lu_task_pool_release(ISTGT_LU_TASK_POOL *pool)
+{
+	if (pool != NULL)
+		istgt_lu_task_pool_unref(pool);
+}
+
+ISTGT_LU_TASK_Ptr
+istgt_lu_task_get(CONN_Ptr conn, int clear)
+{
+	ISTGT_LU_TASK_POOL *pool = conn->task_pool;
+	ISTGT_LU_TASK_Ptr lu_task = NULL;
+
+	if (pool != NULL) {
+		MTX_LOCK(&pool->mutex);
+		if (pool->nfree > 0)
+			lu_task = pool->free[--pool->nfree];
+		else
+			pool->misses++;
+		pool->refs++;
+		if (++pool->inuse > pool->hiwat)
+			pool->hiwat = pool->inuse;
+		MTX_UNLOCK(&pool->mutex);
+	}
+	if (lu_task == NULL)
+		lu_task = xmalloc(ISTGT_LU_TASK_SLOT_LEN);
+	if (clear)
+		memset(lu_task, 0, ISTGT_LU_TASK_SLOT_LEN);
+	lu_task->pool = pool;
+	return (lu_task);
+}
+
+void
+istgt_lu_task_put(ISTGT_LU_TASK_Ptr lu_task)
+{
+	ISTGT_LU_TASK_POOL *pool = lu_task->pool;
+	uint8_t *slot = (uint8_t *)lu_task;
+
+	if (pool == NULL) {
+		xfree(lu_task);
+		return;
+	}
+	MTX_LOCK(&pool->mutex);
+	pool->inuse--;
+	if (slot >= pool->slab &&
+	    slot < pool->slab + pool->slot_len * pool->nslots) {
+		pool->free[pool->nfree++] = slot;
+		slot = NULL;
+	}
+	MTX_UNLOCK(&pool->mutex);
+	if (slot != NULL)
+		xfree(slot);
+	istgt_lu_task_pool_unref(pool);
+}
 
 ISTGT_LU_TASK_Ptr
 istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int lun, ISTGT_LU_DISK *spec)
@@ -3782,7 +4122,7 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int lun, ISTGT_LU_D
 	ISTGT_LU_TASK_Ptr lu_task = NULL;
 	ISCSI_PDU_Ptr dst_pdu, src_pdu;
 	uint8_t *cdb;
-	int alloc_len, i, gotlba = 0;
+	int i, gotlba = 0;
 	int pbdata, lbdata, anchor;
 	int64_t maxlen;
 	uint64_t blkcnt = 0;
@@ -3790,12 +4130,7 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int lun, ISTGT_LU_D
 	int rc;
 #endif
 
-	alloc_len = ISCSI_ALIGN(sizeof (*lu_task));
-	alloc_len += ISCSI_ALIGN(sizeof (*lu_task->lu_cmd.pdu));
-
-	lu_task = xmalloc(alloc_len);
-	if (lu_task == NULL)
-		return (NULL);
+	lu_task = istgt_lu_task_get(conn, 0);
 
 	lu_task->type = ISTGT_LU_TASK_RESPONSE;
 	lu_task->conn = conn;
@@ -3851,6 +4186,7 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int lun, ISTGT_LU_D
 	lu_task->complete = 0;
 	lu_task->lock = 0;
 	lu_task->complete_queue_ptr = NULL;
+	lu_task->deadline.armed = 0;
 	lu_task->lu_cmd.flags = 0;
 #if 0
 	rc = pthread_mutex_init(&lu_task->trans_mutex, NULL);
@@ -3907,8 +4243,9 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int lun, ISTGT_LU_D
 	lu_task->lu_cmd.CmdSN = lu_cmd->CmdSN;
 
 	// lu_task->lu_cmd.iobuf = lu_cmd->iobuf;
-	lu_task->lu_cmd.iobufindx = -1;
-	lu_task->lu_cmd.iobufsize = 0;
+	ISTGT_SGL_INIT(&lu_task->lu_cmd);
+	/* DATA-OUT the connection gathered */
+	ISTGT_SGL_MOVE(&lu_task->lu_cmd, lu_cmd);
 	lu_task->lu_cmd.data = lu_cmd->data;
 	lu_task->lu_cmd.data_len = lu_cmd->data_len;
 	lu_task->lu_cmd.alloc_len = lu_cmd->alloc_len;
@@ -3927,6 +4264,7 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int lun, ISTGT_LU_D
 	lu_task->lu_cmd.connGone = 0;
 	lu_task->lu_cmd.aborted = 0;
 	lu_task->lu_cmd.release_aborted = 0;
+	lu_task->lu_cmd.expired = 0;
 
 	lu_task->alloc_len = 0; // alloc_len;
 
@@ -4131,10 +4469,9 @@ istgt_lu_destroy_task(ISTGT_LU_TASK_Ptr lu_task)
 				lu_task->lu_cmd.iobuf[i].iov_len = 0;
 			}
 		}
-		lu_task->lu_cmd.iobufindx = -1;
-		lu_task->lu_cmd.iobufsize = 0;
 	}
-	xfree(lu_task);
+	ISTGT_SGL_RELEASE(&lu_task->lu_cmd);
+	istgt_lu_task_put(lu_task);
 	return (0);
 }
 
@@ -4268,6 +4605,7 @@ maintenance_io_worker(void *arg)
 		tind = i;
 		snprintf(tinfo, sizeof (tinfo), "mt#%d.%ld.%d", lu->num, (uint64_t)(((uint64_t *)self)[0]), i);
 		pthread_set_name_np(lu->maintenance_thread, tinfo);
+		istgt_affinity_apply(ISTGT_AFF_LU_MAINT, lu->numa_node);
 		for (j = 0; j < lu->maxlun; j++) {
 			spec = (ISTGT_LU_DISK *) lu->lun[j].spec;
 			spec->inflight_io[i] = NULL;
@@ -4472,6 +4810,7 @@ luworker(void *arg)
 			tind = i;
 			snprintf(tinfo, sizeof (tinfo), "l#%d.%ld.%d", lu->num, (uint64_t)(((uint64_t *)self)[0]), i);
 			pthread_set_name_np(lu->luthread[i], tinfo);
+			istgt_affinity_apply(ISTGT_AFF_LU_WORKER, lu->numa_node);
 			for (j = 0; j < lu->maxlun; j++) {
 				spec = (ISTGT_LU_DISK *) lu->lun[j].spec;
 				spec->inflight_io[i] = NULL;
@@ -4650,6 +4989,8 @@ luscheduler(void *arg)
 	ISTGT_LU_TASK_Ptr lu_task;
 	int retry_runningstate_count = 0;
 	struct timespec sch1, sch2, sch3, sch4, sch5, sch6, r;
+	struct timespec qos_abstime;
+	uint64_t qos_wait_us;
 	int qcnt = 0, ind = 0;
 	int worker_id;
 	int id, found_worker = 0;
@@ -4678,6 +5019,7 @@ luscheduler(void *arg)
 	pthread_t sf = pthread_self();
 	snprintf(tinfo, sizeof (tinfo), "sh#%d.%ld.%d", lu->num, (uint64_t)(((uint64_t *)sf)[0]), 0);
 	pthread_set_name_np(lu->schdler_thread, tinfo);
+	istgt_affinity_apply(ISTGT_AFF_LU_SCHEDULER, lu->numa_node);
 	while (istgt_get_state(lu->istgt) != ISTGT_STATE_RUNNING) {
 		if (istgt_get_state(lu->istgt) == ISTGT_STATE_EXITING ||
 			istgt_get_state(lu->istgt) == ISTGT_STATE_SHUTDOWN) {
@@ -4800,7 +5142,28 @@ next_lu_worker:
 			ISTGT_ERRLOG("LU%d: lu_disk_queue_count() failed:%d\n",
 			    lu->num, qcnt);
 		}
-		lu_task = istgt_queue_dequeue(&spec->cmd_queue);
+		lu_task = istgt_lu_qos_dequeue(spec, &spec->cmd_queue, &qos_wait_us);
+		if (lu_task == NULL) {
+			/*
+			 * everything queued is over its QoS limits, keep the
+			 * luworker free and look again once tokens are back
+			 * or a new task comes in
+			 */
+			clock_gettime(CLOCK_REALTIME, &qos_abstime);
+			qos_abstime.tv_sec += qos_wait_us / 1000000;
+			qos_abstime.tv_nsec += (qos_wait_us % 1000000) * 1000;
+			if (qos_abstime.tv_nsec >= 1000000000) {
+				qos_abstime.tv_sec++;
+				qos_abstime.tv_nsec -= 1000000000;
+			}
+			spec->schdler_cmd_waiting = 1;
+			pthread_cond_timedwait(&spec->cmd_queue_cond, &spec->complete_queue_mutex, &qos_abstime);
+			spec->schdler_cmd_waiting = 0;
+			MTX_UNLOCK(&spec->complete_queue_mutex);
+			if (istgt_lu_get_state(lu) != ISTGT_STATE_RUNNING)
+				goto loop_exit;
+			goto next_lu_worker;
+		}
 		clock_gettime(clockid, &sch3);
 		id = 19;
 		tdiff(sch5, sch3, r);
@@ -51,6 +51,7 @@
 #endif
 #include "istgt.h"
 #include "istgt_queue.h"
+#include "istgt_twheel.h"
 
 #ifdef	REPLICATION
 #include "replication.h"
@@ -86,6 +87,13 @@
 #define DEFAULT_LU_BLOCKLEN_DVD 2048
 #define DEFAULT_LU_BLOCKLEN_TAPE DEFAULT_LU_BLOCKLEN
 #define DEFAULT_LU_QUEUE_DEPTH 32
+#define DEFAULT_LU_WC_MAX_BYTES (128 * 1024)
+#define MAX_LU_WC_MAX_BYTES (1024 * 1024)
+#define MAX_LU_WC_WINDOW_US 10000
+#define MAX_LU_RCACHE_MB (64 * 1024)
+#define DEFAULT_LU_QOS_BURST_MS 1000
+#define MAX_LU_QOS_BURST_MS 60000
+#define MAX_LU_REPLICA_DCONNS 8
 #define DEFAULT_LU_ROTATIONRATE 7200	/* 7200 rpm */
 #define DEFAULT_LU_FORMFACTOR 0x02	/* 3.5 inch */
 
@@ -221,6 +229,8 @@ typedef struct istgt_lu_lun_t {
 			int wsame : 1;
 			int dpofua : 1;
 			int wzero : 1;
+			int uring : 1;
+			int directio : 1;
 		};
 		int lunflags;
 	};
@@ -253,6 +263,27 @@ typedef struct istgt_lu_map_t {
 	int ig_tag;
 } ISTGT_LU_MAP;
 
+/* see istgt_lu_qos.c, 0 means unlimited */
+typedef struct istgt_lu_qos_limit {
+	uint64_t iops;
+	uint64_t bps;
+	uint32_t burst_ms;
+} ISTGT_LU_QOS_LIMIT;
+
+typedef struct istgt_lu_qos_stats {
+	char name[MAX_INITIATOR_NAME];	/* "LU" or initiator port */
+	ISTGT_LU_QOS_LIMIT limit;
+	uint64_t admitted;
+	uint64_t throttled;		/* dispatches deferred */
+	uint64_t throttle_us;		/* time spent with work held back */
+} ISTGT_LU_QOS_STATS;
+
+/* how IOs are spread over the data connections of a replica */
+typedef enum {
+	ISTGT_DCONN_LBA = 0,	/* by LBA range, keeps nearby IOs together */
+	ISTGT_DCONN_RR = 1,	/* round robin */
+} ISTGT_LU_DCONN_POLICY;
+
 typedef enum {
 	ISTGT_UA_NONE			=	0X0000,
 	ISTGT_UA_POWERON		=	0X0001,
@@ -335,6 +366,12 @@ typedef struct istgt_lu_t {
 	int queue_depth;
 	int limit_q_size;
 	int queue_check;
+	int wc_window_us;
+	int wc_max_bytes;
+	int rcache_mb;
+	ISTGT_LU_QOS_LIMIT qos_lu;
+	ISTGT_LU_QOS_LIMIT qos_initiator;
+	int numa_node;
 
 	int maxlun;
 	ISTGT_LU_LUN lun[MAX_LU_LUN];
@@ -348,6 +385,10 @@ typedef struct istgt_lu_t {
 	uint8_t desired_replication_factor;
 	uint8_t consistency_factor;
 	TAILQ_HEAD(, trusty_replica_s) trusty_replicas; //Contains list of trusty replicas
+	int replica_dconns;
+	int replica_dconn_policy;
+	int replica_status_push;
+	int replica_pr_persist;
 #endif
 } ISTGT_LU;
 typedef ISTGT_LU *ISTGT_LU_Ptr;
@@ -382,7 +423,9 @@ ISTGT_WORKER_PICKED           = 0x00000080,
 ISTGT_DISK_EXEC               = 0x00000100,
 ISTGT_COMPLETED_EXEC          = 0x00000200,
 ISTGT_RESULT_Q_ENQUEUED       = 0x00000400,
-ISTGT_RESULT_Q_DEQUEUED       = 0x00000800
+ISTGT_RESULT_Q_DEQUEUED       = 0x00000800,
+ISTGT_URING_ALLOWED           = 0x00001000,
+ISTGT_URING_ARMED             = 0x00002000
 };
 
 typedef struct istgt_lu_cmd_t {
@@ -429,7 +472,9 @@ typedef struct istgt_lu_cmd_t {
 
 	uint64_t iobufsize;
 	int iobufindx;
-	struct iovec iobuf[40];
+	int iobufcap;
+	struct iovec *iobuf;	/* iobuf_inl or heap, see ISTGT_SGL_INIT */
+	struct iovec iobuf_inl[ISTGT_SGL_INLINE];
 	//int iobufoff[20]; int iobufsize[20]; uint8_t *iobuf[20];
 
 	uint8_t *data;
@@ -453,6 +498,8 @@ typedef struct istgt_lu_cmd_t {
 	uint8_t    connGone;
 	uint8_t    aborted;
 	uint8_t	   release_aborted;
+	/* past its deadline, a failure is reported as ABORTED COMMAND */
+	uint8_t    expired;
 #ifdef REPLICATION
 	uint32_t   luworkerindx;
 	struct timespec start_rw_time;
@@ -658,6 +705,51 @@ typedef enum {
 	ISTGT_TASK_ERROR
 } istgt_task_action;
 
+/* see istgt_lu_disk_rcache.c */
+#define ISTGT_RCACHE_TICKET_STRIPES	4
+
+typedef struct istgt_lu_rcache_ticket {
+	uint64_t epoch;
+	uint64_t gen[ISTGT_RCACHE_TICKET_STRIPES];
+	int nstripes;		/* 0: don't fill */
+} ISTGT_LU_RCACHE_TICKET;
+
+struct istgt_lu_disk_t;
+
+/* see istgt_lu_disk_uring.c */
+#define	ISTGT_LU_URING_READ	0
+#define	ISTGT_LU_URING_WRITE	1
+#define	ISTGT_LU_URING_FSYNC	2
+
+/*
+ * An IO handed to the io_uring engine.  done() is called exactly once,
+ * from the engine's reaper thread once all of nbytes went through or the
+ * IO failed, with res holding the bytes transferred or -errno.
+ */
+typedef struct istgt_lu_disk_uring_io_t {
+	int opcode;
+	struct iovec *iov;	/* left untouched by the engine */
+	int iovcnt;
+	struct iovec iov1;	/* for a single buffer */
+	uint64_t offset;
+	uint64_t nbytes;
+	void (*done)(struct istgt_lu_disk_t *spec,
+	    struct istgt_lu_disk_uring_io_t *io);
+	void *arg;
+	int64_t res;
+
+	/* engine private */
+	struct istgt_lu_disk_uring_io_t *prev;
+	struct istgt_lu_disk_uring_io_t *next;
+	int linked;
+	uint64_t xfered;	/* resubmitted from here after a short IO */
+	struct iovec *riov;
+	int riovcnt;
+	uint8_t *buf;		/* O_DIRECT bounce buffer */
+	int buf_index;
+	struct iovec biov;
+} ISTGT_LU_DISK_URING_IO;
+
 typedef struct istgt_lu_task_t {
 	uint16_t type;
 	uint16_t  cdb0;
@@ -692,11 +784,36 @@ typedef struct istgt_lu_task_t {
 	int lock;
 	void *complete_queue_ptr;//Pointer to the task in Complete queue
 	ISTGT_QUEUE_Ptr blocked_by;// Pointer to the last task in complete queue blocking the current task
+	ISTGT_TIMER deadline;// On spec's task_wheel while in complete queue
+
+#ifndef	REPLICATION
+	/* READ/WRITE completed by the io_uring engine, not the luworker */
+	ISTGT_LU_DISK_URING_IO uring_io;
+	ISTGT_LU_RCACHE_TICKET rcache_ticket;
+	uint64_t io_lba;
+	uint32_t io_lblen;
+#endif
 
 	int flags;
+	struct istgt_lu_task_pool_t *pool;
 } ISTGT_LU_TASK;
 typedef ISTGT_LU_TASK *ISTGT_LU_TASK_Ptr;
 
+/* preallocated tasks of a connection, see istgt_lu_task_get() */
+typedef struct istgt_lu_task_pool_t {
+	pthread_mutex_t mutex;
+	uint8_t *slab;
+	size_t slot_len;
+	void **free;
+	int nslots;
+	int nfree;
+	int refs;
+	/* read without locks by istgt_metrics.c */
+	uint64_t inuse;
+	uint64_t hiwat;
+	uint64_t misses;
+} ISTGT_LU_TASK_POOL;
+
 /* lu_disk.c */
 typedef struct istgt_lu_pr_key_t {
 	uint64_t key;
@@ -762,6 +879,14 @@ struct luworker_exit_args {
 	ISTGT_LU_TASK_Ptr lu_task;
 };
 
+typedef struct istgt_lu_rcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t size;		/* configured bytes */
+	uint64_t used;		/* bytes of cached data */
+	uint64_t memory;	/* used plus bookkeeping */
+} ISTGT_LU_RCACHE_STATS;
+
 #define HOLD_SCHEDULER		0x1
 #define WRITE_INFLIGHT_ISCSI	0x2
 #define WRITE_INFLIGHT_ONDISK	0x4
@@ -844,10 +969,24 @@ typedef struct istgt_lu_disk_t {
 			uint16_t delay_reserve : 1;
 			uint16_t delay_release : 1;
 			uint16_t exit_lu_worker : 1;
+			uint16_t uring : 1;
+			uint16_t directio : 1;
 		};
 		uint16_t lunflags;
 	};
 
+	/* io_uring engine, NULL when IO goes through pread/pwritev */
+	void *uring_ctx;
+
+	/* read cache, NULL when ReadCacheSize is 0 */
+	void *rcache;
+
+	/* QoS token buckets, see istgt_lu_qos.c */
+	void *qos;
+
+	/* node the LU threads run on, -1 if not bound */
+	int numa_node;
+
 	uint32_t error_inject;
 	int32_t inject_cnt;
 
@@ -893,6 +1032,11 @@ typedef struct istgt_lu_disk_t {
 	 * when consistency changes
 	 */
 	struct replica_s *scalingup_replica;
+	/* io_seq of the last write/sync issued before scalingup_replica was set */
+	uint64_t scaleup_fence_io_seq;
+	/* replica management shard serving this spec, and its poll timer */
+	int mgmt_shard;
+	ISTGT_TIMER poll_timer;
 	/*Common for both the above queues,
 	Since same cmd is part of both the queues*/
 	pthread_mutex_t rq_mtx; 
@@ -905,6 +1049,53 @@ typedef struct istgt_lu_disk_t {
 		uint64_t	used;
 		struct timespec	updated_stats_time;
 	} stats;
+
+	/* write coalescing, see istgt_lu_disk_coalesce_write() */
+	uint32_t wc_window_us;
+	uint32_t wc_max_bytes;
+	pthread_mutex_t wc_mutex;
+	pthread_cond_t wc_cond;
+	void *wc_open;
+	uint64_t wc_batches;
+	uint64_t wc_merged;
+
+	/* flush group commit, see replicate_sync() */
+	uint64_t writes_done;
+	pthread_mutex_t gs_mutex;
+	pthread_cond_t gs_cond;
+	bool gs_inflight;
+	uint64_t gs_covered;
+	uint64_t gs_gen;
+	int64_t gs_rc;
+	uint64_t gs_syncs;
+	uint64_t gs_merged;
+
+	/* data connections opened to each replica, see ReplicaDataConns */
+	int replica_dconns;
+	int replica_dconn_policy;
+	/* subscribe to replica status pushes, see ReplicaStatusPush */
+	int replica_status_push;
+
+	/*
+	 * Persistent reservations kept on the replicas, see ReplicaPersistPR,
+	 * under rq_mtx.  The volume isn't made ready until they have been
+	 * read back once, or PR_WAIT_TIME after the first try.
+	 */
+	int replica_pr_persist;
+	uint64_t pr_seq;
+	void *pr_blob;
+	uint64_t pr_blob_len;
+	int pr_restored;
+	/* from the start of a read back until it or its retry is done */
+	int pr_reading;
+	struct timespec pr_restore_start;
+	/* joined by the next read back or destroy_volume */
+	pthread_t pr_thread;
+	int pr_thread_valid;
+	/* on the shard's poll_wheel, see rmgmt_shard_pr_retry */
+	ISTGT_TIMER pr_retry_timer;
+	/* loads them into the LU, under pr_rsv_mutex */
+	int (*pr_apply)(struct istgt_lu_disk_t *spec);
 #endif
 
 	/*Queue containing all the tasks. Instead of going to separate 
@@ -912,6 +1103,11 @@ typedef struct istgt_lu_disk_t {
 	inflight)to check for blockage, we will check it in just this queue.*/
 	ISTGT_QUEUE complete_queue;
 	pthread_mutex_t complete_queue_mutex;
+#ifdef	REPLICATION
+	/* deadlines of tasks in complete_queue, under complete_queue_mutex */
+	ISTGT_TWHEEL task_wheel;
+	uint64_t task_notice_ms;
+#endif
 
 	pthread_mutex_t schdler_mutex;
 	pthread_mutex_t sleep_mutex;
@@ -938,6 +1134,14 @@ typedef struct istgt_lu_disk_t {
 	int npr_keys;
 	ISTGT_LU_PR_KEY pr_keys[MAX_LU_RESERVE];
 	uint32_t pr_generation;
+	/*
+	 * Changed under pr_rsv_mutex with anything the PR check depends on,
+	 * unique across LUs; conn->pr_verdict entries are keyed on it and
+	 * pr_index is rebuilt from pr_keys when pr_index_epoch falls behind.
+	 */
+	volatile uint32_t pr_epoch;
+	uint32_t pr_index_epoch;
+	ISTGT_SIDX pr_index;
 
 	char *rsv_port;
 	uint64_t rsv_key;
@@ -1028,6 +1232,8 @@ extern istgt_serialize_action istgt_serialize_table[ISTGT_SERIDX_COUNT + 1][ISTG
 
 int64_t
 replicate(ISTGT_LU_DISK *, ISTGT_LU_CMD_Ptr, uint64_t, uint64_t);
+int64_t
+replicate_sync(ISTGT_LU_DISK *, ISTGT_LU_CMD_Ptr, uint64_t, uint64_t);
 int
 istgt_lu_disk_update_raw(ISTGT_LU_Ptr lu, int i, int dofake);
  
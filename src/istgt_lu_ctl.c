@@ -68,6 +68,7 @@
 #include "istgt_lu.h"
 #include "istgt_iscsi.h"
 #include "istgt_proto.h"
+#include "istgt_affinity.h"
 
 #ifdef	REPLICATION
 #include <json-c/json_object.h>
@@ -2366,6 +2367,7 @@ istgt_uctl_cmd_info(UCTL_Ptr uctl)
 	int ncount;
 	int rc;
 	int i, j, k;
+	int lo, hi;
 
 	arg = uctl->arg;
 	iqn = strsepq(&arg, delim);
@@ -2380,8 +2382,9 @@ istgt_uctl_cmd_info(UCTL_Ptr uctl)
 	}
 
 	ncount = 0;
+	istgt_lu_slot_range(uctl->istgt, iqn, &lo, &hi);
 	MTX_LOCK(&uctl->istgt->mutex);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+	for (i = lo; i < hi; i++) {
 		lu = uctl->istgt->logical_unit[i];
 		if (lu == NULL)
 			continue;
@@ -2484,6 +2487,7 @@ istgt_uctl_cmd_status(UCTL_Ptr uctl)
 	int lun_i;
 	int status;
 	int i;
+	int lo, hi;
 	int rc;
 
 	arg = uctl->arg;
@@ -2513,8 +2517,9 @@ istgt_uctl_cmd_status(UCTL_Ptr uctl)
 	if (rc != UCTL_CMD_OK) {
 		return (rc);
 	}
+	istgt_lu_slot_range(uctl->istgt, iqn, &lo, &hi);
 	MTX_LOCK(&uctl->istgt->mutex);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+	for (i = lo; i < hi; i++) {
 		lu = uctl->istgt->logical_unit[i];
 		if (lu == NULL)
 			continue;
@@ -2553,6 +2558,233 @@ istgt_uctl_cmd_status(UCTL_Ptr uctl)
 	return (UCTL_CMD_OK);
 }
 
+#define	MAX_QOS_STATS_LINES	64
+
+/*
+ * QOS <iqn>|ALL                               list the buckets
+ * QOS <iqn>|ALL LU|INITIATOR iops kbps [burst_ms]  set the limits,
+ * 0 means unlimited
+ */
+static int
+istgt_uctl_cmd_qos(UCTL_Ptr uctl)
+{
+	ISTGT_LU_Ptr lu;
+	ISTGT_LU_DISK *spec;
+	ISTGT_LU_QOS_LIMIT limit, ilimit;
+	ISTGT_LU_QOS_STATS *st;
+	const char *delim = ARGS_DELIM;
+	char *arg;
+	char *iqn, *scope = NULL, *iops = NULL, *kbps = NULL, *burst = NULL;
+	int rc;
+	int i, j, n;
+	int found = 0;
+
+	arg = uctl->arg;
+	iqn = strsepq(&arg, delim);
+	if (arg != NULL) {
+		scope = strupr(strsepq(&arg, delim));
+		iops = strsepq(&arg, delim);
+		kbps = strsepq(&arg, delim);
+		burst = strsepq(&arg, delim);
+	}
+	if (iqn == NULL || arg != NULL ||
+	    (scope != NULL && (kbps == NULL ||
+	    (strcmp(scope, "LU") != 0 && strcmp(scope, "INITIATOR") != 0)))) {
+		istgt_uctl_snprintf(uctl, "ERR invalid parameters\n");
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+		return (UCTL_CMD_ERR);
+	}
+	if (scope != NULL) {
+		limit.iops = strtoull(iops, NULL, 10);
+		limit.bps = strtoull(kbps, NULL, 10) * 1024;
+		limit.burst_ms = DEFAULT_LU_QOS_BURST_MS;
+		if (burst != NULL)
+			limit.burst_ms = (uint32_t) strtoul(burst, NULL, 10);
+		if (limit.burst_ms == 0 ||
+		    limit.burst_ms > MAX_LU_QOS_BURST_MS) {
+			istgt_uctl_snprintf(uctl,
+			    "ERR invalid burst %s\n", burst);
+			rc = istgt_uctl_writeline(uctl);
+			if (rc != UCTL_CMD_OK) {
+				return (rc);
+			}
+			return (UCTL_CMD_ERR);
+		}
+	}
+
+	st = xmalloc(sizeof (*st) * MAX_QOS_STATS_LINES);
+	for (i = 1; i <= uctl->istgt->nlogical_unit; i++) {
+		lu = uctl->istgt->logical_unit[i];
+		if (lu == NULL)
+			continue;
+		if (strcmp(iqn, lu->name) != 0 && strcmp(iqn, "ALL") != 0)
+			continue;
+		spec = (ISTGT_LU_DISK *)lu->lun[0].spec;
+		if (spec == NULL)
+			continue;
+		found = 1;
+
+		if (scope != NULL) {
+			istgt_lu_qos_set(spec, scope, &limit);
+			ISTGT_LOG("%s->qos %s iops=%lu kbps=%lu burst=%ums\n",
+			    lu->name, scope, limit.iops, limit.bps / 1024,
+			    limit.burst_ms);
+			continue;
+		}
+
+		n = istgt_lu_qos_stats(spec, st, MAX_QOS_STATS_LINES);
+		for (j = 0; j < n; j++) {
+			istgt_uctl_snprintf(uctl,
+			    "%s %s %s iops=%lu kbps=%lu burst=%ums"
+			    " admitted=%lu throttled=%lu throttle_us=%lu\n",
+			    uctl->cmd, lu->name, st[j].name, st[j].limit.iops,
+			    st[j].limit.bps / 1024, st[j].limit.burst_ms,
+			    st[j].admitted, st[j].throttled, st[j].throttle_us);
+			rc = istgt_uctl_writeline(uctl);
+			if (rc != UCTL_CMD_OK) {
+				xfree(st);
+				return (rc);
+			}
+			if (j != 0)
+				continue;
+			/* limit given to each initiator port bucket */
+			istgt_lu_qos_get_limits(spec, &limit, &ilimit);
+			istgt_uctl_snprintf(uctl,
+			    "%s %s INITIATOR iops=%lu kbps=%lu burst=%ums\n",
+			    uctl->cmd, lu->name, ilimit.iops,
+			    ilimit.bps / 1024, ilimit.burst_ms);
+			rc = istgt_uctl_writeline(uctl);
+			if (rc != UCTL_CMD_OK) {
+				xfree(st);
+				return (rc);
+			}
+		}
+	}
+	xfree(st);
+
+	if (!found) {
+		istgt_uctl_snprintf(uctl, "ERR no target\n");
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+		return (UCTL_CMD_ERR);
+	}
+	istgt_uctl_snprintf(uctl, "OK %s\n", uctl->cmd);
+	rc = istgt_uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return (rc);
+	}
+	return (UCTL_CMD_OK);
+}
+
+static int
+istgt_uctl_cmd_metrics(UCTL_Ptr uctl)
+{
+	char *text, *line, *next;
+	size_t len;
+	int rc;
+
+	text = istgt_metrics_snapshot(uctl->istgt, &len);
+	for (line = text; line < text + len; line = next) {
+		next = strchr(line, '\n');
+		if (next == NULL)
+			next = text + len;
+		else
+			*next++ = '\0';
+		istgt_uctl_snprintf(uctl, "%s %s\n", uctl->cmd, line);
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			xfree(text);
+			return (rc);
+		}
+	}
+	xfree(text);
+
+	istgt_uctl_snprintf(uctl, "OK %s\n", uctl->cmd);
+	rc = istgt_uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return (rc);
+	}
+	return (UCTL_CMD_OK);
+}
+
+#define	MAX_AFFINITY_THREADS	4096
+
+static int
+istgt_uctl_cmd_affinity(UCTL_Ptr uctl)
+{
+	ISTGT_LU_Ptr lu;
+	ISTGT_AFFINITY_ENT *ent;
+	char cpus[ISTGT_AFF_CPULIST_LEN];
+	int colocate, numabind;
+	int rc;
+	int i, n, node;
+
+	istgt_affinity_get_policy(&colocate, &numabind);
+	istgt_uctl_snprintf(uctl, "%s policy colocate=%s numabind=%s\n",
+	    uctl->cmd, colocate ? "Yes" : "No", numabind ? "Yes" : "No");
+	rc = istgt_uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return (rc);
+	}
+	for (i = 0; i < ISTGT_AFF_NCLASSES; i++) {
+		istgt_affinity_class_cpus(i, cpus, sizeof (cpus));
+		istgt_uctl_snprintf(uctl, "%s class %s cpus=%s\n",
+		    uctl->cmd, istgt_aff_class_name[i], cpus);
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+	}
+	for (i = 0; i < istgt_affinity_nnodes(); i++) {
+		node = istgt_affinity_node_cpus(i, cpus, sizeof (cpus));
+		istgt_uctl_snprintf(uctl, "%s node %d cpus=%s\n",
+		    uctl->cmd, node, cpus);
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+	}
+	for (i = 1; i <= uctl->istgt->nlogical_unit; i++) {
+		lu = uctl->istgt->logical_unit[i];
+		if (lu == NULL)
+			continue;
+		istgt_uctl_snprintf(uctl, "%s lu %s node=%d\n",
+		    uctl->cmd, lu->name, lu->numa_node);
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+	}
+
+	/* what the threads actually got */
+	ent = xmalloc(sizeof (*ent) * MAX_AFFINITY_THREADS);
+	n = istgt_affinity_snapshot(ent, MAX_AFFINITY_THREADS);
+	for (i = 0; i < n; i++) {
+		istgt_uctl_snprintf(uctl, "%s thread %s class=%s node=%d"
+		    " cpus=%s\n", uctl->cmd, ent[i].name,
+		    istgt_aff_class_name[ent[i].cls], ent[i].node,
+		    ent[i].cpus);
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			xfree(ent);
+			return (rc);
+		}
+	}
+	xfree(ent);
+
+	istgt_uctl_snprintf(uctl, "OK %s\n", uctl->cmd);
+	rc = istgt_uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return (rc);
+	}
+	return (UCTL_CMD_OK);
+}
+
 static int
 istgt_uctl_cmd_maxtime(UCTL_Ptr uctl)
 {
@@ -3005,6 +3237,7 @@ istgt_uctl_cmd_dump(UCTL_Ptr uctl)
 	int lu_num = 0;
 	int rc;
 	int i, j, k, t;
+	int lo, hi;
 	int x = 0;
 	int detail = 0;
 	PORTAL_GROUP *pgp;
@@ -3029,8 +3262,9 @@ istgt_uctl_cmd_dump(UCTL_Ptr uctl)
 		return (UCTL_CMD_ERR);
 	}
 
+	istgt_lu_slot_range(uctl->istgt, iqn, &lo, &hi);
 	MTX_LOCK(&uctl->istgt->mutex);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+	for (i = lo; i < hi; i++) {
 		lu = uctl->istgt->logical_unit[i];
 		if (lu == NULL)
 			continue;
@@ -3207,6 +3441,7 @@ istgt_uctl_cmd_rsv(UCTL_Ptr uctl)
 	char *iqn;
 	int rc;
 	int i;
+	int lo, hi;
 
 	arg = uctl->arg;
 	iqn = strsepq(&arg, delim);
@@ -3219,8 +3454,9 @@ istgt_uctl_cmd_rsv(UCTL_Ptr uctl)
 		}
 		return (UCTL_CMD_ERR);
 	}
+	istgt_lu_slot_range(uctl->istgt, iqn, &lo, &hi);
 	MTX_LOCK(&uctl->istgt->mutex);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+	for (i = lo; i < hi; i++) {
 		lu = uctl->istgt->logical_unit[i];
 		if (lu == NULL)
 			continue;
@@ -3273,6 +3509,7 @@ istgt_uctl_cmd_que(UCTL_Ptr uctl)
 	char *iqn = NULL, *lu_str = NULL;
 	int rc, err = 0;
 	int i, levels;
+	int lo, hi;
 	int lu_num = -1;
 	int cq, bq, inf, inflight;
 	ISTGT_LU_DISK *spec;
@@ -3310,8 +3547,9 @@ istgt_uctl_cmd_que(UCTL_Ptr uctl)
 		lu_num = (int) strtol(lu_str, NULL, 10);
 	}
 
+	istgt_lu_slot_range(uctl->istgt, iqn, &lo, &hi);
 	MTX_LOCK(&uctl->istgt->mutex);
-	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+	for (i = lo; i < hi; i++) {
 		lu = uctl->istgt->logical_unit[i];
 		if (lu == NULL)
 			continue;
@@ -3536,6 +3774,8 @@ istgt_uctl_cmd_iostats(UCTL_Ptr uctl)
 	struct json_object *jobj;
 	replica_t *replica;
 	ISTGT_LU_DISK *spec;
+	ISTGT_LU_RCACHE_STATS rcstats;
+	ISTGT_LU_QOS_STATS qosstats;
 
 	MTX_LOCK(&specq_mtx);
 	TAILQ_FOREACH(spec, &spec_q, spec_next) {
@@ -3582,6 +3822,33 @@ istgt_uctl_cmd_iostats(UCTL_Ptr uctl)
 		    json_object_new_uint64(spec->totalreadblockcount));
 		json_object_object_add(jobj, "TotalWriteBlockCount",
 		    json_object_new_uint64(spec->totalwriteblockcount));
+		json_object_object_add(jobj, "CoalescedWriteBatches",
+		    json_object_new_uint64(spec->wc_batches));
+		json_object_object_add(jobj, "CoalescedWrites",
+		    json_object_new_uint64(spec->wc_merged));
+		json_object_object_add(jobj, "SyncsSent",
+		    json_object_new_uint64(spec->gs_syncs));
+		json_object_object_add(jobj, "CoalescedSyncs",
+		    json_object_new_uint64(spec->gs_merged));
+
+		istgt_lu_disk_rcache_stats(spec, &rcstats);
+		json_object_object_add(jobj, "ReadCacheHits",
+		    json_object_new_uint64(rcstats.hits));
+		json_object_object_add(jobj, "ReadCacheMisses",
+		    json_object_new_uint64(rcstats.misses));
+		json_object_object_add(jobj, "ReadCacheSize",
+		    json_object_new_uint64(rcstats.size));
+		json_object_object_add(jobj, "ReadCacheUsedBytes",
+		    json_object_new_uint64(rcstats.used));
+		json_object_object_add(jobj, "ReadCacheMemory",
+		    json_object_new_uint64(rcstats.memory));
+
+		if (istgt_lu_qos_stats(spec, &qosstats, 1) == 1) {
+			json_object_object_add(jobj, "QoSThrottled",
+			    json_object_new_uint64(qosstats.throttled));
+			json_object_object_add(jobj, "QoSThrottleTime",
+			    json_object_new_uint64(qosstats.throttle_us));
+		}
 
                 replica_cnt = spec->healthy_rcount + spec->degraded_rcount;
 		json_object_object_add(jobj, "ReplicaCounter",
@@ -3878,6 +4145,9 @@ static ISTGT_UCTL_CMD_TABLE istgt_uctl_cmd_table[] =
 #endif
 	{ "SET", istgt_uctl_cmd_set},
 	{ "MAXTIME", istgt_uctl_cmd_maxtime},
+	{ "QOS", istgt_uctl_cmd_qos},
+	{ "AFFINITY", istgt_uctl_cmd_affinity},
+	{ "METRICS", istgt_uctl_cmd_metrics},
 #ifdef	REPLICATION
 	{ "SNAPCREATE", istgt_uctl_cmd_snap},
 	{ "SNAPDESTROY", istgt_uctl_cmd_snap},
@@ -80,6 +80,7 @@
 #include "istgt_proto.h"
 #include "istgt_scsi.h"
 #include "istgt_queue.h"
+#include "istgt_affinity.h"
 #ifdef	REPLICATION
 #include "istgt_integration.h"
 #include "replication.h"
@@ -102,9 +103,74 @@
 #endif
 
 extern clockid_t clockid;
+#ifdef	REPLICATION
+extern int replica_timeout;
+extern uint64_t io_max_wait_time;
+#endif
 
 //#define ISTGT_TRACE_DISK
 
+#ifdef	REPLICATION
+/*
+ * Deadline of a task in the complete queue, run from timerfn with
+ * complete_queue_mutex held.  It fires every quarter of replica_timeout
+ * to report the task as stale, once per quarter for the volume.  A task
+ * still running after io_max_wait_time is marked expired: replicate()
+ * gives up on it and it ends in CHECK CONDITION, ABORTED COMMAND.  One
+ * the luworker is done with keeps the status it got.
+ */
+static void
+lu_task_deadline_expired(void *owner, ISTGT_TIMER *t)
+{
+	ISTGT_LU_DISK *spec = owner;
+	ISTGT_LU_TASK_Ptr lu_task = t->arg;
+	ISTGT_LU_CMD_Ptr lu_cmd = &lu_task->lu_cmd;
+	struct timespec now, diff;
+	uint64_t quarter, now_ms, ms;
+
+	if (lu_cmd->flags & ISTGT_COMPLETED_EXEC)
+		return;
+	clock_gettime(clockid, &now);
+	timesdiff(clockid, lu_cmd->times[0], now, diff);
+	ms = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+	if (ms >= io_max_wait_time * 1000) {
+		ISTGT_LOG("LU:%lu CSN:0x%x TT:%x OP:%2.2x:%x:%s(%lu+%u) "
+		    "timed out after %lu seconds, failing it\n",
+		    lu_cmd->lun, lu_cmd->CmdSN, lu_cmd->task_tag,
+		    lu_cmd->cdb0, lu_cmd->status, lu_cmd->info,
+		    lu_cmd->lba, lu_cmd->lblen, ms / 1000);
+		lu_cmd->expired = 1;
+		return;
+	}
+
+	quarter = (replica_timeout * 1000) / 4;
+	now_ms = istgt_twheel_now_ms();
+	if (now_ms >= spec->task_notice_ms + quarter) {
+		ISTGT_NOTICELOG("LU:%lu CSN:0x%x TT:%x OP:%2.2x:%x:%s(%lu+%u) "
+		    "not responded since %lu seconds\n",
+		    lu_cmd->lun, lu_cmd->CmdSN, lu_cmd->task_tag,
+		    lu_cmd->cdb0, lu_cmd->status, lu_cmd->info,
+		    lu_cmd->lba, lu_cmd->lblen, ms / 1000);
+		spec->task_notice_ms = now_ms;
+	}
+	ms = (io_max_wait_time * 1000) - ms;
+	if (ms > quarter)
+		ms = quarter;
+	istgt_twheel_arm(&spec->task_wheel, t, now_ms + ms,
+	    lu_task_deadline_expired, lu_task);
+}
+
+#define	LU_TASK_DEADLINE_ARM(spec, lu_task)				\
+	istgt_twheel_arm(&(spec)->task_wheel, &(lu_task)->deadline,	\
+	    istgt_twheel_now_ms() + (replica_timeout * 1000) / 4,	\
+	    lu_task_deadline_expired, (lu_task))
+#define	LU_TASK_DEADLINE_CANCEL(spec, lu_task)				\
+	istgt_twheel_cancel(&(spec)->task_wheel, &(lu_task)->deadline)
+#else
+#define	LU_TASK_DEADLINE_ARM(spec, lu_task)
+#define	LU_TASK_DEADLINE_CANCEL(spec, lu_task)
+#endif
+
 #ifdef	REPLICATION
 #define	IS_SPEC_BUSY(_spec)						\
 		(_spec->state == ISTGT_LUN_BUSY ||			\
@@ -223,6 +289,7 @@ typedef enum {
 #define PR_ALLOW_ALLRR 0x0004
 #define PR_ALLOW_WERR  0x0002
 #define PR_ALLOW_EARR  0x0001
+#define PR_ALLOW_ANY   0xffffffffU
 
 #define BUILD_SENSE(SK,ASC,ASCQ)  istgt_lu_scsi_build_sense_data(lu_cmd,ISTGT_SCSI_SENSE_ ## SK, (ASC), (ASCQ))
 #define BUILD_SENSE2(SK,ASC,ASCQ) istgt_lu_scsi_build_sense_data2(lu_cmd, ISTGT_SCSI_SENSE_ ## SK, (ASC), (ASCQ))
@@ -292,6 +359,10 @@ istgt_lu_disk_open_raw(ISTGT_LU_DISK *spec, int flags, int mode)
 	}
 	spec->fd = rc;
 	spec->foffset = 0;
+#ifndef	REPLICATION
+	if (spec->uring)
+		(void) istgt_lu_disk_uring_open(spec, flags);
+#endif
 	return 0;
 }
 
@@ -303,6 +374,7 @@ istgt_lu_disk_close_raw(ISTGT_LU_DISK *spec)
 
 	if (spec->fd == -1)
 		return 0;
+	istgt_lu_disk_uring_close(spec);
 	rc = close(spec->fd);
 	if (rc < 0) {
 		return -1;
@@ -333,7 +405,10 @@ istgt_lu_disk_sync_raw(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
 	int64_t rc = 0;
 
 #ifndef	REPLICATION
-	rc = (int64_t) fsync(spec->fd);
+	if (spec->uring_ctx != NULL)
+		rc = istgt_lu_disk_uring_fsync(spec);
+	else
+		rc = (int64_t) fsync(spec->fd);
 	if (rc < 0) {
 		return -1;
 	}
@@ -505,6 +580,7 @@ istgt_lu_disk_close(ISTGT_LU_Ptr lu, int i)
 	for (i = 0; i < MAX_LU_RESERVE; i++) {
 		memset(&spec->pr_keys[i], 0, sizeof(spec->pr_keys[i]));
 	} 
+	istgt_lu_disk_pr_changed(spec);
 	MTX_UNLOCK(&spec->pr_rsv_mutex);
 
 	TAILQ_FOREACH(nexus, &spec->nexus, nexus_next) {
@@ -932,6 +1008,8 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d storage\n",
 		    lu->num, i);
 
+		/* per-LU structures on the node of the LU threads */
+		istgt_affinity_mem_bind(lu->numa_node);
 		spec = xmalloc(sizeof *spec);
 		memset(spec, 0, sizeof *spec);
 		spec->lu = lu;
@@ -960,11 +1038,32 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 		spec->xcopy = spec->lu->lun[i].xcopy;
 		spec->wsame = spec->lu->lun[i].wsame;
 		spec->dpofua = spec->lu->lun[i].dpofua;
+		spec->uring = spec->lu->lun[i].uring;
+		spec->directio = spec->lu->lun[i].directio;
+		spec->uring_ctx = NULL;
+		istgt_lu_disk_rcache_init(spec,
+		    (uint64_t)lu->rcache_mb * ISTGT_LU_1MB);
+		istgt_lu_qos_init(spec, &lu->qos_lu, &lu->qos_initiator);
+		spec->numa_node = lu->numa_node;
+		istgt_affinity_mem_unbind();
 		rpm = spec->lu->lun[i].rotationrate;
 
 		spec->watsbuf = NULL;
 
 		spec->queue_depth = lu->queue_depth;
+#ifdef	REPLICATION
+		spec->wc_window_us = lu->wc_window_us;
+		spec->wc_max_bytes = lu->wc_max_bytes;
+		spec->wc_open = NULL;
+		spec->wc_batches = 0;
+		spec->wc_merged = 0;
+		spec->replica_dconns = lu->replica_dconns;
+		spec->replica_dconn_policy = lu->replica_dconn_policy;
+		spec->replica_status_push = lu->replica_status_push;
+		spec->replica_pr_persist = lu->replica_pr_persist;
+		pthread_mutex_init(&spec->wc_mutex, NULL);
+		pthread_cond_init(&spec->wc_cond, NULL);
+#endif
 
 		spec->disk_modify_work_pending = 0;
 
@@ -997,6 +1096,10 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 			return -1;
 		}
 		istgt_queue_init(&spec->complete_queue);
+#ifdef	REPLICATION
+		istgt_twheel_init(&spec->task_wheel, ISTGT_TWHEEL_TICK_MS, spec);
+		spec->task_notice_ms = 0;
+#endif
 
 		rc = pthread_mutex_init(&spec->wait_lu_task_mutex, NULL);
 		if (rc != 0) {
@@ -1073,6 +1176,7 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 			ISTGT_ERRLOG("LU%d: persistent reservation mutex_init() failed errno:%d\n", lu->num, errno);
 			return -1;
 		}
+		spec->pr_apply = istgt_lu_disk_get_reservation;
 #endif
 		memset(&spec->lu_free_matrix, 0, ((ISTGT_MAX_NUM_LUWORKERS/32)+1)*4);
 		memset(&spec->luworker_waiting, 0, sizeof(spec->luworker_waiting));
@@ -1098,6 +1202,8 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 			spec->pr_keys[j].registered_initiator_port = NULL;
 		}
 		spec->pr_generation = 0;
+		spec->pr_index_epoch = 0;
+		istgt_lu_disk_pr_changed(spec);
 		spec->rsv_port = NULL;
 		spec->rsv_key = 0;
 		spec->rsv_scope = 0;
@@ -1322,22 +1428,24 @@ error_return:
 
 				gb_size = spec->size / ISTGT_LU_1GB;
 				mb_size = (spec->size % ISTGT_LU_1GB) / ISTGT_LU_1MB;
-				printf("LU%d: LUN%d %s: storage_online %s [%s, %luGB.%luMB, %lu blks of %lu bytes, phy:%u/%u %s%s%s%s%s%s%s%s rpm:%d] q:%d thr:%d/%d [%ld.%ld, %ld.%ld]\n",
+				printf("LU%d: LUN%d %s: storage_online %s [%s, %luGB.%luMB, %lu blks of %lu bytes, phy:%u/%u %s%s%s%s%s%s%s%s%s rpm:%d] q:%d thr:%d/%d [%ld.%ld, %ld.%ld]\n",
 					lu->num, i, lu->name ? lu->name : "-", lu->readonly ? "readonly " : "",
 					spec->file, gb_size, mb_size, spec->blockcnt, spec->blocklen, spec->rshift, spec->rshiftreal,
 					spec->readcache ? "" : "RCD", spec->writecache ? " WCE" : "",
 					spec->ats ? " ATS" : "", spec->xcopy ? " XCOPY" : "", spec->unmap ? " UNMAP" : "",
 					spec->wsame ? " WSAME" : "", spec->dpofua ? " DPOFUA" : "",
 					spec->wzero ? " WZERO" : "",
+					spec->uring_ctx != NULL ? " URING" : "",
 					rpm, spec->queue_depth, spec->luworkers, spec->luworkersActive,
 					_s1.tv_sec, _s1.tv_nsec, _s2.tv_sec, _s2.tv_nsec);
-				ISTGT_LOG("LU%d: LUN%d %s: storage_online %s [%s, %luGB.%luMB, %lu blks of %lu bytes, phy:%u/%u %s%s%s%s%s%s%s%s rpm:%d] q:%d thr:%d/%d [%ld.%ld, %ld.%ld]\n",
+				ISTGT_LOG("LU%d: LUN%d %s: storage_online %s [%s, %luGB.%luMB, %lu blks of %lu bytes, phy:%u/%u %s%s%s%s%s%s%s%s%s rpm:%d] q:%d thr:%d/%d [%ld.%ld, %ld.%ld]\n",
 					lu->num, i, lu->name ? lu->name : "-", lu->readonly ? "readonly " : "",
 					spec->file, gb_size, mb_size, spec->blockcnt, spec->blocklen, spec->rshift, spec->rshiftreal,
 					spec->readcache ? "" : "RCD", spec->writecache ? " WCE" : "",
 					spec->ats ? " ATS" : "",spec->xcopy ? " XCOPY" : "", spec->unmap ? " UNMAP" : "",
 					spec->wsame ? " WSAME" : "", spec->dpofua ? " DPOFUA" : "",
 					spec->wzero ? " WZERO" : "",
+					spec->uring_ctx != NULL ? " URING" : "",
 					rpm, spec->queue_depth, spec->luworkers, spec->luworkersActive,
 					_s1.tv_sec, _s1.tv_nsec, _s2.tv_sec, _s2.tv_nsec);
 			}
@@ -1525,7 +1633,11 @@ istgt_lu_disk_shutdown(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr
 
 #ifdef	REPLICATION
 		destroy_volume(spec);
+		pthread_mutex_destroy(&spec->wc_mutex);
+		pthread_cond_destroy(&spec->wc_cond);
 #endif
+		istgt_lu_disk_rcache_destroy(spec);
+		istgt_lu_qos_destroy(spec);
 		for ( i=0; i < lu->luworkers; i++ ) {
 			rc = pthread_mutex_destroy(&spec->luworker_mutex[i]);
 			rc = pthread_cond_destroy(&spec->luworker_cond[i]);
@@ -3002,6 +3114,9 @@ istgt_lu_disk_transfer_data(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, size_t len)
 {
 	int rc;
 
+	/* gathered by the connection before the task was queued */
+	if (lu_cmd->iobufsize >= len)
+		return 0;
 	if (lu_cmd->lu->queue_depth == 0) {
 		rc = istgt_iscsi_transfer_out(conn, lu_cmd, len);
 		if (rc < 0) {
@@ -3474,6 +3589,45 @@ istgt_lu_disk_free_pr_key(ISTGT_LU_PR_KEY *prkey)
 	prkey->ninitiator_ports = 0;
 }
 
+#if MAX_LU_RESERVE > ISTGT_SIDX_SLOTS
+#error "pr_index cannot cover MAX_LU_RESERVE registrations"
+#endif
+
+static uint32_t istgt_lu_disk_pr_epoch_seq = 0;
+
+/*
+ * To be called with pr_rsv_mutex held once registrations or the
+ * reservation changed; the index is rebuilt on the next lookup and PR
+ * verdicts cached by connections go stale.
+ */
+void
+istgt_lu_disk_pr_changed(ISTGT_LU_DISK *spec)
+{
+	uint32_t epoch;
+
+	do {
+		epoch = __sync_add_and_fetch(&istgt_lu_disk_pr_epoch_seq, 1);
+	} while (epoch == 0);
+	spec->pr_epoch = epoch;
+}
+
+static void
+istgt_lu_disk_pr_index(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_PR_KEY *prkey;
+	int i;
+
+	istgt_sidx_reset(&spec->pr_index);
+	for (i = 0; i < spec->npr_keys; i++) {
+		prkey = &spec->pr_keys[i];
+		if (prkey->registered_initiator_port == NULL)
+			continue;
+		istgt_sidx_add(&spec->pr_index, i,
+		    istgt_sidx_hash(prkey->registered_initiator_port));
+	}
+	spec->pr_index_epoch = spec->pr_epoch;
+}
+
 static ISTGT_LU_PR_KEY *
 istgt_lu_disk_find_pr_key(ISTGT_LU_DISK *spec, const char *initiator_port, const char *target_port, uint64_t key)
 {
@@ -3489,10 +3643,16 @@ istgt_lu_disk_find_pr_key(ISTGT_LU_DISK *spec, const char *initiator_port, const
 
 	if (initiator_port == NULL)
 		return NULL;
-	for (i = 0; i < spec->npr_keys; i++) {
+	if (spec->pr_index_epoch != spec->pr_epoch)
+		istgt_lu_disk_pr_index(spec);
+	/*
+	 * Only the initiator port is hashed, a registration made with
+	 * ALL_TG_PT or a lookup without target port matches any of them.
+	 */
+	for (i = istgt_sidx_first(&spec->pr_index,
+		istgt_sidx_hash(initiator_port));
+	    i >= 0; i = istgt_sidx_next(&spec->pr_index, i)) {
 		prkey = &spec->pr_keys[i];
-		if (prkey == NULL)
-			continue;
 #ifdef ISTGT_TRACE_DISK
 		if (key != 0) {
 			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
@@ -3586,6 +3746,7 @@ istgt_lu_disk_remove_other_pr_key(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute
 		}
 		spec->npr_keys--;
 	}
+	istgt_lu_disk_pr_changed(spec);
 	return 0;
 }
 
@@ -3649,6 +3810,7 @@ istgt_lu_disk_remove_pr_key(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__
 		}
 		spec->npr_keys--;
 	}
+	istgt_lu_disk_pr_changed(spec);
 	return 0;
 }
 
@@ -3698,7 +3860,6 @@ istgt_lu_parse_transport_id(char **tid, uint8_t *data, int len)
 	return hlen + plen;
 }
 
-#ifndef	REPLICATION
 static int
 istgt_lu_disk_scsi_persistent_reserve_in(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused__)), ISTGT_LU_CMD_Ptr lu_cmd, int sa, uint8_t *data, int alloc_len __attribute__((__unused__)))
 {
@@ -3850,7 +4011,6 @@ istgt_lu_disk_scsi_persistent_reserve_in(ISTGT_LU_DISK *spec, CONN_Ptr conn __at
 	lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
 	return total;
 }
-#endif
 
 static int
 istgt_lu_disk_update_reservation(ISTGT_LU_DISK *spec)
@@ -3885,8 +4045,7 @@ istgt_lu_disk_update_reservation(ISTGT_LU_DISK *spec)
 	pr_reservation->pr_generation =  spec->pr_generation;
 	pr_reservation->rsv_key =  spec->rsv_key;
 	if(spec->rsv_port)
-		strncpy(pr_reservation->rsv_port, spec->rsv_port, sizeof(pr_reservation->rsv_port) - 1);
-	pr_reservation->rsv_port[sizeof(pr_reservation->rsv_port) - 1] = '\0';
+		snprintf(pr_reservation->rsv_port, sizeof(pr_reservation->rsv_port), "%s", spec->rsv_port);
 	for(i = 0; i < spec->npr_keys; i++) {
 		if(spec->pr_keys[i].key == spec->rsv_key) {
 			rsv_idx = i;
@@ -3910,10 +4069,12 @@ istgt_lu_disk_update_reservation(ISTGT_LU_DISK *spec)
 		if (prkey != NULL ) { 
 			/* copy the string */
 			pr_reservation->keys[i].key = prkey->key;
-			strncpy(pr_reservation->keys[i].registered_initiator_port, prkey->registered_initiator_port,
-				((strlen(prkey->registered_initiator_port) + 1) > MAX_INITIATOR_NAME ? MAX_INITIATOR_NAME : (strlen(prkey->registered_initiator_port) + 1)));
-			strncpy(pr_reservation->keys[i].registered_target_port, prkey->registered_target_port,
-				((strlen(prkey->registered_target_port) + 1) > MAX_TARGET_NAME ? MAX_TARGET_NAME : (strlen(prkey->registered_target_port) + 1)));
+			snprintf(pr_reservation->keys[i].registered_initiator_port,
+				sizeof(pr_reservation->keys[i].registered_initiator_port), "%s",
+				prkey->registered_initiator_port);
+			snprintf(pr_reservation->keys[i].registered_target_port,
+				sizeof(pr_reservation->keys[i].registered_target_port), "%s",
+				prkey->registered_target_port);
 			pr_reservation->keys[i].pg_idx= prkey->pg_idx;
 			pr_reservation->keys[i].pg_tag = prkey->pg_tag;
 			pr_reservation->keys[i].all_tpg = prkey->all_tpg;
@@ -3935,6 +4096,14 @@ istgt_lu_disk_update_reservation(ISTGT_LU_DISK *spec)
 		}
 		goto exit;
 	}
+	#else
+	/* kept on the replicas, acked by consistency_factor of them */
+	if (istgt_lu_pr_persist(spec, pr_reservation, sizeof (*pr_reservation)) != 0) {
+		ISTGT_ERRLOG("LU%d:RSV-UPD  replicas failed  (rsvkey:%lx)",
+			luni, spec->rsv_key);
+		ret = -1;
+		goto exit;
+	}
 	#endif
 #endif
 
@@ -3945,10 +4114,47 @@ exit:
 
 }
 
+/*
+ * The blob comes back from the replicas as opaque bytes; make sure the
+ * key count fits what was read and every port string ends in its field.
+ */
+static int
+istgt_lu_disk_pr_data_valid(const SCSI_PR_DATA *pr_reservation, uint64_t len)
+{
+	int i;
+
+	if (len == 0)
+		return 1;
+	if (len < offsetof(SCSI_PR_DATA, keys))
+		return 0;
+	if (pr_reservation->npr_keys < 0 ||
+	    pr_reservation->npr_keys > MAX_LU_ZAP_RESERVE)
+		return 0;
+	if (len < offsetof(SCSI_PR_DATA, keys) +
+	    (uint64_t)pr_reservation->npr_keys * sizeof (SCSI_PR_KEY))
+		return 0;
+	if (strnlen(pr_reservation->rsv_port, sizeof (pr_reservation->rsv_port)) ==
+	    sizeof (pr_reservation->rsv_port))
+		return 0;
+	for (i = 0; i < pr_reservation->npr_keys; i++) {
+		const SCSI_PR_KEY *prkey = &pr_reservation->keys[i];
+		if (strnlen(prkey->registered_initiator_port,
+		    sizeof (prkey->registered_initiator_port)) ==
+		    sizeof (prkey->registered_initiator_port))
+			return 0;
+		if (strnlen(prkey->registered_target_port,
+		    sizeof (prkey->registered_target_port)) ==
+		    sizeof (prkey->registered_target_port))
+			return 0;
+	}
+	return 1;
+}
+
 int
 istgt_lu_disk_get_reservation(ISTGT_LU_DISK *spec)
 {
 	int  ret = 0, i = 0, rsv_idx = -1;
+	uint64_t pr_len = sizeof (SCSI_PR_DATA);
 	SCSI_PR_DATA  *pr_reservation = NULL;
 	SCSI_PR_KEY *prkey = NULL;
 	if(spec == NULL)
@@ -3981,10 +4187,20 @@ istgt_lu_disk_get_reservation(ISTGT_LU_DISK *spec)
 		}
 		goto exit;
 	}
+	#else
+	/* as last read back from or stored on the replicas */
+	pr_len = istgt_lu_pr_fetch(spec, pr_reservation, sizeof (*pr_reservation));
 	#endif
 #endif
 
 	spec->rsv_pending &= ~ISTGT_RSV_READ;
+	if (!istgt_lu_disk_pr_data_valid(pr_reservation, pr_len)) {
+		ISTGT_ERRLOG("LU%d:RSV-READ  malformed reservation data (len:%lu npr:%d), ignored",
+			luni, pr_len, pr_reservation->npr_keys);
+		spec->npr_keys = 0;
+		ret = -1;
+		goto exit;
+	}
 	pr_reservation = (SCSI_PR_DATA *)pr_reservation;
 
 	/* Update the spec with the Reservation data */
@@ -4035,6 +4251,7 @@ istgt_lu_disk_get_reservation(ISTGT_LU_DISK *spec)
 	}
 
 exit:
+	istgt_lu_disk_pr_changed(spec);
 	if(pr_reservation)
 		xfree(pr_reservation);
 	return ret;
@@ -4086,6 +4303,7 @@ istgt_lu_disk_copy_reservation(ISTGT_LU_DISK *spec_bkp, ISTGT_LU_DISK *spec)
 		}
 		
 	}
+	istgt_lu_disk_pr_changed(spec_bkp);
 	return 0;	
 }
 
@@ -4535,6 +4753,7 @@ istgt_lu_disk_scsi_persistent_reserve_out(ISTGT_LU_DISK *spec,
 			istgt_lu_disk_free_pr_key(prkey);
 		}
 		spec->npr_keys = 0;
+		istgt_lu_disk_pr_changed(spec);
 		break;
 
 	case 0x04: /* PREEMPT */
@@ -5038,6 +5257,7 @@ do_register:
 				prkey->all_tpg = (all_tg_pt) ? 1 : 0;
 			}
 			spec->npr_keys = idx + nports;
+			istgt_lu_disk_pr_changed(spec);
 		}
 
 		idx = spec->npr_keys;
@@ -5079,6 +5299,7 @@ do_register:
 		/* count up keys */
 		idx++;
 		spec->npr_keys = idx;
+		istgt_lu_disk_pr_changed(spec);
 
 		/* update generation */
 		spec->pr_generation++;
@@ -5149,15 +5370,16 @@ cleanup_return:
 	return ret;
 }
 
-int
-istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow)
+/* PR_ALLOW bits the I_T nexus of conn is granted under the reservation */
+static uint32_t
+istgt_lu_disk_pr_allowed(ISTGT_LU_DISK *spec, CONN_Ptr conn)
 {
 	ISTGT_LU_PR_KEY *prkey;
 
 #ifdef ISTGT_TRACE_DISK
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-	    "RSV_KEY=0x%16.16"PRIx64", RSV_TYPE=0x%x, PR_ALLOW=0x%x\n",
-	    spec->rsv_key, spec->rsv_type, pr_allow);
+	    "RSV_KEY=0x%16.16"PRIx64", RSV_TYPE=0x%x\n",
+	    spec->rsv_key, spec->rsv_type);
 #endif /* ISTGT_TRACE_DISK */
 
 	prkey = istgt_lu_disk_find_pr_key(spec, conn->initiator_port,
@@ -5171,26 +5393,15 @@ istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow)
 
 		if (spec->rsv_key == prkey->key) {
 			/* reservation holder */
-			return 0;
+			return PR_ALLOW_ANY;
 		}
 
 		switch (spec->rsv_type) {
 		case ISTGT_LU_PR_TYPE_WRITE_EXCLUSIVE_ALL_REGISTRANTS:
-			if (pr_allow & PR_ALLOW_ALLRR)
-				return 0;
-			return -1;
 		case ISTGT_LU_PR_TYPE_EXCLUSIVE_ACCESS_ALL_REGISTRANTS:
-			if (pr_allow & PR_ALLOW_ALLRR)
-				return 0;
-			return -1;
 		case ISTGT_LU_PR_TYPE_WRITE_EXCLUSIVE_REGISTRANTS_ONLY:
-			if (pr_allow & PR_ALLOW_ALLRR)
-				return 0;
-			return -1;
 		case ISTGT_LU_PR_TYPE_EXCLUSIVE_ACCESS_REGISTRANTS_ONLY:
-			if (pr_allow & PR_ALLOW_ALLRR)
-				return 0;
-			return -1;
+			return PR_ALLOW_ALLRR;
 		}
 	} else {
 #ifdef ISTGT_TRACE_DISK
@@ -5201,21 +5412,11 @@ istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow)
 
 		switch (spec->rsv_type) {
 		case ISTGT_LU_PR_TYPE_WRITE_EXCLUSIVE_ALL_REGISTRANTS:
-			if (pr_allow & PR_ALLOW_WERR)
-				return 0;
-			return -1;
 		case ISTGT_LU_PR_TYPE_WRITE_EXCLUSIVE_REGISTRANTS_ONLY:
-			if (pr_allow & PR_ALLOW_WERR)
-				return 0;
-			return -1;
+			return PR_ALLOW_WERR;
 		case ISTGT_LU_PR_TYPE_EXCLUSIVE_ACCESS_ALL_REGISTRANTS:
-			if (pr_allow & PR_ALLOW_EARR)
-				return 0;
-			return -1;
 		case ISTGT_LU_PR_TYPE_EXCLUSIVE_ACCESS_REGISTRANTS_ONLY:
-			if (pr_allow & PR_ALLOW_EARR)
-				return 0;
-			return -1;
+			return PR_ALLOW_EARR;
 		}
 	}
 
@@ -5225,16 +5426,46 @@ istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow)
 	/* any I_T nexus */
 	switch (spec->rsv_type) {
 	case ISTGT_LU_PR_TYPE_WRITE_EXCLUSIVE:
-		if (pr_allow & PR_ALLOW_WE)
-			return 0;
-		return -1;
+		return PR_ALLOW_WE;
 	case ISTGT_LU_PR_TYPE_EXCLUSIVE_ACCESS:
-		if (pr_allow & PR_ALLOW_EA)
-			return 0;
-		return -1;
+		return PR_ALLOW_EA;
 	}
 
 	/* NG */
+	return 0;
+}
+
+/*
+ * Called for every IO while a reservation exists.  The verdict for the
+ * connection's I_T nexus is worked out once per pr_epoch under
+ * pr_rsv_mutex, after that the check is a compare of the cached epoch.
+ */
+int
+istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow)
+{
+	volatile uint64_t *slot;
+	uint64_t verdict;
+	uint32_t allowed;
+
+	slot = &conn->pr_verdict[spec->lun & (ISTGT_PR_VERDICTS - 1)];
+	verdict = *slot;
+	if ((uint32_t)(verdict >> 32) != spec->pr_epoch) {
+		MTX_LOCK(&spec->pr_rsv_mutex);
+		allowed = istgt_lu_disk_pr_allowed(spec, conn);
+		verdict = ((uint64_t)spec->pr_epoch << 32) | allowed;
+		MTX_UNLOCK(&spec->pr_rsv_mutex);
+		*slot = verdict;
+	}
+	allowed = (uint32_t)verdict;
+
+#ifdef ISTGT_TRACE_DISK
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+	    "RSV_KEY=0x%16.16"PRIx64", PR_ALLOW=0x%x, allowed=0x%x\n",
+	    spec->rsv_key, pr_allow, allowed);
+#endif /* ISTGT_TRACE_DISK */
+
+	if (allowed == PR_ALLOW_ANY || (pr_allow & allowed) != 0)
+		return 0;
 	return -1;
 }
 
@@ -5441,6 +5672,7 @@ istgt_lu_disk_unmap(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd,
 			ret = ioctl(spec->fd, DIOCGDELETE, unmbd);
 			#endif
 #endif
+			istgt_lu_disk_rcache_invalidate(spec, lba, lblen);
 
 			exitblockingcall(endofmacro2)
 			if (markedForFree == 1 || markedForReturn == 1) {
@@ -5585,6 +5817,141 @@ istgt_lu_disk_scsi_reserve(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 	return 0;
 }
 
+#ifndef	REPLICATION
+#define	ISTGT_LU_CMD_TASK(lu_cmd)					\
+	((ISTGT_LU_TASK_Ptr)(void *)((uint8_t *)(lu_cmd) -		\
+	    offsetof(ISTGT_LU_TASK, lu_cmd)))
+
+/*
+ * Completion of a READ/WRITE armed by lbread/lbwrite, called from the
+ * io_uring reaper.  Finishes what lbread/lbwrite, execute and the
+ * luworker would have done after a synchronous IO and answers the
+ * command.
+ */
+static void
+istgt_lu_disk_uring_task_done(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io)
+{
+	ISTGT_LU_TASK_Ptr lu_task = io->arg;
+	ISTGT_LU_CMD_Ptr lu_cmd = &lu_task->lu_cmd;
+	CONN_Ptr conn = lu_task->conn;
+	ISTGT_QUEUE_Ptr r_ptr;
+	int i, rc, gone = 0, kick;
+
+	/* exitblockingcall */
+	MTX_LOCK(&spec->state_mutex);
+	--(spec->ludsk_ref);
+	MTX_UNLOCK(&spec->state_mutex);
+	MTX_LOCK(&conn->diskioflag_mutex);
+	--(conn->diskIoPending);
+	if (conn->flagDelayedFree == 1 && conn->diskIoPending == 0)
+		gone = 1;
+	MTX_UNLOCK(&conn->diskioflag_mutex);
+	timediffw(lu_cmd, 'D');
+
+	if (io->opcode == ISTGT_LU_URING_READ) {
+		if (io->res == (int64_t) io->nbytes) {
+			lu_cmd->data_len = io->res;
+			istgt_lu_disk_rcache_fill(spec, lu_task->io_lba,
+			    lu_task->io_lblen, lu_cmd->data,
+			    &lu_task->rcache_ticket);
+		} else {
+			errlog(lu_cmd, "c#%d lu_disk_read() failed errno:%d (%lu+%lu)", conn->id, (int) -io->res, io->offset, io->nbytes)
+			lu_cmd->data_len = 0;
+			lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+			/* UNRECOVERED READ ERROR */
+			BUILD_SENSE(MEDIUM_ERROR, 0x11, 0x00);
+		}
+	} else {
+		istgt_lu_disk_rcache_invalidate(spec, lu_task->io_lba,
+		    lu_task->io_lblen);
+		for (i = 0; i < io->iovcnt; i++) {
+			xfree(lu_cmd->iobuf[i].iov_base);
+			lu_cmd->iobuf[i].iov_base = NULL;
+			lu_cmd->iobuf[i].iov_len = 0;
+		}
+		lu_cmd->iobufsize = 0;
+		lu_cmd->iobufindx = -1;
+		if (io->res == (int64_t) io->nbytes) {
+			lu_cmd->data_len = io->res;
+		} else {
+			errlog(lu_cmd, "c#%d lu_disk_write() failed errno:%d (%lu+%lu)", conn->id, (int) -io->res, io->offset, io->nbytes)
+			lu_cmd->data_len = 0;
+			lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+			/* WRITE ERROR */
+			BUILD_SENSE(MEDIUM_ERROR, 0x0c, 0x00);
+		}
+	}
+	if (lu_cmd->status == ISTGT_SCSI_STATUS_CHECK_CONDITION) {
+		MTX_LOCK(&spec->state_mutex);
+		if (IS_SPEC_BUSY(spec))
+			lu_cmd->status = ISTGT_SCSI_STATUS_BUSY;
+		MTX_UNLOCK(&spec->state_mutex);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d CSN:%x %s %"PRId64"/%"PRIu64" bytes (lba:%lu+%u) uring\n",
+	    conn->id, lu_cmd->CmdSN, io->opcode == ISTGT_LU_URING_READ ? "Read" : "Wrote",
+	    io->res, io->nbytes, lu_task->io_lba, lu_task->io_lblen);
+
+	/* the rest of INFLIGHT_IO_CLEANUP, the luworker was released */
+	MTX_LOCK(&conn->result_queue_mutex);
+	MTX_LOCK(&spec->complete_queue_mutex);
+	istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+	lu_task->complete_queue_ptr = NULL;
+	conn->inflight--;
+	kick = (spec->schdler_cmd_waiting == 1);
+	MTX_UNLOCK(&spec->complete_queue_mutex);
+	if (kick)
+		pthread_cond_signal(&spec->cmd_queue_cond);
+
+	if (lu_cmd->aborted == 1 || gone) {
+		MTX_UNLOCK(&conn->result_queue_mutex);
+		if (gone) {
+			lu_cmd->connGone = 1;
+			ISTGT_ERRLOG("c#%d connGone, CSN:%x dropped\n",
+			    conn->id, lu_cmd->CmdSN);
+		} else {
+			ISTGT_LOG("CmdSN %d aborted in inflight", lu_cmd->CmdSN);
+		}
+		istgt_lu_destroy_task(lu_task);
+		return;
+	}
+	r_ptr = istgt_queue_enqueue(&conn->result_queue, lu_task);
+	if (r_ptr == NULL) {
+		MTX_UNLOCK(&conn->result_queue_mutex);
+		ISTGT_ERRLOG("c#%d rsltq uring failed CSN:%x\n", conn->id,
+		    lu_cmd->CmdSN);
+		istgt_lu_destroy_task(lu_task);
+		return;
+	}
+	lu_cmd->flags |= ISTGT_RESULT_Q_ENQUEUED;
+	rc = istgt_iscsi_result_notify(conn);
+	MTX_UNLOCK(&conn->result_queue_mutex);
+	if (rc != 0)
+		ISTGT_ERRLOG("c#%d rsltq uring bcast failed\n", conn->id);
+}
+
+/* arms lu_cmd's READ/WRITE, the luworker submits it after execute */
+static void
+istgt_lu_disk_uring_arm(ISTGT_LU_DISK *spec, ISTGT_LU_CMD_Ptr lu_cmd,
+    int opcode, struct iovec *iov, int iovcnt, uint64_t offset,
+    uint64_t nbytes, uint64_t lba, uint32_t len)
+{
+	ISTGT_LU_TASK_Ptr lu_task = ISTGT_LU_CMD_TASK(lu_cmd);
+	ISTGT_LU_DISK_URING_IO *io = &lu_task->uring_io;
+
+	io->opcode = opcode;
+	io->iov = iov;
+	io->iovcnt = iovcnt;
+	io->offset = offset;
+	io->nbytes = nbytes;
+	io->done = istgt_lu_disk_uring_task_done;
+	io->arg = lu_task;
+	lu_task->io_lba = lba;
+	lu_task->io_lblen = len;
+	istgt_lu_disk_uring_prepare(spec, io);
+	lu_cmd->flags |= ISTGT_URING_ARMED;
+}
+#endif /* !REPLICATION */
+
 static int
 istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused__)), ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len)
 {
@@ -5596,7 +5963,10 @@ istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused_
 	int64_t rc = 0;
 #ifndef REPLICATION
 	uint8_t *data;
+	ISTGT_LU_TASK_Ptr lu_task;
 #endif
+	uint8_t *cached;
+	ISTGT_LU_RCACHE_TICKET ticket;
 	int diskIoPendingL = 0, markedForFree = 0;
 	int markedForReturn = 0;
 
@@ -5649,11 +6019,45 @@ istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused_
 	timediffw(lu_cmd, 'w');
 
 #ifdef REPLICATION
-	rc = replicate(spec, lu_cmd, offset, nbytes);
+	/* a volume that is not ready fails reads, don't serve them cached */
+	if (!spec->ready) {
+		ticket.nstripes = 0;
+		cached = NULL;
+	} else
+#endif
+	cached = istgt_lu_disk_rcache_lookup(spec, lba, len, &ticket);
+	if (cached != NULL) {
+		rc = nbytes;
+#ifdef REPLICATION
+		lu_cmd->data = cached;
+		lu_cmd->data_len = rc;
 #else
-	data = xmalloc(nbytes);
-	rc = pread(spec->fd, data, nbytes, offset);
+		data = cached;
 #endif
+	} else {
+#ifdef REPLICATION
+		rc = replicate(spec, lu_cmd, offset, nbytes);
+#else
+		data = xmalloc(nbytes);
+		if (spec->uring_ctx != NULL
+		    && (lu_cmd->flags & ISTGT_URING_ALLOWED)) {
+			/* blocking call is left by istgt_lu_disk_uring_task_done() */
+			lu_task = ISTGT_LU_CMD_TASK(lu_cmd);
+			lu_task->uring_io.iov1.iov_base = data;
+			lu_task->uring_io.iov1.iov_len = nbytes;
+			lu_task->rcache_ticket = ticket;
+			istgt_lu_disk_uring_arm(spec, lu_cmd, ISTGT_LU_URING_READ,
+			    &lu_task->uring_io.iov1, 1, offset, nbytes, lba, len);
+			lu_cmd->data = data;
+			lu_cmd->data_len = 0;
+			return 0;
+		}
+		if (spec->uring_ctx != NULL)
+			rc = istgt_lu_disk_uring_pread(spec, data, nbytes, offset);
+		else
+			rc = pread(spec->fd, data, nbytes, offset);
+#endif
+	}
 	timediffw(lu_cmd, 'D');
 
 	exitblockingcall(endofmacro2)
@@ -5675,15 +6079,175 @@ istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused_
 		errlog(lu_cmd, "c#%d lu_disk_read() failed errnor:%d read:%ld (%lu+%lu, lba:%lu+%u)", conn->id, errno, rc, offset, nbytes, lba, len)
 		return -1;
 	}
-	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d Read %"PRId64"/%"PRIu64" bytes (lba:%lu+%u)\n",
-	    conn->id, rc, nbytes, lba, len);
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d Read %"PRId64"/%"PRIu64" bytes (lba:%lu+%u)%s\n",
+	    conn->id, rc, nbytes, lba, len, cached != NULL ? " cached" : "");
 
 #ifndef REPLICATION
 	lu_cmd->data = data;
 	lu_cmd->data_len = rc;
 #endif
+	if (cached == NULL)
+		istgt_lu_disk_rcache_fill(spec, lba, len, lu_cmd->data,
+		    &ticket);
 	return 0;
 }
+#ifdef	REPLICATION
+/*
+ * Write coalescing (WriteCoalesceWindow/WriteCoalesceMax in the LU section).
+ *
+ * A luworker about to replicate a plain write opens a batch and, if other
+ * commands are in flight on the LU, waits up to wc_window_us for luworkers
+ * carrying LBA-contiguous writes to join it.  The leader replicates the
+ * whole range as a single IO built from the members' buffers and hands the
+ * result back to every member, each of which then completes its own task.
+ * Overlapping commands never run concurrently (see the blocked queue), so
+ * members are always disjoint.
+ */
+#define	ISTGT_LU_WC_MAX_IOV	(ISTGT_IOV_MAX - 1)	/* + replica header */
+
+typedef struct istgt_lu_wbatch_t {
+	uint64_t offset;
+	uint64_t nbytes;
+	int iovcnt;
+	int nmembers;
+	int refs;
+	int sealed;
+	int done;
+	int64_t rc;
+	ISTGT_LU_CMD_Ptr members[ISTGT_MAX_NUM_LUWORKERS];
+} ISTGT_LU_WBATCH;
+
+static int
+istgt_lu_disk_wc_eligible(ISTGT_LU_DISK *spec, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	if (spec->wc_window_us == 0)
+		return 0;
+	switch (lu_cmd->cdb0) {
+	case SBC_WRITE_6:
+	case SBC_WRITE_10:
+	case SBC_WRITE_12:
+	case SBC_WRITE_16:
+		break;
+	default:
+		return 0;
+	}
+	if (lu_cmd->fua)
+		return 0;
+	if (lu_cmd->Attr_bit == ISTGT_TAG_ORDERED ||
+	    lu_cmd->Attr_bit == ISTGT_TAG_HEAD_OF_QUEUE ||
+	    lu_cmd->Attr_bit == ISTGT_TAG_ACA)
+		return 0;
+	if (lu_cmd->iobufsize >= spec->wc_max_bytes)
+		return 0;
+	return 1;
+}
+
+static int64_t
+istgt_lu_disk_coalesce_write(ISTGT_LU_DISK *spec, ISTGT_LU_CMD_Ptr lu_cmd,
+    uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_WBATCH batch, *b;
+	ISTGT_LU_CMD_Ptr m;
+	struct timespec abstime;
+	uint64_t saved_size;
+	int iovcnt = lu_cmd->iobufindx + 1;
+	int i, j, k, rc;
+	int64_t ret;
+
+	MTX_LOCK(&spec->wc_mutex);
+	b = spec->wc_open;
+	if (b != NULL && !b->sealed && b->offset + b->nbytes == offset &&
+	    b->nbytes + nbytes <= spec->wc_max_bytes &&
+	    b->iovcnt + iovcnt <= ISTGT_LU_WC_MAX_IOV) {
+		/* join, the leader writes our buffers along with its own */
+		b->members[b->nmembers++] = lu_cmd;
+		b->nbytes += nbytes;
+		b->iovcnt += iovcnt;
+		b->refs++;
+		pthread_cond_broadcast(&spec->wc_cond);
+		while (!b->done)
+			pthread_cond_wait(&spec->wc_cond, &spec->wc_mutex);
+		ret = (b->rc < 0) ? b->rc : (int64_t) nbytes;
+		if (--b->refs == 0)
+			pthread_cond_broadcast(&spec->wc_cond);
+		MTX_UNLOCK(&spec->wc_mutex);
+		return ret;
+	}
+	if (b != NULL || (spec->inflight <= 1 &&
+	    istgt_queue_count(&spec->cmd_queue) == 0)) {
+		/* nothing to join and nobody around to join us */
+		MTX_UNLOCK(&spec->wc_mutex);
+		return replicate(spec, lu_cmd, offset, nbytes);
+	}
+
+	memset(&batch, 0, sizeof (batch));
+	batch.offset = offset;
+	batch.nbytes = nbytes;
+	batch.iovcnt = iovcnt;
+	spec->wc_open = &batch;
+
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_nsec += (long) spec->wc_window_us * 1000;
+	if (abstime.tv_nsec >= SEC_IN_NS) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= SEC_IN_NS;
+	}
+	/* stop early once everybody else in flight has joined */
+	while (batch.nbytes < spec->wc_max_bytes &&
+	    batch.iovcnt < ISTGT_LU_WC_MAX_IOV &&
+	    (spec->inflight > batch.nmembers + 1 ||
+	    istgt_queue_count(&spec->cmd_queue) != 0)) {
+		rc = pthread_cond_timedwait(&spec->wc_cond, &spec->wc_mutex,
+		    &abstime);
+		if (rc == ETIMEDOUT)
+			break;
+	}
+	batch.sealed = 1;
+	spec->wc_open = NULL;
+	MTX_UNLOCK(&spec->wc_mutex);
+
+	if (batch.nmembers != 0 &&
+	    ISTGT_SGL_RESERVE(lu_cmd, batch.iovcnt) < 0) {
+		ISTGT_ERRLOG("LU%d: no memory for %d segments\n",
+		    spec->lu->num, batch.iovcnt);
+		ret = -1;
+	} else if (batch.nmembers == 0) {
+		ret = replicate(spec, lu_cmd, offset, nbytes);
+	} else {
+		/* replicate() takes ownership of all buffers, as for one write */
+		k = iovcnt;
+		for (i = 0; i < batch.nmembers; i++) {
+			m = batch.members[i];
+			for (j = 0; j <= m->iobufindx; j++)
+				lu_cmd->iobuf[k++] = m->iobuf[j];
+		}
+		saved_size = lu_cmd->iobufsize;
+		lu_cmd->iobufindx = k - 1;
+		lu_cmd->iobufsize = batch.nbytes;
+		ret = replicate(spec, lu_cmd, offset, batch.nbytes);
+		for (i = iovcnt; i < k; i++) {
+			lu_cmd->iobuf[i].iov_base = NULL;
+			lu_cmd->iobuf[i].iov_len = 0;
+		}
+		lu_cmd->iobufindx = iovcnt - 1;
+		lu_cmd->iobufsize = saved_size;
+		if (ret >= 0)
+			ret = (int64_t) nbytes;
+		__sync_add_and_fetch(&spec->wc_batches, 1);
+		__sync_add_and_fetch(&spec->wc_merged, batch.nmembers);
+	}
+
+	MTX_LOCK(&spec->wc_mutex);
+	batch.rc = ret;
+	batch.done = 1;
+	pthread_cond_broadcast(&spec->wc_cond);
+	while (batch.refs > 0)
+		pthread_cond_wait(&spec->wc_cond, &spec->wc_mutex);
+	MTX_UNLOCK(&spec->wc_mutex);
+	return ret;
+}
+#endif
+
 static int
 istgt_lu_disk_lbwrite(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len)
 {
@@ -5697,13 +6261,15 @@ istgt_lu_disk_lbwrite(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cm
 	unsigned long nthbitset = 0;
 	int64_t rc = 0;
 	int iovcnt;
-	struct iovec iov[40];
+	struct iovec iov_inl[ISTGT_SGL_INLINE];
+	struct iovec *iov = iov_inl;
 	int diskIoPendingL = 0, markedForFree = 0;
 	int markedForReturn = 0;
 	const char *msg = "write";
 	int i;
 #ifndef	REPLICATION
 	uint64_t actual;
+	int first, cnt;
 #endif
 
 	if (len == 0) {
@@ -5730,6 +6296,14 @@ istgt_lu_disk_lbwrite(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cm
 	}
 
 	iovcnt = lu_cmd->iobufindx+1;
+	if (iovcnt > ISTGT_SGL_INLINE) {
+		iov = xmalloc(sizeof (*iov) * iovcnt);
+		if (iov == NULL) {
+			ISTGT_ERRLOG("c#%d no memory for %d segments (write lba:%lu+%u)\n",
+			    conn->id, iovcnt, lba, len);
+			return -1;
+		}
+	}
 	//memcpy(&iov[0], &lu_cmd->iobuf[0], sizeof(iov));
 	for (i=0; i<iovcnt; ++i) {
 		iov[i].iov_base = lu_cmd->iobuf[i].iov_base;
@@ -5752,6 +6326,8 @@ freeiovcnt:
 				xfree(iov[i].iov_base);
 			iov[i].iov_base = NULL;
 		}
+		if (iov != iov_inl)
+			xfree(iov);
 
 		if (markedForReturn == 2)
 			errno = EBUSY;
@@ -5810,12 +6386,33 @@ freeiovcnt:
 #endif
 	} else {
 #ifdef REPLICATION
-		rc = replicate(spec, lu_cmd, offset, nbytes);
+		if (istgt_lu_disk_wc_eligible(spec, lu_cmd))
+			rc = istgt_lu_disk_coalesce_write(spec, lu_cmd, offset, nbytes);
+		else
+			rc = replicate(spec, lu_cmd, offset, nbytes);
 		lu_cmd->data = NULL;
 #else
+		if (spec->uring_ctx != NULL
+		    && (lu_cmd->flags & ISTGT_URING_ALLOWED)
+		    && iovcnt <= ISTGT_IOV_MAX) {
+			/* buffers are freed by istgt_lu_disk_uring_task_done() */
+			istgt_lu_disk_uring_arm(spec, lu_cmd, ISTGT_LU_URING_WRITE,
+			    lu_cmd->iobuf, iovcnt, offset, nbytes, lba, len);
+			if (iov != iov_inl)
+				xfree(iov);
+			return 0;
+		}
 		actual = lu_cmd->iobufsize; l_offset = offset;
+		first = 0;
 		while (actual > 0) {
-			rc = pwritev(spec->fd, &lu_cmd->iobuf[0], iovcnt, l_offset);
+			cnt = iovcnt - first;
+			if (cnt > ISTGT_IOV_MAX)
+				cnt = ISTGT_IOV_MAX;
+			if (spec->uring_ctx != NULL)
+				rc = istgt_lu_disk_uring_pwritev(spec,
+				    &lu_cmd->iobuf[first], cnt, l_offset);
+			else
+				rc = pwritev(spec->fd, &lu_cmd->iobuf[first], cnt, l_offset);
 			if (rc < 0) {
 				ISTGT_ERRLOG("c#%d pwritev() failed errno:%d\n", conn->id, errno);
 				break;
@@ -5825,7 +6422,7 @@ freeiovcnt:
 			if (actual == 0)
 				break;
 			/* adjust iovec length */
-			for (i = 0; i < iovcnt; i++) {
+			for (i = first; i < iovcnt; i++) {
 				if (lu_cmd->iobuf[i].iov_len != 0 && lu_cmd->iobuf[i].iov_len > (size_t)rc) {
 					lu_cmd->iobuf[i].iov_base = (void *) (((char *)lu_cmd->iobuf[i].iov_base) + rc);
 					lu_cmd->iobuf[i].iov_len -= rc;
@@ -5835,9 +6432,11 @@ freeiovcnt:
 					lu_cmd->iobuf[i].iov_len = 0;
 				}
 			}
+			first = i;
 		}
 #endif
 	}
+	istgt_lu_disk_rcache_invalidate(spec, lba, llen);
 
 	lu_cmd->iobufsize = 0;
 	lu_cmd->iobufindx = -1;
@@ -5857,6 +6456,8 @@ freeiovcnt:
 		for (i=0; i<iovcnt; ++i)
 			xfree(iov[i].iov_base);
 #endif
+		if (iov != iov_inl)
+			xfree(iov);
 		return -1;
 	}
 	if (rc < 0)  {
@@ -5865,6 +6466,8 @@ freeiovcnt:
 		for (i=0; i<iovcnt; ++i)
 			xfree(iov[i].iov_base);
 #endif
+		if (iov != iov_inl)
+			xfree(iov);
 		return -1;
 	}
 	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d Wrote %lu/%lu bytes (lba:%lu+%u) %s\n",
@@ -5875,6 +6478,8 @@ freeiovcnt:
 	for (i=0; i<iovcnt; ++i)
 		xfree(iov[i].iov_base);
 #endif
+	if (iov != iov_inl)
+		xfree(iov);
 	return 0;
 }
 static int
@@ -5965,6 +6570,7 @@ istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 		#endif
 #endif
 		eno = errno;
+		istgt_lu_disk_rcache_invalidate(spec, lba, llen);
 		exitblockingcall(endofmacro2);
 		if (markedForFree == 1 || markedForReturn == 1) {
 			ISTGT_TRACELOG(ISTGT_TRACE_NET, "c#%d connGone(%d)OrMarkedReturn(%d):%p:%d pendingIO:%d (wsameX lba:%lu+%u ret:%ld).",
@@ -6032,6 +6638,7 @@ istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 #ifndef	REPLICATION
 		rc = pwrite(spec->fd, workbuf, reqbytes, offset_local);
 #endif
+		istgt_lu_disk_rcache_invalidate(spec, lba + nblocks, reqblocks);
 		exitblockingcall(endofmacro4);
 		if (markedForFree == 1 || markedForReturn == 1) {
 			timediffw(lu_cmd, 'D');
@@ -6192,6 +6799,7 @@ istgt_lu_disk_lbwrite_ats(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr l
 #ifndef	REPLICATION
 	rc = pwrite(spec->fd, data + nbytes, nbytes, offset);
 #endif
+	istgt_lu_disk_rcache_invalidate(spec, lba, llen);
 	exitblockingcall(endofmacro4)
 	timediffw(lu_cmd, 'D');
 	if (markedForFree == 1 || markedForReturn == 1) {
@@ -6274,7 +6882,7 @@ istgt_lu_disk_lbsync(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused_
 		return -1;
 	}
 #ifdef REPLICATION
-	rc = replicate(spec, lu_cmd, offset, nbytes);
+	rc = replicate_sync(spec, lu_cmd, offset, nbytes);
 #else
 	rc = spec->sync(spec, offset, nbytes);
 #endif
@@ -6674,6 +7282,7 @@ istgt_lu_disk_reset(ISTGT_LU_Ptr lu, int lun , istgt_ua_type ua_type)
 		spec->spc2_reserved = 0;
 		spec->rsv_scope = 0;
 		spec->rsv_type = 0;
+		istgt_lu_disk_pr_changed(spec);
 	}
 
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,"Set U/A to all the initiator that have access to LU%d \n", lu->num);
@@ -6747,6 +7356,7 @@ istgt_lu_disk_clear_reservation(ISTGT_LU_Ptr lu, int lun)
 		}
 	}
 	spec->spc2_reserved = 0;
+	istgt_lu_disk_pr_changed(spec);
 	MTX_UNLOCK(&spec->pr_rsv_mutex);
 	xfree(spec_bkp);
 	return rc;
@@ -6998,6 +7608,38 @@ istgt_lu_disk_status(ISTGT_LU_Ptr lu, int lun)
 	return (status);
 }
 
+#ifndef	REPLICATION
+struct uring_abort_match {
+	const char *initiator_port;
+	int ilen;
+	int all_cmds;
+	uint32_t CmdSN;
+};
+
+/* aborts a READ/WRITE the luworker already handed to io_uring */
+static int
+istgt_lu_disk_uring_abort(ISTGT_LU_DISK_URING_IO *io, void *arg)
+{
+	struct uring_abort_match *m = arg;
+	ISTGT_LU_TASK_Ptr lu_task;
+
+	if (io->done != istgt_lu_disk_uring_task_done)
+		return 0;
+	lu_task = io->arg;
+	if (lu_task->lu_cmd.aborted == 1)
+		return 0;
+	if (((m->all_cmds != 0) || (lu_task->lu_cmd.CmdSN == m->CmdSN))
+	    && (lu_task->in_plen == m->ilen
+	    && (strcasecmp(lu_task->in_port, m->initiator_port) == 0))) {
+		ISTGT_LOG("cmd 0x%x to abort matches with uring IO\n",
+		    lu_task->lu_cmd.CmdSN);
+		lu_task->lu_cmd.aborted = 1;
+		return 1;
+	}
+	return 0;
+}
+#endif
+
 static int
 istgt_lu_disk_queue_clear_internal(CONN_Ptr conn, ISTGT_LU_DISK *spec, const char *initiator_port, int all_cmds, uint32_t CmdSN)
 {
@@ -7065,6 +7707,7 @@ istgt_lu_disk_queue_clear_internal(CONN_Ptr conn, ISTGT_LU_DISK *spec, const cha
 			    lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 			    (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 			istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+			LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 			lu_task->complete_queue_ptr = NULL;
 			rc = istgt_lu_destroy_task(lu_task);
 			if (rc < 0) {
@@ -7127,6 +7770,7 @@ saved_cmd_queue:
 			    lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 			    (unsigned long) (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 			istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+			LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 			lu_task->complete_queue_ptr = NULL;
 			rc = istgt_lu_destroy_task(lu_task);
 			if (rc < 0) {
@@ -7184,6 +7828,7 @@ saved_blocked_queue:
 			    lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 			    (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 			istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+			LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 			lu_task->complete_queue_ptr = NULL;
 			rc = istgt_lu_destroy_task(lu_task);
 			if (rc < 0) {
@@ -7235,6 +7880,7 @@ saved_blocked_queue:
 			    lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 			    (unsigned long) (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 			istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+			LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 			lu_task->complete_queue_ptr = NULL;
 			rc = istgt_lu_destroy_task(lu_task);
 			if (rc < 0) {
@@ -7404,6 +8050,18 @@ avoidif:
 		}
 		MTX_UNLOCK(&spec->luworker_mutex[i]);
 	}
+#ifndef	REPLICATION
+	if (initiator_port != NULL) {
+		struct uring_abort_match m;
+
+		m.initiator_port = initiator_port;
+		m.ilen = ilen;
+		m.all_cmds = all_cmds;
+		m.CmdSN = CmdSN;
+		cleared += istgt_lu_disk_uring_foreach(spec,
+		    istgt_lu_disk_uring_abort, &m);
+	}
+#endif
 	if(conn!=NULL && conn->state != CONN_STATE_EXITING && abort_result_queue == 1) {
 		MTX_LOCK(&conn->result_queue_mutex);    
 		while ((tptr= (ISTGT_LU_TASK_Ptr)istgt_queue_walk(&conn->result_queue, &cookie)) != NULL) {
@@ -7600,6 +8258,7 @@ istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 			lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 		    (unsigned long) (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 		istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+		LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 		lu_task->complete_queue_ptr = NULL;
 		rc = istgt_lu_destroy_task(lu_task);
 		if (rc < 0) {
@@ -7620,6 +8279,7 @@ istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 			lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 		    (unsigned long) (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 		istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+		LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 		lu_task->complete_queue_ptr = NULL;
 		rc = istgt_lu_destroy_task(lu_task);
 		if (rc < 0) {
@@ -7640,6 +8300,7 @@ istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 			lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 		    (unsigned long) (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 		istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+		LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 		lu_task->complete_queue_ptr = NULL;
 		rc = istgt_lu_destroy_task(lu_task);
 		if (rc < 0) {
@@ -7660,6 +8321,7 @@ istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 			lu_task->lu_cmd.lba, lu_task->lu_cmd.lblen,
 		    (unsigned long) (now.tv_sec - lu_task->lu_cmd.create_time.tv_sec));
 		istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+		LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 		lu_task->complete_queue_ptr = NULL;
 		rc = istgt_lu_destroy_task(lu_task);
 		if (rc < 0) {
@@ -8112,6 +8774,7 @@ istgt_is_exec_pipeline_conflict(ISTGT_LU_DISK *spec, ISTGT_LU_TASK_Ptr pending_t
 			}
 			r_ptr = istgt_queue_enqueue(&spec->complete_queue, pending_task);
 			pending_task->complete_queue_ptr = r_ptr;
+			LU_TASK_DEADLINE_ARM(spec, pending_task);
 			return ISTGT_TASK_BLOCK;
 		}
 	}
@@ -8126,9 +8789,11 @@ istgt_is_exec_pipeline_conflict(ISTGT_LU_DISK *spec, ISTGT_LU_TASK_Ptr pending_t
 				r_ptr = istgt_queue_enqueue_after(&spec->complete_queue, pending_task->blocked_by, pending_task);
 				pending_task->blocked_by = NULL;
 				pending_task->complete_queue_ptr = r_ptr;
+				LU_TASK_DEADLINE_ARM(spec, pending_task);
 			} else {
 				r_ptr = istgt_queue_enqueue(&spec->complete_queue, pending_task);
 				pending_task->complete_queue_ptr = r_ptr;
+				LU_TASK_DEADLINE_ARM(spec, pending_task);
 			}
 			if(spec->do_avg == 1)
 			{
@@ -8139,6 +8804,7 @@ istgt_is_exec_pipeline_conflict(ISTGT_LU_DISK *spec, ISTGT_LU_TASK_Ptr pending_t
 		case ISTGT_TASK_PASS:
 			r_ptr = istgt_queue_enqueue(&spec->complete_queue, pending_task);
 			pending_task->complete_queue_ptr = r_ptr;
+			LU_TASK_DEADLINE_ARM(spec, pending_task);
 			break;
 		default:
 			ISTGT_ERRLOG("Invalid action in exec_pipeline for cmdsn:%x\n", pending_task->lu_cmd.CmdSN);
@@ -8445,6 +9111,7 @@ istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 				lu->num, qact[sindx < 0 || sindx > 6 ? 7 : sindx], msg, ccnt, bcnt, icnt, lu_cmd->CmdSN, lu_cmd->cdb[0], lu_cmd->lba, lu_cmd->lblen);
 error_return:
 		istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);
+		LU_TASK_DEADLINE_CANCEL(spec, lu_task);
 		lu_task->complete_queue_ptr = NULL;
 		MTX_UNLOCK(&spec->complete_queue_mutex);
 error_return_no_dequeue:
@@ -8594,7 +9261,8 @@ istgt_lu_disk_cmd_queue_count(ISTGT_LU_Ptr lu, int *lun)
 	return qcnt;
 }
 */
-#define INFLIGHT_IO_CLEANUP	\
+/* the luworker is free for the next task, lu_task may still be running */
+#define INFLIGHT_IO_RELEASE_WORKER	\
 		{\
 			MTX_LOCK(&spec->luworker_mutex[worker_id]);\
 			MTX_LOCK(&spec->lu_tmf_mutex[worker_id]);\
@@ -8643,10 +9311,16 @@ istgt_lu_disk_cmd_queue_count(ISTGT_LU_Ptr lu, int *lun)
 					MTX_UNLOCK(&spec->luworker_mutex[worker_id]);\
 				}\
 			}\
+		}
+
+#define INFLIGHT_IO_CLEANUP	\
+		{\
+			INFLIGHT_IO_RELEASE_WORKER;\
 /* No need to wake up maint_thread as there is only thread and it is looping */\
 			if(likely(lu_task != NULL)) {\
 				MTX_LOCK(&spec->complete_queue_mutex);\
 				istgt_queue_dequeue_middle(&spec->complete_queue, lu_task->complete_queue_ptr);\
+				LU_TASK_DEADLINE_CANCEL(spec, lu_task);\
 				lu_task->complete_queue_ptr = NULL;\
 				if(likely(decrement_conn_inflight == 1))\
 				{\
@@ -8695,7 +9369,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 	ISTGT_LU_CMD_Ptr lu_cmd;
 	struct timespec abstime;
 	time_t start, now;
-	int rc, i, timed_wait_rc = 0;
+	int rc, i, timed_wait_rc = 0, kick;
 	uint32_t CmdSN;
 	int opcode, printmsg = 1, aborted = 0;
 	const char *msg = "";
@@ -8736,6 +9410,10 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 
 	CmdSN = lu_cmd->CmdSN;
 	opcode = lu_cmd->cdb[0];
+#ifndef	REPLICATION
+	if (spec->uring_ctx != NULL)
+		lu_cmd->flags |= ISTGT_URING_ALLOWED;
+#endif
 
 	if(spec->exit_lu_worker)
 	{
@@ -8751,16 +9429,26 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 
 	retval = -1;
 	if (lu_cmd->W_bit) {
-		if (lu_cmd->pdu->data_segment_len >= lu_cmd->transfer_len) {
-			i = ++lu_cmd->iobufindx;
-			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
-			    "c#%d LU%d: CSN:0x%x LUN%d Task Write Immediate Start, op:0x%x [%d,%lu->%lu]\n",
-			    conn->id, lu->num, CmdSN, lun, opcode,
-				i, lu_cmd->iobuf[i].iov_len, lu_cmd->pdu->data_segment_len);
-			lu_cmd->iobuf[i].iov_base = lu_cmd->pdu->data;
-			lu_cmd->iobuf[i].iov_len = lu_cmd->pdu->data_segment_len;
-			lu_cmd->iobufsize = lu_cmd->pdu->data_segment_len;
-			lu_cmd->pdu->data = NULL; lu_cmd->pdu->data_segment_len = 0;
+		if (lu_cmd->pdu->data_segment_len >= lu_cmd->transfer_len
+		    || (lu_cmd->iobufindx != -1
+			&& lu_cmd->iobufsize >= lu_cmd->transfer_len)) {
+			if (lu_cmd->iobufindx != -1) {
+				/* DATA-OUT gathered by the connection */
+				ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+				    "c#%d LU%d: CSN:0x%x LUN%d Task Write Gathered Start, op:0x%x [%d,%lu]\n",
+				    conn->id, lu->num, CmdSN, lun, opcode,
+				    lu_cmd->iobufindx + 1, lu_cmd->iobufsize);
+			} else {
+				i = ++lu_cmd->iobufindx;
+				ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+				    "c#%d LU%d: CSN:0x%x LUN%d Task Write Immediate Start, op:0x%x [%d,%lu->%lu]\n",
+				    conn->id, lu->num, CmdSN, lun, opcode,
+					i, lu_cmd->iobuf[i].iov_len, lu_cmd->pdu->data_segment_len);
+				lu_cmd->iobuf[i].iov_base = lu_cmd->pdu->data;
+				lu_cmd->iobuf[i].iov_len = lu_cmd->pdu->data_segment_len;
+				lu_cmd->iobufsize = lu_cmd->pdu->data_segment_len;
+				lu_cmd->pdu->data = NULL; lu_cmd->pdu->data_segment_len = 0;
+			}
 			lu_task->dup_iobuf = 1;
 
 			//MTX_LOCK(&lu_cmd->lu->mutex);
@@ -8775,6 +9463,15 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 				goto error_return;
 			}
 			lu_task->execute = 1;
+#ifndef	REPLICATION
+			if (lu_cmd->flags & ISTGT_URING_ARMED) {
+				/* answered by istgt_lu_disk_uring_task_done() */
+				INFLIGHT_IO_RELEASE_WORKER;
+				istgt_lu_disk_uring_submit(spec, &lu_task->uring_io);
+				retval = 0;
+				goto return_retval;
+			}
+#endif
 
 			/* response */
 			MTX_LOCK(&conn->result_queue_mutex);
@@ -8790,9 +9487,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 				goto error_return_no_cleanup;
 			}
 			lu_task->lu_cmd.flags |= ISTGT_RESULT_Q_ENQUEUED;
-			rc = 0;
-			if(conn->sender_waiting == 1)
-				rc = pthread_cond_signal(&conn->result_queue_cond);
+			rc = istgt_iscsi_result_notify(conn);
 			MTX_UNLOCK(&conn->result_queue_mutex);
 			if (rc != 0) {
 				msg = "rsltq1 bcast failed";
@@ -8833,16 +9528,17 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 			abstime.tv_sec = 0;
 			abstime.tv_nsec = 0;
 
+			/* the worker drains the queue, a non-empty one has its wakeup */
 			MTX_LOCK(&conn->task_queue_mutex);
+			kick = (istgt_queue_count(&conn->task_queue) == 0);
 			r_ptr = istgt_queue_enqueue(&conn->task_queue, lu_task);
 			MTX_UNLOCK(&conn->task_queue_mutex);
 			if (r_ptr == NULL) {
 				msg = "tskq enqueue failed";
 				goto error_return;
 			}
-			rc = write(conn->task_pipe[1], "Q", 1); //something other than E
-			if(rc < 0 || rc != 1) {
-				msg = "tskpipe write failed";
+			if (kick && istgt_iscsi_task_notify(conn) < 0) {
+				msg = "task notify failed";
 				INFLIGHT_IO_CLEANUP;
 				//Should we dequeue enqueued task?
 				goto error_return_no_destroy;
@@ -8966,6 +9662,15 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 				goto error_return;
 			}
 			lu_task->execute = 1;
+#ifndef	REPLICATION
+			if (lu_cmd->flags & ISTGT_URING_ARMED) {
+				/* answered by istgt_lu_disk_uring_task_done() */
+				INFLIGHT_IO_RELEASE_WORKER;
+				istgt_lu_disk_uring_submit(spec, &lu_task->uring_io);
+				retval = 0;
+				goto return_retval;
+			}
+#endif
 
 			/* response */
 			MTX_LOCK(&conn->result_queue_mutex);
@@ -8981,9 +9686,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 				goto error_return_no_cleanup;
 			}
 			lu_task->lu_cmd.flags |= ISTGT_RESULT_Q_ENQUEUED;
-			rc = 0;
-			if(conn->sender_waiting == 1)
-				rc = pthread_cond_signal(&conn->result_queue_cond);
+			rc = istgt_iscsi_result_notify(conn);
 			MTX_UNLOCK(&conn->result_queue_mutex);
 			if (rc != 0) {
 				msg = "rsltq2 bcast failed";
@@ -9010,6 +9713,15 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 			goto error_return;
 		}
 		lu_task->execute = 1;
+#ifndef	REPLICATION
+		if (lu_cmd->flags & ISTGT_URING_ARMED) {
+			/* answered by istgt_lu_disk_uring_task_done() */
+			INFLIGHT_IO_RELEASE_WORKER;
+			istgt_lu_disk_uring_submit(spec, &lu_task->uring_io);
+			retval = 0;
+			goto return_retval;
+		}
+#endif
 
 		/* response */
 		MTX_LOCK(&conn->result_queue_mutex);
@@ -9025,9 +9737,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun, int worker_id)
 			goto error_return_no_cleanup;
 		}
 		lu_task->lu_cmd.flags |= ISTGT_RESULT_Q_ENQUEUED;
-		rc = 0;
-		if(conn->sender_waiting == 1)
-			rc = pthread_cond_signal(&conn->result_queue_cond);
+		rc = istgt_iscsi_result_notify(conn);
 		MTX_UNLOCK(&conn->result_queue_mutex);
 		if (rc != 0) {
 			msg = "rsltq3 bcast failed";
@@ -10613,11 +11323,15 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	case SPC_PERSISTENT_RESERVE_IN:
 		{
 #ifdef	REPLICATION
-			ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d RESERVE_IN not handled\n", conn->id);
-			/* INVALID COMMAND OPERATION CODE */
-			BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
-			lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
-#else
+			/* served only while reservations are kept on the replicas */
+			if (!spec->persist || !spec->replica_pr_persist) {
+				ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d RESERVE_IN not handled\n", conn->id);
+				/* INVALID COMMAND OPERATION CODE */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+#endif
 			sa = BGET8W(&cdb[1], 4, 5);
 			if (lu_cmd->R_bit == 0) {
 				ISTGT_ERRLOG("c#%d PERSISTENT_RESERVE_IN: sa:0x%2.2x R_bit == 0\n", conn->id, sa);
@@ -10653,19 +11367,21 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			lu_cmd->data_len = DMIN32((size_t)data_len, lu_cmd->transfer_len);
 			lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
 			ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d PERSISTENT_RESERVE_IN sa:0x%2.2x data:%u/%u/%u\n", conn->id, sa, data_len, lu_cmd->transfer_len, allocation_len);
-#endif
 		}
 		break;
 
 	case SPC_PERSISTENT_RESERVE_OUT:
 		{
-#ifdef	REPLICATION
-			ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d RESERVE_OUT not handled\n", conn->id);
-			/* INVALID COMMAND OPERATION CODE */
-			BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
-			lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
-#else
 			int scope, type;
+#ifdef	REPLICATION
+			if (!spec->persist || !spec->replica_pr_persist) {
+				ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "c#%d RESERVE_OUT not handled\n", conn->id);
+				/* INVALID COMMAND OPERATION CODE */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+#endif
 			sa = BGET8W(&cdb[1], 4, 5);
 
 			if (lu_cmd->W_bit == 0) {
@@ -10701,6 +11417,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			getdata(data, lu_cmd)
 			MTX_LOCK(&spec->pr_rsv_mutex);
 			data_len = istgt_lu_disk_scsi_persistent_reserve_out(spec, conn, lu_cmd, sa, scope, type, &data[0], parameter_len, 0);
+			istgt_lu_disk_pr_changed(spec);
 			MTX_UNLOCK(&spec->pr_rsv_mutex);
 			if (data_len < 0) {
 				ISTGT_ERRLOG("c#%d PERSISTENT_RESERVE_OUT sa:0x%2.2x scope:%x type:%x plen:%d, function failed:%d\n",
@@ -10712,7 +11429,6 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
 			ISTGT_ERRLOG("c#%d PERSISTENT_RESERVE_OUT sa:0x%2.2x scope:%x type:%x plen:%d success (%d)",
 						conn->id, sa, scope, type, parameter_len, data_len);
-#endif
 		}
 		break;
 
@@ -10755,6 +11471,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			sleep(spec->delay_release);
 		MTX_LOCK(&spec->pr_rsv_mutex);
 		rc = istgt_lu_disk_scsi_release(spec, conn, lu_cmd);
+		istgt_lu_disk_pr_changed(spec);
 		MTX_UNLOCK(&spec->pr_rsv_mutex);
 		if (rc < 0) {
 			/* build by function */
@@ -10768,6 +11485,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			sleep(spec->delay_release);
 		MTX_LOCK(&spec->pr_rsv_mutex);
 		rc = istgt_lu_disk_scsi_release(spec, conn, lu_cmd);
+		istgt_lu_disk_pr_changed(spec);
 		MTX_UNLOCK(&spec->pr_rsv_mutex);
 		if (rc < 0) {
 			/* build by function */
@@ -10781,6 +11499,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			sleep(spec->delay_reserve);
 		MTX_LOCK(&spec->pr_rsv_mutex);
 		rc = istgt_lu_disk_scsi_reserve(spec, conn, lu_cmd);
+		istgt_lu_disk_pr_changed(spec);
 		MTX_UNLOCK(&spec->pr_rsv_mutex);
 		if (rc < 0) {
 			/* build by function */
@@ -10794,6 +11513,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			sleep(spec->delay_reserve);
 		MTX_LOCK(&spec->pr_rsv_mutex);
 		rc = istgt_lu_disk_scsi_reserve(spec, conn, lu_cmd);
+		istgt_lu_disk_pr_changed(spec);
 		MTX_UNLOCK(&spec->pr_rsv_mutex);
 		if (rc < 0) {
 			/* build by function */
@@ -10878,7 +11598,10 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 		break;
 	}
 
-	if (lu_cmd->status == ISTGT_SCSI_STATUS_CHECK_CONDITION
+	if (lu_cmd->expired && lu_cmd->status == ISTGT_SCSI_STATUS_CHECK_CONDITION) {
+		/* COMMAND TIMEOUT DURING PROCESSING, see lu_task_deadline_expired() */
+		BUILD_SENSE(ABORTED_COMMAND, 0x2e, 0x02);
+	} else if (lu_cmd->status == ISTGT_SCSI_STATUS_CHECK_CONDITION
 			|| lu_cmd->status == ISTGT_SCSI_STATUS_GOOD) {
 		/* Do we need this? */
 		MTX_LOCK(&spec->state_mutex);
@@ -0,0 +1,556 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+/*
+ * Read cache in front of the LUN (ReadCacheSize in the LU section).
+ *
+ * Block granular (spec->blocklen) with 2Q replacement: a block read for
+ * the first time goes to the A1in FIFO, and is only promoted to the Am
+ * LRU if it is read again after it was pushed out of A1in (its lba is
+ * still remembered in the A1out ghost list).  A sequential scan therefore
+ * cycles through A1in and cannot flush the hot set out of Am.
+ *
+ * Writers invalidate the range they touched once the IO is done.  A read
+ * that missed cannot simply insert what it got back, since a write to the
+ * same blocks may have completed while it was out on the wire: lookup
+ * hands out a ticket holding the generations of the stripes covering the
+ * range, invalidate bumps them, and fill drops the data if any of them
+ * moved.  flush bumps the epoch, which voids every outstanding ticket.
+ */
+
+#define	RC_STRIPE_SHIFT	10		/* 1024 blocks per stripe */
+#define	RC_NSTRIPES	256
+
+/* reads bigger than this fraction of the cache are not inserted */
+#define	RC_MAX_FILL_SHIFT	3
+
+enum {
+	RC_FREE = 0,
+	RC_A1IN,
+	RC_A1OUT,
+	RC_AM,
+};
+
+typedef struct istgt_rcache_ent {
+	uint64_t lba;
+	struct istgt_rcache_ent *hnext;
+	TAILQ_ENTRY(istgt_rcache_ent) qnext;
+	int32_t slot;			/* data slot, -1 for ghosts */
+	uint8_t q;
+} RC_ENT;
+
+TAILQ_HEAD(rc_queue, istgt_rcache_ent);
+
+typedef struct istgt_rcache {
+	pthread_mutex_t mutex;
+	uint64_t size;			/* ReadCacheSize in bytes */
+
+	/* geometry, (re)built whenever spec->blocklen changes */
+	uint64_t blocklen;
+	uint32_t capacity;		/* resident blocks */
+	uint32_t kin;
+	uint32_t kout;
+	uint32_t hmask;
+	RC_ENT **hash;
+	RC_ENT *ents;
+	uint32_t nents;
+	uint8_t *arena;
+	int32_t *freeslot;
+	uint32_t nfreeslot;
+
+	struct rc_queue a1in;
+	struct rc_queue a1out;
+	struct rc_queue am;
+	struct rc_queue freeq;
+	uint32_t n_a1in;
+	uint32_t n_a1out;
+	uint32_t n_am;
+
+	uint64_t epoch;
+	uint64_t gen[RC_NSTRIPES];
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fills;
+	uint64_t stale_fills;
+} ISTGT_RCACHE;
+
+#define	RC_HASH(rc, lba)	\
+	((uint32_t)(((lba) * 0x9E3779B97F4A7C15ULL) >> 32) & (rc)->hmask)
+
+static void
+rc_teardown(ISTGT_RCACHE *rc)
+{
+	xfree(rc->hash);
+	xfree(rc->ents);
+	xfree(rc->freeslot);
+	free(rc->arena);
+	rc->hash = NULL;
+	rc->ents = NULL;
+	rc->freeslot = NULL;
+	rc->arena = NULL;
+	rc->blocklen = 0;
+	rc->capacity = 0;
+	rc->nents = 0;
+}
+
+static void
+rc_reset(ISTGT_RCACHE *rc)
+{
+	uint32_t i;
+
+	TAILQ_INIT(&rc->a1in);
+	TAILQ_INIT(&rc->a1out);
+	TAILQ_INIT(&rc->am);
+	TAILQ_INIT(&rc->freeq);
+	rc->n_a1in = rc->n_a1out = rc->n_am = 0;
+	if (rc->hash != NULL)
+		memset(rc->hash, 0, sizeof (RC_ENT *) * (rc->hmask + 1));
+	for (i = 0; i < rc->nents; i++) {
+		rc->ents[i].q = RC_FREE;
+		rc->ents[i].slot = -1;
+		rc->ents[i].hnext = NULL;
+		TAILQ_INSERT_TAIL(&rc->freeq, &rc->ents[i], qnext);
+	}
+	for (i = 0; i < rc->capacity; i++)
+		rc->freeslot[i] = (int32_t)i;
+	rc->nfreeslot = rc->capacity;
+}
+
+/*
+ * Size the cache for the current block length.  The data arena is only
+ * reserved here, pages are faulted in as blocks get cached.
+ */
+static int
+rc_setup(ISTGT_RCACHE *rc, uint64_t blocklen)
+{
+	uint64_t cap;
+	uint32_t nbuckets;
+
+	rc_teardown(rc);
+	if (blocklen == 0)
+		return -1;
+	cap = rc->size / blocklen;
+	if (cap < 16)
+		return -1;
+	if (cap > INT32_MAX / 2)
+		cap = INT32_MAX / 2;
+
+	rc->capacity = (uint32_t)cap;
+	rc->kin = rc->capacity / 4;
+	rc->kout = rc->capacity / 2;
+	rc->nents = rc->capacity + rc->kout + 1;
+	for (nbuckets = 1; nbuckets < rc->nents; nbuckets <<= 1)
+		;
+	rc->hmask = nbuckets - 1;
+
+	rc->arena = malloc(rc->capacity * blocklen);
+	if (rc->arena == NULL) {
+		rc->capacity = 0;
+		rc->nents = 0;
+		return -1;
+	}
+	rc->hash = xmalloc(sizeof (RC_ENT *) * nbuckets);
+	rc->ents = xmalloc(sizeof (RC_ENT) * rc->nents);
+	rc->freeslot = xmalloc(sizeof (int32_t) * rc->capacity);
+	rc->blocklen = blocklen;
+	rc_reset(rc);
+	return 0;
+}
+
+static int
+rc_ready(ISTGT_RCACHE *rc, uint64_t blocklen)
+{
+	if (rc->blocklen == blocklen)
+		return 1;
+	if (rc_setup(rc, blocklen) != 0) {
+		ISTGT_ERRLOG("read cache of %"PRIu64" bytes can't be set up "
+		    "for %"PRIu64" byte blocks, disabled\n", rc->size, blocklen);
+		rc->blocklen = blocklen;	/* don't retry on every IO */
+		return 0;
+	}
+	rc->epoch++;
+	return 1;
+}
+
+static RC_ENT *
+rc_find(ISTGT_RCACHE *rc, uint64_t lba)
+{
+	RC_ENT *e;
+
+	for (e = rc->hash[RC_HASH(rc, lba)]; e != NULL; e = e->hnext)
+		if (e->lba == lba)
+			return e;
+	return NULL;
+}
+
+static void
+rc_unhash(ISTGT_RCACHE *rc, RC_ENT *e)
+{
+	RC_ENT **pp;
+
+	for (pp = &rc->hash[RC_HASH(rc, e->lba)]; *pp != NULL;
+	    pp = &(*pp)->hnext) {
+		if (*pp == e) {
+			*pp = e->hnext;
+			break;
+		}
+	}
+	e->hnext = NULL;
+}
+
+static void
+rc_dequeue(ISTGT_RCACHE *rc, RC_ENT *e)
+{
+	switch (e->q) {
+	case RC_A1IN:
+		TAILQ_REMOVE(&rc->a1in, e, qnext);
+		rc->n_a1in--;
+		break;
+	case RC_A1OUT:
+		TAILQ_REMOVE(&rc->a1out, e, qnext);
+		rc->n_a1out--;
+		break;
+	case RC_AM:
+		TAILQ_REMOVE(&rc->am, e, qnext);
+		rc->n_am--;
+		break;
+	default:
+		TAILQ_REMOVE(&rc->freeq, e, qnext);
+		break;
+	}
+}
+
+static void
+rc_release_slot(ISTGT_RCACHE *rc, RC_ENT *e)
+{
+	if (e->slot >= 0) {
+		rc->freeslot[rc->nfreeslot++] = e->slot;
+		e->slot = -1;
+	}
+}
+
+static void
+rc_free_ent(ISTGT_RCACHE *rc, RC_ENT *e)
+{
+	rc_dequeue(rc, e);
+	rc_unhash(rc, e);
+	rc_release_slot(rc, e);
+	e->q = RC_FREE;
+	TAILQ_INSERT_TAIL(&rc->freeq, e, qnext);
+}
+
+/* make room for one more resident block */
+static void
+rc_reclaim(ISTGT_RCACHE *rc)
+{
+	RC_ENT *e;
+
+	if (rc->nfreeslot != 0)
+		return;
+	if (rc->n_a1in > rc->kin || rc->n_am == 0) {
+		/* A1in tail becomes a ghost */
+		e = TAILQ_LAST(&rc->a1in, rc_queue);
+		if (rc->n_a1out >= rc->kout)
+			rc_free_ent(rc, TAILQ_LAST(&rc->a1out, rc_queue));
+		rc_dequeue(rc, e);
+		rc_release_slot(rc, e);
+		e->q = RC_A1OUT;
+		TAILQ_INSERT_HEAD(&rc->a1out, e, qnext);
+		rc->n_a1out++;
+	} else {
+		rc_free_ent(rc, TAILQ_LAST(&rc->am, rc_queue));
+	}
+}
+
+static void
+rc_insert(ISTGT_RCACHE *rc, uint64_t lba, const uint8_t *data)
+{
+	RC_ENT *e;
+	int promote = 0;
+
+	e = rc_find(rc, lba);
+	if (e != NULL) {
+		if (e->q != RC_A1OUT)
+			return;		/* raced with another reader */
+		rc_free_ent(rc, e);
+		promote = 1;
+	}
+
+	rc_reclaim(rc);
+	e = TAILQ_FIRST(&rc->freeq);
+	if (e == NULL) {
+		/* every entry is a ghost, recycle the oldest one */
+		rc_free_ent(rc, TAILQ_LAST(&rc->a1out, rc_queue));
+		e = TAILQ_FIRST(&rc->freeq);
+	}
+	TAILQ_REMOVE(&rc->freeq, e, qnext);
+	e->lba = lba;
+	e->slot = rc->freeslot[--rc->nfreeslot];
+	memcpy(rc->arena + (uint64_t)e->slot * rc->blocklen, data,
+	    rc->blocklen);
+	e->hnext = rc->hash[RC_HASH(rc, lba)];
+	rc->hash[RC_HASH(rc, lba)] = e;
+	if (promote) {
+		e->q = RC_AM;
+		TAILQ_INSERT_HEAD(&rc->am, e, qnext);
+		rc->n_am++;
+	} else {
+		e->q = RC_A1IN;
+		TAILQ_INSERT_HEAD(&rc->a1in, e, qnext);
+		rc->n_a1in++;
+	}
+}
+
+static void
+rc_ticket(ISTGT_RCACHE *rc, uint64_t lba, uint32_t len,
+    ISTGT_LU_RCACHE_TICKET *ticket)
+{
+	uint64_t s, first, last;
+	int i;
+
+	first = lba >> RC_STRIPE_SHIFT;
+	last = (lba + len - 1) >> RC_STRIPE_SHIFT;
+	ticket->epoch = rc->epoch;
+	if (last - first >= ISTGT_RCACHE_TICKET_STRIPES ||
+	    ((uint64_t)len << RC_MAX_FILL_SHIFT) > rc->capacity) {
+		ticket->nstripes = 0;
+		return;
+	}
+	for (s = first, i = 0; s <= last; s++, i++)
+		ticket->gen[i] = rc->gen[s % RC_NSTRIPES];
+	ticket->nstripes = i;
+}
+
+int
+istgt_lu_disk_rcache_init(ISTGT_LU_DISK *spec, uint64_t size)
+{
+	ISTGT_RCACHE *rc;
+
+	spec->rcache = NULL;
+	if (size == 0)
+		return 0;
+
+	rc = xmalloc(sizeof (*rc));
+	memset(rc, 0, sizeof (*rc));
+	rc->size = size;
+	pthread_mutex_init(&rc->mutex, NULL);
+	TAILQ_INIT(&rc->a1in);
+	TAILQ_INIT(&rc->a1out);
+	TAILQ_INIT(&rc->am);
+	TAILQ_INIT(&rc->freeq);
+	spec->rcache = rc;
+	return 0;
+}
+
+void
+istgt_lu_disk_rcache_destroy(ISTGT_LU_DISK *spec)
+{
+	ISTGT_RCACHE *rc = spec->rcache;
+
+	if (rc == NULL)
+		return;
+	spec->rcache = NULL;
+	rc_teardown(rc);
+	pthread_mutex_destroy(&rc->mutex);
+	xfree(rc);
+}
+
+/*
+ * Returns a buffer holding the whole range if every block of it is
+ * cached, the caller owns it.  Otherwise returns NULL and fills in the
+ * ticket to be passed to istgt_lu_disk_rcache_fill() with the data read
+ * from the backend.
+ */
+uint8_t *
+istgt_lu_disk_rcache_lookup(ISTGT_LU_DISK *spec, uint64_t lba, uint32_t len,
+    ISTGT_LU_RCACHE_TICKET *ticket)
+{
+	ISTGT_RCACHE *rc = spec->rcache;
+	RC_ENT *e;
+	uint8_t *data;
+	uint32_t i;
+
+	ticket->nstripes = 0;
+	if (rc == NULL || len == 0)
+		return NULL;
+
+	MTX_LOCK(&rc->mutex);
+	if (!rc_ready(rc, spec->blocklen) || rc->capacity == 0) {
+		MTX_UNLOCK(&rc->mutex);
+		return NULL;
+	}
+	if (len > rc->capacity)
+		goto miss;
+	for (i = 0; i < len; i++) {
+		e = rc_find(rc, lba + i);
+		if (e == NULL || e->slot < 0)
+			goto miss;
+	}
+
+	data = xmalloc((uint64_t)len * rc->blocklen);
+	for (i = 0; i < len; i++) {
+		e = rc_find(rc, lba + i);
+		memcpy(data + (uint64_t)i * rc->blocklen,
+		    rc->arena + (uint64_t)e->slot * rc->blocklen, rc->blocklen);
+		if (e->q == RC_AM && e != TAILQ_FIRST(&rc->am)) {
+			TAILQ_REMOVE(&rc->am, e, qnext);
+			TAILQ_INSERT_HEAD(&rc->am, e, qnext);
+		}
+	}
+	rc->hits++;
+	MTX_UNLOCK(&rc->mutex);
+	return data;
+
+miss:
+	rc->misses++;
+	rc_ticket(rc, lba, len, ticket);
+	MTX_UNLOCK(&rc->mutex);
+	return NULL;
+}
+
+void
+istgt_lu_disk_rcache_fill(ISTGT_LU_DISK *spec, uint64_t lba, uint32_t len,
+    const uint8_t *data, ISTGT_LU_RCACHE_TICKET *ticket)
+{
+	ISTGT_RCACHE *rc = spec->rcache;
+	uint64_t s;
+	uint32_t i;
+	int n;
+
+	if (rc == NULL || ticket->nstripes == 0)
+		return;
+
+	MTX_LOCK(&rc->mutex);
+	if (ticket->epoch != rc->epoch || rc->blocklen != spec->blocklen ||
+	    rc->capacity == 0)
+		goto stale;
+	s = lba >> RC_STRIPE_SHIFT;
+	for (n = 0; n < ticket->nstripes; n++, s++)
+		if (ticket->gen[n] != rc->gen[s % RC_NSTRIPES])
+			goto stale;
+
+	for (i = 0; i < len; i++)
+		rc_insert(rc, lba + i, data + (uint64_t)i * rc->blocklen);
+	rc->fills++;
+	MTX_UNLOCK(&rc->mutex);
+	return;
+
+stale:
+	rc->stale_fills++;
+	MTX_UNLOCK(&rc->mutex);
+}
+
+/* Drop the range, called by every path that modifies the LUN. */
+void
+istgt_lu_disk_rcache_invalidate(ISTGT_LU_DISK *spec, uint64_t lba,
+    uint64_t len)
+{
+	ISTGT_RCACHE *rc = spec->rcache;
+	RC_ENT *e;
+	uint64_t s, first, last, i;
+
+	if (rc == NULL || len == 0)
+		return;
+
+	MTX_LOCK(&rc->mutex);
+	first = lba >> RC_STRIPE_SHIFT;
+	last = (lba + len - 1) >> RC_STRIPE_SHIFT;
+	if (last - first >= RC_NSTRIPES)
+		rc->epoch++;
+	else
+		for (s = first; s <= last; s++)
+			rc->gen[s % RC_NSTRIPES]++;
+
+	if (rc->capacity == 0 || rc->n_a1in + rc->n_am == 0) {
+		MTX_UNLOCK(&rc->mutex);
+		return;
+	}
+	if (len <= rc->nents) {
+		for (i = 0; i < len; i++) {
+			e = rc_find(rc, lba + i);
+			if (e != NULL && e->slot >= 0)
+				rc_free_ent(rc, e);
+		}
+	} else {
+		for (i = 0; i < rc->nents; i++) {
+			e = &rc->ents[i];
+			if (e->slot >= 0 && e->lba >= lba && e->lba - lba < len)
+				rc_free_ent(rc, e);
+		}
+	}
+	MTX_UNLOCK(&rc->mutex);
+}
+
+/*
+ * Forget everything, for when the LUN contents may have changed behind
+ * our back (rebuild, replicas coming back with different data).
+ */
+void
+istgt_lu_disk_rcache_flush(ISTGT_LU_DISK *spec)
+{
+	ISTGT_RCACHE *rc = spec->rcache;
+
+	if (rc == NULL)
+		return;
+
+	MTX_LOCK(&rc->mutex);
+	rc->epoch++;
+	if (rc->capacity != 0)
+		rc_reset(rc);
+	MTX_UNLOCK(&rc->mutex);
+}
+
+void
+istgt_lu_disk_rcache_stats(ISTGT_LU_DISK *spec, ISTGT_LU_RCACHE_STATS *st)
+{
+	ISTGT_RCACHE *rc = spec->rcache;
+
+	memset(st, 0, sizeof (*st));
+	if (rc == NULL)
+		return;
+
+	MTX_LOCK(&rc->mutex);
+	st->hits = rc->hits;
+	st->misses = rc->misses;
+	st->size = rc->size;
+	st->used = (uint64_t)(rc->n_a1in + rc->n_am) * rc->blocklen;
+	st->memory = st->used;
+	if (rc->hash != NULL)
+		st->memory += (uint64_t)rc->nents * sizeof (RC_ENT) +
+		    (uint64_t)(rc->hmask + 1) * sizeof (RC_ENT *) +
+		    (uint64_t)rc->capacity * sizeof (int32_t);
+	MTX_UNLOCK(&rc->mutex);
+}
@@ -0,0 +1,879 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+#if !defined(__GNUC__)
+#undef __attribute__
+#define __attribute__(x)
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && !defined(REPLICATION)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && !defined(REPLICATION) && \
+    defined(__NR_io_uring_setup)
+
+/*
+ * io_uring engine for RAW storage LUNs (LUN option "IOEngine uring").
+ *
+ * One ring per LUN.  The thread that queues an SQE and finds nobody
+ * else inside io_uring_enter() becomes the submitter and keeps
+ * submitting until no more SQEs are queued, so IOs arriving from other
+ * luworkers in the meantime go to the kernel in one batch.  A reaper
+ * thread waits for completions and calls the done() of each IO.
+ *
+ * READ and WRITE commands are not waited for: the luworker arms them in
+ * lbread/lbwrite, hands them over once it is done with the task and goes
+ * on with the next command, istgt_lu_disk_uring_task_done() answers them
+ * from the reaper.  So the IOs in flight are bounded by the ring, not by
+ * the number of luworkers.  Other users wait for their IO through
+ * istgt_lu_disk_uring_pread/pwritev/fsync.
+ *
+ * With "DirectIO Enable" the ring gets its own O_DIRECT descriptor and
+ * IO goes through page aligned bounce buffers registered with the ring
+ * (READ_FIXED/WRITE_FIXED).  spec->fd stays buffered for the remaining
+ * users (allocate, ATS, WRITE SAME, XCOPY) which do unaligned IO.
+ */
+
+/* largest IO served from a registered buffer, bigger ones bounce via malloc */
+#define	ISTGT_LU_URING_BUFLEN	(1024 * 1024)
+#define	ISTGT_LU_URING_ENTRIES	256
+#define	ISTGT_LU_URING_ALIGN	4096
+
+/* a caller of the synchronous wrappers */
+typedef struct istgt_lu_disk_uring_req_t {
+	pthread_cond_t cond;
+	int done;
+} ISTGT_LU_DISK_URING_REQ;
+
+typedef struct istgt_lu_disk_uring_t {
+	ISTGT_LU_DISK *spec;
+	int ring_fd;
+	int fd;			/* spec->fd, or our own O_DIRECT fd */
+	int directio;
+	unsigned entries;
+
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t space_cond;
+	unsigned queued;	/* in the SQ, not yet passed to io_uring_enter */
+	unsigned inflight;	/* queued or submitted, CQE not reaped yet */
+	ISTGT_LU_DISK_URING_IO *iolist;	/* prepared or in flight */
+	int submitting;
+	int stopping;
+	pthread_t reaper;
+
+	/* O_DIRECT bounce buffers */
+	uint8_t *bufs;
+	int nbufs;
+	int registered;
+	int *freebuf;
+	int nfree;
+
+	/* stats */
+	uint64_t ios;
+	uint64_t enters;
+} ISTGT_LU_DISK_URING;
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	    flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+uring_unmap(ISTGT_LU_DISK_URING *ur)
+{
+	if (ur->sqes != NULL && ur->sqes != MAP_FAILED)
+		munmap(ur->sqes, ur->sqes_len);
+	if (ur->cq_ptr != NULL && ur->cq_ptr != MAP_FAILED)
+		munmap(ur->cq_ptr, ur->cq_len);
+	if (ur->sq_ptr != NULL && ur->sq_ptr != MAP_FAILED)
+		munmap(ur->sq_ptr, ur->sq_len);
+	if (ur->bufs != NULL)
+		munmap(ur->bufs, (size_t)ur->nbufs * ISTGT_LU_URING_BUFLEN);
+	xfree(ur->freebuf);
+}
+
+static int
+uring_map(ISTGT_LU_DISK_URING *ur, struct io_uring_params *p)
+{
+	uint8_t *sq, *cq;
+
+	ur->sq_len = p->sq_off.array + p->sq_entries * sizeof (unsigned);
+	ur->cq_len = p->cq_off.cqes +
+	    p->cq_entries * sizeof (struct io_uring_cqe);
+	ur->sqes_len = p->sq_entries * sizeof (struct io_uring_sqe);
+
+	ur->sq_ptr = mmap(NULL, ur->sq_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED)
+		return -1;
+	ur->cq_ptr = mmap(NULL, ur->cq_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+	if (ur->cq_ptr == MAP_FAILED)
+		return -1;
+	ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED)
+		return -1;
+
+	sq = ur->sq_ptr;
+	ur->sq_head = (unsigned *)(void *)(sq + p->sq_off.head);
+	ur->sq_tail = (unsigned *)(void *)(sq + p->sq_off.tail);
+	ur->sq_mask = (unsigned *)(void *)(sq + p->sq_off.ring_mask);
+	ur->sq_array = (unsigned *)(void *)(sq + p->sq_off.array);
+
+	cq = ur->cq_ptr;
+	ur->cq_head = (unsigned *)(void *)(cq + p->cq_off.head);
+	ur->cq_tail = (unsigned *)(void *)(cq + p->cq_off.tail);
+	ur->cq_mask = (unsigned *)(void *)(cq + p->cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(void *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+static void
+uring_setup_bufs(ISTGT_LU_DISK_URING *ur, int nbufs)
+{
+	struct iovec *iov;
+	int i, rc;
+
+	ur->bufs = mmap(NULL, (size_t)nbufs * ISTGT_LU_URING_BUFLEN,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ur->bufs == MAP_FAILED) {
+		ur->bufs = NULL;
+		return;
+	}
+	ur->nbufs = nbufs;
+	ur->freebuf = xmalloc(sizeof (int) * nbufs);
+	for (i = 0; i < nbufs; i++)
+		ur->freebuf[i] = i;
+	ur->nfree = nbufs;
+
+	iov = xmalloc(sizeof (*iov) * nbufs);
+	for (i = 0; i < nbufs; i++) {
+		iov[i].iov_base = ur->bufs + (size_t)i * ISTGT_LU_URING_BUFLEN;
+		iov[i].iov_len = ISTGT_LU_URING_BUFLEN;
+	}
+	rc = uring_register(ur->ring_fd, IORING_REGISTER_BUFFERS, iov,
+	    (unsigned)nbufs);
+	xfree(iov);
+	if (rc < 0) {
+		/* most likely RLIMIT_MEMLOCK, the buffers are still aligned */
+		ISTGT_WARNLOG("LU%d: LUN%d: uring buffer registration failed "
+		    "(errno=%d), using unregistered bounce buffers\n",
+		    ur->spec->num, ur->spec->lun, errno);
+		return;
+	}
+	ur->registered = 1;
+}
+
+static void
+uring_link(ISTGT_LU_DISK_URING *ur, ISTGT_LU_DISK_URING_IO *io)
+{
+	if (io->linked)
+		return;
+	io->prev = NULL;
+	io->next = ur->iolist;
+	if (ur->iolist != NULL)
+		ur->iolist->prev = io;
+	ur->iolist = io;
+	io->linked = 1;
+}
+
+static void
+uring_unlink(ISTGT_LU_DISK_URING *ur, ISTGT_LU_DISK_URING_IO *io)
+{
+	if (!io->linked)
+		return;
+	if (io->prev != NULL)
+		io->prev->next = io->next;
+	else
+		ur->iolist = io->next;
+	if (io->next != NULL)
+		io->next->prev = io->prev;
+	io->prev = io->next = NULL;
+	io->linked = 0;
+}
+
+/*
+ * Queue one SQE; called with ur->mutex held and a free SQ slot.
+ */
+static void
+uring_queue(ISTGT_LU_DISK_URING *ur, uint8_t opcode, void *addr,
+    uint32_t len, uint64_t offset, int buf_index, int rw_flags,
+    ISTGT_LU_DISK_URING_IO *io)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *ur->sq_tail;
+	idx = tail & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof (*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = ur->fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->rw_flags = rw_flags;
+	if (buf_index >= 0)
+		sqe->buf_index = (uint16_t)buf_index;
+	sqe->user_data = (uint64_t)(uintptr_t)io;
+	ur->sq_array[idx] = idx;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ur->queued++;
+	ur->inflight++;
+}
+
+/*
+ * Queue what is left of io, from io->xfered on; ur->mutex held and a free
+ * SQ slot.
+ */
+static void
+uring_queue_io(ISTGT_LU_DISK_URING *ur, ISTGT_LU_DISK_URING_IO *io)
+{
+	uint64_t off = io->offset + io->xfered;
+	uint32_t len = (uint32_t)(io->nbytes - io->xfered);
+	int wr = (io->opcode == ISTGT_LU_URING_WRITE);
+	int rw_flags = 0;
+
+	if (io->opcode == ISTGT_LU_URING_FSYNC) {
+		uring_queue(ur, IORING_OP_FSYNC, NULL, 0, 0, -1, 0, io);
+		return;
+	}
+#ifdef RWF_SYNC
+	/* setcache() puts O_FSYNC on spec->fd, which our fd doesn't have */
+	if (wr && !ur->spec->writecache)
+		rw_flags = RWF_SYNC;
+#endif
+	if (io->buf != NULL && io->buf_index >= 0) {
+		uring_queue(ur, wr ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED,
+		    io->buf + io->xfered, len, off, io->buf_index, rw_flags, io);
+	} else if (io->buf != NULL) {
+		io->biov.iov_base = io->buf + io->xfered;
+		io->biov.iov_len = len;
+		uring_queue(ur, wr ? IORING_OP_WRITEV : IORING_OP_READV,
+		    &io->biov, 1, off, -1, rw_flags, io);
+	} else if (io->riov != NULL) {
+		uring_queue(ur, wr ? IORING_OP_WRITEV : IORING_OP_READV,
+		    io->riov, (uint32_t)io->riovcnt, off, -1, rw_flags, io);
+	} else {
+		uring_queue(ur, wr ? IORING_OP_WRITEV : IORING_OP_READV,
+		    io->iov, (uint32_t)io->iovcnt, off, -1, rw_flags, io);
+	}
+}
+
+/* after a short IO, the caller's iovec minus what went through */
+static void
+uring_trim_iov(ISTGT_LU_DISK_URING_IO *io)
+{
+	uint64_t skip = io->xfered;
+	int i, j;
+
+	for (i = 0; i < io->iovcnt && skip >= io->iov[i].iov_len; i++)
+		skip -= io->iov[i].iov_len;
+	xfree(io->riov);
+	io->riovcnt = io->iovcnt - i;
+	io->riov = xmalloc(sizeof (struct iovec) * io->riovcnt);
+	for (j = 0; j < io->riovcnt; j++, i++) {
+		io->riov[j].iov_base = (uint8_t *)io->iov[i].iov_base + skip;
+		io->riov[j].iov_len = io->iov[i].iov_len - skip;
+		skip = 0;
+	}
+}
+
+/*
+ * Push everything queued to the kernel unless another thread is
+ * already doing it; SQEs queued while we are inside io_uring_enter()
+ * are picked up by the next round of the loop.
+ */
+static void
+uring_flush(ISTGT_LU_DISK_URING *ur)
+{
+	unsigned n;
+	int rc;
+
+	if (ur->submitting)
+		return;
+	ur->submitting = 1;
+	while (ur->queued > 0) {
+		n = ur->queued;
+		MTX_UNLOCK(&ur->mutex);
+		rc = uring_enter(ur->ring_fd, n, 0, 0);
+		MTX_LOCK(&ur->mutex);
+		ur->enters++;
+		if (rc < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				ISTGT_ERRLOG("LU%d: LUN%d: io_uring_enter(%u) "
+				    "failed errno:%d\n", ur->spec->num,
+				    ur->spec->lun, n, errno);
+			MTX_UNLOCK(&ur->mutex);
+			sched_yield();
+			MTX_LOCK(&ur->mutex);
+			continue;
+		}
+		ur->queued -= (unsigned)rc;
+	}
+	ur->submitting = 0;
+}
+
+static void uring_put_buf(ISTGT_LU_DISK_URING *ur, uint8_t *buf);
+
+/* io is off the list; bounce data back, release what the engine took */
+static void
+uring_finish(ISTGT_LU_DISK_URING *ur, ISTGT_LU_DISK_URING_IO *io)
+{
+	uint64_t n, len, left;
+	int i;
+
+	if (io->buf != NULL) {
+		if (io->opcode == ISTGT_LU_URING_READ && io->res > 0) {
+			left = (uint64_t)io->res;
+			for (i = 0, n = 0; i < io->iovcnt && left > 0; i++) {
+				len = io->iov[i].iov_len;
+				if (len > left)
+					len = left;
+				memcpy(io->iov[i].iov_base, io->buf + n, len);
+				n += len;
+				left -= len;
+			}
+		}
+		uring_put_buf(ur, io->buf);
+		io->buf = NULL;
+	}
+	xfree(io->riov);
+	io->riov = NULL;
+	io->done(ur->spec, io);
+}
+
+static void *
+uring_reaper(void *arg)
+{
+	ISTGT_LU_DISK_URING *ur = arg;
+	ISTGT_LU_DISK_URING_IO *io, *done;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail, reaped;
+	int rc, stop = 0, requeued;
+
+	snprintf(tinfo, sizeof (tinfo), "uring#%d.%d", ur->spec->num,
+	    ur->spec->lun);
+	while (1) {
+		rc = uring_enter(ur->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+		if (rc < 0 && errno != EINTR && errno != EAGAIN) {
+			ISTGT_ERRLOG("LU%d: LUN%d: io_uring_enter(GETEVENTS) "
+			    "failed errno:%d\n", ur->spec->num, ur->spec->lun,
+			    errno);
+			sleep(1);
+		}
+
+		MTX_LOCK(&ur->mutex);
+		head = *ur->cq_head;
+		tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+		reaped = 0;
+		requeued = 0;
+		done = NULL;
+		while (head != tail) {
+			cqe = &ur->cqes[head & *ur->cq_mask];
+			io = (ISTGT_LU_DISK_URING_IO *)(uintptr_t)cqe->user_data;
+			head++;
+			reaped++;
+			ur->inflight--;
+			if (io == NULL) {
+				/* shutdown marker queued by uring_close */
+				stop = 1;
+				continue;
+			}
+			if (cqe->res > 0 && io->opcode != ISTGT_LU_URING_FSYNC &&
+			    io->xfered + (uint64_t)cqe->res < io->nbytes) {
+				/* short, go on with the rest in the slot just freed */
+				io->xfered += (uint64_t)cqe->res;
+				if (io->buf == NULL)
+					uring_trim_iov(io);
+				uring_queue_io(ur, io);
+				requeued++;
+				continue;
+			}
+			if (cqe->res < 0)
+				io->res = cqe->res;
+			else if (cqe->res == 0 && io->xfered < io->nbytes)
+				io->res = -EIO;
+			else
+				io->res = (int64_t)(io->xfered + cqe->res);
+			uring_unlink(ur, io);
+			io->next = done;
+			done = io;
+		}
+		__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+		if (requeued != 0)
+			uring_flush(ur);
+		if (reaped != 0)
+			pthread_cond_broadcast(&ur->space_cond);
+		MTX_UNLOCK(&ur->mutex);
+
+		/* done() answers the command, keep the ring unlocked */
+		while ((io = done) != NULL) {
+			done = io->next;
+			io->next = NULL;
+			uring_finish(ur, io);
+		}
+
+		MTX_LOCK(&ur->mutex);
+		if (stop && ur->inflight == 0) {
+			MTX_UNLOCK(&ur->mutex);
+			break;
+		}
+		MTX_UNLOCK(&ur->mutex);
+	}
+	return NULL;
+}
+
+static uint8_t *
+uring_get_buf(ISTGT_LU_DISK_URING *ur, uint64_t nbytes, int *buf_index)
+{
+	void *p = NULL;
+	int idx = -1;
+
+	if (nbytes <= ISTGT_LU_URING_BUFLEN) {
+		MTX_LOCK(&ur->mutex);
+		if (ur->nfree > 0)
+			idx = ur->freebuf[--ur->nfree];
+		MTX_UNLOCK(&ur->mutex);
+	}
+	if (idx >= 0) {
+		*buf_index = ur->registered ? idx : -1;
+		return ur->bufs + (size_t)idx * ISTGT_LU_URING_BUFLEN;
+	}
+	*buf_index = -1;
+	if (posix_memalign(&p, ISTGT_LU_URING_ALIGN, nbytes) != 0)
+		return NULL;
+	return p;
+}
+
+static void
+uring_put_buf(ISTGT_LU_DISK_URING *ur, uint8_t *buf)
+{
+	if (ur->bufs != NULL && buf >= ur->bufs &&
+	    buf < ur->bufs + (size_t)ur->nbufs * ISTGT_LU_URING_BUFLEN) {
+		MTX_LOCK(&ur->mutex);
+		ur->freebuf[ur->nfree++] =
+		    (int)((size_t)(buf - ur->bufs) / ISTGT_LU_URING_BUFLEN);
+		MTX_UNLOCK(&ur->mutex);
+		return;
+	}
+	free(buf);
+}
+
+/*
+ * Make io known to the engine before it is submitted, so that
+ * istgt_lu_disk_uring_foreach() finds it in between.
+ */
+void
+istgt_lu_disk_uring_prepare(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io)
+{
+	ISTGT_LU_DISK_URING *ur = spec->uring_ctx;
+
+	io->linked = 0;
+	io->riov = NULL;
+	io->buf = NULL;
+	MTX_LOCK(&ur->mutex);
+	uring_link(ur, io);
+	MTX_UNLOCK(&ur->mutex);
+}
+
+/*
+ * Start io and return; io->done() is called once it completed, or right
+ * away from here if it couldn't be started.
+ */
+void
+istgt_lu_disk_uring_submit(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io)
+{
+	ISTGT_LU_DISK_URING *ur = spec->uring_ctx;
+	uint64_t n;
+	int i;
+
+	if (!io->linked) {
+		io->riov = NULL;
+		io->buf = NULL;
+	}
+	io->xfered = 0;
+	io->buf_index = -1;
+	io->res = 0;
+	if (ur->directio && io->opcode != ISTGT_LU_URING_FSYNC) {
+		io->buf = uring_get_buf(ur, io->nbytes, &io->buf_index);
+		if (io->buf == NULL) {
+			io->res = -ENOMEM;
+			goto done;
+		}
+		if (io->opcode == ISTGT_LU_URING_WRITE) {
+			for (i = 0, n = 0; i < io->iovcnt; i++) {
+				memcpy(io->buf + n, io->iov[i].iov_base,
+				    io->iov[i].iov_len);
+				n += io->iov[i].iov_len;
+			}
+		}
+	}
+
+	MTX_LOCK(&ur->mutex);
+	uring_link(ur, io);
+	while (ur->inflight >= ur->entries - 1 && !ur->stopping)
+		pthread_cond_wait(&ur->space_cond, &ur->mutex);
+	if (ur->stopping) {
+		uring_unlink(ur, io);
+		MTX_UNLOCK(&ur->mutex);
+		io->res = -ESHUTDOWN;
+		goto done;
+	}
+	uring_queue_io(ur, io);
+	ur->ios++;
+	uring_flush(ur);
+	MTX_UNLOCK(&ur->mutex);
+	return;
+
+done:
+	MTX_LOCK(&ur->mutex);
+	uring_unlink(ur, io);
+	MTX_UNLOCK(&ur->mutex);
+	uring_finish(ur, io);
+}
+
+/*
+ * Calls fn on every IO prepared or in flight, with the engine locked, and
+ * returns the sum of what it returned.
+ */
+int
+istgt_lu_disk_uring_foreach(ISTGT_LU_DISK *spec,
+    int (*fn)(ISTGT_LU_DISK_URING_IO *io, void *arg), void *arg)
+{
+	ISTGT_LU_DISK_URING *ur = spec->uring_ctx;
+	ISTGT_LU_DISK_URING_IO *io;
+	int n = 0;
+
+	if (ur == NULL)
+		return 0;
+	MTX_LOCK(&ur->mutex);
+	for (io = ur->iolist; io != NULL; io = io->next)
+		n += fn(io, arg);
+	MTX_UNLOCK(&ur->mutex);
+	return n;
+}
+
+static void
+uring_wake(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io)
+{
+	ISTGT_LU_DISK_URING *ur = spec->uring_ctx;
+	ISTGT_LU_DISK_URING_REQ *req = io->arg;
+
+	MTX_LOCK(&ur->mutex);
+	req->done = 1;
+	pthread_cond_signal(&req->cond);
+	MTX_UNLOCK(&ur->mutex);
+}
+
+static int64_t
+uring_do(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io)
+{
+	ISTGT_LU_DISK_URING *ur = spec->uring_ctx;
+	ISTGT_LU_DISK_URING_REQ req;
+
+	pthread_cond_init(&req.cond, NULL);
+	req.done = 0;
+	io->done = uring_wake;
+	io->arg = &req;
+	io->linked = 0;
+	istgt_lu_disk_uring_submit(spec, io);
+	MTX_LOCK(&ur->mutex);
+	while (!req.done)
+		pthread_cond_wait(&req.cond, &ur->mutex);
+	MTX_UNLOCK(&ur->mutex);
+	pthread_cond_destroy(&req.cond);
+
+	if (io->res < 0) {
+		errno = (int)-io->res;
+		return -1;
+	}
+	return io->res;
+}
+
+int
+istgt_lu_disk_uring_open(ISTGT_LU_DISK *spec, int flags)
+{
+	ISTGT_LU_DISK_URING *ur;
+	struct io_uring_params params;
+	unsigned entries;
+	int rc;
+
+	if (spec->fd < 0)
+		return -1;
+
+	ur = xmalloc(sizeof (*ur));
+	memset(ur, 0, sizeof (*ur));
+	ur->spec = spec;
+	ur->fd = spec->fd;
+	ur->ring_fd = -1;
+
+	/* READ/WRITE don't hold a luworker, size the ring for the queue */
+	entries = ISTGT_LU_URING_ENTRIES;
+	while (entries < (unsigned)spec->luworkers + 1)
+		entries <<= 1;
+
+	memset(&params, 0, sizeof (params));
+	ur->ring_fd = uring_setup(entries, &params);
+	if (ur->ring_fd < 0) {
+		ISTGT_WARNLOG("LU%d: LUN%d: io_uring_setup failed (errno=%d), "
+		    "using synchronous IO\n", spec->num, spec->lun, errno);
+		xfree(ur);
+		return -1;
+	}
+	ur->entries = params.sq_entries;
+	if (uring_map(ur, &params) != 0) {
+		ISTGT_WARNLOG("LU%d: LUN%d: io_uring mmap failed (errno=%d), "
+		    "using synchronous IO\n", spec->num, spec->lun, errno);
+		goto error_return;
+	}
+
+	if (spec->directio) {
+		rc = open(spec->file,
+		    (flags & O_ACCMODE) | O_DIRECT);
+		if (rc < 0) {
+			ISTGT_WARNLOG("LU%d: LUN%d: O_DIRECT open failed "
+			    "(errno=%d), using buffered IO\n",
+			    spec->num, spec->lun, errno);
+		} else {
+			ur->fd = rc;
+			ur->directio = 1;
+			uring_setup_bufs(ur, spec->luworkers);
+		}
+	}
+
+	pthread_mutex_init(&ur->mutex, NULL);
+	pthread_cond_init(&ur->space_cond, NULL);
+	rc = pthread_create(&ur->reaper, NULL, &uring_reaper, ur);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: LUN%d: uring reaper thread create failed\n",
+		    spec->num, spec->lun);
+		pthread_mutex_destroy(&ur->mutex);
+		pthread_cond_destroy(&ur->space_cond);
+		goto error_return;
+	}
+
+	spec->uring_ctx = ur;
+	ISTGT_NOTICELOG("LU%d: LUN%d: io_uring engine, %u entries%s%s\n",
+	    spec->num, spec->lun, ur->entries,
+	    ur->directio ? ", O_DIRECT" : "",
+	    ur->registered ? ", fixed buffers" : "");
+	return 0;
+
+error_return:
+	if (ur->fd != spec->fd)
+		close(ur->fd);
+	uring_unmap(ur);
+	close(ur->ring_fd);
+	xfree(ur);
+	return -1;
+}
+
+void
+istgt_lu_disk_uring_close(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_URING *ur = spec->uring_ctx;
+
+	if (ur == NULL)
+		return;
+
+	MTX_LOCK(&ur->mutex);
+	ur->stopping = 1;
+	pthread_cond_broadcast(&ur->space_cond);
+	/* the slot reserved for the marker is always free */
+	uring_queue(ur, IORING_OP_NOP, NULL, 0, 0, -1, 0, NULL);
+	uring_flush(ur);
+	MTX_UNLOCK(&ur->mutex);
+	pthread_join(ur->reaper, NULL);
+
+	ISTGT_NOTICELOG("LU%d: LUN%d: io_uring engine closed, %"PRIu64" IOs in "
+	    "%"PRIu64" submit calls\n", spec->num, spec->lun, ur->ios,
+	    ur->enters);
+
+	spec->uring_ctx = NULL;
+	if (ur->fd != spec->fd)
+		close(ur->fd);
+	uring_unmap(ur);
+	close(ur->ring_fd);
+	pthread_mutex_destroy(&ur->mutex);
+	pthread_cond_destroy(&ur->space_cond);
+	xfree(ur);
+}
+
+int64_t
+istgt_lu_disk_uring_pread(ISTGT_LU_DISK *spec, void *data, uint64_t nbytes,
+    uint64_t offset)
+{
+	ISTGT_LU_DISK_URING_IO io;
+
+	memset(&io, 0, sizeof (io));
+	io.opcode = ISTGT_LU_URING_READ;
+	io.iov1.iov_base = data;
+	io.iov1.iov_len = nbytes;
+	io.iov = &io.iov1;
+	io.iovcnt = 1;
+	io.offset = offset;
+	io.nbytes = nbytes;
+	return uring_do(spec, &io);
+}
+
+int64_t
+istgt_lu_disk_uring_pwritev(ISTGT_LU_DISK *spec, const struct iovec *iov,
+    int iovcnt, uint64_t offset)
+{
+	ISTGT_LU_DISK_URING_IO io;
+	int i;
+
+	memset(&io, 0, sizeof (io));
+	io.opcode = ISTGT_LU_URING_WRITE;
+	io.iov = (struct iovec *)(uintptr_t)iov;
+	io.iovcnt = iovcnt;
+	io.offset = offset;
+	for (i = 0; i < iovcnt; i++)
+		io.nbytes += iov[i].iov_len;
+	return uring_do(spec, &io);
+}
+
+int64_t
+istgt_lu_disk_uring_fsync(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_URING_IO io;
+
+	memset(&io, 0, sizeof (io));
+	io.opcode = ISTGT_LU_URING_FSYNC;
+	return uring_do(spec, &io);
+}
+#else /* io_uring */
+int
+istgt_lu_disk_uring_open(ISTGT_LU_DISK *spec, int flags __attribute__((__unused__)))
+{
+	ISTGT_WARNLOG("LU%d: LUN%d: io_uring not supported by this build, "
+	    "using synchronous IO\n", spec->num, spec->lun);
+	return -1;
+}
+
+void
+istgt_lu_disk_uring_close(ISTGT_LU_DISK *spec __attribute__((__unused__)))
+{
+}
+
+int64_t
+istgt_lu_disk_uring_pread(ISTGT_LU_DISK *spec __attribute__((__unused__)),
+    void *data __attribute__((__unused__)),
+    uint64_t nbytes __attribute__((__unused__)),
+    uint64_t offset __attribute__((__unused__)))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int64_t
+istgt_lu_disk_uring_pwritev(ISTGT_LU_DISK *spec __attribute__((__unused__)),
+    const struct iovec *iov __attribute__((__unused__)),
+    int iovcnt __attribute__((__unused__)),
+    uint64_t offset __attribute__((__unused__)))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int64_t
+istgt_lu_disk_uring_fsync(ISTGT_LU_DISK *spec __attribute__((__unused__)))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+istgt_lu_disk_uring_prepare(ISTGT_LU_DISK *spec __attribute__((__unused__)),
+    ISTGT_LU_DISK_URING_IO *io __attribute__((__unused__)))
+{
+}
+
+void
+istgt_lu_disk_uring_submit(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io)
+{
+	io->res = -ENOSYS;
+	io->done(spec, io);
+}
+
+int
+istgt_lu_disk_uring_foreach(ISTGT_LU_DISK *spec __attribute__((__unused__)),
+    int (*fn)(ISTGT_LU_DISK_URING_IO *io, void *arg) __attribute__((__unused__)),
+    void *arg __attribute__((__unused__)))
+{
+	return 0;
+}
+#endif /* io_uring */
@@ -593,6 +593,7 @@ istgt_lu_disk_lbxcopy(ISTGT_XCOPY_TGT *src_tgt, ISTGT_XCOPY_TGT *dst_tgt, CONN_P
 
 	MTX_LOCK(&dst_tgt->spec->clone_mutex);
 	rc = pwrite(dst_tgt->spec->fd, clone_buf, nbytes, dst_tgt->offset);
+	istgt_lu_disk_rcache_invalidate(dst_tgt->spec, dst_tgt->lba, llen);
 	if (rc < 0  || (uint64_t) rc != nbytes) {
 		xfree(clone_buf);
 		/* CloudByte: TODO FIX, Refer sp4r36s Table-118, Preserve the residual data
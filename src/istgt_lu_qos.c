@@ -0,0 +1,414 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_queue.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+/*
+ * QoS (QoSIOPS/QoSBandwidth and QoSInitiatorIOPS/QoSInitiatorBandwidth
+ * in the LU section).
+ *
+ * Token buckets holding up to QoSBurst msec worth of the limit, one for
+ * the LU and one per initiator port.  The scheduler asks for a task only
+ * once it has a free luworker, and gets the oldest task in cmd_queue that
+ * both the LU bucket and its initiator's bucket can pay for; throttled
+ * tasks stay queued.  Tasks of one initiator always go out in order, those
+ * of another initiator may pass them, but an ORDERED task neither passes
+ * nor is passed.  Bandwidth is charged for the data transferred.
+ *
+ * A task is admitted as long as the bucket isn't empty and the bucket
+ * may go into debt for its byte count, so an IO bigger than the burst
+ * still gets through and only delays the following ones.
+ */
+
+#define	QOS_MIN_WAIT_US		50
+#define	QOS_MAX_WAIT_US		(100 * 1000)
+
+typedef struct istgt_lu_qos_bucket {
+	char name[MAX_INITIATOR_NAME];
+	ISTGT_LU_QOS_LIMIT limit;
+	double ops;
+	double bytes;
+	uint64_t last_ns;
+	uint64_t throttled_since_ns;	/* 0 while not throttled */
+	uint64_t throttle_ns;
+	uint64_t throttled;
+	uint64_t admitted;
+	TAILQ_ENTRY(istgt_lu_qos_bucket) next;
+} QOS_BUCKET;
+
+typedef struct istgt_lu_qos {
+	pthread_mutex_t mutex;
+	int enabled;
+	QOS_BUCKET lu;
+	ISTGT_LU_QOS_LIMIT initiator;
+	int nbuckets;
+	TAILQ_HEAD(, istgt_lu_qos_bucket) buckets;
+} ISTGT_LU_QOS;
+
+static uint64_t
+qos_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static double
+qos_cap_ops(const ISTGT_LU_QOS_LIMIT *l)
+{
+	double cap = (double)l->iops * l->burst_ms / 1000.0;
+
+	return (cap < 1.0 ? 1.0 : cap);
+}
+
+static double
+qos_cap_bytes(const ISTGT_LU_QOS_LIMIT *l)
+{
+	double cap = (double)l->bps * l->burst_ms / 1000.0;
+
+	return (cap < 1.0 ? 1.0 : cap);
+}
+
+static int
+qos_limited(const ISTGT_LU_QOS_LIMIT *l)
+{
+	return (l->iops != 0 || l->bps != 0);
+}
+
+static void
+qos_bucket_set(QOS_BUCKET *b, const ISTGT_LU_QOS_LIMIT *l, uint64_t now)
+{
+	b->limit = *l;
+	if (b->limit.burst_ms == 0)
+		b->limit.burst_ms = DEFAULT_LU_QOS_BURST_MS;
+	/* start full, or keep what's left if the limit went up */
+	if (b->last_ns == 0 || b->ops > qos_cap_ops(&b->limit))
+		b->ops = qos_cap_ops(&b->limit);
+	if (b->last_ns == 0 || b->bytes > qos_cap_bytes(&b->limit))
+		b->bytes = qos_cap_bytes(&b->limit);
+	b->last_ns = now;
+}
+
+static void
+qos_refill(QOS_BUCKET *b, uint64_t now)
+{
+	double dt;
+
+	if (now <= b->last_ns)
+		return;
+	dt = (double)(now - b->last_ns) / 1e9;
+	b->last_ns = now;
+	if (b->limit.iops != 0) {
+		b->ops += dt * b->limit.iops;
+		if (b->ops > qos_cap_ops(&b->limit))
+			b->ops = qos_cap_ops(&b->limit);
+	}
+	if (b->limit.bps != 0) {
+		b->bytes += dt * b->limit.bps;
+		if (b->bytes > qos_cap_bytes(&b->limit))
+			b->bytes = qos_cap_bytes(&b->limit);
+	}
+}
+
+/* usec until the bucket can admit again, 0 if it can now */
+static uint64_t
+qos_deficit_us(QOS_BUCKET *b)
+{
+	double w = 0.0, t;
+
+	if (b->limit.iops != 0 && b->ops < 1.0)
+		w = (1.0 - b->ops) / b->limit.iops;
+	if (b->limit.bps != 0 && b->bytes <= 0.0) {
+		t = -b->bytes / b->limit.bps;
+		if (t > w)
+			w = t;
+	}
+	if (w == 0.0)
+		return 0;
+	return ((uint64_t)(w * 1e6) + 1);
+}
+
+static void
+qos_throttle(QOS_BUCKET *b, uint64_t now)
+{
+	if (b->throttled_since_ns == 0)
+		b->throttled_since_ns = now;
+	b->throttled++;
+}
+
+static void
+qos_charge(QOS_BUCKET *b, uint64_t bytes, uint64_t now)
+{
+	if (b->throttled_since_ns != 0) {
+		b->throttle_ns += now - b->throttled_since_ns;
+		b->throttled_since_ns = 0;
+	}
+	if (b->limit.iops != 0)
+		b->ops -= 1.0;
+	if (b->limit.bps != 0)
+		b->bytes -= (double)bytes;
+	b->admitted++;
+}
+
+static QOS_BUCKET *
+qos_initiator_bucket(ISTGT_LU_QOS *qos, const char *port, uint64_t now)
+{
+	QOS_BUCKET *b;
+
+	TAILQ_FOREACH(b, &qos->buckets, next) {
+		if (strcmp(b->name, port) == 0)
+			return b;
+	}
+	b = xmalloc(sizeof (*b));
+	memset(b, 0, sizeof (*b));
+	strlcpy(b->name, port, sizeof (b->name));
+	qos_bucket_set(b, &qos->initiator, now);
+	TAILQ_INSERT_TAIL(&qos->buckets, b, next);
+	qos->nbuckets++;
+	return b;
+}
+
+static void
+qos_update_enabled(ISTGT_LU_QOS *qos)
+{
+	__atomic_store_n(&qos->enabled,
+	    qos_limited(&qos->lu.limit) || qos_limited(&qos->initiator),
+	    __ATOMIC_RELEASE);
+}
+
+int
+istgt_lu_qos_init(ISTGT_LU_DISK *spec, const ISTGT_LU_QOS_LIMIT *lu_limit,
+    const ISTGT_LU_QOS_LIMIT *initiator_limit)
+{
+	ISTGT_LU_QOS *qos;
+	uint64_t now = qos_now_ns();
+
+	qos = xmalloc(sizeof (*qos));
+	memset(qos, 0, sizeof (*qos));
+	pthread_mutex_init(&qos->mutex, NULL);
+	TAILQ_INIT(&qos->buckets);
+	strlcpy(qos->lu.name, "LU", sizeof (qos->lu.name));
+	qos_bucket_set(&qos->lu, lu_limit, now);
+	qos->initiator = *initiator_limit;
+	if (qos->initiator.burst_ms == 0)
+		qos->initiator.burst_ms = DEFAULT_LU_QOS_BURST_MS;
+	qos_update_enabled(qos);
+	spec->qos = qos;
+	return 0;
+}
+
+void
+istgt_lu_qos_destroy(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_QOS *qos = spec->qos;
+	QOS_BUCKET *b;
+
+	if (qos == NULL)
+		return;
+	spec->qos = NULL;
+	while ((b = TAILQ_FIRST(&qos->buckets)) != NULL) {
+		TAILQ_REMOVE(&qos->buckets, b, next);
+		xfree(b);
+	}
+	pthread_mutex_destroy(&qos->mutex);
+	xfree(qos);
+}
+
+/*
+ * Called by the scheduler with complete_queue_mutex held in place of
+ * istgt_queue_dequeue().  Returns NULL if every queued task is over its
+ * limits, *wait_us telling when to try again.
+ */
+ISTGT_LU_TASK_Ptr
+istgt_lu_qos_dequeue(ISTGT_LU_DISK *spec, ISTGT_QUEUE_Ptr queue,
+    uint64_t *wait_us)
+{
+	ISTGT_LU_QOS *qos = spec->qos;
+	ISTGT_LU_TASK_Ptr lu_task;
+	QOS_BUCKET *b;
+	ISTGT_QUEUE_Ptr node;
+	void *cookie = NULL, *prev;
+	uint64_t now, w, bytes;
+	int skipped = 0;
+
+	*wait_us = 0;
+	if (qos == NULL || !__atomic_load_n(&qos->enabled, __ATOMIC_ACQUIRE))
+		return istgt_queue_dequeue(queue);
+
+	MTX_LOCK(&qos->mutex);
+	now = qos_now_ns();
+	qos_refill(&qos->lu, now);
+	*wait_us = QOS_MAX_WAIT_US;
+	if ((w = qos_deficit_us(&qos->lu)) != 0) {
+		qos_throttle(&qos->lu, now);
+		if (w < *wait_us)
+			*wait_us = w;
+		MTX_UNLOCK(&qos->mutex);
+		return NULL;
+	}
+
+	while (1) {
+		prev = cookie;
+		lu_task = istgt_queue_walk(queue, &cookie);
+		if (lu_task == NULL)
+			break;
+		node = (prev == NULL) ? queue->next : (ISTGT_QUEUE_Ptr)prev;
+		if (skipped && lu_task->lu_cmd.Attr_bit == ISTGT_TAG_ORDERED)
+			break;
+
+		if (qos_limited(&qos->initiator) &&
+		    lu_task->lu_cmd.Attr_bit != ISTGT_TAG_HEAD_OF_QUEUE) {
+			b = qos_initiator_bucket(qos, lu_task->in_port, now);
+			qos_refill(b, now);
+			if ((w = qos_deficit_us(b)) != 0) {
+				qos_throttle(b, now);
+				if (w < *wait_us)
+					*wait_us = w;
+				if (lu_task->lu_cmd.Attr_bit ==
+				    ISTGT_TAG_ORDERED)
+					break;
+				skipped = 1;
+				continue;
+			}
+		} else {
+			b = NULL;
+		}
+
+		/* what goes over the wire, not what WRITE SAME/UNMAP cover */
+		bytes = lu_task->lu_cmd.transfer_len;
+		qos_charge(&qos->lu, bytes, now);
+		if (b != NULL)
+			qos_charge(b, bytes, now);
+		istgt_queue_dequeue_middle(queue, node);
+		MTX_UNLOCK(&qos->mutex);
+		*wait_us = 0;
+		return lu_task;
+	}
+	MTX_UNLOCK(&qos->mutex);
+	if (*wait_us < QOS_MIN_WAIT_US)
+		*wait_us = QOS_MIN_WAIT_US;
+	return NULL;
+}
+
+/* scope is "LU" or "INITIATOR" */
+int
+istgt_lu_qos_set(ISTGT_LU_DISK *spec, const char *scope,
+    const ISTGT_LU_QOS_LIMIT *limit)
+{
+	ISTGT_LU_QOS *qos = spec->qos;
+	QOS_BUCKET *b;
+	uint64_t now;
+
+	if (qos == NULL)
+		return -1;
+
+	MTX_LOCK(&qos->mutex);
+	now = qos_now_ns();
+	if (strcasecmp(scope, "LU") == 0) {
+		qos_refill(&qos->lu, now);
+		qos_bucket_set(&qos->lu, limit, now);
+	} else if (strcasecmp(scope, "INITIATOR") == 0) {
+		qos->initiator = *limit;
+		if (qos->initiator.burst_ms == 0)
+			qos->initiator.burst_ms = DEFAULT_LU_QOS_BURST_MS;
+		TAILQ_FOREACH(b, &qos->buckets, next) {
+			qos_refill(b, now);
+			qos_bucket_set(b, &qos->initiator, now);
+		}
+	} else {
+		MTX_UNLOCK(&qos->mutex);
+		return -1;
+	}
+	qos_update_enabled(qos);
+	MTX_UNLOCK(&qos->mutex);
+	return 0;
+}
+
+static void
+qos_bucket_stats(QOS_BUCKET *b, ISTGT_LU_QOS_STATS *st, uint64_t now)
+{
+	strlcpy(st->name, b->name, sizeof (st->name));
+	st->limit = b->limit;
+	st->admitted = b->admitted;
+	st->throttled = b->throttled;
+	st->throttle_us = b->throttle_ns;
+	if (b->throttled_since_ns != 0)
+		st->throttle_us += now - b->throttled_since_ns;
+	st->throttle_us /= 1000;
+}
+
+/*
+ * Fills st[0] with the LU bucket and the rest with the initiator buckets,
+ * returns the number of entries filled.
+ */
+int
+istgt_lu_qos_stats(ISTGT_LU_DISK *spec, ISTGT_LU_QOS_STATS *st, int max)
+{
+	ISTGT_LU_QOS *qos = spec->qos;
+	QOS_BUCKET *b;
+	uint64_t now;
+	int n = 0;
+
+	if (qos == NULL || max < 1)
+		return 0;
+
+	MTX_LOCK(&qos->mutex);
+	now = qos_now_ns();
+	qos_bucket_stats(&qos->lu, &st[n++], now);
+	TAILQ_FOREACH(b, &qos->buckets, next) {
+		if (n >= max)
+			break;
+		qos_bucket_stats(b, &st[n++], now);
+	}
+	MTX_UNLOCK(&qos->mutex);
+	return n;
+}
+
+void
+istgt_lu_qos_get_limits(ISTGT_LU_DISK *spec, ISTGT_LU_QOS_LIMIT *lu_limit,
+    ISTGT_LU_QOS_LIMIT *initiator_limit)
+{
+	ISTGT_LU_QOS *qos = spec->qos;
+
+	memset(lu_limit, 0, sizeof (*lu_limit));
+	memset(initiator_limit, 0, sizeof (*initiator_limit));
+	if (qos == NULL)
+		return;
+	MTX_LOCK(&qos->mutex);
+	*lu_limit = qos->lu.limit;
+	*initiator_limit = qos->initiator;
+	MTX_UNLOCK(&qos->mutex);
+}
@@ -0,0 +1,742 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_alog.h"
+#include "istgt_conf.h"
+#include "istgt_misc.h"
+#include "istgt_sock.h"
+#include "istgt_iscsi.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+#ifdef	REPLICATION
+#include "istgt_integration.h"
+#include "replication.h"
+#include "ring_mempool.h"
+#endif
+
+/*
+ * Prometheus text exposition of the target counters.
+ *
+ * A scrape copies the counters of all volumes, replicas and connections
+ * into flat snapshot arrays, holding a lock only for the replica and
+ * connection lists, and then renders them family by family as the text
+ * format wants.  The rendered text is reused for MetricsInterval msec
+ * so that the cost stays bounded however many scrapers there are; the
+ * cost of the last render is exported as well.
+ */
+
+#define	DEFAULT_METRICS_INTERVAL_MS	1000
+#define	METRICS_HTTP_TIMEOUT		5
+#define	METRICS_HTTP_REQLEN		4096
+#define	METRICS_MAX_VOL_REPLICAS	64
+#define	METRICS_LABEL_LEN		(2 * (MAX_TARGET_NAME + MAX_INITIATOR_NAME) + 64)
+
+typedef struct metrics_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+} metrics_buf_t;
+
+typedef struct metrics_field {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t off;
+	uint64_t scale;		/* divisor, e.g. ns to seconds */
+} metrics_field_t;
+
+typedef struct metrics_vol {
+	char labels[METRICS_LABEL_LEN];
+	uint64_t online;
+	uint64_t size;
+	uint64_t blocklen;
+	uint64_t inflight;
+	uint64_t rc_hits;
+	uint64_t rc_misses;
+	uint64_t rc_used;
+	uint64_t rc_memory;
+	uint64_t qos_throttled;
+	uint64_t qos_throttle_us;
+#ifdef	REPLICATION
+	uint64_t ready;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t readbytes;
+	uint64_t writebytes;
+	uint64_t readtime;
+	uint64_t writetime;
+	uint64_t wc_batches;
+	uint64_t wc_merged;
+	uint64_t io_seq;
+	uint64_t healthy;
+	uint64_t degraded;
+	uint64_t deadlist;
+#endif
+} metrics_vol_t;
+
+#ifdef	REPLICATION
+typedef struct metrics_rep {
+	char labels[METRICS_LABEL_LEN];
+	uint64_t healthy;
+	uint64_t quorum;
+	uint64_t dconns;
+	uint64_t inflight_read;
+	uint64_t inflight_write;
+	uint64_t inflight_sync;
+	uint64_t cmdq_size;
+	uint64_t cmdq_free;
+	uint64_t read_reqtime;
+	uint64_t read_resptime;
+	uint64_t write_reqtime;
+	uint64_t write_resptime;
+	uint64_t uptime;
+} metrics_rep_t;
+#endif
+
+typedef struct metrics_conn {
+	char labels[METRICS_LABEL_LEN];
+	uint64_t rx_pdus;
+	uint64_t rx_bytes;
+	uint64_t tx_pdus;
+	uint64_t tx_bytes;
+	uint64_t pending_pdus;
+	uint64_t inflight;
+	uint64_t pool_slots;
+	uint64_t pool_inuse;
+	uint64_t pool_hiwat;
+	uint64_t pool_misses;
+} metrics_conn_t;
+
+#define	MF(n, t, h, s, f, sc)	{ n, t, h, offsetof(s, f), sc }
+
+static const metrics_field_t vol_fields[] = {
+	MF("istgt_volume_online", "gauge", "1 if the LU is online",
+	    metrics_vol_t, online, 1),
+	MF("istgt_volume_size_bytes", "gauge", "Size of the volume",
+	    metrics_vol_t, size, 1),
+	MF("istgt_volume_block_size_bytes", "gauge", "Logical block size",
+	    metrics_vol_t, blocklen, 1),
+	MF("istgt_volume_inflight_ios", "gauge", "IOs being executed",
+	    metrics_vol_t, inflight, 1),
+	MF("istgt_volume_read_cache_hits_total", "counter",
+	    "Reads served from the read cache", metrics_vol_t, rc_hits, 1),
+	MF("istgt_volume_read_cache_misses_total", "counter",
+	    "Reads missing the read cache", metrics_vol_t, rc_misses, 1),
+	MF("istgt_volume_read_cache_used_bytes", "gauge",
+	    "Data held by the read cache", metrics_vol_t, rc_used, 1),
+	MF("istgt_volume_read_cache_memory_bytes", "gauge",
+	    "Memory used by the read cache", metrics_vol_t, rc_memory, 1),
+	MF("istgt_volume_qos_throttled_total", "counter",
+	    "Commands delayed by QoS", metrics_vol_t, qos_throttled, 1),
+	MF("istgt_volume_qos_throttle_seconds_total", "counter",
+	    "Time commands were delayed by QoS", metrics_vol_t,
+	    qos_throttle_us, 1000000),
+#ifdef	REPLICATION
+	MF("istgt_volume_ready", "gauge", "1 if the volume takes IOs",
+	    metrics_vol_t, ready, 1),
+	MF("istgt_volume_reads_total", "counter", "Read commands",
+	    metrics_vol_t, reads, 1),
+	MF("istgt_volume_writes_total", "counter", "Write commands",
+	    metrics_vol_t, writes, 1),
+	MF("istgt_volume_read_bytes_total", "counter", "Bytes read",
+	    metrics_vol_t, readbytes, 1),
+	MF("istgt_volume_write_bytes_total", "counter", "Bytes written",
+	    metrics_vol_t, writebytes, 1),
+	MF("istgt_volume_read_seconds_total", "counter",
+	    "Time spent in read commands", metrics_vol_t, readtime,
+	    1000000000),
+	MF("istgt_volume_write_seconds_total", "counter",
+	    "Time spent in write commands", metrics_vol_t, writetime,
+	    1000000000),
+	MF("istgt_volume_coalesced_batches_total", "counter",
+	    "Replicated IOs made of coalesced writes", metrics_vol_t,
+	    wc_batches, 1),
+	MF("istgt_volume_coalesced_writes_total", "counter",
+	    "Writes merged into a coalesced IO", metrics_vol_t, wc_merged, 1),
+	MF("istgt_volume_io_seq", "counter", "IO sequence number",
+	    metrics_vol_t, io_seq, 1),
+	MF("istgt_volume_healthy_replicas", "gauge", "Healthy replicas",
+	    metrics_vol_t, healthy, 1),
+	MF("istgt_volume_degraded_replicas", "gauge", "Degraded replicas",
+	    metrics_vol_t, degraded, 1),
+	MF("istgt_volume_deadlist_entries", "gauge",
+	    "Completed commands waiting to be freed", metrics_vol_t,
+	    deadlist, 1),
+#endif
+};
+
+#ifdef	REPLICATION
+static const metrics_field_t rep_fields[] = {
+	MF("istgt_replica_healthy", "gauge", "1 if the replica is healthy",
+	    metrics_rep_t, healthy, 1),
+	MF("istgt_replica_quorum", "gauge", "1 if the replica is in quorum",
+	    metrics_rep_t, quorum, 1),
+	MF("istgt_replica_data_connections", "gauge",
+	    "Data connections to the replica", metrics_rep_t, dconns, 1),
+	MF("istgt_replica_inflight_reads", "gauge", "Reads sent, not done",
+	    metrics_rep_t, inflight_read, 1),
+	MF("istgt_replica_inflight_writes", "gauge", "Writes sent, not done",
+	    metrics_rep_t, inflight_write, 1),
+	MF("istgt_replica_inflight_syncs", "gauge", "Syncs sent, not done",
+	    metrics_rep_t, inflight_sync, 1),
+	MF("istgt_replica_cmdq_size", "gauge", "Size of the command mempool",
+	    metrics_rep_t, cmdq_size, 1),
+	MF("istgt_replica_cmdq_free", "gauge",
+	    "Free entries of the command mempool", metrics_rep_t, cmdq_free, 1),
+	MF("istgt_replica_read_queue_seconds_total", "counter",
+	    "Time reads waited to be sent", metrics_rep_t, read_reqtime,
+	    1000000000),
+	MF("istgt_replica_read_seconds_total", "counter",
+	    "Time until read responses were received", metrics_rep_t,
+	    read_resptime, 1000000000),
+	MF("istgt_replica_write_queue_seconds_total", "counter",
+	    "Time writes waited to be sent", metrics_rep_t, write_reqtime,
+	    1000000000),
+	MF("istgt_replica_write_seconds_total", "counter",
+	    "Time until write responses were received", metrics_rep_t,
+	    write_resptime, 1000000000),
+	MF("istgt_replica_uptime_seconds", "gauge",
+	    "Time since the replica connected", metrics_rep_t, uptime, 1),
+};
+#endif
+
+static const metrics_field_t conn_fields[] = {
+	MF("istgt_connection_rx_pdus_total", "counter", "PDUs received",
+	    metrics_conn_t, rx_pdus, 1),
+	MF("istgt_connection_rx_bytes_total", "counter", "Bytes received",
+	    metrics_conn_t, rx_bytes, 1),
+	MF("istgt_connection_tx_pdus_total", "counter", "PDUs sent",
+	    metrics_conn_t, tx_pdus, 1),
+	MF("istgt_connection_tx_bytes_total", "counter", "Bytes sent",
+	    metrics_conn_t, tx_bytes, 1),
+	MF("istgt_connection_pending_pdus", "gauge", "PDUs waiting to be sent",
+	    metrics_conn_t, pending_pdus, 1),
+	MF("istgt_connection_inflight_tasks", "gauge", "Tasks being executed",
+	    metrics_conn_t, inflight, 1),
+	MF("istgt_connection_task_pool_slots", "gauge",
+	    "Preallocated task slots", metrics_conn_t, pool_slots, 1),
+	MF("istgt_connection_task_pool_in_use", "gauge",
+	    "Tasks taken from the pool", metrics_conn_t, pool_inuse, 1),
+	MF("istgt_connection_task_pool_high_water", "gauge",
+	    "Most tasks taken from the pool at once", metrics_conn_t,
+	    pool_hiwat, 1),
+	MF("istgt_connection_task_pool_misses_total", "counter",
+	    "Tasks allocated because the pool was empty", metrics_conn_t,
+	    pool_misses, 1),
+};
+
+static int metrics_interval_ms = DEFAULT_METRICS_INTERVAL_MS;
+static char *metrics_sockpath = NULL;
+static int metrics_sock = -1;
+static int metrics_stop = 0;
+static pthread_t metrics_thread;
+static struct timespec metrics_start_time;
+
+/* cached rendering, protected by metrics_mutex */
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_buf_t metrics_text;
+static struct timespec metrics_rendered;
+static uint64_t metrics_renders = 0;
+static uint64_t metrics_scrapes = 0;
+static uint64_t metrics_render_ns = 0;
+
+static void
+mb_printf(metrics_buf_t *mb, const char *fmt, ...)
+{
+	va_list ap;
+	char *nbuf;
+	size_t nsize;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(mb->buf + mb->len, mb->size - mb->len, fmt, ap);
+		va_end(ap);
+		if (n >= 0 && (size_t)n < mb->size - mb->len) {
+			mb->len += n;
+			return;
+		}
+		nsize = mb->size * 2 + (n > 0 ? n : 0);
+		nbuf = xmalloc(nsize);
+		memcpy(nbuf, mb->buf, mb->len);
+		xfree(mb->buf);
+		mb->buf = nbuf;
+		mb->size = nsize;
+	}
+}
+
+/* label values escape backslash, double quote and newline */
+static void
+metrics_label(char *dst, size_t len, const char *src)
+{
+	size_t n = 0;
+
+	for (; *src != '\0' && n + 3 < len; src++) {
+		if (*src == '\\' || *src == '"') {
+			dst[n++] = '\\';
+			dst[n++] = *src;
+		} else if (*src == '\n') {
+			dst[n++] = '\\';
+			dst[n++] = 'n';
+		} else {
+			dst[n++] = *src;
+		}
+	}
+	dst[n] = '\0';
+}
+
+static void
+metrics_render_family(metrics_buf_t *mb, const metrics_field_t *f,
+    const char *base, size_t stride, int count)
+{
+	const char *labels;
+	uint64_t v;
+	int i;
+
+	if (count == 0)
+		return;
+	mb_printf(mb, "# HELP %s %s.\n# TYPE %s %s\n", f->name, f->help,
+	    f->name, f->type);
+	for (i = 0; i < count; i++) {
+		labels = base + stride * i;
+		v = *(const uint64_t *)(labels + f->off);
+		if (f->scale == 1)
+			mb_printf(mb, "%s{%s} %"PRIu64"\n", f->name, labels, v);
+		else
+			mb_printf(mb, "%s{%s} %.9f\n", f->name, labels,
+			    (double)v / f->scale);
+	}
+}
+
+#ifdef	REPLICATION
+static void
+metrics_snap_replica(replica_t *r, const char *target,
+    const struct timespec *now, metrics_rep_t *rep)
+{
+	rep->healthy = (r->state == ZVOL_STATUS_HEALTHY);
+	rep->quorum = r->quorum;
+	rep->dconns = r->ndconns;
+	rep->inflight_read = r->replica_inflight_read_io_cnt;
+	rep->inflight_write = r->replica_inflight_write_io_cnt;
+	rep->inflight_sync = r->replica_inflight_sync_io_cnt;
+	rep->cmdq_size = r->cmdq.length;
+	rep->cmdq_free = get_num_entries_from_mempool(&r->cmdq);
+	rep->read_reqtime = r->totalread_reqtime;
+	rep->read_resptime = r->totalread_resptime;
+	rep->write_reqtime = r->totalwrite_reqtime;
+	rep->write_resptime = r->totalwrite_resptime;
+	rep->uptime = now->tv_sec - r->create_time.tv_sec;
+	snprintf(rep->labels, sizeof (rep->labels),
+	    "target=\"%s\",replica=\"%"PRIu64"\",address=\"%s:%d\"",
+	    target, r->zvol_guid, r->ip, r->port);
+}
+
+/* the replica lists are the only thing locked while copying */
+static int
+metrics_snap_replicas(ISTGT_LU_DISK *spec, const char *target,
+    metrics_rep_t *rep, int max)
+{
+	replica_t *r;
+	struct timespec now;
+	int n = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	MTX_LOCK(&spec->rq_mtx);
+	TAILQ_FOREACH(r, &spec->rq, r_next) {
+		if (n == max)
+			break;
+		metrics_snap_replica(r, target, &now, &rep[n++]);
+	}
+	TAILQ_FOREACH(r, &spec->non_quorum_rq, r_non_quorum_next) {
+		if (n == max)
+			break;
+		metrics_snap_replica(r, target, &now, &rep[n++]);
+	}
+	MTX_UNLOCK(&spec->rq_mtx);
+	return (n);
+}
+#endif
+
+static void
+metrics_render(ISTGT_Ptr istgt, metrics_buf_t *mb)
+{
+	ISTGT_LU_Ptr lu;
+	ISTGT_LU_DISK *spec;
+	ISTGT_LU_RCACHE_STATS rcstats;
+	ISTGT_LU_QOS_STATS qosstats;
+	CONN_Ptr conn;
+	metrics_vol_t *vol;
+	metrics_conn_t *cn;
+	struct timespec now;
+	char target[MAX_TARGET_NAME * 2], initiator[MAX_INITIATOR_NAME * 2];
+	size_t i;
+	int nvol = 0, ncn = 0, maxcn, j;
+#ifdef	REPLICATION
+	metrics_rep_t *rep;
+	int nrep = 0, maxrep;
+#endif
+
+	vol = xmalloc(sizeof (*vol) * (istgt->nlogical_unit + 1));
+#ifdef	REPLICATION
+	maxrep = (istgt->nlogical_unit + 1) * METRICS_MAX_VOL_REPLICAS;
+	rep = xmalloc(sizeof (*rep) * maxrep);
+#endif
+
+	/* volumes, the counters are read without the LU locks */
+	for (j = 1; j <= istgt->nlogical_unit; j++) {
+		lu = istgt->logical_unit[j];
+		if (lu == NULL || lu->lun[0].spec == NULL ||
+		    lu->lun[0].type != ISTGT_LU_LUN_TYPE_STORAGE)
+			continue;
+		spec = (ISTGT_LU_DISK *)lu->lun[0].spec;
+		memset(&vol[nvol], 0, sizeof (vol[nvol]));
+		metrics_label(target, sizeof (target), lu->name);
+		snprintf(vol[nvol].labels, sizeof (vol[nvol].labels),
+		    "target=\"%s\"", target);
+		vol[nvol].online = lu->online;
+		vol[nvol].size = spec->size;
+		vol[nvol].blocklen = spec->blocklen;
+		vol[nvol].inflight = spec->inflight;
+		istgt_lu_disk_rcache_stats(spec, &rcstats);
+		vol[nvol].rc_hits = rcstats.hits;
+		vol[nvol].rc_misses = rcstats.misses;
+		vol[nvol].rc_used = rcstats.used;
+		vol[nvol].rc_memory = rcstats.memory;
+		if (istgt_lu_qos_stats(spec, &qosstats, 1) == 1) {
+			vol[nvol].qos_throttled = qosstats.throttled;
+			vol[nvol].qos_throttle_us = qosstats.throttle_us;
+		}
+#ifdef	REPLICATION
+		vol[nvol].ready = spec->ready;
+		vol[nvol].reads = spec->reads;
+		vol[nvol].writes = spec->writes;
+		vol[nvol].readbytes = spec->readbytes;
+		vol[nvol].writebytes = spec->writebytes;
+		vol[nvol].readtime = spec->totalreadtime;
+		vol[nvol].writetime = spec->totalwritetime;
+		vol[nvol].wc_batches = spec->wc_batches;
+		vol[nvol].wc_merged = spec->wc_merged;
+		vol[nvol].io_seq = spec->io_seq;
+		vol[nvol].healthy = spec->healthy_rcount;
+		vol[nvol].degraded = spec->degraded_rcount;
+		vol[nvol].deadlist =
+		    get_num_entries_from_mempool(&spec->rcommon_deadlist);
+		nrep += metrics_snap_replicas(spec, target, &rep[nrep],
+		    METRICS_MAX_VOL_REPLICAS);
+#endif
+		nvol++;
+	}
+
+	/* connections, g_conns entries stay valid under the gconns lock */
+	istgt_lock_gconns();
+	maxcn = istgt_get_gnconns();
+	cn = xmalloc(sizeof (*cn) * (maxcn + 1));
+	for (j = 0; j < maxcn; j++) {
+		conn = istgt_get_gconn(j);
+		if (conn == NULL)
+			continue;
+		metrics_label(target, sizeof (target), conn->target_name);
+		metrics_label(initiator, sizeof (initiator),
+		    conn->initiator_name);
+		snprintf(cn[ncn].labels, sizeof (cn[ncn].labels),
+		    "conn=\"%d\",target=\"%s\",initiator=\"%s\"", conn->id,
+		    target, initiator);
+		cn[ncn].rx_pdus = conn->rx_pdus;
+		cn[ncn].rx_bytes = conn->rx_bytes;
+		cn[ncn].tx_pdus = conn->tx_pdus;
+		cn[ncn].tx_bytes = conn->tx_bytes;
+		cn[ncn].pending_pdus = conn->pending_pdus.num;
+		cn[ncn].inflight = conn->inflight;
+		if (conn->task_pool != NULL) {
+			cn[ncn].pool_slots = conn->task_pool->nslots;
+			cn[ncn].pool_inuse = conn->task_pool->inuse;
+			cn[ncn].pool_hiwat = conn->task_pool->hiwat;
+			cn[ncn].pool_misses = conn->task_pool->misses;
+		} else {
+			cn[ncn].pool_slots = cn[ncn].pool_inuse = 0;
+			cn[ncn].pool_hiwat = cn[ncn].pool_misses = 0;
+		}
+		ncn++;
+	}
+	istgt_unlock_gconns();
+
+	for (i = 0; i < sizeof (vol_fields) / sizeof (vol_fields[0]); i++)
+		metrics_render_family(mb, &vol_fields[i], (const char *)vol,
+		    sizeof (*vol), nvol);
+#ifdef	REPLICATION
+	for (i = 0; i < sizeof (rep_fields) / sizeof (rep_fields[0]); i++)
+		metrics_render_family(mb, &rep_fields[i], (const char *)rep,
+		    sizeof (*rep), nrep);
+#endif
+	for (i = 0; i < sizeof (conn_fields) / sizeof (conn_fields[0]); i++)
+		metrics_render_family(mb, &conn_fields[i], (const char *)cn,
+		    sizeof (*cn), ncn);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	mb_printf(mb, "# HELP istgt_uptime_seconds Time since start.\n"
+	    "# TYPE istgt_uptime_seconds gauge\n"
+	    "istgt_uptime_seconds %ld\n",
+	    (long)(now.tv_sec - metrics_start_time.tv_sec));
+	mb_printf(mb, "# HELP istgt_connections Connections.\n"
+	    "# TYPE istgt_connections gauge\n"
+	    "istgt_connections %d\n", ncn);
+	mb_printf(mb, "# HELP istgt_log_dropped_total Log records dropped.\n"
+	    "# TYPE istgt_log_dropped_total counter\n"
+	    "istgt_log_dropped_total %"PRIu64"\n", g_log_dropped);
+	mb_printf(mb, "# HELP istgt_log_ratelimited_total Log records"
+	    " rate limited.\n"
+	    "# TYPE istgt_log_ratelimited_total counter\n"
+	    "istgt_log_ratelimited_total %"PRIu64"\n", g_log_ratelimited);
+
+	xfree(cn);
+#ifdef	REPLICATION
+	xfree(rep);
+#endif
+	xfree(vol);
+}
+
+static uint64_t
+metrics_elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+	return ((uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ULL +
+	    to->tv_nsec - from->tv_nsec);
+}
+
+/*
+ * Returns a copy of the exposition text, to be freed with xfree().
+ * The text is rendered again only if the cached one is older than
+ * MetricsInterval.
+ */
+char *
+istgt_metrics_snapshot(ISTGT_Ptr istgt, size_t *lenp)
+{
+	metrics_buf_t mb;
+	struct timespec start, end;
+	char *text;
+
+	MTX_LOCK(&metrics_mutex);
+	metrics_scrapes++;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (metrics_text.buf == NULL || metrics_elapsed_ns(&metrics_rendered,
+	    &start) >= (uint64_t)metrics_interval_ms * 1000000ULL) {
+		mb.size = metrics_text.size != 0 ? metrics_text.size : 16384;
+		mb.buf = xmalloc(mb.size);
+		mb.len = 0;
+		metrics_render(istgt, &mb);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		metrics_render_ns = metrics_elapsed_ns(&start, &end);
+		metrics_renders++;
+		/* the cost of this render shows up in the next one */
+		mb_printf(&mb, "# HELP istgt_metrics_render_seconds Time the"
+		    " last render took.\n"
+		    "# TYPE istgt_metrics_render_seconds gauge\n"
+		    "istgt_metrics_render_seconds %.9f\n"
+		    "# HELP istgt_metrics_renders_total Renders done.\n"
+		    "# TYPE istgt_metrics_renders_total counter\n"
+		    "istgt_metrics_renders_total %"PRIu64"\n"
+		    "# HELP istgt_metrics_scrapes_total Scrapes served.\n"
+		    "# TYPE istgt_metrics_scrapes_total counter\n"
+		    "istgt_metrics_scrapes_total %"PRIu64"\n",
+		    (double)metrics_render_ns / 1000000000, metrics_renders,
+		    metrics_scrapes);
+		xfree(metrics_text.buf);
+		metrics_text = mb;
+		metrics_rendered = end;
+	}
+	text = xmalloc(metrics_text.len + 1);
+	memcpy(text, metrics_text.buf, metrics_text.len);
+	text[metrics_text.len] = '\0';
+	*lenp = metrics_text.len;
+	MTX_UNLOCK(&metrics_mutex);
+	return (text);
+}
+
+static int
+metrics_write_all(int sock, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = istgt_write_socket(sock, buf, len, METRICS_HTTP_TIMEOUT);
+		if (n <= 0)
+			return (-1);
+		buf += n;
+		len -= n;
+	}
+	return (0);
+}
+
+static void
+metrics_http_serve(ISTGT_Ptr istgt, int sock)
+{
+	char req[METRICS_HTTP_REQLEN], hdr[256];
+	char *text;
+	size_t len = 0, tlen;
+	ssize_t n;
+	int hlen;
+
+	istgt_set_recvtimeout(sock, METRICS_HTTP_TIMEOUT * 1000);
+	while (len < sizeof (req) - 1) {
+		n = istgt_read_socket(sock, req + len, sizeof (req) - 1 - len,
+		    METRICS_HTTP_TIMEOUT);
+		if (n <= 0)
+			return;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL ||
+		    strstr(req, "\n\n") != NULL)
+			break;
+	}
+	req[len] = '\0';
+
+	if (strncmp(req, "GET /metrics ", 13) != 0 &&
+	    strncmp(req, "GET / ", 6) != 0) {
+		hlen = snprintf(hdr, sizeof (hdr), "HTTP/1.0 404 Not Found\r\n"
+		    "Content-Length: 0\r\nConnection: close\r\n\r\n");
+		(void) metrics_write_all(sock, hdr, hlen);
+		return;
+	}
+
+	text = istgt_metrics_snapshot(istgt, &tlen);
+	hlen = snprintf(hdr, sizeof (hdr), "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %zu\r\nConnection: close\r\n\r\n", tlen);
+	if (metrics_write_all(sock, hdr, hlen) == 0)
+		(void) metrics_write_all(sock, text, tlen);
+	xfree(text);
+}
+
+/* one request at a time, scrapers queue up on the listen backlog */
+static void *
+metrics_http_worker(void *arg)
+{
+	ISTGT_Ptr istgt = (ISTGT_Ptr) arg;
+	struct pollfd pfd;
+	int sock, rc;
+
+	snprintf(tinfo, sizeof (tinfo), "metrics");
+	while (!__atomic_load_n(&metrics_stop, __ATOMIC_ACQUIRE)) {
+		pfd.fd = metrics_sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		rc = poll(&pfd, 1, 1000);
+		if (rc <= 0)
+			continue;
+		sock = accept(metrics_sock, NULL, NULL);
+		if (sock < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				ISTGT_ERRLOG("metrics accept() failed errno:%d\n",
+				    errno);
+			continue;
+		}
+		metrics_http_serve(istgt, sock);
+		close(sock);
+	}
+	return (NULL);
+}
+
+int
+istgt_metrics_init(ISTGT_Ptr istgt __attribute__((__unused__)),
+    CF_SECTION *sp)
+{
+	const char *val;
+
+	clock_gettime(CLOCK_MONOTONIC, &metrics_start_time);
+
+	val = getenv("MetricsInterval");
+	if (val == NULL)
+		val = istgt_get_val(sp, "MetricsInterval");
+	metrics_interval_ms = DEFAULT_METRICS_INTERVAL_MS;
+	if (val != NULL)
+		metrics_interval_ms = (int) strtol(val, NULL, 10);
+	if (metrics_interval_ms < 0) {
+		ISTGT_ERRLOG("invalid MetricsInterval %s, using %d\n", val,
+		    DEFAULT_METRICS_INTERVAL_MS);
+		metrics_interval_ms = DEFAULT_METRICS_INTERVAL_MS;
+	}
+
+	val = getenv("MetricsSocket");
+	if (val == NULL)
+		val = istgt_get_val(sp, "MetricsSocket");
+	if (val != NULL && val[0] != '\0')
+		metrics_sockpath = xstrdup(val);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "MetricsInterval %d MetricsSocket %s\n",
+	    metrics_interval_ms, metrics_sockpath ? metrics_sockpath : "None");
+	return (0);
+}
+
+int
+istgt_metrics_start(ISTGT_Ptr istgt)
+{
+	int rc;
+
+	if (metrics_sockpath == NULL)
+		return (0);
+	metrics_sock = istgt_listen_unx(metrics_sockpath, 16);
+	if (metrics_sock < 0) {
+		ISTGT_ERRLOG("metrics listen on %s failed\n", metrics_sockpath);
+		metrics_sock = -1;
+		return (-1);
+	}
+	metrics_stop = 0;
+	rc = pthread_create(&metrics_thread, &istgt->attr,
+	    &metrics_http_worker, (void *)istgt);
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_create(metrics) failed\n");
+		close(metrics_sock);
+		metrics_sock = -1;
+		return (-1);
+	}
+	ISTGT_NOTICELOG("metrics served on %s\n", metrics_sockpath);
+	return (0);
+}
+
+void
+istgt_metrics_shutdown(void)
+{
+	if (metrics_sock >= 0) {
+		__atomic_store_n(&metrics_stop, 1, __ATOMIC_RELEASE);
+		(void) pthread_join(metrics_thread, NULL);
+		close(metrics_sock);
+		unlink(metrics_sockpath);
+		metrics_sock = -1;
+	}
+	MTX_LOCK(&metrics_mutex);
+	xfree(metrics_text.buf);
+	memset(&metrics_text, 0, sizeof (metrics_text));
+	MTX_UNLOCK(&metrics_mutex);
+}
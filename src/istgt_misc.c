@@ -1026,6 +1026,204 @@ istgt_hex2bin(uint8_t *data, size_t data_len, const char *str)
 	return (total);
 }
 
+/*
+ * Grow a segment array to hold need entries.  *iovp is either the
+ * caller's inline array inl or a heap array from an earlier call.
+ */
+int
+istgt_iov_reserve(struct iovec **iovp, int *capp, struct iovec *inl, int need)
+{
+	struct iovec *iov;
+	int cap;
+
+	if (need <= *capp)
+		return (0);
+	cap = (*capp > 0) ? *capp : ISTGT_SGL_INLINE;
+	while (cap < need)
+		cap *= 2;
+	iov = xmalloc(sizeof (*iov) * cap);
+	if (iov == NULL)
+		return (-1);
+	if (*capp > 0)
+		memcpy(iov, *iovp, sizeof (*iov) * (*capp));
+	if (*iovp != inl)
+		xfree(*iovp);
+	*iovp = iov;
+	*capp = cap;
+	return (0);
+}
+
+static uint32_t
+istgt_nidx_hash(const char *name)
+{
+	const uint8_t *p;
+	uint32_t h = 2166136261U;
+
+	/* FNV-1a of the lower-cased name */
+	for (p = (const uint8_t *) name; *p != '\0'; p++) {
+		h ^= (uint32_t) tolower(*p);
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+int
+istgt_nidx_init(ISTGT_NIDX *idx, int size)
+{
+	uint32_t n;
+
+	for (n = 16; n < (uint32_t) size; n <<= 1)
+		;
+	idx->bucket = xmalloc(sizeof (*idx->bucket) * n);
+	if (idx->bucket == NULL)
+		return (-1);
+	memset(idx->bucket, 0, sizeof (*idx->bucket) * n);
+	idx->mask = n - 1;
+	idx->count = 0;
+	return (0);
+}
+
+void
+istgt_nidx_fini(ISTGT_NIDX *idx)
+{
+	ISTGT_NIDX_ENT *ent, *next;
+	uint32_t i;
+
+	if (idx->bucket == NULL)
+		return;
+	for (i = 0; i <= idx->mask; i++) {
+		for (ent = idx->bucket[i]; ent != NULL; ent = next) {
+			next = ent->next;
+			xfree(ent->name);
+			xfree(ent);
+		}
+	}
+	xfree(idx->bucket);
+	idx->bucket = NULL;
+	idx->count = 0;
+}
+
+int
+istgt_nidx_add(ISTGT_NIDX *idx, const char *name, void *val)
+{
+	ISTGT_NIDX_ENT *ent;
+	uint32_t h;
+
+	if (name == NULL)
+		return (0);
+	ent = xmalloc(sizeof (*ent));
+	if (ent == NULL)
+		return (-1);
+	ent->name = xstrdup(name);
+	if (ent->name == NULL) {
+		xfree(ent);
+		return (-1);
+	}
+	h = istgt_nidx_hash(name);
+	ent->hash = h;
+	ent->val = val;
+	ent->next = idx->bucket[h & idx->mask];
+	idx->bucket[h & idx->mask] = ent;
+	idx->count++;
+	return (0);
+}
+
+int
+istgt_nidx_del(ISTGT_NIDX *idx, const char *name, void *val)
+{
+	ISTGT_NIDX_ENT **entp, *ent;
+	uint32_t h;
+
+	if (name == NULL)
+		return (0);
+	h = istgt_nidx_hash(name);
+	for (entp = &idx->bucket[h & idx->mask]; (ent = *entp) != NULL;
+	    entp = &ent->next) {
+		if (ent->val == val && ent->hash == h &&
+		    strcasecmp(ent->name, name) == 0) {
+			*entp = ent->next;
+			xfree(ent->name);
+			xfree(ent);
+			idx->count--;
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+void *
+istgt_nidx_find(ISTGT_NIDX *idx, const char *name)
+{
+	ISTGT_NIDX_ENT *ent;
+	uint32_t h;
+
+	if (name == NULL || idx->bucket == NULL)
+		return (NULL);
+	h = istgt_nidx_hash(name);
+	for (ent = idx->bucket[h & idx->mask]; ent != NULL; ent = ent->next) {
+		if (ent->hash == h && strcasecmp(ent->name, name) == 0)
+			return (ent->val);
+	}
+	return (NULL);
+}
+
+uint32_t
+istgt_sidx_hash(const char *name)
+{
+	const uint8_t *p;
+	uint32_t h = 2166136261U;
+
+	for (p = (const uint8_t *) name; *p != '\0'; p++) {
+		h ^= (uint32_t) *p;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+void
+istgt_sidx_reset(ISTGT_SIDX *x)
+{
+	memset(x->head, 0xff, sizeof (x->head));
+	memset(x->tail, 0xff, sizeof (x->tail));
+}
+
+void
+istgt_sidx_add(ISTGT_SIDX *x, int slot, uint32_t hash)
+{
+	int b = hash & (ISTGT_SIDX_BUCKETS - 1);
+
+	x->hash[slot] = hash;
+	x->next[slot] = -1;
+	if (x->tail[b] < 0)
+		x->head[b] = slot;
+	else
+		x->next[x->tail[b]] = slot;
+	x->tail[b] = slot;
+}
+
+int
+istgt_sidx_first(ISTGT_SIDX *x, uint32_t hash)
+{
+	int s;
+
+	s = x->head[hash & (ISTGT_SIDX_BUCKETS - 1)];
+	while (s >= 0 && x->hash[s] != hash)
+		s = x->next[s];
+	return (s);
+}
+
+int
+istgt_sidx_next(ISTGT_SIDX *x, int slot)
+{
+	uint32_t hash = x->hash[slot];
+	int s;
+
+	s = x->next[slot];
+	while (s >= 0 && x->hash[s] != hash)
+		s = x->next[s];
+	return (s);
+}
+
 void
 istgt_yield(void)
 {
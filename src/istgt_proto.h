@@ -85,6 +85,8 @@
 /* istgt_iscsi.c */
 int istgt_chap_get_authinfo(ISTGT_CHAP_AUTH *auth, const char *authfile, const char *authuser, int ag_tag);
 int istgt_iscsi_transfer_out(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, size_t transfer_len);
+int istgt_iscsi_result_notify(CONN_Ptr conn);
+int istgt_iscsi_task_notify(CONN_Ptr conn);
 int istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu);
 int istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr *sa, socklen_t salen);
 void istgt_lock_gconns(void);
@@ -94,6 +96,7 @@ CONN_Ptr istgt_get_gconn(int idx);
 int istgt_get_active_conns(void);
 int istgt_stop_conns(void);
 CONN_Ptr istgt_find_conn(const char *initiator_port, const char *target_name, uint16_t tsih);
+void istgt_iscsi_expire_sess(void);
 int istgt_iscsi_init(ISTGT_Ptr istgt);
 int istgt_iscsi_shutdown(ISTGT_Ptr istgt);
 
@@ -105,6 +108,7 @@ int istgt_lu_visible(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu, const char *iqn, int pg_t
 int istgt_lu_sendtargets(CONN_Ptr conn, const char *iiqn, const char *iaddr, const char *tiqn, uint8_t *data, int alloc_len, int data_len);
 ISTGT_LU_Ptr istgt_lu_find_target(ISTGT_Ptr istgt, const char *target_name);
 ISTGT_LU_Ptr istgt_lu_find_target_by_volname(ISTGT_Ptr istgt, const char *target_name);
+void istgt_lu_slot_range(ISTGT_Ptr istgt, const char *target_name, int *lo, int *hi);
 #ifdef	REPLICATION
 int istgt_lu_create_snapshot(spec_t *spec, char *snapname, int, int);
 int istgt_lu_resize_volume(spec_t *spec, size_t size);
@@ -139,6 +143,10 @@ int istgt_lu_reset(ISTGT_LU_Ptr lu, uint64_t lun, istgt_ua_type ua_type);
 int istgt_lu_reset_all(ISTGT_Ptr istgt, istgt_ua_type ua_type);
 ISTGT_LU_TASK_Ptr istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int lun, ISTGT_LU_DISK * spec);
 int istgt_lu_destroy_task(ISTGT_LU_TASK_Ptr lu_task);
+ISTGT_LU_TASK_POOL *istgt_lu_task_pool_create(int nslots);
+void istgt_lu_task_pool_release(ISTGT_LU_TASK_POOL *pool);
+ISTGT_LU_TASK_Ptr istgt_lu_task_get(CONN_Ptr conn, int clear);
+void istgt_lu_task_put(ISTGT_LU_TASK_Ptr lu_task);
 int istgt_lu_clear_task_IT(CONN_Ptr conn, ISTGT_LU_Ptr lu);
 int istgt_lu_clear_task_ITL(CONN_Ptr conn, ISTGT_LU_Ptr lu, uint64_t lun);
 int istgt_lu_clear_task_ITLQ(CONN_Ptr conn, ISTGT_LU_Ptr lu, uint64_t lun, uint32_t CmdSN);
@@ -205,6 +213,39 @@ IT_NEXUS * istgt_lu_disk_get_nexus(ISTGT_LU_DISK *spec, const char * initiator_p
 int istgt_lu_disk_vbox_lun_init(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
 int istgt_lu_disk_vbox_lun_shutdown(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
 
+/* istgt_lu_disk_uring.c */
+int istgt_lu_disk_uring_open(ISTGT_LU_DISK *spec, int flags);
+void istgt_lu_disk_uring_close(ISTGT_LU_DISK *spec);
+int64_t istgt_lu_disk_uring_pread(ISTGT_LU_DISK *spec, void *data, uint64_t nbytes, uint64_t offset);
+int64_t istgt_lu_disk_uring_pwritev(ISTGT_LU_DISK *spec, const struct iovec *iov, int iovcnt, uint64_t offset);
+int64_t istgt_lu_disk_uring_fsync(ISTGT_LU_DISK *spec);
+void istgt_lu_disk_uring_prepare(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io);
+void istgt_lu_disk_uring_submit(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_URING_IO *io);
+int istgt_lu_disk_uring_foreach(ISTGT_LU_DISK *spec, int (*fn)(ISTGT_LU_DISK_URING_IO *io, void *arg), void *arg);
+
+/* istgt_lu_disk_rcache.c */
+int istgt_lu_disk_rcache_init(ISTGT_LU_DISK *spec, uint64_t size);
+void istgt_lu_disk_rcache_destroy(ISTGT_LU_DISK *spec);
+uint8_t *istgt_lu_disk_rcache_lookup(ISTGT_LU_DISK *spec, uint64_t lba, uint32_t len, ISTGT_LU_RCACHE_TICKET *ticket);
+void istgt_lu_disk_rcache_fill(ISTGT_LU_DISK *spec, uint64_t lba, uint32_t len, const uint8_t *data, ISTGT_LU_RCACHE_TICKET *ticket);
+void istgt_lu_disk_rcache_invalidate(ISTGT_LU_DISK *spec, uint64_t lba, uint64_t len);
+void istgt_lu_disk_rcache_flush(ISTGT_LU_DISK *spec);
+void istgt_lu_disk_rcache_stats(ISTGT_LU_DISK *spec, ISTGT_LU_RCACHE_STATS *st);
+
+/* istgt_lu_qos.c */
+int istgt_lu_qos_init(ISTGT_LU_DISK *spec, const ISTGT_LU_QOS_LIMIT *lu_limit, const ISTGT_LU_QOS_LIMIT *initiator_limit);
+void istgt_lu_qos_destroy(ISTGT_LU_DISK *spec);
+ISTGT_LU_TASK_Ptr istgt_lu_qos_dequeue(ISTGT_LU_DISK *spec, ISTGT_QUEUE_Ptr queue, uint64_t *wait_us);
+int istgt_lu_qos_set(ISTGT_LU_DISK *spec, const char *scope, const ISTGT_LU_QOS_LIMIT *limit);
+int istgt_lu_qos_stats(ISTGT_LU_DISK *spec, ISTGT_LU_QOS_STATS *st, int max);
+void istgt_lu_qos_get_limits(ISTGT_LU_DISK *spec, ISTGT_LU_QOS_LIMIT *lu_limit, ISTGT_LU_QOS_LIMIT *initiator_limit);
+
+/* istgt_metrics.c */
+int istgt_metrics_init(ISTGT_Ptr istgt, CF_SECTION *sp);
+int istgt_metrics_start(ISTGT_Ptr istgt);
+void istgt_metrics_shutdown(void);
+char *istgt_metrics_snapshot(ISTGT_Ptr istgt, size_t *lenp);
+
 int istgt_lu_disk_transfer_data(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, size_t len);
 int istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow);
 
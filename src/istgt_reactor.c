@@ -0,0 +1,327 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_affinity.h"
+#include "istgt_reactor.h"
+
+#define	REACTOR_TICK_MSEC	1000
+
+static ISTGT_REACTOR *reactors = NULL;
+static int nreactors = 0;
+static int reactor_slots = 0;
+static volatile int reactor_stop = 0;
+static __thread ISTGT_REACTOR *reactor_me = NULL;
+
+static uint64_t
+reactor_now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Ticks run without the mutex so that they may detach events of their
+ * owner; when that took the saved next one the walk restarts, and the
+ * generation keeps an event from being ticked twice.
+ */
+static void
+reactor_tick(ISTGT_REACTOR *r)
+{
+	ISTGT_REACTOR_EV *ev, *nev;
+
+	MTX_LOCK(&r->mutex);
+	r->tick_gen++;
+	for (ev = TAILQ_FIRST(&r->evs); ev != NULL; ev = nev) {
+		nev = TAILQ_NEXT(ev, next);
+		if (ev->tick == NULL || ev->tick_gen == r->tick_gen)
+			continue;
+		ev->tick_gen = r->tick_gen;
+		MTX_UNLOCK(&r->mutex);
+		ev->tick(ev);
+		MTX_LOCK(&r->mutex);
+		if (nev != NULL && nev->gone)
+			nev = TAILQ_FIRST(&r->evs);
+	}
+	MTX_UNLOCK(&r->mutex);
+}
+
+static void
+reactor_reap(ISTGT_REACTOR *r)
+{
+	ISTGT_REACTOR_EV *ev;
+
+	MTX_LOCK(&r->mutex);
+	while ((ev = TAILQ_FIRST(&r->gone)) != NULL) {
+		TAILQ_REMOVE(&r->gone, ev, next);
+		MTX_UNLOCK(&r->mutex);
+		if (ev->done != NULL)
+			ev->done(ev);
+		MTX_LOCK(&r->mutex);
+	}
+	MTX_UNLOCK(&r->mutex);
+}
+
+static void *
+reactor_thread(void *arg)
+{
+	ISTGT_REACTOR *r = arg;
+	struct epoll_event events[ISTGT_REACTOR_BATCH];
+	ISTGT_REACTOR_EV *ev;
+	uint64_t next_tick, now;
+	eventfd_t val;
+	int rc, i;
+
+	reactor_me = r;
+	snprintf(tinfo, sizeof (tinfo), "reactor#%d", r->id);
+	prctl(PR_SET_NAME, tinfo, 0, 0, 0);
+	istgt_affinity_apply(ISTGT_AFF_CONN_WORKER, -1);
+	ISTGT_NOTICELOG("reactor %d started\n", r->id);
+
+	next_tick = reactor_now_msec() + REACTOR_TICK_MSEC;
+	while (!reactor_stop) {
+		rc = epoll_wait(r->epfd, events, ISTGT_REACTOR_BATCH,
+		    REACTOR_TICK_MSEC);
+		if (rc == -1 && errno != EINTR) {
+			ISTGT_ERRLOG("reactor %d epoll_wait() failed errno:%d\n",
+			    r->id, errno);
+			break;
+		}
+		r->wakeups++;
+		for (i = 0; i < rc; i++) {
+			ev = events[i].data.ptr;
+			if (ev == NULL) {
+				/* stop request */
+				(void) eventfd_read(r->wakefd, &val);
+				continue;
+			}
+			/* detached earlier in this batch */
+			if (ev->gone)
+				continue;
+			r->dispatched++;
+			ev->handler(ev, events[i].events);
+		}
+		now = reactor_now_msec();
+		if (now >= next_tick) {
+			reactor_tick(r);
+			next_tick = now + REACTOR_TICK_MSEC;
+		}
+		reactor_reap(r);
+	}
+	ISTGT_NOTICELOG("reactor %d ended\n", r->id);
+	return (NULL);
+}
+
+int
+istgt_reactor_start(int nthreads, pthread_attr_t *attr)
+{
+	ISTGT_REACTOR *r;
+	struct epoll_event event;
+	int i, rc;
+
+	if (nthreads <= 0)
+		return (0);
+	if (nthreads > ISTGT_REACTOR_MAX)
+		nthreads = ISTGT_REACTOR_MAX;
+	reactors = xmalloc(sizeof (*reactors) * nthreads);
+	memset(reactors, 0, sizeof (*reactors) * nthreads);
+	reactor_slots = nthreads;
+	reactor_stop = 0;
+	for (i = 0; i < nthreads; i++) {
+		r = &reactors[i];
+		r->id = i;
+		r->epfd = -1;
+		r->wakefd = -1;
+		TAILQ_INIT(&r->evs);
+		TAILQ_INIT(&r->gone);
+		pthread_mutex_init(&r->mutex, NULL);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		r = &reactors[i];
+		r->epfd = epoll_create1(EPOLL_CLOEXEC);
+		r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (r->epfd < 0 || r->wakefd < 0) {
+			ISTGT_ERRLOG("reactor %d: epoll/eventfd failed errno:%d\n",
+			    i, errno);
+			goto error_return;
+		}
+		memset(&event, 0, sizeof (event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &event) != 0) {
+			ISTGT_ERRLOG("reactor %d: epoll_ctl failed errno:%d\n",
+			    i, errno);
+			goto error_return;
+		}
+		rc = pthread_create(&r->thread, attr, &reactor_thread, r);
+		if (rc != 0) {
+			ISTGT_ERRLOG("reactor %d: pthread_create failed rc:%d\n",
+			    i, rc);
+			goto error_return;
+		}
+		nreactors++;
+	}
+	ISTGT_NOTICELOG("%d connection reactors\n", nreactors);
+	return (0);
+
+error_return:
+	istgt_reactor_stop();
+	return (-1);
+}
+
+void
+istgt_reactor_stop(void)
+{
+	int i;
+
+	if (reactors == NULL)
+		return;
+	reactor_stop = 1;
+	for (i = 0; i < nreactors; i++) {
+		if (eventfd_write(reactors[i].wakefd, 1) != 0)
+			ISTGT_ERRLOG("reactor %d wakeup failed\n", i);
+		pthread_join(reactors[i].thread, NULL);
+	}
+	for (i = 0; i < reactor_slots; i++) {
+		if (reactors[i].epfd >= 0)
+			close(reactors[i].epfd);
+		if (reactors[i].wakefd >= 0)
+			close(reactors[i].wakefd);
+		pthread_mutex_destroy(&reactors[i].mutex);
+	}
+	xfree(reactors);
+	reactors = NULL;
+	nreactors = 0;
+	reactor_slots = 0;
+}
+
+int
+istgt_reactor_count(void)
+{
+	return (nreactors);
+}
+
+ISTGT_REACTOR *
+istgt_reactor_self(void)
+{
+	return (reactor_me);
+}
+
+/* least loaded reactor, by attached events */
+ISTGT_REACTOR *
+istgt_reactor_pick(void)
+{
+	ISTGT_REACTOR *best = NULL;
+	int i;
+
+	for (i = 0; i < nreactors; i++) {
+		if (best == NULL || reactors[i].nevs < best->nevs)
+			best = &reactors[i];
+	}
+	return (best);
+}
+
+int
+istgt_reactor_add(ISTGT_REACTOR *r, ISTGT_REACTOR_EV *ev, int fd,
+    uint32_t events, istgt_reactor_fn handler, istgt_reactor_tick_fn tick,
+    void *arg)
+{
+	struct epoll_event event;
+
+	memset(ev, 0, sizeof (*ev));
+	ev->fd = fd;
+	ev->events = events;
+	ev->handler = handler;
+	ev->tick = tick;
+	ev->arg = arg;
+	ev->reactor = r;
+
+	MTX_LOCK(&r->mutex);
+	TAILQ_INSERT_TAIL(&r->evs, ev, next);
+	r->nevs++;
+	MTX_UNLOCK(&r->mutex);
+
+	memset(&event, 0, sizeof (event));
+	event.events = events;
+	event.data.ptr = ev;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		ISTGT_ERRLOG("reactor %d: add fd %d failed errno:%d\n",
+		    r->id, fd, errno);
+		MTX_LOCK(&r->mutex);
+		TAILQ_REMOVE(&r->evs, ev, next);
+		r->nevs--;
+		MTX_UNLOCK(&r->mutex);
+		ev->reactor = NULL;
+		return (-1);
+	}
+	return (0);
+}
+
+int
+istgt_reactor_mod(ISTGT_REACTOR_EV *ev, uint32_t events)
+{
+	struct epoll_event event;
+
+	if (ev->events == events)
+		return (0);
+	memset(&event, 0, sizeof (event));
+	event.events = events;
+	event.data.ptr = ev;
+	if (epoll_ctl(ev->reactor->epfd, EPOLL_CTL_MOD, ev->fd, &event) != 0) {
+		ISTGT_ERRLOG("reactor %d: mod fd %d failed errno:%d\n",
+		    ev->reactor->id, ev->fd, errno);
+		return (-1);
+	}
+	ev->events = events;
+	return (0);
+}
+
+void
+istgt_reactor_del(ISTGT_REACTOR_EV *ev, istgt_reactor_done_fn done)
+{
+	ISTGT_REACTOR *r = ev->reactor;
+
+	if (ev->gone)
+		return;
+	(void) epoll_ctl(r->epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+	ev->gone = 1;
+	ev->done = done;
+	MTX_LOCK(&r->mutex);
+	TAILQ_REMOVE(&r->evs, ev, next);
+	TAILQ_INSERT_TAIL(&r->gone, ev, next);
+	r->nevs--;
+	MTX_UNLOCK(&r->mutex);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef	ISTGT_REACTOR_H
+#define	ISTGT_REACTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+/*
+ * Fixed pool of event loop threads serving many file descriptors each.
+ *
+ * A descriptor is attached to one reactor for its lifetime and all its
+ * handlers run on that reactor's thread, so state private to the owner
+ * needs no locking.  Every attached event also gets a tick about once a
+ * second, for idle and timeout checks.  Detaching is only allowed from
+ * the reactor thread; the done callback runs after the events already
+ * collected in the same wakeup have been skipped, so that is where the
+ * owner may release the memory.
+ */
+
+#define	ISTGT_REACTOR_MAX	256
+#define	ISTGT_REACTOR_BATCH	64
+
+struct istgt_reactor;
+struct istgt_reactor_ev;
+
+typedef void (*istgt_reactor_fn)(struct istgt_reactor_ev *ev,
+    uint32_t events);
+typedef void (*istgt_reactor_tick_fn)(struct istgt_reactor_ev *ev);
+typedef void (*istgt_reactor_done_fn)(struct istgt_reactor_ev *ev);
+
+typedef struct istgt_reactor_ev {
+	int fd;
+	uint32_t events;
+	istgt_reactor_fn handler;
+	istgt_reactor_tick_fn tick;
+	istgt_reactor_done_fn done;
+	void *arg;
+	struct istgt_reactor *reactor;
+	int gone;
+	uint64_t tick_gen;
+	TAILQ_ENTRY(istgt_reactor_ev) next;
+} ISTGT_REACTOR_EV;
+
+typedef struct istgt_reactor {
+	int id;
+	int epfd;
+	int wakefd;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	TAILQ_HEAD(, istgt_reactor_ev) evs;
+	TAILQ_HEAD(, istgt_reactor_ev) gone;
+	int nevs;
+	uint64_t tick_gen;
+	uint64_t wakeups;
+	uint64_t dispatched;
+} ISTGT_REACTOR;
+
+int istgt_reactor_start(int nthreads, pthread_attr_t *attr);
+void istgt_reactor_stop(void);
+int istgt_reactor_count(void);
+ISTGT_REACTOR *istgt_reactor_pick(void);
+ISTGT_REACTOR *istgt_reactor_self(void);
+int istgt_reactor_add(ISTGT_REACTOR *r, ISTGT_REACTOR_EV *ev, int fd,
+    uint32_t events, istgt_reactor_fn handler, istgt_reactor_tick_fn tick,
+    void *arg);
+int istgt_reactor_mod(ISTGT_REACTOR_EV *ev, uint32_t events);
+void istgt_reactor_del(ISTGT_REACTOR_EV *ev, istgt_reactor_done_fn done);
+
+#endif /* ISTGT_REACTOR_H */
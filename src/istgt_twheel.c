@@ -0,0 +1,179 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "istgt_twheel.h"
+
+#define	TW_MASK		(ISTGT_TWHEEL_SLOTS - 1)
+#define	TW_SPAN		(1ULL << (ISTGT_TWHEEL_LEVELS * ISTGT_TWHEEL_BITS))
+
+uint64_t
+istgt_twheel_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void
+istgt_twheel_init(ISTGT_TWHEEL *w, uint32_t tick_ms, void *owner)
+{
+	int l, s;
+
+	memset(w, 0, sizeof (*w));
+	w->tick_ms = tick_ms ? tick_ms : ISTGT_TWHEEL_TICK_MS;
+	w->now = istgt_twheel_now_ms() / w->tick_ms;
+	w->owner = owner;
+	for (l = 0; l < ISTGT_TWHEEL_LEVELS; l++)
+		for (s = 0; s < ISTGT_TWHEEL_SLOTS; s++)
+			LIST_INIT(&w->slot[l][s]);
+}
+
+static void
+twheel_insert(ISTGT_TWHEEL *w, ISTGT_TIMER *t)
+{
+	uint64_t delta;
+	int lvl, idx;
+
+	if (t->expires < w->now)
+		t->expires = w->now;
+	delta = t->expires - w->now;
+	if (delta >= TW_SPAN) {
+		/* fires early, the callback is expected to re-check */
+		t->expires = w->now + TW_SPAN - 1;
+		delta = TW_SPAN - 1;
+	}
+	for (lvl = 0; lvl < ISTGT_TWHEEL_LEVELS - 1; lvl++)
+		if (delta < (1ULL << ((lvl + 1) * ISTGT_TWHEEL_BITS)))
+			break;
+	idx = (t->expires >> (lvl * ISTGT_TWHEEL_BITS)) & TW_MASK;
+	LIST_INSERT_HEAD(&w->slot[lvl][idx], t, link);
+}
+
+void
+istgt_twheel_arm(ISTGT_TWHEEL *w, ISTGT_TIMER *t, uint64_t expires_ms,
+    istgt_timer_fn fn, void *arg)
+{
+	if (t->armed) {
+		LIST_REMOVE(t, link);
+		w->count--;
+	}
+	t->expires = (expires_ms + w->tick_ms - 1) / w->tick_ms;
+	t->fn = fn;
+	t->arg = arg;
+	t->armed = 1;
+	twheel_insert(w, t);
+	w->count++;
+}
+
+void
+istgt_twheel_cancel(ISTGT_TWHEEL *w, ISTGT_TIMER *t)
+{
+	if (!t->armed)
+		return;
+	LIST_REMOVE(t, link);
+	t->armed = 0;
+	w->count--;
+}
+
+/* move one slot of a higher level down, returns the slot index */
+static int
+twheel_cascade(ISTGT_TWHEEL *w, int lvl)
+{
+	ISTGT_TIMER *t;
+	int idx;
+
+	idx = (w->now >> (lvl * ISTGT_TWHEEL_BITS)) & TW_MASK;
+	while ((t = LIST_FIRST(&w->slot[lvl][idx])) != NULL) {
+		LIST_REMOVE(t, link);
+		twheel_insert(w, t);
+	}
+	return (idx);
+}
+
+/*
+ * Run every timer due at or before now_ms.  Due timers are moved off the
+ * wheel first, so a callback may re-arm its timer or cancel another one
+ * of the same batch.
+ */
+int
+istgt_twheel_advance(ISTGT_TWHEEL *w, uint64_t now_ms)
+{
+	LIST_HEAD(, istgt_timer) due;
+	ISTGT_TIMER *t;
+	uint64_t target = now_ms / w->tick_ms;
+	int fired = 0, lvl, idx;
+
+	while (w->now <= target) {
+		if (w->count == 0) {
+			w->now = target + 1;
+			break;
+		}
+		idx = w->now & TW_MASK;
+		if (idx == 0) {
+			for (lvl = 1; lvl < ISTGT_TWHEEL_LEVELS; lvl++)
+				if (twheel_cascade(w, lvl) != 0)
+					break;
+		}
+		LIST_INIT(&due);
+		while ((t = LIST_FIRST(&w->slot[0][idx])) != NULL) {
+			LIST_REMOVE(t, link);
+			LIST_INSERT_HEAD(&due, t, link);
+		}
+		w->now++;
+		while ((t = LIST_FIRST(&due)) != NULL) {
+			LIST_REMOVE(t, link);
+			t->armed = 0;
+			w->count--;
+			t->fn(w->owner, t);
+			fired++;
+		}
+	}
+	return (fired);
+}
+
+/*
+ * Milliseconds until advance has work to do, -1 with nothing armed.  Only
+ * level 0 is looked at; past its wrap the wait ends at the cascade, which
+ * keeps this O(slots).
+ */
+int
+istgt_twheel_timeout(ISTGT_TWHEEL *w, uint64_t now_ms)
+{
+	uint64_t tick, at;
+	int i;
+
+	if (w->count == 0)
+		return (-1);
+	for (i = 0, tick = w->now; i < ISTGT_TWHEEL_SLOTS; i++, tick++) {
+		if (i != 0 && (tick & TW_MASK) == 0)
+			break;
+		if (!LIST_EMPTY(&w->slot[0][tick & TW_MASK]))
+			break;
+	}
+	at = tick * w->tick_ms;
+	if (at <= now_ms)
+		return (0);
+	return ((int)(at - now_ms));
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef	ISTGT_TWHEEL_H
+#define	ISTGT_TWHEEL_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+/*
+ * Hierarchical timer wheel for per-IO deadlines.
+ *
+ * Level 0 has one slot per tick, each further level covers the whole
+ * level below in one slot and is cascaded down when the lower level
+ * wraps.  Arming and cancelling are O(1), so a deadline can be set on
+ * every command at submit and dropped on completion.  A wheel is not
+ * locked; its owner serializes arm, cancel and advance, and callbacks
+ * run from advance with the owner's lock held.  A callback may re-arm
+ * its own timer.
+ */
+
+#define	ISTGT_TWHEEL_BITS	6
+#define	ISTGT_TWHEEL_SLOTS	(1 << ISTGT_TWHEEL_BITS)
+#define	ISTGT_TWHEEL_LEVELS	4
+#define	ISTGT_TWHEEL_TICK_MS	10
+
+struct istgt_timer;
+
+typedef void (*istgt_timer_fn)(void *owner, struct istgt_timer *t);
+
+typedef struct istgt_timer {
+	LIST_ENTRY(istgt_timer) link;
+	/* in ticks */
+	uint64_t expires;
+	istgt_timer_fn fn;
+	void *arg;
+	int armed;
+} ISTGT_TIMER;
+
+typedef struct istgt_twheel {
+	/* next tick to be run */
+	uint64_t now;
+	uint32_t tick_ms;
+	int count;
+	void *owner;
+	LIST_HEAD(, istgt_timer) slot[ISTGT_TWHEEL_LEVELS][ISTGT_TWHEEL_SLOTS];
+} ISTGT_TWHEEL;
+
+uint64_t istgt_twheel_now_ms(void);
+void istgt_twheel_init(ISTGT_TWHEEL *w, uint32_t tick_ms, void *owner);
+void istgt_twheel_arm(ISTGT_TWHEEL *w, ISTGT_TIMER *t, uint64_t expires_ms,
+    istgt_timer_fn fn, void *arg);
+void istgt_twheel_cancel(ISTGT_TWHEEL *w, ISTGT_TIMER *t);
+int istgt_twheel_advance(ISTGT_TWHEEL *w, uint64_t now_ms);
+int istgt_twheel_timeout(ISTGT_TWHEEL *w, uint64_t now_ms);
+
+#endif /* ISTGT_TWHEEL_H */
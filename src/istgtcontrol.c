@@ -1123,6 +1123,126 @@ exec_maxtime(UCTL_Ptr uctl)
 	return (UCTL_CMD_OK);
 }
 
+static int
+exec_qos(UCTL_Ptr uctl)
+{
+	const char *delim = ARGS_DELIM;
+	char *arg;
+	char *result;
+	char args[MAX_LINEBUF];
+	size_t len = 0;
+	int rc;
+	int i;
+
+	/* [LU|INITIATOR iops kbps [burst_ms]] */
+	args[0] = '\0';
+	for (i = 0; i < uctl->setargcnt && len < sizeof (args); i++)
+		len += snprintf(args + len, sizeof (args) - len, " %s",
+		    uctl->setargv[i]);
+
+	if (uctl->iqn == NULL)
+		uctl_snprintf(uctl, "QOS ALL%s\n", args);
+	else
+		uctl_snprintf(uctl, "QOS \"%s\"%s\n", uctl->iqn, args);
+	rc = uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return (rc);
+	}
+
+	/* receive result */
+	while (1) {
+		rc = uctl_readline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+		arg = trim_string(uctl->recvbuf);
+		result = strsepq(&arg, delim);
+		strupr(result);
+		if (strcmp(result, uctl->cmd) != 0)
+			break;
+		printf("%s\n", arg);
+	}
+	if (strcmp(result, "OK") != 0) {
+		if (is_err_req_auth(uctl, arg))
+			return (UCTL_CMD_REQAUTH);
+		fprintf(stderr, "ERROR %s\n", arg);
+		return (UCTL_CMD_ERR);
+	}
+	return (UCTL_CMD_OK);
+}
+
+static int
+exec_affinity(UCTL_Ptr uctl)
+{
+	const char *delim = ARGS_DELIM;
+	char *arg;
+	char *result;
+	int rc;
+
+	uctl_snprintf(uctl, "AFFINITY\n");
+	rc = uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return (rc);
+	}
+
+	/* receive result */
+	while (1) {
+		rc = uctl_readline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+		arg = trim_string(uctl->recvbuf);
+		result = strsepq(&arg, delim);
+		strupr(result);
+		if (strcmp(result, uctl->cmd) != 0)
+			break;
+		printf("%s\n", arg);
+	}
+	if (strcmp(result, "OK") != 0) {
+		if (is_err_req_auth(uctl, arg))
+			return (UCTL_CMD_REQAUTH);
+		fprintf(stderr, "ERROR %s\n", arg);
+		return (UCTL_CMD_ERR);
+	}
+	return (UCTL_CMD_OK);
+}
+
+static int
+exec_metrics(UCTL_Ptr uctl)
+{
+	const char *delim = ARGS_DELIM;
+	char *arg;
+	char *result;
+	int rc;
+
+	uctl_snprintf(uctl, "METRICS\n");
+	rc = uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return (rc);
+	}
+
+	/* receive result */
+	while (1) {
+		rc = uctl_readline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return (rc);
+		}
+		arg = trim_string(uctl->recvbuf);
+		result = strsepq(&arg, delim);
+		strupr(result);
+		if (strcmp(result, uctl->cmd) != 0)
+			break;
+		printf("%s\n", arg);
+	}
+	if (strcmp(result, "OK") != 0) {
+		if (is_err_req_auth(uctl, arg))
+			return (UCTL_CMD_REQAUTH);
+		fprintf(stderr, "ERROR %s\n", arg);
+		return (UCTL_CMD_ERR);
+	}
+	return (UCTL_CMD_OK);
+}
+
 static int
 exec_set(UCTL_Ptr uctl)
 {
@@ -1329,6 +1449,9 @@ static EXEC_TABLE exec_table[] =
 #endif
 	{"SET", exec_set, 0, 1},
 	{"MAXTIME", exec_maxtime, 0, 0},
+	{"QOS", exec_qos, 0, 0},
+	{"AFFINITY", exec_affinity, 0, 0},
+	{"METRICS", exec_metrics, 0, 0},
 #ifdef	REPLICATION
 	{"SNAPCREATE", exec_snap, 2, 0},
 	{"SNAPDESTROY", exec_snap, 2, 0},
@@ -1819,6 +1942,10 @@ usage(void)
 	printf(" info       show connections of target\n");
 	printf(" iostats    displays iostats of volume\n");
 	printf(" maxtime    list the IOs which took maximum time to process\n");
+	printf(" qos        list QoS buckets and throttle times, or set limits\n");
+	printf("            [LU|INITIATOR <iops> <KB/s> [<burst msec>]], 0 is unlimited\n");
+	printf(" affinity   show cpu/numa placement of thread classes, LUs and threads\n");
+	printf(" metrics    dump all counters in Prometheus text format\n");
 #ifdef	REPLICATION
 	printf(" replica    list replica and its stats\n");
 	printf(" mempool    get mempool details\n");
@@ -2102,6 +2229,7 @@ main(int argc, char *argv[])
 	(strcmp(cmd, "SNAPDESTROY") == 0) ||
 	    (strcmp(cmd, "REPLICA") == 0) ||
 	    (strcmp(cmd, "MAXIOWAIT") == 0) ||
+	    (strcmp(cmd, "QOS") == 0) ||
 	    (strcmp(cmd, "RESIZE") == 0) ||
 	    (strcmp(cmd, "DRF") == 0)) {
 		uctl->setargv = argv;
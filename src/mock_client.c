@@ -73,6 +73,7 @@ build_cmd(cargs_t *cargs, ISTGT_LU_CMD_Ptr cmd, SBC_OPCODE opcode,
 			for (i = 0; i < len; i++)
 				buf[i] = random() % 200;
 			cmd->cdb0 = SBC_WRITE_16;
+			cmd->iobufindx = 0;
 			cmd->iobuf[0].iov_base = buf;
 			cmd->iobuf[0].iov_len = len;
 			cmd->iobufsize = len;
@@ -136,6 +137,7 @@ writer(void *args)
 
 	lu_cmd  = (ISTGT_LU_CMD_Ptr)malloc(sizeof (ISTGT_LU_CMD));
 	memset(lu_cmd, 0, sizeof (ISTGT_LU_CMD));
+	ISTGT_SGL_INIT(lu_cmd);
 
 	check_settings(spec);
 
@@ -215,6 +217,7 @@ reader(void *args)
 
 	lu_cmd  = malloc(sizeof (ISTGT_LU_CMD));
 	memset(lu_cmd, 0, sizeof (ISTGT_LU_CMD));
+	ISTGT_SGL_INIT(lu_cmd);
 
 	check_settings(spec);
 
@@ -473,6 +473,14 @@ send_mgmt_ack(int fd, zvol_io_hdr_t *mgmt_ack_hdr, void *buf, int *zrepl_status_
 			break;
 
 		default:
+			/* answers like a replica without reservation support */
+			if (mgmt_ack_hdr->opcode == ZVOL_OPCODE_PR_UPDATE ||
+			    mgmt_ack_hdr->opcode == ZVOL_OPCODE_PR_READ) {
+				iovec_count = 3;
+				mgmt_ack_hdr->status = ZVOL_OP_STATUS_FAILED;
+				mgmt_ack_hdr->len = 0;
+				break;
+			}
 			REPLICA_ERRLOG("opcode(%d) is not handled.. program is aborting now..",
 			    mgmt_ack_hdr->opcode);
 			abort();
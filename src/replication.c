@@ -45,14 +45,20 @@
 uint64_t io_max_wait_time = 60;
 struct timespec io_queue_time[ISTGT_MAX_NUM_LUWORKERS];
 extern int replica_timeout;
+extern int replica_poll_time;
+/* replicas that push their status are polled this many times less often */
+#define	REPLICA_PUSH_POLL_FACTOR	6
 cstor_conn_ops_t cstor_ops = {
 	.conn_listen = replication_listen,
 	.conn_connect = replication_connect,
+	.conn_connect_nb = replication_connect_nb,
 };
 
 int replication_initialized = 0;
 size_t rcmd_mempool_count = RCMD_MEMPOOL_ENTRIES;
 struct timespec istgt_start_time;
+/* spec_q by volume name, under specq_mtx */
+static ISTGT_NIDX spec_volname_idx;
 
 static int start_rebuild(void *buf, replica_t *replica, uint64_t data_len);
 static void handle_mgmt_conn_error(replica_t *r, int sfd, struct epoll_event *events,
@@ -63,12 +69,20 @@ static void inform_data_conn(replica_t *r);
 static void free_replica(replica_t *r);
 static int handle_mgmt_event_fd(replica_t *replica);
 static int get_non_quorum_replica_count(spec_t *spec);
+static void pr_start_restore(spec_t *spec);
+static void queue_status_subscribe(replica_t *replica, spec_t *spec);
+static int rmgmt_shard_epfd(spec_t *spec);
+static void rmgmt_shard_pr_retry(spec_t *spec, uint64_t delay_ms);
+static int send_replica_pr_command(spec_t *spec, replica_t *replica,
+    zvol_op_code_t opcode, rcommon_mgmt_cmd_t *rcomm_mgmt, uint64_t pr_seq,
+    void *buf, uint64_t len);
 
 #define build_rcomm_cmd(rcomm_cmd, cmd, offset, nbytes) 						\
 	do {								\
 		uint64_t blockcnt = 0;                                  \
 		rcomm_cmd = malloc(sizeof (*rcomm_cmd));		\
 		memset(rcomm_cmd, 0, sizeof (*rcomm_cmd));		\
+		rcomm_cmd->iov = rcomm_cmd->iov_inl;			\
 		rcomm_cmd->offset = offset;				\
 		rcomm_cmd->data_len = nbytes;				\
 		rcomm_cmd->state = CMD_CREATED;				\
@@ -125,6 +139,9 @@ static int get_non_quorum_replica_count(spec_t *spec);
 				break;					\
 		}							\
 		if (cmd_write) {					\
+			if (iovcnt > ISTGT_SGL_INLINE)			\
+				rcomm_cmd->iov = malloc(		\
+				    sizeof (struct iovec) * (iovcnt + 1)); \
 			for (i=1; i < iovcnt + 1; i++) {		\
 				rcomm_cmd->iov[i].iov_base =		\
 				    cmd->iobuf[i-1].iov_base;		\
@@ -339,6 +356,27 @@ check_header_sanity(zvol_io_hdr_t *resp_hdr)
 			exp_len = 0;
 			break;
 		default:
+			if (resp_hdr->opcode == ZVOL_OPCODE_PR_UPDATE ||
+			    resp_hdr->opcode == ZVOL_OPCODE_STATUS_SUBSCRIBE) {
+				exp_len = 0;
+				break;
+			}
+			if (resp_hdr->opcode == ZVOL_OPCODE_STATUS_NOTIFY) {
+				exp_len = sizeof (zrepl_status_ack_t);
+				break;
+			}
+			if (resp_hdr->opcode == ZVOL_OPCODE_STATS_NOTIFY) {
+				exp_len = sizeof (zvol_op_stat_t);
+				break;
+			}
+			if (resp_hdr->opcode == ZVOL_OPCODE_PR_READ) {
+				exp_len = resp_hdr->len;
+				if (exp_len < sizeof (zvol_op_pr_data_t) ||
+				    exp_len > sizeof (zvol_op_pr_data_t) +
+				    ZVOL_PR_DATA_MAX)
+					exp_len = sizeof (zvol_op_pr_data_t);
+				break;
+			}
 			assert(!"Please handle this opcode\n");
 			break;
 	}
@@ -423,6 +461,7 @@ send_prepare_for_rebuild_or_trigger_rebuild(spec_t *spec,
 	spec->rebuild_info.rebuild_in_progress = true;
 	spec->scalingup_replica = NULL;
 	ASSERT(spec->rebuild_info.dw_replica);
+	istgt_lu_disk_rcache_flush(spec);
 
 	replica_cnt = count_of_replicas_helping_rebuild(spec, healthy_replica);
 	assert(replica_cnt || (spec->replication_factor ==  1));
@@ -1176,12 +1215,27 @@ update_volstate(spec_t *spec)
 			max = (max == 0) ? 10 : max + (1<<20);
 			spec->io_seq = max;
 		}
+		if (spec->persist && spec->replica_pr_persist &&
+		    !spec->pr_restored) {
+			pr_start_restore(spec);
+			spec->ready = false;
+			REPLICA_NOTICELOG("volume(%s) waiting for reservations "
+			    "from replicas\n", spec->volname);
+			return;
+		}
 		spec->ready = true;
 		REPLICA_NOTICELOG("volume(%s) is ready for IOs now.. io_seq(%lu) "
 		    "healthy_replica(%d) degraded_replica(%d)\n",
 		    spec->volname, spec->io_seq, spec->healthy_rcount,
 		    spec->degraded_rcount);
 	} else {
+		/*
+		 * The replicas may come back with other data, e.g. rolled
+		 * back to a snapshot while they were away.  Reads are
+		 * refused from here on, also drop what the cache holds.
+		 */
+		if (spec->ready)
+			istgt_lu_disk_rcache_flush(spec);
 		spec->ready = false;
 		REPLICA_NOTICELOG("Marking volume(%s) not ready for IOs\n", spec->volname);
 	}
@@ -1374,6 +1428,7 @@ create_replica_entry(spec_t *spec, int epfd, int mgmt_fd)
 	replica->mgmt_io_resp_hdr = malloc(sizeof(zvol_io_hdr_t));
 	memset(replica->mgmt_io_resp_hdr, 0, sizeof (zvol_io_hdr_t));
 	replica->mgmt_io_resp_data = NULL;
+	replica->mgmt_read_state = READ_IO_RESP_HDR;
 
 	MTX_LOCK(&spec->rq_mtx);
 	TAILQ_INSERT_TAIL(&spec->rwaitq, replica, r_waitnext);
@@ -1381,6 +1436,8 @@ create_replica_entry(spec_t *spec, int epfd, int mgmt_fd)
 
 	replica->mgmt_eventfd2 = -1;
 	replica->iofd = -1;
+	replica->hs_fd = -1;
+	replica->hs_eventfd = -1;
 	replica->spec = spec;
 
 	rc = pthread_mutex_init(&replica->r_mtx, NULL);
@@ -1409,132 +1466,178 @@ error:
 }
 
 /*
- * update_replica_entry updates replica entry with IP/port,
- * perform handshake on data connection
- * starts replica thread to send/receive IOs to/from replica
- * removes replica from spec's rwaitq and adds it to spec's rq
- * Note: Locks in update_replica_entry are avoided since update_replica_entry is being
- *	 executed once only during handshake with replica.
+ * Stages of the handshake of a replica after its ack, see replica_hs_step.
+ * A replica that doesn't get its data connections opened within
+ * REPLICA_HS_TIMEOUT_MS is dropped at the next poll of its volume.
  */
-int
-update_replica_entry(spec_t *spec, replica_t *replica, int iofd)
+#define	REPLICA_HS_NONE		0
+#define	REPLICA_HS_START	1
+#define	REPLICA_HS_CONNECT	2
+#define	REPLICA_HS_OPEN		3
+#define	REPLICA_HS_THREAD	4
+#define	REPLICA_HS_TIMEOUT_MS	10000
+
+/*
+ * sends OPEN on a data connection to replica, its response is read by
+ * replica_hs_step
+ */
+static int
+send_data_conn_open(spec_t *spec, replica_t *replica, int fd)
 {
-	int rc;
-	zvol_io_hdr_t *rio_hdr = NULL;
-	pthread_t r_thread;
-	zvol_io_hdr_t *ack_hdr;
-	mgmt_ack_t *ack_data;
-	zvol_op_open_data_t *rio_payload = NULL;
-	int i;
-	bool needs_update, can_be_trusty;
+	zvol_io_hdr_t rio_hdr;
+	zvol_op_open_data_t rio_payload;
+	struct iovec iov[2];
+
+	memset(&rio_hdr, 0, sizeof (rio_hdr));
+	rio_hdr.opcode = ZVOL_OPCODE_OPEN;
+	rio_hdr.io_seq = 0;
+	rio_hdr.volsize = spec->size;
+	rio_hdr.len = sizeof (zvol_op_open_data_t);
+	rio_hdr.version = REPLICA_VERSION;
+
+	memset(&rio_payload, 0, sizeof (rio_payload));
+	rio_payload.timeout = (3 * replica_timeout);
+	rio_payload.tgt_block_size = spec->blocklen;
+	strncpy(rio_payload.volname, spec->volname,
+	    sizeof (rio_payload.volname));
+	rio_payload.replication_factor = spec->replication_factor;
+
+	iov[0].iov_base = &rio_hdr;
+	iov[0].iov_len = sizeof (rio_hdr);
+	iov[1].iov_base = &rio_payload;
+	iov[1].iov_len = sizeof (rio_payload);
+	/* a new connection takes both whole into its send buffer */
+	if (writev(fd, iov, 2) != sizeof (rio_hdr) + sizeof (rio_payload)) {
+		REPLICA_ERRLOG("failed to send data-open to replica(%lu) "
+		    "err(%d)\n", replica->zvol_guid, errno);
+		return -1;
+	}
+	return 0;
+}
 
-	ack_hdr = replica->mgmt_io_resp_hdr;
-	ack_data = (mgmt_ack_t *)replica->mgmt_io_resp_data;
+/* closes the data connections opened by replica_hs_step */
+static void
+close_data_conns(replica_t *replica)
+{
+	while (replica->ndconns > 0) {
+		replica->ndconns--;
+		shutdown(replica->dconn[replica->ndconns].fd, SHUT_RDWR);
+		close(replica->dconn[replica->ndconns].fd);
+		replica->dconn[replica->ndconns].fd = -1;
+	}
+	replica->iofd = -1;
+}
 
-	TAILQ_INIT(&replica->waitq);
-	TAILQ_INIT(&replica->blockedq);
-	TAILQ_INIT(&replica->readyq);
+/* closes the data connections other than the first one */
+static void
+close_more_data_conns(replica_t *replica)
+{
+	while (replica->ndconns > 1) {
+		replica->ndconns--;
+		shutdown(replica->dconn[replica->ndconns].fd, SHUT_RDWR);
+		close(replica->dconn[replica->ndconns].fd);
+		replica->dconn[replica->ndconns].fd = -1;
+	}
+}
 
-	replica->ongoing_io = NULL;
-	replica->ongoing_io_len = 0;
-	replica->ongoing_io_buf = NULL;
-	replica->iofd = iofd;
-	replica->ip = malloc(strlen(ack_data->ip)+1);
-	strcpy(replica->ip, ack_data->ip);
-	replica->quorum = ack_data->quorum;
-	replica->port = ack_data->port;
-	replica->state = ZVOL_STATUS_DEGRADED;
-	replica->initial_checkpointed_io_seq =
-	    MAX_OF(ack_data->checkpointed_io_seq,
-	    ack_data->checkpointed_degraded_io_seq);
+/*
+ * Adds hs_eventfd to the epoll set of the shard the replica is homed on,
+ * which then runs replica_hs_step for its first kick.
+ */
+static int
+replica_hs_arm(replica_t *replica)
+{
+	struct epoll_event event;
 
-	replica->pool_guid = ack_data->pool_guid;
-	replica->zvol_guid = ack_data->zvol_guid;
-	strncpy(replica->replica_id, ack_data->replica_id, REPLICA_ID_LEN);
+	event.data.ptr = replica->m_event4;
+	event.events = EPOLLIN;
+	if (epoll_ctl(replica->epfd, EPOLL_CTL_ADD, replica->hs_eventfd,
+	    &event) == -1) {
+		REPLICA_ERRLOG("epoll_ctl() failed on hs_eventfd(%d) err(%d) "
+		    "for replica(%s:%d)\n", replica->hs_eventfd, errno,
+		    replica->ip, replica->port);
+		return -1;
+	}
+	return 0;
+}
 
-	if (strlen(replica->replica_id) == 0) {
-		REPLICA_ERRLOG("replicas(ip:%s port:%d "
-		    "guid:%lu) replica_id is empty so not permitted to connect\n",
-		    replica->ip, replica->port,
-		    replica->zvol_guid);
-		goto replica_error;
+/* ends the handshake, called with rq_mtx held */
+static void
+replica_hs_close(replica_t *replica)
+{
+	ASSERT(MTX_LOCKED(&replica->spec->rq_mtx));
+	if (replica->hs_fd != -1) {
+		close_fd(replica->epfd, replica->hs_fd);
+		replica->hs_fd = -1;
 	}
-	MTX_LOCK(&spec->rq_mtx);
-	if (!is_replica_newly_connected(spec, replica)) {
-		MTX_UNLOCK(&spec->rq_mtx);
-		REPLICA_ERRLOG("replica(ip:%s port:%d "
-		    "guid:%lu) is not permitted to connect\n", replica->ip, replica->port,
-		    replica->zvol_guid);
-		goto replica_error;
+	if (replica->hs_eventfd != -1) {
+		close_fd(replica->epfd, replica->hs_eventfd);
+		replica->hs_eventfd = -1;
 	}
-	MTX_UNLOCK(&spec->rq_mtx);
+	replica->hs_state = REPLICA_HS_NONE;
+}
 
-	replica->spec = spec;
-	replica->io_resp_hdr = (zvol_io_hdr_t *) malloc(sizeof (zvol_io_hdr_t));
-	memset(replica->io_resp_hdr, 0, sizeof (zvol_io_hdr_t));
-	replica->io_state = READ_IO_RESP_HDR;
-	replica->io_read = 0;
-
-	rio_hdr = (zvol_io_hdr_t *) malloc(sizeof (zvol_io_hdr_t));
-	memset(rio_hdr, 0, sizeof (zvol_io_hdr_t));
-	rio_hdr->opcode = ZVOL_OPCODE_OPEN;
-	rio_hdr->io_seq = 0;
-	rio_hdr->volsize = spec->size;
-	rio_hdr->len = sizeof (zvol_op_open_data_t);
-	rio_hdr->version = REPLICA_VERSION;
-
-	rio_payload = (zvol_op_open_data_t *) malloc(
-	    sizeof (zvol_op_open_data_t));
-	memset(rio_payload, 0, sizeof (zvol_op_open_data_t));
-	rio_payload->timeout = (3 * replica_timeout);
-	rio_payload->tgt_block_size = spec->blocklen;
-	strncpy(rio_payload->volname, spec->volname,
-	    sizeof (rio_payload->volname));
-	rio_payload->replication_factor = spec->replication_factor;
+/* drops a handshake that failed before replica_thread was started */
+static void
+replica_hs_abort(replica_t *replica)
+{
+	MTX_LOCK(&replica->spec->rq_mtx);
+	replica_hs_close(replica);
+	MTX_UNLOCK(&replica->spec->rq_mtx);
+	destroy_mempool(&replica->cmdq);
+	close_data_conns(replica);
+}
 
-	REPLICA_LOG("replica(%lu) connected successfully from %s:%d rep: %d\n",
-	    replica->zvol_guid, replica->ip, replica->port,
-	    rio_payload->replication_factor);
+/*
+ * Starts connecting the next data connection, replica_hs_step goes on
+ * from EPOLLOUT on it.
+ */
+static int
+replica_hs_connect(replica_t *replica)
+{
+	struct epoll_event event;
+	mgmt_event_t *mevent = replica->m_event3;
+	int fd;
 
-	if (write(replica->iofd, rio_hdr, sizeof (*rio_hdr)) !=
-	    sizeof (*rio_hdr)) {
-		REPLICA_ERRLOG("failed to send io hdr to replica(%lu)\n",
-		    replica->zvol_guid);
-		goto replica_error;
-	}
+	fd = cstor_ops.conn_connect_nb(replica->ip, replica->port);
+	if (fd < 0)
+		return -1;
 
-	if (write(replica->iofd, rio_payload, sizeof (zvol_op_open_data_t)) !=
-	    sizeof (zvol_op_open_data_t)) {
-		REPLICA_ERRLOG("failed to send data-open payload to "
-		    "replica(%lu)\n", replica->zvol_guid);
-		goto replica_error;
+	mevent->fd = fd;
+	event.data.ptr = mevent;
+	event.events = EPOLLOUT;
+	if (epoll_ctl(replica->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		REPLICA_ERRLOG("epoll_ctl() failed on data conn fd(%d) err(%d) "
+		    "for replica(%lu)\n", fd, errno, replica->zvol_guid);
+		close(fd);
+		return -1;
 	}
+	replica->hs_fd = fd;
+	replica->hs_read = 0;
+	replica->hs_state = REPLICA_HS_CONNECT;
+	return 0;
+}
 
-	if (read(replica->iofd, rio_hdr, sizeof (*rio_hdr)) !=
-	    sizeof (*rio_hdr)) {
-		REPLICA_ERRLOG("failed to read data-open response from "
-		    "replica(%lu)\n", replica->zvol_guid);
-		goto replica_error;
-	}
+/*
+ * Once its data connections are open, starts replica_thread on them.
+ * It kicks hs_eventfd once it is up, or has given up.
+ */
+static int
+replica_hs_start_thread(spec_t *spec, replica_t *replica)
+{
+	pthread_t r_thread;
+	int rc;
 
-	if (rio_hdr->status != ZVOL_OP_STATUS_OK) {
-		REPLICA_ERRLOG("data-open response is not OK for "
-		    "replica(%lu)\n", replica->zvol_guid);
-		goto replica_error;
-	}
+	if (replica->ndconns < spec->replica_dconns)
+		REPLICA_NOTICELOG("replica(%lu) took %d of %d data "
+		    "connections\n", replica->zvol_guid, replica->ndconns,
+		    spec->replica_dconns);
 
 	if (init_mempool(&replica->cmdq, rcmd_mempool_count, 0, 0,
 	    "replica_cmd_mempool", NULL, NULL, NULL, false)) {
 		REPLICA_ERRLOG("Failed to initialize replica(%lu) cmdq\n",
 		    replica->zvol_guid);
-		goto replica_error;
-	}
-
-	rc = make_socket_non_blocking(iofd);
-	if (rc == -1) {
-		REPLICA_ERRLOG("make_socket_non_blocking() failed for"
-		    " replica(%lu)\n", replica->zvol_guid);
-		goto replica_error;
+		return -1;
 	}
 
 	MTX_LOCK(&spec->rq_mtx);
@@ -1545,11 +1648,12 @@ update_replica_entry(spec_t *spec, replica_t *replica, int iofd)
 		    spec->degraded_rcount, get_non_quorum_replica_count(spec),
 		    replica->ip, replica->port, replica->zvol_guid);
 		MTX_UNLOCK(&spec->rq_mtx);
-		goto replica_error;
+		return -1;
 	}
 
-	needs_update = needs_trusty_replica_update_during_connect(spec, replica);
-	if (needs_update) {
+	replica->hs_needs_update =
+	    needs_trusty_replica_update_during_connect(spec, replica);
+	if (replica->hs_needs_update) {
 		rc = update_trusty_replica_list(spec, replica, spec->replication_factor);
 		if (rc < 0) {
 			REPLICA_ERRLOG("Failed to update known trusty list... "
@@ -1557,41 +1661,169 @@ update_replica_entry(spec_t *spec, replica_t *replica, int iofd)
 			    "guid:%lu replica_id: %s)\n", replica->ip, replica->port,
 			    replica->zvol_guid, replica->replica_id);
 			MTX_UNLOCK(&spec->rq_mtx);
-			goto replica_error;
+			return -1;
 		}
 	}
 	MTX_UNLOCK(&spec->rq_mtx);
 
+	replica->iofd = replica->dconn[0].fd;
+	replica->hs_state = REPLICA_HS_THREAD;
 	rc = pthread_create(&r_thread, NULL, &replica_thread,
 			(void *)replica);
 	if (rc != 0) {
 		REPLICA_ERRLOG("pthread_create(r_thread) failed for "
 		    "replica(%lu)\n", replica->zvol_guid);
-replica_error:
-		destroy_mempool(&replica->cmdq);
+		replica->hs_state = REPLICA_HS_OPEN;
 		replica->iofd = -1;
-		close(iofd);
-		if (rio_hdr)
-			free(rio_hdr);
-		if (rio_payload)
-			free(rio_payload);
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * The data connection being opened failed.  Only the first one is
+ * required, a replica that serves a volume on one connection only
+ * refuses the OPEN of the others, and we carry on with what we have.
+ */
+static int
+replica_hs_conn_failed(spec_t *spec, replica_t *replica)
+{
+	if (replica->hs_fd != -1) {
+		close_fd(replica->epfd, replica->hs_fd);
+		replica->hs_fd = -1;
+	}
+	if (replica->ndconns == 0) {
+		REPLICA_ERRLOG("Failed to open data connection for replica"
+		    "(%s:%d)\n", replica->ip, replica->port);
+		return -1;
+	}
+	return replica_hs_start_thread(spec, replica);
+}
+
+/*
+ * Runs the handshake of a replica on its mgmt shard, for events on its
+ * hs_eventfd and on the data connection being opened.  Connects are
+ * non-blocking and OPEN responses are read as they come, so a slow or
+ * stuck replica holds up nothing but itself.  Returns -1 when the
+ * replica is to be dropped.
+ */
+static int
+replica_hs_step(replica_t *replica, mgmt_event_t *mevent, uint32_t events)
+{
+	spec_t *spec = replica->spec;
+	struct epoll_event event;
+	socklen_t len;
+	int err = 0, target;
+	ssize_t count;
+
+	if (mevent == replica->m_event4) {
+		if (replica->hs_eventfd == -1)
+			return 0;
+		do_drainfd(replica->hs_eventfd);
+	} else if (replica->hs_fd == -1 || mevent->fd != replica->hs_fd) {
+		return 0;
+	}
+
+	switch (replica->hs_state) {
+	case REPLICA_HS_START:
+		replica->hs_deadline_ms = istgt_twheel_now_ms() +
+		    REPLICA_HS_TIMEOUT_MS;
+		if (replica_hs_connect(replica) != 0)
+			return replica_hs_conn_failed(spec, replica);
+		return 0;
+
+	case REPLICA_HS_CONNECT:
+	case REPLICA_HS_OPEN:
+		if (mevent == replica->m_event4) {
+			if (istgt_twheel_now_ms() < replica->hs_deadline_ms)
+				return 0;
+			REPLICA_ERRLOG("data connection %d of replica(%lu) not "
+			    "opened in %dms\n", replica->ndconns + 1,
+			    replica->zvol_guid, REPLICA_HS_TIMEOUT_MS);
+			return replica_hs_conn_failed(spec, replica);
+		}
+		if (events & (EPOLLERR | EPOLLHUP))
+			return replica_hs_conn_failed(spec, replica);
+		break;
+
+	case REPLICA_HS_THREAD:
+		if (mevent != replica->m_event4)
+			return 0;
+		return update_replica_entry(spec, replica);
+
+	default:
+		return 0;
+	}
+
+	if (replica->hs_state == REPLICA_HS_CONNECT) {
+		len = sizeof (err);
+		if (getsockopt(replica->hs_fd, SOL_SOCKET, SO_ERROR, &err,
+		    &len) == -1 || err != 0) {
+			REPLICA_ERRLOG("connect to replica(%s:%d) failed "
+			    "err(%d)\n", replica->ip, replica->port, err);
+			return replica_hs_conn_failed(spec, replica);
+		}
+		if (send_data_conn_open(spec, replica, replica->hs_fd) != 0)
+			return replica_hs_conn_failed(spec, replica);
+		event.data.ptr = mevent;
+		event.events = EPOLLIN;
+		if (epoll_ctl(replica->epfd, EPOLL_CTL_MOD, replica->hs_fd,
+		    &event) == -1)
+			return replica_hs_conn_failed(spec, replica);
+		replica->hs_state = REPLICA_HS_OPEN;
+		return 0;
+	}
+
+	count = read(replica->hs_fd, ((uint8_t *)&replica->hs_hdr) +
+	    replica->hs_read, sizeof (replica->hs_hdr) - replica->hs_read);
+	if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (count <= 0) {
+		REPLICA_ERRLOG("failed to read data-open response from "
+		    "replica(%lu)\n", replica->zvol_guid);
+		return replica_hs_conn_failed(spec, replica);
+	}
+	replica->hs_read += count;
+	if (replica->hs_read < (int)sizeof (replica->hs_hdr))
+		return 0;
+	if (replica->hs_hdr.status != ZVOL_OP_STATUS_OK) {
+		REPLICA_ERRLOG("data-open response is not OK for "
+		    "replica(%lu)\n", replica->zvol_guid);
+		return replica_hs_conn_failed(spec, replica);
+	}
 
-	free(rio_hdr);
-	free(rio_payload);
+	/* replica_thread takes it into its own epoll set */
+	(void) epoll_ctl(replica->epfd, EPOLL_CTL_DEL, replica->hs_fd, NULL);
+	replica->dconn[replica->ndconns++].fd = replica->hs_fd;
+	replica->hs_fd = -1;
+
+	target = MAX_OF(spec->replica_dconns, 1);
+	if (replica->ndconns < target && replica_hs_connect(replica) == 0)
+		return 0;
+	return replica_hs_start_thread(spec, replica);
+}
+
+/*
+ * update_replica_entry runs once replica_thread is up on the data
+ * connections opened by replica_hs_step, on the mgmt shard:
+ * removes replica from spec's rwaitq and adds it to spec's rq
+ */
+int
+update_replica_entry(spec_t *spec, replica_t *replica)
+{
+	int iofd = replica->iofd;
+	bool can_be_trusty;
 
 	MTX_LOCK(&spec->rq_mtx);
+	replica_hs_close(replica);
 	MTX_LOCK(&replica->r_mtx);
-	for (i = 0; (i < 10) && (replica->mgmt_eventfd2 == -1); i++) {
-		MTX_UNLOCK(&replica->r_mtx);
-		sleep(1);
-		MTX_LOCK(&replica->r_mtx);
-	}
 
-	if (replica->mgmt_eventfd2 == -1) {
-		REPLICA_ERRLOG("unable to set mgmteventfd2 for more than 10 "
-		    "seconds for replica(%s:%lu)\n", replica->replica_id, replica->zvol_guid);
+	if (replica->mgmt_eventfd2 == -1 || replica->hs_conn_error) {
+		REPLICA_ERRLOG("%s for replica(%s:%lu)\n",
+		    replica->hs_conn_error ? "mgmt connection failed while "
+		    "replica thread was starting" : "replica thread failed "
+		    "to start", replica->replica_id, replica->zvol_guid);
+		replica->mgmt_eventfd2 = -1;
 		/*
 		 * as this function doesn't run in parallel with handle_mgmt_conn
 		 * for given replica, its fine to set these values to -1 here.
@@ -1599,6 +1831,8 @@ replica_error:
 error_out_replica:
 		replica->dont_free = 1;
 		replica->iofd = -1;
+		replica->dconn[0].fd = -1;
+		close_more_data_conns(replica);
 		MTX_UNLOCK(&replica->r_mtx);
 		MTX_UNLOCK(&spec->rq_mtx);
 		shutdown(iofd, SHUT_RDWR);
@@ -1646,13 +1880,36 @@ error_out_replica:
 			TAILQ_INSERT_TAIL(&spec->non_quorum_rq, replica, r_non_quorum_next);
 	}
 
+	/*
+	 * Bring a replica that missed reservation changes up to date.  None
+	 * were made if the replicas never answered PR_READ, then they may
+	 * not know the opcodes at all.
+	 */
+	if (spec->pr_restored && spec->pr_blob_len != 0)
+		(void) send_replica_pr_command(spec, replica,
+		    ZVOL_OPCODE_PR_UPDATE, NULL, spec->pr_seq, spec->pr_blob,
+		    spec->pr_blob_len);
+
 	ISTGT_LOG("replica(%s:%lu) connected to target with needs_update: %d can_be_trusty: %d\n",
-	    replica->replica_id, replica->zvol_guid, needs_update, can_be_trusty)
+	    replica->replica_id, replica->zvol_guid, replica->hs_needs_update,
+	    can_be_trusty)
+
+	/*
+	 * Replica may come back with different data (e.g. after a snapshot
+	 * rollback on its side), don't keep serving what we read earlier.
+	 */
+	istgt_lu_disk_rcache_flush(spec);
 
 	/* Update the volume ready state */
 	update_volstate(spec);
 	MTX_UNLOCK(&spec->rq_mtx);
 	clock_gettime(CLOCK_MONOTONIC_COARSE, &replica->create_time);
+
+	if (spec->replica_status_push) {
+		MTX_LOCK(&replica->r_mtx);
+		queue_status_subscribe(replica, spec);
+		MTX_UNLOCK(&replica->r_mtx);
+	}
 	return 0;
 }
 
@@ -2173,46 +2430,371 @@ istgt_lu_resize_volume(spec_t *spec, uint64_t size) {
 	return true;
 }
 
-void
-get_replica_stats_json(replica_t *replica, struct json_object **jobj)
-{
-	struct json_object *j_stats;
-	struct timespec now;
+/* seconds a reservation change waits for consistency_factor replicas */
+#define	PR_WAIT_TIME	5
+#define	PR_POLL_US	10000
 
-	j_stats = json_object_new_object();
-	json_object_object_add(j_stats, "replicaId",
-	    json_object_new_uint64(replica->zvol_guid));
+/*
+ * Persistent reservations are kept on the replicas as an opaque blob
+ * tagged with pr_seq.  A change is acked once consistency_factor replicas
+ * in rq have stored it, so reading back any consistency_factor of them
+ * finds the latest one by pr_seq.
+ */
+static int
+send_replica_pr_command(spec_t *spec, replica_t *replica, zvol_op_code_t opcode,
+    rcommon_mgmt_cmd_t *rcomm_mgmt, uint64_t pr_seq, void *buf, uint64_t len)
+{
+	zvol_io_hdr_t *rmgmtio = NULL;
+	zvol_op_pr_data_t *pr;
+	mgmt_cmd_t *mgmt_cmd;
+	uint64_t data_len, num = 1;
+	int ret = 0;
 
-	json_object_object_add(j_stats, "Address",
-	    json_object_new_string(replica->ip));
+	data_len = sizeof (zvol_op_pr_data_t) + len;
+	mgmt_cmd = malloc(sizeof (mgmt_cmd_t));
+	memset(mgmt_cmd, 0, sizeof (mgmt_cmd_t));
+	mgmt_cmd->rcomm_mgmt = rcomm_mgmt;
 
-	json_object_object_add(j_stats, "Mode",
-	    json_object_new_string((replica->state == ZVOL_STATUS_HEALTHY) ?
-	    REPLICA_STATUS_HEALTHY : REPLICA_STATUS_DEGRADED));
+	BUILD_REPLICA_MGMT_HDR(rmgmtio, opcode, data_len);
+	pr = malloc(data_len);
+	memset(pr, 0, data_len);
+	strncpy(pr->volname, spec->volname, MAX_NAME_LEN - 1);
+	pr->pr_seq = pr_seq;
+	pr->len = len;
+	if (len != 0)
+		memcpy(pr + 1, buf, len);
 
-	json_object_object_add(j_stats, "checkpointedIOSeq",
-	    json_object_new_uint64(replica->initial_checkpointed_io_seq));
+	rmgmtio->io_seq = spec->io_seq;
+	mgmt_cmd->io_hdr = rmgmtio;
+	mgmt_cmd->data = pr;
+	mgmt_cmd->mgmt_cmd_state = WRITE_IO_SEND_HDR;
 
-	json_object_object_add(j_stats, "inflightRead",
-	    json_object_new_uint64(replica->replica_inflight_read_io_cnt));
+	MTX_LOCK(&replica->r_mtx);
+	TAILQ_INSERT_TAIL(&replica->mgmt_cmd_queue, mgmt_cmd, mgmt_cmd_next);
+	MTX_UNLOCK(&replica->r_mtx);
 
-	json_object_object_add(j_stats, "inflightWrite",
-	    json_object_new_uint64(replica->replica_inflight_write_io_cnt));
+	if (rcomm_mgmt != NULL)
+		rcomm_mgmt->cmds_sent++;
 
-	json_object_object_add(j_stats, "inflightSync",
-	    json_object_new_uint64(replica->replica_inflight_sync_io_cnt));
+	if (write(replica->mgmt_eventfd1, &num, sizeof (num)) != sizeof (num)) {
+		REPLICA_ERRLOG("Failed to inform PR request to mgmt_eventfd for "
+		    "replica(%lu)\n", replica->zvol_guid);
+		ret = -1;
+	}
+	return ret;
+}
 
-	json_object_object_add(j_stats, "quorum",
-	    json_object_new_uint64(replica->quorum));
+/*
+ * hdr is NULL when the replica went away before answering.  A replica
+ * answering PR_READ with an error has nothing stored, which counts as a
+ * response; the newest blob is kept in rcomm_mgmt->buf for the caller.
+ */
+static void
+handle_pr_resp(replica_t *replica, mgmt_cmd_t *mgmt_cmd, zvol_io_hdr_t *hdr,
+    void *resp)
+{
+	rcommon_mgmt_cmd_t *rcomm_mgmt = mgmt_cmd->rcomm_mgmt;
+	zvol_op_pr_data_t *pr = resp, *best;
+	bool delete = false;
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	json_object_object_add(j_stats, "upTime",
-	    json_object_new_int64(now.tv_sec - replica->create_time.tv_sec));
+	if (rcomm_mgmt == NULL)
+		return;
 
-	*jobj = j_stats;
+	MTX_LOCK(&rcomm_mgmt->mtx);
+	if (hdr == NULL) {
+		rcomm_mgmt->cmds_failed++;
+	} else if (hdr->opcode == ZVOL_OPCODE_PR_UPDATE) {
+		if (hdr->status != ZVOL_OP_STATUS_OK) {
+			REPLICA_ERRLOG("replica(%lu) failed to store "
+			    "reservations\n", replica->zvol_guid);
+			rcomm_mgmt->cmds_failed++;
+		} else
+			rcomm_mgmt->cmds_succeeded++;
+	} else {
+		rcomm_mgmt->cmds_succeeded++;
+		best = rcomm_mgmt->buf;
+		if (hdr->status == ZVOL_OP_STATUS_OK && pr != NULL &&
+		    pr->len == hdr->len - sizeof (zvol_op_pr_data_t) &&
+		    rcomm_mgmt->caller_gone == 0 &&
+		    (best == NULL || best->pr_seq < pr->pr_seq)) {
+			free(rcomm_mgmt->buf);
+			rcomm_mgmt->buf = malloc(hdr->len);
+			memcpy(rcomm_mgmt->buf, pr, hdr->len);
+			rcomm_mgmt->buf_size = hdr->len;
+		}
+	}
+	if ((rcomm_mgmt->caller_gone == 1) &&
+	    (rcomm_mgmt->cmds_sent == (rcomm_mgmt->cmds_failed + rcomm_mgmt->cmds_succeeded)))
+		delete = true;
+	MTX_UNLOCK(&rcomm_mgmt->mtx);
+	if (delete == true)
+		free_rcommon_mgmt_cmd(rcomm_mgmt);
 }
 
-const char *
+/*
+ * Like timeout_wait_for_command() with a short poll, a reservation change
+ * holds up the initiator.  Hands back the newest PR_READ answer in bufp.
+ * Called with rq_mtx held.
+ */
+static int
+pr_wait_for_command(spec_t *spec, rcommon_mgmt_cmd_t *rcomm_mgmt,
+    struct timespec last, void **bufp)
+{
+	struct timespec diff, now;
+	int8_t free_rcomm_mgmt = 0;
+	int success;
+
+	ASSERT(MTX_LOCKED(&spec->rq_mtx));
+
+	timesdiff(CLOCK_MONOTONIC_COARSE, last, now, diff);
+	MTX_LOCK(&rcomm_mgmt->mtx);
+	while (diff.tv_sec < PR_WAIT_TIME) {
+		if (rcomm_mgmt->cmds_sent == (rcomm_mgmt->cmds_succeeded + rcomm_mgmt->cmds_failed))
+			break;
+		MTX_UNLOCK(&rcomm_mgmt->mtx);
+		MTX_UNLOCK(&spec->rq_mtx);
+		usleep(PR_POLL_US);
+		MTX_LOCK(&spec->rq_mtx);
+		MTX_LOCK(&rcomm_mgmt->mtx);
+		timesdiff(CLOCK_MONOTONIC_COARSE, last, now, diff);
+	}
+	rcomm_mgmt->caller_gone = 1;
+	if (rcomm_mgmt->cmds_sent == (rcomm_mgmt->cmds_succeeded + rcomm_mgmt->cmds_failed))
+		free_rcomm_mgmt = 1;
+	success = rcomm_mgmt->cmds_succeeded;
+	if (bufp != NULL) {
+		*bufp = rcomm_mgmt->buf;
+		rcomm_mgmt->buf = NULL;
+	}
+	MTX_UNLOCK(&rcomm_mgmt->mtx);
+
+	if (free_rcomm_mgmt)
+		free_rcommon_mgmt_cmd(rcomm_mgmt);
+	return (success);
+}
+
+/*
+ * Stores buf as the volume's reservations on the replicas.  Returns -1
+ * unless consistency_factor replicas in rq have it, the caller then rolls
+ * the change back.  Called with pr_rsv_mutex held.
+ */
+int
+istgt_lu_pr_persist(spec_t *spec, void *buf, uint64_t len)
+{
+	replica_t *replica;
+	rcommon_mgmt_cmd_t *rcomm_mgmt;
+	struct timespec last;
+	uint64_t pr_seq;
+	int success;
+
+	/* kept nowhere, as the reservations of a volume always were */
+	if (!spec->replica_pr_persist)
+		return (0);
+	if (len > ZVOL_PR_DATA_MAX)
+		return (-1);
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
+	MTX_LOCK(&spec->rq_mtx);
+	if (!spec->pr_restored) {
+		MTX_UNLOCK(&spec->rq_mtx);
+		REPLICA_ERRLOG("volume(%s) reservations not read back yet\n",
+		    spec->volname);
+		return (-1);
+	}
+
+	pr_seq = ++spec->pr_seq;
+	rcomm_mgmt = allocate_rcommon_mgmt_cmd(0);
+	TAILQ_FOREACH(replica, &spec->rq, r_next)
+		(void) send_replica_pr_command(spec, replica,
+		    ZVOL_OPCODE_PR_UPDATE, rcomm_mgmt, pr_seq, buf, len);
+	TAILQ_FOREACH(replica, &spec->non_quorum_rq, r_non_quorum_next)
+		(void) send_replica_pr_command(spec, replica,
+		    ZVOL_OPCODE_PR_UPDATE, NULL, pr_seq, buf, len);
+
+	success = pr_wait_for_command(spec, rcomm_mgmt, last, NULL);
+	if (success < spec->consistency_factor) {
+		MTX_UNLOCK(&spec->rq_mtx);
+		REPLICA_ERRLOG("volume(%s) reservations pr_seq(%lu) stored on "
+		    "%d replicas, need %d\n", spec->volname, pr_seq, success,
+		    spec->consistency_factor);
+		return (-1);
+	}
+
+	free(spec->pr_blob);
+	spec->pr_blob = malloc(len);
+	memcpy(spec->pr_blob, buf, len);
+	spec->pr_blob_len = len;
+	MTX_UNLOCK(&spec->rq_mtx);
+	return (0);
+}
+
+/*
+ * Copies the reservations last read back from or stored on the replicas
+ * into buf, returns the length copied.  Called with pr_rsv_mutex held.
+ */
+uint64_t
+istgt_lu_pr_fetch(spec_t *spec, void *buf, uint64_t len)
+{
+	MTX_LOCK(&spec->rq_mtx);
+	if (len > spec->pr_blob_len)
+		len = spec->pr_blob_len;
+	if (len != 0)
+		memcpy(buf, spec->pr_blob, len);
+	MTX_UNLOCK(&spec->rq_mtx);
+	return (len);
+}
+
+/*
+ * Retried from the shard of the spec until PR_WAIT_TIME after the first
+ * try.  Replicas that don't answer PR_READ at all keep the volume from
+ * quorum that long only, it then starts without reservations.
+ */
+static void *
+pr_restore_thread(void *arg)
+{
+	spec_t *spec = arg;
+	replica_t *replica;
+	rcommon_mgmt_cmd_t *rcomm_mgmt;
+	zvol_op_pr_data_t *pr = NULL;
+	struct timespec last, now, diff;
+	int success, rc;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
+	MTX_LOCK(&spec->rq_mtx);
+	rcomm_mgmt = allocate_rcommon_mgmt_cmd(0);
+	TAILQ_FOREACH(replica, &spec->rq, r_next)
+		(void) send_replica_pr_command(spec, replica,
+		    ZVOL_OPCODE_PR_READ, rcomm_mgmt, 0, NULL, 0);
+	success = pr_wait_for_command(spec, rcomm_mgmt, last, (void **)&pr);
+
+	timesdiff(CLOCK_MONOTONIC_COARSE, spec->pr_restore_start, now, diff);
+	if (success < spec->consistency_factor && diff.tv_sec < PR_WAIT_TIME) {
+		MTX_UNLOCK(&spec->rq_mtx);
+		free(pr);
+		REPLICA_ERRLOG("volume(%s) reservations read from %d replicas, "
+		    "need %d.. retrying\n", spec->volname, success,
+		    spec->consistency_factor);
+		/* pr_reading stays set until the retry timer clears it */
+		rmgmt_shard_pr_retry(spec, 1000);
+		return (NULL);
+	}
+
+	free(spec->pr_blob);
+	spec->pr_blob = NULL;
+	spec->pr_blob_len = 0;
+	if (success < spec->consistency_factor) {
+		/* the next change still has to supersede what they hold */
+		if (pr != NULL && pr->pr_seq > spec->pr_seq)
+			spec->pr_seq = pr->pr_seq;
+		free(pr);
+		REPLICA_WARNLOG("volume(%s) reservations read from %d replicas "
+		    "in %ds, need %d.. starting without reservations\n",
+		    spec->volname, success, PR_WAIT_TIME,
+		    spec->consistency_factor);
+	} else if (pr != NULL) {
+		spec->pr_seq = pr->pr_seq;
+		spec->pr_blob_len = pr->len;
+		spec->pr_blob = malloc(pr->len);
+		memcpy(spec->pr_blob, pr + 1, pr->len);
+		free(pr);
+	}
+	MTX_UNLOCK(&spec->rq_mtx);
+
+	if (spec->pr_apply != NULL) {
+		MTX_LOCK(&spec->pr_rsv_mutex);
+		rc = spec->pr_apply(spec);
+		MTX_UNLOCK(&spec->pr_rsv_mutex);
+		if (rc != 0)
+			REPLICA_ERRLOG("volume(%s) failed to apply "
+			    "reservations\n", spec->volname);
+	}
+
+	MTX_LOCK(&spec->rq_mtx);
+	if (success >= spec->consistency_factor)
+		REPLICA_NOTICELOG("volume(%s) reservations read back from %d "
+		    "replicas pr_seq(%lu) len(%lu)\n", spec->volname, success,
+		    spec->pr_seq, spec->pr_blob_len);
+	spec->pr_restored = 1;
+	spec->pr_reading = 0;
+	update_volstate(spec);
+	MTX_UNLOCK(&spec->rq_mtx);
+	return (NULL);
+}
+
+/*
+ * Reads the reservations back from the replicas once quorum is first
+ * reached.  Called with rq_mtx held.
+ */
+static void
+pr_start_restore(spec_t *spec)
+{
+	int rc;
+
+	ASSERT(MTX_LOCKED(&spec->rq_mtx));
+	if (spec->pr_reading)
+		return;
+	/* pr_reading is cleared after its last use of spec, so this is short */
+	if (spec->pr_thread_valid) {
+		(void) pthread_join(spec->pr_thread, NULL);
+		spec->pr_thread_valid = 0;
+	}
+	spec->pr_reading = 1;
+	if (spec->pr_restore_start.tv_sec == 0)
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &spec->pr_restore_start);
+	rc = pthread_create(&spec->pr_thread, NULL, &pr_restore_thread,
+	    (void *)spec);
+	if (rc != 0) {
+		REPLICA_ERRLOG("pthread_create(pr_thread) failed for volume(%s) "
+		    "err(%d)\n", spec->volname, rc);
+		spec->pr_reading = 0;
+		return;
+	}
+	spec->pr_thread_valid = 1;
+}
+
+void
+get_replica_stats_json(replica_t *replica, struct json_object **jobj)
+{
+	struct json_object *j_stats;
+	struct timespec now;
+
+	j_stats = json_object_new_object();
+	json_object_object_add(j_stats, "replicaId",
+	    json_object_new_uint64(replica->zvol_guid));
+
+	json_object_object_add(j_stats, "Address",
+	    json_object_new_string(replica->ip));
+
+	json_object_object_add(j_stats, "Mode",
+	    json_object_new_string((replica->state == ZVOL_STATUS_HEALTHY) ?
+	    REPLICA_STATUS_HEALTHY : REPLICA_STATUS_DEGRADED));
+
+	json_object_object_add(j_stats, "checkpointedIOSeq",
+	    json_object_new_uint64(replica->initial_checkpointed_io_seq));
+
+	json_object_object_add(j_stats, "inflightRead",
+	    json_object_new_uint64(replica->replica_inflight_read_io_cnt));
+
+	json_object_object_add(j_stats, "inflightWrite",
+	    json_object_new_uint64(replica->replica_inflight_write_io_cnt));
+
+	json_object_object_add(j_stats, "inflightSync",
+	    json_object_new_uint64(replica->replica_inflight_sync_io_cnt));
+
+	json_object_object_add(j_stats, "quorum",
+	    json_object_new_uint64(replica->quorum));
+
+	json_object_object_add(j_stats, "dataConnections",
+	    json_object_new_int(replica->ndconns));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	json_object_object_add(j_stats, "upTime",
+	    json_object_new_int64(now.tv_sec - replica->create_time.tv_sec));
+
+	*jobj = j_stats;
+}
+
+const char *
 get_cv_status(spec_t *spec)
 {
 	if (spec->ready == false)
@@ -2260,16 +2842,23 @@ istgt_lu_replica_stats(char *volname, char **resp)
 
 	MTX_LOCK(&specq_mtx);
 
-	TAILQ_FOREACH(spec, &spec_q, spec_next) {
+	/* exact name through the index, else the first prefix match */
+	if (volname &&
+	    (spec = istgt_nidx_find(&spec_volname_idx, volname)) != NULL) {
 		MTX_LOCK(&spec->rq_mtx);
-		if (volname) {
-			if(!strncmp(spec->volname, volname, strlen(volname))) {
+		POPULATE_SPEC_STATUS(spec)
+	} else {
+		TAILQ_FOREACH(spec, &spec_q, spec_next) {
+			MTX_LOCK(&spec->rq_mtx);
+			if (volname) {
+				if(!strncmp(spec->volname, volname, strlen(volname))) {
+					POPULATE_SPEC_STATUS(spec)
+					break;
+				}
+				MTX_UNLOCK(&spec->rq_mtx);
+			} else {
 				POPULATE_SPEC_STATUS(spec)
-				break;
 			}
-			MTX_UNLOCK(&spec->rq_mtx);
-		} else {
-			POPULATE_SPEC_STATUS(spec)
 		}
 	}
 
@@ -2297,6 +2886,7 @@ send_replica_query(replica_t *replica, spec_t *spec, zvol_op_code_t opcode)
 	char *data;
 	zvol_op_code_t mgmt_opcode = opcode;
 	mgmt_cmd_t *mgmt_cmd;
+	uint64_t now;
 
 	/*
 	 * This API sends the query to replica on its management connection.
@@ -2305,6 +2895,17 @@ send_replica_query(replica_t *replica, spec_t *spec, zvol_op_code_t opcode)
 	if ((replica->state == ZVOL_STATUS_HEALTHY) && (opcode == ZVOL_OPCODE_REPLICA_STATUS))
 		return 0;
 
+	/* replicas that push their status are polled only as a fallback */
+	if (replica->push_enabled && (opcode == ZVOL_OPCODE_REPLICA_STATUS ||
+	    opcode == ZVOL_OPCODE_STATS)) {
+		now = istgt_twheel_now_ms();
+		if (now < replica->push_poll_due_ms)
+			return 0;
+		if (opcode == ZVOL_OPCODE_STATS)
+			replica->push_poll_due_ms = now +
+			    REPLICA_PUSH_POLL_FACTOR * replica_poll_time * 1000;
+	}
+
 	mgmt_cmd = malloc(sizeof(mgmt_cmd_t));
 	memset(mgmt_cmd, 0, sizeof (mgmt_cmd_t));
 	data_len = strlen(spec->volname) + 1;
@@ -2324,6 +2925,50 @@ send_replica_query(replica_t *replica, spec_t *spec, zvol_op_code_t opcode)
 	return handle_write_data_event(replica);
 }
 
+/*
+ * Queues STATUS_SUBSCRIBE on a replica that just completed its handshake.
+ * It is sent on the next write event of the mgmt connection.
+ */
+static void
+queue_status_subscribe(replica_t *replica, spec_t *spec)
+{
+	zvol_io_hdr_t *rmgmtio = NULL;
+	zvol_op_subscribe_data_t *data;
+	mgmt_cmd_t *mgmt_cmd;
+
+	mgmt_cmd = malloc(sizeof (mgmt_cmd_t));
+	memset(mgmt_cmd, 0, sizeof (mgmt_cmd_t));
+	BUILD_REPLICA_MGMT_HDR(rmgmtio, ZVOL_OPCODE_STATUS_SUBSCRIBE,
+	    sizeof (*data));
+
+	data = malloc(sizeof (*data));
+	memset(data, 0, sizeof (*data));
+	strncpy(data->volname, spec->volname, sizeof (data->volname) - 1);
+	data->stats_interval = replica_poll_time;
+
+	mgmt_cmd->io_hdr = rmgmtio;
+	mgmt_cmd->data = (char *)data;
+	mgmt_cmd->mgmt_cmd_state = WRITE_IO_SEND_HDR;
+
+	ASSERT(MTX_LOCKED(&replica->r_mtx));
+	TAILQ_INSERT_TAIL(&replica->mgmt_cmd_queue, mgmt_cmd, mgmt_cmd_next);
+}
+
+static void
+handle_status_subscribe_resp(replica_t *replica, zvol_io_hdr_t *hdr)
+{
+	if (hdr->status != ZVOL_OP_STATUS_OK) {
+		REPLICA_NOTICELOG("replica(%s:%d) doesn't push its status, "
+		    "polling it\n", replica->ip, replica->port);
+		return;
+	}
+	replica->push_enabled = 1;
+	replica->push_poll_due_ms = istgt_twheel_now_ms() +
+	    REPLICA_PUSH_POLL_FACTOR * replica_poll_time * 1000;
+	REPLICA_LOG("replica(%s:%d) pushes its status\n", replica->ip,
+	    replica->port);
+}
+
 #define SEND_REPLICA_ZVOL_OPCODE(RQ_LIST, NEXT, OPCODE, AGAIN) 				\
 	TAILQ_FOREACH(replica, RQ_LIST, NEXT) { 					\
 		ret = send_replica_query(replica, spec, OPCODE);			\
@@ -2467,64 +3112,35 @@ handle_update_spec_stats(spec_t *spec, zvol_io_hdr_t *hdr, void *resp)
 }
 
 /*
- * wait_for_ongoing_ios_on_replica pause the IOs and it's caller
- * responsibility to pause IO's and call this function
- * Returns:
- * 0 - on success
- * -1 - still, if pending IOs are there
+ * scaleup_fence_pending returns true while a write or sync that was
+ * issued at or before spec->scaleup_fence_io_seq is still waiting for
+ * replica responses. Such IOs were built without the scaling up replica
+ * and have to complete under the old membership before the new
+ * consistency model is committed. rcommon_waitq is ordered by io_seq for
+ * writes and syncs (only reads get requeued with their old io_seq), so
+ * the scan stops at the first write/sync beyond the fence. The scaling up
+ * replica may also still have writes or syncs of its own in flight that
+ * were sent to it before it joined, which have to be acked first.
  */
-static int
-wait_for_ongoing_ios_on_replica(spec_t *spec, replica_t *replica, int sec) {
-	int ret = -1;
-	struct timespec last, now, diff;
-	bool io_found = false;	/* Write or Sync IOs */
+static bool
+scaleup_fence_pending(spec_t *spec, replica_t *replica)
+{
+	rcommon_cmd_t *rcomm_cmd;
 
 	ASSERT(MTX_LOCKED(&spec->rq_mtx));
-	ASSERT(spec->quiesce == 1);
 
-	clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
-	timesdiff(CLOCK_MONOTONIC_COARSE, last, now, diff);
-
-	while (diff.tv_sec < sec) {
-		io_found = false;
+	if (replica->replica_inflight_write_io_cnt != 0 ||
+	    replica->replica_inflight_sync_io_cnt != 0)
+		return true;
 
-		/*
-		 * Check on spec is required as these IOs as well
-		 * need to be pushed to replica before setting scalingup_replica
-		 * to replica.
-		 */
-		if (spec->inflight_write_io_cnt != 0 ||
-		    spec->inflight_sync_io_cnt != 0)
-			io_found = true;
-		if (replica->replica_inflight_write_io_cnt != 0 ||
-		    replica->replica_inflight_sync_io_cnt != 0) {
-			io_found = true;
-		}
-		if (!io_found) {
-			ret = 0;
-			ISTGT_LOG("Successfully flushed the IO's from replica(%s:%lu) queue",
-			    replica->replica_id, replica->zvol_guid);
+	TAILQ_FOREACH(rcomm_cmd, &spec->rcommon_waitq, wait_cmd_next) {
+		if (rcomm_cmd->opcode == ZVOL_OPCODE_READ)
+			continue;
+		if (rcomm_cmd->io_seq > spec->scaleup_fence_io_seq)
 			break;
-		}
-
-		MTX_UNLOCK(&spec->rq_mtx);
-
-		ISTGT_LOG("Waiting for IO's to flush on replica(%s:%lu) "
-		    "spec write_io_cnt: %lu and sync_io_cnt: %lu replica "
-		    "write_io_cnt: %lu sync_io_cnt: %lu\n",
-	   	    replica->replica_id, replica->zvol_guid,
-		    spec->inflight_write_io_cnt, spec->inflight_sync_io_cnt,
-		    replica->replica_inflight_write_io_cnt, replica->replica_inflight_sync_io_cnt);
-		/*
-		 * inflight write/sync IOs in spec, or in replica,
-		 * so, wait for some time
-		 */
-		sleep (1);
-		MTX_LOCK(&spec->rq_mtx);
-		timesdiff(CLOCK_MONOTONIC_COARSE, last, now, diff);
+		return true;
 	}
-
-	return ret;
+	return false;
 }
 
 //TODO: Need to restructure handle_scaleup_replica_transition and
@@ -2540,7 +3156,6 @@ static int
 handle_scaleup_replica_transition(spec_t *spec, replica_t *replica)
 {
 	int rf, cf, rc;
-	int pause_io_wait_time = 10;
 	/*
 	 * Check if there is no change in CF wrt new RF, i.e., (RF + 1)
 	 */
@@ -2550,30 +3165,30 @@ handle_scaleup_replica_transition(spec_t *spec, replica_t *replica)
 		rc = update_trusty_replica_list(spec, replica, rf);
 	else {
 
-		rc = 0;
-
 		/*
-		 * Wait for ongoing IOs if first time (or)
-		 * waiting in previous iteration was NOT successful.
+		 * Writes issued from now on are built with scalingup_replica
+		 * and already follow the new consistency model. Writes issued
+		 * before the fence keep the old one, so the switch is only
+		 * committed once they have drained; IO is never paused.
 		 */
-
 		if (spec->scalingup_replica == NULL) {
-			/* Pause IO's */
-			spec->quiesce = 1;
-
-			rc = wait_for_ongoing_ios_on_replica(spec, replica, pause_io_wait_time);
-
-			/* set transition replica so that new consistency model as well gets applied */
-			if (rc == 0)
-				spec->scalingup_replica = replica;
-
-			/* Resume IOs */
-			spec->quiesce = 0;
+			spec->scalingup_replica = replica;
+			spec->scaleup_fence_io_seq = spec->io_seq;
+			ISTGT_LOG("scaling up replica(%s:%lu) with io fence "
+			    "at io_seq(%lu)\n", replica->replica_id,
+			    replica->zvol_guid, spec->scaleup_fence_io_seq);
 		}
 
-		/* Retry again */
-		if (rc != 0)
-			return rc;
+		/* Retry again on next status update */
+		if (scaleup_fence_pending(spec, replica)) {
+			ISTGT_LOG("waiting for IOs before io_seq(%lu) to "
+			    "complete on replica(%s:%lu) write_io_cnt: %lu "
+			    "sync_io_cnt: %lu\n", spec->scaleup_fence_io_seq,
+			    replica->replica_id, replica->zvol_guid,
+			    replica->replica_inflight_write_io_cnt,
+			    replica->replica_inflight_sync_io_cnt);
+			return -1;
+		}
 
 		rc = update_trusty_replica_list(spec, replica, rf);
 	}
@@ -2775,6 +3390,7 @@ cleanup:
 			spec->rebuild_info.dw_replica = NULL;
 			spec->rebuild_info.healthy_replica = NULL;
 			spec->rebuild_info.rebuild_in_progress = false;
+			istgt_lu_disk_rcache_flush(spec);
 			/* There may be chance of change due to non_quorum replica */
 			update_volstate(spec);
 		}
@@ -2798,14 +3414,16 @@ cleanup:
 }
 
 /*
- * forms data connection to replica, updates replica entry
+ * updates replica entry from its handshake ack, its data connections are
+ * then opened by replica_hs_step
  */
 int
 zvol_handshake(spec_t *spec, replica_t *replica)
 {
-	int rc, iofd;
 	zvol_io_hdr_t *ack_hdr;
 	mgmt_ack_t *ack_data;
+	mgmt_event_t *mevent3, *mevent4;
+	int i;
 
 	ack_hdr = replica->mgmt_io_resp_hdr;
 	ack_data = (mgmt_ack_t *)replica->mgmt_io_resp_data;
@@ -2824,15 +3442,135 @@ zvol_handshake(spec_t *spec, replica_t *replica)
 		return -1;
 	}
 
-	if((iofd = cstor_ops.conn_connect(ack_data->ip, ack_data->port)) < 0) {
-		REPLICA_ERRLOG("Failed to open data connection for replica"
-		    "(%s:%d)\n", replica->ip, replica->port);
+	TAILQ_INIT(&replica->waitq);
+	TAILQ_INIT(&replica->blockedq);
+	istgt_twheel_init(&replica->io_wheel, ISTGT_TWHEEL_TICK_MS, replica);
+	replica->io_timed_out = 0;
+	replica->io_notice_ms = 0;
+
+	for (i = 0; i < MAX_LU_REPLICA_DCONNS; i++) {
+		TAILQ_INIT(&replica->dconn[i].readyq);
+		replica->dconn[i].fd = -1;
+		replica->dconn[i].io_state = READ_IO_RESP_HDR;
+		replica->dconn[i].io_read = 0;
+		replica->dconn[i].ongoing_io = NULL;
+		replica->dconn[i].ongoing_io_len = 0;
+		replica->dconn[i].ongoing_io_buf = NULL;
+		replica->dconn[i].cmds_sent = 0;
+	}
+	replica->ndconns = 0;
+	replica->dconn_next = 0;
+	replica->ip = malloc(strlen(ack_data->ip)+1);
+	strcpy(replica->ip, ack_data->ip);
+	replica->quorum = ack_data->quorum;
+	replica->port = ack_data->port;
+	replica->state = ZVOL_STATUS_DEGRADED;
+	replica->initial_checkpointed_io_seq =
+	    MAX_OF(ack_data->checkpointed_io_seq,
+	    ack_data->checkpointed_degraded_io_seq);
+
+	replica->pool_guid = ack_data->pool_guid;
+	replica->zvol_guid = ack_data->zvol_guid;
+	strncpy(replica->replica_id, ack_data->replica_id, REPLICA_ID_LEN);
+
+	if (strlen(replica->replica_id) == 0) {
+		REPLICA_ERRLOG("replicas(ip:%s port:%d "
+		    "guid:%lu) replica_id is empty so not permitted to connect\n",
+		    replica->ip, replica->port,
+		    replica->zvol_guid);
+		return -1;
+	}
+	MTX_LOCK(&spec->rq_mtx);
+	if (!is_replica_newly_connected(spec, replica)) {
+		MTX_UNLOCK(&spec->rq_mtx);
+		REPLICA_ERRLOG("replica(ip:%s port:%d "
+		    "guid:%lu) is not permitted to connect\n", replica->ip, replica->port,
+		    replica->zvol_guid);
 		return -1;
 	}
+	MTX_UNLOCK(&spec->rq_mtx);
+
+	replica->spec = spec;
 
-	rc = update_replica_entry(spec, replica, iofd);
+	REPLICA_LOG("replica(%lu) connected successfully from %s:%d rep: %d\n",
+	    replica->zvol_guid, replica->ip, replica->port,
+	    spec->replication_factor);
 
-	return rc;
+	/* starts replica_hs_step as soon as it is in an epoll set */
+	replica->hs_eventfd = eventfd(1, EFD_NONBLOCK);
+	if (replica->hs_eventfd < 0) {
+		REPLICA_ERRLOG("failed to create hs_eventfd for replica(%lu) "
+		    "err(%d)\n", replica->zvol_guid, errno);
+		return -1;
+	}
+	mevent3 = malloc(sizeof (mgmt_event_t));
+	mevent4 = malloc(sizeof (mgmt_event_t));
+	mevent3->fd = -1;
+	mevent3->r_ptr = replica;
+	mevent4->fd = replica->hs_eventfd;
+	mevent4->r_ptr = replica;
+	replica->m_event3 = mevent3;
+	replica->m_event4 = mevent4;
+	replica->hs_state = REPLICA_HS_START;
+	return 0;
+}
+
+/*
+ * Replicas are accepted on behalf of the first volume.  One that names
+ * another configured volume in its handshake ack is moved over to that
+ * volume, and to its mgmt shard, before the handshake goes on.
+ */
+static void
+rehome_replica(replica_t *replica)
+{
+	zvol_io_hdr_t *ack_hdr = replica->mgmt_io_resp_hdr;
+	mgmt_ack_t *ack_data = (mgmt_ack_t *)replica->mgmt_io_resp_data;
+	spec_t *spec = replica->spec, *nspec;
+
+	if ((ack_hdr->status != ZVOL_OP_STATUS_OK) ||
+	    (ack_hdr->len != sizeof (mgmt_ack_t)) ||
+	    (strcmp(ack_data->volname, spec->volname) == 0))
+		return;
+
+	MTX_LOCK(&specq_mtx);
+	nspec = istgt_nidx_find(&spec_volname_idx, ack_data->volname);
+	MTX_UNLOCK(&specq_mtx);
+	if (nspec == NULL || nspec == spec)
+		return;
+
+	MTX_LOCK(&spec->rq_mtx);
+	TAILQ_REMOVE(&spec->rwaitq, replica, r_waitnext);
+	MTX_UNLOCK(&spec->rq_mtx);
+
+	MTX_LOCK(&nspec->rq_mtx);
+	TAILQ_INSERT_TAIL(&nspec->rwaitq, replica, r_waitnext);
+	replica->spec = nspec;
+	replica->epfd = rmgmt_shard_epfd(nspec);
+	MTX_UNLOCK(&nspec->rq_mtx);
+}
+
+/*
+ * Takes the handshake ack of a replica, on the mgmt shard it came in on.
+ * The rest of the handshake runs from replica_hs_step on the shard of its
+ * volume.  One moved to a volume of another shard is handed over to that
+ * shard by rmgmt_shard_thread once this returns, along with hs_eventfd;
+ * if it failed, its fds are closed from the shard they are still in.
+ */
+static int
+replica_handshake(replica_t *replica)
+{
+	int epfd = replica->epfd;
+	int rc;
+
+	rehome_replica(replica);
+	rc = zvol_handshake(replica->spec, replica);
+	if (rc == 0 && replica->epfd == epfd)
+		rc = replica_hs_arm(replica);
+	if (rc != 0) {
+		replica->epfd = epfd;
+		return (rc);
+	}
+	return (0);
 }
 
 /*
@@ -2840,10 +3578,11 @@ zvol_handshake(spec_t *spec, replica_t *replica)
  * sends handshake IO to start handshake on accepted (mgmt) connection
  */
 void
-accept_mgmt_conns(int epfd, int sfd)
+accept_mgmt_conns(int sfd)
 {
 	struct epoll_event event;
 	int rc, rcount=0;
+	int epfd;
 	spec_t *spec = NULL;
 	int mgmt_fd;
 	mgmt_event_t *mevent1, *mevent2;
@@ -2890,8 +3629,7 @@ accept_mgmt_conns(int epfd, int sfd)
 
                 MTX_LOCK(&specq_mtx);
                 TAILQ_FOREACH(spec, &spec_q, spec_next) {
-			// Since we are supporting single spec per controller
-			// we will continue using first spec only
+			// placeholder until the handshake ack names the volume
                         break;
                 }
                 MTX_UNLOCK(&specq_mtx);
@@ -2904,12 +3642,11 @@ accept_mgmt_conns(int epfd, int sfd)
 		}
 
 		/*
-		 * As of now, we are supporting single spec_t per target
-		 * So, we can assign spec to replica here.
-		 * TODO: In case of multiple spec, asignment of spec to replica
-		 * 	 should be handled in update_replica_entry func according to
-		 * 	 volume name provided by replica.
+		 * The volume of a replica is known only from its handshake
+		 * ack, so it starts out with the first spec and is moved by
+		 * rehome_replica if the ack names another volume.
 		 */
+		epfd = rmgmt_shard_epfd(spec);
 		replica = create_replica_entry(spec, epfd, mgmt_fd);
 		if (!replica) {
 			REPLICA_ERRLOG("Failed to create replica for fd(%d) "
@@ -3099,12 +3836,36 @@ read_io_resp_hdr:
 
 			*read_count = 0;
 
+			/* pushed by a subscribed replica, not a response */
+			if (resp_hdr->opcode == ZVOL_OPCODE_STATUS_NOTIFY ||
+			    resp_hdr->opcode == ZVOL_OPCODE_STATS_NOTIFY) {
+				assert(fd != replica->iofd);
+				if (resp_hdr->opcode == ZVOL_OPCODE_STATUS_NOTIFY)
+					update_replica_status(spec, resp_hdr,
+					    replica);
+				else
+					handle_update_spec_stats(spec, resp_hdr,
+					    *resp_data);
+				free(*resp_data);
+				*resp_data = NULL;
+				*state = READ_IO_RESP_HDR;
+				goto read_io_resp_hdr;
+			}
+			if (mgmt_cmd == NULL) {
+				REPLICA_ERRLOG("unexpected response(%d) on mgmt "
+				    "connection.. for replica(%lu)\n",
+				    resp_hdr->opcode, replica->zvol_guid);
+				free(*resp_data);
+				*resp_data = NULL;
+				return (-1);
+			}
+
 			switch (resp_hdr->opcode) {
 				case ZVOL_OPCODE_HANDSHAKE:
 					/* dont process handshake on data connection */
 					ASSERT(fd != replica->iofd);
 
-					rc = zvol_handshake(spec, replica);
+					rc = replica_handshake(replica);
 
 					memset(resp_hdr, 0, sizeof(zvol_io_hdr_t));
 					free(*resp_data);
@@ -3166,6 +3927,21 @@ read_io_resp_hdr:
 					break;
 
 				default:
+					if (resp_hdr->opcode == ZVOL_OPCODE_PR_UPDATE ||
+					    resp_hdr->opcode == ZVOL_OPCODE_PR_READ) {
+						assert(fd != replica->iofd);
+						handle_pr_resp(replica, mgmt_cmd,
+						    resp_hdr, *resp_data);
+						free(*resp_data);
+						break;
+					}
+					if (resp_hdr->opcode ==
+					    ZVOL_OPCODE_STATUS_SUBSCRIBE) {
+						assert(fd != replica->iofd);
+						handle_status_subscribe_resp(replica,
+						    resp_hdr);
+						break;
+					}
 					REPLICA_ERRLOG("unsupported opcode"
 					    "(%d) received for replica(%lu)\n",
 					    resp_hdr->opcode,
@@ -3177,6 +3953,12 @@ read_io_resp_hdr:
 			donecount++;
 			mgmt_cmd->cmd_completed = 1;
 			*state = READ_IO_RESP_HDR;
+			/*
+			 * Notifications may follow the response, those are read
+			 * by handle_read_data_event once the command is cleared.
+			 */
+			if (replica->push_enabled)
+				return donecount;
 			/*
 			 * Try to read data from replica again if replica is
 			 * sending more or multiple reponses for the same command.
@@ -3266,6 +4048,8 @@ free_replica(replica_t *r)
 	free(r->mgmt_io_resp_hdr);
 	free(r->m_event1);
 	free(r->m_event2);
+	free(r->m_event3);
+	free(r->m_event4);
 
 	if (r->ip)
 		free(r->ip);
@@ -3316,6 +4100,12 @@ empty_mgmt_q_of_replica(replica_t *r)
 					    NULL);
 					break;
 				default:
+					if (mgmt_cmd->io_hdr->opcode ==
+					    ZVOL_OPCODE_PR_UPDATE ||
+					    mgmt_cmd->io_hdr->opcode ==
+					    ZVOL_OPCODE_PR_READ)
+						handle_pr_resp(r, mgmt_cmd,
+						    NULL, NULL);
 					break;
 			}
 			REPLICA_NOTICELOG("mgmt command(%d) failed for "
@@ -3362,6 +4152,10 @@ respond_with_error_for_all_outstanding_mgmt_ios(replica_t *r)
 		    SENT_TO_HEALTHY : SENT_TO_DEGRADED;			\
 		rcmd->rcommq_ptr = rcomm_cmd;				\
 		rcmd->iovcnt = rcomm_cmd->iovcnt;			\
+		rcmd->iov = rcmd->iov_inl;				\
+		if (rcmd->iovcnt > ISTGT_SGL_INLINE)			\
+			rcmd->iov = malloc(sizeof (struct iovec) *	\
+			    (rcmd->iovcnt + 1));			\
 		for (i=1; i < rcomm_cmd->iovcnt + 1; i++) {		\
 			rcmd->iov[i].iov_base = 			\
 			     rcomm_cmd->iov[i].iov_base;		\
@@ -3588,6 +4382,8 @@ again:
 	/* Quiesce write/sync IOs based on flag */
 	if ((cmd_write || cmd_sync) && spec->quiesce == 1) {
 		MTX_UNLOCK(&spec->rq_mtx);
+		if (cmd->expired)
+			return -1;
 		sleep(1);
 		goto again;
 	}
@@ -3696,7 +4492,8 @@ retry_read:
 			    (RECEIVED_OK|RECEIVED_ERR|REPLICATE_TIMED_OUT)) {
 				count++;
 			}
-			else if (diff.tv_sec >= (time_t)io_max_wait_time) {
+			else if (diff.tv_sec >= (time_t)io_max_wait_time ||
+			    cmd->expired) {
 				ASSERT(resp_replica);
 				rcomm_cmd->resp_list[i].status |=
 				    REPLICATE_TIMED_OUT;
@@ -3757,6 +4554,10 @@ retry_read:
 			UPDATE_INFLIGHT_SPEC_IO_CNT(spec, cmd, -1);
 			MTX_UNLOCK(&spec->rq_mtx);
 
+			/* before the initiator can see it, see replicate_sync() */
+			if (rcomm_cmd->opcode == ZVOL_OPCODE_WRITE)
+				__sync_add_and_fetch(&spec->writes_done, 1);
+
 			put_to_mempool(&spec->rcommon_deadlist, rcomm_cmd);
 			break;
 		}
@@ -3786,6 +4587,53 @@ wait_for_other_responses:
 	return rc;
 }
 
+/*
+ * Group commit for SYNCHRONIZE CACHE.  A flush has to cover the writes that
+ * had completed when it arrived, and a sync covers every write that had
+ * completed before it was sent to the replicas; spec->writes_done orders
+ * the two.  A flush arriving while a sync is in flight waits for that sync
+ * if it already covers it, otherwise for the next one, which is sent by
+ * whichever waiter gets there first once the current one is acked.
+ */
+int64_t
+replicate_sync(ISTGT_LU_DISK *spec, ISTGT_LU_CMD_Ptr cmd, uint64_t offset,
+    uint64_t nbytes)
+{
+	uint64_t arrived, gen;
+	bool covered;
+	int64_t rc;
+
+	MTX_LOCK(&spec->gs_mutex);
+	arrived = __sync_add_and_fetch(&spec->writes_done, 0);
+	while (spec->gs_inflight) {
+		gen = spec->gs_gen;
+		covered = (spec->gs_covered >= arrived);
+		while (spec->gs_gen == gen)
+			pthread_cond_wait(&spec->gs_cond, &spec->gs_mutex);
+		if (covered) {
+			rc = spec->gs_rc;
+			spec->gs_merged++;
+			MTX_UNLOCK(&spec->gs_mutex);
+			return (rc);
+		}
+	}
+	spec->gs_inflight = true;
+	spec->gs_covered = __sync_add_and_fetch(&spec->writes_done, 0);
+	MTX_UNLOCK(&spec->gs_mutex);
+
+	/* the replicas flush the whole volume whatever the range */
+	rc = replicate(spec, cmd, offset, nbytes);
+
+	MTX_LOCK(&spec->gs_mutex);
+	spec->gs_inflight = false;
+	spec->gs_rc = rc;
+	spec->gs_gen++;
+	spec->gs_syncs++;
+	pthread_cond_broadcast(&spec->gs_cond);
+	MTX_UNLOCK(&spec->gs_mutex);
+	return (rc);
+}
+
 /*
  * This function handles error in replica's management interface
  * and inform replica_thread(data connection) regarding error
@@ -3800,6 +4648,17 @@ handle_mgmt_conn_error(replica_t *r, int sfd, struct epoll_event *events, int ev
 	replica_t *r_ev;
 	known_replica_t *kr = NULL;
 
+	/*
+	 * replica_thread is starting on its data connections, it is torn
+	 * down along with them by update_replica_entry once it is up.
+	 */
+	if (r->hs_state == REPLICA_HS_THREAD) {
+		r->hs_conn_error = 1;
+		return;
+	}
+	if (r->hs_state != REPLICA_HS_NONE)
+		replica_hs_abort(r);
+
 	MTX_LOCK(&r->spec->rq_mtx);
 	MTX_LOCK(&r->r_mtx);
 
@@ -3816,10 +4675,6 @@ handle_mgmt_conn_error(replica_t *r, int sfd, struct epoll_event *events, int ev
 				if (r_ev == r) {
 					TAILQ_REMOVE(&r->spec->rwaitq, r, r_waitnext);
 					r->conn_closed++;
-					if (r->io_resp_hdr) {
-						free(r->io_resp_hdr);
-						r->io_resp_hdr = NULL;
-					}
 				}
 			}
 		}
@@ -3872,7 +4727,9 @@ handle_mgmt_conn_error(replica_t *r, int sfd, struct epoll_event *events, int ev
 				continue;
 
 			if (mevent->fd == mgmt_eventfd1 ||
-				mevent->fd == mgmtfd) {
+				mevent->fd == mgmtfd ||
+				mevent == r->m_event3 ||
+				mevent == r->m_event4) {
 				events[i].data.ptr = NULL;
 			} else
 				REPLICA_ERRLOG("unexpected fd(%d) for "
@@ -3937,48 +4794,416 @@ handle_read_data_event(replica_t *replica)
 	mgmt_cmd_t *mgmt_cmd;
 	int rc = 0;
 
-	MTX_LOCK(&replica->r_mtx);
-	mgmt_cmd = TAILQ_FIRST(&replica->mgmt_cmd_queue);
-	if (!(mgmt_cmd != NULL &&
-		(mgmt_cmd->mgmt_cmd_state == READ_IO_RESP_HDR ||
-		mgmt_cmd->mgmt_cmd_state == READ_IO_RESP_DATA))) {
+	revent.fd = replica->mgmt_fd;
+	revent.state = &(replica->mgmt_read_state);
+	revent.io_hdr = replica->mgmt_io_resp_hdr;
+	revent.io_data = (void **)(&(replica->mgmt_io_resp_data));
+	revent.byte_count = &(replica->mgmt_read_bytes);
+
+	while (1) {
+		MTX_LOCK(&replica->r_mtx);
+		mgmt_cmd = TAILQ_FIRST(&replica->mgmt_cmd_queue);
+		if (mgmt_cmd != NULL &&
+		    mgmt_cmd->mgmt_cmd_state != READ_IO_RESP_HDR &&
+		    mgmt_cmd->mgmt_cmd_state != READ_IO_RESP_DATA)
+			mgmt_cmd = NULL;
 		MTX_UNLOCK(&replica->r_mtx);
+
 		/*
 		 * Though we didn't send any IO query on management connection,
 		 * We have a read event on management connection. Thats an
-		 * error as management connection is not working in stateful
-		 * manner. So we will print error message and does cleanup
+		 * error unless the replica pushes its status. So we will print
+		 * error message and does cleanup
 		 */
-		REPLICA_ERRLOG("unexpected read IO on mgmt connection.. for "
-		    "replica(%lu)\n", replica->zvol_guid);
-		return (-1);
-	}
-
-	MTX_UNLOCK(&replica->r_mtx);
-
-	revent.fd = replica->mgmt_fd;
-	revent.state = &(mgmt_cmd->mgmt_cmd_state);
-	revent.io_hdr = replica->mgmt_io_resp_hdr;
-	revent.io_data = (void **)(&(replica->mgmt_io_resp_data));
-	revent.byte_count = &(mgmt_cmd->io_bytes);
+		if (mgmt_cmd == NULL && !replica->push_enabled) {
+			REPLICA_ERRLOG("unexpected read IO on mgmt connection.. "
+			    "for replica(%lu)\n", replica->zvol_guid);
+			return (-1);
+		}
 
-	rc = read_io_resp(replica->spec, replica, &revent, mgmt_cmd);
-	if (rc > 0) {
+		rc = read_io_resp(replica->spec, replica, &revent, mgmt_cmd);
+		if (rc <= 0)
+			break;
 		VERIFY3S(rc, ==, 1);
 		MTX_LOCK(&replica->r_mtx);
 		clear_mgmt_cmd(replica, mgmt_cmd);
 		MTX_UNLOCK(&replica->r_mtx);
 		rc = handle_write_data_event(replica);
+		if (rc == -1 || !replica->push_enabled)
+			break;
 	}
 	return (rc);
 }
 
 int replica_poll_time = 10;
 
+/*
+ * Management connections of replicas are served by a pool of shard
+ * threads instead of the listener.  Every spec is homed on one shard at
+ * initialize_volume, and so are the management connections of its
+ * replicas, so a slow handshake or a burst of reconnects on one volume
+ * only holds up the volumes of its own shard.  Each shard owns a timer
+ * wheel with one status/stats poll timer per spec, first armed at a
+ * random point within replica_poll_time so that polls of many volumes
+ * are spread out instead of all going out at once.
+ */
+typedef struct rmgmt_shard_s {
+	int id;
+	int epfd;
+	pthread_t thread;
+	/* wakes epoll_wait for timers armed from other threads */
+	int wake_fd;
+	/* protects poll_wheel and nspecs */
+	pthread_mutex_t mtx;
+	ISTGT_TWHEEL poll_wheel;
+	int nspecs;
+} rmgmt_shard_t;
+
+#define	REPLICA_MGMT_SHARDS_DEFAULT	4
+#define	REPLICA_MGMT_SHARDS_MAX		64
+/* every replica of every volume may reconnect at once after a restart */
+#define	REPLICA_MGMT_BACKLOG		1024
+
+int replica_mgmt_shards = REPLICA_MGMT_SHARDS_DEFAULT;
+static rmgmt_shard_t *rmgmt_shards;
+static uint32_t rmgmt_next_shard;
+
+static void
+spec_poll_timer_expired(void *owner, ISTGT_TIMER *t)
+{
+	rmgmt_shard_t *shard = (rmgmt_shard_t *)owner;
+	spec_t *spec = (spec_t *)t->arg;
+	uint64_t poll_ms = (uint64_t)replica_poll_time * 1000;
+	uint64_t now = istgt_twheel_now_ms(), next;
+	uint64_t one = 1;
+	replica_t *replica;
+
+	send_replica_opcode(spec, ZVOL_OPCODE_REPLICA_STATUS);
+	send_replica_opcode(spec, ZVOL_OPCODE_STATS);
+
+	/* handshakes past their deadline, dropped by replica_hs_step */
+	MTX_LOCK(&spec->rq_mtx);
+	TAILQ_FOREACH(replica, &spec->rwaitq, r_waitnext) {
+		if ((replica->hs_state == REPLICA_HS_CONNECT ||
+		    replica->hs_state == REPLICA_HS_OPEN) &&
+		    replica->hs_eventfd != -1 &&
+		    now >= replica->hs_deadline_ms &&
+		    write(replica->hs_eventfd, &one, sizeof (one)) !=
+		    sizeof (one))
+			REPLICA_ERRLOG("failed to kick handshake of "
+			    "replica(%lu)\n", replica->zvol_guid);
+	}
+	MTX_UNLOCK(&spec->rq_mtx);
+
+	/*
+	 * Rebuilds are otherwise triggered on status responses, which
+	 * replicas that push their status only send on transitions.
+	 */
+	if (spec->replica_status_push) {
+		MTX_LOCK(&spec->rq_mtx);
+		if (spec->ready && (spec->degraded_rcount > 0 ||
+		    !TAILQ_EMPTY(&spec->non_quorum_rq)))
+			trigger_rebuild(spec);
+		MTX_UNLOCK(&spec->rq_mtx);
+	}
+
+	/*
+	 * Keep the phase picked in rmgmt_shard_add_spec, re-arming from now
+	 * would line up every spec that expired during a stall of the shard.
+	 */
+	if (poll_ms == 0)
+		poll_ms = shard->poll_wheel.tick_ms;
+	next = t->expires * shard->poll_wheel.tick_ms + poll_ms;
+	if (next <= now)
+		next += ((now - next) / poll_ms + 1) * poll_ms;
+	istgt_twheel_arm(&shard->poll_wheel, t, next, spec_poll_timer_expired,
+	    spec);
+}
+
+/*
+ * Homes spec on the next shard and arms its poll timer.
+ */
+static void
+rmgmt_shard_add_spec(spec_t *spec)
+{
+	rmgmt_shard_t *shard;
+	uint64_t poll_ms = (uint64_t)replica_poll_time * 1000;
+
+	spec->mgmt_shard = __sync_fetch_and_add(&rmgmt_next_shard, 1) %
+	    replica_mgmt_shards;
+	shard = &rmgmt_shards[spec->mgmt_shard];
+
+	memset(&spec->poll_timer, 0, sizeof (spec->poll_timer));
+	memset(&spec->pr_retry_timer, 0, sizeof (spec->pr_retry_timer));
+	MTX_LOCK(&shard->mtx);
+	istgt_twheel_arm(&shard->poll_wheel, &spec->poll_timer,
+	    istgt_twheel_now_ms() + (poll_ms ? random() % poll_ms : 0) + 1,
+	    spec_poll_timer_expired, spec);
+	shard->nspecs++;
+	MTX_UNLOCK(&shard->mtx);
+}
+
+static void
+rmgmt_shard_remove_spec(spec_t *spec)
+{
+	rmgmt_shard_t *shard = &rmgmt_shards[spec->mgmt_shard];
+
+	MTX_LOCK(&shard->mtx);
+	istgt_twheel_cancel(&shard->poll_wheel, &spec->poll_timer);
+	istgt_twheel_cancel(&shard->poll_wheel, &spec->pr_retry_timer);
+	shard->nspecs--;
+	MTX_UNLOCK(&shard->mtx);
+}
+
+static void
+spec_pr_retry_expired(void *owner __attribute__((__unused__)),
+    ISTGT_TIMER *t)
+{
+	spec_t *spec = (spec_t *)t->arg;
+
+	MTX_LOCK(&spec->rq_mtx);
+	spec->pr_reading = 0;
+	update_volstate(spec);
+	MTX_UNLOCK(&spec->rq_mtx);
+}
+
+/*
+ * Has the shard of spec re-run update_volstate after delay_ms, for a
+ * read back of its reservations that too few replicas answered.
+ */
+static void
+rmgmt_shard_pr_retry(spec_t *spec, uint64_t delay_ms)
+{
+	rmgmt_shard_t *shard = &rmgmt_shards[spec->mgmt_shard];
+	uint64_t one = 1;
+
+	MTX_LOCK(&shard->mtx);
+	istgt_twheel_arm(&shard->poll_wheel, &spec->pr_retry_timer,
+	    istgt_twheel_now_ms() + delay_ms, spec_pr_retry_expired, spec);
+	MTX_UNLOCK(&shard->mtx);
+	/* it may be sleeping until the next poll */
+	if (write(shard->wake_fd, &one, sizeof (one)) != sizeof (one))
+		REPLICA_ERRLOG("failed to wake mgmt shard(%d) err(%d)\n",
+		    shard->id, errno);
+}
+
+static int
+rmgmt_shard_epfd(spec_t *spec)
+{
+	return (rmgmt_shards[spec->mgmt_shard].epfd);
+}
+
+/*
+ * Moves the mgmt fds of a replica that its handshake ack rehomed over to
+ * the shard of its new volume.  Its events left in this shard's batch are
+ * dropped, the new shard gets them reported again.
+ */
+static void
+rmgmt_shard_hand_over(rmgmt_shard_t *shard, replica_t *r,
+    struct epoll_event *events, int ev_count)
+{
+	struct epoll_event event;
+	mgmt_event_t *mevent;
+	int i;
+
+	for (i = 0; i < ev_count; i++) {
+		if (events[i].data.ptr == NULL)
+			continue;
+		mevent = events[i].data.ptr;
+		if (mevent->r_ptr == r)
+			events[i].data.ptr = NULL;
+	}
+
+	(void) epoll_ctl(shard->epfd, EPOLL_CTL_DEL, r->mgmt_eventfd1, NULL);
+	(void) epoll_ctl(shard->epfd, EPOLL_CTL_DEL, r->mgmt_fd, NULL);
+
+	event.data.ptr = r->m_event1;
+	event.events = EPOLLIN;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->mgmt_eventfd1, &event) == -1)
+		REPLICA_ERRLOG("epoll_ctl() failed on mgmt_eventfd(%d) err(%d) "
+		    "for replica(%s:%d)\n", r->mgmt_eventfd1, errno, r->ip,
+		    r->port);
+	event.data.ptr = r->m_event2;
+	event.events = EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLET | EPOLLOUT |
+	    EPOLLRDHUP;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->mgmt_fd, &event) == -1)
+		REPLICA_ERRLOG("epoll_ctl() failed on mgmt_fd(%d) err(%d) "
+		    "for replica(%s:%d)\n", r->mgmt_fd, errno, r->ip, r->port);
+
+	/* the new shard goes on with the handshake from here */
+	if (r->hs_state == REPLICA_HS_START)
+		(void) replica_hs_arm(r);
+}
+
+/*
+ * Serves management connections of replicas of the specs homed on the
+ * shard, and polls those specs as their timers expire.
+ */
+static void *
+rmgmt_shard_thread(void *arg)
+{
+	rmgmt_shard_t *shard = (rmgmt_shard_t *)arg;
+	struct epoll_event *events;
+	int rc, event_count, i;
+	int timeout, max_timeout;
+	replica_t *r;
+	mgmt_event_t *mevent;
+	uint64_t wake;
+
+	snprintf(tinfo, sizeof tinfo, "rm#%d.%d", shard->id, getpid());
+	prctl(PR_SET_NAME, "replica_mgmt", 0, 0, 0);
+
+	events = calloc(MAXEVENTS, sizeof (struct epoll_event));
+	max_timeout = replica_poll_time * 1000;
+
+	while (1) {
+		MTX_LOCK(&shard->mtx);
+		timeout = istgt_twheel_timeout(&shard->poll_wheel,
+		    istgt_twheel_now_ms());
+		MTX_UNLOCK(&shard->mtx);
+		if (timeout < 0 || timeout > max_timeout)
+			timeout = max_timeout;
+
+		event_count = epoll_wait(shard->epfd, events, MAXEVENTS,
+		    timeout);
+		if (event_count < 0) {
+			if (errno == EINTR)
+				continue;
+			REPLICA_ERRLOG("epoll_wait ret(%d) err(%d) on mgmt "
+			    "shard(%d)\n", event_count, errno, shard->id);
+			continue;
+		}
+
+		for (i = 0; i < event_count; i++) {
+			if (events[i].data.ptr == NULL)
+				continue;
+			if (events[i].data.ptr == shard) {
+				(void) read(shard->wake_fd, &wake, sizeof (wake));
+				continue;
+			}
+			mevent = events[i].data.ptr;
+			ASSERT(mevent->r_ptr);
+			r = mevent->r_ptr;
+
+			if (mevent == r->m_event3 || mevent == r->m_event4) {
+				if (replica_hs_step(r, mevent,
+				    events[i].events) == -1)
+					handle_mgmt_conn_error(r, -1, events,
+					    event_count);
+				continue;
+			}
+
+			if (events[i].events & EPOLLHUP ||
+			    events[i].events & EPOLLERR ||
+			    events[i].events & EPOLLRDHUP) {
+				REPLICA_ERRLOG("epoll event(%d) on "
+				    "replica(%s:%d)\n",
+				    events[i].events, r->ip, r->port);
+				handle_mgmt_conn_error(r, -1, events,
+				    event_count);
+				continue;
+			}
+
+			rc = 0;
+			if (events[i].events & EPOLLIN) {
+				if (mevent->fd == r->mgmt_fd)
+					rc = handle_read_data_event(r);
+				else
+					rc = handle_mgmt_event_fd(r);
+			}
+
+			/* rehomed by its handshake, see replica_handshake */
+			if ((rc != -1) && (r->epfd != shard->epfd)) {
+				rmgmt_shard_hand_over(shard, r, events,
+				    event_count);
+				continue;
+			}
+
+			if ((rc != -1) && (events[i].events & EPOLLOUT)) {
+				ASSERT(mevent->fd == r->mgmt_fd);
+				rc = handle_write_data_event(r);
+			}
+			if (rc == -1)
+				handle_mgmt_conn_error(r, -1, events,
+				    event_count);
+		}
+
+		MTX_LOCK(&shard->mtx);
+		istgt_twheel_advance(&shard->poll_wheel,
+		    istgt_twheel_now_ms());
+		MTX_UNLOCK(&shard->mtx);
+	}
+
+	free(events);
+	return (NULL);
+}
+
+/*
+ * Creates the management shards, ReplicaMgmtThreads of them when set.
+ * Returns 0 on success.
+ */
+static int
+start_rmgmt_shards(void)
+{
+	const char *val = getenv("ReplicaMgmtThreads");
+	rmgmt_shard_t *shard;
+	struct epoll_event event;
+	int i, rc;
+
+	if (val != NULL)
+		replica_mgmt_shards = (int)strtol(val, NULL, 10);
+	if (replica_mgmt_shards < 1)
+		replica_mgmt_shards = 1;
+	if (replica_mgmt_shards > REPLICA_MGMT_SHARDS_MAX)
+		replica_mgmt_shards = REPLICA_MGMT_SHARDS_MAX;
+
+	rmgmt_shards = calloc(replica_mgmt_shards, sizeof (rmgmt_shard_t));
+	if (rmgmt_shards == NULL)
+		return (-1);
+
+	for (i = 0; i < replica_mgmt_shards; i++) {
+		shard = &rmgmt_shards[i];
+		shard->id = i;
+		istgt_twheel_init(&shard->poll_wheel, ISTGT_TWHEEL_TICK_MS,
+		    shard);
+		rc = pthread_mutex_init(&shard->mtx, NULL);
+		if (rc != 0) {
+			REPLICA_ERRLOG("Failed to init mgmt shard(%d) mtx "
+			    "err(%d)\n", i, rc);
+			return (-1);
+		}
+		shard->epfd = epoll_create1(0);
+		if (shard->epfd < 0) {
+			REPLICA_ERRLOG("epoll_create1() failed for mgmt "
+			    "shard(%d) err(%d)\n", i, errno);
+			return (-1);
+		}
+		shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+		event.data.ptr = shard;
+		event.events = EPOLLIN;
+		if (shard->wake_fd < 0 || epoll_ctl(shard->epfd, EPOLL_CTL_ADD,
+		    shard->wake_fd, &event) == -1) {
+			REPLICA_ERRLOG("failed to set up wake fd of mgmt "
+			    "shard(%d) err(%d)\n", i, errno);
+			return (-1);
+		}
+		rc = pthread_create(&shard->thread, NULL, &rmgmt_shard_thread,
+		    shard);
+		if (rc != 0) {
+			REPLICA_ERRLOG("pthread_create(mgmt shard %d) failed "
+			    "err(%d)\n", i, rc);
+			return (-1);
+		}
+	}
+	REPLICA_LOG("started %d replica management shard(s)\n",
+	    replica_mgmt_shards);
+	return (0);
+}
+
 /*
  * initializes replication
  * - by starting listener to accept mgmt connections
- * - reads data on accepted mgmt connection
+ * - accepted connections are handed to the mgmt shard of their spec
  */
 void *
 init_replication(void *arg __attribute__((__unused__)))
@@ -3986,10 +5211,6 @@ init_replication(void *arg __attribute__((__unused__)))
 	struct epoll_event event, *events;
 	int rc, sfd, event_count, i;
 	int epfd;
-	replica_t *r;
-	int timeout;
-	struct timespec last, now, diff;
-	mgmt_event_t *mevent;
 	pthread_t self = pthread_self();
 
 	snprintf(tinfo, sizeof tinfo, "rm#%d.%d", (int)(((uint64_t *)self)[0]), getpid());
@@ -3998,7 +5219,8 @@ init_replication(void *arg __attribute__((__unused__)))
 	const char* externalIP = getenv("externalIP");
 	ASSERT(externalIP);
 
-	if((sfd = cstor_ops.conn_listen(externalIP, 6060, 32, 1)) < 0) {
+	if((sfd = cstor_ops.conn_listen(externalIP, 6060,
+	    REPLICA_MGMT_BACKLOG, 1)) < 0) {
 		REPLICA_LOG("conn_listen() failed, sfd(%d)", sfd);
 		exit(EXIT_FAILURE);
 	}
@@ -4013,8 +5235,6 @@ init_replication(void *arg __attribute__((__unused__)))
 	}
 
 	events = calloc(MAXEVENTS, sizeof(event));
-	timeout = replica_poll_time * 1000;
-	clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
 
 #ifdef	DEBUG
 	/*
@@ -4038,8 +5258,8 @@ init_replication(void *arg __attribute__((__unused__)))
 	replication_initialized = 1;
 
 	while (1) {
-		//Wait for management connections(on sfd) and management commands(on mgmt_rfds[]) from replicas
-		event_count = epoll_wait(epfd, events, MAXEVENTS, timeout);
+		//Wait for management connections(on sfd) from replicas
+		event_count = epoll_wait(epfd, events, MAXEVENTS, -1);
 		if (event_count < 0) {
 			if (errno == EINTR)
 				continue;
@@ -4051,70 +5271,19 @@ init_replication(void *arg __attribute__((__unused__)))
 		for(i=0; i< event_count; i++) {
 			if (events[i].events & EPOLLHUP || events[i].events & EPOLLERR ||
 				events[i].events & EPOLLRDHUP) {
-				if (events[i].data.fd == sfd) {
-					REPLICA_ERRLOG("epoll event(%d) on "
-					    "fd(%d)... better to restart "
-					    "listener\n",
-					    events[i].events,
-					    events[i].data.fd);
-					/*
-					 * Here, we can exit without performing
-					 * cleanup for all replica
-					 */
-					exit(EXIT_FAILURE);
-				} else {
-					if (events[i].data.ptr == NULL)
-						continue;
-					mevent = events[i].data.ptr;
-					ASSERT(mevent->r_ptr);
-					r = mevent->r_ptr;
-					REPLICA_ERRLOG("epoll event(%d) on "
-					    "replica(%s:%d)\n",
-					    events[i].events, r->ip, r->port);
-					handle_mgmt_conn_error(r, sfd, events, event_count);
-				}
-			} else {
-				if (events[i].data.fd == sfd) {
-					//Accept management connections from replicas and add the replicas to replica queue
-					accept_mgmt_conns(epfd, sfd);
-				} else {
-					if (events[i].data.ptr == NULL)
-						continue;
-
-					mevent = events[i].data.ptr;
-					ASSERT(mevent->r_ptr);
-					r = mevent->r_ptr;
-
-					rc = 0;
-					if (events[i].events & EPOLLIN) {
-						if (mevent->fd == r->mgmt_fd)
-							rc = handle_read_data_event(r);
-						else
-							rc = handle_mgmt_event_fd(r);
-					}
-
-					if ((rc != -1) &&
-					    (events[i].events & EPOLLOUT)) {
-						ASSERT(mevent->fd == r->mgmt_fd);
-						rc = handle_write_data_event(r);
-					}
-					if (rc == -1)
-						handle_mgmt_conn_error(r, sfd, events, event_count);
-				}
-			}
-		}
-
-		// send replica_status query to degraded replicas at max interval of '2*replica_poll_time' seconds
-		timesdiff(CLOCK_MONOTONIC_COARSE, last, now, diff);
-		if (diff.tv_sec >= replica_poll_time) {
-			spec_t *spec = NULL;
-			MTX_LOCK(&specq_mtx);
-			TAILQ_FOREACH(spec, &spec_q, spec_next) {
-				send_replica_opcode(spec, ZVOL_OPCODE_REPLICA_STATUS);
-				send_replica_opcode(spec, ZVOL_OPCODE_STATS);
+				REPLICA_ERRLOG("epoll event(%d) on "
+				    "fd(%d)... better to restart "
+				    "listener\n",
+				    events[i].events,
+				    events[i].data.fd);
+				/*
+				 * Here, we can exit without performing
+				 * cleanup for all replica
+				 */
+				exit(EXIT_FAILURE);
 			}
-			MTX_UNLOCK(&specq_mtx);
-			clock_gettime(CLOCK_MONOTONIC_COARSE, &last);
+			//Accept management connections from replicas and add the replicas to replica queue
+			accept_mgmt_conns(sfd);
 		}
 	}
 
@@ -4138,13 +5307,23 @@ initialize_replication()
 		REPLICA_ERRLOG("Failed to init specq_mtx err(%d)\n", rc);
 		return -1;
 	}
+	if (istgt_nidx_init(&spec_volname_idx, MAX_LOGICAL_UNIT) != 0) {
+		REPLICA_ERRLOG("Failed to init volume name index\n");
+		return -1;
+	}
 	clock_gettime(CLOCK_MONOTONIC_COARSE, &istgt_start_time);
+	if (start_rmgmt_shards() != 0) {
+		REPLICA_ERRLOG("Failed to start replica management shards\n");
+		return -1;
+	}
 	return 0;
 }
 
 void
 destroy_volume(spec_t *spec)
 {
+	int pr_joinable;
+
 	ASSERT0(get_num_entries_from_mempool(&spec->rcommon_deadlist));
 	destroy_mempool(&spec->rcommon_deadlist);
 
@@ -4152,13 +5331,33 @@ destroy_volume(spec_t *spec)
 	ASSERT(TAILQ_EMPTY(&spec->rq));
 	ASSERT(TAILQ_EMPTY(&spec->rwaitq));
 
-	pthread_mutex_destroy(&spec->rcommonq_mtx);
-	pthread_mutex_destroy(&spec->rq_mtx);
+	/*
+	 * The restore thread uses rq_mtx, pr_blob and the LU up to its end.
+	 * rq is empty, so no retry can start another one after this.
+	 */
+	MTX_LOCK(&spec->rq_mtx);
+	pr_joinable = spec->pr_thread_valid;
+	spec->pr_thread_valid = 0;
+	MTX_UNLOCK(&spec->rq_mtx);
+	if (pr_joinable)
+		(void) pthread_join(spec->pr_thread, NULL);
+
+	/*
+	 * No poll of its shard and no replica rehomed onto it may take its
+	 * locks any more once they are gone.
+	 */
+	rmgmt_shard_remove_spec(spec);
 
 	MTX_LOCK(&specq_mtx);
 	TAILQ_REMOVE(&spec_q, spec, spec_next);
+	(void) istgt_nidx_del(&spec_volname_idx, spec->volname, spec);
 	MTX_UNLOCK(&specq_mtx);
 
+	pthread_mutex_destroy(&spec->rcommonq_mtx);
+	pthread_mutex_destroy(&spec->rq_mtx);
+	free(spec->pr_blob);
+	spec->pr_blob = NULL;
+
 	return;
 }
 
@@ -4191,6 +5390,16 @@ initialize_volume(spec_t *spec, int replication_factor, int consistency_factor,
 	spec->rebuild_info.dw_replica = NULL;
 	spec->rebuild_info.healthy_replica = NULL;
 	spec->scalingup_replica = NULL;
+	spec->scaleup_fence_io_seq = 0;
+	spec->pr_seq = 0;
+	spec->pr_blob = NULL;
+	spec->pr_blob_len = 0;
+	spec->pr_restored = 0;
+	spec->pr_reading = 0;
+	spec->pr_thread_valid = 0;
+	spec->pr_restore_start.tv_sec = 0;
+	spec->pr_restore_start.tv_nsec = 0;
+	spec->pr_apply = NULL;
 
 	rc = pthread_mutex_init(&spec->rcommonq_mtx, NULL);
 	if (rc != 0) {
@@ -4204,6 +5413,18 @@ initialize_volume(spec_t *spec, int replication_factor, int consistency_factor,
 		return -1;
 	}
 
+	spec->writes_done = 0;
+	spec->gs_inflight = false;
+	spec->gs_covered = 0;
+	spec->gs_gen = 0;
+	spec->gs_syncs = 0;
+	spec->gs_merged = 0;
+	if (pthread_mutex_init(&spec->gs_mutex, NULL) != 0 ||
+	    pthread_cond_init(&spec->gs_cond, NULL) != 0) {
+		REPLICA_ERRLOG("Failed to init gs_mutex err(%d)\n", errno);
+		return -1;
+	}
+
 	rc = pthread_create(&deadlist_cleanup_thread, NULL, &cleanup_deadlist,
 			(void *)spec);
 	if (rc != 0) {
@@ -4214,8 +5435,12 @@ initialize_volume(spec_t *spec, int replication_factor, int consistency_factor,
 
 	MTX_LOCK(&specq_mtx);
 	TAILQ_INSERT_TAIL(&spec_q, spec, spec_next);
+	if (istgt_nidx_add(&spec_volname_idx, spec->volname, spec) != 0)
+		REPLICA_ERRLOG("Failed to index volume(%s)\n", spec->volname);
 	MTX_UNLOCK(&specq_mtx);
 
+	rmgmt_shard_add_spec(spec);
+
 	return 0;
 }
 
@@ -4324,6 +5549,7 @@ cleanup_deadlist(void *arg)
 				for (i=1; i<rcomm_cmd->iovcnt + 1; i++)
 					xfree(rcomm_cmd->iov[i].iov_base);
 
+				RCMD_IOV_FREE(rcomm_cmd);
 				free(rcomm_cmd);
 			} else {
 				put_to_mempool(&spec->rcommon_deadlist, rcomm_cmd);
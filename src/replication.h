@@ -54,6 +54,42 @@
 
 #define CONSISTENCY_FACTOR(a) (((a)/2) + 1)
 
+/*
+ * Persistent reservations kept on the replicas, with ReplicaPersistPR.
+ * These opcodes belong in zrepl_prot.h, which comes with libcstor; they
+ * are here until it has them, with the same values.  A replica that
+ * doesn't know them answers with a failed status or not at all.  Both
+ * carry zvol_op_pr_data_t, PR_UPDATE followed by len bytes of reservation
+ * data, which PR_READ returns for the highest pr_seq stored.
+ */
+#define	ZVOL_OPCODE_PR_UPDATE	((zvol_op_code_t)0xf0)
+#define	ZVOL_OPCODE_PR_READ	((zvol_op_code_t)0xf1)
+#define	ZVOL_PR_DATA_MAX	(64 * 1024)
+
+typedef struct zvol_op_pr_data {
+	char		volname[MAX_NAME_LEN];
+	uint64_t	pr_seq;
+	uint64_t	len;
+} __attribute__((packed)) zvol_op_pr_data_t;
+
+/*
+ * Replica status push, not in zrepl_prot.h either.  STATUS_SUBSCRIBE
+ * carries zvol_op_subscribe_data_t; a replica that accepts it sends
+ * STATUS_NOTIFY (zrepl_status_ack_t) on every status transition, and
+ * STATS_NOTIFY (zvol_op_stat_t) when its stats changed, at most once per
+ * stats_interval seconds.  Both are sent unsolicited on the management
+ * connection, with io_seq 0.  A replica that fails STATUS_SUBSCRIBE is
+ * polled as before.
+ */
+#define	ZVOL_OPCODE_STATUS_SUBSCRIBE	((zvol_op_code_t)0xf2)
+#define	ZVOL_OPCODE_STATUS_NOTIFY	((zvol_op_code_t)0xf3)
+#define	ZVOL_OPCODE_STATS_NOTIFY	((zvol_op_code_t)0xf4)
+
+typedef struct zvol_op_subscribe_data {
+	char		volname[MAX_NAME_LEN];
+	uint32_t	stats_interval;
+} __attribute__((packed)) zvol_op_subscribe_data_t;
+
 typedef enum zvol_cmd_type_e {
 	CMD_IO = 1,
 	CND_MGMT,
@@ -118,7 +154,9 @@ typedef struct rcommon_cmd_s {
 	/* array of response received from replica */
 	replica_rcomm_resp_t resp_list[MAXREPLICA];
 	int64_t iovcnt;
-	struct iovec iov[41];
+	/* iov[0] is left for the header, iov_inl or heap if larger */
+	struct iovec *iov;
+	struct iovec iov_inl[ISTGT_SGL_INLINE + 1];
 } rcommon_cmd_t;
 
 typedef struct rcmd_s {
@@ -131,11 +169,21 @@ typedef struct rcmd_s {
 	int64_t iovcnt;
 	uint64_t offset;
 	uint64_t data_len;
-	struct iovec iov[41];
+	struct iovec *iov;	/* iov_inl or heap, see RCMD_IOV_FREE */
+	struct iovec iov_inl[ISTGT_SGL_INLINE + 1];
 	struct timespec start_time;
 	struct timespec ready_time;
+	/* on replica's io_wheel while the replica owns the IO */
+	ISTGT_TIMER deadline;
 } rcmd_t;
 
+#define	RCMD_IOV_FREE(c)						\
+	do {								\
+		if ((c)->iov != (c)->iov_inl)				\
+			free((c)->iov);					\
+		(c)->iov = NULL;					\
+	} while (0)
+
 typedef struct replica_s replica_t;
 
 typedef struct istgt_lu_disk_t spec_t;
@@ -202,7 +250,7 @@ void *init_replication(void *);
 int make_socket_non_blocking(int);
 int send_mgmtack(int, zvol_op_code_t, void *, char *, int);
 int zvol_handshake(spec_t *, replica_t *);
-void accept_mgmt_conns(int, int);
+void accept_mgmt_conns(int);
 void clear_rcomm_cmd(rcommon_cmd_t *);
 void ask_replica_status(spec_t *spec, replica_t *replica);
 extern void * replica_thread(void *);
@@ -213,6 +261,8 @@ int64_t perform_read_write_on_fd(int fd, uint8_t *data, uint64_t len,
 int initialize_volume(spec_t *spec, int, int, int);
 void destroy_volume(spec_t *spec);
 void inform_mgmt_conn(replica_t *r);
+int istgt_lu_pr_persist(spec_t *spec, void *buf, uint64_t len);
+uint64_t istgt_lu_pr_fetch(spec_t *spec, void *buf, uint64_t len);
 extern const char * get_cv_status(spec_t *spec);
 extern void get_replica_stats_json(replica_t *replica, struct json_object **jobj);
 
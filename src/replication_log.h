@@ -17,8 +17,7 @@
 #ifndef	REPLICATION_LOG_H
 #define	REPLICATION_LOG_H
 
-#include <sys/time.h>
-#include <time.h>
+#include "istgt_alog.h"
 
 enum replication_log_level {
 	LOG_LEVEL_ERR,
@@ -31,26 +30,12 @@ int replication_log_level;
 
 #define	repl_log(lvl, fmt, ...)						\
 do {									\
-	struct timeval _tv;						\
-	struct tm *_tinfo;						\
-	unsigned int _ms;						\
-	char _l[512];							\
-	int _off = 0;							\
+	static istgt_log_site_t _site;					\
 									\
 	if (replication_log_level < lvl)				\
 		break;							\
 									\
-	/* Create timestamp prefix */					\
-	gettimeofday(&_tv, NULL);					\
-	_tinfo = localtime(&_tv.tv_sec);				\
-	_ms = _tv.tv_usec / 1000;					\
-	strftime(_l, sizeof (_l), "%Y-%m-%d/%H:%M:%S.", _tinfo);	\
-	_off += 20;							\
-	snprintf(_l+ _off, sizeof (_l) - _off, "%03u ", _ms);		\
-	_off += 4;							\
-									\
-	snprintf(_l + _off, sizeof (_l) - _off, fmt, ##__VA_ARGS__);	\
-	fprintf(stderr, "%s\n", _l);					\
+	istgt_alog(&_site, ISTGT_ALOG_STDERR, lvl, fmt, ##__VA_ARGS__);	\
 } while (0);
 
 #define	REPLICA_LOG(fmt, ...)						\
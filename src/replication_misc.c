@@ -31,8 +31,12 @@
 #define	POLLWAIT 5000
 #define	PORTNUMLEN 32
 
-int
-replication_connect(const char *host, int port)
+/*
+ * With non_blocking the socket is returned while connect is still in
+ * progress, the caller waits for EPOLLOUT and checks SO_ERROR.
+ */
+static int
+connect_to_host(const char *host, int port, int non_blocking)
 {
 	char buf[MAX_TMPBUF];
 	char portnum[PORTNUMLEN];
@@ -98,7 +102,14 @@ retry:
 			/* error */
 			continue;
 		}
+		if (non_blocking == 1 && make_socket_non_blocking(sock) == -1) {
+			close(sock);
+			sock = -1;
+			continue;
+		}
 		rc = connect(sock, res->ai_addr, res->ai_addrlen);
+		if (rc == -1 && errno == EINPROGRESS && non_blocking == 1)
+			rc = 0;
 		if (rc == -1 && errno == EINTR) {
 			/* interrupted? */
 			ISTGT_ERRLOG("connect() failed .. err(%d)\n", errno);
@@ -134,6 +145,19 @@ retry:
 	}
 	return (sock);
 }
+
+int
+replication_connect(const char *host, int port)
+{
+	return (connect_to_host(host, port, 0));
+}
+
+int
+replication_connect_nb(const char *host, int port)
+{
+	return (connect_to_host(host, port, 1));
+}
+
 int
 replication_listen(const char *ip, int port, int que, int non_blocking)
 {
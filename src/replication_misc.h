@@ -21,6 +21,7 @@
 #include "istgt_misc.h"
 
 int replication_connect(const char *, int);
+int replication_connect_nb(const char *, int);
 int replication_listen(const char *, int, int, int);
 int set_socket_keepalive(int);
 json_object * json_object_new_uint64(uint64_t value);
@@ -26,6 +26,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <math.h>
 #include "replication.h"
 #include "istgt_integration.h"
 #include "replication_misc.h"
@@ -66,6 +68,99 @@ uint64_t write_ios;
 int replica_quorum_state = 0;
 char replica_id[REPLICA_ID_LEN];
 
+/*
+ * Simulator mode: IO responses are held back according to per-opcode
+ * latency distributions, a bandwidth cap, jitter and periodic stall
+ * windows, and are sent from the epoll loop once they are due.
+ */
+typedef enum sim_dist {
+	SIM_DIST_NONE = 0,
+	SIM_DIST_FIXED,
+	SIM_DIST_UNIFORM,
+	SIM_DIST_LOGNORMAL,
+} sim_dist_t;
+
+typedef struct sim_latency {
+	sim_dist_t dist;
+	double p1;	/* fixed value, uniform min, lognormal median (usec) */
+	double p2;	/* uniform max, lognormal sigma */
+} sim_latency_t;
+
+enum {
+	SIM_OP_READ = 0,
+	SIM_OP_WRITE,
+	SIM_OP_SYNC,
+	SIM_OP_MAX,
+};
+
+typedef struct sim_resp_s {
+	TAILQ_ENTRY(sim_resp_s) next;
+	int fd;
+	uint64_t due;
+	zvol_io_hdr_t hdr;
+	void *data;
+} sim_resp_t;
+
+bool sim_enabled = false;
+sim_latency_t sim_latency[SIM_OP_MAX];
+uint64_t sim_bandwidth = 0;		/* bytes per second, 0 is unlimited */
+uint64_t sim_jitter = 0;		/* usec */
+uint64_t sim_stall_period = 0;		/* usec */
+uint64_t sim_stall_len = 0;		/* usec */
+uint64_t sim_start;
+uint64_t sim_link_free;
+TAILQ_HEAD(sim_resp_head, sim_resp_s) sim_respq =
+    TAILQ_HEAD_INITIALIZER(sim_respq);
+int sim_timerfd = -1;
+
+/* in-memory backing store, used instead of the volume file if set */
+uint8_t *mem_store = NULL;
+size_t mem_store_size = 0;
+
+/*
+ * Data connections from the target and the state of the IO being read on
+ * each.  Connections past max_dconns get their OPEN refused, like a
+ * replica that serves a volume on a single connection.
+ */
+#define	MAX_TEST_DCONNS	16
+
+typedef struct test_dconn_s {
+	int fd;
+	zvol_io_hdr_t *io_hdr;
+	uint8_t *data;
+	bool read_rem_data;
+	bool read_rem_hdr;
+	uint64_t recv_len;
+	uint64_t total_len;
+} test_dconn_t;
+
+test_dconn_t dconns[MAX_TEST_DCONNS];
+int ndconns = 0;
+int max_dconns = 1;
+
+/*
+ * Status push: once the target sent STATUS_SUBSCRIBE, status transitions
+ * and changed stats are sent as notifications.  The rebuild progress a
+ * polled replica makes on every status query is made on a one second
+ * tick of push_timerfd instead.  -o refuses the subscription like a
+ * replica that doesn't know it.
+ */
+#define	TEST_USED_BYTES	10000
+
+bool push_refused = false;
+bool push_subscribed = false;
+int push_timerfd = -1;
+uint32_t push_stats_interval = 0;
+uint32_t push_ticks = 0;
+uint64_t push_stats_used = 0;
+
+/*
+ * persistent reservations from PR_UPDATE, kept next to the volume file;
+ * -x never answers PR_UPDATE and PR_READ, like a replica without them
+ */
+char pr_path[1024 + 8];
+bool pr_ignored = false;
+
 static void
 sig_handler(int sig)
 {
@@ -220,6 +315,176 @@ check_for_err(zvol_io_hdr_t *io_hdr)
 	return 0;
 }
 
+static uint64_t
+sim_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static double
+sim_rand_unit(void)
+{
+	/* (0, 1], never 0 so that log() stays finite */
+	return ((random() + 1.0) / ((double)RAND_MAX + 1.0));
+}
+
+static uint64_t
+sim_sample_latency(sim_latency_t *lat)
+{
+	double u1, u2, z, val = 0;
+
+	switch (lat->dist) {
+		case SIM_DIST_FIXED:
+			val = lat->p1;
+			break;
+		case SIM_DIST_UNIFORM:
+			val = lat->p1 + (lat->p2 - lat->p1) * sim_rand_unit();
+			break;
+		case SIM_DIST_LOGNORMAL:
+			/* Box-Muller, median p1 and shape p2 */
+			u1 = sim_rand_unit();
+			u2 = sim_rand_unit();
+			z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+			val = lat->p1 * exp(lat->p2 * z);
+			break;
+		default:
+			break;
+	}
+	return ((val > 0) ? (uint64_t)val : 0);
+}
+
+/*
+ * parses <op>=<dist>:<p1>[:<p2>] where op is read, write or sync
+ * and dist is fixed, uniform or lognormal
+ */
+static int
+sim_parse_latency(char *arg)
+{
+	char *op, *dist, *p1, *p2, *saveptr = NULL;
+	sim_latency_t lat;
+	int idx;
+
+	op = strtok_r(arg, "=", &saveptr);
+	dist = strtok_r(NULL, ":", &saveptr);
+	p1 = strtok_r(NULL, ":", &saveptr);
+	p2 = strtok_r(NULL, ":", &saveptr);
+	if (op == NULL || dist == NULL || p1 == NULL)
+		return (-1);
+
+	if (strcmp(op, "read") == 0)
+		idx = SIM_OP_READ;
+	else if (strcmp(op, "write") == 0)
+		idx = SIM_OP_WRITE;
+	else if (strcmp(op, "sync") == 0)
+		idx = SIM_OP_SYNC;
+	else
+		return (-1);
+
+	memset(&lat, 0, sizeof (lat));
+	lat.p1 = strtod(p1, NULL);
+	lat.p2 = (p2 != NULL) ? strtod(p2, NULL) : 0;
+	if (strcmp(dist, "fixed") == 0)
+		lat.dist = SIM_DIST_FIXED;
+	else if (strcmp(dist, "uniform") == 0 && p2 != NULL &&
+	    lat.p2 >= lat.p1)
+		lat.dist = SIM_DIST_UNIFORM;
+	else if (strcmp(dist, "lognormal") == 0 && p2 != NULL)
+		lat.dist = SIM_DIST_LOGNORMAL;
+	else
+		return (-1);
+
+	if (lat.p1 < 0 || lat.p2 < 0)
+		return (-1);
+	sim_latency[idx] = lat;
+	return (0);
+}
+
+/*
+ * Computes when the response for io_hdr should leave the replica:
+ * wait for the link to be free, transfer at sim_bandwidth, add the
+ * sampled service latency and jitter, and push it past any stall window.
+ */
+static uint64_t
+sim_response_due(zvol_io_hdr_t *io_hdr, uint64_t now)
+{
+	uint64_t due = now, start, pos;
+	int idx = -1;
+
+	if (io_hdr->opcode == ZVOL_OPCODE_READ)
+		idx = SIM_OP_READ;
+	else if (io_hdr->opcode == ZVOL_OPCODE_WRITE)
+		idx = SIM_OP_WRITE;
+	else if (io_hdr->opcode == ZVOL_OPCODE_SYNC)
+		idx = SIM_OP_SYNC;
+	else
+		return (now);
+
+	if (sim_bandwidth && io_hdr->len) {
+		start = (sim_link_free > now) ? sim_link_free : now;
+		sim_link_free = start + (io_hdr->len * 1000000) / sim_bandwidth;
+		due = sim_link_free;
+	}
+
+	due += sim_sample_latency(&sim_latency[idx]);
+	if (sim_jitter)
+		due += random() % (sim_jitter + 1);
+
+	/* stall window is the last sim_stall_len usec of every period */
+	if (sim_stall_period) {
+		pos = (due - sim_start) % sim_stall_period;
+		if (pos >= sim_stall_period - sim_stall_len)
+			due += sim_stall_period - pos;
+	}
+	return (due);
+}
+
+static void
+sim_arm_timer(void)
+{
+	struct itimerspec its;
+	sim_resp_t *resp = TAILQ_FIRST(&sim_respq);
+
+	memset(&its, 0, sizeof (its));
+	if (resp != NULL) {
+		/* zero disarms the timer, so fire at least 1 nsec out */
+		its.it_value.tv_sec = resp->due / 1000000;
+		its.it_value.tv_nsec = (resp->due % 1000000) * 1000 + 1;
+	}
+	if (timerfd_settime(sim_timerfd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+		REPLICA_ERRLOG("timerfd_settime failed err(%d)\n", errno);
+}
+
+/*
+ * queues the response to be sent on fd, takes ownership of data
+ */
+static void
+sim_queue_resp(int fd, zvol_io_hdr_t *io_hdr, void *data)
+{
+	sim_resp_t *resp, *r;
+
+	resp = malloc(sizeof (*resp));
+	resp->fd = fd;
+	resp->due = sim_response_due(io_hdr, sim_now_usec());
+	memcpy(&resp->hdr, io_hdr, sizeof (resp->hdr));
+	resp->data = data;
+
+	/* keep the queue sorted by due time, most inserts land at the tail */
+	TAILQ_FOREACH_REVERSE(r, &sim_respq, sim_resp_head, next) {
+		if (r->due <= resp->due)
+			break;
+	}
+	if (r == NULL)
+		TAILQ_INSERT_HEAD(&sim_respq, resp, next);
+	else
+		TAILQ_INSERT_AFTER(&sim_respq, r, resp, next);
+
+	if (TAILQ_FIRST(&sim_respq) == resp)
+		sim_arm_timer();
+}
+
 static int64_t
 test_read_data(int fd, uint8_t *data, uint64_t len)
 {
@@ -249,6 +514,64 @@ test_read_data(int fd, uint8_t *data, uint64_t len)
 	return nbytes;
 }
 
+/*
+ * Loads the stored reservations, a zvol_op_pr_data_t with pr_seq 0 and no
+ * data if nothing has been stored yet.
+ */
+static zvol_op_pr_data_t *
+read_pr_file(void)
+{
+	zvol_op_pr_data_t *pr, hdr;
+	int fd;
+
+	memset(&hdr, 0, sizeof (hdr));
+	fd = open(pr_path, O_RDONLY);
+	if (fd >= 0 && (read(fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+	    hdr.len > ZVOL_PR_DATA_MAX))
+		memset(&hdr, 0, sizeof (hdr));
+	pr = malloc(sizeof (hdr) + hdr.len);
+	memcpy(pr, &hdr, sizeof (hdr));
+	if (hdr.len != 0 &&
+	    read(fd, pr + 1, hdr.len) != (ssize_t)hdr.len) {
+		REPLICA_ERRLOG("short reservation file %s\n", pr_path);
+		memset(pr, 0, sizeof (hdr));
+	}
+	if (fd >= 0)
+		close(fd);
+	return (pr);
+}
+
+/* replaces the stored reservations unless they are newer */
+static int
+write_pr_file(zvol_op_pr_data_t *pr)
+{
+	zvol_op_pr_data_t *cur;
+	char tmp[sizeof (pr_path) + 4];
+	size_t len = sizeof (*pr) + pr->len;
+	int fd, rc = 0;
+
+	cur = read_pr_file();
+	if (cur->pr_seq > pr->pr_seq) {
+		free(cur);
+		return (0);
+	}
+	free(cur);
+
+	snprintf(tmp, sizeof (tmp), "%s.tmp", pr_path);
+	fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+	if (fd < 0)
+		return (-1);
+	if (write(fd, pr, len) != (ssize_t)len || fsync(fd) != 0)
+		rc = -1;
+	close(fd);
+	if (rc == 0 && rename(tmp, pr_path) != 0)
+		rc = -1;
+	if (rc != 0)
+		REPLICA_ERRLOG("Failed to store reservations in %s err(%d)\n",
+		    pr_path, errno);
+	return (rc);
+}
+
 static int
 send_mgmt_ack(int fd, zvol_op_code_t opcode, void *buf, char *replica_ip,
     int replica_port, int delay_connection, zrepl_status_ack_t *zrepl_status,
@@ -260,6 +583,7 @@ send_mgmt_ack(int fd, zvol_op_code_t opcode, void *buf, char *replica_ip,
 	int iovec_count;
 	zvol_io_hdr_t *mgmt_ack_hdr = NULL;
 	mgmt_ack_t *mgmt_ack_data = NULL;
+	zvol_op_pr_data_t *pr = NULL;
 	int ret = -1;
 	zvol_op_stat_t stats;
 
@@ -321,7 +645,7 @@ send_mgmt_ack(int fd, zvol_op_code_t opcode, void *buf, char *replica_ip,
 		iovec_count = 1;
 	} else if (opcode == ZVOL_OPCODE_STATS) {
 		strcpy(stats.label, "used");
-		stats.value = 10000;
+		stats.value = TEST_USED_BYTES;
 		mgmt_ack_hdr->len = sizeof (zvol_op_stat_t);
 		iovec[1].iov_base = &stats;
 		iovec[1].iov_len = sizeof (zvol_op_stat_t);
@@ -329,6 +653,22 @@ send_mgmt_ack(int fd, zvol_op_code_t opcode, void *buf, char *replica_ip,
 	} else if (opcode == ZVOL_OPCODE_RESIZE) {
 		mgmt_ack_hdr->len = 0;
 		iovec_count = 1;
+	} else if (opcode == ZVOL_OPCODE_PR_UPDATE) {
+		mgmt_ack_hdr->status = write_pr_file(buf) == 0 ?
+		    ZVOL_OP_STATUS_OK : ZVOL_OP_STATUS_FAILED;
+		mgmt_ack_hdr->len = 0;
+		iovec_count = 1;
+	} else if (opcode == ZVOL_OPCODE_STATUS_SUBSCRIBE) {
+		mgmt_ack_hdr->status = push_refused ? ZVOL_OP_STATUS_FAILED :
+		    ZVOL_OP_STATUS_OK;
+		mgmt_ack_hdr->len = 0;
+		iovec_count = 1;
+	} else if (opcode == ZVOL_OPCODE_PR_READ) {
+		pr = read_pr_file();
+		mgmt_ack_hdr->len = sizeof (*pr) + pr->len;
+		iovec[1].iov_base = pr;
+		iovec[1].iov_len = mgmt_ack_hdr->len;
+		iovec_count = 2;
 	} else {
 		build_mgmt_ack_data;
 
@@ -370,9 +710,71 @@ out:
 	if (mgmt_ack_data)
 		free(mgmt_ack_data);
 
+	if (pr)
+		free(pr);
+
 	return ret;
 }
 
+static int
+push_notify(int fd, zvol_op_code_t opcode, void *buf, uint64_t len)
+{
+	zvol_io_hdr_t hdr;
+	struct iovec iovec[2];
+	ssize_t rc;
+	int i = 0;
+
+	memset(&hdr, 0, sizeof (hdr));
+	hdr.opcode = opcode;
+	hdr.version = REPLICA_VERSION;
+	hdr.status = ZVOL_OP_STATUS_OK;
+	hdr.len = len;
+	iovec[0].iov_base = &hdr;
+	iovec[0].iov_len = sizeof (hdr);
+	iovec[1].iov_base = buf;
+	iovec[1].iov_len = len;
+
+	while (i < 2) {
+		rc = writev(fd, &iovec[i], 2 - i);
+		if (rc < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (-1);
+		}
+		while (i < 2 && (size_t)rc >= iovec[i].iov_len) {
+			rc -= iovec[i].iov_len;
+			i++;
+		}
+		if (i < 2) {
+			iovec[i].iov_base = (uint8_t *)iovec[i].iov_base + rc;
+			iovec[i].iov_len -= rc;
+		}
+	}
+	return (0);
+}
+
+static int
+push_status(int fd, zrepl_status_ack_t *zrepl_status)
+{
+	if (!push_subscribed)
+		return (0);
+	return (push_notify(fd, ZVOL_OPCODE_STATUS_NOTIFY, zrepl_status,
+	    sizeof (*zrepl_status)));
+}
+
+static int
+push_stats(int fd)
+{
+	zvol_op_stat_t stats;
+
+	if (!push_subscribed || push_stats_used == TEST_USED_BYTES)
+		return (0);
+	memset(&stats, 0, sizeof (stats));
+	strcpy(stats.label, "used");
+	stats.value = push_stats_used = TEST_USED_BYTES;
+	return (push_notify(fd, ZVOL_OPCODE_STATS_NOTIFY, &stats,
+	    sizeof (stats)));
+}
 
 static int
 send_io_resp(int fd, zvol_io_hdr_t *io_hdr, void *buf)
@@ -428,6 +830,39 @@ send_io_resp(int fd, zvol_io_hdr_t *io_hdr, void *buf)
 	return 0;
 }
 
+/*
+ * sends all responses that are due, and re-arms the timer for the rest
+ */
+static int
+sim_send_due_resp(void)
+{
+	sim_resp_t *resp;
+	uint64_t now = sim_now_usec();
+	int rc = 0;
+
+	while ((resp = TAILQ_FIRST(&sim_respq)) != NULL && resp->due <= now) {
+		TAILQ_REMOVE(&sim_respq, resp, next);
+		rc = send_io_resp(resp->fd, &resp->hdr, resp->data);
+		free(resp->data);
+		free(resp);
+		if (rc != 0)
+			return (rc);
+	}
+	sim_arm_timer();
+	return (0);
+}
+
+static test_dconn_t *
+find_dconn(int fd)
+{
+	int i;
+
+	for (i = 0; i < ndconns; i++)
+		if (dconns[i].fd == fd)
+			return (&dconns[i]);
+	return (NULL);
+}
+
 static void
 usage(void)
 {
@@ -445,6 +880,16 @@ usage(void)
 	printf(" -e error frequency (should be <= 10, default is 0)\n");
 	printf(" -t delay in response in seconds\n");
 	printf(" -s delay while forming the management connectioin and Rebuild respone in seconds\n");
+	printf(" -c number of data connections to accept from target (default is 1)\n");
+	printf(" -o refuse status push subscription\n");
+	printf(" -x don't answer persistent reservation requests\n");
+	printf("simulator options:\n");
+	printf(" -l <read|write|sync>=<fixed:usec|uniform:min:max|lognormal:median:sigma>\n");
+	printf("    response latency distribution per opcode, can be repeated\n");
+	printf(" -B bandwidth cap in KB/s for read and write payloads\n");
+	printf(" -j max random jitter in usec added to every IO response\n");
+	printf(" -w <period_ms>:<len_ms> stall IO responses for len_ms every period_ms\n");
+	printf(" -m serve IOs from an in-memory copy of the volume file\n");
 }
 
 
@@ -462,6 +907,7 @@ main(int argc, char **argv)
 	struct zvol_io_rw_hdr *io_rw_hdr;
 	zvol_op_open_data_t *open_ptr;
 	int iofd = -1, mgmtfd, sfd, rc, epfd, event_count, i;
+	test_dconn_t *dc;
 	int64_t count;
 	struct epoll_event event, *events;
 	uint8_t *data, *mgmt_data;
@@ -482,10 +928,13 @@ main(int argc, char **argv)
 	int delay = 0;
 	int delay_connection = 0;
 	bool retry = false;
+	bool use_mem_store = false;
+	char *sep;
+	struct stat vol_stat;
 
 	memset(replica_id, 0, REPLICA_ID_LEN);
 
-	while ((ch = getopt(argc, argv, "i:p:I:P:V:n:e:s:t:drq")) != -1) {
+	while ((ch = getopt(argc, argv, "i:p:I:P:V:n:e:s:t:c:drql:B:j:w:mox")) != -1) {
 		switch (ch) {
 			case 'i':
 				strncpy(ctrl_ip, optarg, sizeof(ctrl_ip));
@@ -517,6 +966,12 @@ main(int argc, char **argv)
 			case 'd':
 				degraded_mode = true;
 				break;
+			case 'o':
+				push_refused = true;
+				break;
+			case 'x':
+				pr_ignored = true;
+				break;
 			case 'e':
 				error_freq = atoi(optarg);
 				if (error_freq > 10) {
@@ -533,6 +988,45 @@ main(int argc, char **argv)
 			case 't':
 				delay = atoi(optarg);
 				break;
+			case 'c':
+				max_dconns = atoi(optarg);
+				if (max_dconns < 1 || max_dconns > MAX_TEST_DCONNS) {
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'l':
+				if (sim_parse_latency(optarg) != 0) {
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				sim_enabled = true;
+				break;
+			case 'B':
+				sim_bandwidth = strtoull(optarg, NULL, 10) * 1024;
+				sim_enabled = true;
+				break;
+			case 'j':
+				sim_jitter = strtoull(optarg, NULL, 10);
+				sim_enabled = true;
+				break;
+			case 'w':
+				sep = strchr(optarg, ':');
+				if (sep == NULL) {
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				sim_stall_period = strtoull(optarg, NULL, 10) * 1000;
+				sim_stall_len = strtoull(sep + 1, NULL, 10) * 1000;
+				if (sim_stall_len >= sim_stall_period) {
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				sim_enabled = true;
+				break;
+			case 'm':
+				use_mem_store = true;
+				break;
 			default:
 				usage();
 				exit(EXIT_FAILURE);
@@ -556,13 +1050,58 @@ main(int argc, char **argv)
 		close(vol_fd);
 		exit(EXIT_FAILURE);
 	}
+	snprintf(pr_path, sizeof (pr_path), "%s.prfile", test_vol);
 
 	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
 	srandom(now.tv_sec);
 
+	if (use_mem_store) {
+		if (fstat(vol_fd, &vol_stat) != 0 ||
+		    (mem_store = calloc(1, vol_stat.st_size)) == NULL) {
+			REPLICA_ERRLOG("Failed to allocate in-memory store of "
+			    "%s replica(%d)\n", test_vol, ctrl_port);
+			close(vol_fd);
+			destroy_mdlist();
+			exit(EXIT_FAILURE);
+		}
+		mem_store_size = vol_stat.st_size;
+		/* start from what the volume file holds */
+		for (nbytes = 0; nbytes < mem_store_size; nbytes += rc) {
+			rc = pread(vol_fd, mem_store + nbytes,
+			    (mem_store_size - nbytes > 1024 * 1024) ?
+			    1024 * 1024 : mem_store_size - nbytes, nbytes);
+			if (rc <= 0) {
+				REPLICA_ERRLOG("Failed to load %s into memory, "
+				    "err:%d replica(%d)\n", test_vol, errno,
+				    ctrl_port);
+				close(vol_fd);
+				destroy_mdlist();
+				exit(EXIT_FAILURE);
+			}
+		}
+		nbytes = 0;
+	}
+
 	data = NULL;
 	epfd = epoll_create1(0);
 
+	if (sim_enabled) {
+		sim_start = sim_now_usec();
+		sim_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (sim_timerfd < 0) {
+			REPLICA_ERRLOG("timerfd_create() failed, err:%d "
+			    "replica(%d)", errno, ctrl_port);
+			exit(EXIT_FAILURE);
+		}
+		event.data.fd = sim_timerfd;
+		event.events = EPOLLIN;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sim_timerfd, &event) == -1) {
+			REPLICA_ERRLOG("epoll_ctl() failed, err:%d replica(%d)",
+			    errno, ctrl_port);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	//Create listener for io connections from controller and add to epoll
 	if((sfd = cstor_ops.conn_listen(replica_ip, replica_port, 32, 1)) < 0) {
                 REPLICA_LOG("conn_listen() failed, err:%d replica(%d)", errno, ctrl_port);
@@ -580,6 +1119,20 @@ main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	push_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (push_timerfd < 0) {
+		REPLICA_ERRLOG("timerfd_create() failed, err:%d replica(%d)",
+		    errno, ctrl_port);
+		exit(EXIT_FAILURE);
+	}
+	event.data.fd = push_timerfd;
+	event.events = EPOLLIN;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, push_timerfd, &event) == -1) {
+		REPLICA_ERRLOG("epoll_ctl() failed, err:%d replica(%d)",
+		    errno, ctrl_port);
+		exit(EXIT_FAILURE);
+	}
+
 	events = calloc(MAXEVENTS, sizeof(event));
 
 again:
@@ -612,6 +1165,43 @@ again:
 					(!(events[i].events & EPOLLIN))) {
 				fprintf (stderr, "epoll error for replica(%d)\n", ctrl_port);
 				continue;
+			} else if (events[i].data.fd == sim_timerfd) {
+				uint64_t expirations;
+				if (read(sim_timerfd, &expirations,
+				    sizeof (expirations)) < 0 && errno != EAGAIN) {
+					REPLICA_ERRLOG("timerfd read failed err(%d)\n", errno);
+				}
+				if (sim_send_due_resp()) {
+					REPLICA_ERRLOG("Failed to send response replica(%d)\n", ctrl_port);
+					rc = -1;
+					goto error;
+				}
+			} else if (events[i].data.fd == push_timerfd) {
+				uint64_t expirations;
+				bool changed = false;
+				if (read(push_timerfd, &expirations,
+				    sizeof (expirations)) < 0 && errno != EAGAIN) {
+					REPLICA_ERRLOG("timerfd read failed err(%d)\n", errno);
+				}
+				push_ticks++;
+				if ((zrepl_status_msg_cnt >= 2) &&
+				    (zrepl_status->state != ZVOL_STATUS_HEALTHY) &&
+				    !degraded_mode) {
+					zrepl_status->state = ZVOL_STATUS_HEALTHY;
+					zrepl_status->rebuild_status = ZVOL_REBUILDING_DONE;
+					zrepl_status_msg_cnt = 0;
+					changed = true;
+				}
+				if (zrepl_status->rebuild_status == ZVOL_REBUILDING_SNAP)
+					zrepl_status_msg_cnt += 1;
+				if ((changed && push_status(mgmtfd, zrepl_status) != 0) ||
+				    (push_stats_interval &&
+				    (push_ticks % push_stats_interval) == 0 &&
+				    push_stats(mgmtfd) != 0)) {
+					REPLICA_ERRLOG("Failed to push status replica(%d)\n", ctrl_port);
+					rc = -1;
+					goto error;
+				}
 			} else if (events[i].data.fd == mgmtfd) {
 				count = test_read_data(events[i].data.fd, (uint8_t *)mgmtio, sizeof(zvol_io_hdr_t));
 				if (count < 0) {
@@ -657,7 +1247,30 @@ again:
 					}
 				}
 				opcode = mgmtio->opcode;
-				send_mgmt_ack(mgmtfd, opcode, mgmt_data, replica_ip, replica_port, delay_connection, zrepl_status, &zrepl_status_msg_cnt);
+				if (!pr_ignored || (opcode != ZVOL_OPCODE_PR_UPDATE &&
+				    opcode != ZVOL_OPCODE_PR_READ))
+					send_mgmt_ack(mgmtfd, opcode, mgmt_data, replica_ip, replica_port, delay_connection, zrepl_status, &zrepl_status_msg_cnt);
+				rc = 0;
+				if (opcode == ZVOL_OPCODE_STATUS_SUBSCRIBE && !push_refused) {
+					struct itimerspec its;
+
+					push_subscribed = true;
+					push_stats_interval = ((zvol_op_subscribe_data_t *)
+					    mgmt_data)->stats_interval;
+					memset(&its, 0, sizeof (its));
+					its.it_value.tv_sec = its.it_interval.tv_sec = 1;
+					timerfd_settime(push_timerfd, 0, &its, NULL);
+					rc = push_status(mgmtfd, zrepl_status);
+					if (rc == 0)
+						rc = push_stats(mgmtfd);
+				} else if (opcode == ZVOL_OPCODE_START_REBUILD) {
+					rc = push_status(mgmtfd, zrepl_status);
+				}
+				if (rc != 0) {
+					REPLICA_ERRLOG("Failed to push status replica(%d)\n", ctrl_port);
+					rc = -1;
+					goto error;
+				}
 			} else if (events[i].data.fd == sfd) {
 				struct sockaddr saddr;
 				socklen_t slen;
@@ -691,6 +1304,15 @@ again:
 					    " replica(%d)", errno, ctrl_port);
 					exit(EXIT_FAILURE);
 				}
+				if (ndconns == MAX_TEST_DCONNS) {
+					REPLICA_ERRLOG("too many data connections replica(%d)\n", ctrl_port);
+					close(iofd);
+					break;
+				}
+				dc = &dconns[ndconns++];
+				memset(dc, 0, sizeof (*dc));
+				dc->fd = iofd;
+				dc->io_hdr = malloc(sizeof (zvol_io_hdr_t));
 				event.data.fd = iofd;
 				event.events = EPOLLIN | EPOLLET;
 				rc = epoll_ctl(epfd, EPOLL_CTL_ADD, iofd, &event);
@@ -698,7 +1320,15 @@ again:
 					REPLICA_ERRLOG("epoll_ctl() failed, errno:%d replica(%d)", errno, ctrl_port);
 					exit(EXIT_FAILURE);
 				}
-			} else if(events[i].data.fd == iofd) {
+			} else if ((dc = find_dconn(events[i].data.fd)) != NULL) {
+				/* pick up where the last read on this connection stopped */
+				iofd = dc->fd;
+				io_hdr = dc->io_hdr;
+				data = dc->data;
+				read_rem_data = dc->read_rem_data;
+				read_rem_hdr = dc->read_rem_hdr;
+				recv_len = dc->recv_len;
+				total_len = dc->total_len;
 				while(1) {
 					if (read_rem_data) {
 						count = test_read_data(events[i].data.fd, (uint8_t *)data + recv_len, total_len - recv_len);
@@ -772,11 +1402,29 @@ again:
 						}
 					}
 execute_io:
+					if (io_hdr->opcode == ZVOL_OPCODE_OPEN &&
+					    (dc - dconns) >= max_dconns) {
+						REPLICA_LOG("refusing data connection %d, "
+						    "replica(%d) takes %d\n", iofd, ctrl_port,
+						    max_dconns);
+						io_hdr->status = ZVOL_OP_STATUS_FAILED;
+						(void) send_io_resp(iofd, io_hdr, NULL);
+						epoll_ctl(epfd, EPOLL_CTL_DEL, iofd, NULL);
+						close(iofd);
+						dc->fd = -1;
+						free(data);
+						data = NULL;
+						break;
+					}
 					if (io_hdr->opcode == ZVOL_OPCODE_OPEN) {
 						open_ptr = (zvol_op_open_data_t *)data;
 						if (open_ptr->replication_factor == 1) {
 							zrepl_status->state = ZVOL_STATUS_HEALTHY;
 							zrepl_status->rebuild_status = ZVOL_REBUILDING_DONE;
+							if (push_status(mgmtfd, zrepl_status) != 0) {
+								rc = -1;
+								goto error;
+							}
 						}
 						io_hdr->status = ZVOL_OP_STATUS_OK;
 						REPLICA_LOG("Volume name:%s blocksize:%d timeout:%d.. replica(%d) state: %d\n",
@@ -800,7 +1448,13 @@ execute_io:
 						write_metadata(io_hdr->offset, io_rw_hdr->len, io_rw_hdr->io_num);
 						data += sizeof(struct zvol_io_rw_hdr);
 						nbytes = 0;
-						while((rc = pwrite(vol_fd, data + nbytes, io_rw_hdr->len - nbytes, io_hdr->offset + nbytes))) {
+						if (mem_store != NULL &&
+						    io_hdr->offset + io_rw_hdr->len <= mem_store_size) {
+							memcpy(mem_store + io_hdr->offset, data,
+							    io_rw_hdr->len);
+							nbytes = io_rw_hdr->len;
+						}
+						while(mem_store == NULL && (rc = pwrite(vol_fd, data + nbytes, io_rw_hdr->len - nbytes, io_hdr->offset + nbytes))) {
 							if(rc == -1 ) {
 								if(errno == 11) {
 									sleep(1);
@@ -837,7 +1491,13 @@ execute_io:
 						nbytes = 0;
 						io_hdr->status = ZVOL_OP_STATUS_OK;
 						rc = check_for_err(io_hdr);
-						if(!rc)  {
+						if (!rc && mem_store != NULL) {
+							if (io_hdr->offset + io_hdr->len <= mem_store_size) {
+								memcpy(user_data, mem_store + io_hdr->offset,
+								    io_hdr->len);
+								nbytes = io_hdr->len;
+							}
+						} else if(!rc)  {
 							while ((rc = pread(vol_fd, user_data + nbytes, io_hdr->len - nbytes, io_hdr->offset + nbytes))) {
 								if(rc == -1 ) {
 									if(errno == EAGAIN) {
@@ -868,6 +1528,17 @@ execute_io:
 						read_ios++;
 					}
 
+					if (sim_enabled) {
+						/* data is only sent back for reads */
+						if (io_hdr->opcode != ZVOL_OPCODE_READ) {
+							free(data);
+							data = NULL;
+						}
+						sim_queue_resp(iofd, io_hdr, data);
+						data = NULL;
+						continue;
+					}
+
 					rc = send_io_resp(iofd, io_hdr, data);
 					if (rc) {
 						REPLICA_ERRLOG("Failed to send response replica(%d)\n", ctrl_port);
@@ -879,6 +1550,12 @@ execute_io:
 						data = NULL;
 					}
 				}
+				dc->data = data;
+				dc->read_rem_data = read_rem_data;
+				dc->read_rem_hdr = read_rem_hdr;
+				dc->recv_len = recv_len;
+				dc->total_len = total_len;
+				data = NULL;
 			}
 		}
 	}
@@ -888,6 +1565,8 @@ error:
 	    replica_ip, replica_port, read_ios, write_ios);
 	if (data)
 		free(data);
+	if (mem_store)
+		free(mem_store);
 	close(vol_fd);
 	destroy_mdlist();
 	return rc;
@@ -0,0 +1,242 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Tests of the timer wheel (istgt_twheel.c).  Time is driven by hand: the
+ * wheel is put at a chosen tick and advanced one tick at a time, so every
+ * timer can be checked to fire on its own tick and not one earlier.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "istgt_twheel.h"
+
+#define	TICK		10
+#define	NTIMERS		64
+#define	SPAN		(1ULL << (ISTGT_TWHEEL_LEVELS * ISTGT_TWHEEL_BITS))
+
+typedef struct test_timer {
+	ISTGT_TIMER t;
+	/* tick it is due on, 0 for never */
+	uint64_t due;
+	uint64_t fired_at;
+	int fired;
+	/* re-armed by the callback until it has fired that often */
+	int repeat;
+	uint64_t period;
+} TEST_TIMER;
+
+static ISTGT_TWHEEL wheel;
+static uint64_t cur_tick;
+
+#define	check(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "twheel_test: " __VA_ARGS__);	\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static void
+expired(void *owner, ISTGT_TIMER *t)
+{
+	TEST_TIMER *tt = t->arg;
+
+	check(owner == &wheel, "owner %p\n", owner);
+	check(!t->armed, "timer still armed in its callback\n");
+	check(cur_tick >= tt->due, "timer due %lu fired early at %lu\n",
+	    (unsigned long) tt->due, (unsigned long) cur_tick);
+	tt->fired++;
+	tt->fired_at = cur_tick;
+	if (tt->fired < tt->repeat) {
+		tt->due = cur_tick + tt->period;
+		istgt_twheel_arm(&wheel, t, tt->due * TICK, expired, tt);
+	}
+}
+
+static void
+start(uint64_t tick)
+{
+	istgt_twheel_init(&wheel, TICK, &wheel);
+	wheel.now = tick;
+	cur_tick = tick;
+}
+
+static void
+arm(TEST_TIMER *tt, uint64_t due)
+{
+	tt->due = due;
+	istgt_twheel_arm(&wheel, &tt->t, due * TICK, expired, tt);
+}
+
+/* up to and including tick, each timer has to fire right on its due tick */
+static void
+run_to(TEST_TIMER *tt, int n, uint64_t tick)
+{
+	int i;
+
+	while (cur_tick < tick) {
+		cur_tick++;
+		(void) istgt_twheel_advance(&wheel, cur_tick * TICK);
+		for (i = 0; i < n; i++) {
+			if (tt[i].due == 0 || tt[i].due != cur_tick)
+				continue;
+			check(tt[i].t.armed == 0 && tt[i].fired_at == cur_tick,
+			    "timer %d due %lu not fired (%d)\n", i,
+			    (unsigned long) tt[i].due, tt[i].fired);
+		}
+	}
+}
+
+static void
+arm_cancel_test(void)
+{
+	TEST_TIMER tt[3];
+
+	memset(tt, 0, sizeof (tt));
+	start(1000);
+	arm(&tt[0], 1005);
+	arm(&tt[1], 1010);
+	arm(&tt[2], 1003);
+	check(wheel.count == 3, "count %d after arming 3\n", wheel.count);
+	check(istgt_twheel_timeout(&wheel, 1000 * TICK) == 3 * TICK,
+	    "timeout %d\n", istgt_twheel_timeout(&wheel, 1000 * TICK));
+
+	istgt_twheel_cancel(&wheel, &tt[1].t);
+	istgt_twheel_cancel(&wheel, &tt[1].t);
+	check(wheel.count == 2, "count %d after cancel\n", wheel.count);
+	tt[1].due = 0;
+
+	run_to(tt, 3, 1020);
+	check(tt[0].fired == 1 && tt[2].fired == 1 && tt[1].fired == 0,
+	    "fired %d %d %d\n", tt[0].fired, tt[1].fired, tt[2].fired);
+	check(wheel.count == 0, "count %d after expiry\n", wheel.count);
+	check(istgt_twheel_timeout(&wheel, cur_tick * TICK) == -1,
+	    "timeout with nothing armed\n");
+
+	/* a deadline in the past runs on the next advance */
+	arm(&tt[0], 1015);
+	tt[0].due = cur_tick + 1;
+	run_to(tt, 1, cur_tick + 1);
+	check(tt[0].fired == 2, "past deadline fired %d\n", tt[0].fired);
+}
+
+static void
+rearm_test(void)
+{
+	TEST_TIMER tt[2];
+
+	memset(tt, 0, sizeof (tt));
+	start(5000);
+	/* moved closer, then further, fires once at the last deadline */
+	arm(&tt[0], 5100);
+	arm(&tt[0], 5020);
+	arm(&tt[0], 5300);
+	check(wheel.count == 1, "count %d after re-arming\n", wheel.count);
+
+	/* re-arms itself from the callback, as the task deadline does */
+	tt[1].repeat = 5;
+	tt[1].period = 70;
+	arm(&tt[1], 5010);
+
+	run_to(tt, 2, 5400);
+	check(tt[0].fired == 1 && tt[0].fired_at == 5300,
+	    "re-armed timer fired %d at %lu\n", tt[0].fired,
+	    (unsigned long) tt[0].fired_at);
+	check(tt[1].fired == 5 && tt[1].fired_at == 5010 + 4 * 70,
+	    "periodic timer fired %d at %lu\n", tt[1].fired,
+	    (unsigned long) tt[1].fired_at);
+	check(wheel.count == 0, "count %d\n", wheel.count);
+}
+
+/*
+ * Timers spread over every level, armed a few ticks before the level 0,
+ * level 1 and level 2 wraps, so they are cascaded down across them.
+ */
+static void
+wrap_test(uint64_t base)
+{
+	static const uint64_t delta[] = {
+		1, 2, 3, 4, 5, 63, 64, 65, 66, 127, 128, 200, 4095, 4096,
+		4097, 4100, 5000, 8191, 8192, 70000, 262143, 262144, 262145,
+		300000,
+	};
+	TEST_TIMER tt[NTIMERS];
+	uint64_t end = 0;
+	int n = 0, i;
+
+	memset(tt, 0, sizeof (tt));
+	start(base);
+	for (i = 0; i < (int) (sizeof (delta) / sizeof (delta[0])); i++) {
+		arm(&tt[n++], base + delta[i]);
+		if (base + delta[i] > end)
+			end = base + delta[i];
+	}
+	/* the same tick twice, and one cancelled half way */
+	arm(&tt[n++], base + 64);
+	arm(&tt[n++], base + 4096);
+	check(wheel.count == n, "count %d of %d\n", wheel.count, n);
+
+	run_to(tt, n, base + 2000);
+	istgt_twheel_cancel(&wheel, &tt[n - 1].t);
+	tt[n - 1].due = 0;
+	run_to(tt, n, end + 10);
+	for (i = 0; i < n; i++) {
+		if (tt[i].due == 0) {
+			check(tt[i].fired == 0, "cancelled timer %d fired\n", i);
+			continue;
+		}
+		check(tt[i].fired == 1, "timer %d due %lu fired %d times\n",
+		    i, (unsigned long) tt[i].due, tt[i].fired);
+	}
+	check(wheel.count == 0, "count %d after the wraps\n", wheel.count);
+}
+
+/* past the span of the wheel it fires early, at the last tick it has */
+static void
+span_test(void)
+{
+	TEST_TIMER tt;
+
+	memset(&tt, 0, sizeof (tt));
+	start(64 * 64 - 2);
+	arm(&tt, wheel.now + SPAN + 1000);
+	tt.due = wheel.now + SPAN - 1;
+	check(tt.t.expires == tt.due, "clamped to %lu, not %lu\n",
+	    (unsigned long) tt.t.expires, (unsigned long) tt.due);
+	run_to(&tt, 1, tt.due);
+	check(tt.fired == 1, "span timer fired %d\n", tt.fired);
+}
+
+int
+main(void)
+{
+	arm_cancel_test();
+	rearm_test();
+	wrap_test(64 - 3);
+	wrap_test(64 * 64 - 2);
+	wrap_test(64 * 64 * 64 - 5);
+	wrap_test(123457);
+	span_test();
+	printf("twheel_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright © 2017-2019 The OpenEBS Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Tests of the io_uring engine (istgt_lu_disk_uring.c) on a scratch file.
+ * Exits 0 without testing anything when the engine can't be started, i.e.
+ * in REPLICATION builds or when the kernel has no io_uring.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "istgt.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+#define	BLKSZ		4096
+#define	NBLKS		2048		/* 8MB scratch file */
+#define	NASYNC		1000		/* more than the ring holds */
+#define	NSEGS		8
+
+static pthread_mutex_t done_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+static int ndone;
+static int nfailed;
+
+#define	check(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "uring_test: " __VA_ARGS__);	\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static void
+fill(uint8_t *buf, size_t len, uint64_t offset, int gen)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (uint8_t)((offset + i) * 7 + gen);
+}
+
+static int
+verify(const uint8_t *buf, size_t len, uint64_t offset, int gen)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] != (uint8_t)((offset + i) * 7 + gen))
+			return -1;
+	return 0;
+}
+
+static void
+async_done(ISTGT_LU_DISK *spec __attribute__((__unused__)),
+    ISTGT_LU_DISK_URING_IO *io)
+{
+	pthread_mutex_lock(&done_mtx);
+	if (io->res != (int64_t)io->nbytes)
+		nfailed++;
+	ndone++;
+	pthread_cond_signal(&done_cv);
+	pthread_mutex_unlock(&done_mtx);
+}
+
+static void
+wait_done(int n)
+{
+	pthread_mutex_lock(&done_mtx);
+	while (ndone < n)
+		pthread_cond_wait(&done_cv, &done_mtx);
+	pthread_mutex_unlock(&done_mtx);
+}
+
+static int
+count_io(ISTGT_LU_DISK_URING_IO *io __attribute__((__unused__)),
+    void *arg __attribute__((__unused__)))
+{
+	return 1;
+}
+
+/* synchronous wrappers, one multi segment write read back in one go */
+static void
+sync_test(ISTGT_LU_DISK *spec)
+{
+	struct iovec iov[NSEGS];
+	uint8_t *buf;
+	int i;
+	int64_t rc;
+
+	for (i = 0; i < NSEGS; i++) {
+		iov[i].iov_len = BLKSZ * (i + 1);
+		iov[i].iov_base = xmalloc(iov[i].iov_len);
+	}
+	buf = xmalloc(BLKSZ * 36);
+	for (i = 0, rc = 0; i < NSEGS; i++) {
+		fill(iov[i].iov_base, iov[i].iov_len, BLKSZ + rc, 1);
+		rc += iov[i].iov_len;
+	}
+	rc = istgt_lu_disk_uring_pwritev(spec, iov, NSEGS, BLKSZ);
+	check(rc == BLKSZ * 36, "pwritev returned %ld errno:%d\n", rc, errno);
+	rc = istgt_lu_disk_uring_pread(spec, buf, BLKSZ * 36, BLKSZ);
+	check(rc == BLKSZ * 36, "pread returned %ld errno:%d\n", rc, errno);
+	check(verify(buf, BLKSZ * 36, BLKSZ, 1) == 0, "sync data mismatch\n");
+	rc = istgt_lu_disk_uring_fsync(spec);
+	check(rc == 0, "fsync returned %ld errno:%d\n", rc, errno);
+
+	/* runs into EOF, the engine retries the rest and fails it */
+	rc = istgt_lu_disk_uring_pread(spec, buf, BLKSZ * 2,
+	    (uint64_t)BLKSZ * (NBLKS - 1));
+	check(rc < 0 && errno == EIO, "read past EOF returned %ld errno:%d\n",
+	    rc, errno);
+
+	for (i = 0; i < NSEGS; i++)
+		xfree(iov[i].iov_base);
+	xfree(buf);
+}
+
+/*
+ * Submit more IOs than the ring holds without waiting for any of them,
+ * the submitter blocks for ring space only, done() comes from the reaper.
+ */
+static void
+async_test(ISTGT_LU_DISK *spec, int opcode, int gen)
+{
+	ISTGT_LU_DISK_URING_IO *ios;
+	uint8_t *data;
+	uint64_t off;
+	int i, n;
+
+	ios = xmalloc(sizeof (*ios) * NASYNC);
+	memset(ios, 0, sizeof (*ios) * NASYNC);
+	data = xmalloc((size_t)BLKSZ * NASYNC);
+	if (opcode == ISTGT_LU_URING_WRITE)
+		fill(data, (size_t)BLKSZ * NASYNC, 0, gen);
+	else
+		memset(data, 0, (size_t)BLKSZ * NASYNC);
+
+	ndone = nfailed = 0;
+	for (i = 0; i < NASYNC; i++) {
+		/* blocks spread over the file, each one written once */
+		off = (uint64_t)((i * 7) % NASYNC) * BLKSZ;
+		ios[i].opcode = opcode;
+		ios[i].iov1.iov_base = data + off;
+		ios[i].iov1.iov_len = BLKSZ;
+		ios[i].iov = &ios[i].iov1;
+		ios[i].iovcnt = 1;
+		ios[i].offset = off;
+		ios[i].nbytes = BLKSZ;
+		ios[i].done = async_done;
+		istgt_lu_disk_uring_prepare(spec, &ios[i]);
+	}
+	n = istgt_lu_disk_uring_foreach(spec, count_io, NULL);
+	check(n == NASYNC, "%d of %d prepared IOs found\n", n, NASYNC);
+	for (i = 0; i < NASYNC; i++)
+		istgt_lu_disk_uring_submit(spec, &ios[i]);
+	wait_done(NASYNC);
+	check(nfailed == 0, "%d of %d async IOs failed\n", nfailed, NASYNC);
+	n = istgt_lu_disk_uring_foreach(spec, count_io, NULL);
+	check(n == 0, "%d IOs left after completion\n", n);
+
+	if (opcode == ISTGT_LU_URING_WRITE) {
+		memset(data, 0, (size_t)BLKSZ * NASYNC);
+		check(pread(spec->fd, data, (size_t)BLKSZ * NASYNC, 0) ==
+		    (ssize_t)BLKSZ * NASYNC, "pread errno:%d\n", errno);
+	}
+	check(verify(data, (size_t)BLKSZ * NASYNC, 0, gen) == 0,
+	    "async %s data mismatch\n",
+	    opcode == ISTGT_LU_URING_WRITE ? "write" : "read");
+	xfree(data);
+	xfree(ios);
+}
+
+static int
+run(const char *path, int directio)
+{
+	ISTGT_LU_DISK spec;
+
+	memset(&spec, 0, sizeof (spec));
+	spec.num = 0;
+	spec.lun = directio;
+	spec.luworkers = 6;
+	spec.writecache = 1;
+	spec.directio = directio;
+	spec.file = path;
+	spec.fd = open(path, O_RDWR);
+	check(spec.fd >= 0, "open %s errno:%d\n", path, errno);
+
+	if (istgt_lu_disk_uring_open(&spec, O_RDWR) != 0) {
+		close(spec.fd);
+		return -1;
+	}
+	sync_test(&spec);
+	async_test(&spec, ISTGT_LU_URING_WRITE, 3);
+	async_test(&spec, ISTGT_LU_URING_READ, 3);
+	istgt_lu_disk_uring_close(&spec);
+	check(spec.uring_ctx == NULL, "engine still set after close\n");
+
+	close(spec.fd);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	char path[] = "/tmp/uring_test.XXXXXX";
+	const char *dir = argc > 1 ? argv[1] : NULL;
+	char *p = path;
+	int fd;
+
+	if (dir != NULL) {
+		p = xmalloc(strlen(dir) + sizeof ("/uring_test.XXXXXX"));
+		sprintf(p, "%s/uring_test.XXXXXX", dir);
+	}
+	fd = mkstemp(p);
+	check(fd >= 0, "mkstemp errno:%d\n", errno);
+	check(ftruncate(fd, (off_t)BLKSZ * NBLKS) == 0, "ftruncate errno:%d\n",
+	    errno);
+	close(fd);
+
+	if (run(p, 0) != 0) {
+		printf("uring_test: io_uring unavailable, skipped\n");
+		unlink(p);
+		return 0;
+	}
+	/* the file system may not do O_DIRECT, the engine falls back then */
+	run(p, 1);
+	unlink(p);
+	printf("uring_test: passed\n");
+	return 0;
+}
@@ -5,7 +5,13 @@ SETUP_ISTGT=$DIR/src/setup_istgt.sh
 REPLICATION_TEST=$DIR/src/replication_test
 TEST_SNAPSHOT=$DIR/test_snapshot.sh
 MEMPOOL_TEST=$DIR/src/mempool_test
+URING_TEST=$DIR/src/uring_test
+TWHEEL_TEST=$DIR/src/twheel_test
 ISTGT_INTEGRATION=$DIR/src/istgt_integration
+ISCSI_SCALE_TEST=$DIR/src/iscsi_scale_test
+ISCSI_ERL_TEST=$DIR/src/iscsi_erl_test
+ISCSI_MCS_TEST=$DIR/src/iscsi_mcs_test
+ISTGT_BENCH=$DIR/src/istgt_bench
 ISCSIADM=iscsiadm
 ISTGTCONTROL=istgtcontrol
 SETUP_PID=-1
@@ -88,6 +94,28 @@ start_replica() {
 	$REPLICATION_TEST $* >> $LOGFILE 2>&1
 }
 
+# start_three_replicas starts the replicas of /tmp/test_vol1..3 on ports
+# 6161..6163 and gives them time to connect.  Its arguments are extra
+# options of the first, second and third replica, "" for none.
+start_three_replicas() {
+	start_replica -i "$CONTROLLER_IP" -p "$CONTROLLER_PORT" -I "127.0.0.1" -P "6161" -V "/tmp/test_vol1" -q $1 &
+	replica1_pid=$!
+	start_replica -i "$CONTROLLER_IP" -p "$CONTROLLER_PORT" -I "127.0.0.1" -P "6162" -V "/tmp/test_vol2" -q $2 &
+	replica2_pid=$!
+	start_replica -i "$CONTROLLER_IP" -p "$CONTROLLER_PORT" -I "127.0.0.1" -P "6163" -V "/tmp/test_vol3" -q $3 &
+	replica3_pid=$!
+	sleep 15
+}
+
+# stop_three_replicas kills the replicas of start_three_replicas, the
+# ones already killed by the test are skipped.
+stop_three_replicas() {
+	pkill -9 -P $replica1_pid
+	pkill -9 -P $replica2_pid
+	pkill -9 -P $replica3_pid
+	kill -SIGKILL $replica1_pid $replica2_pid $replica3_pid 2>/dev/null
+}
+
 stop_istgt() {
 	if [ $SETUP_PID -ne -1 ]; then
 		pkill -9 -P $(list_descendants $SETUP_PID)
@@ -105,6 +133,21 @@ run_mempool_test()
 	return 0
 }
 
+# skips itself when the build or the kernel has no io_uring
+run_uring_test()
+{
+	$URING_TEST
+	[[ $? -ne 0 ]] && echo "uring test failed" && exit 1
+	return 0
+}
+
+run_twheel_test()
+{
+	$TWHEEL_TEST
+	[[ $? -ne 0 ]] && echo "twheel test failed" && exit 1
+	return 0
+}
+
 run_istgt_integration()
 {
 	local pid_istgt=$(sudo lsof -t -i:6060)
@@ -1565,14 +1608,271 @@ run_io_timeout_test()
 	rm -rf ${replica1_vdev::-1}*
 }
 
+# run_data_conns_test connects two replicas that take several data
+# connections and one that only takes the first, and verifies the IOs
+# striped across the connections.
+run_data_conns_test()
+{
+	local cnt=0
+
+	export ReplicaDataConns=4
+	setup_test_env
+
+	start_three_replicas "-c 4" "-c 4" ""
+
+	write_and_verify_data
+
+	cmd="$ISTGTCONTROL -q REPLICA vol1 | jq '.\"volumeStatus\"[0].\"replicaStatus\"[].dataConnections'"
+	cnt=$(eval $cmd | grep -w 4 | wc -l)
+	if [ $cnt -ne 2 ]; then
+		echo "expected 2 replicas with 4 data connections, got $cnt"
+		exit 1
+	fi
+	cnt=$(eval $cmd | grep -w 1 | wc -l)
+	if [ $cnt -ne 1 ]; then
+		echo "expected 1 replica with 1 data connection, got $cnt"
+		exit 1
+	fi
+
+	pkill -9 -P $replica1_pid
+	kill -SIGKILL $replica1_pid
+	sleep 5
+	write_and_verify_data
+
+	stop_three_replicas
+	unset ReplicaDataConns
+	cleanup_test_env
+}
+
+# run_conn_reactor_test serves 250 loopback sessions from two connection
+# reactors, with IOs on each, and verifies the target didn't start
+# threads for them.
+run_conn_reactor_test()
+{
+	local pid_istgt
+
+	ulimit -n 4096
+	export ConnReactors=2
+	setup_test_env
+
+	start_three_replicas
+
+	pid_istgt=$(pidof istgt)
+	$ISCSI_SCALE_TEST -t iqn.2016-09.com.openebs.cstor:vol1 -n 250 -r 20 -w 2 \
+	    -P $pid_istgt -T 100
+	[[ $? -ne 0 ]] && echo "connection reactor test failed" && tail -30 $LOGFILE && exit 1
+
+	stop_three_replicas
+	unset ConnReactors
+	cleanup_test_env
+}
+
+# run_task_queue_test has the LU drive DATA-OUT (MaxR2T 0) through the task
+# queue of the connection, with 16 WRITEs outstanding at once, so that one
+# wakeup of the worker stands for several queued tasks.
+run_task_queue_test()
+{
+	local cnt
+
+	>$LOGFILE
+	export ConnReactors=0
+	sed -i 's/MaxR2T 16/MaxR2T 0/' src/istgt.conf
+	setup_test_env
+
+	start_three_replicas
+
+	timeout 120 $ISCSI_SCALE_TEST -t iqn.2016-09.com.openebs.cstor:vol1 -n 1 -r 1 -w 200 -q 16
+	[[ $? -ne 0 ]] && echo "task queue test failed" && tail -30 $LOGFILE && exit 1
+	cnt=$(grep -c "iscsi_task_transfer_out() failed" $LOGFILE)
+	[[ $cnt -ne 0 ]] && echo "DATA-OUT through the task queue failed" && exit 1
+
+	stop_three_replicas
+	git checkout src/istgt.conf
+	unset ConnReactors
+	cleanup_test_env
+}
+
+# run_status_push_test has two replicas push their status and one refuse
+# to, and checks that the pushing ones turn healthy within a few seconds
+# of their rebuild while the other one still does by being polled.
+run_status_push_test()
+{
+	local cnt
+
+	export ReplicaStatusPush=Yes
+	setup_test_env
+
+	start_three_replicas "" "" "-o"
+
+	## polled replicas need three polls of 10 seconds each to be healthy
+	sleep 10
+	cnt=$(grep -c "doesn't push its status" $LOGFILE)
+	[[ $cnt -lt 1 ]] && echo "replica refusing status push is not polled" && exit 1
+	cnt=$($ISTGTCONTROL -q REPLICA vol1 | jq '."volumeStatus"[0]."replicaStatus"[].Mode' | grep -w Healthy | wc -l)
+	[[ $cnt -lt 1 ]] && echo "no replica turned healthy through status push" && tail -30 $LOGFILE && exit 1
+
+	wait_for_healthy_replicas 3
+
+	stop_three_replicas
+	unset ReplicaStatusPush
+	cleanup_test_env
+}
+
+# run_erl_test raises ErrorRecoveryLevel to 2 and has iscsi_erl_test corrupt
+# data digests and drop its connection, checking that the session recovers
+# through command retry, recovery R2T, SNACK and task reassignment.
+run_erl_test()
+{
+	>$LOGFILE
+	sed -i '/DefaultTime2Retain 20/a\  ErrorRecoveryLevel 2' src/istgt.conf
+	setup_test_env
+
+	start_three_replicas
+
+	timeout 120 $ISCSI_ERL_TEST -t iqn.2016-09.com.openebs.cstor:vol1
+	[[ $? -ne 0 ]] && echo "error recovery test failed" && tail -30 $LOGFILE && exit 1
+
+	stop_three_replicas
+	git checkout src/istgt.conf
+	cleanup_test_env
+}
+
+# run_mcs_test opens one session with four connections, with a thread pair
+# per connection and with the connection reactors, and checks CmdSN order
+# across the connections and that a session logout closes all of them.
+run_mcs_test()
+{
+	local reactors
+
+	for reactors in 0 2; do
+		export ConnReactors=$reactors
+		setup_test_env
+
+		start_three_replicas
+
+		timeout 120 $ISCSI_MCS_TEST -t iqn.2016-09.com.openebs.cstor:vol1 -c 4 -n 500
+		[[ $? -ne 0 ]] && echo "MC/S test failed with ConnReactors=$reactors" && tail -30 $LOGFILE && exit 1
+
+		stop_three_replicas
+		cleanup_test_env
+	done
+	unset ConnReactors
+}
+
+# run_mgmt_shards_test registers a few hundred volumes in one process with
+# mock replicas behind them, and checks that every volume turns healthy and
+# that the periodic replica polls are spread out instead of bunched up.
+run_mgmt_shards_test()
+{
+	local out avg max
+
+	ulimit -n 65536
+	out=$(ReplicaMgmtThreads=4 $ISTGT_BENCH -M -n 200 -f 3 -s 1 -t 10 \
+	    2>>$LOGFILE)
+	[[ $? -ne 0 ]] && echo "mgmt shards test failed" && tail -30 $LOGFILE && exit 1
+	echo "$out"
+
+	avg=$(echo "$out" | jq '.stats_polls_per_sec.avg')
+	max=$(echo "$out" | jq '.stats_polls_per_sec.max')
+	if ! awk -v a="$avg" -v m="$max" 'BEGIN { exit !(a > 0 && m <= 2 * a) }'; then
+		echo "replica stats polls are bunched up (avg $avg max $max)"
+		exit 1
+	fi
+}
+
+# run_group_sync_test issues concurrent flushes mixed with writes against
+# mock replicas, and checks that flushes share syncs to the replicas and that
+# none of them is acked before the writes acked ahead of it are flushed.
+run_group_sync_test()
+{
+	local out flushes syncs
+
+	out=$($ISTGT_BENCH -q 32 -r 0 -F 30 -f 3 -c 2 -t 5 2>>$LOGFILE)
+	[[ $? -ne 0 ]] && echo "group sync test failed" && echo "$out" && tail -30 $LOGFILE && exit 1
+	echo "$out"
+
+	flushes=$(echo "$out" | jq '.flushes')
+	syncs=$(echo "$out" | jq '.syncs_sent')
+	if [ "$flushes" -eq 0 ] || [ "$syncs" -ge "$flushes" ]; then
+		echo "flushes were not coalesced ($flushes flushes, $syncs syncs)"
+		exit 1
+	fi
+}
+
+# run_pr_persist_test registers and reserves through the iSCSI device,
+# restarts the target and the replicas on the same volume files, and
+# verifies the reservation is read back from the replicas.  Replicas that
+# never answer for their reservations hold the volume up for a few
+# seconds only, it then comes up without any.
+run_pr_persist_test()
+{
+	local device_name
+	local pass
+	local from
+
+	export ReplicaPersistPR=Yes
+	setup_test_env
+
+	for pass in 1 2; do
+		start_three_replicas
+
+		login_to_volume "$CONTROLLER_IP:3260"
+		sleep 5
+		device_name=$(get_scsi_disk)
+		if [ $pass -eq 1 ]; then
+			sg_persist --out --register --param-sark=0xabc /dev/$device_name
+			[[ $? -ne 0 ]] && echo "PR register failed" && tail -20 $LOGFILE && exit 1
+			sg_persist --out --reserve --param-rk=0xabc --prout-type=1 /dev/$device_name
+			[[ $? -ne 0 ]] && echo "PR reserve failed" && tail -20 $LOGFILE && exit 1
+		else
+			sg_persist --in --read-reservation /dev/$device_name | grep -q "Key=0xabc"
+			[[ $? -ne 0 ]] && echo "reservation lost across restart" && tail -20 $LOGFILE && exit 1
+			sg_persist --in --read-keys /dev/$device_name | grep -q "0xabc"
+			[[ $? -ne 0 ]] && echo "registration lost across restart" && tail -20 $LOGFILE && exit 1
+		fi
+		logout_of_volume
+
+		stop_three_replicas
+		if [ $pass -eq 1 ]; then
+			stop_istgt
+			start_istgt 5G
+		fi
+	done
+
+	from=$(($(wc -l < $LOGFILE) + 1))
+	stop_istgt
+	start_istgt 5G
+	start_three_replicas "-x" "-x" "-x"
+
+	tail -n +$from $LOGFILE | grep -q "starting without reservations"
+	[[ $? -ne 0 ]] && echo "PR restore from silent replicas not given up" && tail -20 $LOGFILE && exit 1
+	tail -n +$from $LOGFILE | grep -q "is ready for IOs now"
+	[[ $? -ne 0 ]] && echo "volume not ready without reservations" && tail -20 $LOGFILE && exit 1
+
+	stop_three_replicas
+	unset ReplicaPersistPR
+	cleanup_test_env
+}
+
 run_lu_rf_test
 run_quorum_test
 data_integrity_with_unknown_replica
 run_non_quorum_replica_errored_test
 run_data_integrity_test
 run_mempool_test
+run_uring_test
+run_twheel_test
 run_istgt_integration
 run_read_consistency_test
+run_data_conns_test
+run_conn_reactor_test
+run_task_queue_test
+run_mgmt_shards_test
+run_group_sync_test
+run_status_push_test
+run_erl_test
+run_mcs_test
+run_pr_persist_test
 run_replication_factor_test
 run_io_timeout_test
 run_test_env